@@ -1,13 +1,37 @@
 #ifndef _STDARG_H
 #define _STDARG_H
 
+#if defined(__ELF__) && defined(__x86_64__)
+/* va_start points ap at the SysV block it fills in the frame, and
+   va_arg takes each value from the register save area or the stack */
+struct __va_block {
+  unsigned int gp_offset;
+  unsigned int fp_offset;
+  void *overflow_arg_area;
+  void *reg_save_area;
+};
+typedef struct __va_block *va_list;
+#elif defined(__ELF__)
+/* va_start points ap at the AAPCS64 block it fills in the frame, and
+   va_arg takes each value from the register save areas or the stack */
+struct __va_block {
+  void *__stack;
+  void *__gr_top;
+  void *__vr_top;
+  int __gr_offs;
+  int __vr_offs;
+};
+typedef struct __va_block *va_list;
+#else
+/* Mach-O passes every variadic argument in its own 8-byte stack slot */
 typedef char *va_list;
+#endif
+
+#define va_arg(ap, type) __builtin_va_arg(ap, type)
 
 void __builtin_va_start(va_list *ap);
 #define va_start(ap, ...) __builtin_va_start(&(ap))
 
-#define va_arg(ap, type) (*(type*)((ap += 8) - 8))
-
 #define va_end(ap) ((void)0)
 #define va_copy(dest, src) ((dest) = (src))
 
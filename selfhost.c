@@ -11,6 +11,8 @@
 #include <stdlib.h>
 #include <string.h>
 #ifdef __STDC__
+#include <time.h>
+#include <sys/resource.h>
 static inline int __read_byte(void *p, int i) { return ((unsigned char*)p)[i]; }
 static inline void __write_byte(void *p, int i, int v) { ((unsigned char*)p)[i] = v; }
 #else
@@ -20,10 +22,24 @@ int fgetc(int *f);
 int fclose(int *f);
 int fputc(int c, int *f);
 int fflush(int *f);
+int *fdopen(int fd, int *mode);
+int fprintf(int *f, int *fmt, ...);
 int *malloc(int size);
 int *realloc(int *ptr, int size);
 int exit(int code);
 int system(int *cmd);
+int fwrite(int *ptr, int size, int n, int *f);
+int fread(int *ptr, int size, int n, int *f);
+int fseek(int *f, int off, int whence);
+int ftell(int *f);
+int free(int *p);
+int clock_gettime(int clk, long *ts);
+int getrusage(int who, long *ru);
+#ifdef __linux__
+enum { CLOCK_MONOTONIC = 1 };
+#else
+enum { CLOCK_MONOTONIC = 6 };
+#endif
 #endif
 
 // ---- Constants ----
@@ -33,11 +49,42 @@ enum { ND_NUM, ND_VAR, ND_STRLIT, ND_CALL, ND_UNARY, ND_BINARY,
        ND_TERNARY, ND_INITLIST, ND_COMPOUND_LIT, ND_CAST, ND_STMT_EXPR, ND_LABEL_ADDR };
 enum { ST_RETURN, ST_IF, ST_WHILE, ST_FOR, ST_BREAK, ST_CONTINUE,
        ST_EXPR, ST_VARDECL, ST_DOWHILE, ST_GOTO, ST_LABEL, ST_SWITCH, ST_BLOCK, ST_COMPUTED_GOTO };
+enum { IR_IMM, IR_MOV, IR_ADD, IR_SUB, IR_MUL, IR_DIV, IR_REM, IR_AND, IR_OR, IR_XOR,
+       IR_SHL, IR_SHR, IR_NEG, IR_NOT, IR_EXT, IR_SET, IR_LOAD, IR_STORE, IR_ADDR, IR_FRAME,
+       IR_CALL, IR_PARAM, IR_LABEL, IR_JMP, IR_BR, IR_BZ, IR_BNZ, IR_RET, IR_SWITCH, IR_NOP };
+enum { IR_CC_EQ, IR_CC_NE, IR_CC_LT, IR_CC_LE, IR_CC_GT, IR_CC_GE,
+       IR_CC_LO, IR_CC_LS, IR_CC_HI, IR_CC_HS };
+// Integrated assembler: operand kinds, register kinds, shifts/extends,
+// relocation modifiers, fixup kinds and instruction encoding classes
+enum { OPK_REG, OPK_IMM, OPK_FIMM, OPK_SHIFT, OPK_MEM, OPK_SYM };
+enum { RK_X, RK_W, RK_D, RK_S, RK_H, RK_B, RK_Q, RK_V };
+enum { SH_LSL, SH_LSR, SH_ASR, SH_ROR, SH_UXTB, SH_UXTH, SH_UXTW, SH_UXTX,
+       SH_SXTB, SH_SXTH, SH_SXTW, SH_SXTX };
+enum { AM_NONE, AM_PAGE, AM_PAGEOFF, AM_GOTPAGE, AM_GOTPAGEOFF };
+enum { FX_B26, FX_B19, FX_B14, FX_PAGE, FX_PAGEOFF, FX_GOTPAGE, FX_GOTPAGEOFF, FX_DATA };
+enum { AC_ADDSUB, AC_CMP, AC_NEG, AC_LOGIC, AC_TST, AC_MVN, AC_MOV, AC_MOVW, AC_SHIFT,
+       AC_EXTEND, AC_DP1, AC_DP2, AC_MUL, AC_MADD, AC_CSEL, AC_CSET, AC_CINC, AC_LDST,
+       AC_LDP, AC_B, AC_BCOND, AC_CB, AC_TB, AC_BR, AC_ADRP, AC_NOP, AC_FMOV, AC_FCVTI,
+       AC_FCVT, AC_FP1, AC_FP2, AC_FCMP, AC_SIMD };
+// x86-64 lowering: hardware register numbers
+enum { XR_AX, XR_CX, XR_DX, XR_BX, XR_SP, XR_BP, XR_SI, XR_DI,
+       XR_R8, XR_R9, XR_R10, XR_R11, XR_R12, XR_R13, XR_R14, XR_R15 };
 
 // Capacity constants
 enum {
     MAX_TOKENS       = 1048576,  // tok_kind, tok_val, tok_pos
+    MAX_AS_FIXUPS    = 1048576,  // as_fx_*, as_rl_*
+    MAX_AS_SYMS      = 262144,   // as_sym_*
+    MAX_AS_BUCKETS   = 65536,    // as_sym_head
+    MAX_ATOMS        = 262144,   // atom_name, atom_kw, atom_next
+    MAX_ATOM_BUCKETS = 65536,    // atom_head
+    MAX_ARENA_CHUNKS = 65536,    // ar_chunk, ar_big (per arena)
+    MAX_IR           = 65536,    // ir_op, ir_dst, etc. (one function)
+    MAX_IR_VREGS     = 32768,    // ir_ndef, ir_preg, etc.
+    MAX_IR_LABELS    = 16384,    // ir_label_str, etc.
+    MAX_PEEP_LINES   = 65536,    // peep_start, peep_op, etc. (one function)
     MAX_STRINGS      = 65536,    // sp_decoded, sp_label
+    MAX_JT_ENTRIES   = 65536,    // jt_entry
     MAX_CG_GLOBALS   = 65536,    // cg_gnames, cg_gis_array, etc.
     MAX_ENUMS        = 65536,    // ec_table
     MAX_MACRO_BUCKETS = 65536,   // macro_ht_head
@@ -49,16 +96,28 @@ enum {
     MAX_STRUCTS      = 4096,     // cg_s*, p_sdefs, inline_sdefs
     MAX_TYPEDEFS     = 4096,     // td_name, td_stype, etc.
     MAX_STATIC_LOCALS = 4096,    // sl_names, sl_labels, etc.
+    MAX_JUMP_TABLES  = 4096,     // jt_label, jt_first, jt_count
     MAX_FUNC_INFO    = 4096,     // struct_ret, float_ret, barechar, variadic
+    MAX_HEADERS      = 4096,     // pp_hdr_*, pp_inc_path
     MAX_LOCAL_VARS   = 512,      // lv_name, lv_stype, etc.
+    MAX_FOLD_CONSTS  = 512,      // fold_cname, fold_cval (one function)
+    MAX_INLINE_NAMES = 256,      // inl_from, inl_to, inl_written (one callee)
+    MAX_AS_MNEMONICS = 256,      // as_mn_*
     MAX_LAYOUT       = 512,      // lay_name, lay_off, lay_char_name, etc.
     MAX_LAYOUT_ARR   = 256,      // lay_arr_name, lay_sv_name, lay_psv_name
+    MAX_FIELD_ROWS   = 256,      // fld_row_* (2D array fields)
     MAX_LOOP_STACK   = 64,       // loop_brk, loop_cont
+    MAX_AS_SECTS     = 32,       // as_sec_*
+    MAX_TMP_REGS     = 4,        // x12-x15 expression temporaries
+    MAX_VAR_REGS     = 10,       // x19-x28 register locals
+    MAX_PP_DEPTH     = 1024,     // pp_lv_* (macro expansions being rescanned)
     MAX_IF_STACK     = 32        // if_stack_*
 };
 
 
 // ---- Structs ----
+struct ExprType;
+
 struct Expr {
   int kind;
   long ival;
@@ -69,6 +128,7 @@ struct Expr {
   struct Expr **args;
   int nargs;
   int *desig;
+  struct ExprType *ty; // codegen's cached type answers, see ty_of
 };
 
 struct VarDecl {
@@ -84,6 +144,7 @@ struct VarDecl {
   int is_float;
   int is_short;
   int is_long;
+  int is_const;
 };
 
 struct Stmt {
@@ -126,6 +187,7 @@ struct FuncDef {
   int *param_is_float;
   int ret_is_float;
   int is_static;
+  int inline_hint;  // p_inline_hint when the function was parsed
 };
 
 struct SDef {
@@ -207,6 +269,9 @@ struct Program {
 int *outbuf;
 int outlen;
 int outcap;
+// Line ends of the current function, for the peephole pass
+int peep_line_end[MAX_PEEP_LINES];
+int npeep_line_end;
 
 // Ptr-returning function names (for sxtw after bl)
 int *ptr_ret_names[MAX_RET_FUNCS];
@@ -230,11 +295,34 @@ int *sp_decoded[MAX_STRINGS];
 int *sp_label[MAX_STRINGS];
 int nsp;
 
+// Switch jump tables (emitted after the string pool)
+int *jt_label[MAX_JUMP_TABLES];
+int jt_first[MAX_JUMP_TABLES];
+int jt_count[MAX_JUMP_TABLES];
+int njt;
+int *jt_entry[MAX_JT_ENTRIES];
+int njt_entry;
+
 // Loop stack
 int *loop_brk[MAX_LOOP_STACK];
 int *loop_cont[MAX_LOOP_STACK];
 int nloop;
 
+// Expression temporaries: a register stack over x12..x15, spilling to the
+// machine stack when deeper. Temps below cg_tmp_base were saved by a call.
+int cg_tmp_depth;
+int cg_tmp_base;
+
+// Name indexes: open-addressing hash from atom id to the entries of one
+// table with that name, oldest first, chained through next[]
+struct NameIndex {
+  int *ids;    // atom id in each slot, 0 if the slot is empty
+  int *first;  // oldest entry with that name
+  int *last;   // newest entry with that name
+  int *next;   // per entry: the next newer entry with the same name, or -1
+  int cap;     // slots, a power of two
+};
+
 // Global variable names for codegen
 struct CGlobal {
   int *name;
@@ -251,11 +339,13 @@ struct CGlobal {
 };
 struct CGlobal cgg[MAX_CG_GLOBALS];
 int ncg_g;
+struct NameIndex *cgg_ix;
 int cgg_var_bsz[MAX_CG_GLOBALS];
 int cgg_is_unsigned[MAX_CG_GLOBALS];
 
 // Struct/union defs for codegen
 int *cg_sname[MAX_STRUCTS];
+struct NameIndex *cg_s_ix;
 int **cg_sfields[MAX_STRUCTS];
 int **cg_sfield_types[MAX_STRUCTS];
 int cg_snfields[MAX_STRUCTS];
@@ -275,11 +365,69 @@ int *cg_s_fbyteoff[MAX_STRUCTS];  // per-field byte offset (proper layout)
 int *cg_s_fbytesize[MAX_STRUCTS]; // per-field byte size (proper layout)
 int cg_s_bytesize[MAX_STRUCTS];   // total struct byte size (proper layout)
 int cg_s_max_align[MAX_STRUCTS];  // max field alignment (for embedded struct alignment)
+struct NameIndex *cg_s_fix[MAX_STRUCTS]; // field name -> field number
+int *cg_s_fslot[MAX_STRUCTS];     // first flattened slot of each field, built on first use
+int *cg_s_ca_len[MAX_STRUCTS];    // per slot: length of the char array packed there, or 0
+int *cg_s_ca_off[MAX_STRUCTS];    // per slot: its byte offset within that char array
 int ncg_s;
 
+// 2D array fields: elements per row of sname.fname (field_is_array holds the flattened count)
+int *fld_row_sname[MAX_FIELD_ROWS];
+int *fld_row_fname[MAX_FIELD_ROWS];
+int fld_row_len[MAX_FIELD_ROWS];
+int nfld_row;
+
 // Proper struct layout flag
 int use_proper_layout = 1;
 
+// Generate function bodies through the IR (-fno-ir keeps the AST emitter)
+int use_ir = 1;
+
+// Assembly peephole pass (-fno-peephole); -fpeephole-report prints its counts
+int use_peephole = 1;
+int peep_report = 0;
+
+// Per-phase reports: -ftime-report for wall time and the slowest functions,
+// -fmem-report for allocation, peak RSS and sizes
+int time_report = 0;
+int mem_report = 0;
+
+// Fold constant expressions and const locals before codegen (-fno-fold)
+int use_fold = 1;
+
+// Inline small static and inline functions at their call sites (-fno-inline)
+int use_inline = 1;
+
+// Frames: leaf functions drop the x30 save, or the whole frame when they
+// never touch it; 1 with -fomit-frame-pointer addresses slots through sp,
+// -1 with -fno-omit-frame-pointer keeps the full frame everywhere
+int use_omit_fp = 0;
+
+// Assemble and write the object file in-process (-fno-integrated-as runs
+// clang on the .s instead); -c stops at the object file
+int use_integrated_as = 1;
+int compile_only = 0;
+
+// Object format conventions: Mach-O by default, ELF/GAS with
+// -target aarch64-linux-gnu
+int target_elf = 0;
+int *sym_pfx = "_";          // prefix on C symbol names
+int *lab_pfx = "L_";         // assembler-local labels
+int *str_pfx = "l_.str_";    // string literal labels
+int *cc_driver = "clang ";   // assembles and links what we emit
+
+// -target x86_64-linux-gnu: code is generated as for AArch64 ELF and then
+// rewritten by x86_lower(). The settings below keep the AArch64 code within
+// what maps onto x86-64 registers and the SysV calling convention: six
+// integer argument registers, five callee-saved ones, and no x30 since call
+// and ret keep the return address on the stack.
+int target_x86 = 0;
+int arg_regs = 8;            // integer arguments passed in registers
+int var_regs = MAX_VAR_REGS; // callee-saved registers from x19 up
+int va_spill_regs = 8;       // registers a variadic function spills
+int va_area_gap = 16;        // bytes from x29 up to a variadic save area
+int frame_reserve = 0;       // frame bytes below x29 kept from the layout
+
 // Token arrays
 struct Token {
   int kind;
@@ -294,6 +442,7 @@ int cur_pos;
 
 // Parser struct defs (with field type info)
 struct SDefInfo *p_sdefs[MAX_STRUCTS];
+struct NameIndex *sdef_ix;
 int np_sdefs;
 
 // Local variable table (reset per function)
@@ -306,6 +455,7 @@ struct LocalVar {
 };
 struct LocalVar lv[MAX_LOCAL_VARS];
 int nlv;
+struct NameIndex *lv_ix;
 
 // Global variable struct type table (persistent across functions)
 struct GlobalVar {
@@ -317,6 +467,7 @@ struct GlobalVar {
 };
 struct GlobalVar glv[MAX_GLV];
 int nglv;
+struct NameIndex *glv_ix;
 int lv_is_long[MAX_LOCAL_VARS];
 int lv_is_short[MAX_LOCAL_VARS];
 int glv_is_long[MAX_GLV];
@@ -327,6 +478,7 @@ int *lay_name[MAX_LAYOUT];
 int lay_off[MAX_LAYOUT];
 int lay_var_bsz[MAX_LAYOUT];
 int nlay;
+struct NameIndex *lay_ix;
 int *lay_arr_name[MAX_LAYOUT_ARR];
 int lay_arr_count[MAX_LAYOUT_ARR];
 int lay_arr_inner[MAX_LAYOUT_ARR];
@@ -357,6 +509,12 @@ int nlay_barechar;
 int *lay_long_name[MAX_LAYOUT];
 int nlay_long;
 int lay_stack_size;
+int lay_locals_size;           // frame bytes used by slots, before the save area
+int lay_reg[MAX_LAYOUT];       // callee-saved register (19..28) holding the slot, or 0
+int lay_reg_uses[MAX_LAYOUT];  // loop-weighted use count; -1 if address is taken
+int lay_nsave;                 // number of x19.. registers this function saves
+int lay_save_off;              // save area starts at [x29, #-lay_save_off]
+int lay_reg_ok;                // 0 when the function calls setjmp-like routines
 
 // Float-returning function names
 int *float_ret_names[MAX_FUNC_INFO];
@@ -369,6 +527,7 @@ struct EnumConst {
 };
 struct EnumConst ec_table[MAX_ENUMS];
 int nec;
+struct NameIndex *ec_ix;
 
 // Typedef table
 struct TypeDef {
@@ -380,6 +539,7 @@ struct TypeDef {
 };
 struct TypeDef td[MAX_TYPEDEFS];
 int ntd;
+struct NameIndex *td_ix;
 int td_is_long[MAX_TYPEDEFS];
 int td_is_short[MAX_TYPEDEFS];
 int td_is_unsigned[MAX_TYPEDEFS];
@@ -389,6 +549,11 @@ int td_is_ptr[MAX_TYPEDEFS];
 int *cg_cur_func_name;
 int *cg_cur_func_ret_stype;
 int cg_cur_func_ret_is_float;
+// Variadic function on ELF: the prologue spills the argument registers
+// just below the caller's stack arguments, see cg_va_area
+int cg_va_save;
+int cg_va_ngr;     // named arguments in general registers
+int cg_va_nvr;     // and in floating-point ones
 
 // Compound literal counters
 int cg_cl_counter;
@@ -436,13 +601,30 @@ int if_depth;
 // Include depth tracking
 int include_depth;
 
+// Headers read in this compile, by resolved path. Each file is read once;
+// a later #include of it is dropped without reading when its guard macro
+// is defined or it said #pragma once.
+int *pp_hdr_path[MAX_HEADERS];
+int *pp_hdr_src[MAX_HEADERS];
+int pp_hdr_len[MAX_HEADERS];
+int *pp_hdr_guard[MAX_HEADERS];  // X of an "#ifndef X ... #endif" around the whole file, or 0
+int pp_hdr_once[MAX_HEADERS];
+int pp_nhdr;
+struct NameIndex *pp_hdr_ix;
+// Resolved #include lookups: "dir/name" for "name", "</name" for <name>
+int *pp_inc_path[MAX_HEADERS];   // the file found, or 0
+int pp_ninc;
+struct NameIndex *pp_inc_ix;
+
 // Known function names (for function pointer support)
 int *known_funcs[MAX_KNOWN_FUNCS];
 int nknown_funcs;
+struct NameIndex *known_ix;
 
 // Defined function names (functions with bodies, not just prototypes)
 int *defined_funcs[MAX_KNOWN_FUNCS];
 int ndefined_funcs;
+struct NameIndex *defined_ix;
 
 // Bare char parameter tracking (side table indexed by function)
 int *barechar_func_names[MAX_FUNC_INFO];
@@ -473,6 +655,9 @@ int nsl;
 extern int *include_dirs[64];
 extern int ninclude_dirs;
 int skip_attribute();
+int is_digit(int c);
+int is_alpha(int c);
+int is_alnum(int c);
 int parse_const_expr();
 struct Expr *parse_expr(int min_prec);
 struct Expr *parse_unary();
@@ -480,8 +665,32 @@ struct Expr *parse_primary();
 int parse_enum_def();
 int parse_const_unary();
 int lay_walk_stmts(struct Stmt **stmts, int nstmts, int *offset);
+int lay_reg_walk_stmts(struct Stmt **stmts, int nstmts, int w);
+int lay_index(int *name);
+struct Expr *fold_expr(struct Expr *e);
+int inl_check_stmts(struct Stmt **stmts, int n);
+struct Expr *inl_clone_expr(struct Expr *e);
+struct Stmt *inl_clone_stmt(struct Stmt *st);
+struct Stmt **inl_clone_stmts(struct Stmt **stmts, int n);
+int inl_stmt(struct Stmt *st);
+int inl_stmts(struct Stmt **stmts, int n);
+int inl_scan_stmts(struct Stmt **stmts, int n);
+int cg_stmts_call(struct Stmt **stmts, int n);
+int out_flush();
+int x86_frame_regs_used(int body);
+int ir_emit_reg(int r, int w);
+int ir_emit_imm(int r, long val);
 int gen_value(struct Expr *e);
 int gen_stmt(struct Stmt *st, int *ret_label);
+int gen_val_call_site(struct Expr *e, int *name);
+int gen_cond(struct Expr *e, int *label, int jump_if);
+int cg_const_offset(struct Expr *idx, int stride, long *off);
+int cg_cmp_imm(int *w, long k);
+int *ir_load_mn(int size, int sgn, int unscaled);
+int cg_index_load_bsz(struct Expr *e, int *is_unsigned);
+int ir_cc_of(int *op, int is_unsigned);
+int ir_cc_invert(int cc);
+int *ir_cc_name(int cc);
 #endif
 
 // ---- Utility functions ----
@@ -494,18 +703,260 @@ int my_fatal(int *msg) {
 
 int total_alloc;
 int n_allocs;
-int *my_malloc(int size) {
+
+int *sys_malloc(int size) {
   int *p = malloc(size);
   if (p == 0) {
     printf("cc: OOM at alloc #%d, total=%d, requested=%d\n", n_allocs, total_alloc, size);
     fflush(0);
     my_fatal("out of memory");
   }
+  return p;
+}
+
+// ---- Arenas ----
+// my_malloc carves memory out of the current arena, a list of 1 MB chunks
+// filled front to back; requests over 256 KB get a chunk of their own.
+// Nothing is freed one allocation at a time. AR_PERM lives for the whole
+// compile, AR_PP holds source text and preprocessor buffers until the
+// lexer is done, and AR_FUNC holds one function's codegen scratch and is
+// reset after each function.
+enum { AR_PERM, AR_PP, AR_FUNC, N_ARENAS };
+enum { AR_CHUNK = 1048576, AR_BIG = 262144 };
+int *ar_chunk[N_ARENAS * MAX_ARENA_CHUNKS];
+int ar_nchunk[N_ARENAS];  // chunks owned
+int ar_k[N_ARENAS];       // chunks in use; the last of them is being filled
+int ar_used[N_ARENAS];    // bytes used in that chunk
+int *ar_big[N_ARENAS * MAX_ARENA_CHUNKS];
+int ar_nbig[N_ARENAS];
+int ar_cur;               // the arena my_malloc uses
+
+int *arena_alloc(int a, int size) {
+  size = (size + 7) & (0 - 8);
+  if (size > AR_BIG) {
+    if (ar_nbig[a] >= MAX_ARENA_CHUNKS) { my_fatal("too many large allocations"); }
+    int *big = sys_malloc(size);
+    ar_big[a * MAX_ARENA_CHUNKS + ar_nbig[a]] = big;
+    ar_nbig[a]++;
+    return big;
+  }
+  if (ar_k[a] == 0 || ar_used[a] + size > AR_CHUNK) {
+    if (ar_k[a] == ar_nchunk[a]) {
+      if (ar_nchunk[a] >= MAX_ARENA_CHUNKS) { my_fatal("out of arena chunks"); }
+      ar_chunk[a * MAX_ARENA_CHUNKS + ar_nchunk[a]] = sys_malloc(AR_CHUNK);
+      ar_nchunk[a]++;
+    }
+    ar_k[a]++;
+    ar_used[a] = 0;
+  }
+  int *c = ar_chunk[a * MAX_ARENA_CHUNKS + ar_k[a] - 1];
+  int *p = c + ar_used[a] / sizeof(int);
+  ar_used[a] = ar_used[a] + size;
+  return p;
+}
+
+// Make a the arena for my_malloc; returns the previous one
+int arena_use(int a) {
+  int prev = ar_cur;
+  ar_cur = a;
+  return prev;
+}
+
+// Drop everything allocated in a. Its chunks are kept for reuse unless
+// give_back is set, when they go back to the C library.
+int arena_reset(int a, int give_back) {
+  for (int i = 0; i < ar_nbig[a]; i++) { free(ar_big[a * MAX_ARENA_CHUNKS + i]); }
+  ar_nbig[a] = 0;
+  ar_k[a] = 0;
+  ar_used[a] = 0;
+  if (give_back) {
+    for (int i = 0; i < ar_nchunk[a]; i++) { free(ar_chunk[a * MAX_ARENA_CHUNKS + i]); }
+    ar_nchunk[a] = 0;
+  }
+  return 0;
+}
+
+int *my_malloc(int size) {
   total_alloc = total_alloc + size;
   n_allocs++;
+  return arena_alloc(ar_cur, size);
+}
+
+// my_malloc from AR_PERM, for tables that outlive the current phase
+int *perm_malloc(int size) {
+  int prev = arena_use(AR_PERM);
+  int *p = my_malloc(size);
+  arena_use(prev);
   return p;
 }
 
+// ---- Phase report ----
+// main calls rep_phase() as each phase ends, which records the time and
+// allocation since the previous call; codegen keeps the slowest functions.
+// rep_print() writes the table for -ftime-report and -fmem-report to
+// stderr, so that it does not mix with what the compiler prints.
+enum { MAX_REP_PHASES = 16, REP_TOP_FUNCS = 10 };
+int *rep_name[MAX_REP_PHASES];
+int rep_us[MAX_REP_PHASES];      // wall time
+int rep_bytes[MAX_REP_PHASES];   // my_malloc bytes
+int rep_allocs[MAX_REP_PHASES];  // my_malloc calls
+int rep_rss[MAX_REP_PHASES];     // peak RSS in KB when the phase ended
+int rep_nphase;
+int rep_mark_us;
+int rep_mark_bytes;
+int rep_mark_allocs;
+int *rep_fname[REP_TOP_FUNCS];   // slowest functions first
+int rep_fus[REP_TOP_FUNCS];
+int rep_nfunc;
+int rep_fstart;
+int *rep_out;    // stderr while printing
+long rep_base_sec;
+long rep_ts[2];                  // struct timespec
+long rep_ru[18];                 // struct rusage
+int n_ast_nodes;                 // Expr and Stmt nodes made by the parser
+int n_out_bytes;                 // assembly text written
+
+// Microseconds since the first call, on a clock that never steps back
+int rep_now_us() {
+  clock_gettime(CLOCK_MONOTONIC, (void *)rep_ts);
+  if (rep_base_sec == 0) { rep_base_sec = rep_ts[0]; }
+  return (rep_ts[0] - rep_base_sec) * 1000000 + rep_ts[1] / 1000;
+}
+
+// Peak resident set size so far, in KB
+int rep_peak_rss() {
+  getrusage(0, (void *)rep_ru);  // 0 = RUSAGE_SELF; ru_maxrss follows two timevals
+#ifdef __linux__
+  return rep_ru[4];
+#else
+  return rep_ru[4] / 1024;
+#endif
+}
+
+int rep_start() {
+  if (time_report == 0 && mem_report == 0) return 0;
+  rep_mark_us = rep_now_us();
+  rep_mark_bytes = total_alloc;
+  rep_mark_allocs = n_allocs;
+  return 0;
+}
+
+int rep_phase(int *name) {
+  if (time_report == 0 && mem_report == 0) return 0;
+  if (rep_nphase >= MAX_REP_PHASES) return 0;
+  int now = rep_now_us();
+  rep_name[rep_nphase] = name;
+  rep_us[rep_nphase] = now - rep_mark_us;
+  rep_bytes[rep_nphase] = total_alloc - rep_mark_bytes;
+  rep_allocs[rep_nphase] = n_allocs - rep_mark_allocs;
+  rep_rss[rep_nphase] = rep_peak_rss();
+  rep_nphase++;
+  rep_mark_us = now;
+  rep_mark_bytes = total_alloc;
+  rep_mark_allocs = n_allocs;
+  return 0;
+}
+
+int rep_func_begin() {
+  if (time_report) { rep_fstart = rep_now_us(); }
+  return 0;
+}
+
+// Keep name among the slowest REP_TOP_FUNCS functions
+int rep_func_end(int *name) {
+  if (time_report == 0) return 0;
+  int us = rep_now_us() - rep_fstart;
+  int i = rep_nfunc;
+  if (i == REP_TOP_FUNCS) {
+    if (us <= rep_fus[i - 1]) return 0;
+    i--;
+  } else {
+    rep_nfunc++;
+  }
+  while (i > 0 && rep_fus[i - 1] < us) {
+    rep_fname[i] = rep_fname[i - 1];
+    rep_fus[i] = rep_fus[i - 1];
+    i--;
+  }
+  rep_fname[i] = name;
+  rep_fus[i] = us;
+  return 0;
+}
+
+// Microseconds as milliseconds with three decimals
+int rep_print_ms(int us) {
+  fprintf(rep_out, "%6d.%03d ms", us / 1000, us % 1000);
+  return 0;
+}
+
+int rep_print() {
+  if (time_report == 0 && mem_report == 0) return 0;
+  int total_us = 0;
+  rep_out = fdopen(2, "w");
+  fprintf(rep_out, "%-16s", "phase");
+  if (time_report) { fprintf(rep_out, "  %13s", "wall"); }
+  if (mem_report) { fprintf(rep_out, "  %12s  %9s  %12s", "allocated", "allocs", "peak RSS"); }
+  fprintf(rep_out, "\n");
+  for (int i = 0; i < rep_nphase; i++) {
+    fprintf(rep_out, "%-16s", rep_name[i]);
+    if (time_report) { fprintf(rep_out, "  "); rep_print_ms(rep_us[i]); }
+    if (mem_report) { fprintf(rep_out, "  %12d  %9d  %9d KB", rep_bytes[i], rep_allocs[i], rep_rss[i]); }
+    fprintf(rep_out, "\n");
+    total_us = total_us + rep_us[i];
+  }
+  fprintf(rep_out, "%-16s", "total");
+  if (time_report) { fprintf(rep_out, "  "); rep_print_ms(total_us); }
+  if (mem_report) { fprintf(rep_out, "  %12d  %9d  %9d KB", total_alloc, n_allocs, rep_peak_rss()); }
+  fprintf(rep_out, "\n");
+  if (mem_report) {
+    fprintf(rep_out, "tokens %d, AST nodes %d, assembly %d bytes\n", ntokens, n_ast_nodes, n_out_bytes);
+  }
+  if (time_report && rep_nfunc > 0) {
+    fprintf(rep_out, "slowest functions in codegen:\n");
+    for (int i = 0; i < rep_nfunc; i++) {
+      fprintf(rep_out, "  "); rep_print_ms(rep_fus[i]); fprintf(rep_out, "  %s\n", rep_fname[i]);
+    }
+  }
+  fflush(rep_out);
+  return 0;
+}
+
+// Read the whole file at path into a buffer of its size plus a NUL, with
+// one fread when the size is known up front. Returns 0 if it cannot be
+// opened; the length goes to *out_len.
+int *read_file(int *path, int *out_len) {
+  int *f = fopen(path, "r");
+  if (f == 0) return 0;
+  int len = 0 - 1;
+  if (fseek(f, 0, 2) == 0) { len = ftell(f); }  // 2 = SEEK_END
+  int *buf = 0;
+  if (len >= 0 && fseek(f, 0, 0) == 0) {
+    buf = my_malloc(len + 1);
+    len = fread(buf, 1, len, f);
+  } else {
+    // Not seekable: read byte by byte into a growing buffer
+    int cap = 65536;
+    buf = my_malloc(cap + 1);
+    len = 0;
+    int ch = fgetc(f);
+    while (ch != 0 - 1) {
+      if (len >= cap) {
+        cap = cap * 2;
+        int *nb = my_malloc(cap + 1);
+        for (int i = 0; i < len; i++) { __write_byte(nb, i, __read_byte(buf, i)); }
+        buf = nb;
+      }
+      __write_byte(buf, len, ch);
+      len++;
+      ch = fgetc(f);
+    }
+  }
+  __write_byte(buf, len, 0);
+  fclose(f);
+  *out_len = len;
+  return buf;
+}
+
 int *my_strdup(int *s) {
   int len = strlen(s);
   int *p = my_malloc(len + 1);
@@ -516,7 +967,8 @@ int *my_strdup(int *s) {
 }
 
 int my_strcmp(int *a, int *b) {
-  if (a == 0 || b == 0) return (a != b);
+  if (a == b) return 0;
+  if (a == 0 || b == 0) return 1;
   return strcmp(a, b);
 }
 
@@ -581,7 +1033,7 @@ long my_atoi(int *s) {
 int emit_ch(int c) {
   if (outlen >= outcap) {
     outcap *= 2;
-    int *newbuf = my_malloc(outcap);
+    int *newbuf = perm_malloc(outcap);
     int i = 0;
     while (i < outlen) {
       __write_byte(newbuf, i, __read_byte(outbuf, i));
@@ -589,6 +1041,10 @@ int emit_ch(int c) {
     }
     outbuf = newbuf;
   }
+  if (c == '\n' && npeep_line_end < MAX_PEEP_LINES) {
+    peep_line_end[npeep_line_end] = outlen;
+    npeep_line_end++;
+  }
   __write_byte(outbuf, outlen, c);
   outlen++;
   return 0;
@@ -651,10 +1107,29 @@ int emit_mov_imm(int *reg, long val) {
   return 0;
 }
 
+// Emit "mn dst, src, #imm" for an add/sub immediate of up to 24 bits,
+// using the shifted (lsl #12) form for the high part
+int emit_addsub_imm(int *mn, int *dst, int *src, int val) {
+  int hi = val >> 12;
+  int lo = val & 4095;
+  if (hi > 0) {
+    emit_s("\t"); emit_s(mn); emit_s("\t"); emit_s(dst); emit_s(", "); emit_s(src);
+    emit_s(", #"); emit_num(hi); emit_line(", lsl #12");
+    src = dst;
+  }
+  if (lo > 0 || hi == 0) {
+    emit_s("\t"); emit_s(mn); emit_s("\t"); emit_s(dst); emit_s(", "); emit_s(src);
+    emit_s(", #"); emit_num(lo); emit_ch('\n');
+  }
+  return 0;
+}
+
 // Emit sub dst, src, #imm handling large immediates
 int emit_sub_imm(int *dst, int *src, int val) {
   if (val <= 4095) {
     emit_s("\tsub\t"); emit_s(dst); emit_s(", "); emit_s(src); emit_s(", #"); emit_num(val); emit_ch('\n');
+  } else if (val <= 16777215) {
+    emit_addsub_imm("sub", dst, src, val);
   } else {
     emit_mov_imm("x11", val);
     emit_s("\tsub\t"); emit_s(dst); emit_s(", "); emit_s(src); emit_s(", x11"); emit_ch('\n');
@@ -666,6 +1141,8 @@ int emit_sub_imm(int *dst, int *src, int val) {
 int emit_add_imm(int *dst, int *src, int val) {
   if (val <= 4095) {
     emit_s("\tadd\t"); emit_s(dst); emit_s(", "); emit_s(src); emit_s(", #"); emit_num(val); emit_ch('\n');
+  } else if (val <= 16777215) {
+    emit_addsub_imm("add", dst, src, val);
   } else {
     emit_mov_imm("x11", val);
     emit_s("\tadd\t"); emit_s(dst); emit_s(", "); emit_s(src); emit_s(", x11"); emit_ch('\n');
@@ -673,6 +1150,95 @@ int emit_add_imm(int *dst, int *src, int val) {
   return 0;
 }
 
+// Emit text, the C symbol name and a newline
+int emit_sym_line(int *text, int *name) {
+  emit_s(text); emit_s(sym_pfx); emit_line(name);
+  return 0;
+}
+
+// Emit the definition label of a C symbol
+int emit_sym_label(int *name) {
+  emit_s(sym_pfx); emit_s(name); emit_line(":");
+  return 0;
+}
+
+// One half of a symbol reference: Mach-O puts the relocation after the
+// name (sym@PAGEOFF), ELF in front of it (:lo12:sym)
+int emit_sym_ref(int *pfx, int *name, int *elf_rel, int *macho_rel) {
+  if (target_elf) { emit_s(elf_rel); }
+  emit_s(pfx); emit_s(name);
+  if (target_elf == 0) { emit_s(macho_rel); }
+  return 0;
+}
+
+// Load the address of pfx+name into reg with adrp and an add, or with
+// adrp and a load from its GOT entry
+int emit_sym_addr(int *reg, int *pfx, int *name, int got) {
+  emit_s("\tadrp\t"); emit_s(reg); emit_s(", ");
+  if (got) {
+    emit_sym_ref(pfx, name, ":got:", "@GOTPAGE"); emit_ch('\n');
+    emit_s("\tldr\t"); emit_s(reg); emit_s(", ["); emit_s(reg); emit_s(", ");
+    emit_sym_ref(pfx, name, ":got_lo12:", "@GOTPAGEOFF"); emit_line("]");
+  } else {
+    emit_sym_ref(pfx, name, "", "@PAGE"); emit_ch('\n');
+    emit_s("\tadd\t"); emit_s(reg); emit_s(", "); emit_s(reg); emit_s(", ");
+    emit_sym_ref(pfx, name, ":lo12:", "@PAGEOFF"); emit_ch('\n');
+  }
+  return 0;
+}
+
+// Emit v as an unsigned hex literal (all 64 bits)
+int emit_hex(long v) {
+  int started = 0;
+  emit_s("0x");
+  for (int sh = 60; sh >= 0; sh = sh - 4) {
+    int d = (v >> sh) & 15;
+    if (d != 0 || started || sh == 0) {
+      if (d < 10) { emit_ch('0' + d); } else { emit_ch('a' + d - 10); }
+      started = 1;
+    }
+  }
+  return 0;
+}
+
+// Low n bits set (n in 0..64)
+long low_bits(int n) {
+  long one = 1;
+  if (n >= 64) return 0 - one;
+  return (one << n) - 1;
+}
+
+// Whether v can be the immediate of and/orr/eor/tst: a rotated run of
+// ones repeated across the register in 2, 4, ..., 64-bit elements.
+// w selects the 32-bit form, where only the low 32 bits of v matter.
+int is_logical_imm(long v, int w) {
+  if (w) {
+    v = v & low_bits(32);
+    v = v | (v << 32);
+  }
+  if (v == 0 || v == 0 - 1) return 0;
+  int size = 2;
+  while (size <= 64) {
+    long mask = low_bits(size);
+    long elem = v & mask;
+    int repeats = 1;
+    for (int at = size; at < 64; at = at + size) {
+      if (((v >> at) & mask) != elem) { repeats = 0; break; }
+    }
+    if (repeats) {
+      for (int r = 0; r < size; r++) {
+        // Rotate elem right by r within the element
+        long rot = elem;
+        if (r > 0) { rot = ((elem >> r) & low_bits(size - r)) | ((elem << (size - r)) & mask); }
+        if ((rot & (rot + 1)) == 0) return 1;
+      }
+      return 0;
+    }
+    size = size * 2;
+  }
+  return 0;
+}
+
 // Build a char* string from pieces
 int *build_str2(int *a, int *b) {
   int la = my_strlen(a);
@@ -735,6 +1301,165 @@ int *make_str(int *src, int start, int len) {
   return buf;
 }
 
+// ---- Atoms ----
+// The lexer interns every identifier, number and operator, so equal names
+// share one string. Symbol tables store atoms and compare pointers.
+// Atom 0 is unused so that an empty bucket or chain end can be 0.
+int *atom_name[MAX_ATOMS];
+int atom_kw[MAX_ATOMS];          // 0 not yet known, 1 identifier, 2 keyword
+int atom_next[MAX_ATOMS];        // hash chain
+int atom_head[MAX_ATOM_BUCKETS];
+int n_atoms = 1;
+int atom_nokey;                  // its address is never an atom
+
+int atom_hash(int *buf, int start, int len) {
+  int h = 0;
+  for (int i = 0; i < len; i++) { h = h * 31 + __read_byte(buf, start + i); }
+  return h & (MAX_ATOM_BUCKETS - 1);
+}
+
+int atom_lookup(int *buf, int start, int len, int h) {
+  int a = atom_head[h];
+  while (a != 0) {
+    int *nm = atom_name[a];
+    int k = 0;
+    while (k < len && __read_byte(nm, k) == __read_byte(buf, start + k)) { k++; }
+    if (k == len && __read_byte(nm, len) == 0) return a;
+    a = atom_next[a];
+  }
+  return 0;
+}
+
+int atom_id(int *buf, int start, int len) {
+  int h = atom_hash(buf, start, len);
+  int a = atom_lookup(buf, start, len, h);
+  if (a != 0) return a;
+  if (n_atoms >= MAX_ATOMS) { my_fatal("too many distinct names"); }
+  a = n_atoms;
+  n_atoms++;
+  int prev = arena_use(AR_PERM);  // names outlive the phase that saw them first
+  atom_name[a] = make_str(buf, start, len);
+  arena_use(prev);
+  atom_kw[a] = 0;
+  atom_next[a] = atom_head[h];
+  atom_head[h] = a;
+  return a;
+}
+
+int *atom_n(int *buf, int start, int len) {
+  return atom_name[atom_id(buf, start, len)];
+}
+
+int *atom(int *s) {
+  if (s == 0) return 0;
+  return atom_name[atom_id(s, 0, strlen(s))];
+}
+
+// The id of the atom spelled like s without creating one, or 0
+int atom_find_id(int *s) {
+  if (s == 0) return 0;
+  int len = strlen(s);
+  int h = atom_hash(s, 0, len);
+  int a = atom_head[h];
+  while (a != 0) {
+    if (atom_name[a] == s) return a;
+    a = atom_next[a];
+  }
+  return atom_lookup(s, 0, len, h);
+}
+
+// The atom spelled like s. A name nobody interned cannot be in an
+// atom-keyed table, so it maps to a key that matches nothing.
+int *atom_find(int *s) {
+  int a = atom_find_id(s);
+  if (a == 0) return &atom_nokey;
+  return atom_name[a];
+}
+
+// ---- Name indexes ----
+
+int nx_clear(struct NameIndex *x) {
+  for (int i = 0; i < x->cap; i++) { x->ids[i] = 0; }
+  return 0;
+}
+
+// An index for a table of at most nents entries, kept at most half full
+struct NameIndex *nx_new(int nents) {
+  struct NameIndex *x = my_malloc(40);
+  int cap = 16;
+  while (cap < nents * 2) { cap = cap * 2; }
+  x->cap = cap;
+  x->ids = my_malloc(cap * 8);
+  x->first = my_malloc(cap * 8);
+  x->last = my_malloc(cap * 8);
+  x->next = my_malloc(nents * 8);
+  nx_clear(x);
+  return x;
+}
+
+// The slot holding id, or the empty slot where it belongs
+int nx_slot(struct NameIndex *x, int id) {
+  int m = x->cap - 1;
+  int h = id & m;
+  while (x->ids[h] != 0 && x->ids[h] != id) { h = (h + 1) & m; }
+  return h;
+}
+
+// Oldest entry called name, or -1: what a forward scan finds first
+int nx_first(struct NameIndex *x, int *name) {
+  int id = atom_find_id(name);
+  if (id == 0) return 0 - 1;
+  int h = nx_slot(x, id);
+  if (x->ids[h] == 0) return 0 - 1;
+  return x->first[h];
+}
+
+// Newest entry called name, or -1: what a backward scan finds first
+int nx_last(struct NameIndex *x, int *name) {
+  int id = atom_find_id(name);
+  if (id == 0) return 0 - 1;
+  int h = nx_slot(x, id);
+  if (x->ids[h] == 0) return 0 - 1;
+  return x->last[h];
+}
+
+int nx_next(struct NameIndex *x, int ent) {
+  return x->next[ent];
+}
+
+// Record that entry ent, appended to the table, is called name. The name
+// is interned here, so an entry can never drop out of the index.
+int nx_add(struct NameIndex *x, int *name, int ent) {
+  if (name == 0) { my_fatal("nx_add: entry without a name"); }
+  int id = atom_id(name, 0, my_strlen(name));
+  int h = nx_slot(x, id);
+  x->next[ent] = 0 - 1;
+  if (x->ids[h] == 0) {
+    x->ids[h] = id;
+    x->first[h] = ent;
+  } else {
+    x->next[x->last[h]] = ent;
+  }
+  x->last[h] = ent;
+  return 0;
+}
+
+int nx_init() {
+  lv_ix = nx_new(MAX_LOCAL_VARS);
+  glv_ix = nx_new(MAX_GLV);
+  td_ix = nx_new(MAX_TYPEDEFS);
+  ec_ix = nx_new(MAX_ENUMS);
+  lay_ix = nx_new(MAX_LAYOUT);
+  cgg_ix = nx_new(MAX_CG_GLOBALS);
+  cg_s_ix = nx_new(MAX_STRUCTS);
+  sdef_ix = nx_new(MAX_STRUCTS);
+  known_ix = nx_new(MAX_KNOWN_FUNCS);
+  defined_ix = nx_new(MAX_KNOWN_FUNCS);
+  pp_hdr_ix = nx_new(MAX_HEADERS);
+  pp_inc_ix = nx_new(MAX_HEADERS);
+  return 0;
+}
+
 // ---- Preprocessor helpers ----
 
 int pp_is_macro_defined(int *name) {
@@ -810,26 +1535,139 @@ int *pp_concat_paths(int *dir, int *file) {
 
 // Read a file into a buffer, return pointer and set *out_len
 int *pp_read_file(int *path, int *out_len) {
-  int *f = fopen(path, "r");
-  if (f == 0) {
+  int *buf = read_file(path, out_len);
+  if (buf == 0) {
     printf("cc: Cannot open include: %s\n", path);
     exit(1);
   }
-  int *buf = my_malloc(10 * 1000 * 1000);
-  int len = 0;
-  int ch = fgetc(f);
-  while (ch != 0 - 1) {
-    __write_byte(buf, len, ch);
-    len++;
-    ch = fgetc(f);
-  }
-  __write_byte(buf, len, 0);
-  fclose(f);
-  // Store length at out_len pointer (use first element)
-  *out_len = len;
   return buf;
 }
 
+// Skip blanks, newlines and comments starting at i
+int pp_skip_blank(int *s, int i, int n) {
+  while (i < n) {
+    int c = __read_byte(s, i);
+    if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+      i++;
+    } else if (c == '/' && i + 1 < n && __read_byte(s, i + 1) == '/') {
+      while (i < n && __read_byte(s, i) != '\n') { i++; }
+    } else if (c == '/' && i + 1 < n && __read_byte(s, i + 1) == '*') {
+      i = i + 2;
+      while (i + 1 < n && (__read_byte(s, i) != '*' || __read_byte(s, i + 1) != '/')) { i++; }
+      i = i + 2;
+    } else {
+      return i;
+    }
+  }
+  return n;
+}
+
+// If the line at i is "#word", the offset after word, else -1
+int pp_directive_at(int *s, int i, int n, int *word) {
+  while (i < n && (__read_byte(s, i) == ' ' || __read_byte(s, i) == '\t')) { i++; }
+  if (i >= n || __read_byte(s, i) != '#') return 0 - 1;
+  i++;
+  while (i < n && (__read_byte(s, i) == ' ' || __read_byte(s, i) == '\t')) { i++; }
+  int k = 0;
+  while (__read_byte(word, k) != 0) {
+    if (i >= n || __read_byte(s, i) != __read_byte(word, k)) return 0 - 1;
+    i++;
+    k++;
+  }
+  if (i < n && is_alnum(__read_byte(s, i))) return 0 - 1;
+  return i;
+}
+
+// The guard macro X when all of the file but comments is one
+// "#ifndef X ... #endif" block, else 0
+int *pp_find_guard(int *s, int n) {
+  int i = pp_skip_blank(s, 0, n);
+  int p = pp_directive_at(s, i, n, "ifndef");
+  if (p < 0) return 0;
+  while (p < n && (__read_byte(s, p) == ' ' || __read_byte(s, p) == '\t')) { p++; }
+  int gs = p;
+  while (p < n && is_alnum(__read_byte(s, p))) { p++; }
+  if (p == gs) return 0;
+  int *guard = make_str(s, gs, p - gs);
+  int depth = 0;
+  i = p;
+  while (i < n) {
+    while (i < n && __read_byte(s, i) != '\n') { i++; }
+    i++;
+    if (pp_directive_at(s, i, n, "if") >= 0 || pp_directive_at(s, i, n, "ifdef") >= 0 ||
+        pp_directive_at(s, i, n, "ifndef") >= 0) {
+      depth++;
+    } else if (depth == 0 && (pp_directive_at(s, i, n, "else") >= 0 || pp_directive_at(s, i, n, "elif") >= 0)) {
+      return 0;
+    } else if (pp_directive_at(s, i, n, "endif") >= 0) {
+      if (depth == 0) {
+        while (i < n && __read_byte(s, i) != '\n') { i++; }
+        if (pp_skip_blank(s, i, n) < n) return 0;
+        return guard;
+      }
+      depth--;
+    }
+  }
+  return 0;
+}
+
+// The header table entry for path, reading the file the first time
+int pp_header(int *path) {
+  path = atom(path);
+  int h = nx_first(pp_hdr_ix, path);
+  if (h >= 0) return h;
+  if (pp_nhdr >= MAX_HEADERS) { my_fatal("too many headers"); }
+  h = pp_nhdr;
+  pp_nhdr++;
+  pp_hdr_path[h] = path;
+  pp_hdr_len[h] = 0;
+  pp_hdr_src[h] = pp_read_file(path, &pp_hdr_len[h]);
+  pp_hdr_guard[h] = pp_find_guard(pp_hdr_src[h], pp_hdr_len[h]);
+  pp_hdr_once[h] = 0;
+  nx_add(pp_hdr_ix, path, h);
+  return h;
+}
+
+// Where #include finds name, looking next to the including file in dir
+// first when quoted. 0 when no directory has it; a quoted name that is
+// nowhere resolves to dir/name so that reading it reports the error.
+int *pp_resolve_include(int *dir, int *name, int quoted) {
+  int *key = 0;
+  if (quoted) { key = atom(pp_concat_paths(dir, name)); }
+  else { key = atom(pp_concat_paths("<", name)); }
+  int e = nx_first(pp_inc_ix, key);
+  if (e >= 0) return pp_inc_path[e];
+  int *found = 0;
+  if (quoted) {
+    int *f = fopen(key, "r");
+    if (f != 0) { fclose(f); found = key; }
+  }
+  int idi = 0;
+  while (found == 0 && idi < ninclude_dirs) {
+    int *tp = pp_concat_paths(include_dirs[idi], name);
+    int *f = fopen(tp, "r");
+    if (f != 0) { fclose(f); found = tp; }
+    idi++;
+  }
+  if (found == 0 && quoted) { found = key; }
+  if (pp_ninc >= MAX_HEADERS) { my_fatal("too many #include names"); }
+  pp_inc_path[pp_ninc] = found;
+  nx_add(pp_inc_ix, key, pp_ninc);
+  pp_ninc++;
+  return found;
+}
+
+int pp_preprocess(int *src, int srclen, int *filepath, int *out, int co, int depth);
+
+// Preprocess the header at path into out, unless its guard is defined or
+// it has #pragma once and was included before
+int pp_include(int *path, int *out, int co, int depth) {
+  int h = pp_header(path);
+  if (pp_hdr_once[h]) return co;
+  if (pp_hdr_guard[h] != 0 && pp_is_macro_defined(pp_hdr_guard[h])) return co;
+  return pp_preprocess(pp_hdr_src[h], pp_hdr_len[h], pp_hdr_path[h], out, co, depth);
+}
+
 // Recursive descent #if expression evaluator
 int *ifex_buf;    // expression buffer
 int ifex_pos;     // current position
@@ -1118,8 +1956,6 @@ int pp_preprocess(int *src, int srclen, int *filepath, int *out, int co, int dep
   int pstart = 0;
   int *inc_file = 0;
   int *full_path = 0;
-  int inc_len = 0;
-  int *inc_src = 0;
 
   while (ci < srclen) {
     // Skip leading whitespace to check for #
@@ -1280,46 +2116,15 @@ int pp_preprocess(int *src, int srclen, int *filepath, int *out, int co, int dep
           pstart = si;
           while (si < srclen && __read_byte(src, si) != '"' && __read_byte(src, si) != '\n') { si++; }
           inc_file = make_str(src, pstart, si - pstart);
-          full_path = pp_concat_paths(dir, inc_file);
-          {
-            int *tryf = fopen(full_path, "r");
-            if (tryf != 0) {
-              fclose(tryf);
-            } else {
-              // Try include dirs
-              int idi = 0;
-              while (idi < ninclude_dirs) {
-                int *tp = pp_concat_paths(include_dirs[idi], inc_file);
-                tryf = fopen(tp, "r");
-                if (tryf != 0) { fclose(tryf); full_path = tp; idi = ninclude_dirs; }
-                idi++;
-              }
-            }
-          }
-          inc_len = 0;
-          inc_src = pp_read_file(full_path, &inc_len);
-          co = pp_preprocess(inc_src, inc_len, full_path, out, co, depth + 1);
+          full_path = pp_resolve_include(dir, inc_file, 1);
+          co = pp_include(full_path, out, co, depth + 1);
         } else if (si < srclen && __read_byte(src, si) == '<') {
           si++;
           pstart = si;
           while (si < srclen && __read_byte(src, si) != '>' && __read_byte(src, si) != '\n') { si++; }
           inc_file = make_str(src, pstart, si - pstart);
-          {
-            int idi = 0;
-            int inc_found = 0;
-            while (idi < ninclude_dirs && inc_found == 0) {
-              full_path = pp_concat_paths(include_dirs[idi], inc_file);
-              int *tryf = fopen(full_path, "r");
-              if (tryf != 0) {
-                fclose(tryf);
-                inc_len = 0;
-                inc_src = pp_read_file(full_path, &inc_len);
-                co = pp_preprocess(inc_src, inc_len, full_path, out, co, depth + 1);
-                inc_found = 1;
-              }
-              idi++;
-            }
-          }
+          full_path = pp_resolve_include(dir, inc_file, 0);
+          if (full_path != 0) { co = pp_include(full_path, out, co, depth + 1); }
         }
         // Skip rest of line
         while (ci < srclen && __read_byte(src, ci) != '\n') { ci++; }
@@ -1493,12 +2298,20 @@ int pp_preprocess(int *src, int srclen, int *filepath, int *out, int co, int dep
         if (ci < srclen) { __write_byte(out, co, '\n'); co++; ci++; }
       }
 
-      // Check for "pragma" (ignore directive, just skip)
+      // Check for "pragma": "once" marks the header, the rest are ignored
       else if (si + 6 <= srclen &&
           __read_byte(src, si) == 'p' && __read_byte(src, si+1) == 'r' &&
           __read_byte(src, si+2) == 'a' && __read_byte(src, si+3) == 'g' &&
           __read_byte(src, si+4) == 'm' && __read_byte(src, si+5) == 'a' &&
           (__read_byte(src, si+6) == ' ' || __read_byte(src, si+6) == '\t' || __read_byte(src, si+6) == '\n')) {
+        si += 6;
+        while (si < srclen && (__read_byte(src, si) == ' ' || __read_byte(src, si) == '\t')) { si++; }
+        if (si + 4 <= srclen && __read_byte(src, si) == 'o' && __read_byte(src, si+1) == 'n' &&
+            __read_byte(src, si+2) == 'c' && __read_byte(src, si+3) == 'e' &&
+            (si + 4 == srclen || !is_alnum(__read_byte(src, si+4)))) {
+          int oh = nx_first(pp_hdr_ix, filepath);
+          if (oh >= 0) { pp_hdr_once[oh] = 1; }
+        }
         while (ci < srclen && __read_byte(src, ci) != '\n') { ci++; }
         if (ci < srclen) { __write_byte(out, co, '\n'); co++; ci++; }
       }
@@ -1533,97 +2346,584 @@ int pp_preprocess(int *src, int srclen, int *filepath, int *out, int co, int dep
 }
 
 
-// ---- Lexer ----
+// ---- Macro expansion ----
+// One pass over the preprocessed text. Input is read from a stack of levels.
+// Level 0 is the source. Each level above it is the replacement text of a
+// macro that is being rescanned. That macro is hidden while its level is
+// live: this is the hide-set rule applied to everything its expansion
+// produces. A level is dropped once it has been read to the end. Arguments
+// are expanded on their own levels, above a floor that stops them reading
+// past their end.
+int *pp_lv_text[MAX_PP_DEPTH];
+int pp_lv_pos[MAX_PP_DEPTH];
+int pp_lv_len[MAX_PP_DEPTH];
+int pp_lv_macro[MAX_PP_DEPTH];  // macro hidden while the level is live, or -1
+int *pp_lv_buf[MAX_PP_DEPTH];   // replacement text storage, reused per depth
+int pp_lv_cap[MAX_PP_DEPTH];
+int pp_nlv;
+int pp_floor;                   // lowest level the current run may read
+int *pp_out;
+int pp_olen;
+int pp_ocap;
+int pp_line = 1;                // line number at level-0 offset pp_line_pos
+int pp_line_pos;
+int *pp_file;                   // what __FILE__ expands to
+
+int pp_out_ch(int c) {
+  if (pp_olen >= pp_ocap) {
+    pp_ocap = pp_ocap * 2 + 64;
+    int *nb = my_malloc(pp_ocap + 1);
+    for (int i = 0; i < pp_olen; i++) { __write_byte(nb, i, __read_byte(pp_out, i)); }
+    pp_out = nb;
+  }
+  __write_byte(pp_out, pp_olen, c);
+  pp_olen++;
+  return 0;
+}
 
-int is_space(int c) {
-  if (c == ' ') { return 1; }
-  if (c == '\t') { return 1; }
-  if (c == '\n') { return 1; }
-  if (c == '\r') { return 1; }
+int pp_out_range(int *s, int start, int end) {
+  for (int i = start; i < end; i++) { pp_out_ch(__read_byte(s, i)); }
   return 0;
 }
 
-int is_digit(int c) {
-  return c >= '0' && c <= '9';
+int pp_out_str(int *s) {
+  pp_out_range(s, 0, my_strlen(s));
+  return 0;
 }
 
-int is_alpha(int c) {
-  if (c >= 'a' && c <= 'z') { return 1; }
-  if (c >= 'A' && c <= 'Z') { return 1; }
-  if (c == '_') { return 1; }
-  if (c == '$') { return 1; }
+int pp_push(int *text, int len, int mc) {
+  if (pp_nlv >= MAX_PP_DEPTH) { my_fatal("macro expansion nested too deeply"); }
+  pp_lv_text[pp_nlv] = text;
+  pp_lv_pos[pp_nlv] = 0;
+  pp_lv_len[pp_nlv] = len;
+  pp_lv_macro[pp_nlv] = mc;
+  pp_nlv++;
   return 0;
 }
 
-int is_alnum(int c) {
-  return is_alpha(c) || is_digit(c);
+// Drop levels above the floor that have been read to the end
+int pp_drop_done() {
+  while (pp_nlv - 1 > pp_floor && pp_lv_pos[pp_nlv - 1] >= pp_lv_len[pp_nlv - 1]) { pp_nlv--; }
+  return 0;
 }
 
-int is_float_literal(int *s) {
-  int i = 0;
-  int c = __read_byte(s, i);
-  // Hex float: 0x1.fp2 — has 'p' or 'P' exponent
-  if (c == '0' && (__read_byte(s, 1) == 'x' || __read_byte(s, 1) == 'X')) {
-    int hi = 2;
-    while (__read_byte(s, hi) != 0) { if (__read_byte(s, hi) == 'p' || __read_byte(s, hi) == 'P') { return 1; } hi++; }
-    return 0;
+int pp_hidden(int mc) {
+  for (int k = 0; k < pp_nlv; k++) {
+    if (pp_lv_macro[k] == mc) return 1;
   }
-  while (c != 0) {
-    if (c == '.' || c == 'e' || c == 'E') { return 1; }
+  return 0;
+}
+
+// End of the string or char literal that starts at i
+int pp_skip_quoted(int *s, int i, int n) {
+  int q = __read_byte(s, i);
+  i++;
+  while (i < n && __read_byte(s, i) != q) {
+    if (__read_byte(s, i) == '\\' && i + 1 < n) { i++; }
     i++;
-    c = __read_byte(s, i);
   }
-  // Check for 'f' or 'F' suffix at end
-  if (i > 0) {
-    int last = __read_byte(s, i - 1);
-    if (last == 'f' || last == 'F') { return 1; }
+  if (i < n) { i++; }
+  return i;
+}
+
+// End of the preprocessing number that starts at i
+int pp_skip_number(int *s, int i, int n) {
+  i++;
+  while (i < n) {
+    int c = __read_byte(s, i);
+    if ((c == '+' || c == '-') && (__read_byte(s, i - 1) | 32) == 'e') { i++; }
+    else if ((c == '+' || c == '-') && (__read_byte(s, i - 1) | 32) == 'p') { i++; }
+    else if (is_alnum(c) || c == '.') { i++; }
+    else { break; }
   }
-  return 0;
+  return i;
 }
 
-// Convert float literal string to IEEE 754 double bit pattern using integer-only math
-int *str_to_double_bits(int *s) {
-  int sign = 0;
-  int i = 0;
-  int c = __read_byte(s, i);
+// Whether s[i..i+len) spells name
+int pp_same(int *name, int *s, int i, int len) {
+  for (int k = 0; k < len; k++) {
+    if (__read_byte(name, k) != __read_byte(s, i + k)) return 0;
+  }
+  return __read_byte(name, len) == 0;
+}
 
-  // Sign
-  if (c == '-') { sign = 1; i++; c = __read_byte(s, i); }
-  else if (c == '+') { i++; c = __read_byte(s, i); }
+int pp_ident_end(int *s, int i, int n) {
+  while (i < n && is_alnum(__read_byte(s, i))) { i++; }
+  return i;
+}
 
-  // Hex float: 0xH.Hp±D  -> value = H.H * 2^(±D)
-  if (c == '0' && (__read_byte(s, i + 1) == 'x' || __read_byte(s, i + 1) == 'X')) {
-    i += 2; c = __read_byte(s, i);
-    // Parse hex integer part
-    long hm = 0;
-    int hbits = 0;
-    while (is_hex_digit(c)) {
-      int hd = 0;
-      if (c >= '0' && c <= '9') { hd = c - '0'; }
-      else if (c >= 'a' && c <= 'f') { hd = c - 'a' + 10; }
-      else if (c >= 'A' && c <= 'F') { hd = c - 'A' + 10; }
-      hm = hm * 16 + hd;
-      hbits += 4;
-      i++; c = __read_byte(s, i);
-    }
-    int hfrac_bits = 0;
-    if (c == '.') {
-      i++; c = __read_byte(s, i);
-      while (is_hex_digit(c)) {
-        int hd = 0;
-        if (c >= '0' && c <= '9') { hd = c - '0'; }
-        else if (c >= 'a' && c <= 'f') { hd = c - 'a' + 10; }
-        else if (c >= 'A' && c <= 'F') { hd = c - 'A' + 10; }
-        hm = hm * 16 + hd;
-        hfrac_bits += 4;
-        hbits += 4;
-        i++; c = __read_byte(s, i);
-      }
+// Carry definition offsets through a pass that drops text: definitions at or
+// before read offset ri now sit at write offset wi. macros[] is in def_pos order.
+int pp_shift_defs(int dm, int ri, int wi) {
+  while (dm < nmacros && macros[dm].def_pos <= ri) {
+    macros[dm].def_pos = wi;
+    dm++;
+  }
+  return dm;
+}
+
+// Line of level-0 offset pos; offsets only move forward
+int pp_line_at(int pos) {
+  while (pp_line_pos < pos) {
+    if (__read_byte(pp_lv_text[0], pp_line_pos) == '\n') { pp_line++; }
+    pp_line_pos++;
+  }
+  return pp_line;
+}
+
+// The definition of s[i..i+len) in effect at level-0 offset where, or -1
+int pp_find_macro(int *s, int i, int len, int where) {
+  int h = 0;
+  for (int k = 0; k < len; k++) { h = h * 31 + __read_byte(s, i + k); }
+  int mc = macro_ht_head[h & 65535];
+  while (mc >= 0) {
+    if (macros[mc].nlen == len && macros[mc].def_pos <= where) {
+      int k = 0;
+      while (k < len && __read_byte(macros[mc].name, k) == __read_byte(s, i + k)) { k++; }
+      if (k == len) return mc;
     }
-    int hexp = 0;
-    int hexp_sign = 1;
-    if (c == 'p' || c == 'P') {
-      i++; c = __read_byte(s, i);
+    mc = macros[mc].ht_next;
+  }
+  return 0 - 1;
+}
+
+// Whether the next character, skipping blanks and finished levels, is '('
+int pp_paren_follows() {
+  int k = pp_nlv - 1;
+  while (k >= pp_floor) {
+    int *s = pp_lv_text[k];
+    int p = pp_lv_pos[k];
+    while (p < pp_lv_len[k] && (__read_byte(s, p) == ' ' || __read_byte(s, p) == '\t')) { p++; }
+    if (p < pp_lv_len[k]) return __read_byte(s, p) == '(';
+    k--;
+  }
+  return 0;
+}
+
+// Next character of a macro call's argument list, or -1 at the floor's end
+int pp_take() {
+  pp_drop_done();
+  int t = pp_nlv - 1;
+  if (pp_lv_pos[t] >= pp_lv_len[t]) return 0 - 1;
+  int c = __read_byte(pp_lv_text[t], pp_lv_pos[t]);
+  pp_lv_pos[t]++;
+  return c;
+}
+
+int *pp_trimmed(int *s, int start, int end) {
+  while (start < end && (__read_byte(s, start) == ' ' || __read_byte(s, start) == '\t')) { start++; }
+  while (end > start && (__read_byte(s, end - 1) == ' ' || __read_byte(s, end - 1) == '\t')) { end--; }
+  return make_str(s, start, end - start);
+}
+
+// Read "(a, b, ...)" from the input into args; the raw text read, parens
+// included, goes to *raw. Returns the argument count, or -1 when the input
+// ends first.
+int pp_read_args(int **args, int **raw) {
+  int *saved = pp_out;
+  int saved_len = pp_olen;
+  int saved_cap = pp_ocap;
+  pp_ocap = 64;
+  pp_out = my_malloc(pp_ocap + 1);
+  pp_olen = 0;
+  int c = pp_take();
+  while (c == ' ' || c == '\t') { c = pp_take(); }
+  pp_out_ch(c);
+  int nargs = 0;
+  int depth = 1;
+  int astart = pp_olen;
+  int ok = 0;
+  while (depth > 0) {
+    c = pp_take();
+    if (c < 0) break;
+    pp_out_ch(c);
+    if (c == '(') {
+      depth++;
+    } else if (c == ')') {
+      depth--;
+      if (depth == 0) {
+        if ((pp_olen - 1 > astart || nargs > 0) && nargs < 64) { args[nargs] = pp_trimmed(pp_out, astart, pp_olen - 1); }
+        if (pp_olen - 1 > astart || nargs > 0) { nargs++; }
+        ok = 1;
+      }
+    } else if (c == ',' && depth == 1) {
+      if (nargs < 64) { args[nargs] = pp_trimmed(pp_out, astart, pp_olen - 1); }
+      nargs++;
+      astart = pp_olen;
+    } else if (c == '"' || c == '\'') {
+      int q = c;
+      c = pp_take();
+      while (c >= 0 && c != q) {
+        pp_out_ch(c);
+        if (c == '\\') {
+          c = pp_take();
+          if (c >= 0) { pp_out_ch(c); }
+        }
+        c = pp_take();
+      }
+      if (c >= 0) { pp_out_ch(c); }
+    }
+  }
+  __write_byte(pp_out, pp_olen, 0);
+  *raw = pp_out;
+  pp_out = saved;
+  pp_olen = saved_len;
+  pp_ocap = saved_cap;
+  if (ok == 0) return 0 - 1;
+  return nargs;
+}
+
+int pp_run();
+
+// An argument with its macros expanded, as it is substituted outside # and ##
+int *pp_expand_arg(int *arg) {
+  int *saved = pp_out;
+  int saved_len = pp_olen;
+  int saved_cap = pp_ocap;
+  int saved_floor = pp_floor;
+  int alen = my_strlen(arg);
+  pp_ocap = alen * 2 + 16;
+  pp_out = my_malloc(pp_ocap + 1);
+  pp_olen = 0;
+  pp_push(arg, alen, 0 - 1);
+  pp_floor = pp_nlv - 1;
+  pp_run();
+  pp_nlv = pp_floor;
+  pp_floor = saved_floor;
+  __write_byte(pp_out, pp_olen, 0);
+  int *r = pp_out;
+  pp_out = saved;
+  pp_olen = saved_len;
+  pp_ocap = saved_cap;
+  return r;
+}
+
+int pp_is_paste(int *s, int i, int n) {
+  while (i < n && (__read_byte(s, i) == ' ' || __read_byte(s, i) == '\t')) { i++; }
+  return i + 1 < n && __read_byte(s, i) == '#' && __read_byte(s, i + 1) == '#';
+}
+
+// Write the replacement of a call to function-like macro mc to the output
+int pp_substitute(int mc, int **args, int nargs) {
+  int *body = macros[mc].body;
+  int n = my_strlen(body);
+  int np = macros[mc].nparams;
+  int *xargs[64];
+  for (int k = 0; k < 64; k++) { xargs[k] = 0; }
+  int after_paste = 0;
+  int bi = 0;
+  while (bi < n) {
+    int c = __read_byte(body, bi);
+    if (c == '"' || c == '\'') {
+      int e = pp_skip_quoted(body, bi, n);
+      pp_out_range(body, bi, e);
+      bi = e;
+      after_paste = 0;
+    } else if (is_digit(c)) {
+      int e = pp_skip_number(body, bi, n);
+      pp_out_range(body, bi, e);
+      bi = e;
+      after_paste = 0;
+    } else if (is_alpha(c)) {
+      int ps = bi;
+      bi = pp_ident_end(body, bi, n);
+      int raw = after_paste || pp_is_paste(body, bi, n);
+      int px = 0 - 1;
+      // L'x' and L"x" stay wide literals
+      if (bi - ps != 1 || c != 'L' || bi >= n || (__read_byte(body, bi) != '\'' && __read_byte(body, bi) != '"')) {
+        for (int k = 0; k < np; k++) {
+          if (pp_same(macros[mc].params[k], body, ps, bi - ps)) { px = k; k = np; }
+        }
+      }
+      if (px >= 0) {
+        if (raw) { pp_out_str(args[px]); }
+        else {
+          if (xargs[px] == 0) { xargs[px] = pp_expand_arg(args[px]); }
+          pp_out_str(xargs[px]);
+        }
+      } else if (macros[mc].is_variadic && bi - ps == 11 && pp_same("__VA_ARGS__", body, ps, 11)) {
+        // GNU ", ## __VA_ARGS__" drops the comma when there are no extra args
+        if (after_paste && nargs <= np && pp_olen > 0 && __read_byte(pp_out, pp_olen - 1) == ',') { pp_olen--; }
+        for (int k = np; k < nargs && k < 64; k++) {
+          if (k > np) { pp_out_ch(','); pp_out_ch(' '); }
+          if (raw) { pp_out_str(args[k]); }
+          else {
+            if (xargs[k] == 0) { xargs[k] = pp_expand_arg(args[k]); }
+            pp_out_str(xargs[k]);
+          }
+        }
+      } else {
+        pp_out_range(body, ps, bi);
+      }
+      after_paste = 0;
+    } else if (c == '#' && bi + 1 < n && __read_byte(body, bi + 1) == '#') {
+      // Token pasting: drop ## and the blanks around it
+      bi = bi + 2;
+      while (pp_olen > 0 && (__read_byte(pp_out, pp_olen - 1) == ' ' || __read_byte(pp_out, pp_olen - 1) == '\t')) { pp_olen--; }
+      while (bi < n && (__read_byte(body, bi) == ' ' || __read_byte(body, bi) == '\t')) { bi++; }
+      after_paste = 1;
+    } else if (c == '#' && bi + 1 < n && is_alpha(__read_byte(body, bi + 1))) {
+      // Stringify a parameter
+      int ps = bi + 1;
+      bi = pp_ident_end(body, ps, n);
+      int px = 0 - 1;
+      for (int k = 0; k < np; k++) {
+        if (pp_same(macros[mc].params[k], body, ps, bi - ps)) { px = k; k = np; }
+      }
+      if (px >= 0) {
+        int *a = args[px];
+        int alen = my_strlen(a);
+        pp_out_ch('"');
+        int k = 0;
+        while (k < alen) {
+          int sc = __read_byte(a, k);
+          if (sc == '"' || sc == '\'') {
+            // Literals keep their spacing; their quotes and backslashes are escaped
+            int e = pp_skip_quoted(a, k, alen);
+            while (k < e) {
+              sc = __read_byte(a, k);
+              if (sc == '"' || sc == '\\') { pp_out_ch('\\'); }
+              pp_out_ch(sc);
+              k++;
+            }
+          } else if (sc == ' ' || sc == '\t' || sc == '\n') {
+            // Blanks between tokens become one space
+            while (k < alen && (__read_byte(a, k) == ' ' || __read_byte(a, k) == '\t' || __read_byte(a, k) == '\n')) { k++; }
+            pp_out_ch(' ');
+          } else {
+            pp_out_ch(sc);
+            k++;
+          }
+        }
+        pp_out_ch('"');
+      } else {
+        pp_out_range(body, ps - 1, bi);
+      }
+      after_paste = 0;
+    } else {
+      pp_out_ch(c);
+      bi++;
+    }
+  }
+  return 0;
+}
+
+// Expand a call to function-like macro mc whose name has just been read;
+// the argument list is next in the input
+int pp_call(int mc, int *name, int nlen) {
+  int *args[64];
+  int *raw = 0;
+  int nargs = pp_read_args(args, &raw);
+  int np = macros[mc].nparams;
+  // F() passes one empty argument to a one-parameter macro
+  if (nargs == 0 && np == 1) {
+    args[0] = "";
+    nargs = 1;
+  }
+  if (nargs < 0 || nargs > 64 || (nargs != np && !(macros[mc].is_variadic && nargs >= np))) {
+    // Not a call after all: keep the name, and rescan what was read
+    pp_out_range(name, 0, nlen);
+    pp_push(raw, my_strlen(raw), 0 - 1);
+    return 0;
+  }
+  int k = pp_nlv;
+  if (k >= MAX_PP_DEPTH) { my_fatal("macro expansion nested too deeply"); }
+  int *saved = pp_out;
+  int saved_len = pp_olen;
+  int saved_cap = pp_ocap;
+  if (pp_lv_buf[k] == 0) {
+    pp_lv_cap[k] = 256;
+    pp_lv_buf[k] = my_malloc(pp_lv_cap[k] + 1);
+  }
+  pp_out = pp_lv_buf[k];
+  pp_ocap = pp_lv_cap[k];
+  pp_olen = 0;
+  pp_substitute(mc, args, nargs);
+  pp_lv_buf[k] = pp_out;
+  pp_lv_cap[k] = pp_ocap;
+  int len = pp_olen;
+  pp_out = saved;
+  pp_olen = saved_len;
+  pp_ocap = saved_cap;
+  pp_push(pp_lv_buf[k], len, mc);
+  return 0;
+}
+
+// An identifier s[i..j) read from level t
+int pp_ident(int t, int *s, int i, int j) {
+  int len = j - i;
+  int where = pp_lv_pos[0];
+  if (t == 0) { where = i; }
+  if (len == 8 && pp_same("__LINE__", s, i, 8)) {
+    pp_out_str(int_to_str(pp_line_at(where)));
+    return 0;
+  }
+  if (len == 8 && pp_same("__FILE__", s, i, 8)) {
+    pp_out_ch('"');
+    pp_out_str(pp_file);
+    pp_out_ch('"');
+    return 0;
+  }
+  int mc = pp_find_macro(s, i, len, where);
+  // L'x' and L"x" are wide literals, not the macro L
+  if (mc >= 0 && len == 1 && __read_byte(s, i) == 'L' && j < pp_lv_len[t] &&
+      (__read_byte(s, j) == '\'' || __read_byte(s, j) == '"')) { mc = 0 - 1; }
+  if (mc < 0 || pp_hidden(mc)) {
+    pp_out_range(s, i, j);
+    return 0;
+  }
+  if (macros[mc].nparams < 0) {
+    pp_push(macros[mc].value, my_strlen(macros[mc].value), mc);
+    return 0;
+  }
+  // A function-like macro name without arguments is an ordinary name
+  if (pp_paren_follows() == 0) {
+    pp_out_range(s, i, j);
+    return 0;
+  }
+  pp_call(mc, make_str(s, i, len), len);
+  return 0;
+}
+
+// Expand everything above the floor, writing it to the output
+int pp_run() {
+  while (1) {
+    pp_drop_done();
+    int t = pp_nlv - 1;
+    int *s = pp_lv_text[t];
+    int i = pp_lv_pos[t];
+    int n = pp_lv_len[t];
+    if (i >= n) return 0;
+    int c = __read_byte(s, i);
+    if (c == '"' || c == '\'') {
+      int e = pp_skip_quoted(s, i, n);
+      pp_out_range(s, i, e);
+      pp_lv_pos[t] = e;
+    } else if (is_digit(c) || (c == '.' && i + 1 < n && is_digit(__read_byte(s, i + 1)))) {
+      int e = pp_skip_number(s, i, n);
+      pp_out_range(s, i, e);
+      pp_lv_pos[t] = e;
+    } else if (is_alpha(c)) {
+      int e = pp_ident_end(s, i, n);
+      pp_lv_pos[t] = e;
+      pp_ident(t, s, i, e);
+    } else {
+      pp_out_ch(c);
+      pp_lv_pos[t] = i + 1;
+    }
+  }
+  return 0;
+}
+
+// Expand the macros in src[0..n); the length of the result goes to *out_len
+int *pp_expand(int *src, int n, int *path, int *out_len) {
+  pp_file = path;
+  pp_nlv = 0;
+  pp_floor = 0;
+  pp_line = 1;
+  pp_line_pos = 0;
+  pp_push(src, n, 0 - 1);
+  pp_ocap = n + n / 4 + 4096;
+  pp_out = my_malloc(pp_ocap + 1);
+  pp_olen = 0;
+  pp_run();
+  __write_byte(pp_out, pp_olen, 0);
+  *out_len = pp_olen;
+  return pp_out;
+}
+
+
+// ---- Lexer ----
+
+int is_space(int c) {
+  if (c == ' ') { return 1; }
+  if (c == '\t') { return 1; }
+  if (c == '\n') { return 1; }
+  if (c == '\r') { return 1; }
+  return 0;
+}
+
+int is_digit(int c) {
+  return c >= '0' && c <= '9';
+}
+
+int is_alpha(int c) {
+  if (c >= 'a' && c <= 'z') { return 1; }
+  if (c >= 'A' && c <= 'Z') { return 1; }
+  if (c == '_') { return 1; }
+  if (c == '$') { return 1; }
+  return 0;
+}
+
+int is_alnum(int c) {
+  return is_alpha(c) || is_digit(c);
+}
+
+int is_float_literal(int *s) {
+  int i = 0;
+  int c = __read_byte(s, i);
+  // Hex float: 0x1.fp2 — has 'p' or 'P' exponent
+  if (c == '0' && (__read_byte(s, 1) == 'x' || __read_byte(s, 1) == 'X')) {
+    int hi = 2;
+    while (__read_byte(s, hi) != 0) { if (__read_byte(s, hi) == 'p' || __read_byte(s, hi) == 'P') { return 1; } hi++; }
+    return 0;
+  }
+  while (c != 0) {
+    if (c == '.' || c == 'e' || c == 'E') { return 1; }
+    i++;
+    c = __read_byte(s, i);
+  }
+  // Check for 'f' or 'F' suffix at end
+  if (i > 0) {
+    int last = __read_byte(s, i - 1);
+    if (last == 'f' || last == 'F') { return 1; }
+  }
+  return 0;
+}
+
+// Convert float literal string to IEEE 754 double bit pattern using integer-only math
+int *str_to_double_bits(int *s) {
+  int sign = 0;
+  int i = 0;
+  int c = __read_byte(s, i);
+
+  // Sign
+  if (c == '-') { sign = 1; i++; c = __read_byte(s, i); }
+  else if (c == '+') { i++; c = __read_byte(s, i); }
+
+  // Hex float: 0xH.Hp±D  -> value = H.H * 2^(±D)
+  if (c == '0' && (__read_byte(s, i + 1) == 'x' || __read_byte(s, i + 1) == 'X')) {
+    i += 2; c = __read_byte(s, i);
+    // Parse hex integer part
+    long hm = 0;
+    int hbits = 0;
+    while (is_hex_digit(c)) {
+      int hd = 0;
+      if (c >= '0' && c <= '9') { hd = c - '0'; }
+      else if (c >= 'a' && c <= 'f') { hd = c - 'a' + 10; }
+      else if (c >= 'A' && c <= 'F') { hd = c - 'A' + 10; }
+      hm = hm * 16 + hd;
+      hbits += 4;
+      i++; c = __read_byte(s, i);
+    }
+    int hfrac_bits = 0;
+    if (c == '.') {
+      i++; c = __read_byte(s, i);
+      while (is_hex_digit(c)) {
+        int hd = 0;
+        if (c >= '0' && c <= '9') { hd = c - '0'; }
+        else if (c >= 'a' && c <= 'f') { hd = c - 'a' + 10; }
+        else if (c >= 'A' && c <= 'F') { hd = c - 'A' + 10; }
+        hm = hm * 16 + hd;
+        hfrac_bits += 4;
+        hbits += 4;
+        i++; c = __read_byte(s, i);
+      }
+    }
+    int hexp = 0;
+    int hexp_sign = 1;
+    if (c == 'p' || c == 'P') {
+      i++; c = __read_byte(s, i);
       if (c == '-') { hexp_sign = 0 - 1; i++; c = __read_byte(s, i); }
       else if (c == '+') { i++; c = __read_byte(s, i); }
       while (c >= '0' && c <= '9') { hexp = hexp * 10 + (c - '0'); i++; c = __read_byte(s, i); }
@@ -1858,8 +3158,9 @@ void merge_string_literals() {
 }
 
 int lex(int *src, int srclen) {
-  // Strip comments into a buffer (preserving string/char literal contents)
-  int *buf = my_malloc(srclen + 1);
+  // Strip comments into a buffer (preserving string/char literal contents);
+  // tokens copy what they keep, so it goes with the preprocessor's memory
+  int *buf = arena_alloc(AR_PP, srclen + 1);
   int j = 0;
   int i = 0;
   while (i < srclen) {
@@ -1913,6 +3214,7 @@ int lex(int *src, int srclen) {
   int ec = 0;
   int c1 = 0;
   int *id_val = 0;
+  int aid = 0;
   while (i < len) {
     int c = __read_byte(buf, i);
 
@@ -1964,7 +3266,7 @@ int lex(int *src, int srclen) {
         while (i < len && is_digit(__read_byte(buf, i))) { i++; }
       }
       tok[ntokens].kind = TK_NUM;
-      tok[ntokens].val = make_str(buf, start, i - start);
+      tok[ntokens].val = atom_n(buf, start, i - start);
       // Skip integer/float suffixes: U, L, UL, ULL, LL, F, f, etc.
       while (i < len && (__read_byte(buf, i) == 'U' || __read_byte(buf, i) == 'u' || __read_byte(buf, i) == 'L' || __read_byte(buf, i) == 'l' || __read_byte(buf, i) == 'F' || __read_byte(buf, i) == 'f')) { i++; }
       tok[ntokens].pos = start;
@@ -1978,12 +3280,14 @@ int lex(int *src, int srclen) {
       while (i < len && is_alnum(__read_byte(buf, i))) {
         i++;
       }
-      id_val = make_str(buf, start, i - start);
+      aid = atom_id(buf, start, i - start);
+      id_val = atom_name[aid];
       // Wide char/string prefix: L'x' or L"str" — skip the L prefix
       if (my_strcmp(id_val, "L") == 0 && i < len && (__read_byte(buf, i) == 39 || __read_byte(buf, i) == '"')) {
         // Fall through to char/string literal parsing below
       } else {
-        if (is_keyword(id_val)) {
+        if (atom_kw[aid] == 0) { atom_kw[aid] = 1 + is_keyword(id_val); }
+        if (atom_kw[aid] == 2) {
           tok[ntokens].kind = TK_KW;
         } else {
           tok[ntokens].kind = TK_ID;
@@ -2100,32 +3404,32 @@ int lex(int *src, int srclen) {
     if (i + 2 < len) {
       c1 = __read_byte(buf, i + 1);
       int c2 = __read_byte(buf, i + 2);
-      if (c == '<' && c1 == '<' && c2 == '=') { tok[ntokens].kind = TK_OP; tok[ntokens].val = my_strdup("<<="); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 3; continue; }
-      if (c == '>' && c1 == '>' && c2 == '=') { tok[ntokens].kind = TK_OP; tok[ntokens].val = my_strdup(">>="); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 3; continue; }
+      if (c == '<' && c1 == '<' && c2 == '=') { tok[ntokens].kind = TK_OP; tok[ntokens].val = atom("<<="); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 3; continue; }
+      if (c == '>' && c1 == '>' && c2 == '=') { tok[ntokens].kind = TK_OP; tok[ntokens].val = atom(">>="); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 3; continue; }
     }
 
     // Two-char operators
     if (i + 1 < len) {
       c1 = __read_byte(buf, i + 1);
-      if (c == '-' && c1 == '>') { tok[ntokens].kind = TK_OP; tok[ntokens].val = my_strdup("->"); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 2; continue; }
-      if (c == '=' && c1 == '=') { tok[ntokens].kind = TK_OP; tok[ntokens].val = my_strdup("=="); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 2; continue; }
-      if (c == '!' && c1 == '=') { tok[ntokens].kind = TK_OP; tok[ntokens].val = my_strdup("!="); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 2; continue; }
-      if (c == '<' && c1 == '=') { tok[ntokens].kind = TK_OP; tok[ntokens].val = my_strdup("<="); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 2; continue; }
-      if (c == '>' && c1 == '=') { tok[ntokens].kind = TK_OP; tok[ntokens].val = my_strdup(">="); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 2; continue; }
-      if (c == '&' && c1 == '&') { tok[ntokens].kind = TK_OP; tok[ntokens].val = my_strdup("&&"); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 2; continue; }
-      if (c == '|' && c1 == '|') { tok[ntokens].kind = TK_OP; tok[ntokens].val = my_strdup("||"); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 2; continue; }
-      if (c == '+' && c1 == '+') { tok[ntokens].kind = TK_OP; tok[ntokens].val = my_strdup("++"); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 2; continue; }
-      if (c == '-' && c1 == '-') { tok[ntokens].kind = TK_OP; tok[ntokens].val = my_strdup("--"); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 2; continue; }
-      if (c == '<' && c1 == '<') { tok[ntokens].kind = TK_OP; tok[ntokens].val = my_strdup("<<"); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 2; continue; }
-      if (c == '>' && c1 == '>') { tok[ntokens].kind = TK_OP; tok[ntokens].val = my_strdup(">>"); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 2; continue; }
-      if (c == '+' && c1 == '=') { tok[ntokens].kind = TK_OP; tok[ntokens].val = my_strdup("+="); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 2; continue; }
-      if (c == '-' && c1 == '=') { tok[ntokens].kind = TK_OP; tok[ntokens].val = my_strdup("-="); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 2; continue; }
-      if (c == '*' && c1 == '=') { tok[ntokens].kind = TK_OP; tok[ntokens].val = my_strdup("*="); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 2; continue; }
-      if (c == '/' && c1 == '=') { tok[ntokens].kind = TK_OP; tok[ntokens].val = my_strdup("/="); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 2; continue; }
-      if (c == '%' && c1 == '=') { tok[ntokens].kind = TK_OP; tok[ntokens].val = my_strdup("%="); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 2; continue; }
-      if (c == '&' && c1 == '=') { tok[ntokens].kind = TK_OP; tok[ntokens].val = my_strdup("&="); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 2; continue; }
-      if (c == '|' && c1 == '=') { tok[ntokens].kind = TK_OP; tok[ntokens].val = my_strdup("|="); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 2; continue; }
-      if (c == '^' && c1 == '=') { tok[ntokens].kind = TK_OP; tok[ntokens].val = my_strdup("^="); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 2; continue; }
+      if (c == '-' && c1 == '>') { tok[ntokens].kind = TK_OP; tok[ntokens].val = atom("->"); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 2; continue; }
+      if (c == '=' && c1 == '=') { tok[ntokens].kind = TK_OP; tok[ntokens].val = atom("=="); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 2; continue; }
+      if (c == '!' && c1 == '=') { tok[ntokens].kind = TK_OP; tok[ntokens].val = atom("!="); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 2; continue; }
+      if (c == '<' && c1 == '=') { tok[ntokens].kind = TK_OP; tok[ntokens].val = atom("<="); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 2; continue; }
+      if (c == '>' && c1 == '=') { tok[ntokens].kind = TK_OP; tok[ntokens].val = atom(">="); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 2; continue; }
+      if (c == '&' && c1 == '&') { tok[ntokens].kind = TK_OP; tok[ntokens].val = atom("&&"); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 2; continue; }
+      if (c == '|' && c1 == '|') { tok[ntokens].kind = TK_OP; tok[ntokens].val = atom("||"); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 2; continue; }
+      if (c == '+' && c1 == '+') { tok[ntokens].kind = TK_OP; tok[ntokens].val = atom("++"); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 2; continue; }
+      if (c == '-' && c1 == '-') { tok[ntokens].kind = TK_OP; tok[ntokens].val = atom("--"); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 2; continue; }
+      if (c == '<' && c1 == '<') { tok[ntokens].kind = TK_OP; tok[ntokens].val = atom("<<"); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 2; continue; }
+      if (c == '>' && c1 == '>') { tok[ntokens].kind = TK_OP; tok[ntokens].val = atom(">>"); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 2; continue; }
+      if (c == '+' && c1 == '=') { tok[ntokens].kind = TK_OP; tok[ntokens].val = atom("+="); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 2; continue; }
+      if (c == '-' && c1 == '=') { tok[ntokens].kind = TK_OP; tok[ntokens].val = atom("-="); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 2; continue; }
+      if (c == '*' && c1 == '=') { tok[ntokens].kind = TK_OP; tok[ntokens].val = atom("*="); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 2; continue; }
+      if (c == '/' && c1 == '=') { tok[ntokens].kind = TK_OP; tok[ntokens].val = atom("/="); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 2; continue; }
+      if (c == '%' && c1 == '=') { tok[ntokens].kind = TK_OP; tok[ntokens].val = atom("%="); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 2; continue; }
+      if (c == '&' && c1 == '=') { tok[ntokens].kind = TK_OP; tok[ntokens].val = atom("&="); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 2; continue; }
+      if (c == '|' && c1 == '=') { tok[ntokens].kind = TK_OP; tok[ntokens].val = atom("|="); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 2; continue; }
+      if (c == '^' && c1 == '=') { tok[ntokens].kind = TK_OP; tok[ntokens].val = atom("^="); tok[ntokens].pos = i; ntokens = ntokens + 1; i = i + 2; continue; }
     }
 
     // Single-char operators
@@ -2135,7 +3439,7 @@ int lex(int *src, int srclen) {
         c == '{' || c == '}' || c == '[' || c == ']' ||
         c == '?' || c == ':') {
       tok[ntokens].kind = TK_OP;
-      tok[ntokens].val = make_str(buf, i, 1);
+      tok[ntokens].val = atom_n(buf, i, 1);
       tok[ntokens].pos = i;
       ntokens++;
       i++;
@@ -2149,7 +3453,7 @@ int lex(int *src, int srclen) {
   }
 
   tok[ntokens].kind = TK_EOF;
-  tok[ntokens].val = my_strdup("");
+  tok[ntokens].val = atom("");
   tok[ntokens].pos = len;
   ntokens++;
 
@@ -2187,26 +3491,20 @@ int *p_eat(int kind, int *val) {
 }
 
 int *find_lv_stype(int *name) {
-  int i = nlv - 1;
-  while (i >= 0) {
-    if (my_strcmp(lv[i].name, name) == 0) {
-      return lv[i].stype;
-    }
-    i--;
+  int i = nx_last(lv_ix, name);
+  if (i >= 0) {
+    return lv[i].stype;
   }
   // Also check global struct variable table
-  i = 0;
-  while (i < nglv) {
-    if (my_strcmp(glv[i].name, name) == 0) {
-      return glv[i].stype;
-    }
-    i++;
+  i = nx_first(glv_ix, name);
+  if (i >= 0) {
+    return glv[i].stype;
   }
   return 0;
 }
 
 int add_lv(int *name, int *stype, int is_ptr) {
-  lv[nlv].name = my_strdup(name);
+  lv[nlv].name = atom(name);
   if (stype != 0) {
     lv[nlv].stype = my_strdup(stype);
   } else {
@@ -2217,167 +3515,111 @@ int add_lv(int *name, int *stype, int is_ptr) {
   lv[nlv].is_char = 0;
   lv_is_long[nlv] = 0;
   lv_is_short[nlv] = 0;
+  nx_add(lv_ix, lv[nlv].name, nlv);
   nlv++;
   return 0;
 }
 
 int set_lv_is_char(int *name) {
-  int i = nlv - 1;
-  while (i >= 0) {
-    if (my_strcmp(lv[i].name, name) == 0) { lv[i].is_char = 1; return 0; }
-    i--;
-  }
+  int i = nx_last(lv_ix, name);
+  if (i >= 0) { lv[i].is_char = 1; return 0; }
   return 0;
 }
 
 int find_lv_is_char(int *name) {
-  int i = nlv - 1;
-  while (i >= 0) {
-    if (my_strcmp(lv[i].name, name) == 0) { return lv[i].is_char; }
-    i--;
-  }
+  int i = nx_last(lv_ix, name);
+  if (i >= 0) { return lv[i].is_char; }
   return 0;
 }
 
 int set_lv_is_long(int *name) {
-  int i = nlv - 1;
-  while (i >= 0) {
-    if (my_strcmp(lv[i].name, name) == 0) { lv_is_long[i] = 1; return 0; }
-    i--;
-  }
+  int i = nx_last(lv_ix, name);
+  if (i >= 0) { lv_is_long[i] = 1; return 0; }
   return 0;
 }
 
 int set_lv_is_short(int *name) {
-  int i = nlv - 1;
-  while (i >= 0) {
-    if (my_strcmp(lv[i].name, name) == 0) { lv_is_short[i] = 1; return 0; }
-    i--;
-  }
+  int i = nx_last(lv_ix, name);
+  if (i >= 0) { lv_is_short[i] = 1; return 0; }
   return 0;
 }
 
 int find_lv_is_long(int *name) {
-  int i = nlv - 1;
-  while (i >= 0) {
-    if (my_strcmp(lv[i].name, name) == 0) { return lv_is_long[i]; }
-    i--;
-  }
+  int i = nx_last(lv_ix, name);
+  if (i >= 0) { return lv_is_long[i]; }
   return 0;
 }
 
 int find_lv_is_short(int *name) {
-  int i = nlv - 1;
-  while (i >= 0) {
-    if (my_strcmp(lv[i].name, name) == 0) { return lv_is_short[i]; }
-    i--;
-  }
+  int i = nx_last(lv_ix, name);
+  if (i >= 0) { return lv_is_short[i]; }
   return 0;
 }
 
 int find_glv_is_long(int *name) {
-  int i = nglv - 1;
-  while (i >= 0) {
-    if (my_strcmp(glv[i].name, name) == 0) { return glv_is_long[i]; }
-    i--;
-  }
+  int i = nx_last(glv_ix, name);
+  if (i >= 0) { return glv_is_long[i]; }
   return 0;
 }
 
 int find_glv_is_short(int *name) {
-  int i = nglv - 1;
-  while (i >= 0) {
-    if (my_strcmp(glv[i].name, name) == 0) { return glv_is_short[i]; }
-    i--;
-  }
+  int i = nx_last(glv_ix, name);
+  if (i >= 0) { return glv_is_short[i]; }
   return 0;
 }
 
 int find_lv_isptr(int *name) {
-  int i = nlv - 1;
-  while (i >= 0) {
-    if (my_strcmp(lv[i].name, name) == 0) { return lv[i].isptr; }
-    i--;
-  }
+  int i = nx_last(lv_ix, name);
+  if (i >= 0) { return lv[i].isptr; }
   return 0;
 }
 
 int set_lv_arrsize(int *name, int sz) {
-  int i = nlv - 1;
-  while (i >= 0) {
-    if (my_strcmp(lv[i].name, name) == 0) { lv[i].arrsize = sz; return 0; }
-    i--;
-  }
+  int i = nx_last(lv_ix, name);
+  if (i >= 0) { lv[i].arrsize = sz; return 0; }
   return 0;
 }
 
 int find_lv_arrsize(int *name) {
-  int i = nlv - 1;
-  while (i >= 0) {
-    if (my_strcmp(lv[i].name, name) == 0) { return lv[i].arrsize; }
-    i--;
-  }
+  int i = nx_last(lv_ix, name);
+  if (i >= 0) { return lv[i].arrsize; }
   return 0 - 1;
 }
 
 int find_glv_arrsize(int *name) {
-  int i = nglv - 1;
-  while (i >= 0) {
-    if (my_strcmp(glv[i].name, name) == 0) { return glv[i].arrsize; }
-    i--;
-  }
+  int i = nx_last(glv_ix, name);
+  if (i >= 0) { return glv[i].arrsize; }
   return 0 - 1;
 }
 
 int *find_glv_stype(int *name) {
-  int i = nglv - 1;
-  while (i >= 0) {
-    if (my_strcmp(glv[i].name, name) == 0) { return glv[i].stype; }
-    i--;
-  }
+  int i = nx_last(glv_ix, name);
+  if (i >= 0) { return glv[i].stype; }
   return 0;
 }
 
 int find_glv_is_char(int *name) {
-  int i = nglv - 1;
-  while (i >= 0) {
-    if (my_strcmp(glv[i].name, name) == 0) { return glv[i].is_char; }
-    i--;
-  }
+  int i = nx_last(glv_ix, name);
+  if (i >= 0) { return glv[i].is_char; }
   return 0;
 }
 
 int find_glv_isptr(int *name) {
-  int i = nglv - 1;
-  while (i >= 0) {
-    if (my_strcmp(glv[i].name, name) == 0) { return glv[i].isptr; }
-    i--;
-  }
+  int i = nx_last(glv_ix, name);
+  if (i >= 0) { return glv[i].isptr; }
   return 0;
 }
 
 int *find_typedef(int *name);
 
 struct SDefInfo *find_sdef(int *name) {
-  int i = 0;
-  while (i < np_sdefs) {
-    struct SDefInfo *sdi = p_sdefs[i];
-    if (my_strcmp(sdi->name, name) == 0) {
-      return sdi;
-    }
-    i++;
-  }
+  int i = nx_first(sdef_ix, name);
+  if (i >= 0) { return p_sdefs[i]; }
   // Try resolving as a typedef
   int *resolved = find_typedef(name);
   if (resolved != 0 && my_strcmp(resolved, name) != 0) {
-    i = 0;
-    while (i < np_sdefs) {
-      struct SDefInfo *sdi = p_sdefs[i];
-      if (my_strcmp(sdi->name, resolved) == 0) {
-        return sdi;
-      }
-      i++;
-    }
+    i = nx_first(sdef_ix, resolved);
+    if (i >= 0) { return p_sdefs[i]; }
   }
   return 0;
 }
@@ -2634,8 +3876,15 @@ int *resolve_stype(struct Expr *e) {
 
 // ---- AST constructors ----
 
+// Parser nodes come from here so -fmem-report can count them
+int *ast_alloc(int size) {
+  n_ast_nodes++;
+  return my_malloc(size);
+}
+
 struct Expr *new_num(long val) {
-  struct Expr *e = my_malloc(72);
+  struct Expr *e = ast_alloc(80);
+  e->ty = 0;
   e->kind = ND_NUM;
   e->ival = val;
   e->sval = 0;
@@ -2649,21 +3898,24 @@ struct Expr *new_num(long val) {
 }
 
 struct Expr *new_var(int *name) {
-  struct Expr *e = my_malloc(72);
+  struct Expr *e = ast_alloc(80);
+  e->ty = 0;
   e->kind = ND_VAR;
   e->sval = my_strdup(name);
   return e;
 }
 
 struct Expr *new_strlit(int *val) {
-  struct Expr *e = my_malloc(72);
+  struct Expr *e = ast_alloc(80);
+  e->ty = 0;
   e->kind = ND_STRLIT;
   e->sval = my_strdup(val);
   return e;
 }
 
 struct Expr *new_call(int *name, struct Expr **args, int nargs) {
-  struct Expr *e = my_malloc(72);
+  struct Expr *e = ast_alloc(80);
+  e->ty = 0;
   e->kind = ND_CALL;
   e->sval = my_strdup(name);
   e->args = args;
@@ -2672,7 +3924,8 @@ struct Expr *new_call(int *name, struct Expr **args, int nargs) {
 }
 
 struct Expr *new_unary(int op, struct Expr *rhs) {
-  struct Expr *e = my_malloc(72);
+  struct Expr *e = ast_alloc(80);
+  e->ty = 0;
   e->kind = ND_UNARY;
   e->ival = op;
   e->left = rhs;
@@ -2680,7 +3933,8 @@ struct Expr *new_unary(int op, struct Expr *rhs) {
 }
 
 struct Expr *new_binary(int *op, struct Expr *lhs, struct Expr *rhs) {
-  struct Expr *e = my_malloc(72);
+  struct Expr *e = ast_alloc(80);
+  e->ty = 0;
   e->kind = ND_BINARY;
   e->sval2 = my_strdup(op);
   e->left = lhs;
@@ -2689,7 +3943,8 @@ struct Expr *new_binary(int *op, struct Expr *lhs, struct Expr *rhs) {
 }
 
 struct Expr *new_index(struct Expr *base, struct Expr *idx) {
-  struct Expr *e = my_malloc(72);
+  struct Expr *e = ast_alloc(80);
+  e->ty = 0;
   e->kind = ND_INDEX;
   e->left = base;
   e->right = idx;
@@ -2697,7 +3952,8 @@ struct Expr *new_index(struct Expr *base, struct Expr *idx) {
 }
 
 struct Expr *new_field(struct Expr *obj, int *field, int *stype) {
-  struct Expr *e = my_malloc(72);
+  struct Expr *e = ast_alloc(80);
+  e->ty = 0;
   e->kind = ND_FIELD;
   e->left = obj;
   e->sval = my_strdup(field);
@@ -2706,7 +3962,8 @@ struct Expr *new_field(struct Expr *obj, int *field, int *stype) {
 }
 
 struct Expr *new_arrow(struct Expr *obj, int *field, int *stype) {
-  struct Expr *e = my_malloc(72);
+  struct Expr *e = ast_alloc(80);
+  e->ty = 0;
   e->kind = ND_ARROW;
   e->left = obj;
   e->sval = my_strdup(field);
@@ -2715,7 +3972,8 @@ struct Expr *new_arrow(struct Expr *obj, int *field, int *stype) {
 }
 
 struct Expr *new_assign(struct Expr *target, struct Expr *rhs) {
-  struct Expr *e = my_malloc(72);
+  struct Expr *e = ast_alloc(80);
+  e->ty = 0;
   e->kind = ND_ASSIGN;
   e->left = target;
   e->right = rhs;
@@ -2723,21 +3981,24 @@ struct Expr *new_assign(struct Expr *target, struct Expr *rhs) {
 }
 
 struct Expr *new_postinc(struct Expr *operand) {
-  struct Expr *e = my_malloc(72);
+  struct Expr *e = ast_alloc(80);
+  e->ty = 0;
   e->kind = ND_POSTINC;
   e->left = operand;
   return e;
 }
 
 struct Expr *new_postdec(struct Expr *operand) {
-  struct Expr *e = my_malloc(72);
+  struct Expr *e = ast_alloc(80);
+  e->ty = 0;
   e->kind = ND_POSTDEC;
   e->left = operand;
   return e;
 }
 
 struct Expr *new_ternary(struct Expr *cond, struct Expr *then_e, struct Expr *else_e) {
-  struct Expr *e = my_malloc(72);
+  struct Expr *e = ast_alloc(80);
+  e->ty = 0;
   e->kind = ND_TERNARY;
   e->left = cond;
   e->right = then_e;
@@ -2747,14 +4008,14 @@ struct Expr *new_ternary(struct Expr *cond, struct Expr *then_e, struct Expr *el
 }
 
 struct Stmt *new_return_s(struct Expr *e) {
-  struct Stmt *s = my_malloc(144);
+  struct Stmt *s = ast_alloc(144);
   s->kind = ST_RETURN;
   s->expr = e;
   return s;
 }
 
 struct Stmt *new_if_s(struct Expr *cond, struct Stmt **body, int nbody, struct Stmt **body2, int nbody2) {
-  struct Stmt *s = my_malloc(144);
+  struct Stmt *s = ast_alloc(144);
   s->kind = ST_IF;
   s->expr = cond;
   s->body = body;
@@ -2765,7 +4026,7 @@ struct Stmt *new_if_s(struct Expr *cond, struct Stmt **body, int nbody, struct S
 }
 
 struct Stmt *new_while_s(struct Expr *cond, struct Stmt **body, int nbody) {
-  struct Stmt *s = my_malloc(144);
+  struct Stmt *s = ast_alloc(144);
   s->kind = ST_WHILE;
   s->expr = cond;
   s->body = body;
@@ -2774,7 +4035,7 @@ struct Stmt *new_while_s(struct Expr *cond, struct Stmt **body, int nbody) {
 }
 
 struct Stmt *new_for_s(struct Stmt *init, struct Expr *cond, struct Expr *post, struct Stmt **body, int nbody) {
-  struct Stmt *s = my_malloc(144);
+  struct Stmt *s = ast_alloc(144);
   s->kind = ST_FOR;
   s->init = init;
   s->expr = cond;
@@ -2785,26 +4046,26 @@ struct Stmt *new_for_s(struct Stmt *init, struct Expr *cond, struct Expr *post,
 }
 
 struct Stmt *new_break_s() {
-  struct Stmt *s = my_malloc(144);
+  struct Stmt *s = ast_alloc(144);
   s->kind = ST_BREAK;
   return s;
 }
 
 struct Stmt *new_continue_s() {
-  struct Stmt *s = my_malloc(144);
+  struct Stmt *s = ast_alloc(144);
   s->kind = ST_CONTINUE;
   return s;
 }
 
 struct Stmt *new_expr_s(struct Expr *e) {
-  struct Stmt *s = my_malloc(144);
+  struct Stmt *s = ast_alloc(144);
   s->kind = ST_EXPR;
   s->expr = e;
   return s;
 }
 
 struct Stmt *new_vardecl_s(struct VarDecl **decls, int ndecls) {
-  struct Stmt *s = my_malloc(144);
+  struct Stmt *s = ast_alloc(144);
   s->kind = ST_VARDECL;
   s->decls = decls;
   s->ndecls = ndecls;
@@ -2812,7 +4073,7 @@ struct Stmt *new_vardecl_s(struct VarDecl **decls, int ndecls) {
 }
 
 struct Stmt *new_dowhile_s(struct Expr *cond, struct Stmt **body, int nbody) {
-  struct Stmt *s = my_malloc(144);
+  struct Stmt *s = ast_alloc(144);
   s->kind = ST_DOWHILE;
   s->expr = cond;
   s->body = body;
@@ -2821,14 +4082,14 @@ struct Stmt *new_dowhile_s(struct Expr *cond, struct Stmt **body, int nbody) {
 }
 
 struct Stmt *new_goto_s(int *label) {
-  struct Stmt *s = my_malloc(144);
+  struct Stmt *s = ast_alloc(144);
   s->kind = ST_GOTO;
   s->sval = my_strdup(label);
   return s;
 }
 
 struct Stmt *new_label_s(int *label, struct Stmt *following) {
-  struct Stmt *s = my_malloc(144);
+  struct Stmt *s = ast_alloc(144);
   s->kind = ST_LABEL;
   s->sval = my_strdup(label);
   s->body = my_malloc(8);
@@ -2838,7 +4099,7 @@ struct Stmt *new_label_s(int *label, struct Stmt *following) {
 }
 
 struct Stmt *new_switch_s(struct Expr *cond, int *case_vals, struct Stmt ***case_bodies, int *case_nbodies, int ncases, struct Stmt **default_body, int ndefault) {
-  struct Stmt *s = my_malloc(144);
+  struct Stmt *s = ast_alloc(144);
   s->kind = ST_SWITCH;
   s->expr = cond;
   s->case_vals = case_vals;
@@ -2852,6 +4113,21 @@ struct Stmt *new_switch_s(struct Expr *cond, int *case_vals, struct Stmt ***case
 
 // ---- Parser ----
 
+// Inline keywords and attributes seen on the current top-level declaration:
+// 0 none, 1 inline, 2 always_inline, -1 noinline (which wins)
+int p_inline_hint;
+
+int p_note_inline() {
+  if (p_inline_hint == 0) { p_inline_hint = 1; }
+  return 0;
+}
+
+int p_note_inline_attr(int *name) {
+  if (my_strcmp(name, "noinline") == 0 || my_strcmp(name, "__noinline__") == 0) { p_inline_hint = 0 - 1; }
+  else if ((my_strcmp(name, "always_inline") == 0 || my_strcmp(name, "__always_inline__") == 0) && p_inline_hint >= 0) { p_inline_hint = 2; }
+  return 0;
+}
+
 int skip_qualifiers() {
   int skipped = 0;
   while (1) {
@@ -2875,6 +4151,7 @@ int skip_qualifiers() {
       }
       skipped = 1;
     } else if (p_match(TK_KW, "__extension__") || p_match(TK_KW, "__inline__") || p_match(TK_KW, "__inline") || p_match(TK_KW, "inline") || p_match(TK_KW, "_Noreturn")) {
+      p_note_inline();
       cur_pos++;
       skipped = 1;
     } else if (p_match(TK_OP, "[") && cur_pos + 1 < ntokens && my_strcmp(tok[cur_pos + 1].val, "[") == 0) {
@@ -2902,12 +4179,13 @@ int skip_attribute() {
       while (cur_pos < ntokens) {
         if (p_match(TK_OP, "(")) { depth++; cur_pos++; }
         else if (p_match(TK_OP, ")")) { depth--; cur_pos++; if (depth == 0) break; }
-        else { cur_pos++; }
+        else { p_note_inline_attr(tok[cur_pos].val); cur_pos++; }
       }
     }
     return 1;
   }
   if (p_match(TK_KW, "__extension__") || p_match(TK_KW, "__inline__") || p_match(TK_KW, "__inline") || p_match(TK_KW, "inline") || p_match(TK_KW, "_Noreturn")) {
+    p_note_inline();
     cur_pos++;
     return 1;
   }
@@ -2934,94 +4212,73 @@ int skip_param_list() {
 }
 
 int *find_typedef(int *name) {
-  int i = ntd - 1;
-  while (i >= 0) {
-    if (my_strcmp(td[i].name, name) == 0) {
-      return td[i].stype;
-    }
-    i--;
+  int i = nx_last(td_ix, name);
+  if (i >= 0) {
+    return td[i].stype;
   }
   return 0;
 }
 
 int has_typedef(int *name) {
-  for (int i = 0; i < ntd; i++) {
-    if (my_strcmp(td[i].name, name) == 0) {
-      return 1;
-    }
+  int i = nx_first(td_ix, name);
+  if (i >= 0) {
+    return 1;
   }
   return 0;
 }
 
 int td_lookup_is_char(int *name) {
-  int i = ntd - 1;
-  while (i >= 0) {
-    if (my_strcmp(td[i].name, name) == 0) {
-      return td[i].is_char ? (td[i].is_unsigned ? 2 : 1) : 0;
-    }
-    i--;
+  int i = nx_last(td_ix, name);
+  if (i >= 0) {
+    return td[i].is_char ? (td[i].is_unsigned ? 2 : 1) : 0;
   }
   return 0;
 }
 
 int td_lookup_is_funcptr(int *name) {
-  int i = ntd - 1;
-  while (i >= 0) {
-    if (my_strcmp(td[i].name, name) == 0) {
-      return td[i].is_funcptr;
-    }
-    i--;
+  int i = nx_last(td_ix, name);
+  if (i >= 0) {
+    return td[i].is_funcptr;
   }
   return 0;
 }
 
 int td_lookup_is_long(int *name) {
-  int i = ntd - 1;
-  while (i >= 0) {
-    if (my_strcmp(td[i].name, name) == 0) {
-      return td_is_long[i];
-    }
-    i--;
+  int i = nx_last(td_ix, name);
+  if (i >= 0) {
+    return td_is_long[i];
   }
   return 0;
 }
 
 int td_lookup_is_short(int *name) {
-  int i = ntd - 1;
-  while (i >= 0) {
-    if (my_strcmp(td[i].name, name) == 0) {
-      return td_is_short[i];
-    }
-    i--;
+  int i = nx_last(td_ix, name);
+  if (i >= 0) {
+    return td_is_short[i];
   }
   return 0;
 }
 
 int td_lookup_is_unsigned(int *name) {
-  int i = ntd - 1;
-  while (i >= 0) {
-    if (my_strcmp(td[i].name, name) == 0) {
-      return td_is_unsigned[i];
-    }
-    i--;
+  int i = nx_last(td_ix, name);
+  if (i >= 0) {
+    return td_is_unsigned[i];
   }
   return 0;
 }
 
 int td_lookup_is_ptr(int *name) {
-  int i = ntd - 1;
-  while (i >= 0) {
-    if (my_strcmp(td[i].name, name) == 0) {
-      return td_is_ptr[i];
-    }
-    i--;
+  int i = nx_last(td_ix, name);
+  if (i >= 0) {
+    return td_is_ptr[i];
   }
   return 0;
 }
 
 int add_typedef(int *name, int *stype) {
   if (ntd >= MAX_TYPEDEFS) { printf("cc: OVERFLOW td_name ntd=%d name=%s\n", ntd, name); fflush(0); }
-  td[ntd].name = my_strdup(name);
+  td[ntd].name = atom(name);
+  nx_add(td_ix, td[ntd].name, ntd);
   if (stype != 0) {
     td[ntd].stype = my_strdup(stype);
   } else {
@@ -3207,12 +4464,13 @@ int *parse_base_type() {
       p_eat(TK_OP, "}");
       // Register in parser's struct table
       struct SDefInfo *asdi = my_malloc(48);
-      asdi->name = my_strdup(synth_name);
+      asdi->name = atom(synth_name);
       asdi->flds = aflds;
       asdi->nflds = anf;
       asdi->nwords = 0;
       asdi->is_union = is_union_kw;
       p_sdefs[np_sdefs] = asdi;
+      nx_add(sdef_ix, asdi->name, np_sdefs);
       np_sdefs++;
       // Register for codegen
       struct SDef *asd = my_malloc(128);
@@ -3315,12 +4573,13 @@ int *parse_base_type() {
       }
       p_eat(TK_OP, "}");
       struct SDefInfo *lsdi = my_malloc(48);
-      lsdi->name = my_strdup(name);
+      lsdi->name = atom(name);
       lsdi->flds = lflds;
       lsdi->nflds = lnf;
       lsdi->nwords = 0;
       lsdi->is_union = is_union_kw;
       p_sdefs[np_sdefs] = lsdi;
+      nx_add(sdef_ix, lsdi->name, np_sdefs);
       np_sdefs++;
       struct SDef *lsd = my_malloc(128);
       lsd->name = my_strdup(name);
@@ -3420,9 +4679,18 @@ struct Stmt *parse_stmt();
 
 struct Stmt **parse_block(int *out_len) {
   p_eat(TK_OP, "{");
-  struct Stmt **stmts = my_malloc(512 * 8);
+  // Most blocks are short: start small and double as statements arrive
+  int cap = 8;
+  struct Stmt **stmts = my_malloc(cap * 8);
   int n = 0;
   while (!p_match(TK_OP, "}")) {
+    if (n >= cap) {
+      int new_cap = cap * 2;
+      struct Stmt **new_stmts = my_malloc(new_cap * 8);
+      for (int ri = 0; ri < n; ri++) { new_stmts[ri] = stmts[ri]; }
+      stmts = new_stmts;
+      cap = new_cap;
+    }
     stmts[n] = parse_stmt();
     n++;
   }
@@ -3446,7 +4714,7 @@ struct Stmt **parse_block_or_stmt(int *out_len) {
 int parse_const_expr();
 
 struct VarDecl *make_vd(int *name, int *stype, int arr_size, int is_ptr, struct Expr *init, int is_static) {
-  struct VarDecl *vd = my_malloc(96);
+  struct VarDecl *vd = my_malloc(104);
   vd->name = name;
   vd->stype = stype;
   vd->arr_size = arr_size;
@@ -3459,6 +4727,7 @@ struct VarDecl *make_vd(int *name, int *stype, int arr_size, int is_ptr, struct
   vd->is_float = 0;
   vd->is_short = 0;
   vd->is_long = 0;
+  vd->is_const = 0;
   return vd;
 }
 
@@ -3546,7 +4815,8 @@ struct Expr *parse_init_list(int *stype_name) {
     break;
   }
   p_eat(TK_OP, "}");
-  struct Expr *e = my_malloc(80);
+  struct Expr *e = ast_alloc(80);
+  e->ty = 0;
   e->kind = ND_INITLIST;
   e->args = elems;
   e->nargs = nelems;
@@ -3574,9 +4844,16 @@ struct Stmt *parse_vardecl_stmt(int vd_is_static) {
   int base_is_short = 0;
   int base_is_long = 0;
   int base_td_is_ptr = 0;
+  int base_is_const = 0;
   // Check if base type is char or float/double/short/long (before parse_base_type consumes it)
   {
     int sv = cur_pos;
+    // Only a plain "const int" is a candidate for constant propagation
+    while (tok[cur_pos].kind == TK_KW && (my_strcmp(tok[cur_pos].val, "const") == 0 || my_strcmp(tok[cur_pos].val, "static") == 0)) {
+      if (my_strcmp(tok[cur_pos].val, "const") == 0) { base_is_const = 1; }
+      cur_pos++;
+    }
+    if (p_match(TK_KW, "int") == 0) { base_is_const = 0; }
     skip_qualifiers();
     if (p_match(TK_KW, "char")) { base_is_char = 1; }
     else if (p_match(TK_KW, "float") || p_match(TK_KW, "double")) { base_is_float = 1; }
@@ -3602,7 +4879,7 @@ struct Stmt *parse_vardecl_stmt(int vd_is_static) {
   // Standalone struct/union definition: struct Name { ... };
   if (stype != 0 && p_match(TK_OP, ";")) {
     p_eat(TK_OP, ";");
-    struct Stmt *nop = my_malloc(144);
+    struct Stmt *nop = ast_alloc(144);
     nop->kind = ST_EXPR;
     nop->expr = new_num(0);
     return nop;
@@ -3720,6 +4997,7 @@ struct Stmt *parse_vardecl_stmt(int vd_is_static) {
     decls[ndecls]->is_short = base_is_short;
     decls[ndecls]->is_long = base_is_long;
     decls[ndecls]->is_unsigned = base_unsigned;
+    decls[ndecls]->is_const = base_is_const && is_ptr == 0;
     if (last_type_is_short) { decls[ndecls]->is_short = 1; }
     if (last_type_is_long) { decls[ndecls]->is_long = 1; }
     if (last_type_unsigned) { decls[ndecls]->is_unsigned = 1; }
@@ -4080,7 +5358,8 @@ struct Expr *parse_unary() {
       // Check for compound literal: (struct/union type){...}
       if (cl_stype != 0 && p_match(TK_OP, "{")) {
         struct Expr *cl_init = parse_init_list(cl_stype);
-        struct Expr *cl_e = my_malloc(80);
+        struct Expr *cl_e = ast_alloc(80);
+        cl_e->ty = 0;
         cl_e->kind = ND_COMPOUND_LIT;
         cl_e->sval = cl_stype;
         cl_e->left = cl_init;
@@ -4093,7 +5372,8 @@ struct Expr *parse_unary() {
           e = cl_init->args[0];
         } else {
           // Multi-element: treat as compound literal with no struct type
-          struct Expr *cl_e = my_malloc(80);
+          struct Expr *cl_e = ast_alloc(80);
+          cl_e->ty = 0;
           cl_e->kind = ND_COMPOUND_LIT;
           cl_e->sval = 0;
           cl_e->left = cl_init;
@@ -4101,7 +5381,8 @@ struct Expr *parse_unary() {
         }
       } else {
         struct Expr *cast_inner = parse_unary();
-        struct Expr *cast_e = my_malloc(80);
+        struct Expr *cast_e = ast_alloc(80);
+        cast_e->ty = 0;
         cast_e->kind = ND_CAST;
         cast_e->left = cast_inner;
         cast_e->sval = cl_stype;  // Store cast target struct type (or 0)
@@ -4122,7 +5403,8 @@ struct Expr *parse_unary() {
   } else if (p_match(TK_OP, "&&") && tok[cur_pos + 1].kind == TK_ID) {
     // Labels-as-values: &&label
     p_eat(TK_OP, "&&");
-    struct Expr *la = my_malloc(72);
+    struct Expr *la = ast_alloc(80);
+    la->ty = 0;
     la->kind = ND_LABEL_ADDR;
     la->sval = my_strdup(p_eat(TK_ID, 0));
     return la;
@@ -4159,28 +5441,25 @@ struct Expr *parse_unary() {
 }
 
 int find_enum_const(int *name) {
-  int i = 0;
-  while (i < nec) {
-    if (my_strcmp(ec_table[i].name, name) == 0) {
-      return ec_table[i].val;
-    }
-    i++;
+  int i = nx_first(ec_ix, name);
+  if (i >= 0) {
+    return ec_table[i].val;
   }
   return 0 - 1;
 }
 
 int has_enum_const(int *name) {
-  for (int i = 0; i < nec; i++) {
-    if (my_strcmp(ec_table[i].name, name) == 0) {
-      return 1;
-    }
+  int i = nx_first(ec_ix, name);
+  if (i >= 0) {
+    return 1;
   }
   return 0;
 }
 
 int add_enum_const(int *name, int val) {
   if (nec >= MAX_ENUMS) { printf("cc: OVERFLOW ec_table nec=%d name=%s\n", nec, name); fflush(0); }
-  ec_table[nec].name = my_strdup(name);
+  ec_table[nec].name = atom(name);
+  nx_add(ec_ix, ec_table[nec].name, nec);
   ec_table[nec].val = val;
   nec++;
   return 0;
@@ -4196,7 +5475,7 @@ struct Expr *parse_primary() {
   if (k == TK_NUM) {
     p_eat(TK_NUM, 0);
     if (is_float_literal(v)) {
-      int flt_bits = str_to_double_bits(v);
+      long flt_bits = str_to_double_bits(v);
       e = new_num(flt_bits);
       e->nargs = 1; // mark as float literal
     } else {
@@ -4233,21 +5512,29 @@ struct Expr *parse_primary() {
       p_eat(TK_OP, "(");
       struct Expr *va_ap = parse_expr(0);
       p_eat(TK_OP, ",");
-      // Skip type argument
+      // Skip type argument, noting whether it is floating
       int va_depth = 0;
+      int va_fp = 0;
+      int va_ptr = 0;
       while (1) {
         if (p_match(TK_OP, "(")) { va_depth++; cur_pos++; }
         else if (p_match(TK_OP, ")")) {
           if (va_depth == 0) break;
           va_depth--; cur_pos++;
         }
-        else { cur_pos++; }
+        else {
+          if (p_match(TK_KW, "double") || p_match(TK_KW, "float")) { va_fp = 1; }
+          if (p_match(TK_OP, "*")) { va_ptr = 1; }
+          cur_pos++;
+        }
       }
       p_eat(TK_OP, ")");
-      // Treat as a call so codegen can handle it
+      // Treat as a call so codegen can handle it; the second argument says
+      // the value comes from the floating-point registers
       struct Expr **va_args = my_malloc(8 * 8);
       va_args[0] = va_ap;
-      e = new_call("__builtin_va_arg", va_args, 1);
+      va_args[1] = new_num(va_fp && !va_ptr);
+      e = new_call("__builtin_va_arg", va_args, 2);
     }
     // __builtin_va_end(ap) => no-op
     else if (my_strcmp(name, "__builtin_va_end") == 0) {
@@ -4330,11 +5617,12 @@ struct Expr *parse_primary() {
     int se_blen = 0;
     struct Stmt **se_body = parse_block(&se_blen);
     p_eat(TK_OP, ")");
-    struct Stmt *se_blk = my_malloc(144);
+    struct Stmt *se_blk = ast_alloc(144);
     se_blk->kind = ST_BLOCK;
     se_blk->body = se_body;
     se_blk->nbody = se_blen;
-    e = my_malloc(80);
+    e = ast_alloc(80);
+    e->ty = 0;
     e->kind = ND_STMT_EXPR;
     e->left = se_blk; // abuse left as Stmt* pointer
   } else if (p_match(TK_OP, "(")) {
@@ -4497,7 +5785,7 @@ struct Stmt *parse_stmt() {
 
   // Anonymous block
   if (p_match(TK_OP, "{")) {
-    struct Stmt *bs = my_malloc(144);
+    struct Stmt *bs = ast_alloc(144);
     bs->kind = ST_BLOCK;
     bs->body = parse_block(&blen);
     bs->nbody = blen;
@@ -4641,7 +5929,7 @@ struct Stmt *parse_stmt() {
     if (p_match(TK_OP, "*")) {
       // Computed goto: goto *expr;
       p_eat(TK_OP, "*");
-      struct Stmt *cgs = my_malloc(144);
+      struct Stmt *cgs = ast_alloc(144);
       cgs->kind = ST_COMPUTED_GOTO;
       cgs->expr = parse_expr(0);
       p_eat(TK_OP, ";");
@@ -5015,6 +6303,8 @@ struct SDef *parse_struct_or_union_def(int is_union) {
     }
     // parse array dimensions in struct fields
     int f_is_arr = 0;
+    int f_ndim = 0;
+    int f_row = 0;
     while (p_match(TK_OP, "[")) {
       p_eat(TK_OP, "[");
       int dim_n = 0;
@@ -5033,7 +6323,15 @@ struct SDef *parse_struct_or_union_def(int is_union) {
       }
       p_eat(TK_OP, "]");
       if (f_is_arr == 0) { f_is_arr = dim_n; }
-      else { f_is_arr = f_is_arr * dim_n; }
+      else { f_is_arr = f_is_arr * dim_n; f_row = f_row * dim_n; }
+      if (f_ndim == 1) { f_row = dim_n; }
+      f_ndim++;
+    }
+    if (f_ndim > 1 && nfld_row < MAX_FIELD_ROWS) {
+      fld_row_sname[nfld_row] = name;
+      fld_row_fname[nfld_row] = fname;
+      fld_row_len[nfld_row] = f_row;
+      nfld_row++;
     }
     while (skip_attribute()) {}
     // Bitfield: field : width (may be a constant expression)
@@ -5110,12 +6408,13 @@ struct SDef *parse_struct_or_union_def(int is_union) {
 
   // Register in parser struct defs
   struct SDefInfo *sdi = my_malloc(48);
-  sdi->name = my_strdup(name);
+  sdi->name = atom(name);
   sdi->flds = finfo;
   sdi->nflds = nf;
   sdi->nwords = 0;
   sdi->is_union = is_union;
   p_sdefs[np_sdefs] = sdi;
+  nx_add(sdef_ix, sdi->name, np_sdefs);
   np_sdefs++;
 
   // Build field_types array
@@ -5190,6 +6489,7 @@ struct SDef *parse_struct_or_union_def(int is_union) {
 
 struct FuncDef *parse_func() {
   nlv = 0;
+  nx_clear(lv_ix);
   struct FuncDef *fd = 0;
   int ret_is_float = 0;
   { int sv_rf = cur_pos; skip_qualifiers();
@@ -5488,7 +6788,7 @@ struct FuncDef *parse_func() {
   if (p_match(TK_OP, ";")) {
     p_eat(TK_OP, ";");
     // Store proto info: name and ret_is_ptr
-    fd = my_malloc(160);
+    fd = my_malloc(168);
     fd->name = name;
     fd->params = 0;
     fd->nparams = np;
@@ -5504,11 +6804,12 @@ struct FuncDef *parse_func() {
     fd->param_is_long = param_is_long;
     fd->param_is_short = param_is_short;
     if (ret_is_ptr == 0) { fd->ret_stype = ret_stype; }
-    if (ret_stype != 0) { struct_ret_names[n_struct_ret] = my_strdup(name); struct_ret_stypes[n_struct_ret] = my_strdup(ret_stype); n_struct_ret++; }
+    if (ret_stype != 0) { struct_ret_names[n_struct_ret] = atom(name); struct_ret_stypes[n_struct_ret] = my_strdup(ret_stype); n_struct_ret++; }
     fd->param_stypes = param_stypes;
     fd->param_is_float = param_is_float;
     fd->ret_is_float = ret_is_float;
     fd->is_static = 0;
+    fd->inline_hint = p_inline_hint;
     barechar_func_names[nbarechar_funcs] = my_strdup(name);
     barechar_param_data[nbarechar_funcs] = param_is_barechar;
     nbarechar_funcs++;
@@ -5516,9 +6817,10 @@ struct FuncDef *parse_func() {
   }
 
   int blen = 0;
+  int inline_hint = p_inline_hint;
   struct Stmt **body = parse_block(&blen);
 
-  fd = my_malloc(160);
+  fd = my_malloc(168);
   fd->name = name;
   fd->params = params;
   fd->nparams = np;
@@ -5534,11 +6836,12 @@ struct FuncDef *parse_func() {
   fd->param_is_long = param_is_long;
   fd->param_is_short = param_is_short;
   if (ret_is_ptr == 0) { fd->ret_stype = ret_stype; }
-  if (ret_stype != 0) { struct_ret_names[n_struct_ret] = my_strdup(name); struct_ret_stypes[n_struct_ret] = my_strdup(ret_stype); n_struct_ret++; }
+  if (ret_stype != 0) { struct_ret_names[n_struct_ret] = atom(name); struct_ret_stypes[n_struct_ret] = my_strdup(ret_stype); n_struct_ret++; }
   fd->param_stypes = param_stypes;
   fd->param_is_float = param_is_float;
   fd->ret_is_float = ret_is_float;
   fd->is_static = 0;
+  fd->inline_hint = inline_hint;
   barechar_func_names[nbarechar_funcs] = my_strdup(name);
   barechar_param_data[nbarechar_funcs] = param_is_barechar;
   nbarechar_funcs++;
@@ -5576,7 +6879,8 @@ struct GDecl *parse_global_decl_one(int *stype, int g_is_char) {
   // Register global struct variables for resolve_stype
   if (stype != 0) {
     if (nglv >= MAX_GLV) { printf("cc: OVERFLOW glv nglv=%d name=%s\n", nglv, name); fflush(0); }
-    glv[nglv].name = my_strdup(name);
+    glv[nglv].name = atom(name);
+    nx_add(glv_ix, glv[nglv].name, nglv);
     glv[nglv].stype = my_strdup(stype);
     glv[nglv].isptr = is_ptr;
     glv[nglv].arrsize = 0 - 1; // updated later when array_size is known
@@ -5662,7 +6966,8 @@ struct GDecl *parse_global_decl_one(int *stype, int g_is_char) {
 
   // Register global for sizeof lookups (if not already registered with stype above)
   if (stype == 0 && nglv < MAX_GLV) {
-    glv[nglv].name = my_strdup(name);
+    glv[nglv].name = atom(name);
+    nx_add(glv_ix, glv[nglv].name, nglv);
     glv[nglv].stype = 0;
     glv[nglv].isptr = is_ptr;
     glv[nglv].arrsize = array_size;
@@ -5881,6 +7186,7 @@ struct FuncDef *skip_funcptr_return() {
   fpr->ret_stype = 0;
   fpr->ret_is_float = 0;
   fpr->is_static = 0;
+  fpr->inline_hint = 0 - 1;  // parameters are not recorded
 
   if (p_match(TK_OP, ";")) {
     p_eat(TK_OP, ";");
@@ -6145,7 +7451,8 @@ int skip_extern_decl() {
     int *ext_name = tok[cur_pos].val;
     // Don't register if next token is '(' (that's a function prototype)
     if (cur_pos + 1 < ntokens && my_strcmp(tok[cur_pos + 1].val, "(") != 0) {
-      glv[nglv].name = my_strdup(ext_name);
+      glv[nglv].name = atom(ext_name);
+      nx_add(glv_ix, glv[nglv].name, nglv);
       if (ext_stype != 0) { glv[nglv].stype = my_strdup(ext_stype); } else { glv[nglv].stype = 0; }
       glv[nglv].isptr = 1;
       glv[nglv].arrsize = 0 - 1;
@@ -6164,12 +7471,13 @@ int skip_extern_decl() {
 
 void register_td_struct(int *sname, int **td_fields, struct SFieldInfo **td_finfo, int td_nf, int is_union, struct SDef **structs, int *ns_ptr) {
   struct SDefInfo *sdi = my_malloc(48);
-  sdi->name = my_strdup(sname);
+  sdi->name = atom(sname);
   sdi->flds = td_finfo;
   sdi->nflds = td_nf;
   sdi->nwords = 0;
   sdi->is_union = is_union;
   p_sdefs[np_sdefs] = sdi;
+  nx_add(sdef_ix, sdi->name, np_sdefs);
   np_sdefs++;
   int **ftypes = my_malloc(512 * 8);
   int fti = 0;
@@ -6547,6 +7855,9 @@ struct Program *parse_program() {
   np_sdefs = 0;
   nec = 0;
   ntd = 0;
+  nx_clear(sdef_ix);
+  nx_clear(ec_ix);
+  nx_clear(td_ix);
   // Built-in typedefs
   add_typedef("va_list", 0);
   add_typedef("__builtin_va_list", 0);
@@ -6629,9 +7940,10 @@ struct Program *parse_program() {
 
     // static/inline/__attribute__/__extension__ — skip keywords (any order)
     int top_is_static = 0;
+    p_inline_hint = 0;
     while (1) {
       if (p_match(TK_KW, "static")) { p_eat(TK_KW, "static"); top_is_static = 1; }
-      else if (p_match(TK_KW, "inline")) { p_eat(TK_KW, "inline"); }
+      else if (p_match(TK_KW, "inline")) { p_note_inline(); p_eat(TK_KW, "inline"); }
       else if (skip_attribute()) {}
       else { break; }
     }
@@ -6766,7 +8078,8 @@ struct Program *parse_program() {
             sv_gd2->stype = sv_stype; sv_gd2->is_char = 0; sv_gd2->is_unsigned = 0;
             sv_gd2->is_static = top_is_static; sv_gd2->is_short = 0; sv_gd2->is_long = 0;
             globals[ng] = sv_gd2; ng++;
-            glv[nglv].name = my_strdup(sv_name2);
+            glv[nglv].name = atom(sv_name2);
+            nx_add(glv_ix, glv[nglv].name, nglv);
             glv[nglv].stype = my_strdup(sv_stype);
             glv[nglv].isptr = sv_ptr2;
             glv[nglv].arrsize = 0 - 1;
@@ -6781,7 +8094,8 @@ struct Program *parse_program() {
           sv_gd->stype = sv_stype; sv_gd->is_char = 0; sv_gd->is_unsigned = 0;
           sv_gd->is_static = top_is_static; sv_gd->is_short = 0; sv_gd->is_long = 0;
           globals[ng] = sv_gd; ng++;
-          glv[nglv].name = my_strdup(sv_name);
+          glv[nglv].name = atom(sv_name);
+          nx_add(glv_ix, glv[nglv].name, nglv);
           glv[nglv].stype = my_strdup(sv_stype);
           glv[nglv].isptr = sv_ptr;
           glv[nglv].arrsize = sv_arr;
@@ -6859,7 +8173,8 @@ struct Program *parse_program() {
             sv_gd2->is_static = top_is_static; sv_gd2->is_short = 0; sv_gd2->is_long = 0;
             globals[ng] = sv_gd2; ng++;
             if (sv_stype != 0) {
-              glv[nglv].name = my_strdup(sv_name2);
+              glv[nglv].name = atom(sv_name2);
+              nx_add(glv_ix, glv[nglv].name, nglv);
               glv[nglv].stype = my_strdup(sv_stype);
               glv[nglv].isptr = sv_ptr2;
               glv[nglv].arrsize = 0 - 1;
@@ -6877,7 +8192,8 @@ struct Program *parse_program() {
           globals[ng] = sv_gd; ng++;
           // Register for resolve_stype
           if (sv_stype != 0) {
-            glv[nglv].name = my_strdup(sv_name);
+            glv[nglv].name = atom(sv_name);
+            nx_add(glv_ix, glv[nglv].name, nglv);
             glv[nglv].stype = my_strdup(sv_stype);
             glv[nglv].isptr = sv_ptr;
             glv[nglv].arrsize = sv_arr;
@@ -7077,135 +8393,161 @@ struct Program *parse_program() {
 // ---- Codegen ----
 
 int cg_is_local(int *name) {
-  int i = 0;
-  while (i < nlay) {
-    if (lay_name[i] != 0 && my_strcmp(lay_name[i], name) == 0) { return 1; }
-    i++;
-  }
+  int i = nx_first(lay_ix, name);
+  if (i >= 0) { return 1; }
   return 0;
 }
 
 int cg_is_global(int *name) {
   if (cg_is_local(name)) return 0;
-  int i = 0;
-  while (i < ncg_g) {
-    if (my_strcmp(cgg[i].name, name) == 0) { return 1; }
-    i++;
-  }
+  int i = nx_first(cgg_ix, name);
+  if (i >= 0) { return 1; }
   return 0;
 }
 
 int cg_global_is_array(int *name) {
   if (cg_is_local(name)) return 0;
-  int i = 0;
-  while (i < ncg_g) {
-    if (my_strcmp(cgg[i].name, name) == 0) { return cgg[i].is_array; }
-    i++;
-  }
+  int i = nx_first(cgg_ix, name);
+  if (i >= 0) { return cgg[i].is_array; }
   return 0;
 }
 
 int cg_global_esz(int *name) {
   if (cg_is_local(name)) return 0;
-  int i = 0;
-  while (i < ncg_g) {
-    if (my_strcmp(cgg[i].name, name) == 0) { return cgg[i].esz; }
-    i++;
-  }
+  int i = nx_first(cgg_ix, name);
+  if (i >= 0) { return cgg[i].esz; }
   return 0;
 }
 
 int cg_global_ptr_esz(int *name) {
   if (cg_is_local(name)) return 0;
-  int i = 0;
-  while (i < ncg_g) {
-    if (my_strcmp(cgg[i].name, name) == 0) { return cgg[i].ptr_esz; }
-    i++;
-  }
+  int i = nx_first(cgg_ix, name);
+  if (i >= 0) { return cgg[i].ptr_esz; }
   return 0;
 }
 
 int cg_global_is_bare_char_arr(int *name) {
   if (cg_is_local(name)) return 0;
-  int i = 0;
-  while (i < ncg_g) {
-    if (my_strcmp(cgg[i].name, name) == 0) { return cgg[i].is_bare_char_arr; }
-    i++;
-  }
+  int i = nx_first(cgg_ix, name);
+  if (i >= 0) { return cgg[i].is_bare_char_arr; }
   return 0;
 }
 
 int cg_global_is_unsigned(int *name) {
   if (cg_is_local(name)) return 0;
-  int i = 0;
-  while (i < ncg_g) {
-    if (my_strcmp(cgg[i].name, name) == 0) { return cgg_is_unsigned[i]; }
-    i++;
-  }
+  int i = nx_first(cgg_ix, name);
+  if (i >= 0) { return cgg_is_unsigned[i]; }
   return 0;
 }
 
 int func_returns_ptr(int *name) {
+  int *key = atom_find(name);
   int i = 0;
   while (i < n_ptr_ret) {
-    if (my_strcmp(ptr_ret_names[i], name) == 0) { return 1; }
+    if (ptr_ret_names[i] == key) { return 1; }
     i++;
   }
   return 0;
 }
 
 int func_returns_unsigned(int *name) {
+  int *key = atom_find(name);
   int i = 0;
   while (i < n_unsigned_ret) {
-    if (my_strcmp(unsigned_ret_names[i], name) == 0) { return 1; }
+    if (unsigned_ret_names[i] == key) { return 1; }
     i++;
   }
   return 0;
 }
 
 int *func_ret_stype(int *name) {
+  int *key = atom_find(name);
   int i = 0;
   while (i < n_struct_ret) {
-    if (my_strcmp(struct_ret_names[i], name) == 0) { return struct_ret_stypes[i]; }
+    if (struct_ret_names[i] == key) { return struct_ret_stypes[i]; }
     i++;
   }
   return 0;
 }
 
 int is_known_func(int *name) {
-  int i = 0;
-  while (i < nknown_funcs) {
-    if (my_strcmp(known_funcs[i], name) == 0) { return 1; }
-    i++;
-  }
+  int i = nx_first(known_ix, name);
+  if (i >= 0) { return 1; }
   return 0;
 }
 
 int is_defined_func(int *name) {
-  int i = 0;
-  while (i < ndefined_funcs) {
-    if (my_strcmp(defined_funcs[i], name) == 0) { return 1; }
-    i++;
-  }
+  int i = nx_first(defined_ix, name);
+  if (i >= 0) { return 1; }
   return 0;
 }
 
 int *cg_new_label(int *base) {
   label_id++;
   int *num = int_to_str(label_id);
-  int *tmp = build_str2("L_", base);
+  int *tmp = build_str2(lab_pfx, base);
   int *tmp2 = build_str2(tmp, "_");
   return build_str2(tmp2, num);
 }
 
+// Push x0 as an expression temporary
+int cg_push_tmp() {
+  int k = cg_tmp_depth - cg_tmp_base;
+  if (k < MAX_TMP_REGS) {
+    emit_s("\tmov\tx"); emit_num(12 + k); emit_line(", x0");
+  } else {
+    emit_line("\tstr\tx0, [sp, #-16]!");
+  }
+  cg_tmp_depth++;
+  return 0;
+}
+
+// Pop the innermost expression temporary into x<r>
+int cg_pop_tmp(int r) {
+  cg_tmp_depth--;
+  int k = cg_tmp_depth - cg_tmp_base;
+  if (k < MAX_TMP_REGS) {
+    emit_s("\tmov\tx"); emit_num(r); emit_s(", x"); emit_num(12 + k); emit_ch('\n');
+  } else {
+    emit_s("\tldr\tx"); emit_num(r); emit_line(", [sp], #16");
+  }
+  return 0;
+}
+
+// Before a call: spill live temp registers, return the old base
+int cg_save_tmps() {
+  int n = cg_tmp_depth - cg_tmp_base;
+  if (n > MAX_TMP_REGS) { n = MAX_TMP_REGS; }
+  int k = 0;
+  while (k + 1 < n) {
+    emit_s("\tstp\tx"); emit_num(12 + k); emit_s(", x"); emit_num(13 + k); emit_line(", [sp, #-16]!");
+    k = k + 2;
+  }
+  if (k < n) { emit_s("\tstr\tx"); emit_num(12 + k); emit_line(", [sp, #-16]!"); }
+  int old_base = cg_tmp_base;
+  cg_tmp_base = cg_tmp_depth;
+  return old_base;
+}
+
+// After a call: reload the temp registers spilled by cg_save_tmps
+int cg_restore_tmps(int old_base) {
+  int n = cg_tmp_base - old_base;
+  if (n > MAX_TMP_REGS) { n = MAX_TMP_REGS; }
+  cg_tmp_base = old_base;
+  int k = n;
+  if (k % 2 == 1) { k--; emit_s("\tldr\tx"); emit_num(12 + k); emit_line(", [sp], #16"); }
+  while (k > 0) {
+    k = k - 2;
+    emit_s("\tldp\tx"); emit_num(12 + k); emit_s(", x"); emit_num(13 + k); emit_line(", [sp], #16");
+  }
+  return 0;
+}
+
 int cg_find_slot(int *name) {
-  int i = 0;
+  int i = nx_first(lay_ix, name);
   if (name == 0) return 0 - 1;
-  while (i < nlay) {
-    if (lay_name[i] != 0 && my_strcmp(lay_name[i], name) == 0) {
-      return lay_off[i];
-    }
-    i++;
+  if (i >= 0) {
+    return lay_off[i];
   }
   return 0 - 1;
 }
@@ -7257,13 +8599,7 @@ int cg_struct_nfields(int *sname);
 // Resolve a struct name, trying typedef if direct match fails
 int *cg_resolve_sname(int *sname) {
   if (sname == 0) return 0;
-  int i = 0;
-  while (i < ncg_s) {
-    if (cg_sname[i] != 0 && my_strcmp(cg_sname[i], sname) == 0) {
-      return sname;
-    }
-    i++;
-  }
+  if (nx_first(cg_s_ix, sname) >= 0) return sname;
   // Try typedef resolution
   int *resolved = find_typedef(sname);
   if (resolved != 0 && my_strcmp(resolved, sname) != 0) {
@@ -7272,53 +8608,91 @@ int *cg_resolve_sname(int *sname) {
   return sname;
 }
 
-int cg_field_index(int *sname, int *fname) {
-  int i = 0;
-  int j = 0;
+// Field number of fname in struct si, or -1: the first field so named
+int cg_field_pos(int si, int *fname) {
+  if (fname == 0) return 0 - 1;
+  return nx_first(cg_s_fix[si], fname);
+}
+
+// Flattened slots taken by field j of struct si
+int cg_field_slot_span(int si, int j) {
+  int f_sl = 1;
+  if (cg_sfield_types[si][j] != 0) {
+    f_sl = cg_struct_nfields(cg_sfield_types[si][j]);
+  }
+  // Array fields occupy arr_size slots (or arr_size * nested_struct_size)
+  // Char arrays: ceil(arr_size / 8) slots
+  if (cg_s_fa[si] != 0 && cg_s_fa[si][j] > 0) {
+    if (cg_s_fc[si] != 0 && cg_s_fc[si][j]) {
+      f_sl = (cg_s_fa[si][j] + 7) / 8;
+    } else {
+      f_sl = f_sl * cg_s_fa[si][j];
+    }
+  }
+  return f_sl;
+}
+
+// First slot of each field of struct si, with the total after the last.
+// Built on first use, when every struct it embeds is registered.
+int *cg_struct_fslots(int si) {
+  if (cg_s_fslot[si] != 0) return cg_s_fslot[si];
+  int nf = cg_snfields[si];
+  int *fslot = perm_malloc((nf + 1) * 8);
   int slot = 0;
-  if (sname == 0 || fname == 0) return 0;
-  sname = cg_resolve_sname(sname);
-  while (i < ncg_s) {
-    if (cg_sname[i] != 0 && my_strcmp(cg_sname[i], sname) == 0) {
-      // For unions, all fields are at offset 0
-      if (cg_s_is_union[i]) { return 0; }
-      // Bitfield struct: use word_indices
-      if (cg_s_wi[i] != 0) {
-        int *wi_arr = cg_s_wi[i];
-        j = 0;
-        while (j < cg_snfields[i]) {
-          if (cg_sfields[i][j] != 0 && my_strcmp(cg_sfields[i][j], fname) == 0) {
-            return wi_arr[j];
-          }
-          j++;
-        }
-        printf("cc: field '%s' not found in bitfield struct '%s'\n", fname, sname); return 0;
-      }
-      slot = 0;
-      j = 0;
-      while (j < cg_snfields[i]) {
-        if (cg_sfields[i][j] != 0 && my_strcmp(cg_sfields[i][j], fname) == 0) {
-          return slot;
-        }
-        {
-          int f_sl = 1;
-          if (cg_sfield_types[i][j] != 0) {
-            f_sl = cg_struct_nfields(cg_sfield_types[i][j]);
-          }
-          if (cg_s_fa[i] != 0 && cg_s_fa[i][j] > 0) {
-            if (cg_s_fc[i] != 0 && cg_s_fc[i][j]) {
-              f_sl = (cg_s_fa[i][j] + 7) / 8;
-            } else {
-              f_sl = f_sl * cg_s_fa[i][j];
-            }
-          }
-          slot += f_sl;
-        }
-        j++;
+  for (int j = 0; j < nf; j++) {
+    fslot[j] = slot;
+    slot += cg_field_slot_span(si, j);
+  }
+  fslot[nf] = slot;
+  cg_s_fslot[si] = fslot;
+  return fslot;
+}
+
+// Char arrays packed into the slots of struct si, for initializer emission:
+// fills cg_s_ca_len and cg_s_ca_off once, sized to cg_struct_nfields
+int cg_struct_ca_map(int si) {
+  if (cg_s_ca_len[si] != 0) return 0;
+  int n = 1;
+  if (cg_s_is_union[si] == 0) { n = cg_s_nw[si]; }
+  int *fslot = cg_struct_fslots(si);
+  if (cg_s_is_union[si] == 0 && n <= 0) { n = fslot[cg_snfields[si]]; }
+  int *ca_len = perm_malloc((n + 1) * 8);
+  int *ca_off = perm_malloc((n + 1) * 8);
+  for (int k = 0; k < n; k++) { ca_len[k] = 0; ca_off[k] = 0; }
+  for (int j = 0; j < cg_snfields[si]; j++) {
+    if (cg_s_fa[si] != 0 && cg_s_fa[si][j] > 0 && cg_s_fc[si] != 0 && cg_s_fc[si][j]) {
+      int ca_nslots = (cg_s_fa[si][j] + 7) / 8;
+      int csi = 0;
+      while (csi < ca_nslots && (fslot[j] + csi) < n) {
+        ca_len[fslot[j] + csi] = cg_s_fa[si][j];
+        ca_off[fslot[j] + csi] = csi * 8;
+        csi++;
       }
-      printf("cc: field '%s' not found in struct '%s' (nfields=%d)\n", fname, sname, cg_snfields[i]); return 0;
     }
-    i++;
+  }
+  cg_s_ca_len[si] = ca_len;
+  cg_s_ca_off[si] = ca_off;
+  return 0;
+}
+
+int cg_field_index(int *sname, int *fname) {
+  if (sname == 0 || fname == 0) return 0;
+  sname = cg_resolve_sname(sname);
+  int i = nx_first(cg_s_ix, sname);
+  if (i >= 0) {
+    // For unions, all fields are at offset 0
+    if (cg_s_is_union[i]) { return 0; }
+    int j = cg_field_pos(i, fname);
+    // Bitfield struct: use word_indices
+    if (cg_s_wi[i] != 0) {
+      if (j >= 0) { return cg_s_wi[i][j]; }
+      printf("cc: field '%s' not found in bitfield struct '%s'\n", fname, sname); return 0;
+    }
+    if (j >= 0) {
+      int *fslot = cg_struct_fslots(i);
+      return fslot[j];
+    }
+    printf("cc: field '%s' not found in struct '%s' (nfields=%d)\n", fname, sname, cg_snfields[i]); return 0;
   }
   printf("cc: struct '%s' not found in codegen (field '%s') [in %s] ncg_s=%d\n", sname, fname, cg_cur_func_name, ncg_s);
   // Dump all known struct names for debugging
@@ -7337,160 +8711,72 @@ int cg_field_index(int *sname, int *fname) {
 int cg_field_is_array(int *sname, int *fname) {
   if (sname == 0 || fname == 0) return 0;
   sname = cg_resolve_sname(sname);
-  int i = 0;
-  while (i < ncg_s) {
-    if (cg_sname[i] != 0 && my_strcmp(cg_sname[i], sname) == 0) {
-      if (cg_s_fa[i] == 0) return 0;
-      int j = 0;
-      while (j < cg_snfields[i]) {
-        if (cg_sfields[i][j] != 0 && my_strcmp(cg_sfields[i][j], fname) == 0) {
-          return cg_s_fa[i][j];
-        }
-        j++;
-      }
-      return 0;
-    }
-    i++;
-  }
+  int i = nx_first(cg_s_ix, sname);
+  if (i < 0 || cg_s_fa[i] == 0) return 0;
+  int j = cg_field_pos(i, fname);
+  if (j >= 0) { return cg_s_fa[i][j]; }
   return 0;
 }
 
 int cg_field_is_char(int *sname, int *fname) {
   if (sname == 0 || fname == 0) return 0;
   sname = cg_resolve_sname(sname);
-  int i = 0;
-  while (i < ncg_s) {
-    if (cg_sname[i] != 0 && my_strcmp(cg_sname[i], sname) == 0) {
-      if (cg_s_fc[i] == 0) return 0;
-      int j = 0;
-      while (j < cg_snfields[i]) {
-        if (cg_sfields[i][j] != 0 && my_strcmp(cg_sfields[i][j], fname) == 0) {
-          return cg_s_fc[i][j];
-        }
-        j++;
-      }
-      return 0;
-    }
-    i++;
-  }
+  int i = nx_first(cg_s_ix, sname);
+  if (i < 0 || cg_s_fc[i] == 0) return 0;
+  int j = cg_field_pos(i, fname);
+  if (j >= 0) { return cg_s_fc[i][j]; }
   return 0;
 }
 
 int cg_field_is_unsigned(int *sname, int *fname) {
   sname = cg_resolve_sname(sname);
-  int i = 0;
-  while (i < ncg_s) {
-    if (my_strcmp(cg_sname[i], sname) == 0) {
-      int j = 0;
-      while (j < cg_snfields[i]) {
-        if (my_strcmp(cg_sfields[i][j], fname) == 0) {
-          return (cg_s_fu[i] != 0) ? cg_s_fu[i][j] : 0;
-        }
-        j++;
-      }
-      return 0;
-    }
-    i++;
-  }
+  int i = nx_first(cg_s_ix, sname);
+  if (i < 0 || cg_s_fu[i] == 0) return 0;
+  int j = cg_field_pos(i, fname);
+  if (j >= 0) { return cg_s_fu[i][j]; }
   return 0;
 }
 
 int cg_field_is_ptr(int *sname, int *fname) {
   if (sname == 0 || fname == 0) return 0;
   sname = cg_resolve_sname(sname);
-  int i = 0;
-  while (i < ncg_s) {
-    if (cg_sname[i] != 0 && my_strcmp(cg_sname[i], sname) == 0) {
-      if (cg_s_fp[i] == 0) return 0;
-      int j = 0;
-      while (j < cg_snfields[i]) {
-        if (cg_sfields[i][j] != 0 && my_strcmp(cg_sfields[i][j], fname) == 0) {
-          return cg_s_fp[i][j];
-        }
-        j++;
-      }
-      return 0;
-    }
-    i++;
-  }
+  int i = nx_first(cg_s_ix, sname);
+  if (i < 0 || cg_s_fp[i] == 0) return 0;
+  int j = cg_field_pos(i, fname);
+  if (j >= 0) { return cg_s_fp[i][j]; }
   return 0;
 }
 
 int cg_field_is_short(int *sname, int *fname) {
   if (sname == 0 || fname == 0) return 0;
   sname = cg_resolve_sname(sname);
-  int i = 0;
-  while (i < ncg_s) {
-    if (cg_sname[i] != 0 && my_strcmp(cg_sname[i], sname) == 0) {
-      if (cg_s_fsh[i] == 0) return 0;
-      int j = 0;
-      while (j < cg_snfields[i]) {
-        if (cg_sfields[i][j] != 0 && my_strcmp(cg_sfields[i][j], fname) == 0) {
-          return cg_s_fsh[i][j];
-        }
-        j++;
-      }
-      return 0;
-    }
-    i++;
-  }
+  int i = nx_first(cg_s_ix, sname);
+  if (i < 0 || cg_s_fsh[i] == 0) return 0;
+  int j = cg_field_pos(i, fname);
+  if (j >= 0) { return cg_s_fsh[i][j]; }
   return 0;
 }
 
 int cg_field_is_long(int *sname, int *fname) {
   if (sname == 0 || fname == 0) return 0;
   sname = cg_resolve_sname(sname);
-  int i = 0;
-  while (i < ncg_s) {
-    if (cg_sname[i] != 0 && my_strcmp(cg_sname[i], sname) == 0) {
-      if (cg_s_fl[i] == 0) return 0;
-      int j = 0;
-      while (j < cg_snfields[i]) {
-        if (cg_sfields[i][j] != 0 && my_strcmp(cg_sfields[i][j], fname) == 0) {
-          return cg_s_fl[i][j];
-        }
-        j++;
-      }
-      return 0;
-    }
-    i++;
-  }
+  int i = nx_first(cg_s_ix, sname);
+  if (i < 0 || cg_s_fl[i] == 0) return 0;
+  int j = cg_field_pos(i, fname);
+  if (j >= 0) { return cg_s_fl[i][j]; }
   return 0;
 }
 
 int cg_struct_nfields(int *sname) {
-  int i = 0;
-  int j = 0;
-  int total = 0;
   sname = cg_resolve_sname(sname);
-  while (i < ncg_s) {
-    if (my_strcmp(cg_sname[i], sname) == 0) {
-      // Unions: all fields overlap, allocate 1 slot
-      if (cg_s_is_union[i]) { return 1; }
-      // Bitfield struct: use nwords
-      if (cg_s_nw[i] > 0) { return cg_s_nw[i]; }
-      total = 0;
-      j = 0;
-      while (j < cg_snfields[i]) {
-        int f_slots = 1;
-        if (cg_sfield_types[i][j] != 0) {
-          f_slots = cg_struct_nfields(cg_sfield_types[i][j]);
-        }
-        // Array fields occupy arr_size slots (or arr_size * nested_struct_size)
-        // Char arrays: ceil(arr_size / 8) slots
-        if (cg_s_fa[i] != 0 && cg_s_fa[i][j] > 0) {
-          if (cg_s_fc[i] != 0 && cg_s_fc[i][j]) {
-            f_slots = (cg_s_fa[i][j] + 7) / 8;
-          } else {
-            f_slots = f_slots * cg_s_fa[i][j];
-          }
-        }
-        total += f_slots;
-        j++;
-      }
-      return total;
-    }
-    i++;
+  int i = nx_first(cg_s_ix, sname);
+  if (i >= 0) {
+    // Unions: all fields overlap, allocate 1 slot
+    if (cg_s_is_union[i]) { return 1; }
+    // Bitfield struct: use nwords
+    if (cg_s_nw[i] > 0) { return cg_s_nw[i]; }
+    int *fslot = cg_struct_fslots(i);
+    return fslot[cg_snfields[i]];
   }
   printf("cc: struct '%s' not found for nfields in %s\n", sname, cg_cur_func_name);
   return 1;
@@ -7498,12 +8784,9 @@ int cg_struct_nfields(int *sname) {
 
 int cg_struct_byte_size(int *sname) {
   sname = cg_resolve_sname(sname);
-  int i = 0;
-  while (i < ncg_s) {
-    if (my_strcmp(cg_sname[i], sname) == 0) {
-      return cg_s_bytesize[i];
-    }
-    i++;
+  int i = nx_first(cg_s_ix, sname);
+  if (i >= 0) {
+    return cg_s_bytesize[i];
   }
   printf("cc: struct '%s' not found for byte_size\n", sname);
   return 8;
@@ -7512,20 +8795,12 @@ int cg_struct_byte_size(int *sname) {
 int cg_field_byte_offset(int *sname, int *fname) {
   if (sname == 0 || fname == 0) return 0;
   sname = cg_resolve_sname(sname);
-  int i = 0;
-  while (i < ncg_s) {
-    if (cg_sname[i] != 0 && my_strcmp(cg_sname[i], sname) == 0) {
-      if (cg_s_fbyteoff[i] == 0) { printf("cc: WARNING: no byte offset table for struct '%s', falling back to fi*8\n", sname); return cg_field_index(sname, fname) * 8; }
-      int j = 0;
-      while (j < cg_snfields[i]) {
-        if (cg_sfields[i][j] != 0 && my_strcmp(cg_sfields[i][j], fname) == 0) {
-          return cg_s_fbyteoff[i][j];
-        }
-        j++;
-      }
-      return 0;
-    }
-    i++;
+  int i = nx_first(cg_s_ix, sname);
+  if (i >= 0) {
+    if (cg_s_fbyteoff[i] == 0) { printf("cc: WARNING: no byte offset table for struct '%s', falling back to fi*8\n", sname); return cg_field_index(sname, fname) * 8; }
+    int j = cg_field_pos(i, fname);
+    if (j >= 0) { return cg_s_fbyteoff[i][j]; }
+    return 0;
   }
   return 0;
 }
@@ -7533,41 +8808,20 @@ int cg_field_byte_offset(int *sname, int *fname) {
 int cg_field_byte_size(int *sname, int *fname) {
   if (sname == 0 || fname == 0) return 8;
   sname = cg_resolve_sname(sname);
-  int i = 0;
-  while (i < ncg_s) {
-    if (cg_sname[i] != 0 && my_strcmp(cg_sname[i], sname) == 0) {
-      if (cg_s_fbytesize[i] == 0) return 8;
-      int j = 0;
-      while (j < cg_snfields[i]) {
-        if (cg_sfields[i][j] != 0 && my_strcmp(cg_sfields[i][j], fname) == 0) {
-          return cg_s_fbytesize[i][j];
-        }
-        j++;
-      }
-      return 8;
-    }
-    i++;
-  }
+  int i = nx_first(cg_s_ix, sname);
+  if (i < 0 || cg_s_fbytesize[i] == 0) return 8;
+  int j = cg_field_pos(i, fname);
+  if (j >= 0) { return cg_s_fbytesize[i][j]; }
   return 8;
 }
 
 // Returns struct type of a field, or 0 if field is not a struct
 int *cg_field_struct_type(int *sname, int *fname) {
   sname = cg_resolve_sname(sname);
-  int i = 0;
-  while (i < ncg_s) {
-    if (my_strcmp(cg_sname[i], sname) == 0) {
-      int j = 0;
-      while (j < cg_snfields[i]) {
-        if (my_strcmp(cg_sfields[i][j], fname) == 0) {
-          return cg_sfield_types[i][j];
-        }
-        j++;
-      }
-      return 0;
-    }
-    i++;
-  }
+  int i = nx_first(cg_s_ix, sname);
+  if (i < 0) return 0;
+  int j = cg_field_pos(i, fname);
+  if (j >= 0) { return cg_sfield_types[i][j]; }
   return 0;
 }
 
@@ -7575,15 +8829,12 @@ int *cg_field_struct_type(int *sname, int *fname) {
 int cg_field_byte_offset_idx(int *sname, int fi) {
   if (sname == 0) { printf("cc: WARNING: cg_field_byte_offset_idx called with null sname, fi=%d\n", fi); return fi * 8; }
   sname = cg_resolve_sname(sname);
-  int i = 0;
-  while (i < ncg_s) {
-    if (my_strcmp(cg_sname[i], sname) == 0) {
-      if (cg_s_fbyteoff[i] != 0 && fi >= 0 && fi < cg_snfields[i])
-        return cg_s_fbyteoff[i][fi];
-      printf("cc: WARNING: no byte offset table for struct '%s' idx, falling back to fi*8\n", sname);
-      return fi * 8;
-    }
-    i++;
+  int i = nx_first(cg_s_ix, sname);
+  if (i >= 0) {
+    if (cg_s_fbyteoff[i] != 0 && fi >= 0 && fi < cg_snfields[i])
+      return cg_s_fbyteoff[i][fi];
+    printf("cc: WARNING: no byte offset table for struct '%s' idx, falling back to fi*8\n", sname);
+    return fi * 8;
   }
   printf("cc: WARNING: struct '%s' not found in cg_field_byte_offset_idx, falling back to fi*8\n", sname);
   return fi * 8;
@@ -7593,14 +8844,11 @@ int cg_field_byte_offset_idx(int *sname, int fi) {
 int cg_field_byte_size_idx(int *sname, int fi) {
   if (sname == 0) return 8;
   sname = cg_resolve_sname(sname);
-  int i = 0;
-  while (i < ncg_s) {
-    if (my_strcmp(cg_sname[i], sname) == 0) {
-      if (cg_s_fbytesize[i] != 0 && fi >= 0 && fi < cg_snfields[i])
-        return cg_s_fbytesize[i][fi];
-      return 8;
-    }
-    i++;
+  int i = nx_first(cg_s_ix, sname);
+  if (i >= 0) {
+    if (cg_s_fbytesize[i] != 0 && fi >= 0 && fi < cg_snfields[i])
+      return cg_s_fbytesize[i][fi];
+    return 8;
   }
   return 8;
 }
@@ -7609,14 +8857,11 @@ int cg_field_byte_size_idx(int *sname, int fi) {
 int *cg_field_type_idx(int *sname, int fi) {
   if (sname == 0) return 0;
   sname = cg_resolve_sname(sname);
-  int i = 0;
-  while (i < ncg_s) {
-    if (my_strcmp(cg_sname[i], sname) == 0) {
-      if (fi >= 0 && fi < cg_snfields[i])
-        return cg_sfield_types[i][fi];
-      return 0;
-    }
-    i++;
+  int i = nx_first(cg_s_ix, sname);
+  if (i >= 0) {
+    if (fi >= 0 && fi < cg_snfields[i])
+      return cg_sfield_types[i][fi];
+    return 0;
   }
   return 0;
 }
@@ -7626,55 +8871,41 @@ int *cg_field_type_idx(int *sname, int fi) {
 int cg_field_arr_elem_size(int *sname, int *fname) {
   if (sname == 0 || fname == 0) return 8;
   sname = cg_resolve_sname(sname);
+  int i = nx_first(cg_s_ix, sname);
+  if (i < 0) return 8;
+  int j = cg_field_pos(i, fname);
+  if (j < 0) return 8;
+  if (cg_s_fc[i] != 0 && cg_s_fc[i][j]) return 1;
+  if (cg_s_fct[i] != 0 && cg_s_fct[i][j]) return 1;
+  if (cg_s_fsh[i] != 0 && cg_s_fsh[i][j]) return 2;
+  if (cg_s_fp[i] != 0 && cg_s_fp[i][j]) return 8;
+  if (cg_s_fl[i] != 0 && cg_s_fl[i][j]) return 8;
+  if (cg_sfield_types[i][j] != 0) return cg_struct_byte_size(cg_sfield_types[i][j]);
+  return 4;
+}
+
+// Elements per row of a 2D array field (int data[3][4] -> 4), or 0 if not 2D
+int cg_field_row_len(int *sname, int *fname) {
+  if (sname == 0 || fname == 0 || nfld_row == 0) return 0;
+  sname = cg_resolve_sname(sname);
   int i = 0;
-  while (i < ncg_s) {
-    if (my_strcmp(cg_sname[i], sname) == 0) {
-      int j = 0;
-      while (j < cg_snfields[i]) {
-        if (cg_sfields[i][j] != 0 && my_strcmp(cg_sfields[i][j], fname) == 0) {
-          if (cg_s_fc[i] != 0 && cg_s_fc[i][j]) return 1;
-          if (cg_s_fct[i] != 0 && cg_s_fct[i][j]) return 1;
-          if (cg_s_fsh[i] != 0 && cg_s_fsh[i][j]) return 2;
-          if (cg_s_fp[i] != 0 && cg_s_fp[i][j]) return 8;
-          if (cg_s_fl[i] != 0 && cg_s_fl[i][j]) return 8;
-          if (cg_sfield_types[i][j] != 0) return cg_struct_byte_size(cg_sfield_types[i][j]);
-          return 4;
-        }
-        j++;
-      }
-      return 8;
-    }
+  while (i < nfld_row) {
+    if (my_strcmp(fld_row_sname[i], sname) == 0 && my_strcmp(fld_row_fname[i], fname) == 0) { return fld_row_len[i]; }
     i++;
   }
-  return 8;
+  return 0;
 }
 
 // Returns bit_width (0 if not a bitfield). Sets *out_bit_offset.
 int cg_get_bitfield_info(int *sname, int *fname, int *out_bit_offset) {
   sname = cg_resolve_sname(sname);
-  int i = 0;
-  int *bw_arr = 0;
-  int *bo_arr = 0;
-  while (i < ncg_s) {
-    if (my_strcmp(cg_sname[i], sname) == 0) {
-      bw_arr = cg_s_bw[i];
-      bo_arr = cg_s_bo[i];
-      if (bw_arr == 0) { *out_bit_offset = 0; return 0; }
-      int j = 0;
-      while (j < cg_snfields[i]) {
-        if (my_strcmp(cg_sfields[i][j], fname) == 0) {
-          *out_bit_offset = bo_arr[j];
-          return bw_arr[j];
-        }
-        j++;
-      }
-      *out_bit_offset = 0;
-      return 0;
-    }
-    i++;
-  }
+  int i = nx_first(cg_s_ix, sname);
   *out_bit_offset = 0;
-  return 0;
+  if (i < 0 || cg_s_bw[i] == 0) return 0;
+  int j = cg_field_pos(i, fname);
+  if (j < 0) return 0;
+  *out_bit_offset = cg_s_bo[i][j];
+  return cg_s_bw[i][j];
 }
 
 int *cg_intern_string(int *decoded) {
@@ -7686,11 +8917,13 @@ int *cg_intern_string(int *decoded) {
     }
     i++;
   }
+  int prev = arena_use(AR_PERM);
   int *num = int_to_str(nsp + 1);
-  int *lab = build_str2("l_.str_", num);
+  int *lab = build_str2(str_pfx, num);
   sp_decoded[nsp] = my_strdup(decoded);
   sp_label[nsp] = lab;
   nsp++;
+  arena_use(prev);
   return lab;
 }
 
@@ -7797,7 +9030,8 @@ int cg_emit_escaped_string(int *s) {
 
 // Layout computation
 int lay_add_slot(int *name, int off, int bsz) {
-  lay_name[nlay] = my_strdup(name);
+  lay_name[nlay] = atom(name);
+  nx_add(lay_ix, lay_name[nlay], nlay);
   lay_off[nlay] = off;
   lay_var_bsz[nlay] = bsz;
   nlay++;
@@ -7883,9 +9117,11 @@ int lay_walk_stmts(struct Stmt **stmts, int nstmts, int *offset) {
         }
         if (vd->is_static) {
           // Static local: record in static local table, use sentinel offset -1
+          int sl_prev = arena_use(AR_PERM);
           sl[nsl].name = my_strdup(vd->name);
           sl[nsl].func = my_strdup(cg_cur_func_name);
           sl[nsl].label = build_str2("_sl_", int_to_str(nsl));
+          arena_use(sl_prev);
           sl[nsl].has_init = 0;
           sl[nsl].init_val = 0;
           sl[nsl].init_list = 0;
@@ -8063,10 +9299,10 @@ int cg_is_barechar(int *name) {
   }
   // Check globals, but only if name is not a local variable
   if (cg_is_local(name) == 0) {
-    i = 0;
-    while (i < ncg_g) {
-      if (cgg[i].is_barechar && my_strcmp(cgg[i].name, name) == 0) { return cgg[i].is_barechar; }
-      i++;
+    i = nx_first(cgg_ix, name);
+    while (i >= 0) {
+      if (cgg[i].is_barechar) { return cgg[i].is_barechar; }
+      i = nx_next(cgg_ix, i);
     }
   }
   return 0;
@@ -8080,10 +9316,10 @@ int cg_is_char(int *name) {
   }
   // Check global char* variables, but only if name is not a local variable
   if (cg_is_local(name) == 0) {
-    i = 0;
-    while (i < ncg_g) {
-      if (cgg[i].is_char && my_strcmp(cgg[i].name, name) == 0) { return 1; }
-      i++;
+    i = nx_first(cgg_ix, name);
+    while (i >= 0) {
+      if (cgg[i].is_char) { return 1; }
+      i = nx_next(cgg_ix, i);
     }
   }
   return 0;
@@ -8097,10 +9333,10 @@ int cg_is_char_arr(int *name) {
   }
   // Also check global char* arrays, but only if name is not a local variable
   if (cg_is_local(name) == 0) {
-    i = 0;
-    while (i < ncg_g) {
-      if (cgg[i].is_char_arr && my_strcmp(cgg[i].name, name) == 0) { return 1; }
-      i++;
+    i = nx_first(cgg_ix, name);
+    while (i >= 0) {
+      if (cgg[i].is_char_arr) { return 1; }
+      i = nx_next(cgg_ix, i);
     }
   }
   return 0;
@@ -8108,21 +9344,15 @@ int cg_is_char_arr(int *name) {
 
 int *cg_global_stype(int *name) {
   if (cg_is_local(name)) return 0;
-  int i = 0;
-  while (i < ncg_g) {
-    if (my_strcmp(cgg[i].name, name) == 0) { return cgg[i].stype; }
-    i++;
-  }
+  int i = nx_first(cgg_ix, name);
+  if (i >= 0) { return cgg[i].stype; }
   return 0;
 }
 
 int *cg_global_ptr_stype(int *name) {
   if (cg_is_local(name)) return 0;
-  int i = 0;
-  while (i < ncg_g) {
-    if (my_strcmp(cgg[i].name, name) == 0) { return cgg[i].ptr_stype; }
-    i++;
-  }
+  int i = nx_first(cgg_ix, name);
+  if (i >= 0) { return cgg[i].ptr_stype; }
   return 0;
 }
 
@@ -8145,10 +9375,10 @@ int cg_is_intptr(int *name) {
   }
   // Check global int pointer variables, but only if name is not a local variable
   if (cg_is_local(name) == 0) {
-    i = 0;
-    while (i < ncg_g) {
-      if (cgg[i].is_intptr && my_strcmp(cgg[i].name, name) == 0) { return 1; }
-      i++;
+    i = nx_first(cgg_ix, name);
+    while (i >= 0) {
+      if (cgg[i].is_intptr) { return 1; }
+      i = nx_next(cgg_ix, i);
     }
   }
   return 0;
@@ -8216,28 +9446,156 @@ int func_returns_float(int *name) {
 }
 
 int cg_var_bsz(int *name) {
-  int i = nlay - 1;
-  while (i >= 0) {
-    if (my_strcmp(lay_name[i], name) == 0) { return lay_var_bsz[i]; }
-    i--;
+  int i = nx_last(lay_ix, name);
+  if (i >= 0) { return lay_var_bsz[i]; }
+  return 0;
+}
+
+// Callee-saved register holding a local, or 0 if it lives in memory
+int cg_var_reg(int *name) {
+  int li = lay_index(name);
+  if (li < 0) return 0;
+  return lay_reg[li];
+}
+
+// Move x0 into register local xR, extended the way a load of the slot would be
+int cg_set_var_reg(int r, int *name) {
+  int vbsz = cg_var_bsz(name);
+  int vu = cg_is_unsigned(name);
+  if (vbsz == 1 && vu) { emit_s("\tand\tx"); emit_num(r); emit_line(", x0, #255"); }
+  else if (vbsz == 1) { emit_s("\tsxtb\tx"); emit_num(r); emit_line(", w0"); }
+  else if (vbsz == 2 && vu) { emit_s("\tand\tx"); emit_num(r); emit_line(", x0, #65535"); }
+  else if (vbsz == 2) { emit_s("\tsxth\tx"); emit_num(r); emit_line(", w0"); }
+  else if (vbsz == 4 && vu) { emit_s("\tmov\tw"); emit_num(r); emit_line(", w0"); }
+  else if (vbsz == 4) { emit_s("\tsxtw\tx"); emit_num(r); emit_line(", w0"); }
+  else { emit_s("\tmov\tx"); emit_num(r); emit_line(", x0"); }
+  return 0;
+}
+
+// Save or restore the callee-saved registers used for locals
+int cg_emit_var_reg_saves(int *op1, int *op2) {
+  int k = 0;
+  int *base = "x29";
+  int boff = 0 - lay_save_off;
+  if (lay_save_off > 256) {
+    emit_sub_imm("x9", "x29", lay_save_off);
+    base = "x9";
+    boff = 0;
+  }
+  while (k < lay_nsave) {
+    if (k + 1 < lay_nsave) {
+      emit_s("\t"); emit_s(op2); emit_s("\tx"); emit_num(19 + k); emit_s(", x"); emit_num(20 + k);
+      k = k + 2;
+    } else {
+      emit_s("\t"); emit_s(op1); emit_s("\tx"); emit_num(19 + k);
+      k = k + 1;
+    }
+    emit_s(", ["); emit_s(base); emit_s(", #"); emit_num(boff); emit_line("]");
+    boff = boff + 16;
   }
   return 0;
 }
 
 int cg_global_var_bsz(int *name) {
-  int i = 0;
-  while (i < ncg_g) {
-    if (my_strcmp(cgg[i].name, name) == 0) { return cgg_var_bsz[i]; }
-    i++;
-  }
+  int i = nx_first(cgg_ix, name);
+  if (i >= 0) { return cgg_var_bsz[i]; }
   return 0;
 }
 
-// Check if an expression evaluates to a long/pointer (64-bit) type
+// Value of a statement expression: its final expression statement, or 0
+struct Expr *cg_stmt_expr_value(struct Expr *e) {
+  struct Stmt *se_blk = e->left;
+  if (se_blk == 0 || se_blk->kind != ST_BLOCK || se_blk->nbody < 1) return 0;
+  struct Stmt *last = se_blk->body[se_blk->nbody - 1];
+  if (last == 0 || last < 4096 || last == (0 - 1) || last->kind != ST_EXPR) return 0;
+  return last->expr;
+}
+
+// ---- Expression types ----
+// Codegen asks the same type questions of a node many times over: every
+// a[i] walks the char, array, field and pointer tables, and the expr_is_*
+// predicates re-walk whole subtrees.  Each answer is worked out once and kept
+// on the node.  The answers depend on the current function's layout tables,
+// so they hold for one epoch; layout_func starts a new one.
+struct ExprType {
+  int epoch;
+  int is_unsigned; // -1 until asked
+  int is_long;
+  int is_float;
+  int load_bsz;
+  int load_unsigned;
+};
+
+int ty_epoch = 1;
+
+int ty_new_epoch() {
+  ty_epoch++;
+  return 0;
+}
+
+struct ExprType *ty_of(struct Expr *e) {
+  struct ExprType *t = e->ty;
+  if (t == 0) {
+    t = perm_malloc(48);
+    e->ty = t;
+    t->epoch = 0;
+  }
+  if (t->epoch != ty_epoch) {
+    t->epoch = ty_epoch;
+    t->is_unsigned = 0 - 1;
+    t->is_long = 0 - 1;
+    t->is_float = 0 - 1;
+    t->load_bsz = 0 - 1;
+    t->load_unsigned = 0;
+  }
+  return t;
+}
+
+int ty_unsigned(struct Expr *e);
+int ty_long(struct Expr *e);
+int ty_float(struct Expr *e);
+int ty_index_load_bsz(struct Expr *e, int *is_unsigned);
+
 int expr_is_unsigned(struct Expr *e) {
   if (e == 0) return 0;
+  struct ExprType *t = ty_of(e);
+  if (t->is_unsigned < 0) { t->is_unsigned = ty_unsigned(e); }
+  return t->is_unsigned;
+}
+
+// Check if an expression evaluates to a long/pointer (64-bit) type
+int expr_is_long(struct Expr *e) {
+  if (e == 0) return 0;
+  struct ExprType *t = ty_of(e);
+  if (t->is_long < 0) { t->is_long = ty_long(e); }
+  return t->is_long;
+}
+
+// Check if an expression evaluates to a float type
+int expr_is_float(struct Expr *e) {
+  if (e == 0) return 0;
+  struct ExprType *t = ty_of(e);
+  if (t->is_float < 0) { t->is_float = ty_float(e); }
+  return t->is_float;
+}
+
+// Load width for an ND_INDEX rvalue, or 0 when the element is an
+// aggregate and the value is its address
+int cg_index_load_bsz(struct Expr *e, int *is_unsigned) {
+  struct ExprType *t = ty_of(e);
+  if (t->load_bsz < 0) {
+    int u = 0;
+    t->load_bsz = ty_index_load_bsz(e, &u);
+    t->load_unsigned = u;
+  }
+  *is_unsigned = t->load_unsigned;
+  return t->load_bsz;
+}
+
+int ty_unsigned(struct Expr *e) {
   if (e->kind == ND_VAR) return cg_is_unsigned(e->sval);
   if (e->kind == ND_CALL) return func_returns_unsigned(e->sval);
+  if (e->kind == ND_STMT_EXPR) return expr_is_unsigned(cg_stmt_expr_value(e));
   if (e->kind == ND_CAST && (e->ival == 4 || e->ival == 6 || e->ival == 7)) return 1;
   if (e->kind == ND_BINARY) {
     if (expr_is_unsigned(e->left) || expr_is_unsigned(e->right)) return 1;
@@ -8246,25 +9604,30 @@ int expr_is_unsigned(struct Expr *e) {
   return 0;
 }
 
-int expr_is_long(struct Expr *e) {
-  if (e == 0) return 0;
+int ty_long(struct Expr *e) {
   if (e->kind == ND_VAR) return cg_is_long_or_ptr(e->sval);
   if (e->kind == ND_CALL) return func_returns_long_or_ptr(e->sval);
+  if (e->kind == ND_STMT_EXPR) return expr_is_long(cg_stmt_expr_value(e));
   if (e->kind == ND_UNARY && e->sval != 0 && e->sval[0] == '&') return 1;
   if (e->kind == ND_STRLIT) return 1;
   if (e->kind == ND_CAST && e->ival == 2) return 1;
   if (e->kind == ND_BINARY) {
     if (expr_is_long(e->left) || expr_is_long(e->right)) return 1;
   }
+  // Elements of long and pointer arrays are loaded as 64-bit values
+  if (e->kind == ND_INDEX && e->left != 0 && e->left->kind == ND_VAR) {
+    int idx_unsigned = 0;
+    return cg_index_load_bsz(e, &idx_unsigned) == 8;
+  }
   return 0;
 }
 
-// Check if an expression evaluates to a float type
-int expr_is_float(struct Expr *e) {
-  if (e == 0) return 0;
+int ty_float(struct Expr *e) {
   if (e->kind == ND_NUM && e->nargs == 1) return 1; // float literal (nargs=1 as marker)
   if (e->kind == ND_VAR && cg_is_float(e->sval)) return 1;
   if (e->kind == ND_CALL && func_returns_float(e->sval)) return 1;
+  if (e->kind == ND_CALL && e->nargs == 2 && my_strcmp(e->sval, "__builtin_va_arg") == 0) return e->args[1]->ival;
+  if (e->kind == ND_STMT_EXPR) return expr_is_float(cg_stmt_expr_value(e));
   if (e->kind == ND_BINARY) {
     // Comparison operators always return int, even for float operands
     if (my_strcmp(e->sval2, "==") == 0 || my_strcmp(e->sval2, "!=") == 0 ||
@@ -8293,8 +9656,1145 @@ int cg_get_arr_inner(int *name) {
   return 0 - 1;
 }
 
-int layout_func(struct FuncDef *f) {
-  nlay = 0;
+// Register locals: count loop-weighted uses of each slot, rule out any
+// variable whose address escapes, then give the busiest scalars x19..x28.
+int lay_index(int *name) {
+  int i = nx_first(lay_ix, name);
+  if (name == 0) return 0 - 1;
+  if (i >= 0) { return i; }
+  return 0 - 1;
+}
+
+int lay_reg_note(int *name, int w) {
+  int li = lay_index(name);
+  if (li < 0 || lay_reg_uses[li] < 0) return 0;
+  if (w < 0) { lay_reg_uses[li] = 0 - 1; return 0; }
+  lay_reg_uses[li] = lay_reg_uses[li] + w;
+  return 0;
+}
+
+int lay_reg_walk_expr(struct Expr *e, int w) {
+  int ci = 0;
+  if (e == 0 || e < 4096) return 0;
+  if (e->kind == ND_VAR) {
+    lay_reg_note(e->sval, w);
+  } else if (e->kind == ND_UNARY && e->ival == '&') {
+    if (e->left != 0 && e->left->kind == ND_VAR) { lay_reg_note(e->left->sval, 0 - 1); }
+    lay_reg_walk_expr(e->left, w);
+  } else if (e->kind == ND_FIELD) {
+    if (e->left != 0 && e->left->kind == ND_VAR) { lay_reg_note(e->left->sval, 0 - 1); }
+    lay_reg_walk_expr(e->left, w);
+  } else if (e->kind == ND_CALL) {
+    if (e->sval != 0) {
+      if (my_strcmp(e->sval, "setjmp") == 0 || my_strcmp(e->sval, "_setjmp") == 0 ||
+          my_strcmp(e->sval, "sigsetjmp") == 0 || my_strcmp(e->sval, "vfork") == 0) {
+        lay_reg_ok = 0;
+      }
+      // va_* builtins take the address of their va_list operand
+      if (e->nargs > 0 && e->args[0] != 0 && e->args[0]->kind == ND_VAR &&
+          (my_strcmp(e->sval, "__builtin_va_start") == 0 || my_strcmp(e->sval, "__builtin_va_arg") == 0 ||
+           my_strcmp(e->sval, "__builtin_va_end") == 0 || my_strcmp(e->sval, "__builtin_va_copy") == 0)) {
+        lay_reg_note(e->args[0]->sval, 0 - 1);
+      }
+      lay_reg_note(e->sval, w);
+    }
+    ci = 0;
+    while (ci < e->nargs) {
+      lay_reg_walk_expr(e->args[ci], w);
+      ci++;
+    }
+  } else if (e->kind == ND_TERNARY) {
+    lay_reg_walk_expr(e->left, w);
+    lay_reg_walk_expr(e->right, w);
+    lay_reg_walk_expr(e->args[0], w);
+  } else if (e->kind == ND_INITLIST) {
+    ci = 0;
+    while (ci < e->nargs) {
+      lay_reg_walk_expr(e->args[ci], w);
+      ci++;
+    }
+  } else if (e->kind == ND_STMT_EXPR) {
+    struct Stmt *se_blk = e->left;
+    if (se_blk != 0 && se_blk->kind == ST_BLOCK) {
+      lay_reg_walk_stmts(se_blk->body, se_blk->nbody, w);
+    }
+  } else if (e->kind != ND_NUM && e->kind != ND_STRLIT && e->kind != ND_LABEL_ADDR) {
+    lay_reg_walk_expr(e->left, w);
+    lay_reg_walk_expr(e->right, w);
+  }
+  return 0;
+}
+
+int lay_reg_walk_stmts(struct Stmt **stmts, int nstmts, int w) {
+  int i = 0;
+  int lw = w;
+  if (lw < 4096) { lw = w * 4; }
+  while (i < nstmts) {
+    struct Stmt *st = stmts[i];
+    i++;
+    if (st == 0 || st < 4096 || st == (0 - 1)) continue;
+    if (st->kind == ST_VARDECL) {
+      for (int j = 0; j < st->ndecls; j++) {
+        struct VarDecl *vd = st->decls[j];
+        lay_reg_note(vd->name, w);
+        lay_reg_walk_expr(vd->init, w);
+        // Struct initialized from a variable copies out of its address
+        if (vd->stype != 0 && vd->is_ptr == 0 && vd->init != 0 && vd->init->kind == ND_VAR) {
+          lay_reg_note(vd->init->sval, 0 - 1);
+        }
+      }
+    } else if (st->kind == ST_IF) {
+      lay_reg_walk_expr(st->expr, w);
+      lay_reg_walk_stmts(st->body, st->nbody, w);
+      if (st->body2 != 0) { lay_reg_walk_stmts(st->body2, st->nbody2, w); }
+    } else if (st->kind == ST_WHILE || st->kind == ST_DOWHILE) {
+      lay_reg_walk_expr(st->expr, lw);
+      lay_reg_walk_stmts(st->body, st->nbody, lw);
+    } else if (st->kind == ST_FOR) {
+      if (st->init != 0) {
+        struct Stmt *arr[1];
+        arr[0] = st->init;
+        lay_reg_walk_stmts(arr, 1, w);
+      }
+      lay_reg_walk_expr(st->expr, lw);
+      lay_reg_walk_expr(st->expr2, lw);
+      lay_reg_walk_stmts(st->body, st->nbody, lw);
+    } else if (st->kind == ST_SWITCH) {
+      lay_reg_walk_expr(st->expr, w);
+      for (int ci = 0; ci < st->ncases; ci++) {
+        lay_reg_walk_stmts(st->case_bodies[ci], st->case_nbodies[ci], w);
+      }
+      if (st->default_body != 0) { lay_reg_walk_stmts(st->default_body, st->ndefault, w); }
+    } else if (st->kind == ST_LABEL || st->kind == ST_BLOCK) {
+      lay_reg_walk_stmts(st->body, st->nbody, w);
+    } else if (st->kind == ST_RETURN) {
+      lay_reg_walk_expr(st->expr, w);
+      // Struct returns hand back the address of the returned object
+      if (cg_cur_func_ret_stype != 0 && st->expr != 0 && st->expr->kind == ND_VAR) {
+        lay_reg_note(st->expr->sval, 0 - 1);
+      }
+    } else if (st->kind == ST_EXPR || st->kind == ST_COMPUTED_GOTO) {
+      lay_reg_walk_expr(st->expr, w);
+    }
+  }
+  return 0;
+}
+
+int lay_assign_regs(struct FuncDef *f, int *offset) {
+  int li = 0;
+  lay_nsave = 0;
+  lay_save_off = 0;
+  lay_reg_ok = 1;
+  while (li < nlay) {
+    lay_reg[li] = 0;
+    lay_reg_uses[li] = 0;
+    li++;
+  }
+  lay_reg_walk_stmts(f->body, f->nbody, 1);
+  if (lay_reg_ok == 0) return 0;
+  while (lay_nsave < var_regs) {
+    int best = 0 - 1;
+    li = 0;
+    while (li < nlay) {
+      // Only plain scalars in frame slots: no statics, stack params,
+      // arrays, struct values or compound literals
+      if (lay_reg[li] == 0 && lay_off[li] > 0 && lay_reg_uses[li] >= 2 &&
+          cg_is_array(lay_name[li]) == 0 && cg_is_structvar(lay_name[li]) == 0 &&
+          (best < 0 || lay_reg_uses[li] > lay_reg_uses[best])) {
+        best = li;
+      }
+      li++;
+    }
+    if (best < 0) break;
+    lay_reg[best] = 19 + lay_nsave;
+    lay_nsave++;
+  }
+  if (lay_nsave > 0) {
+    *offset = *offset + lay_nsave * 8;
+    lay_save_off = *offset;
+  }
+  return 0;
+}
+
+// ---- Inlining ----
+// Runs over the whole program after parsing, before any function is laid
+// out. A call to a small function becomes a statement expression holding a
+// copy of the callee's body: each parameter turns into a local initialized
+// from its argument, and the trailing return (or chain of `if (c) return x;`
+// ending in one) into a local of the return type that gives the value.
+// Callees must be static or declared inline, and must not be variadic,
+// recursive, noinline, or use gotos, static locals, local arrays, struct
+// values or float parameters. A size limit applies unless always_inline is
+// given. Copied locals get fresh names; a call site is left alone when a
+// caller local would hide a name the callee refers to. Static functions
+// whose calls were all expanded are dropped.
+
+int *inl_from[MAX_INLINE_NAMES];     // callee params and locals
+int *inl_to[MAX_INLINE_NAMES];       // their names in the copy
+int ninl;
+int *inl_written[MAX_INLINE_NAMES];  // callee names assigned, stepped or address-taken
+int ninl_written;
+int inl_ok;                          // cleared when a callee or call site does not qualify
+int inl_nodes;                       // callee size in statements and expressions
+int inl_value_ret;                   // callee's trailing returns give a value
+int *inl_self;                       // callee name, to reject recursion
+int inl_counter;                     // numbers the copies
+int inl_depth;                       // copies being expanded inside copies
+int *inl_cnames[MAX_LAYOUT];         // caller params and locals
+int ninl_cnames;
+int inl_added;                       // locals copies have added to the caller
+int inl_scan_refs;                   // inl_scan_*: 1 marks references, 0 collects local names
+struct FuncDef **inl_funcs;
+int *inl_cand;                       // indexes of functions that may be inlined
+int *inl_count;                      // per candidate: call sites expanded
+int *inl_used;                       // per candidate: still referenced
+int ninl_cand;
+
+int inl_candidate(struct FuncDef *f) {
+  if (f->nbody < 1 || f->is_variadic || f->inline_hint < 0 || f->nparams > 8) return 0;
+  if (f->is_static == 0 && f->inline_hint == 0) return 0;
+  if (f->ret_is_float || (f->ret_is_ptr == 0 && f->ret_stype != 0)) return 0;
+  if (my_strcmp(f->name, "main") == 0) return 0;
+  for (int i = 0; i < f->nparams; i++) {
+    if (f->param_stypes != 0 && f->param_stypes[i] != 0) return 0;
+    if (f->param_is_float != 0 && f->param_is_float[i]) return 0;
+  }
+  return 1;
+}
+
+int inl_find(int *name) {
+  for (int ci = 0; ci < ninl_cand; ci++) {
+    struct FuncDef *f = inl_funcs[inl_cand[ci]];
+    if (my_strcmp(f->name, name) == 0) return ci;
+  }
+  return 0 - 1;
+}
+
+int inl_caller_has(int *name) {
+  for (int i = 0; i < ninl_cnames && i < MAX_LAYOUT; i++) {
+    if (my_strcmp(inl_cnames[i], name) == 0) return 1;
+  }
+  return 0;
+}
+
+int inl_note_local(int *name) {
+  for (int i = 0; i < ninl; i++) {
+    if (my_strcmp(inl_from[i], name) == 0) return 0;
+  }
+  if (ninl >= MAX_INLINE_NAMES) { inl_ok = 0; return 0; }
+  inl_from[ninl] = name;
+  ninl++;
+  return 0;
+}
+
+int inl_note_written(struct Expr *e) {
+  if (e == 0 || e < 4096 || e->kind != ND_VAR) return 0;
+  if (ninl_written >= MAX_INLINE_NAMES) { inl_ok = 0; return 0; }
+  inl_written[ninl_written] = e->sval;
+  ninl_written++;
+  return 0;
+}
+
+int inl_is_written(int *name) {
+  for (int i = 0; i < ninl_written; i++) {
+    if (my_strcmp(inl_written[i], name) == 0) return 1;
+  }
+  return 0;
+}
+
+// Size and shape of callee code
+int inl_check_expr(struct Expr *e) {
+  if (e == 0 || e < 4096) return 0;
+  inl_nodes++;
+  int k = e->kind;
+  if (k == ND_LABEL_ADDR || k == ND_COMPOUND_LIT) {
+    inl_ok = 0;
+  } else if (k == ND_CALL || k == ND_INITLIST) {
+    if (k == ND_CALL && my_strcmp(e->sval, inl_self) == 0) { inl_ok = 0; }
+    for (int i = 0; i < e->nargs; i++) { inl_check_expr(e->args[i]); }
+  } else if (k == ND_BINARY || k == ND_INDEX || k == ND_ASSIGN) {
+    if (k == ND_ASSIGN) { inl_note_written(e->left); }
+    inl_check_expr(e->left);
+    inl_check_expr(e->right);
+  } else if (k == ND_TERNARY) {
+    inl_check_expr(e->left);
+    inl_check_expr(e->right);
+    inl_check_expr(e->args[0]);
+  } else if (k == ND_STMT_EXPR) {
+    struct Stmt *se_blk = e->left;
+    if (se_blk == 0 || se_blk->kind != ST_BLOCK) { inl_ok = 0; return 0; }
+    inl_check_stmts(se_blk->body, se_blk->nbody);
+  } else if (k == ND_UNARY || k == ND_CAST || k == ND_FIELD || k == ND_ARROW ||
+             k == ND_POSTINC || k == ND_POSTDEC) {
+    if (k == ND_POSTINC || k == ND_POSTDEC || (k == ND_UNARY && e->ival == '&')) { inl_note_written(e->left); }
+    inl_check_expr(e->left);
+  }
+  return 0;
+}
+
+// Statements before the trailing returns: no returns, gotos or labels
+int inl_check_stmts(struct Stmt **stmts, int n) {
+  for (int i = 0; i < n; i++) {
+    struct Stmt *st = stmts[i];
+    if (st == 0 || st < 4096 || st == (0 - 1)) continue;
+    inl_nodes++;
+    int k = st->kind;
+    if (k == ST_VARDECL) {
+      for (int j = 0; j < st->ndecls; j++) {
+        struct VarDecl *vd = st->decls[j];
+        if (vd->is_static || vd->arr_size >= 0 || vd->is_float || (vd->stype != 0 && vd->is_ptr == 0)) { inl_ok = 0; }
+        inl_note_local(vd->name);
+        inl_check_expr(vd->init);
+      }
+    } else if (k == ST_IF) {
+      inl_check_expr(st->expr);
+      inl_check_stmts(st->body, st->nbody);
+      if (st->body2 != 0) { inl_check_stmts(st->body2, st->nbody2); }
+    } else if (k == ST_WHILE || k == ST_DOWHILE) {
+      inl_check_expr(st->expr);
+      inl_check_stmts(st->body, st->nbody);
+    } else if (k == ST_FOR) {
+      if (st->init != 0) {
+        struct Stmt *arr[1];
+        arr[0] = st->init;
+        inl_check_stmts(arr, 1);
+      }
+      inl_check_expr(st->expr);
+      inl_check_expr(st->expr2);
+      inl_check_stmts(st->body, st->nbody);
+    } else if (k == ST_SWITCH) {
+      inl_check_expr(st->expr);
+      for (int ci = 0; ci < st->ncases; ci++) { inl_check_stmts(st->case_bodies[ci], st->case_nbodies[ci]); }
+      if (st->default_body != 0) { inl_check_stmts(st->default_body, st->ndefault); }
+    } else if (k == ST_BLOCK) {
+      inl_check_stmts(st->body, st->nbody);
+    } else if (k == ST_EXPR) {
+      inl_check_expr(st->expr);
+    } else if (k != ST_BREAK && k != ST_CONTINUE) {
+      inl_ok = 0;
+    }
+  }
+  return 0;
+}
+
+int inl_is_value_return(struct Stmt *st) {
+  return st != 0 && st >= 4096 && st != (0 - 1) && st->kind == ST_RETURN && st->expr != 0;
+}
+
+// `if (c) return x;`, or with_else: `if (c) return x; else return y;`
+int inl_is_return_if(struct Stmt *st, int with_else) {
+  if (st == 0 || st < 4096 || st == (0 - 1) || st->kind != ST_IF || st->nbody != 1) return 0;
+  if (inl_is_value_return(st->body[0]) == 0) return 0;
+  if (with_else) return st->body2 != 0 && st->nbody2 == 1 && inl_is_value_return(st->body2[0]);
+  return st->body2 == 0;
+}
+
+// Index of the callee's trailing returns; n when it has none
+int inl_tail_start(struct Stmt **stmts, int n) {
+  inl_value_ret = 0;
+  struct Stmt *last = stmts[n - 1];
+  if (last != 0 && last >= 4096 && last != (0 - 1) && last->kind == ST_RETURN && last->expr == 0) return n - 1;
+  if (inl_is_value_return(last) == 0 && inl_is_return_if(last, 1) == 0) return n;
+  inl_value_ret = 1;
+  int t = n - 1;
+  while (t > 0 && inl_is_return_if(stmts[t - 1], 0)) { t--; }
+  return t;
+}
+
+int inl_check_tail(struct Stmt *st) {
+  inl_nodes++;
+  if (st->kind == ST_RETURN) { inl_check_expr(st->expr); return 0; }
+  inl_check_expr(st->expr);
+  struct Stmt *then_ret = st->body[0];
+  inl_check_expr(then_ret->expr);
+  if (st->body2 != 0) {
+    struct Stmt *else_ret = st->body2[0];
+    inl_check_expr(else_ret->expr);
+  }
+  return 0;
+}
+
+int *inl_rename(int *name) {
+  for (int i = 0; i < ninl; i++) {
+    if (my_strcmp(inl_from[i], name) == 0) return inl_to[i];
+  }
+  // Anything else the callee names must mean the same in the caller
+  if (inl_caller_has(name)) { inl_ok = 0; }
+  return name;
+}
+
+struct Expr **inl_clone_args(struct Expr **args, int n) {
+  if (args == 0) return 0;
+  struct Expr **c = my_malloc((n + 1) * 8);
+  for (int i = 0; i < n; i++) { c[i] = inl_clone_expr(args[i]); }
+  return c;
+}
+
+struct Expr *inl_clone_expr(struct Expr *e) {
+  if (e == 0 || e < 4096) return e;
+  struct Expr *c = my_malloc(80);
+  c->ty = 0;
+  c->kind = e->kind;
+  c->ival = e->ival;
+  c->sval = e->sval;
+  c->sval2 = e->sval2;
+  c->left = e->left;
+  c->right = e->right;
+  c->args = e->args;
+  c->nargs = e->nargs;
+  c->desig = e->desig;
+  int k = e->kind;
+  if (k == ND_VAR) {
+    c->sval = inl_rename(e->sval);
+  } else if (k == ND_CALL || k == ND_INITLIST) {
+    if (k == ND_CALL) { c->sval = inl_rename(e->sval); }
+    c->args = inl_clone_args(e->args, e->nargs);
+  } else if (k == ND_BINARY || k == ND_INDEX) {
+    c->left = inl_clone_expr(e->left);
+    c->right = inl_clone_expr(e->right);
+  } else if (k == ND_ASSIGN) {
+    struct Expr *r = e->right;
+    c->left = inl_clone_expr(e->left);
+    c->right = inl_clone_expr(r);
+    // Compound assignments share the target with the operation
+    if (r != 0 && r >= 4096 && r->kind == ND_BINARY && r->left == e->left) {
+      struct Expr *cr = c->right;
+      cr->left = c->left;
+    }
+  } else if (k == ND_TERNARY) {
+    c->left = inl_clone_expr(e->left);
+    c->right = inl_clone_expr(e->right);
+    c->args = my_malloc(8);
+    c->args[0] = inl_clone_expr(e->args[0]);
+  } else if (k == ND_STMT_EXPR) {
+    c->left = inl_clone_stmt(e->left);
+  } else if (k == ND_UNARY || k == ND_CAST || k == ND_FIELD || k == ND_ARROW ||
+             k == ND_POSTINC || k == ND_POSTDEC) {
+    c->left = inl_clone_expr(e->left);
+  }
+  return c;
+}
+
+struct VarDecl *inl_clone_decl(struct VarDecl *vd) {
+  struct VarDecl *c = make_vd(inl_rename(vd->name), vd->stype, vd->arr_size, vd->is_ptr, inl_clone_expr(vd->init), vd->is_static);
+  c->is_unsigned = vd->is_unsigned;
+  c->arr_size2 = vd->arr_size2;
+  c->is_char = vd->is_char;
+  c->is_float = vd->is_float;
+  c->is_short = vd->is_short;
+  c->is_long = vd->is_long;
+  c->is_const = vd->is_const;
+  return c;
+}
+
+struct Stmt *inl_clone_stmt(struct Stmt *st) {
+  if (st == 0 || st < 4096 || st == (0 - 1)) return st;
+  struct Stmt *c = my_malloc(144);
+  c->kind = st->kind;
+  c->expr = st->expr;
+  c->expr2 = st->expr2;
+  c->body = st->body;
+  c->nbody = st->nbody;
+  c->body2 = st->body2;
+  c->nbody2 = st->nbody2;
+  c->init = st->init;
+  c->decls = st->decls;
+  c->ndecls = st->ndecls;
+  c->sval = st->sval;
+  c->case_vals = st->case_vals;
+  c->case_bodies = st->case_bodies;
+  c->case_nbodies = st->case_nbodies;
+  c->ncases = st->ncases;
+  c->default_body = st->default_body;
+  c->ndefault = st->ndefault;
+  int k = st->kind;
+  if (k == ST_RETURN || k == ST_IF || k == ST_WHILE || k == ST_DOWHILE || k == ST_FOR ||
+      k == ST_EXPR || k == ST_SWITCH || k == ST_COMPUTED_GOTO) {
+    c->expr = inl_clone_expr(st->expr);
+  }
+  if (k == ST_VARDECL) {
+    c->decls = my_malloc((st->ndecls + 1) * 8);
+    for (int j = 0; j < st->ndecls; j++) { c->decls[j] = inl_clone_decl(st->decls[j]); }
+  } else if (k == ST_IF) {
+    c->body = inl_clone_stmts(st->body, st->nbody);
+    c->body2 = inl_clone_stmts(st->body2, st->nbody2);
+  } else if (k == ST_FOR) {
+    c->init = inl_clone_stmt(st->init);
+    c->expr2 = inl_clone_expr(st->expr2);
+    c->body = inl_clone_stmts(st->body, st->nbody);
+  } else if (k == ST_SWITCH) {
+    c->case_bodies = my_malloc((st->ncases + 1) * 8);
+    for (int ci = 0; ci < st->ncases; ci++) { c->case_bodies[ci] = inl_clone_stmts(st->case_bodies[ci], st->case_nbodies[ci]); }
+    c->default_body = inl_clone_stmts(st->default_body, st->ndefault);
+  } else if (k == ST_WHILE || k == ST_DOWHILE || k == ST_BLOCK) {
+    c->body = inl_clone_stmts(st->body, st->nbody);
+  }
+  return c;
+}
+
+struct Stmt **inl_clone_stmts(struct Stmt **stmts, int n) {
+  if (stmts == 0) return 0;
+  struct Stmt **c = my_malloc((n + 1) * 8);
+  for (int i = 0; i < n; i++) { c[i] = inl_clone_stmt(stmts[i]); }
+  return c;
+}
+
+// The value of trailing returns from t on, as nested ternaries
+struct Expr *inl_tail_value(struct Stmt **stmts, int t, int n) {
+  struct Stmt *last = stmts[n - 1];
+  struct Expr *v = 0;
+  if (last->kind == ST_RETURN) {
+    v = inl_clone_expr(last->expr);
+  } else {
+    struct Stmt *then_ret = last->body[0];
+    struct Stmt *else_ret = last->body2[0];
+    v = new_ternary(inl_clone_expr(last->expr), inl_clone_expr(then_ret->expr), inl_clone_expr(else_ret->expr));
+  }
+  for (int i = n - 2; i >= t; i--) {
+    struct Stmt *st = stmts[i];
+    struct Stmt *ret = st->body[0];
+    v = new_ternary(inl_clone_expr(st->expr), inl_clone_expr(ret->expr), v);
+  }
+  return v;
+}
+
+// Parameter i of f as a local, typed the way layout_func types it
+struct VarDecl *inl_param_decl(struct FuncDef *f, int i, int *name, struct Expr *init) {
+  struct VarDecl *vd = make_vd(name, 0, 0 - 1, 0, init, 0);
+  if (f->param_is_char != 0 && f->param_is_char[i]) {
+    vd->is_char = 1;
+    vd->is_ptr = 1;
+  } else if (f->param_is_intptr != 0 && f->param_is_intptr[i]) {
+    vd->is_ptr = f->param_is_intptr[i];
+  }
+  if (f->param_is_unsigned != 0) { vd->is_unsigned = f->param_is_unsigned[i]; }
+  if (f->param_is_long != 0) { vd->is_long = f->param_is_long[i]; }
+  if (f->param_is_short != 0) { vd->is_short = f->param_is_short[i]; }
+  for (int bci = 0; bci < nbarechar_funcs; bci++) {
+    if (my_strcmp(barechar_func_names[bci], f->name) == 0) {
+      if (barechar_param_data[bci] != 0 && barechar_param_data[bci][i]) {
+        vd->is_char = 1;
+        vd->is_unsigned = (barechar_param_data[bci][i] == 2) ? 1 : 0;
+      }
+      break;
+    }
+  }
+  // Parameters the body never changes let constant arguments fold
+  vd->is_const = inl_is_written(f->params[i]) == 0;
+  return vd;
+}
+
+// Replace call e with a copy of its callee's body, or return e unchanged
+struct Expr *inl_call(struct Expr *e) {
+  if (ninl_cnames + inl_added > MAX_LAYOUT / 2) return e;
+  int ci = inl_find(e->sval);
+  if (ci < 0) return e;
+  struct FuncDef *f = inl_funcs[inl_cand[ci]];
+  if (e->nargs != f->nparams || inl_caller_has(e->sval)) return e;
+  inl_ok = 1;
+  inl_nodes = 0;
+  ninl = 0;
+  ninl_written = 0;
+  inl_self = f->name;
+  for (int i = 0; i < f->nparams; i++) { inl_note_local(f->params[i]); }
+  int t = inl_tail_start(f->body, f->nbody);
+  inl_check_stmts(f->body, t);
+  for (int i = t; i < f->nbody; i++) { inl_check_tail(f->body[i]); }
+  int limit = 40;
+  if (f->inline_hint == 1) { limit = 120; }
+  if (inl_ok == 0 || (f->inline_hint != 2 && inl_nodes > limit)) return e;
+  if (ninl_cnames + inl_added + ninl + 1 > MAX_LAYOUT / 2) return e;
+
+  int *prefix = build_str2("__inl", int_to_str(inl_counter));
+  int *stem = build_str2(prefix, "_");
+  for (int i = 0; i < ninl; i++) { inl_to[i] = build_str2(stem, inl_from[i]); }
+  int np = f->nparams;
+  struct Stmt **body = my_malloc((np + t + 3) * 8);
+  int nb = 0;
+  for (int i = 0; i < np; i++) {
+    struct VarDecl **pd = my_malloc(8);
+    pd[0] = inl_param_decl(f, i, inl_to[i], e->args[i]);
+    body[nb] = new_vardecl_s(pd, 1);
+    nb++;
+  }
+  for (int i = 0; i < t; i++) {
+    body[nb] = inl_clone_stmt(f->body[i]);
+    nb++;
+  }
+  if (inl_value_ret) {
+    // The result goes through a local so it converts like a return would
+    struct VarDecl **rd = my_malloc(8);
+    rd[0] = make_vd(prefix, 0, 0 - 1, f->ret_is_ptr, inl_tail_value(f->body, t, f->nbody), 0);
+    rd[0]->is_unsigned = f->ret_is_unsigned;
+    rd[0]->is_long = f->ret_is_long;
+    rd[0]->is_const = 1;
+    body[nb] = new_vardecl_s(rd, 1);
+    nb++;
+    body[nb] = new_expr_s(new_var(prefix));
+    nb++;
+  }
+  if (inl_ok == 0) return e;
+  inl_counter++;
+  inl_added = inl_added + ninl + 1;
+  inl_count[ci]++;
+
+  struct Stmt *se_blk = my_malloc(144);
+  se_blk->kind = ST_BLOCK;
+  se_blk->body = body;
+  se_blk->nbody = nb;
+  struct Expr *se = my_malloc(80);
+  se->ty = 0;
+  se->kind = ND_STMT_EXPR;
+  se->left = se_blk;
+  se->sval = 0;
+  se->right = 0;
+  se->args = 0;
+  se->nargs = 0;
+  // Calls the copy still makes, up to a few levels deep
+  if (inl_depth < 3) {
+    inl_depth++;
+    for (int i = np; i < nb; i++) { inl_stmt(body[i]); }
+    inl_depth--;
+  }
+  return se;
+}
+
+// Expand calls in the positions layout scans for statement expressions
+struct Expr *inl_expr(struct Expr *e) {
+  if (e == 0 || e < 4096) return e;
+  int k = e->kind;
+  if (k == ND_CALL) {
+    for (int i = 0; i < e->nargs; i++) { e->args[i] = inl_expr(e->args[i]); }
+    return inl_call(e);
+  }
+  if (k == ND_BINARY || k == ND_INDEX) {
+    e->left = inl_expr(e->left);
+    e->right = inl_expr(e->right);
+  } else if (k == ND_ASSIGN) {
+    struct Expr *r = e->right;
+    int shared = r != 0 && r >= 4096 && r->kind == ND_BINARY && r->left == e->left;
+    e->left = inl_expr(e->left);
+    if (shared) {
+      r->left = e->left;
+      r->right = inl_expr(r->right);
+    } else {
+      e->right = inl_expr(r);
+    }
+  } else if (k == ND_TERNARY) {
+    e->left = inl_expr(e->left);
+    e->right = inl_expr(e->right);
+    e->args[0] = inl_expr(e->args[0]);
+  } else if (k == ND_STMT_EXPR) {
+    struct Stmt *se_blk = e->left;
+    if (se_blk != 0 && se_blk->kind == ST_BLOCK) { inl_stmts(se_blk->body, se_blk->nbody); }
+  } else if (k == ND_UNARY || k == ND_CAST || k == ND_FIELD || k == ND_ARROW ||
+             k == ND_POSTINC || k == ND_POSTDEC) {
+    e->left = inl_expr(e->left);
+  }
+  return e;
+}
+
+int inl_stmt(struct Stmt *st) {
+  if (st == 0 || st < 4096 || st == (0 - 1)) return 0;
+  int k = st->kind;
+  if (k == ST_EXPR || k == ST_RETURN || k == ST_IF || k == ST_WHILE || k == ST_COMPUTED_GOTO) {
+    st->expr = inl_expr(st->expr);
+  }
+  if (k == ST_VARDECL) {
+    for (int j = 0; j < st->ndecls; j++) {
+      struct VarDecl *vd = st->decls[j];
+      if (vd->is_static == 0 && vd->init != 0 && vd->init >= 4096 && vd->init->kind != ND_INITLIST) {
+        vd->init = inl_expr(vd->init);
+      }
+    }
+  } else if (k == ST_IF) {
+    inl_stmts(st->body, st->nbody);
+    if (st->body2 != 0) { inl_stmts(st->body2, st->nbody2); }
+  } else if (k == ST_FOR) {
+    inl_stmt(st->init);
+    st->expr = inl_expr(st->expr);
+    st->expr2 = inl_expr(st->expr2);
+    inl_stmts(st->body, st->nbody);
+  } else if (k == ST_SWITCH) {
+    for (int ci = 0; ci < st->ncases; ci++) { inl_stmts(st->case_bodies[ci], st->case_nbodies[ci]); }
+    if (st->default_body != 0) { inl_stmts(st->default_body, st->ndefault); }
+  } else if (k == ST_WHILE || k == ST_DOWHILE || k == ST_BLOCK || k == ST_LABEL) {
+    inl_stmts(st->body, st->nbody);
+  }
+  return 0;
+}
+
+int inl_stmts(struct Stmt **stmts, int n) {
+  for (int i = 0; i < n; i++) { inl_stmt(stmts[i]); }
+  return 0;
+}
+
+int inl_scan_name(int *name) {
+  if (inl_scan_refs == 0) return 0;
+  for (int ci = 0; ci < ninl_cand; ci++) {
+    struct FuncDef *f = inl_funcs[inl_cand[ci]];
+    if (inl_count[ci] > 0 && my_strcmp(f->name, name) == 0) { inl_used[ci] = 1; }
+  }
+  return 0;
+}
+
+// Walk all code: collects local names into inl_cnames, or with
+// inl_scan_refs marks the candidates it refers to
+int inl_scan_expr(struct Expr *e) {
+  if (e == 0 || e < 4096) return 0;
+  int k = e->kind;
+  if (k == ND_VAR) {
+    inl_scan_name(e->sval);
+  } else if (k == ND_CALL || k == ND_INITLIST) {
+    if (k == ND_CALL) { inl_scan_name(e->sval); }
+    for (int i = 0; i < e->nargs; i++) { inl_scan_expr(e->args[i]); }
+  } else if (k == ND_BINARY || k == ND_INDEX || k == ND_ASSIGN) {
+    inl_scan_expr(e->left);
+    inl_scan_expr(e->right);
+  } else if (k == ND_TERNARY) {
+    inl_scan_expr(e->left);
+    inl_scan_expr(e->right);
+    inl_scan_expr(e->args[0]);
+  } else if (k == ND_STMT_EXPR) {
+    struct Stmt *se_blk = e->left;
+    if (se_blk != 0 && se_blk->kind == ST_BLOCK) { inl_scan_stmts(se_blk->body, se_blk->nbody); }
+  } else if (k == ND_UNARY || k == ND_CAST || k == ND_FIELD || k == ND_ARROW ||
+             k == ND_POSTINC || k == ND_POSTDEC || k == ND_COMPOUND_LIT) {
+    inl_scan_expr(e->left);
+  }
+  return 0;
+}
+
+int inl_scan_stmts(struct Stmt **stmts, int n) {
+  for (int i = 0; i < n; i++) {
+    struct Stmt *st = stmts[i];
+    if (st == 0 || st < 4096 || st == (0 - 1)) continue;
+    int k = st->kind;
+    if (k == ST_RETURN || k == ST_IF || k == ST_WHILE || k == ST_DOWHILE || k == ST_FOR ||
+        k == ST_EXPR || k == ST_SWITCH || k == ST_COMPUTED_GOTO) {
+      inl_scan_expr(st->expr);
+    }
+    if (k == ST_VARDECL) {
+      for (int j = 0; j < st->ndecls; j++) {
+        struct VarDecl *vd = st->decls[j];
+        if (inl_scan_refs == 0) {
+          if (ninl_cnames < MAX_LAYOUT) { inl_cnames[ninl_cnames] = vd->name; }
+          ninl_cnames++;
+        }
+        inl_scan_expr(vd->init);
+      }
+    } else if (k == ST_IF) {
+      inl_scan_stmts(st->body, st->nbody);
+      if (st->body2 != 0) { inl_scan_stmts(st->body2, st->nbody2); }
+    } else if (k == ST_FOR) {
+      if (st->init != 0) {
+        struct Stmt *arr[1];
+        arr[0] = st->init;
+        inl_scan_stmts(arr, 1);
+      }
+      inl_scan_expr(st->expr2);
+      inl_scan_stmts(st->body, st->nbody);
+    } else if (k == ST_SWITCH) {
+      for (int ci = 0; ci < st->ncases; ci++) { inl_scan_stmts(st->case_bodies[ci], st->case_nbodies[ci]); }
+      if (st->default_body != 0) { inl_scan_stmts(st->default_body, st->ndefault); }
+    } else if (k == ST_WHILE || k == ST_DOWHILE || k == ST_BLOCK || k == ST_LABEL) {
+      inl_scan_stmts(st->body, st->nbody);
+    }
+  }
+  return 0;
+}
+
+// Keep functions that are not fully inlined statics, and any such static
+// they still refer to
+int inl_drop_unused(struct Program *prog) {
+  int nf = prog->nfuncs;
+  int *cand_of = my_malloc((nf + 1) * 4);
+  int *live = my_malloc((nf + 1) * 4);
+  for (int fi = 0; fi < nf; fi++) {
+    cand_of[fi] = 0 - 1;
+    live[fi] = 0;
+  }
+  for (int ci = 0; ci < ninl_cand; ci++) { cand_of[inl_cand[ci]] = ci; }
+  inl_scan_refs = 1;
+  for (int gi = 0; gi < prog->nglobals; gi++) {
+    struct GDecl *gd = prog->globals[gi];
+    if (gd->init_list != 0) { inl_scan_expr(gd->init_list); }
+  }
+  int changed = 1;
+  while (changed) {
+    changed = 0;
+    for (int fi = 0; fi < nf; fi++) {
+      struct FuncDef *f = prog->funcs[fi];
+      int ci = cand_of[fi];
+      if (live[fi]) continue;
+      if (ci >= 0 && f->is_static && inl_count[ci] > 0 && inl_used[ci] == 0) continue;
+      live[fi] = 1;
+      changed = 1;
+      if (f->nbody > 0) { inl_scan_stmts(f->body, f->nbody); }
+    }
+  }
+  int kept = 0;
+  for (int fi = 0; fi < nf; fi++) {
+    if (live[fi]) {
+      prog->funcs[kept] = prog->funcs[fi];
+      kept++;
+    }
+  }
+  prog->nfuncs = kept;
+  return 0;
+}
+
+int inline_program(struct Program *prog) {
+  int nf = prog->nfuncs;
+  inl_funcs = prog->funcs;
+  inl_cand = my_malloc((nf + 1) * 4);
+  inl_count = my_malloc((nf + 1) * 4);
+  inl_used = my_malloc((nf + 1) * 4);
+  ninl_cand = 0;
+  for (int fi = 0; fi < nf; fi++) {
+    if (inl_candidate(prog->funcs[fi])) {
+      inl_cand[ninl_cand] = fi;
+      inl_count[ninl_cand] = 0;
+      inl_used[ninl_cand] = 0;
+      ninl_cand++;
+    }
+  }
+  if (ninl_cand == 0) return 0;
+  for (int fi = 0; fi < nf; fi++) {
+    struct FuncDef *f = prog->funcs[fi];
+    if (f->nbody < 1) continue;
+    ninl_cnames = 0;
+    inl_added = 0;
+    inl_depth = 0;
+    inl_scan_refs = 0;
+    for (int i = 0; i < f->nparams && i < MAX_LAYOUT; i++) {
+      inl_cnames[ninl_cnames] = f->params[i];
+      ninl_cnames++;
+    }
+    inl_scan_stmts(f->body, f->nbody);
+    inl_stmts(f->body, f->nbody);
+  }
+  inl_drop_unused(prog);
+  return 0;
+}
+
+// ---- Constant folding ----
+// Runs over a function body after layout has recorded its locals and before
+// registers are handed out. Operators whose operands are both constants are
+// evaluated the way the generated code would compute them, reads of const
+// int locals with constant initializers become the constant, and identities
+// like x*1, x+0 and x&0 are simplified. Results outside int range, anything
+// that would change an operand's type, and subtrees layout has numbered are
+// left alone.
+
+int *fold_cname[MAX_FOLD_CONSTS];   // locals in scope that matter, innermost last
+long fold_cval[MAX_FOLD_CONSTS];
+int fold_cok[MAX_FOLD_CONSTS];      // 0 for a non-const local shadowing a const
+int nfold_c;
+int fold_cfull;
+
+int fold_fits_int(long v) {
+  return v >= 0 - 2147483647 - 1 && v <= 2147483647;
+}
+
+int fold_is_num(struct Expr *e) {
+  return e != 0 && e >= 4096 && e->kind == ND_NUM && e->nargs == 0 && fold_fits_int(e->ival);
+}
+
+int fold_find(int *name) {
+  int i = nfold_c - 1;
+  while (i >= 0) {
+    if (my_strcmp(fold_cname[i], name) == 0) return i;
+    i--;
+  }
+  return 0 - 1;
+}
+
+int fold_push(int *name, long val, int ok) {
+  if (nfold_c >= MAX_FOLD_CONSTS) { fold_cfull = 1; return 0; }
+  fold_cname[nfold_c] = name;
+  fold_cval[nfold_c] = val;
+  fold_cok[nfold_c] = ok;
+  nfold_c++;
+  return 0;
+}
+
+// Whether e may be discarded: layout has already numbered compound
+// literals, and statement expressions can hold labels
+int fold_can_drop(struct Expr *e) {
+  if (e == 0 || e < 4096) return 1;
+  int k = e->kind;
+  if (k == ND_COMPOUND_LIT || k == ND_STMT_EXPR || k == ND_LABEL_ADDR) return 0;
+  if (k == ND_NUM || k == ND_VAR || k == ND_STRLIT) return 1;
+  if (k == ND_CALL || k == ND_INITLIST) {
+    for (int i = 0; i < e->nargs; i++) {
+      if (fold_can_drop(e->args[i]) == 0) return 0;
+    }
+    return 1;
+  }
+  if (k == ND_TERNARY && fold_can_drop(e->args[0]) == 0) return 0;
+  if (k == ND_BINARY || k == ND_INDEX || k == ND_ASSIGN || k == ND_TERNARY) {
+    return fold_can_drop(e->left) && fold_can_drop(e->right);
+  }
+  return fold_can_drop(e->left);
+}
+
+// Evaluate a op b for int operands; 0 when the result is not a plain int
+int fold_eval(int *op, long a, long b, long *out) {
+  long v = 0;
+  if (my_strcmp(op, "+") == 0) { v = a + b; }
+  else if (my_strcmp(op, "-") == 0) { v = a - b; }
+  else if (my_strcmp(op, "*") == 0) { v = a * b; }
+  else if (my_strcmp(op, "&") == 0) { v = a & b; }
+  else if (my_strcmp(op, "|") == 0) { v = a | b; }
+  else if (my_strcmp(op, "^") == 0) { v = a ^ b; }
+  else if (my_strcmp(op, "<<") == 0 || my_strcmp(op, ">>") == 0) {
+    if (b < 0 || b > 31) return 0;
+    if (my_strcmp(op, "<<") == 0) { v = a << b; } else { v = a >> b; }
+  } else if (my_strcmp(op, "/") == 0 || my_strcmp(op, "%") == 0) {
+    if (b == 0 || (b == 0 - 1 && a == 0 - 2147483647 - 1)) return 0;
+    if (my_strcmp(op, "/") == 0) { v = a / b; } else { v = a % b; }
+  }
+  else if (my_strcmp(op, "==") == 0) { v = a == b; }
+  else if (my_strcmp(op, "!=") == 0) { v = a != b; }
+  else if (my_strcmp(op, "<") == 0) { v = a < b; }
+  else if (my_strcmp(op, "<=") == 0) { v = a <= b; }
+  else if (my_strcmp(op, ">") == 0) { v = a > b; }
+  else if (my_strcmp(op, ">=") == 0) { v = a >= b; }
+  else if (my_strcmp(op, "&&") == 0) { v = a != 0 && b != 0; }
+  else if (my_strcmp(op, "||") == 0) { v = a != 0 || b != 0; }
+  else return 0;
+  if (fold_fits_int(v) == 0) return 0;
+  *out = v;
+  return 1;
+}
+
+// x op c where c is constant; returns x, a new constant, or 0
+struct Expr *fold_identity(int *op, struct Expr *x, long c, int c_on_left) {
+  if (expr_is_float(x)) return 0;
+  if (c == 0 && (my_strcmp(op, "+") == 0 || my_strcmp(op, "|") == 0 || my_strcmp(op, "^") == 0)) return x;
+  if (c == 1 && my_strcmp(op, "*") == 0) return x;
+  if (c_on_left == 0) {
+    if (c == 0 && (my_strcmp(op, "-") == 0 || my_strcmp(op, "<<") == 0 || my_strcmp(op, ">>") == 0)) return x;
+    if (c == 1 && my_strcmp(op, "/") == 0) return x;
+  }
+  // Dropping x must not lose side effects or a long/unsigned type
+  if (c == 0 && (my_strcmp(op, "*") == 0 || my_strcmp(op, "&") == 0) && x->kind == ND_VAR &&
+      expr_is_long(x) == 0 && expr_is_unsigned(x) == 0) {
+    return new_num(0);
+  }
+  return 0;
+}
+
+struct Expr *fold_binary(struct Expr *e) {
+  int *op = e->sval2;
+  e->left = fold_expr(e->left);
+  e->right = fold_expr(e->right);
+  if (op == 0) return e;
+  struct Expr *l = e->left;
+  struct Expr *r = e->right;
+  long v = 0;
+  if (fold_is_num(l) && fold_is_num(r)) {
+    if (fold_eval(op, l->ival, r->ival, &v)) return new_num(v);
+    return e;
+  }
+  if (fold_is_num(l) && fold_can_drop(r)) {
+    if (my_strcmp(op, "&&") == 0 && l->ival == 0) return new_num(0);
+    if (my_strcmp(op, "||") == 0 && l->ival != 0) return new_num(1);
+  }
+  struct Expr *s = 0;
+  if (fold_is_num(r) && l != 0) { s = fold_identity(op, l, r->ival, 0); }
+  else if (fold_is_num(l) && r != 0) { s = fold_identity(op, r, l->ival, 1); }
+  if (s != 0) return s;
+  return e;
+}
+
+// Fold inside an assignment target without turning the target itself
+// into a value
+struct Expr *fold_lvalue(struct Expr *e) {
+  if (e == 0 || e < 4096 || e->kind == ND_VAR) return e;
+  return fold_expr(e);
+}
+
+int fold_stmts(struct Stmt **stmts, int n);
+
+int fold_scoped(struct Stmt **stmts, int n) {
+  int mark = nfold_c;
+  fold_stmts(stmts, n);
+  nfold_c = mark;
+  return 0;
+}
+
+struct Expr *fold_expr(struct Expr *e) {
+  if (e == 0 || e < 4096) return e;
+  int k = e->kind;
+  if (k == ND_NUM || k == ND_STRLIT || k == ND_LABEL_ADDR) return e;
+  if (k == ND_VAR) {
+    if (nfold_c > 0 && fold_cfull == 0) {
+      int ci = fold_find(e->sval);
+      if (ci >= 0 && fold_cok[ci]) return new_num(fold_cval[ci]);
+    }
+    return e;
+  }
+  if (k == ND_BINARY) return fold_binary(e);
+  if (k == ND_UNARY) {
+    if (e->ival == '&') { e->left = fold_lvalue(e->left); return e; }
+    e->left = fold_expr(e->left);
+    if (fold_is_num(e->left)) {
+      long v = e->left->ival;
+      if (e->ival == '-' && fold_fits_int(0 - v)) return new_num(0 - v);
+      if (e->ival == '~') return new_num(~v);
+      if (e->ival == '!') return new_num(v == 0);
+    }
+    return e;
+  }
+  if (k == ND_ASSIGN) {
+    // Compound assignments share the target with the operation
+    struct Expr *r = e->right;
+    int shared = r != 0 && r >= 4096 && r->kind == ND_BINARY && r->left == e->left;
+    e->left = fold_lvalue(e->left);
+    if (shared) {
+      r->left = e->left;
+      r->right = fold_expr(r->right);
+    } else {
+      e->right = fold_expr(r);
+    }
+    return e;
+  }
+  if (k == ND_POSTINC || k == ND_POSTDEC) {
+    e->left = fold_lvalue(e->left);
+    return e;
+  }
+  if (k == ND_TERNARY) {
+    e->left = fold_expr(e->left);
+    e->right = fold_expr(e->right);
+    e->args[0] = fold_expr(e->args[0]);
+    if (fold_is_num(e->left)) {
+      if (e->left->ival != 0 && fold_can_drop(e->args[0])) return e->right;
+      if (e->left->ival == 0 && fold_can_drop(e->right)) return e->args[0];
+    }
+    return e;
+  }
+  if (k == ND_CALL || k == ND_INITLIST) {
+    for (int i = 0; i < e->nargs; i++) { e->args[i] = fold_expr(e->args[i]); }
+    return e;
+  }
+  if (k == ND_INDEX) {
+    e->left = fold_expr(e->left);
+    e->right = fold_expr(e->right);
+    return e;
+  }
+  if (k == ND_STMT_EXPR) {
+    struct Stmt *se_blk = e->left;
+    if (se_blk != 0 && se_blk->kind == ST_BLOCK) { fold_scoped(se_blk->body, se_blk->nbody); }
+    return e;
+  }
+  // FIELD, ARROW, CAST, COMPOUND_LIT
+  e->left = fold_expr(e->left);
+  return e;
+}
+
+int fold_decl(struct VarDecl *vd) {
+  vd->init = fold_expr(vd->init);
+  if (vd->is_const && vd->stype == 0 && vd->is_ptr == 0 && vd->arr_size < 0 && vd->is_static == 0 &&
+      vd->is_char == 0 && vd->is_short == 0 && vd->is_long == 0 && vd->is_unsigned == 0 &&
+      vd->is_float == 0 && fold_is_num(vd->init)) {
+    fold_push(vd->name, vd->init->ival, 1);
+  } else if (nfold_c > 0 && fold_find(vd->name) >= 0) {
+    fold_push(vd->name, 0, 0);
+  }
+  return 0;
+}
+
+// Case bodies share one scope but are folded in switch order, not source
+// order, so names they declare hide outer constants throughout the switch
+int fold_shadow_decls(struct Stmt **stmts, int n) {
+  for (int i = 0; i < n; i++) {
+    struct Stmt *st = stmts[i];
+    if (st == 0 || st < 4096 || st == (0 - 1) || st->kind != ST_VARDECL) continue;
+    for (int j = 0; j < st->ndecls; j++) {
+      if (nfold_c > 0 && fold_find(st->decls[j]->name) >= 0) { fold_push(st->decls[j]->name, 0, 0); }
+    }
+  }
+  return 0;
+}
+
+int fold_stmts(struct Stmt **stmts, int n) {
+  for (int i = 0; i < n; i++) {
+    struct Stmt *st = stmts[i];
+    if (st == 0 || st < 4096 || st == (0 - 1)) continue;
+    int k = st->kind;
+    if (k == ST_VARDECL) {
+      for (int j = 0; j < st->ndecls; j++) { fold_decl(st->decls[j]); }
+    } else if (k == ST_IF) {
+      st->expr = fold_expr(st->expr);
+      fold_scoped(st->body, st->nbody);
+      if (st->body2 != 0) { fold_scoped(st->body2, st->nbody2); }
+    } else if (k == ST_WHILE || k == ST_DOWHILE) {
+      st->expr = fold_expr(st->expr);
+      fold_scoped(st->body, st->nbody);
+    } else if (k == ST_FOR) {
+      int mark = nfold_c;
+      if (st->init != 0) {
+        struct Stmt *arr[1];
+        arr[0] = st->init;
+        fold_stmts(arr, 1);
+      }
+      st->expr = fold_expr(st->expr);
+      st->expr2 = fold_expr(st->expr2);
+      fold_scoped(st->body, st->nbody);
+      nfold_c = mark;
+    } else if (k == ST_SWITCH) {
+      st->expr = fold_expr(st->expr);
+      int mark = nfold_c;
+      for (int ci = 0; ci < st->ncases; ci++) { fold_shadow_decls(st->case_bodies[ci], st->case_nbodies[ci]); }
+      if (st->default_body != 0) { fold_shadow_decls(st->default_body, st->ndefault); }
+      for (int ci = 0; ci < st->ncases; ci++) { fold_scoped(st->case_bodies[ci], st->case_nbodies[ci]); }
+      if (st->default_body != 0) { fold_scoped(st->default_body, st->ndefault); }
+      nfold_c = mark;
+    } else if (k == ST_BLOCK) {
+      fold_scoped(st->body, st->nbody);
+    } else if (k == ST_LABEL) {
+      fold_stmts(st->body, st->nbody);
+    } else if (k == ST_RETURN || k == ST_EXPR || k == ST_COMPUTED_GOTO) {
+      st->expr = fold_expr(st->expr);
+    }
+  }
+  return 0;
+}
+
+int fold_func(struct FuncDef *f) {
+  nfold_c = 0;
+  fold_cfull = 0;
+  fold_stmts(f->body, f->nbody);
+  return 0;
+}
+
+// Bytes a variadic ELF function keeps between its frame record and the
+// caller's stack arguments: an AAPCS64 va_list (__stack, __gr_top, __vr_top,
+// __gr_offs, __vr_offs), d0-d7 in 16-byte slots and then the general
+// argument registers. On x86-64 the va_list is the SysV one (gp_offset,
+// fp_offset, overflow_arg_area, reg_save_area) and the general registers
+// come first, as its register save area wants. va_start points ap at that
+// va_list, so ap can also be handed to vprintf and the like.
+int cg_va_area() {
+  return 32 + 16 * 8 + 8 * va_spill_regs;
+}
+
+// Offsets in that area of the general and floating-point register spills
+int cg_va_gr_off() {
+  if (target_x86) return 32;
+  return 32 + 16 * 8;
+}
+
+int cg_va_vr_off() {
+  if (target_x86) return 32 + 8 * va_spill_regs;
+  return 32;
+}
+
+int layout_func(struct FuncDef *f) {
+  nlay = 0;
+  nx_clear(lay_ix);
   nlay_arr = 0;
   nlay_sv = 0;
   nlay_psv = 0;
@@ -8306,7 +10806,8 @@ int layout_func(struct FuncDef *f) {
   nlay_float = 0;
   nlay_barechar = 0;
   nlay_long = 0;
-  int offset = 0;
+  int offset = frame_reserve;
+  ty_new_epoch();
 
   for (int i = 0; i < f->nparams; i++) {
     if (f->param_stypes != 0 && f->param_stypes[i] != 0) {
@@ -8319,7 +10820,7 @@ int layout_func(struct FuncDef *f) {
       lay_sv_name[nlay_sv] = my_strdup(f->params[i]);
       lay_sv_type[nlay_sv] = my_strdup(f->param_stypes[i]);
       nlay_sv++;
-    } else if (i < 8) {
+    } else if (i < arg_regs) {
       offset += 8;
       {
         int pbsz = 4;
@@ -8332,8 +10833,9 @@ int layout_func(struct FuncDef *f) {
         lay_add_slot(f->params[i], offset, pbsz);
       }
     } else {
-      // Stack-passed params: at [x29+16+(i-8)*8]. Use negative offset as signal.
-      int above_off = 16 + (i - 8) * 8;
+      // Stack-passed params: at [x29+16+(i-arg_regs)*8]. Use negative offset as signal.
+      int above_off = 16 + (i - arg_regs) * 8;
+      if (cg_va_save) { above_off = above_off + cg_va_area(); }
       lay_add_slot(f->params[i], 0 - above_off, 8);
     }
     if (f->param_is_char != 0 && f->param_is_char[i]) {
@@ -8388,16 +10890,175 @@ int layout_func(struct FuncDef *f) {
 
 
   lay_walk_stmts(f->body, f->nbody, &offset);
+  lay_locals_size = offset;
+  // Folding rewrites the tree, which static initializers still use later
+  if (use_fold) {
+    int prev = arena_use(AR_PERM);
+    fold_func(f);
+    arena_use(prev);
+  }
+  // Types asked during the walk and fold may predate the finished tables
+  ty_new_epoch();
+  lay_assign_regs(f, &offset);
 
   lay_stack_size = ((offset + 15) / 16) * 16;
   return 0;
 }
 
-// Code generation
-int gen_addr(struct Expr *e) {
+// Byte stride of an ND_INDEX element; 1 means the index is used unscaled
+int cg_index_stride(struct Expr *e) {
+  int *idx_stype = 0;
+  int idx_stride = 8;
+  int idx_is_char = 0;
+  if (e->left->kind == ND_VAR) {
+    if (cg_is_char(e->left->sval)) {
+      idx_stride = 1;
+      idx_is_char = 1;
+    } else if (cg_is_char_larr(e->left->sval)) {
+      idx_stride = 1;
+      idx_is_char = 1;
+    } else if (cg_global_is_bare_char_arr(e->left->sval)) {
+      idx_stride = 1;
+      idx_is_char = 1;
+    } else {
+      idx_stype = cg_structvar_type(e->left->sval);
+      if (idx_stype == 0) {
+        idx_stype = cg_ptr_structvar_type(e->left->sval);
+      }
+      // Check global struct type (non-pointer embedded struct arrays)
+      if (idx_stype == 0) {
+        idx_stype = cg_global_stype(e->left->sval);
+      }
+      // Check global pointer-to-struct type
+      if (idx_stype == 0) {
+        idx_stype = cg_global_ptr_stype(e->left->sval);
+      }
+      // Check for 2D array: stride = inner_dim * esz
+      if (idx_stype == 0) {
+        int inner = cg_get_arr_inner(e->left->sval);
+        if (inner >= 0) {
+          int inner_esz = cg_arr_esz(e->left->sval);
+          if (inner_esz > 0 && inner_esz < 8) {
+            idx_stride = inner * inner_esz;
+          } else {
+            idx_stride = inner * 8;
+          }
+        }
+      }
+      // Check if this is a plain int/short array or int/short pointer
+      if (idx_stype == 0 && idx_stride == 8 && idx_is_char == 0) {
+        int aesz = cg_arr_esz(e->left->sval);
+        if (aesz > 0 && aesz < 8) { idx_stride = aesz; }
+        if (idx_stride == 8) {
+          int iesz = cg_intptr_esz(e->left->sval);
+          if (iesz > 0 && iesz < 8) { idx_stride = iesz; }
+        }
+        if (idx_stride == 8) {
+          int gesz = cg_global_esz(e->left->sval);
+          if (gesz > 0 && gesz < 8) { idx_stride = gesz; }
+        }
+        if (idx_stride == 8 && cg_global_is_array(e->left->sval) == 0) {
+          int gpesz = cg_global_ptr_esz(e->left->sval);
+          if (gpesz > 0 && gpesz < 8) { idx_stride = gpesz; }
+        }
+      }
+    }
+  }
+  // Check if indexing a char* struct field (e.g. s->buf[i])
+  if ((e->left->kind == ND_ARROW || e->left->kind == ND_FIELD) && idx_is_char == 0) {
+    if (cg_field_is_char(e->left->sval2, e->left->sval) && (cg_field_is_ptr(e->left->sval2, e->left->sval) == 0 || cg_field_is_array(e->left->sval2, e->left->sval) == 0)) {
+      idx_stride = 1;
+      idx_is_char = 1;
+    }
+    // Proper layout: determine element stride for array fields in structs
+    if (idx_is_char == 0 && cg_field_is_array(e->left->sval2, e->left->sval) > 0) {
+      int fp = cg_field_is_ptr(e->left->sval2, e->left->sval);
+      if (fp == 0) {
+        int es = cg_field_arr_elem_size(e->left->sval2, e->left->sval);
+        idx_stride = es;
+        if (es == 1) { idx_is_char = 1; }
+      }
+    }
+    // 2D array field (e.g. m.data[i]): stride is one row
+    int frow = cg_field_row_len(e->left->sval2, e->left->sval);
+    if (frow > 0) {
+      idx_stride = frow * cg_field_arr_elem_size(e->left->sval2, e->left->sval);
+      idx_is_char = 0;
+      return idx_stride;
+    }
+    // Check if field has a struct type (e.g. collection->defaults[i] where defaults is default_t*)
+    // Only use struct stride for:
+    //   - embedded struct arrays (is_ptr == 0): stride = sizeof(struct)
+    //   - single pointer to struct (is_ptr == 1): stride = sizeof(struct)
+    // NOT for double pointer (is_ptr >= 2): stride = 8 (array of pointers)
+    if (idx_stype == 0 && idx_is_char == 0) {
+      int *fs = field_stype(e->left->sval2, e->left->sval);
+      int fp = cg_field_is_ptr(e->left->sval2, e->left->sval);
+      if (fs != 0 && fp <= 1) { idx_stype = fs; }
+    }
+    // Check if field is an int*/short*/long* pointer (non-array, non-char, non-struct)
+    // e.g. vm->prog[i] where prog is int* — stride should be 4, not 8
+    if (idx_stype == 0 && idx_is_char == 0 && idx_stride == 8) {
+      int fp2 = cg_field_is_ptr(e->left->sval2, e->left->sval);
+      int fa2 = cg_field_is_array(e->left->sval2, e->left->sval);
+      if (fp2 > 0 && fa2 == 0) {
+        int fc2 = cg_field_is_char(e->left->sval2, e->left->sval);
+        if (fc2 == 0 && fp2 == 1) {
+          // Single pointer to non-char, non-struct: check short/long/plain
+          if (cg_field_is_short(e->left->sval2, e->left->sval)) {
+            idx_stride = 2;
+          } else if (cg_field_is_long(e->left->sval2, e->left->sval)) {
+            idx_stride = 8;
+          } else {
+            idx_stride = 4;
+          }
+        }
+        // fp2 >= 2: pointer to pointer, stride = 8 (already default)
+      }
+    }
+  }
+  // Element of a 2D array field row (e.g. m.data[i][j])
+  if (e->left->kind == ND_INDEX && e->left->left != 0 && (e->left->left->kind == ND_ARROW || e->left->left->kind == ND_FIELD) && cg_field_row_len(e->left->left->sval2, e->left->left->sval) > 0) {
+    return cg_field_arr_elem_size(e->left->left->sval2, e->left->left->sval);
+  }
+  // Check if indexing result of char* array (e.g. names[i][j])
+  if (e->left->kind == ND_INDEX && idx_is_char == 0 && e->left->left != 0 && e->left->left->kind == ND_VAR) {
+    if (cg_is_char_arr(e->left->left->sval)) {
+      idx_stride = 1;
+      idx_is_char = 1;
+    }
+    // Check if indexing a 2D int/short array (e.g. arr[i][j])
+    if (idx_is_char == 0 && idx_stype == 0 && idx_stride == 8) {
+      int aesz2 = cg_arr_esz(e->left->left->sval);
+      if (aesz2 > 0 && aesz2 < 8) { idx_stride = aesz2; }
+    }
+    // Check if indexing through global int* array (e.g. cg_s_fa[i][j])
+    if (idx_is_char == 0 && idx_stype == 0 && idx_stride == 8) {
+      int gpe = cg_global_ptr_esz(e->left->left->sval);
+      if (gpe > 0 && gpe < 8) { idx_stride = gpe; }
+    }
+    // Check if double-indexing a short**/int** global (e.g. texturecolumnlump[tex][col])
+    if (idx_is_char == 0 && idx_stype == 0 && idx_stride == 8) {
+      if (find_glv_is_short(e->left->left->sval)) { idx_stride = 2; }
+      else if (cg_is_barechar(e->left->left->sval)) { idx_stride = 1; idx_is_char = 1; }
+    }
+  }
+  if (idx_stype != 0) {
+    idx_stride = cg_struct_byte_size(idx_stype);
+  }
+  if (idx_is_char) return 1;
+  return idx_stride;
+}
+
+// Code generation
+int gen_addr(struct Expr *e) {
   int fi = 0;
   if (e->kind == ND_VAR) {
     int off = cg_find_slot(e->sval);
+    if (cg_var_reg(e->sval) > 0) {
+      printf("cc: address of register local %s in %s\n", e->sval, cg_cur_func_name);
+      my_fatal("register local has no address");
+    }
     // Stack-passed parameter: offset <= -2 means positive offset from x29
     if (off <= (0 - 2)) {
       int pos_off = 0 - off;
@@ -8410,12 +11071,7 @@ int gen_addr(struct Expr *e) {
       int sli = 0;
       while (sli < nsl) {
         if (my_strcmp(sl[sli].name, e->sval) == 0 && my_strcmp(sl[sli].func, cg_cur_func_name) == 0) {
-          emit_s("\tadrp\tx0, ");
-          emit_s(sl[sli].label);
-          emit_line("@PAGE");
-          emit_s("\tadd\tx0, x0, ");
-          emit_s(sl[sli].label);
-          emit_line("@PAGEOFF");
+          emit_sym_addr("x0", "", sl[sli].label, 0);
           return 0;
         }
         sli++;
@@ -8424,32 +11080,17 @@ int gen_addr(struct Expr *e) {
     if (off < 0) {
       // Check if it's a global variable
       if (cg_is_global(e->sval)) {
-        emit_s("\tadrp\tx0, _");
-        emit_s(e->sval);
-        emit_line("@PAGE");
-        emit_s("\tadd\tx0, x0, _");
-        emit_s(e->sval);
-        emit_line("@PAGEOFF");
+        emit_sym_addr("x0", sym_pfx, e->sval, 0);
         return 0;
       }
       // Check if it's a function name (for function pointers)
       if (is_known_func(e->sval)) {
         if (is_defined_func(e->sval)) {
           // Function defined in this compilation unit — direct address
-          emit_s("\tadrp\tx0, _");
-          emit_s(e->sval);
-          emit_line("@PAGE");
-          emit_s("\tadd\tx0, x0, _");
-          emit_s(e->sval);
-          emit_line("@PAGEOFF");
+          emit_sym_addr("x0", sym_pfx, e->sval, 0);
         } else {
           // External function — use GOT
-          emit_s("\tadrp\tx0, _");
-          emit_s(e->sval);
-          emit_line("@GOTPAGE");
-          emit_s("\tldr\tx0, [x0, _");
-          emit_s(e->sval);
-          emit_line("@GOTPAGEOFF]");
+          emit_sym_addr("x0", sym_pfx, e->sval, 1);
         }
         return 0;
       }
@@ -8461,12 +11102,7 @@ int gen_addr(struct Expr *e) {
         }
         if (ev_found) {
           // Extern variable — use GOT
-          emit_s("\tadrp\tx0, _");
-          emit_s(e->sval);
-          emit_line("@GOTPAGE");
-          emit_s("\tldr\tx0, [x0, _");
-          emit_s(e->sval);
-          emit_line("@GOTPAGEOFF]");
+          emit_sym_addr("x0", sym_pfx, e->sval, 1);
           return 0;
         }
       }
@@ -8475,14 +11111,7 @@ int gen_addr(struct Expr *e) {
       emit_line("\tmov\tx0, #0");
       return 0;
     }
-    if (off <= 255) {
-      emit_s("\tsub\tx0, x29, #");
-      emit_num(off);
-      emit_ch('\n');
-    } else {
-      emit_mov_imm("x0", off);
-      emit_line("\tsub\tx0, x29, x0");
-    }
+    emit_sub_imm("x0", "x29", off);
     return 0;
   }
   if (e->kind == ND_UNARY && e->ival == '*') {
@@ -8490,153 +11119,30 @@ int gen_addr(struct Expr *e) {
     return 0;
   }
   if (e->kind == ND_INDEX) {
-    int *idx_stype = 0;
-    int idx_stride = 8;
-    int idx_is_char = 0;
-    if (e->left->kind == ND_VAR) {
-      if (cg_is_char(e->left->sval)) {
-        idx_stride = 1;
-        idx_is_char = 1;
-      } else if (cg_is_char_larr(e->left->sval)) {
-        idx_stride = 1;
-        idx_is_char = 1;
-      } else if (cg_global_is_bare_char_arr(e->left->sval)) {
-        idx_stride = 1;
-        idx_is_char = 1;
-      } else {
-        idx_stype = cg_structvar_type(e->left->sval);
-        if (idx_stype == 0) {
-          idx_stype = cg_ptr_structvar_type(e->left->sval);
-        }
-        // Check global struct type (non-pointer embedded struct arrays)
-        if (idx_stype == 0) {
-          idx_stype = cg_global_stype(e->left->sval);
-        }
-        // Check global pointer-to-struct type
-        if (idx_stype == 0) {
-          idx_stype = cg_global_ptr_stype(e->left->sval);
-        }
-        // Check for 2D array: stride = inner_dim * esz
-        if (idx_stype == 0) {
-          int inner = cg_get_arr_inner(e->left->sval);
-          if (inner >= 0) {
-            int inner_esz = cg_arr_esz(e->left->sval);
-            if (inner_esz > 0 && inner_esz < 8) {
-              idx_stride = inner * inner_esz;
-            } else {
-              idx_stride = inner * 8;
-            }
-          }
-        }
-        // Check if this is a plain int/short array or int/short pointer
-        if (idx_stype == 0 && idx_stride == 8 && idx_is_char == 0) {
-          int aesz = cg_arr_esz(e->left->sval);
-          if (aesz > 0 && aesz < 8) { idx_stride = aesz; }
-          if (idx_stride == 8) {
-            int iesz = cg_intptr_esz(e->left->sval);
-            if (iesz > 0 && iesz < 8) { idx_stride = iesz; }
-          }
-          if (idx_stride == 8) {
-            int gesz = cg_global_esz(e->left->sval);
-            if (gesz > 0 && gesz < 8) { idx_stride = gesz; }
-          }
-          if (idx_stride == 8 && cg_global_is_array(e->left->sval) == 0) {
-            int gpesz = cg_global_ptr_esz(e->left->sval);
-            if (gpesz > 0 && gpesz < 8) { idx_stride = gpesz; }
-          }
-        }
-      }
-    }
-    // Check if indexing a char* struct field (e.g. s->buf[i])
-    if ((e->left->kind == ND_ARROW || e->left->kind == ND_FIELD) && idx_is_char == 0) {
-      if (cg_field_is_char(e->left->sval2, e->left->sval) && (cg_field_is_ptr(e->left->sval2, e->left->sval) == 0 || cg_field_is_array(e->left->sval2, e->left->sval) == 0)) {
-        idx_stride = 1;
-        idx_is_char = 1;
-      }
-      // Proper layout: determine element stride for array fields in structs
-      if (idx_is_char == 0 && cg_field_is_array(e->left->sval2, e->left->sval) > 0) {
-        int fp = cg_field_is_ptr(e->left->sval2, e->left->sval);
-        if (fp == 0) {
-          int es = cg_field_arr_elem_size(e->left->sval2, e->left->sval);
-          idx_stride = es;
-          if (es == 1) { idx_is_char = 1; }
-        }
-      }
-      // Check if field has a struct type (e.g. collection->defaults[i] where defaults is default_t*)
-      // Only use struct stride for:
-      //   - embedded struct arrays (is_ptr == 0): stride = sizeof(struct)
-      //   - single pointer to struct (is_ptr == 1): stride = sizeof(struct)
-      // NOT for double pointer (is_ptr >= 2): stride = 8 (array of pointers)
-      if (idx_stype == 0 && idx_is_char == 0) {
-        int *fs = field_stype(e->left->sval2, e->left->sval);
-        int fp = cg_field_is_ptr(e->left->sval2, e->left->sval);
-        if (fs != 0 && fp <= 1) { idx_stype = fs; }
-      }
-      // Check if field is an int*/short*/long* pointer (non-array, non-char, non-struct)
-      // e.g. vm->prog[i] where prog is int* — stride should be 4, not 8
-      if (idx_stype == 0 && idx_is_char == 0 && idx_stride == 8) {
-        int fp2 = cg_field_is_ptr(e->left->sval2, e->left->sval);
-        int fa2 = cg_field_is_array(e->left->sval2, e->left->sval);
-        if (fp2 > 0 && fa2 == 0) {
-          int fc2 = cg_field_is_char(e->left->sval2, e->left->sval);
-          if (fc2 == 0 && fp2 == 1) {
-            // Single pointer to non-char, non-struct: check short/long/plain
-            if (cg_field_is_short(e->left->sval2, e->left->sval)) {
-              idx_stride = 2;
-            } else if (cg_field_is_long(e->left->sval2, e->left->sval)) {
-              idx_stride = 8;
-            } else {
-              idx_stride = 4;
-            }
-          }
-          // fp2 >= 2: pointer to pointer, stride = 8 (already default)
-        }
-      }
-    }
-    // Check if indexing result of char* array (e.g. names[i][j])
-    if (e->left->kind == ND_INDEX && idx_is_char == 0 && e->left->left != 0 && e->left->left->kind == ND_VAR) {
-      if (cg_is_char_arr(e->left->left->sval)) {
-        idx_stride = 1;
-        idx_is_char = 1;
-      }
-      // Check if indexing a 2D int/short array (e.g. arr[i][j])
-      if (idx_is_char == 0 && idx_stype == 0 && idx_stride == 8) {
-        int aesz2 = cg_arr_esz(e->left->left->sval);
-        if (aesz2 > 0 && aesz2 < 8) { idx_stride = aesz2; }
-      }
-      // Check if indexing through global int* array (e.g. cg_s_fa[i][j])
-      if (idx_is_char == 0 && idx_stype == 0 && idx_stride == 8) {
-        int gpe = cg_global_ptr_esz(e->left->left->sval);
-        if (gpe > 0 && gpe < 8) { idx_stride = gpe; }
-      }
-      // Check if double-indexing a short**/int** global (e.g. texturecolumnlump[tex][col])
-      if (idx_is_char == 0 && idx_stype == 0 && idx_stride == 8) {
-        if (find_glv_is_short(e->left->left->sval)) { idx_stride = 2; }
-        else if (cg_is_barechar(e->left->left->sval)) { idx_stride = 1; idx_is_char = 1; }
-      }
-    }
-    if (idx_stype != 0) {
-      idx_stride = cg_struct_byte_size(idx_stype);
+    int idx_stride = cg_index_stride(e);
+    long idx_off = 0;
+    if (cg_const_offset(e->right, idx_stride, &idx_off)) {
+      // Constant index: base plus an immediate
+      gen_value(e->left);
+      if (idx_off > 0) { emit_add_imm("x0", "x0", idx_off); }
+      else if (idx_off < 0) { emit_sub_imm("x0", "x0", 0 - idx_off); }
+      return 0;
     }
     gen_value(e->left);
-    emit_line("\tstr\tx0, [sp, #-16]!");
+    cg_push_tmp();
     gen_value(e->right);
-    if (idx_is_char) {
-      // No scaling needed for char pointers (stride = 1)
-    } else if (idx_stride == 8) {
-      emit_line("\tlsl\tx0, x0, #3");
-    } else if (idx_stride == 4) {
-      emit_line("\tlsl\tx0, x0, #2");
-    } else if (idx_stride == 2) {
-      emit_line("\tlsl\tx0, x0, #1");
+    cg_pop_tmp(1);
+    int idx_sh = cg_log2(idx_stride);
+    if (idx_sh == 0) {
+      emit_line("\tadd\tx0, x1, x0");
+    } else if (idx_sh > 0) {
+      // Scale the index in the add's shifted-register operand
+      emit_s("\tadd\tx0, x1, x0, lsl #"); emit_num(idx_sh); emit_ch('\n');
     } else {
-      emit_s("\tmov\tx1, #");
-      emit_num(idx_stride);
-      emit_ch('\n');
-      emit_line("\tmul\tx0, x0, x1");
+      emit_mov_imm("x9", idx_stride);
+      emit_line("\tmul\tx0, x0, x9");
+      emit_line("\tadd\tx0, x1, x0");
     }
-    emit_line("\tldr\tx1, [sp], #16");
-    emit_line("\tadd\tx0, x1, x0");
     return 0;
   }
   if (e->kind == ND_FIELD) {
@@ -8658,7 +11164,7 @@ int gen_addr(struct Expr *e) {
         fi_stride = cg_struct_byte_size(fi_stype);
       }
       gen_value(e->left->left);
-      emit_line("\tstr\tx0, [sp, #-16]!");
+      cg_push_tmp();
       gen_value(e->left->right);
       if (fi_stride == 8) {
         emit_line("\tlsl\tx0, x0, #3");
@@ -8666,7 +11172,7 @@ int gen_addr(struct Expr *e) {
         emit_s("\tmov\tx1, #"); emit_num(fi_stride); emit_ch('\n');
         emit_line("\tmul\tx0, x0, x1");
       }
-      emit_line("\tldr\tx1, [sp], #16");
+      cg_pop_tmp(1);
       emit_line("\tadd\tx0, x1, x0");
       {
         int boff = cg_field_byte_offset(e->sval2, e->sval);
@@ -8777,49 +11283,67 @@ int gen_val_num(struct Expr *e) {
   return 0;
 }
 
+// Emit "ldr<size> w0|x0, " for a load of size bytes; the caller emits the
+// address. Sign-extending loads write x0, the others w0 (or x0 for 8).
+int gen_load_mn(int size, int sgn, int unscaled) {
+  emit_s("\t"); emit_s(ir_load_mn(size, sgn, unscaled));
+  if (size < 8 && sgn == 0) { emit_s("\tw0, "); } else { emit_s("\tx0, "); }
+  return 0;
+}
+
 int gen_load_by_bsz(int bsz, int is_unsigned) {
-  if (bsz == 1) {
-    // ARM64: char is unsigned by default, always zero-extend
-    emit_line("\tldrb\tw0, [x0]");
-  } else if (bsz == 2) {
-    if (is_unsigned) { emit_line("\tldrh\tw0, [x0]"); }
-    else { emit_line("\tldrsh\tx0, [x0]"); }
-  } else if (bsz == 4) {
-    if (is_unsigned) { emit_line("\tldr\tw0, [x0]"); }
-    else { emit_line("\tldrsw\tx0, [x0]"); }
-  } else {
-    emit_line("\tldr\tx0, [x0]");
-  }
+  if (bsz != 1 && bsz != 2 && bsz != 4) { bsz = 8; }
+  // ARM64: char is unsigned by default, always zero-extend
+  gen_load_mn(bsz, bsz > 1 && bsz < 8 && is_unsigned == 0, 0);
+  emit_line("[x0]");
   return 0;
 }
 
+// Byte offset of a constant index scaled by stride, when it fits an
+// add/sub immediate
+int cg_const_offset(struct Expr *idx, int stride, long *off) {
+  if (idx->kind != ND_NUM || idx->nargs != 0) return 0;
+  long k = idx->ival;
+  if (k < 0 - 65536 || k > 65536) return 0;
+  k = k * stride;
+  if (k < 0 - 16777215 || k > 16777215) return 0;
+  *off = k;
+  return 1;
+}
+
 int gen_val_var(struct Expr *e) {
   // Function name used as value: load its address (don't dereference)
   if (cg_find_slot(e->sval) < 0 && cg_is_global(e->sval) == 0 && is_known_func(e->sval)) {
     gen_addr(e);
     return 0;
   }
+  {
+    int vr = cg_var_reg(e->sval);
+    if (vr > 0) {
+      emit_s("\tmov\tx0, x"); emit_num(vr); emit_ch('\n');
+      return 0;
+    }
+  }
+  {
+    int off = cg_find_slot(e->sval);
+    if (off > 0 && off <= 256 && cg_is_array(e->sval) == 0 && cg_is_structvar(e->sval) == 0) {
+      // Scalar local: load straight from the frame
+      int vbsz = cg_var_bsz(e->sval);
+      if (vbsz != 1 && vbsz != 2 && vbsz != 4) { vbsz = 8; }
+      gen_load_mn(vbsz, vbsz < 8 && cg_is_unsigned(e->sval) == 0, 1);
+      emit_s("[x29, #-"); emit_num(off); emit_line("]");
+      return 0;
+    }
+  }
   gen_addr(e);
   {
     int is_local = (cg_find_slot(e->sval) >= 0);
     if (is_local) {
       if (cg_is_array(e->sval) == 0 && cg_is_structvar(e->sval) == 0) {
         int vbsz = cg_var_bsz(e->sval);
-        if (vbsz == 1) {
-          int vu = cg_is_unsigned(e->sval);
-          if (vu) { emit_line("\tldrb\tw0, [x0]"); }
-          else { emit_line("\tldrsb\tx0, [x0]"); }
-        } else if (vbsz == 2) {
-          int vu = cg_is_unsigned(e->sval);
-          if (vu) { emit_line("\tldrh\tw0, [x0]"); }
-          else { emit_line("\tldrsh\tx0, [x0]"); }
-        } else if (vbsz == 4) {
-          int vu = cg_is_unsigned(e->sval);
-          if (vu) { emit_line("\tldr\tw0, [x0]"); }
-          else { emit_line("\tldrsw\tx0, [x0]"); }
-        } else {
-          emit_line("\tldr\tx0, [x0]");
-        }
+        if (vbsz != 1 && vbsz != 2 && vbsz != 4) { vbsz = 8; }
+        gen_load_mn(vbsz, vbsz < 8 && cg_is_unsigned(e->sval) == 0, 0);
+        emit_line("[x0]");
       }
     } else {
       if (cg_is_array(e->sval) == 0 && cg_is_structvar(e->sval) == 0 && cg_global_is_array(e->sval) == 0 && cg_global_stype(e->sval) == 0) {
@@ -8836,14 +11360,24 @@ int gen_val_field_arrow(struct Expr *e) {
   int bf_mask = 0;
   bf_bit_off = 0;
   bf_width = cg_get_bitfield_info(e->sval2, e->sval, &bf_bit_off);
-  gen_addr(e);
   if (cg_field_is_array(e->sval2, e->sval)) {
+    gen_addr(e);
     return 0;
   }
   {
     int bsz = cg_field_byte_size(e->sval2, e->sval);
     int f_unsigned = cg_field_is_unsigned(e->sval2, e->sval);
-    gen_load_by_bsz(bsz, f_unsigned);
+    int boff = cg_field_byte_offset(e->sval2, e->sval);
+    if (bsz != 1 && bsz != 2 && bsz != 4) { bsz = 8; }
+    if (e->kind == ND_ARROW && boff > 0 && boff % bsz == 0 && boff / bsz <= 4095) {
+      // p->field: load at a scaled offset from the pointer
+      gen_value(e->left);
+      gen_load_mn(bsz, bsz > 1 && bsz < 8 && f_unsigned == 0, 0);
+      emit_s("[x0, #"); emit_num(boff); emit_line("]");
+    } else {
+      gen_addr(e);
+      gen_load_by_bsz(bsz, f_unsigned);
+    }
   }
   if (bf_width > 0) {
     if (bf_bit_off > 0) {
@@ -8864,49 +11398,46 @@ int gen_val_field_arrow(struct Expr *e) {
   return 0;
 }
 
-int gen_val_index(struct Expr *e) {
+int ty_index_load_bsz(struct Expr *e, int *is_unsigned) {
+  *is_unsigned = 0;
   // For 2D array: arr[i] returns row address (no load), arr[i][j] loads
-  if (e->left->kind == ND_VAR && cg_get_arr_inner(e->left->sval) >= 0) {
-    // This is indexing a 2D array - return row pointer, don't load
-    gen_addr(e);
-    return 0;
+  if (e->left->kind == ND_VAR && cg_get_arr_inner(e->left->sval) >= 0) return 0;
+  if ((e->left->kind == ND_ARROW || e->left->kind == ND_FIELD) && cg_field_row_len(e->left->sval2, e->left->sval) > 0) return 0;
+  if (e->left->kind == ND_INDEX && e->left->left != 0 && (e->left->left->kind == ND_ARROW || e->left->left->kind == ND_FIELD) && cg_field_row_len(e->left->left->sval2, e->left->left->sval) > 0) {
+    *is_unsigned = cg_field_is_unsigned(e->left->left->sval2, e->left->left->sval);
+    int rs = cg_field_arr_elem_size(e->left->left->sval2, e->left->left->sval);
+    if (rs == 1) { *is_unsigned = 1; }
+    return rs;
   }
   // Global struct array: g_table[i] returns struct address (no load)
-  if (e->left->kind == ND_VAR && cg_global_is_array(e->left->sval) && cg_global_stype(e->left->sval) != 0) {
-    gen_addr(e);
-    return 0;
-  }
+  if (e->left->kind == ND_VAR && cg_global_is_array(e->left->sval) && cg_global_stype(e->left->sval) != 0) return 0;
   // Local struct array: items[i] returns struct address (no load)
-  if (e->left->kind == ND_VAR && cg_is_array(e->left->sval) && cg_structvar_type(e->left->sval) != 0) {
-    gen_addr(e);
-    return 0;
-  }
-  gen_addr(e);
+  if (e->left->kind == ND_VAR && cg_is_array(e->left->sval) && cg_structvar_type(e->left->sval) != 0) return 0;
   if (e->left->kind == ND_VAR && (cg_is_char(e->left->sval) || cg_is_char_larr(e->left->sval) || cg_global_is_bare_char_arr(e->left->sval))) {
-    emit_line("\tldrb\tw0, [x0]");
+    *is_unsigned = 1;
+    return 1;
   } else if ((e->left->kind == ND_ARROW || e->left->kind == ND_FIELD) && cg_field_is_char(e->left->sval2, e->left->sval) && (cg_field_is_ptr(e->left->sval2, e->left->sval) == 0 || cg_field_is_array(e->left->sval2, e->left->sval) == 0)) {
-    emit_line("\tldrb\tw0, [x0]");
+    *is_unsigned = 1;
+    return 1;
   } else if (e->left->kind == ND_INDEX && e->left->left != 0 && e->left->left->kind == ND_VAR && cg_is_char_arr(e->left->left->sval)) {
     // char *arr[N]; arr[i][j] — second index should byte-load
-    emit_line("\tldrb\tw0, [x0]");
+    *is_unsigned = 1;
+    return 1;
   } else if ((e->left->kind == ND_ARROW || e->left->kind == ND_FIELD) && cg_field_is_array(e->left->sval2, e->left->sval) > 0 && cg_field_is_ptr(e->left->sval2, e->left->sval) == 0) {
-    int es = cg_field_arr_elem_size(e->left->sval2, e->left->sval);
-    int fu = cg_field_is_unsigned(e->left->sval2, e->left->sval);
-    gen_load_by_bsz(es, fu);
+    *is_unsigned = cg_field_is_unsigned(e->left->sval2, e->left->sval);
+    return cg_field_arr_elem_size(e->left->sval2, e->left->sval);
   } else if ((e->left->kind == ND_ARROW || e->left->kind == ND_FIELD) && cg_field_is_ptr(e->left->sval2, e->left->sval) == 1 && cg_field_is_char(e->left->sval2, e->left->sval) == 0 && field_stype(e->left->sval2, e->left->sval) == 0) {
     // Struct field pointer indexing: s->field[i] where field is int*/short*
-    { int fp_bsz = 4; int fp_u = cg_field_is_unsigned(e->left->sval2, e->left->sval);
-    if (cg_field_is_short(e->left->sval2, e->left->sval)) { fp_bsz = 2; }
-    else if (cg_field_is_long(e->left->sval2, e->left->sval)) { fp_bsz = 8; }
-    gen_load_by_bsz(fp_bsz, fp_u); }
+    *is_unsigned = cg_field_is_unsigned(e->left->sval2, e->left->sval);
+    if (cg_field_is_short(e->left->sval2, e->left->sval)) return 2;
+    if (cg_field_is_long(e->left->sval2, e->left->sval)) return 8;
+    return 4;
   } else if (e->left->kind == ND_VAR) {
     int aesz = cg_arr_esz(e->left->sval);
     if (aesz == 0) { aesz = cg_intptr_esz(e->left->sval); }
     if (aesz == 0 && cg_global_is_array(e->left->sval) == 0) { aesz = cg_global_ptr_esz(e->left->sval); }
     if (aesz == 0) { aesz = cg_global_esz(e->left->sval); }
-    if (aesz == 4) { emit_line("\tldrsw\tx0, [x0]"); }
-    else if (aesz == 2) { emit_line("\tldrsh\tx0, [x0]"); }
-    else { emit_line("\tldr\tx0, [x0]"); }
+    if (aesz == 4 || aesz == 2) return aesz;
   } else if (e->left->kind == ND_INDEX && e->left->left != 0 && e->left->left->kind == ND_VAR) {
     // 2D array element load: arr[i][j] or ptr_ptr[i][j]
     int aesz = cg_arr_esz(e->left->left->sval);
@@ -8917,16 +11448,147 @@ int gen_val_index(struct Expr *e) {
       if (find_glv_is_short(e->left->left->sval) || find_lv_is_short(e->left->left->sval)) { aesz = 2; }
       else if (cg_is_barechar(e->left->left->sval)) { aesz = 1; }
     }
-    if (aesz == 4) { emit_line("\tldrsw\tx0, [x0]"); }
-    else if (aesz == 2) { emit_line("\tldrsh\tx0, [x0]"); }
-    else if (aesz == 1) { emit_line("\tldrb\tw0, [x0]"); }
-    else { emit_line("\tldr\tx0, [x0]"); }
-  } else {
-    emit_line("\tldr\tx0, [x0]");
+    if (aesz == 1) { *is_unsigned = 1; }
+    if (aesz == 4 || aesz == 2 || aesz == 1) return aesz;
+  }
+  return 8;
+}
+
+int gen_val_index(struct Expr *e) {
+  int idx_unsigned = 0;
+  int idx_bsz = cg_index_load_bsz(e, &idx_unsigned);
+  if (idx_bsz > 0) {
+    int stride = cg_index_stride(e);
+    int sgn = (idx_bsz > 1 && idx_bsz < 8 && idx_unsigned == 0);
+    long off = 0;
+    if (cg_const_offset(e->right, stride, &off) && off >= 0 && off % idx_bsz == 0 && off / idx_bsz <= 4095) {
+      // a[k]: scaled immediate offset
+      gen_value(e->left);
+      gen_load_mn(idx_bsz, sgn, 0);
+      if (off > 0) { emit_s("[x0, #"); emit_num(off); emit_line("]"); }
+      else { emit_line("[x0]"); }
+      return 0;
+    }
+    if (stride == idx_bsz) {
+      // a[i]: register offset, scaled by the element size
+      gen_value(e->left);
+      cg_push_tmp();
+      gen_value(e->right);
+      cg_pop_tmp(1);
+      gen_load_mn(idx_bsz, sgn, 0);
+      emit_s("[x1, x0");
+      if (idx_bsz > 1) { emit_s(", lsl #"); emit_num(cg_log2(idx_bsz)); }
+      emit_line("]");
+      return 0;
+    }
+  }
+  gen_addr(e);
+  if (idx_bsz > 0) { gen_load_by_bsz(idx_bsz, idx_unsigned); }
+  return 0;
+}
+
+// Width of the store for an assignment through lhs (1, 2, 4 or 8 bytes)
+int cg_assign_store_bsz(struct Expr *lhs) {
+  int assign_char = 0;
+  if (lhs->kind == ND_UNARY && lhs->ival == '*' && lhs->left->kind == ND_VAR && cg_is_char(lhs->left->sval)) { assign_char = 1; }
+  // *char_ptr++ = val or *char_ptr-- = val
+  if (lhs->kind == ND_UNARY && lhs->ival == '*' && (lhs->left->kind == ND_POSTINC || lhs->left->kind == ND_POSTDEC) && lhs->left->left != 0 && lhs->left->left->kind == ND_VAR && cg_is_char(lhs->left->left->sval)) { assign_char = 1; }
+  if (lhs->kind == ND_INDEX && lhs->left->kind == ND_VAR && (cg_is_char(lhs->left->sval) || cg_is_char_larr(lhs->left->sval) || cg_global_is_bare_char_arr(lhs->left->sval))) { assign_char = 1; }
+  if (lhs->kind == ND_INDEX && (lhs->left->kind == ND_ARROW || lhs->left->kind == ND_FIELD) && cg_field_is_char(lhs->left->sval2, lhs->left->sval) && (cg_field_is_ptr(lhs->left->sval2, lhs->left->sval) == 0 || cg_field_is_array(lhs->left->sval2, lhs->left->sval) == 0)) { assign_char = 1; }
+  if (lhs->kind == ND_UNARY && lhs->ival == '*' && lhs->left->kind == ND_BINARY && lhs->left->left != 0 && lhs->left->left->kind == ND_VAR && cg_is_char(lhs->left->left->sval)) { assign_char = 1; }
+  // char *arr[N]; arr[i][j] = val
+  if (lhs->kind == ND_INDEX && lhs->left->kind == ND_INDEX && lhs->left->left != 0 && lhs->left->left->kind == ND_VAR && cg_is_char_arr(lhs->left->left->sval)) { assign_char = 1; }
+  if (assign_char) {
+    return 1;
+  } else if (lhs->kind == ND_INDEX && lhs->left->kind == ND_INDEX && lhs->left->left != 0 && (lhs->left->left->kind == ND_ARROW || lhs->left->left->kind == ND_FIELD) && cg_field_row_len(lhs->left->left->sval2, lhs->left->left->sval) > 0) {
+    // 2D array field element: m.data[i][j] = val
+    int es = cg_field_arr_elem_size(lhs->left->left->sval2, lhs->left->left->sval);
+    if (es == 1 || es == 2 || es == 4) { return es; }
+  } else if (lhs->kind == ND_FIELD || lhs->kind == ND_ARROW) {
+    int bsz = cg_field_byte_size(lhs->sval2, lhs->sval);
+    if (bsz == 1 || bsz == 2 || bsz == 4) { return bsz; }
+  } else if (lhs->kind == ND_INDEX && (lhs->left->kind == ND_ARROW || lhs->left->kind == ND_FIELD) && cg_field_is_array(lhs->left->sval2, lhs->left->sval) > 0 && cg_field_is_ptr(lhs->left->sval2, lhs->left->sval) == 0) {
+    int es = cg_field_arr_elem_size(lhs->left->sval2, lhs->left->sval);
+    if (es == 1 || es == 2 || es == 4) { return es; }
+  } else if (lhs->kind == ND_INDEX && (lhs->left->kind == ND_ARROW || lhs->left->kind == ND_FIELD) && cg_field_is_ptr(lhs->left->sval2, lhs->left->sval) == 1 && cg_field_is_char(lhs->left->sval2, lhs->left->sval) == 0 && field_stype(lhs->left->sval2, lhs->left->sval) == 0) {
+    // Struct field pointer store: s->field[i] = val where field is int*/short*
+    if (cg_field_is_short(lhs->left->sval2, lhs->left->sval)) { return 2; }
+    if (cg_field_is_long(lhs->left->sval2, lhs->left->sval)) { return 8; }
+    return 4;
+  } else if (lhs->kind == ND_INDEX && lhs->left != 0 && lhs->left->kind == ND_VAR) {
+    int aesz = cg_arr_esz(lhs->left->sval);
+    if (aesz == 0) { aesz = cg_intptr_esz(lhs->left->sval); }
+    if (aesz == 0 && cg_global_is_array(lhs->left->sval) == 0) { aesz = cg_global_ptr_esz(lhs->left->sval); }
+    if (aesz == 0) { aesz = cg_global_esz(lhs->left->sval); }
+    if (aesz == 4 || aesz == 2) { return aesz; }
+  } else if (lhs->kind == ND_UNARY && lhs->ival == '*' && lhs->left != 0 && lhs->left->kind == ND_VAR && cg_is_intptr(lhs->left->sval)) {
+    int desz = cg_intptr_esz(lhs->left->sval);
+    if (desz == 0) { desz = cg_global_ptr_esz(lhs->left->sval); }
+    if (desz == 0) { desz = 4; }
+    if (desz == 4 || desz == 2) { return desz; }
+  } else if (lhs->kind == ND_UNARY && lhs->ival == '*' && lhs->left != 0 && lhs->left->kind == ND_BINARY && lhs->left->left != 0 && lhs->left->left->kind == ND_VAR && cg_is_intptr(lhs->left->left->sval)) {
+    int desz = cg_intptr_esz(lhs->left->left->sval);
+    if (desz == 0) { desz = cg_global_ptr_esz(lhs->left->left->sval); }
+    if (desz == 0) { desz = 4; }
+    if (desz == 4 || desz == 2) { return desz; }
+  } else if (lhs->kind == ND_UNARY && lhs->ival == '*' && lhs->left != 0 && (lhs->left->kind == ND_POSTINC || lhs->left->kind == ND_POSTDEC) && lhs->left->left != 0 && lhs->left->left->kind == ND_VAR && cg_is_intptr(lhs->left->left->sval)) {
+    int desz = cg_intptr_esz(lhs->left->left->sval);
+    if (desz == 0) { desz = cg_global_ptr_esz(lhs->left->left->sval); }
+    if (desz == 0) { desz = 4; }
+    if (desz == 4 || desz == 2) { return desz; }
+  } else if (lhs->kind == ND_UNARY && lhs->ival == '*' && lhs->left != 0 && (lhs->left->kind == ND_ARROW || lhs->left->kind == ND_FIELD)) {
+    // Store through struct field pointer: *mi->field = val
+    int fp = cg_field_is_ptr(lhs->left->sval2, lhs->left->sval);
+    if (fp == 1 && cg_field_is_char(lhs->left->sval2, lhs->left->sval)) { return 1; }
+    if (fp == 1 && field_stype(lhs->left->sval2, lhs->left->sval) == 0) {
+      if (cg_field_is_short(lhs->left->sval2, lhs->left->sval)) { return 2; }
+      if (cg_field_is_long(lhs->left->sval2, lhs->left->sval)) { return 8; }
+      return 4;
+    }
+  } else if (lhs->kind == ND_INDEX && lhs->left != 0 && lhs->left->kind == ND_INDEX && lhs->left->left != 0 && lhs->left->left->kind == ND_VAR) {
+    // 2D array element store: arr[i][j] = val
+    int aesz = cg_arr_esz(lhs->left->left->sval);
+    if (aesz == 0) { aesz = cg_global_ptr_esz(lhs->left->left->sval); }
+    if (aesz == 0) { aesz = cg_global_esz(lhs->left->left->sval); }
+    if (aesz == 4 || aesz == 2) { return aesz; }
   }
+  return 8;
+}
+
+// Store w0/x0 to [x1] with the given width
+int gen_store_by_bsz(int bsz) {
+  if (bsz == 1) { emit_line("\tstrb\tw0, [x1]"); }
+  else if (bsz == 2) { emit_line("\tstrh\tw0, [x1]"); }
+  else if (bsz == 4) { emit_line("\tstr\tw0, [x1]"); }
+  else { emit_line("\tstr\tx0, [x1]"); }
   return 0;
 }
 
+// Struct type copied by an assignment whose target is a struct value, or 0
+int *cg_assign_struct_type(struct Expr *e) {
+  int *sa_type = 0;
+  if (e->left->kind == ND_VAR) {
+    sa_type = cg_structvar_type(e->left->sval);
+    // Also check global struct vars
+    if (sa_type == 0) { sa_type = cg_global_stype(e->left->sval); }
+  }
+  if (sa_type == 0 && (e->left->kind == ND_FIELD || e->left->kind == ND_ARROW)) {
+    sa_type = cg_field_struct_type(e->left->sval2, e->left->sval);
+  }
+  // Deref struct pointer: *p where p is struct*
+  if (sa_type == 0 && e->left->kind == ND_UNARY && e->left->ival == '*' && e->left->left->kind == ND_VAR) {
+    sa_type = cg_ptr_structvar_type(e->left->left->sval);
+    if (sa_type == 0) { sa_type = cg_global_stype(e->left->left->sval); }
+  }
+  // Indexing struct array: arr[i]
+  if (sa_type == 0 && e->left->kind == ND_INDEX && e->left->left->kind == ND_VAR) {
+    sa_type = cg_structvar_type(e->left->left->sval);
+    if (sa_type == 0) { sa_type = cg_ptr_structvar_type(e->left->left->sval); }
+    if (sa_type == 0) { sa_type = cg_global_stype(e->left->left->sval); }
+  }
+  return sa_type;
+}
+
 int gen_val_assign(struct Expr *e) {
   int bf_bit_off = 0;
   int bf_width = 0;
@@ -8943,9 +11605,9 @@ int gen_val_assign(struct Expr *e) {
       bf_mask = (1 << bf_width) - 1;
       bf_clear_mask = bf_mask << bf_bit_off;
       gen_addr(e->left);
-      emit_line("\tstr\tx0, [sp, #-16]!");
+      cg_push_tmp();
       gen_value(e->right);
-      emit_line("\tldr\tx1, [sp], #16");
+      cg_pop_tmp(1);
       emit_s("\tand\tx0, x0, #");
       emit_num(bf_mask);
       emit_ch('\n');
@@ -8971,27 +11633,29 @@ int gen_val_assign(struct Expr *e) {
       return 0;
     }
   }
-  // Check for multi-field struct assignment
-  sa_type = 0;
-  if (e->left->kind == ND_VAR) {
-    sa_type = cg_structvar_type(e->left->sval);
-    // Also check global struct vars
-    if (sa_type == 0) { sa_type = cg_global_stype(e->left->sval); }
-  }
-  if (sa_type == 0 && (e->left->kind == ND_FIELD || e->left->kind == ND_ARROW)) {
-    sa_type = cg_field_struct_type(e->left->sval2, e->left->sval);
-  }
-  // Deref struct pointer: *p where p is struct*
-  if (sa_type == 0 && e->left->kind == ND_UNARY && e->left->ival == '*' && e->left->left->kind == ND_VAR) {
-    sa_type = cg_ptr_structvar_type(e->left->left->sval);
-    if (sa_type == 0) { sa_type = cg_global_stype(e->left->left->sval); }
-  }
-  // Indexing struct array: arr[i]
-  if (sa_type == 0 && e->left->kind == ND_INDEX && e->left->left->kind == ND_VAR) {
-    sa_type = cg_structvar_type(e->left->left->sval);
-    if (sa_type == 0) { sa_type = cg_ptr_structvar_type(e->left->left->sval); }
-    if (sa_type == 0) { sa_type = cg_global_stype(e->left->left->sval); }
+  // Register local: no address to compute, store by normalizing into the register
+  if (e->left->kind == ND_VAR && cg_var_reg(e->left->sval) > 0) {
+    int vr = cg_var_reg(e->left->sval);
+    int target_is_float = cg_is_float(e->left->sval);
+    int value_is_float = expr_is_float(e->right);
+    gen_value(e->right);
+    if (target_is_float && value_is_float == 0) {
+      emit_line("\tscvtf\td0, x0");
+      emit_line("\tfmov\tx0, d0");
+    } else if (target_is_float == 0 && value_is_float) {
+      emit_line("\tfmov\td0, x0");
+      emit_line("\tfcvtzs\tx0, d0");
+    }
+    {
+      int bc = cg_is_barechar(e->left->sval);
+      if (bc == 2) { emit_line("\tuxtb\tw0, w0"); }
+      else if (bc == 1) { emit_line("\tsxtb\tx0, w0"); }
+    }
+    cg_set_var_reg(vr, e->left->sval);
+    return 0;
   }
+  // Check for multi-field struct assignment
+  sa_type = cg_assign_struct_type(e);
   if (sa_type != 0) {
     sa_nf = cg_struct_nfields(sa_type);
     if (sa_nf >= 1) {
@@ -8999,14 +11663,14 @@ int gen_val_assign(struct Expr *e) {
     }
     if (sa_nf >= 1) {
       gen_addr(e->left);
-      emit_line("\tstr\tx0, [sp, #-16]!");
+      cg_push_tmp();
       // Get source address
       if (e->right->kind == ND_UNARY && e->right->ival == '*') {
         gen_value(e->right->left);
       } else {
         gen_addr(e->right);
       }
-      emit_line("\tldr\tx1, [sp], #16");
+      cg_pop_tmp(1);
       // x0 = src addr, x1 = dest addr — byte-level copy
       {
         int sa_bsz = cg_struct_byte_size(sa_type);
@@ -9042,9 +11706,9 @@ int gen_val_assign(struct Expr *e) {
     }
   }
   gen_addr(e->left);
-  emit_line("\tstr\tx0, [sp, #-16]!");
+  cg_push_tmp();
   gen_value(e->right);
-  emit_line("\tldr\tx1, [sp], #16");
+  cg_pop_tmp(1);
   {
     // Float conversion: int-to-float or float-to-int
     int target_is_float = 0;
@@ -9059,92 +11723,13 @@ int gen_val_assign(struct Expr *e) {
       emit_line("\tfmov\td0, x0");
       emit_line("\tfcvtzs\tx0, d0");
     }
-    int assign_char = 0;
-    if (e->left->kind == ND_UNARY && e->left->ival == '*' && e->left->left->kind == ND_VAR && cg_is_char(e->left->left->sval)) { assign_char = 1; }
-    // *char_ptr++ = val or *char_ptr-- = val
-    if (e->left->kind == ND_UNARY && e->left->ival == '*' && (e->left->left->kind == ND_POSTINC || e->left->left->kind == ND_POSTDEC) && e->left->left->left != 0 && e->left->left->left->kind == ND_VAR && cg_is_char(e->left->left->left->sval)) { assign_char = 1; }
-    if (e->left->kind == ND_INDEX && e->left->left->kind == ND_VAR && (cg_is_char(e->left->left->sval) || cg_is_char_larr(e->left->left->sval) || cg_global_is_bare_char_arr(e->left->left->sval))) { assign_char = 1; }
-    if (e->left->kind == ND_INDEX && (e->left->left->kind == ND_ARROW || e->left->left->kind == ND_FIELD) && cg_field_is_char(e->left->left->sval2, e->left->left->sval) && (cg_field_is_ptr(e->left->left->sval2, e->left->left->sval) == 0 || cg_field_is_array(e->left->left->sval2, e->left->left->sval) == 0)) { assign_char = 1; }
-    if (e->left->kind == ND_UNARY && e->left->ival == '*' && e->left->left->kind == ND_BINARY && e->left->left->left != 0 && e->left->left->left->kind == ND_VAR && cg_is_char(e->left->left->left->sval)) { assign_char = 1; }
-    // char *arr[N]; arr[i][j] = val
-    if (e->left->kind == ND_INDEX && e->left->left->kind == ND_INDEX && e->left->left->left != 0 && e->left->left->left->kind == ND_VAR && cg_is_char_arr(e->left->left->left->sval)) { assign_char = 1; }
     // Truncate when assigning to a bare char variable
     if (e->left->kind == ND_VAR) {
       int bc = cg_is_barechar(e->left->sval);
       if (bc == 2) { emit_line("\tuxtb\tw0, w0"); }
       else if (bc == 1) { emit_line("\tsxtb\tx0, w0"); }
     }
-    if (assign_char) {
-      emit_line("\tstrb\tw0, [x1]");
-    } else if (e->left->kind == ND_FIELD || e->left->kind == ND_ARROW) {
-      int bsz = cg_field_byte_size(e->left->sval2, e->left->sval);
-      if (bsz == 1) { emit_line("\tstrb\tw0, [x1]"); }
-      else if (bsz == 2) { emit_line("\tstrh\tw0, [x1]"); }
-      else if (bsz == 4) { emit_line("\tstr\tw0, [x1]"); }
-      else { emit_line("\tstr\tx0, [x1]"); }
-    } else if (e->left->kind == ND_INDEX && (e->left->left->kind == ND_ARROW || e->left->left->kind == ND_FIELD) && cg_field_is_array(e->left->left->sval2, e->left->left->sval) > 0 && cg_field_is_ptr(e->left->left->sval2, e->left->left->sval) == 0) {
-      int es = cg_field_arr_elem_size(e->left->left->sval2, e->left->left->sval);
-      if (es == 1) { emit_line("\tstrb\tw0, [x1]"); }
-      else if (es == 2) { emit_line("\tstrh\tw0, [x1]"); }
-      else if (es == 4) { emit_line("\tstr\tw0, [x1]"); }
-      else { emit_line("\tstr\tx0, [x1]"); }
-    } else if (e->left->kind == ND_INDEX && (e->left->left->kind == ND_ARROW || e->left->left->kind == ND_FIELD) && cg_field_is_ptr(e->left->left->sval2, e->left->left->sval) == 1 && cg_field_is_char(e->left->left->sval2, e->left->left->sval) == 0 && field_stype(e->left->left->sval2, e->left->left->sval) == 0) {
-      // Struct field pointer store: s->field[i] = val where field is int*/short*
-      if (cg_field_is_short(e->left->left->sval2, e->left->left->sval)) { emit_line("\tstrh\tw0, [x1]"); }
-      else if (cg_field_is_long(e->left->left->sval2, e->left->left->sval)) { emit_line("\tstr\tx0, [x1]"); }
-      else { emit_line("\tstr\tw0, [x1]"); }
-    } else if (e->left->kind == ND_INDEX && e->left->left != 0 && e->left->left->kind == ND_VAR) {
-      int aesz = cg_arr_esz(e->left->left->sval);
-      if (aesz == 0) { aesz = cg_intptr_esz(e->left->left->sval); }
-      if (aesz == 0 && cg_global_is_array(e->left->left->sval) == 0) { aesz = cg_global_ptr_esz(e->left->left->sval); }
-      if (aesz == 0) { aesz = cg_global_esz(e->left->left->sval); }
-      if (aesz == 4) { emit_line("\tstr\tw0, [x1]"); }
-      else if (aesz == 2) { emit_line("\tstrh\tw0, [x1]"); }
-      else { emit_line("\tstr\tx0, [x1]"); }
-    } else if (e->left->kind == ND_UNARY && e->left->ival == '*' && e->left->left != 0 && e->left->left->kind == ND_VAR && cg_is_intptr(e->left->left->sval)) {
-      int desz = cg_intptr_esz(e->left->left->sval);
-      if (desz == 0) { desz = cg_global_ptr_esz(e->left->left->sval); }
-      if (desz == 0) { desz = 4; }
-      if (desz == 4) { emit_line("\tstr\tw0, [x1]"); }
-      else if (desz == 2) { emit_line("\tstrh\tw0, [x1]"); }
-      else { emit_line("\tstr\tx0, [x1]"); }
-    } else if (e->left->kind == ND_UNARY && e->left->ival == '*' && e->left->left != 0 && e->left->left->kind == ND_BINARY && e->left->left->left != 0 && e->left->left->left->kind == ND_VAR && cg_is_intptr(e->left->left->left->sval)) {
-      int desz = cg_intptr_esz(e->left->left->left->sval);
-      if (desz == 0) { desz = cg_global_ptr_esz(e->left->left->left->sval); }
-      if (desz == 0) { desz = 4; }
-      if (desz == 4) { emit_line("\tstr\tw0, [x1]"); }
-      else if (desz == 2) { emit_line("\tstrh\tw0, [x1]"); }
-      else { emit_line("\tstr\tx0, [x1]"); }
-    } else if (e->left->kind == ND_UNARY && e->left->ival == '*' && e->left->left != 0 && (e->left->left->kind == ND_POSTINC || e->left->left->kind == ND_POSTDEC) && e->left->left->left != 0 && e->left->left->left->kind == ND_VAR && cg_is_intptr(e->left->left->left->sval)) {
-      int desz = cg_intptr_esz(e->left->left->left->sval);
-      if (desz == 0) { desz = cg_global_ptr_esz(e->left->left->left->sval); }
-      if (desz == 0) { desz = 4; }
-      if (desz == 4) { emit_line("\tstr\tw0, [x1]"); }
-      else if (desz == 2) { emit_line("\tstrh\tw0, [x1]"); }
-      else { emit_line("\tstr\tx0, [x1]"); }
-    } else if (e->left->kind == ND_UNARY && e->left->ival == '*' && e->left->left != 0 && (e->left->left->kind == ND_ARROW || e->left->left->kind == ND_FIELD)) {
-      // Store through struct field pointer: *mi->field = val
-      int fp = cg_field_is_ptr(e->left->left->sval2, e->left->left->sval);
-      if (fp == 1 && cg_field_is_char(e->left->left->sval2, e->left->left->sval)) {
-        emit_line("\tstrb\tw0, [x1]");
-      } else if (fp == 1 && field_stype(e->left->left->sval2, e->left->left->sval) == 0) {
-        if (cg_field_is_short(e->left->left->sval2, e->left->left->sval)) { emit_line("\tstrh\tw0, [x1]"); }
-        else if (cg_field_is_long(e->left->left->sval2, e->left->left->sval)) { emit_line("\tstr\tx0, [x1]"); }
-        else { emit_line("\tstr\tw0, [x1]"); }
-      } else {
-        emit_line("\tstr\tx0, [x1]");
-      }
-    } else if (e->left->kind == ND_INDEX && e->left->left != 0 && e->left->left->kind == ND_INDEX && e->left->left->left != 0 && e->left->left->left->kind == ND_VAR) {
-      // 2D array element store: arr[i][j] = val
-      int aesz = cg_arr_esz(e->left->left->left->sval);
-      if (aesz == 0) { aesz = cg_global_ptr_esz(e->left->left->left->sval); }
-      if (aesz == 0) { aesz = cg_global_esz(e->left->left->left->sval); }
-      if (aesz == 4) { emit_line("\tstr\tw0, [x1]"); }
-      else if (aesz == 2) { emit_line("\tstrh\tw0, [x1]"); }
-      else { emit_line("\tstr\tx0, [x1]"); }
-    } else {
-      emit_line("\tstr\tx0, [x1]");
-    }
+    gen_store_by_bsz(cg_assign_store_bsz(e->left));
   }
   return 0;
 }
@@ -9162,10 +11747,15 @@ int gen_val_postinc_postdec(struct Expr *e) {
       if (inc == 0) { inc = 4; }
     }
   }
-  gen_addr(e->left);
-  emit_line("\tstr\tx0, [sp, #-16]!");
-  emit_line("\tldr\tx0, [x0]");
-  emit_line("\tstr\tx0, [sp, #-16]!");
+  if (e->left->kind == ND_VAR && cg_var_reg(e->left->sval) > 0) {
+    int vr = cg_var_reg(e->left->sval);
+    emit_s("\tmov\tx0, x"); emit_num(vr); emit_ch('\n');
+  } else {
+    gen_addr(e->left);
+    emit_line("\tmov\tx1, x0");
+    emit_line("\tldr\tx0, [x1]");
+  }
+  emit_line("\tmov\tx2, x0");
   if (pi_is_float) {
     // Float post-increment/decrement
     emit_line("\tfmov\td0, x0");
@@ -9189,9 +11779,10 @@ int gen_val_postinc_postdec(struct Expr *e) {
     if (bc == 2) { emit_line("\tuxtb\tw0, w0"); }
     else if (bc == 1) { emit_line("\tsxtb\tx0, w0"); }
   }
-  emit_line("\tldr\tx1, [sp, #16]");
   // Use ABI-width store for locals
-  if (e->left->kind == ND_VAR) {
+  if (e->left->kind == ND_VAR && cg_var_reg(e->left->sval) > 0) {
+    cg_set_var_reg(cg_var_reg(e->left->sval), e->left->sval);
+  } else if (e->left->kind == ND_VAR) {
     int absz = cg_var_bsz(e->left->sval);
     if (absz == 1) { emit_line("\tstrb\tw0, [x1]"); }
     else if (absz == 2) { emit_line("\tstrh\tw0, [x1]"); }
@@ -9200,7 +11791,7 @@ int gen_val_postinc_postdec(struct Expr *e) {
   } else {
     emit_line("\tstr\tx0, [x1]");
   }
-  emit_line("\tldr\tx0, [sp], #32");
+  emit_line("\tmov\tx0, x2");
   return 0;
 }
 
@@ -9287,9 +11878,7 @@ int gen_val_ternary(struct Expr *e) {
   int *else_l = 0;
   else_l = cg_new_label("tern_else");
   end_l = cg_new_label("tern_end");
-  gen_value(e->left);
-  emit_line("\tcmp\tx0, #0");
-  emit_s("\tb.eq\t"); emit_line(else_l);
+  gen_cond(e->left, else_l, 0);
   gen_value(e->right);
   emit_s("\tb\t"); emit_line(end_l);
   emit_s(else_l); emit_line(":");
@@ -9301,15 +11890,68 @@ int gen_val_ternary(struct Expr *e) {
 int gen_val_strlit(struct Expr *e) {
   int *decoded = cg_decode_string(e->sval);
   int *lab = cg_intern_string(decoded);
-  emit_s("\tadrp\tx0, ");
-  emit_s(lab);
-  emit_line("@PAGE");
-  emit_s("\tadd\tx0, x0, ");
-  emit_s(lab);
-  emit_line("@PAGEOFF");
+  emit_sym_addr("x0", "", lab, 0);
   return 0;
 }
 
+// Load width for *e (1 means a zero-extended byte)
+int cg_deref_bsz(struct Expr *e, int *is_unsigned) {
+  int deref_char = 0;
+  if (e->left->kind == ND_VAR && cg_is_char(e->left->sval)) { deref_char = 1; }
+  if (e->left->kind == ND_BINARY && e->left->left != 0 && e->left->left->kind == ND_VAR && cg_is_char(e->left->left->sval)) { deref_char = 1; }
+  if (e->left->kind == ND_BINARY && e->left->right != 0 && e->left->right->kind == ND_VAR && cg_is_char(e->left->right->sval)) { deref_char = 1; }
+  if (e->left->kind == ND_INDEX && e->left->left != 0 && e->left->left->kind == ND_VAR && cg_is_char_arr(e->left->left->sval)) { deref_char = 1; }
+  // *s++ / *s-- where s is char*
+  if ((e->left->kind == ND_POSTINC || e->left->kind == ND_POSTDEC) && e->left->left != 0 && e->left->left->kind == ND_VAR && cg_is_char(e->left->left->sval)) { deref_char = 1; }
+  // *++s / *--s where s is char* (pre-inc/dec is ND_ASSIGN)
+  if (e->left->kind == ND_ASSIGN && e->left->left != 0 && e->left->left->kind == ND_VAR && cg_is_char(e->left->left->sval)) { deref_char = 1; }
+  // *mi->field where field is char* in a struct
+  if ((e->left->kind == ND_ARROW || e->left->kind == ND_FIELD) && cg_field_is_char(e->left->sval2, e->left->sval) && cg_field_is_ptr(e->left->sval2, e->left->sval) == 1) { deref_char = 1; }
+  if (deref_char) return 1;
+  int deref_esz = 8;
+  int deref_unsigned = 0;
+  if (e->left->kind == ND_VAR && cg_is_intptr(e->left->sval)) {
+    deref_esz = cg_intptr_esz(e->left->sval);
+    if (deref_esz == 0) { deref_esz = cg_global_ptr_esz(e->left->sval); }
+    if (deref_esz == 0) { deref_esz = 4; }
+  }
+  if (e->left->kind == ND_BINARY && e->left->left != 0 && e->left->left->kind == ND_VAR && cg_is_intptr(e->left->left->sval)) {
+    deref_esz = cg_intptr_esz(e->left->left->sval);
+    if (deref_esz == 0) { deref_esz = cg_global_ptr_esz(e->left->left->sval); }
+    if (deref_esz == 0) { deref_esz = 4; }
+  }
+  // Commutative: *(N + p) where pointer is on the right
+  if (deref_esz == 8 && e->left->kind == ND_BINARY && e->left->right != 0 && e->left->right->kind == ND_VAR && cg_is_intptr(e->left->right->sval)) {
+    deref_esz = cg_intptr_esz(e->left->right->sval);
+    if (deref_esz == 0) { deref_esz = cg_global_ptr_esz(e->left->right->sval); }
+    if (deref_esz == 0) { deref_esz = 4; }
+  }
+  if ((e->left->kind == ND_POSTINC || e->left->kind == ND_POSTDEC) && e->left->left != 0 && e->left->left->kind == ND_VAR && cg_is_intptr(e->left->left->sval)) {
+    deref_esz = cg_intptr_esz(e->left->left->sval);
+    if (deref_esz == 0) { deref_esz = cg_global_ptr_esz(e->left->left->sval); }
+    if (deref_esz == 0) { deref_esz = 4; }
+  }
+  // Pre-increment/decrement: *++p or *--p is *(p = p +/- 1)
+  if (deref_esz == 8 && e->left->kind == ND_ASSIGN && e->left->left != 0 && e->left->left->kind == ND_VAR && cg_is_intptr(e->left->left->sval)) {
+    deref_esz = cg_intptr_esz(e->left->left->sval);
+    if (deref_esz == 0) { deref_esz = cg_global_ptr_esz(e->left->left->sval); }
+    if (deref_esz == 0) { deref_esz = 4; }
+  }
+  // Struct field pointer dereference: *mi->field where field is int*/short*/long*
+  if (deref_esz == 8 && (e->left->kind == ND_ARROW || e->left->kind == ND_FIELD)) {
+    int fp = cg_field_is_ptr(e->left->sval2, e->left->sval);
+    int *fst = field_stype(e->left->sval2, e->left->sval);
+    if (fp == 1 && fst == 0) {
+      if (cg_field_is_short(e->left->sval2, e->left->sval)) { deref_esz = 2; }
+      else if (cg_field_is_long(e->left->sval2, e->left->sval)) { deref_esz = 8; }
+      else { deref_esz = 4; }
+      deref_unsigned = cg_field_is_unsigned(e->left->sval2, e->left->sval);
+    }
+  }
+  *is_unsigned = deref_unsigned;
+  return deref_esz;
+}
+
 int gen_val_unary(struct Expr *e) {
   int unary_op = 0;
   unary_op = e->ival;
@@ -9318,63 +11960,10 @@ int gen_val_unary(struct Expr *e) {
     return 0;
   }
   if (unary_op == '*') {
-    int deref_char = 0;
-    if (e->left->kind == ND_VAR && cg_is_char(e->left->sval)) { deref_char = 1; }
-    if (e->left->kind == ND_BINARY && e->left->left != 0 && e->left->left->kind == ND_VAR && cg_is_char(e->left->left->sval)) { deref_char = 1; }
-    if (e->left->kind == ND_BINARY && e->left->right != 0 && e->left->right->kind == ND_VAR && cg_is_char(e->left->right->sval)) { deref_char = 1; }
-    if (e->left->kind == ND_INDEX && e->left->left != 0 && e->left->left->kind == ND_VAR && cg_is_char_arr(e->left->left->sval)) { deref_char = 1; }
-    // *s++ / *s-- where s is char*
-    if ((e->left->kind == ND_POSTINC || e->left->kind == ND_POSTDEC) && e->left->left != 0 && e->left->left->kind == ND_VAR && cg_is_char(e->left->left->sval)) { deref_char = 1; }
-    // *++s / *--s where s is char* (pre-inc/dec is ND_ASSIGN)
-    if (e->left->kind == ND_ASSIGN && e->left->left != 0 && e->left->left->kind == ND_VAR && cg_is_char(e->left->left->sval)) { deref_char = 1; }
-    // *mi->field where field is char* in a struct
-    if ((e->left->kind == ND_ARROW || e->left->kind == ND_FIELD) && cg_field_is_char(e->left->sval2, e->left->sval) && cg_field_is_ptr(e->left->sval2, e->left->sval) == 1) { deref_char = 1; }
+    int deref_unsigned = 0;
+    int deref_bsz = cg_deref_bsz(e, &deref_unsigned);
     gen_value(e->left);
-    if (deref_char) {
-      emit_line("\tldrb\tw0, [x0]");
-    } else {
-      int deref_esz = 8;
-      int deref_unsigned = 0;
-      if (e->left->kind == ND_VAR && cg_is_intptr(e->left->sval)) {
-        deref_esz = cg_intptr_esz(e->left->sval);
-        if (deref_esz == 0) { deref_esz = cg_global_ptr_esz(e->left->sval); }
-        if (deref_esz == 0) { deref_esz = 4; }
-      }
-      if (e->left->kind == ND_BINARY && e->left->left != 0 && e->left->left->kind == ND_VAR && cg_is_intptr(e->left->left->sval)) {
-        deref_esz = cg_intptr_esz(e->left->left->sval);
-        if (deref_esz == 0) { deref_esz = cg_global_ptr_esz(e->left->left->sval); }
-        if (deref_esz == 0) { deref_esz = 4; }
-      }
-      // Commutative: *(N + p) where pointer is on the right
-      if (deref_esz == 8 && e->left->kind == ND_BINARY && e->left->right != 0 && e->left->right->kind == ND_VAR && cg_is_intptr(e->left->right->sval)) {
-        deref_esz = cg_intptr_esz(e->left->right->sval);
-        if (deref_esz == 0) { deref_esz = cg_global_ptr_esz(e->left->right->sval); }
-        if (deref_esz == 0) { deref_esz = 4; }
-      }
-      if ((e->left->kind == ND_POSTINC || e->left->kind == ND_POSTDEC) && e->left->left != 0 && e->left->left->kind == ND_VAR && cg_is_intptr(e->left->left->sval)) {
-        deref_esz = cg_intptr_esz(e->left->left->sval);
-        if (deref_esz == 0) { deref_esz = cg_global_ptr_esz(e->left->left->sval); }
-        if (deref_esz == 0) { deref_esz = 4; }
-      }
-      // Pre-increment/decrement: *++p or *--p is *(p = p +/- 1)
-      if (deref_esz == 8 && e->left->kind == ND_ASSIGN && e->left->left != 0 && e->left->left->kind == ND_VAR && cg_is_intptr(e->left->left->sval)) {
-        deref_esz = cg_intptr_esz(e->left->left->sval);
-        if (deref_esz == 0) { deref_esz = cg_global_ptr_esz(e->left->left->sval); }
-        if (deref_esz == 0) { deref_esz = 4; }
-      }
-      // Struct field pointer dereference: *mi->field where field is int*/short*/long*
-      if (deref_esz == 8 && (e->left->kind == ND_ARROW || e->left->kind == ND_FIELD)) {
-        int fp = cg_field_is_ptr(e->left->sval2, e->left->sval);
-        int *fst = field_stype(e->left->sval2, e->left->sval);
-        if (fp == 1 && fst == 0) {
-          if (cg_field_is_short(e->left->sval2, e->left->sval)) { deref_esz = 2; }
-          else if (cg_field_is_long(e->left->sval2, e->left->sval)) { deref_esz = 8; }
-          else { deref_esz = 4; }
-          deref_unsigned = cg_field_is_unsigned(e->left->sval2, e->left->sval);
-        }
-      }
-      gen_load_by_bsz(deref_esz, deref_unsigned);
-    }
+    gen_load_by_bsz(deref_bsz, deref_unsigned);
     return 0;
   }
   gen_value(e->left);
@@ -9395,132 +11984,419 @@ int gen_val_unary(struct Expr *e) {
   return 0;
 }
 
-int gen_val_binary(struct Expr *e) {
-  int *bin_op = 0;
-  int *end_l = 0;
-  int *rhs_l = 0;
-  bin_op = e->sval2;
+// Shift amount for a power of two, or -1
+int cg_log2(long v) {
+  int k = 0;
+  if (v <= 0) return 0 - 1;
+  while ((v & 1) == 0) { v = v >> 1; k++; }
+  if (v != 1) return 0 - 1;
+  return k;
+}
+
+// ---- Strength reduction ----
+//
+// Multiplies and divides by constants without mul, sdiv or udiv. The
+// emitters read x<ra> and write x<rd> (w registers when w is set), use x8
+// and x17 as scratch, and return 0 without emitting anything when no
+// cheaper sequence applies; with emit 0 they only report whether one does.
+
+int cg_emit_rri(int *mn, int rd, int ra, int w, int n) {
+  emit_s("\t"); emit_s(mn); emit_s("\t"); ir_emit_reg(rd, w); emit_s(", "); ir_emit_reg(ra, w);
+  emit_s(", #"); emit_num(n); emit_ch('\n');
+  return 0;
+}
 
-  // Comma operator: evaluate left (discard), evaluate right (keep)
-  if (my_strcmp(bin_op, ",") == 0) {
-    gen_value(e->left);
-    gen_value(e->right);
-    return 0;
+// mn rd, ra, rb[, sh #n]
+int cg_emit_rrr(int *mn, int rd, int ra, int rb, int w, int *sh, int n) {
+  emit_s("\t"); emit_s(mn); emit_s("\t"); ir_emit_reg(rd, w); emit_s(", "); ir_emit_reg(ra, w);
+  emit_s(", "); ir_emit_reg(rb, w);
+  if (sh != 0) { emit_s(", "); emit_s(sh); emit_s(" #"); emit_num(n); }
+  emit_ch('\n');
+  return 0;
+}
+
+// k as an operation of the given width and signedness sees it
+long cg_const_width(long k, int w, int sgn) {
+  if (w == 0) return k;
+  if (sgn) return (k << 32) >> 32;
+  return k & low_bits(32);
+}
+
+// rd = ra * k as a shift, a shifted add or sub, or one of those and a
+// shift or negate
+int cg_emit_mul_const(int rd, int ra, long k, int w, int emit) {
+  k = cg_const_width(k, w, 1);
+  if (k == 0 || k == 1) return 0;
+  int neg = k < 0;
+  long a = k;
+  if (neg) { a = 0 - k; }
+  if (a < 0) return 0;
+  int m = 0;
+  while ((a & 1) == 0) { a = a >> 1; m++; }
+  if (a == 1) {
+    if (emit && neg) {
+      emit_s("\tneg\t"); ir_emit_reg(rd, w); emit_s(", "); ir_emit_reg(ra, w);
+      if (m > 0) { emit_s(", lsl #"); emit_num(m); }
+      emit_ch('\n');
+    } else if (emit) {
+      cg_emit_rri("lsl", rd, ra, w, m);
+    }
+    return 1;
+  }
+  int n = cg_log2(a - 1);
+  if (n > 0 && neg == 0) {
+    // (2^n + 1) << m
+    if (emit == 0) return 1;
+    if (m == 0) { cg_emit_rrr("add", rd, ra, ra, w, "lsl", n); return 1; }
+    cg_emit_rrr("add", 17, ra, ra, w, "lsl", n);
+    cg_emit_rri("lsl", rd, 17, w, m);
+    return 1;
   }
+  n = cg_log2(a + 1);
+  if (n > 0 && m == 0) {
+    // ra - (ra << n) is ra * (1 - 2^n)
+    if (emit == 0) return 1;
+    if (neg) { cg_emit_rrr("sub", rd, ra, ra, w, "lsl", n); return 1; }
+    cg_emit_rrr("sub", 17, ra, ra, w, "lsl", n);
+    emit_s("\tneg\t"); ir_emit_reg(rd, w); emit_s(", "); ir_emit_reg(17, w); emit_ch('\n');
+    return 1;
+  }
+  return 0;
+}
 
-  if (my_strcmp(bin_op, "&&") == 0 || my_strcmp(bin_op, "||") == 0) {
-    end_l = cg_new_label("sc_end");
-    rhs_l = cg_new_label("sc_rhs");
+// Smallest p in 32..62 with m = ceil(2^p / d) close enough to 2^p / d that
+// (n * m) >> p is n / d for every 32-bit n, or -1. A signed n can reach
+// 2^31 in magnitude, an unsigned one 2^32 - 1.
+int cg_div_magic(long d, int sgn, long *magic) {
+  long one = 1;
+  for (int p = 32; p <= 62; p++) {
+    long m = ((one << p) + d - 1) / d;
+    long e = m * d - (one << p);
+    int ok = e <= (one << (p - 32));
+    if (sgn) { ok = e < (one << (p - 31)); }
+    if (ok) {
+      *magic = m;
+      return p;
+    }
+  }
+  return 0 - 1;
+}
 
-    gen_value(e->left);
-    emit_line("\tcmp\tx0, #0");
-    if (my_strcmp(bin_op, "&&") == 0) {
-      emit_s("\tb.ne\t"); emit_line(rhs_l);
-      emit_line("\tmov\tx0, #0");
-      emit_s("\tb\t"); emit_line(end_l);
+// rd = ra / d, or ra % d when rem is set. Powers of two become shifts and
+// masks with a rounding fixup for negative dividends; other 32-bit
+// divisors multiply the dividend, moved to the high word, by a magic
+// number and keep the high half. 64-bit divisors that are not powers of
+// two are left to sdiv/udiv.
+int cg_emit_div_const(int rd, int ra, long d, int w, int sgn, int rem, int emit) {
+  d = cg_const_width(d, w, sgn);
+  int bits = 64;
+  if (w) { bits = 32; }
+  if (d == 1 || (sgn && d == 0 - 1)) {
+    if (emit == 0) return 1;
+    if (rem) { emit_s("\tmov\t"); ir_emit_reg(rd, w); emit_line(", #0"); }
+    else if (d == 1) { emit_s("\tmov\t"); ir_emit_reg(rd, w); emit_s(", "); ir_emit_reg(ra, w); emit_ch('\n'); }
+    else { emit_s("\tneg\t"); ir_emit_reg(rd, w); emit_s(", "); ir_emit_reg(ra, w); emit_ch('\n'); }
+    return 1;
+  }
+  long ad = d;
+  if (sgn && d < 0) { ad = 0 - d; }
+  int k = cg_log2(ad);
+  if (k > 0) {
+    if (emit == 0) return 1;
+    if (sgn == 0) {
+      if (rem == 0) { cg_emit_rri("lsr", rd, ra, w, k); return 1; }
+      emit_s("\tand\t"); ir_emit_reg(rd, w); emit_s(", "); ir_emit_reg(ra, w);
+      emit_s(", #"); emit_hex(low_bits(k)); emit_ch('\n');
+      return 1;
+    }
+    // Add 2^k - 1 to negative dividends so the shift rounds toward zero
+    cg_emit_rri("asr", 8, ra, w, bits - 1);
+    cg_emit_rrr("add", 8, ra, 8, w, "lsr", bits - k);
+    if (rem) {
+      emit_s("\tand\t"); ir_emit_reg(8, w); emit_s(", "); ir_emit_reg(8, w);
+      emit_s(", #"); emit_hex(low_bits(bits) - low_bits(k)); emit_ch('\n');
+      cg_emit_rrr("sub", rd, ra, 8, w, 0, 0);
+    } else if (d < 0) {
+      cg_emit_rri("asr", 8, 8, w, k);
+      emit_s("\tneg\t"); ir_emit_reg(rd, w); emit_s(", "); ir_emit_reg(8, w); emit_ch('\n');
     } else {
-      emit_s("\tb.eq\t"); emit_line(rhs_l);
-      emit_line("\tmov\tx0, #1");
-      emit_s("\tb\t"); emit_line(end_l);
+      cg_emit_rri("asr", rd, 8, w, k);
     }
-    emit_s(rhs_l); emit_line(":");
-    gen_value(e->right);
-    emit_line("\tcmp\tx0, #0");
-    emit_line("\tcset\tx0, ne");
-    emit_s(end_l); emit_line(":");
-    return 0;
+    return 1;
   }
+  if (w == 0 || ad < 3) return 0;
+  long one = 1;
+  if (sgn == 0 && ad >= (one << 31)) {
+    // The quotient is 0 or 1
+    if (emit == 0) return 1;
+    ir_emit_imm(17, ad);
+    emit_s("\tcmp\t"); ir_emit_reg(ra, 1); emit_line(", w17");
+    if (rem == 0) { emit_s("\tcset\t"); ir_emit_reg(rd, 1); emit_line(", hs"); return 1; }
+    cg_emit_rrr("sub", 8, ra, 17, 1, 0, 0);
+    emit_s("\tcsel\t"); ir_emit_reg(rd, 1); emit_s(", w8, "); ir_emit_reg(ra, 1); emit_line(", hs");
+    return 1;
+  }
+  long m = 0;
+  int p = cg_div_magic(ad, sgn, &m);
+  if (p < 0) return 0;
+  if (emit == 0) return 1;
+  // x8 = n << 32, so the high half of x8 * m is (n * m) >> 32
+  cg_emit_rri("lsl", 8, ra, 0, 32);
+  ir_emit_imm(17, m);
+  if (sgn) { emit_line("\tsmulh\tx8, x8, x17"); } else { emit_line("\tumulh\tx8, x8, x17"); }
+  int q = 8;
+  if (rem == 0 && d > 0) { q = rd; }
+  if (sgn) {
+    if (p > 32) { cg_emit_rri("asr", 8, 8, 0, p - 32); }
+    // Round toward zero: one more for negative dividends
+    cg_emit_rrr("sub", q, 8, ra, 1, "asr", 31);
+    if (rem == 0 && d < 0) {
+      emit_s("\tneg\t"); ir_emit_reg(rd, 1); emit_line(", w8");
+    }
+  } else if (p > 32) {
+    cg_emit_rri("lsr", q, 8, 0, p - 32);
+  } else if (q != 8) {
+    emit_s("\tmov\t"); ir_emit_reg(q, 0); emit_line(", x8");
+  }
+  if (rem) {
+    ir_emit_imm(17, ad);
+    emit_s("\tmsub\t"); ir_emit_reg(rd, 1); emit_s(", w8, w17, "); ir_emit_reg(ra, 1); emit_ch('\n');
+  }
+  return 1;
+}
 
-  gen_value(e->left);
-  emit_line("\tstr\tx0, [sp, #-16]!");
-  gen_value(e->right);
-  emit_line("\tldr\tx1, [sp], #16");
-
-  // Pointer-to-struct scaling for + and -
-  if (my_strcmp(bin_op, "+") == 0 || my_strcmp(bin_op, "-") == 0) {
-    int *pstype = 0;
-    int scale_rhs = 0;
-    int *lhs_pstype = 0;
-    int *rhs_pstype = 0;
+// Element size that scales the integer side of ptr + n / ptr - n, or 0.
+// *scale_rhs is 1 when the right operand is the one to scale.
+int cg_ptr_scale(struct Expr *e, int *scale_rhs) {
+  int *bin_op = e->sval2;
+  int *lhs_pstype = 0;
+  int *rhs_pstype = 0;
+  *scale_rhs = 0;
+  if (my_strcmp(bin_op, "+") != 0 && my_strcmp(bin_op, "-") != 0) return 0;
+  if (e->left->kind == ND_VAR) {
+    lhs_pstype = cg_ptr_structvar_type(e->left->sval);
+    // Also check struct arrays (items + N where items is struct array)
+    if (lhs_pstype == 0 && cg_is_array(e->left->sval)) {
+      lhs_pstype = cg_structvar_type(e->left->sval);
+    }
+  }
+  if (e->right->kind == ND_VAR) {
+    rhs_pstype = cg_ptr_structvar_type(e->right->sval);
+    if (rhs_pstype == 0 && cg_is_array(e->right->sval)) {
+      rhs_pstype = cg_structvar_type(e->right->sval);
+    }
+  }
+  if (lhs_pstype != 0 && rhs_pstype != 0 && my_strcmp(bin_op, "-") == 0) {
+    // struct ptr - struct ptr: no scaling, divide after sub
+    return 0;
+  } else if (lhs_pstype != 0) {
+    *scale_rhs = 1;
+    return cg_struct_byte_size(lhs_pstype);
+  } else if (rhs_pstype != 0) {
+    return cg_struct_byte_size(rhs_pstype);
+  }
+  // Scale int pointer arithmetic (not char, not struct)
+  // Also includes local arrays and global arrays
+  {
+    int left_intptr = 0;
+    int right_intptr = 0;
     if (e->left->kind == ND_VAR) {
-      lhs_pstype = cg_ptr_structvar_type(e->left->sval);
-      // Also check struct arrays (items + N where items is struct array)
-      if (lhs_pstype == 0 && cg_is_array(e->left->sval)) {
-        lhs_pstype = cg_structvar_type(e->left->sval);
+      if (cg_is_intptr(e->left->sval) || (cg_is_array(e->left->sval) && cg_is_char_larr(e->left->sval) == 0)) {
+        left_intptr = 1;
+      } else if (cg_global_is_array(e->left->sval) && cg_is_char_arr(e->left->sval) == 0 && cg_global_is_bare_char_arr(e->left->sval) == 0) {
+        left_intptr = 1;
       }
     }
     if (e->right->kind == ND_VAR) {
-      rhs_pstype = cg_ptr_structvar_type(e->right->sval);
-      if (rhs_pstype == 0 && cg_is_array(e->right->sval)) {
-        rhs_pstype = cg_structvar_type(e->right->sval);
-      }
-    }
-    if (lhs_pstype != 0 && rhs_pstype != 0 && my_strcmp(bin_op, "-") == 0) {
-      // struct ptr - struct ptr: no scaling, divide after sub
-    } else if (lhs_pstype != 0) {
-      pstype = lhs_pstype;
-      scale_rhs = 1;
-    } else if (rhs_pstype != 0) {
-      pstype = rhs_pstype;
-      scale_rhs = 0;
-    }
-    if (pstype != 0) {
-      int scale = cg_struct_byte_size(pstype);
-      if (scale_rhs) {
-        emit_mov_imm("x9", scale);
-        emit_line("\tmul\tx0, x0, x9");
-      } else {
-        emit_mov_imm("x9", scale);
-        emit_line("\tmul\tx1, x1, x9");
-      }
-    } else {
-      // Scale by 8 for int pointer arithmetic (not char, not struct)
-      // Also includes local arrays and global arrays
-      int left_intptr = 0;
-      int right_intptr = 0;
-      if (e->left->kind == ND_VAR) {
-        if (cg_is_intptr(e->left->sval) || (cg_is_array(e->left->sval) && cg_is_char_larr(e->left->sval) == 0)) {
-          left_intptr = 1;
-        } else if (cg_global_is_array(e->left->sval) && cg_is_char_arr(e->left->sval) == 0 && cg_global_is_bare_char_arr(e->left->sval) == 0) {
-          left_intptr = 1;
-        }
-      }
-      if (e->right->kind == ND_VAR) {
-        if (cg_is_intptr(e->right->sval) || (cg_is_array(e->right->sval) && cg_is_char_larr(e->right->sval) == 0)) {
-          right_intptr = 1;
-        } else if (cg_global_is_array(e->right->sval) && cg_is_char_arr(e->right->sval) == 0 && cg_global_is_bare_char_arr(e->right->sval) == 0) {
-          right_intptr = 1;
-        }
-      }
-      if (left_intptr && right_intptr && my_strcmp(bin_op, "-") == 0) {
-        // ptr - ptr: don't scale, divide result by esz after sub
-        // handled below after sub instruction
-      } else if (left_intptr) {
-        int lp_esz = 8;
-        if (e->left->kind == ND_VAR) {
-          int le = cg_intptr_esz(e->left->sval);
-          if (le > 0) { lp_esz = le; }
-          if (lp_esz == 8) { le = cg_arr_esz(e->left->sval); if (le > 0) { lp_esz = le; } }
-          if (lp_esz == 8 && cg_global_is_array(e->left->sval) == 0) { le = cg_global_ptr_esz(e->left->sval); if (le > 0) { lp_esz = le; } }
-          if (lp_esz == 8) { le = cg_global_esz(e->left->sval); if (le > 0) { lp_esz = le; } }
-        }
-        if (lp_esz == 4) { emit_line("\tlsl\tx0, x0, #2"); }
-        else if (lp_esz == 2) { emit_line("\tlsl\tx0, x0, #1"); }
-        else { emit_line("\tlsl\tx0, x0, #3"); }
-      } else if (right_intptr) {
-        int rp_esz = 8;
-        if (e->right->kind == ND_VAR) {
-          int re = cg_intptr_esz(e->right->sval);
-          if (re > 0) { rp_esz = re; }
-          if (rp_esz == 8) { re = cg_arr_esz(e->right->sval); if (re > 0) { rp_esz = re; } }
-          if (rp_esz == 8 && cg_global_is_array(e->right->sval) == 0) { re = cg_global_ptr_esz(e->right->sval); if (re > 0) { rp_esz = re; } }
-          if (rp_esz == 8) { re = cg_global_esz(e->right->sval); if (re > 0) { rp_esz = re; } }
-        }
-        if (rp_esz == 4) { emit_line("\tlsl\tx1, x1, #2"); }
-        else if (rp_esz == 2) { emit_line("\tlsl\tx1, x1, #1"); }
-        else { emit_line("\tlsl\tx1, x1, #3"); }
+      if (cg_is_intptr(e->right->sval) || (cg_is_array(e->right->sval) && cg_is_char_larr(e->right->sval) == 0)) {
+        right_intptr = 1;
+      } else if (cg_global_is_array(e->right->sval) && cg_is_char_arr(e->right->sval) == 0 && cg_global_is_bare_char_arr(e->right->sval) == 0) {
+        right_intptr = 1;
       }
     }
+    if (left_intptr && right_intptr && my_strcmp(bin_op, "-") == 0) {
+      // ptr - ptr: don't scale, divide result by esz after sub
+      return 0;
+    }
+    {
+      struct Expr *pe = 0;
+      int esz = 8;
+      int pe_esz = 0;
+      if (left_intptr) { pe = e->left; *scale_rhs = 1; }
+      else if (right_intptr) { pe = e->right; }
+      else return 0;
+      pe_esz = cg_intptr_esz(pe->sval);
+      if (pe_esz > 0) { esz = pe_esz; }
+      if (esz == 8) { pe_esz = cg_arr_esz(pe->sval); if (pe_esz > 0) { esz = pe_esz; } }
+      if (esz == 8 && cg_global_is_array(pe->sval) == 0) { pe_esz = cg_global_ptr_esz(pe->sval); if (pe_esz > 0) { esz = pe_esz; } }
+      if (esz == 8) { pe_esz = cg_global_esz(pe->sval); if (pe_esz > 0) { esz = pe_esz; } }
+      if (esz == 4 || esz == 2) return esz;
+      return 8;
+    }
+  }
+}
+
+// Divisor for ptr - ptr, or 0. Int pointers divide by shifting:
+// *by_shift receives the shift amount.
+int cg_ptr_diff_div(struct Expr *e, int *by_shift) {
+  *by_shift = 0;
+  if (my_strcmp(e->sval2, "-") != 0) return 0;
+  if (e->left->kind != ND_VAR || e->right->kind != ND_VAR) return 0;
+  {
+    int *left_pstype = cg_ptr_structvar_type(e->left->sval);
+    int *right_pstype = cg_ptr_structvar_type(e->right->sval);
+    if (left_pstype != 0 && right_pstype != 0) {
+      return cg_struct_byte_size(left_pstype);
+    }
+  }
+  if (cg_is_intptr(e->left->sval) && cg_is_intptr(e->right->sval)) {
+    int pp_esz = cg_intptr_esz(e->left->sval);
+    if (pp_esz == 0) { pp_esz = cg_global_ptr_esz(e->left->sval); }
+    if (pp_esz == 0) { pp_esz = cg_global_esz(e->left->sval); }
+    if (pp_esz == 4) { *by_shift = 2; }
+    else if (pp_esz == 2) { *by_shift = 1; }
+    else { *by_shift = 3; }
+    return 1 << *by_shift;
+  }
+  return 0;
+}
+
+// Integer binary ops compare and divide unsigned when a direct operand is
+int cg_binary_unsigned(struct Expr *e) {
+  if (e->left->kind == ND_VAR && cg_is_unsigned(e->left->sval)) return 1;
+  if (e->right->kind == ND_VAR && cg_is_unsigned(e->right->sval)) return 1;
+  if (e->left->kind == ND_CALL && func_returns_unsigned(e->left->sval)) return 1;
+  if (e->right->kind == ND_CALL && func_returns_unsigned(e->right->sval)) return 1;
+  if (e->left->kind == ND_STMT_EXPR && expr_is_unsigned(e->left)) return 1;
+  if (e->right->kind == ND_STMT_EXPR && expr_is_unsigned(e->right)) return 1;
+  if (e->left->kind == ND_CAST && (e->left->ival == 4 || e->left->ival == 6 || e->left->ival == 7)) return 1;
+  if (e->right->kind == ND_CAST && (e->right->ival == 4 || e->right->ival == 6 || e->right->ival == 7)) return 1;
+  return 0;
+}
+
+// x op constant using the instruction's immediate form: add/sub #imm12
+// (optionally lsl #12), logical bitmask immediates, shifts by #n and
+// cmp/cmn #imm, or a strength-reduced multiply or divide. Returns 0 when
+// the operands need the general path.
+int gen_binary_imm(struct Expr *e) {
+  struct Expr *r = e->right;
+  int *op = e->sval2;
+  if (r->kind != ND_NUM || r->nargs != 0 || expr_is_float(e->left)) return 0;
+  long k = r->ival;
+  int use_long = (expr_is_long(e->left) || expr_is_long(r));
+  if (my_strcmp(op, "+") == 0 || my_strcmp(op, "-") == 0) {
+    int scale_rhs = 0;
+    int scale = cg_ptr_scale(e, &scale_rhs);
+    int by_shift = 0;
+    if (scale > 0 && scale_rhs == 0) return 0;
+    if (my_strcmp(op, "-") == 0 && (cg_ptr_diff_div(e, &by_shift) > 0 || by_shift > 0)) return 0;
+    if (k < 0 - 65536 || k > 65536) return 0;
+    if (scale > 0) { k = k * scale; }
+    if (my_strcmp(op, "-") == 0) { k = 0 - k; }
+    if (k < 0 - 16777215 || k > 16777215) return 0;
+    gen_value(e->left);
+    if (k > 0) { emit_add_imm("x0", "x0", k); }
+    else if (k < 0) { emit_sub_imm("x0", "x0", 0 - k); }
+    return 1;
+  }
+  if (my_strcmp(op, "&") == 0 || my_strcmp(op, "|") == 0 || my_strcmp(op, "^") == 0) {
+    if (is_logical_imm(k, 0) == 0) return 0;
+    gen_value(e->left);
+    if (my_strcmp(op, "&") == 0) { emit_s("\tand"); }
+    else if (my_strcmp(op, "|") == 0) { emit_s("\torr"); }
+    else { emit_s("\teor"); }
+    emit_s("\tx0, x0, #"); emit_hex(k); emit_ch('\n');
+    return 1;
+  }
+  if (my_strcmp(op, "<<") == 0 || my_strcmp(op, ">>") == 0) {
+    int *w = "w";
+    int bits = 32;
+    if (my_strcmp(op, "<<") == 0 || use_long) { w = "x"; bits = 64; }
+    if (k < 0 || k >= bits) return 0;
+    int sext = 0;
+    gen_value(e->left);
+    if (my_strcmp(op, "<<") == 0) { emit_s("\tlsl"); }
+    else if (cg_binary_unsigned(e) || expr_is_unsigned(e->left)) { emit_s("\tlsr"); }
+    else { emit_s("\tasr"); sext = use_long == 0; }
+    emit_s("\t"); emit_s(w); emit_s("0, "); emit_s(w); emit_s("0, #"); emit_num(k); emit_ch('\n');
+    if (sext) { emit_line("\tsxtw\tx0, w0"); }
+    return 1;
+  }
+  if (my_strcmp(op, "*") == 0) {
+    if (cg_emit_mul_const(0, 0, k, 0, 0) == 0) return 0;
+    gen_value(e->left);
+    cg_emit_mul_const(0, 0, k, 0, 1);
+    return 1;
+  }
+  if (my_strcmp(op, "/") == 0 || my_strcmp(op, "%") == 0) {
+    int rem = my_strcmp(op, "%") == 0;
+    int sgn = cg_binary_unsigned(e) == 0;
+    if (cg_emit_div_const(0, 0, k, use_long == 0, sgn, rem, 0) == 0) return 0;
+    gen_value(e->left);
+    cg_emit_div_const(0, 0, k, use_long == 0, sgn, rem, 1);
+    if (sgn && use_long == 0) { emit_line("\tsxtw\tx0, w0"); }
+    return 1;
+  }
+  int cc = ir_cc_of(op, cg_binary_unsigned(e));
+  if (cc >= 0 && k >= 0 - 4095 && k <= 4095) {
+    int *cw = "w";
+    if (use_long) { cw = "x"; }
+    gen_value(e->left);
+    cg_cmp_imm(cw, k);
+    emit_s("\tcset\tw0, "); emit_line(ir_cc_name(cc));
+    return 1;
+  }
+  return 0;
+}
+
+int gen_val_binary(struct Expr *e) {
+  int *bin_op = 0;
+  int *end_l = 0;
+  int *false_l = 0;
+  bin_op = e->sval2;
+
+  // Comma operator: evaluate left (discard), evaluate right (keep)
+  if (my_strcmp(bin_op, ",") == 0) {
+    gen_value(e->left);
+    gen_value(e->right);
+    return 0;
+  }
+
+  if (my_strcmp(bin_op, "&&") == 0 || my_strcmp(bin_op, "||") == 0) {
+    // Branch on the whole condition, then materialize its value once
+    end_l = cg_new_label("sc_end");
+    false_l = cg_new_label("sc_false");
+    gen_cond(e, false_l, 0);
+    emit_line("\tmov\tx0, #1");
+    emit_s("\tb\t"); emit_line(end_l);
+    emit_s(false_l); emit_line(":");
+    emit_line("\tmov\tx0, #0");
+    emit_s(end_l); emit_line(":");
+    return 0;
+  }
+
+  if (gen_binary_imm(e)) { return 0; }
+
+  gen_value(e->left);
+  cg_push_tmp();
+  gen_value(e->right);
+  cg_pop_tmp(1);
+
+  // Pointer scaling for + and -
+  {
+    int scale_rhs = 0;
+    int scale = cg_ptr_scale(e, &scale_rhs);
+    int *sreg = "x1";
+    if (scale_rhs) { sreg = "x0"; }
+    if (scale > 1 && cg_log2(scale) > 0) {
+      emit_s("\tlsl\t"); emit_s(sreg); emit_s(", "); emit_s(sreg); emit_s(", #");
+      emit_num(cg_log2(scale)); emit_ch('\n');
+    } else if (scale > 0 && cg_emit_mul_const(scale_rhs == 0, scale_rhs == 0, scale, 0, 1)) {
+      // Shift and add
+    } else if (scale > 0) {
+      emit_mov_imm("x9", scale);
+      emit_s("\tmul\t"); emit_s(sreg); emit_s(", "); emit_s(sreg); emit_line(", x9");
+    }
   }
 
   // Check if either operand is float
@@ -9548,13 +12424,7 @@ int gen_val_binary(struct Expr *e) {
   }
 
   // Check if either operand is unsigned
-  int use_unsigned = 0;
-  if (e->left->kind == ND_VAR && cg_is_unsigned(e->left->sval)) { use_unsigned = 1; }
-  if (e->right->kind == ND_VAR && cg_is_unsigned(e->right->sval)) { use_unsigned = 1; }
-  if (e->left->kind == ND_CALL && func_returns_unsigned(e->left->sval)) { use_unsigned = 1; }
-  if (e->right->kind == ND_CALL && func_returns_unsigned(e->right->sval)) { use_unsigned = 1; }
-  if (e->left->kind == ND_CAST && (e->left->ival == 4 || e->left->ival == 6 || e->left->ival == 7)) { use_unsigned = 1; }
-  if (e->right->kind == ND_CAST && (e->right->ival == 4 || e->right->ival == 6 || e->right->ival == 7)) { use_unsigned = 1; }
+  int use_unsigned = cg_binary_unsigned(e);
 
   // Check if either operand is 64-bit (long/pointer) — use x registers; otherwise use w registers
   int use_long = 0;
@@ -9564,21 +12434,14 @@ int gen_val_binary(struct Expr *e) {
   else if (my_strcmp(bin_op, "-") == 0) {
     emit_line("\tsub\tx0, x1, x0");
     // ptr - ptr: divide by element size to get element count
-    if (e->left->kind == ND_VAR && e->right->kind == ND_VAR) {
-      int *left_pstype = cg_ptr_structvar_type(e->left->sval);
-      int *right_pstype = cg_ptr_structvar_type(e->right->sval);
-      if (left_pstype != 0 && right_pstype != 0) {
-        int scale = cg_struct_byte_size(left_pstype);
-        emit_mov_imm("x9", scale);
+    {
+      int by_shift = 0;
+      int pdiv = cg_ptr_diff_div(e, &by_shift);
+      if (by_shift) {
+        emit_s("\tasr\tx0, x0, #"); emit_num(by_shift); emit_ch('\n');
+      } else if (pdiv > 0) {
+        emit_mov_imm("x9", pdiv);
         emit_line("\tsdiv\tx0, x0, x9");
-      } else if (cg_is_intptr(e->left->sval) && cg_is_intptr(e->right->sval)) {
-        int pp_esz = cg_intptr_esz(e->left->sval);
-        if (pp_esz == 0) { pp_esz = cg_global_ptr_esz(e->left->sval); }
-        if (pp_esz == 0) { pp_esz = cg_global_esz(e->left->sval); }
-        if (pp_esz == 0) { pp_esz = 8; }
-        if (pp_esz == 4) { emit_line("\tasr\tx0, x0, #2"); }
-        else if (pp_esz == 2) { emit_line("\tasr\tx0, x0, #1"); }
-        else { emit_line("\tasr\tx0, x0, #3"); }
       }
     }
   }
@@ -9589,7 +12452,7 @@ int gen_val_binary(struct Expr *e) {
       else { emit_line("\tsdiv\tx0, x1, x0"); }
     } else {
       if (use_unsigned) { emit_line("\tudiv\tw0, w1, w0"); }
-      else { emit_line("\tsdiv\tw0, w1, w0"); }
+      else { emit_line("\tsdiv\tw0, w1, w0"); emit_line("\tsxtw\tx0, w0"); }
     }
   }
   else if (my_strcmp(bin_op, "&") == 0) { emit_line("\tand\tx0, x1, x0"); }
@@ -9605,7 +12468,7 @@ int gen_val_binary(struct Expr *e) {
       else { emit_line("\tasr\tx0, x1, x0"); }
     } else {
       if (shift_unsigned) { emit_line("\tlsr\tw0, w1, w0"); }
-      else { emit_line("\tasr\tw0, w1, w0"); }
+      else { emit_line("\tasr\tw0, w1, w0"); emit_line("\tsxtw\tx0, w0"); }
     }
   }
   else if (my_strcmp(bin_op, "%") == 0) {
@@ -9617,6 +12480,7 @@ int gen_val_binary(struct Expr *e) {
       if (use_unsigned) { emit_line("\tudiv\tw9, w1, w0"); }
       else { emit_line("\tsdiv\tw9, w1, w0"); }
       emit_line("\tmsub\tw0, w9, w0, w1");
+      if (use_unsigned == 0) { emit_line("\tsxtw\tx0, w0"); }
     }
   }
   else if (my_strcmp(bin_op, "==") == 0) {
@@ -9653,16 +12517,14 @@ int gen_val_binary(struct Expr *e) {
 }
 
 int gen_val_call(struct Expr *e) {
-  int var_space = 0;
   int *name = e->sval;
-  int nargs = e->nargs;
 
   // __read_byte intrinsic
   if (my_strcmp(name, "__read_byte") == 0) {
     gen_value(e->args[0]);
-    emit_line("\tstr\tx0, [sp, #-16]!");
+    cg_push_tmp();
     gen_value(e->args[1]);
-    emit_line("\tldr\tx1, [sp], #16");
+    cg_pop_tmp(1);
     emit_line("\tldrb\tw0, [x1, x0]");
     return 0;
   }
@@ -9670,12 +12532,12 @@ int gen_val_call(struct Expr *e) {
   // __write_byte intrinsic
   if (my_strcmp(name, "__write_byte") == 0) {
     gen_value(e->args[0]);
-    emit_line("\tstr\tx0, [sp, #-16]!");
+    cg_push_tmp();
     gen_value(e->args[1]);
-    emit_line("\tstr\tx0, [sp, #-16]!");
+    cg_push_tmp();
     gen_value(e->args[2]);
-    emit_line("\tldr\tx1, [sp], #16");
-    emit_line("\tldr\tx2, [sp], #16");
+    cg_pop_tmp(1);
+    cg_pop_tmp(2);
     emit_line("\tstrb\tw0, [x2, x1]");
     return 0;
   }
@@ -9691,18 +12553,106 @@ int gen_val_call(struct Expr *e) {
       // Plain variable: use gen_addr to get its address
       gen_addr(e->args[0]);
     }
-    emit_line("\tadd\tx1, x29, #16");
+    emit_add_imm("x1", "x29", va_area_gap);
     emit_line("\tstr\tx1, [x0]");
+    if (cg_va_save) {
+      // Fill in the va_list: where the unnamed arguments start in each
+      // register save area and on the stack
+      int top = va_area_gap + cg_va_area();
+      int ngr = cg_va_ngr;
+      int nvr = cg_va_nvr;
+      int nstk = 0;
+      if (ngr > va_spill_regs) { nstk = nstk + ngr - va_spill_regs; ngr = va_spill_regs; }
+      if (nvr > 8) { nstk = nstk + nvr - 8; nvr = 8; }
+      if (target_x86) {
+        emit_mov_imm("x2", 8 * ngr);
+        emit_line("\tstr\tw2, [x1]");
+        emit_mov_imm("x2", 8 * va_spill_regs + 16 * nvr);
+        emit_line("\tstr\tw2, [x1, #4]");
+        emit_add_imm("x2", "x29", 16 + cg_va_area() + 8 * nstk);
+        emit_line("\tstr\tx2, [x1, #8]");
+        emit_add_imm("x2", "x29", va_area_gap + cg_va_gr_off());
+        emit_line("\tstr\tx2, [x1, #16]");
+        return 0;
+      }
+      emit_add_imm("x2", "x29", 16 + cg_va_area() + 8 * nstk);
+      emit_line("\tstr\tx2, [x1]");
+      emit_add_imm("x2", "x29", top);
+      emit_line("\tstr\tx2, [x1, #8]");
+      emit_add_imm("x2", "x29", va_area_gap + 32 + 16 * 8);
+      emit_line("\tstr\tx2, [x1, #16]");
+      emit_mov_imm("x2", 0 - 8 * (va_spill_regs - ngr));
+      emit_line("\tstr\tw2, [x1, #24]");
+      emit_mov_imm("x2", 0 - 16 * (8 - nvr));
+      emit_line("\tstr\tw2, [x1, #28]");
+    }
     return 0;
   }
 
-  // __builtin_va_arg(ap, type) => load *ap, advance ap += 8
+  // __builtin_va_arg(ap, type): ap walks the argument slots on Mach-O; on
+  // ELF it points at an AAPCS64 (or on x86-64 a SysV) va_list, and the
+  // value comes from the general or floating-point save area until that
+  // runs out, then from the stack
   if (my_strcmp(name, "__builtin_va_arg") == 0) {
-    gen_addr(e->args[0]); // address of ap variable (so we can modify it)
-    emit_line("\tldr\tx1, [x0]"); // x1 = current va ptr (value of ap)
-    emit_line("\tadd\tx2, x1, #8"); // x2 = next position
-    emit_line("\tstr\tx2, [x0]"); // ap = advanced pointer
-    emit_line("\tldr\tx0, [x1]"); // x0 = value at current position
+    gen_addr(e->args[0]);
+    if (target_elf == 0) {
+      emit_line("\tldr\tx1, [x0]");
+      emit_line("\tadd\tx2, x1, #8");
+      emit_line("\tstr\tx2, [x0]");
+      emit_line("\tldr\tx0, [x1]");
+      return 0;
+    }
+    int fp = e->nargs > 1 && e->args[1]->ival;
+    int *stk_l = cg_new_label("va_stack");
+    int *end_l = cg_new_label("va_end");
+    emit_line("\tldr\tx1, [x0]");
+    if (target_x86) {
+      // SysV: the offsets count up to the end of each part of the
+      // register save area, and overflow_arg_area walks the stack
+      if (fp) {
+        emit_line("\tldr\tw2, [x1, #4]");
+        emit_s("\tcmp\tx2, #"); emit_num(8 * va_spill_regs + 16 * 8); emit_ch('\n');
+        emit_s("\tb.hs\t"); emit_line(stk_l);
+        emit_line("\tadd\tx3, x2, #16");
+        emit_line("\tstr\tw3, [x1, #4]");
+      } else {
+        emit_line("\tldr\tw2, [x1]");
+        emit_s("\tcmp\tx2, #"); emit_num(8 * va_spill_regs); emit_ch('\n');
+        emit_s("\tb.hs\t"); emit_line(stk_l);
+        emit_line("\tadd\tx3, x2, #8");
+        emit_line("\tstr\tw3, [x1]");
+      }
+      emit_line("\tldr\tx3, [x1, #16]");
+      emit_line("\tldr\tx0, [x3, x2]");
+      emit_s("\tb\t"); emit_line(end_l);
+      emit_s(stk_l); emit_line(":");
+      emit_line("\tldr\tx3, [x1, #8]");
+      emit_line("\tadd\tx2, x3, #8");
+      emit_line("\tstr\tx2, [x1, #8]");
+      emit_line("\tldr\tx0, [x3]");
+      emit_s(end_l); emit_line(":");
+      return 0;
+    }
+    if (fp) { emit_line("\tldrsw\tx2, [x1, #28]"); } else { emit_line("\tldrsw\tx2, [x1, #24]"); }
+    emit_line("\tcmp\tx2, #0");
+    emit_s("\tb.ge\t"); emit_line(stk_l);
+    if (fp) {
+      emit_line("\tadd\tx3, x2, #16");
+      emit_line("\tstr\tw3, [x1, #28]");
+      emit_line("\tldr\tx3, [x1, #16]");
+    } else {
+      emit_line("\tadd\tx3, x2, #8");
+      emit_line("\tstr\tw3, [x1, #24]");
+      emit_line("\tldr\tx3, [x1, #8]");
+    }
+    emit_line("\tldr\tx0, [x3, x2]");
+    emit_s("\tb\t"); emit_line(end_l);
+    emit_s(stk_l); emit_line(":");
+    emit_line("\tldr\tx3, [x1]");
+    emit_line("\tadd\tx2, x3, #8");
+    emit_line("\tstr\tx2, [x1]");
+    emit_line("\tldr\tx0, [x3]");
+    emit_s(end_l); emit_line(":");
     return 0;
   }
 
@@ -9732,13 +12682,13 @@ int gen_val_call(struct Expr *e) {
 
   // __builtin_abort() => call abort
   if (my_strcmp(name, "__builtin_abort") == 0) {
-    emit_line("\tbl\t_abort");
+    emit_sym_line("\tbl\t", "abort");
     return 0;
   }
 
   // __builtin_trap() => call abort
   if (my_strcmp(name, "__builtin_trap") == 0) {
-    emit_line("\tbl\t_abort");
+    emit_sym_line("\tbl\t", "abort");
     return 0;
   }
 
@@ -9786,9 +12736,9 @@ int gen_val_call(struct Expr *e) {
   // __builtin_copysign(x, y) => copy sign from y to x
   if (my_strcmp(name, "__builtin_copysign") == 0 || my_strcmp(name, "__builtin_copysignf") == 0) {
     gen_value(e->args[0]);
-    emit_line("\tstr\tx0, [sp, #-16]!");
+    cg_push_tmp();
     gen_value(e->args[1]);
-    emit_line("\tldr\tx1, [sp], #16");
+    cg_pop_tmp(1);
     // Clear sign bit of x1, copy sign bit of x0 to x1
     emit_line("\tand\tx1, x1, #0x7fffffffffffffff");
     emit_line("\tand\tx0, x0, #0x8000000000000000");
@@ -9811,13 +12761,13 @@ int gen_val_call(struct Expr *e) {
   // __builtin_add_overflow(a, b, *result) => *result = a + b, return overflow
   if (my_strcmp(name, "__builtin_add_overflow") == 0) {
     gen_value(e->args[0]);
-    emit_line("\tstr\tx0, [sp, #-16]!");
+    cg_push_tmp();
     gen_value(e->args[1]);
-    emit_line("\tstr\tx0, [sp, #-16]!");
+    cg_push_tmp();
     gen_value(e->args[2]);  // pointer to result
     emit_line("\tmov\tx2, x0");
-    emit_line("\tldr\tx1, [sp], #16");
-    emit_line("\tldr\tx0, [sp], #16");
+    cg_pop_tmp(1);
+    cg_pop_tmp(0);
     emit_line("\tadds\tx3, x0, x1");
     emit_line("\tstr\tx3, [x2]");
     emit_line("\tcset\tx0, vs");
@@ -9826,13 +12776,13 @@ int gen_val_call(struct Expr *e) {
   // __builtin_sub_overflow(a, b, *result) => *result = a - b, return overflow
   if (my_strcmp(name, "__builtin_sub_overflow") == 0) {
     gen_value(e->args[0]);
-    emit_line("\tstr\tx0, [sp, #-16]!");
+    cg_push_tmp();
     gen_value(e->args[1]);
-    emit_line("\tstr\tx0, [sp, #-16]!");
+    cg_push_tmp();
     gen_value(e->args[2]);
     emit_line("\tmov\tx2, x0");
-    emit_line("\tldr\tx1, [sp], #16");
-    emit_line("\tldr\tx0, [sp], #16");
+    cg_pop_tmp(1);
+    cg_pop_tmp(0);
     emit_line("\tsubs\tx3, x0, x1");
     emit_line("\tstr\tx3, [x2]");
     emit_line("\tcset\tx0, vs");
@@ -9841,13 +12791,13 @@ int gen_val_call(struct Expr *e) {
   // __builtin_mul_overflow(a, b, *result) => *result = a * b, return overflow
   if (my_strcmp(name, "__builtin_mul_overflow") == 0) {
     gen_value(e->args[0]);
-    emit_line("\tstr\tx0, [sp, #-16]!");
+    cg_push_tmp();
     gen_value(e->args[1]);
-    emit_line("\tstr\tx0, [sp, #-16]!");
+    cg_push_tmp();
     gen_value(e->args[2]);
     emit_line("\tmov\tx2, x0");
-    emit_line("\tldr\tx1, [sp], #16");
-    emit_line("\tldr\tx0, [sp], #16");
+    cg_pop_tmp(1);
+    cg_pop_tmp(0);
     emit_line("\tmul\tx3, x0, x1");
     emit_line("\tstr\tx3, [x2]");
     emit_line("\tsmulh\tx4, x0, x1");
@@ -9858,9 +12808,9 @@ int gen_val_call(struct Expr *e) {
   // __builtin_mul_overflow_p(a, b, c) => return overflow (no store)
   if (my_strcmp(name, "__builtin_mul_overflow_p") == 0) {
     gen_value(e->args[0]);
-    emit_line("\tstr\tx0, [sp, #-16]!");
+    cg_push_tmp();
     gen_value(e->args[1]);
-    emit_line("\tldr\tx1, [sp], #16");
+    cg_pop_tmp(1);
     emit_line("\tmul\tx3, x1, x0");
     emit_line("\tsmulh\tx4, x1, x0");
     emit_line("\tcmp\tx4, x3, asr #63");
@@ -9972,216 +12922,301 @@ int gen_val_call(struct Expr *e) {
     return 0;
   }
 
-  // Generic variadic function call (Apple ARM64 variadic ABI)
-  int vnp = 0 - 1;
+  // Real call: live expression temporaries do not survive it
+  int tmp_base = cg_save_tmps();
+  gen_val_call_site(e, name);
+  cg_restore_tmps(tmp_base);
+  return 0;
+}
+
+// ---- Call arguments ----
+// A call's arguments go straight to their places: x0-x7, x8 for the callee
+// of an indirect call, or the outgoing stack area. Only values that would
+// not survive evaluating a later argument are staged, in the expression
+// temporaries x12-x15 (on the stack past those), and moved into place just
+// before the call. Staged values and their registers never overlap, so
+// these moves need no ordering.
+
+// How an argument can be placed without gen_value: 2 for a constant or a
+// frame address, which may be computed at any point, 1 for a read of a
+// local, which must not move past a later argument's side effects, and 0
+// for anything else
+int cg_leaf_arg(struct Expr *e) {
+  if (e->kind == ND_NUM) {
+    if (e->nargs == 0 && e->ival >= 0 - 65535 && e->ival <= 65535) return 2;
+    return 0;
+  }
+  if (e->kind == ND_STRLIT) return 2;
+  int addr = 0;
+  if (e->kind == ND_UNARY && e->ival == '&') {
+    e = e->left;
+    addr = 1;
+  }
+  if (e->kind != ND_VAR) return 0;
+  int off = cg_find_slot(e->sval);
+  if (cg_var_reg(e->sval) > 0) {
+    if (addr) return 0;
+    return 1;
+  }
+  if (off <= 0 || off > 4095) return 0;
+  if (addr || cg_is_array(e->sval) || cg_is_structvar(e->sval)) return 2;
+  if (off <= 256) return 1;
+  return 0;
+}
+
+// Compute leaf argument e into x<r> alone, as gen_value would into x0
+int gen_leaf_arg(struct Expr *e, int r) {
+  int *reg = build_str2("x", int_to_str(r));
+  if (e->kind == ND_NUM) {
+    emit_mov_imm(reg, e->ival);
+    return 0;
+  }
+  if (e->kind == ND_STRLIT) {
+    emit_sym_addr(reg, "", cg_intern_string(cg_decode_string(e->sval)), 0);
+    return 0;
+  }
+  int addr = 0;
+  if (e->kind == ND_UNARY) {
+    e = e->left;
+    addr = 1;
+  }
+  int vr = cg_var_reg(e->sval);
+  if (vr > 0) {
+    emit_s("\tmov\t"); emit_s(reg); emit_s(", x"); emit_num(vr); emit_ch('\n');
+    return 0;
+  }
+  int off = cg_find_slot(e->sval);
+  if (addr || cg_is_array(e->sval) || cg_is_structvar(e->sval)) {
+    emit_sub_imm(reg, "x29", off);
+    return 0;
+  }
+  int vbsz = cg_var_bsz(e->sval);
+  if (vbsz != 1 && vbsz != 2 && vbsz != 4) { vbsz = 8; }
+  int sgn = vbsz < 8 && cg_is_unsigned(e->sval) == 0;
+  emit_s("\t"); emit_s(ir_load_mn(vbsz, sgn, 1));
+  if (vbsz < 8 && sgn == 0) { emit_s("\tw"); } else { emit_s("\tx"); }
+  emit_num(r); emit_s(", [x29, #-"); emit_num(off); emit_line("]");
+  return 0;
+}
+
+// Evaluate ex[0..n) in that order; ex[i] goes to x<tgt[i]> when tgt[i] >= 0
+// and to outgoing stack slot -1 - tgt[i] otherwise. space bytes of stack
+// area are reserved first and stay reserved for the call.
+int gen_call_args(struct Expr **ex, int *tgt, int n, int space) {
+  int *kind = my_malloc(n * 8 + 8);
+  int *staged = my_malloc(n * 8 + 8);
+  int nstaged = 0;
+  int last = 0 - 1;  // the last argument that needs gen_value
+  for (int i = 0; i < n; i++) {
+    kind[i] = cg_leaf_arg(ex[i]);
+    if (kind[i] == 0) { last = i; }
+  }
+  if (space > 0) { emit_s("\tsub\tsp, sp, #"); emit_num(space); emit_ch('\n'); }
+  for (int i = 0; i < n; i++) {
+    if (tgt[i] < 0) {
+      // Temporaries past x15 sit below the outgoing area
+      int below = cg_tmp_depth - cg_tmp_base - MAX_TMP_REGS;
+      if (below < 0) { below = 0; }
+      int slot = (0 - 1 - tgt[i]) * 8 + below * 16;
+      if (kind[i] == 0) {
+        gen_value(ex[i]);
+        emit_s("\tstr\tx0, [sp, #"); emit_num(slot); emit_line("]");
+      } else {
+        gen_leaf_arg(ex[i], 9);
+        emit_s("\tstr\tx9, [sp, #"); emit_num(slot); emit_line("]");
+      }
+    } else if (i == last) {
+      gen_value(ex[i]);
+      if (tgt[i] != 0) { emit_s("\tmov\tx"); emit_num(tgt[i]); emit_line(", x0"); }
+    } else if (i < last && kind[i] != 2) {
+      gen_value(ex[i]);
+      cg_push_tmp();
+      staged[nstaged] = i;
+      nstaged++;
+    }
+  }
+  for (int i = 0; i < n; i++) {
+    if (tgt[i] >= 0 && i != last && (i > last || kind[i] == 2)) { gen_leaf_arg(ex[i], tgt[i]); }
+  }
+  while (nstaged > 0) {
+    nstaged--;
+    cg_pop_tmp(tgt[staged[nstaged]]);
+  }
+  return 0;
+}
+
+// Bytes of outgoing stack area for n stack-passed arguments
+int cg_arg_space(int n) {
+  if (n <= 0) return 0;
+  return ((n * 8 + 15) / 16) * 16;
+}
+
+// Named parameter count of a variadic function, or -1
+int cg_variadic_nparams(int *name) {
   int vfi = 0;
   while (vfi < nvar_funcs) {
-    if (my_strcmp(var_funcs[vfi], name) == 0) {
-      vnp = var_nparams[vfi];
-      vfi = nvar_funcs;
-    }
+    if (my_strcmp(var_funcs[vfi], name) == 0) { return var_nparams[vfi]; }
     vfi++;
   }
-  if (vnp >= 0) {
-    int n_named = vnp;
-    if (n_named > nargs) { n_named = nargs; }
-    int n_var = nargs - n_named;
-    // Allocate stack for variadic args
-    if (n_var > 0) {
-      var_space = ((n_var * 8 + 15) / 16) * 16;
-      emit_s("\tsub\tsp, sp, #");
-      emit_num(var_space);
-      emit_ch('\n');
-      int vsi = 0;
-      while (vsi < n_var) {
-        gen_value(e->args[n_named + vsi]);
-        emit_s("\tstr\tx0, [sp, #");
-        emit_num(vsi * 8);
-        emit_line("]");
-        vsi++;
-      }
-    }
-    // Push named args to temp area
-    int nai = 0;
-    while (nai < n_named) {
-      gen_value(e->args[nai]);
-      emit_line("\tstr\tx0, [sp, #-16]!");
-      nai++;
-    }
-    // Load named args into registers
-    nai = 0;
-    while (nai < n_named) {
-      emit_s("\tldr\tx");
-      emit_num(nai);
-      emit_s(", [sp, #");
-      emit_num((n_named - 1 - nai) * 16);
-      emit_line("]");
-      nai++;
-    }
-    // Pop named temp area so sp points to variadic args
-    if (n_named > 0) {
-      emit_s("\tadd\tsp, sp, #");
-      emit_num(n_named * 16);
-      emit_ch('\n');
-    }
-    emit_s("\tbl\t_");
-    emit_line(name);
-    // Clean up variadic stack
-    if (n_var > 0) {
-      var_space = ((n_var * 8 + 15) / 16) * 16;
-      emit_s("\tadd\tsp, sp, #");
-      emit_num(var_space);
-      emit_ch('\n');
-    }
-    if (func_returns_ptr(name) == 0 && func_returns_unsigned(name) == 0) {
-      emit_line("\tsxtw\tx0, w0");
-    }
-    return 0;
+  return 0 - 1;
+}
+
+// Bring the result of a direct call to name into the form gen_value leaves
+// in x0: doubles move over from d0, and int results are sign-extended
+int cg_call_result(int *name) {
+  if (func_returns_float(name)) {
+    emit_line("\tfmov\tx0, d0");
+  } else if (func_returns_ptr(name) == 0 && func_ret_stype(name) == 0 && func_returns_unsigned(name) == 0) {
+    emit_line("\tsxtw\tx0, w0");
   }
+  return 0;
+}
 
-  // Regular function call
-  int ai = 0;
-  int disp = 0;
-  int real_nargs = 0;
-  int reg_nargs = 0;
-  int extra = 0;
-  int stack_arg_space = 0;
-  int src_disp = 0;
+// x86-64 variadic callees read al for how many vector registers carry
+// arguments; w18, which nothing else uses, stands for it there
+int cg_vector_count(int n) {
+  if (target_x86) { emit_s("\tmov\tw18, #"); emit_num(n); emit_ch('\n'); }
+  return 0;
+}
 
-  // Indirect call through arbitrary expression (e.g. s.field(args))
-  if (my_strcmp(name, "__indirect_call") == 0) {
-    real_nargs = nargs - 1;
-    gen_value(e->args[0]);
-    emit_line("\tstr\tx0, [sp, #-16]!");
-    ai = 0;
-    while (ai < real_nargs) {
-      gen_value(e->args[1 + ai]);
-      emit_line("\tstr\tx0, [sp, #-16]!");
-      ai++;
-    }
-    reg_nargs = real_nargs;
-    if (reg_nargs > 8) { reg_nargs = 8; }
-    extra = real_nargs - reg_nargs;
-    stack_arg_space = 0;
-    if (extra > 0) { stack_arg_space = ((extra * 8 + 15) / 16) * 16; }
-    if (stack_arg_space > 0) {
-      emit_s("\tsub\tsp, sp, #"); emit_num(stack_arg_space); emit_ch('\n');
-    }
-    ai = 0;
-    while (ai < extra) {
-      src_disp = (real_nargs - 1 - (8 + ai)) * 16 + stack_arg_space;
-      emit_s("\tldr\tx9, [sp, #"); emit_num(src_disp); emit_line("]");
-      emit_s("\tstr\tx9, [sp, #"); emit_num(ai * 8); emit_line("]");
-      ai++;
-    }
-    emit_s("\tldr\tx8, [sp, #"); emit_num(real_nargs * 16 + stack_arg_space); emit_line("]");
-    ai = 0;
-    while (ai < reg_nargs) {
-      disp = (real_nargs - 1 - ai) * 16 + stack_arg_space;
-      emit_s("\tldr\tx"); emit_num(ai); emit_s(", [sp, #"); emit_num(disp); emit_line("]");
-      ai++;
-    }
-    emit_line("\tblr\tx8");
-    if (stack_arg_space > 0) {
-      emit_s("\tadd\tsp, sp, #"); emit_num(stack_arg_space); emit_ch('\n');
-    }
-    emit_s("\tadd\tsp, sp, #"); emit_num((real_nargs + 1) * 16); emit_ch('\n');
+// Variadic call under AAPCS64 (ELF): arguments take registers as for
+// any call, floating-point ones in d0-d7 and the rest in x0-x7, and what
+// does not fit goes on the stack in order
+int gen_val_call_elf_variadic(struct Expr *e, int *name) {
+  int nargs = e->nargs;
+  int *in_fpr = my_malloc(nargs * 8 + 8);
+  int ngr = 0;
+  int nfr = 0;
+  int nstk = 0;
+  int nfloat = 0;
+  for (int ai = 0; ai < nargs; ai++) {
+    in_fpr[ai] = expr_is_float(e->args[ai]);
+    if (in_fpr[ai]) { nfloat++; }
+  }
+  if (nfloat == 0) {
+    // Integer arguments only: placed as for any other call
+    int *tgt = my_malloc(nargs * 8 + 8);
+    for (int ai = 0; ai < nargs; ai++) {
+      tgt[ai] = ai;
+      if (ai >= arg_regs) { tgt[ai] = 0 - 1 - (ai - arg_regs); }
+    }
+    int space = cg_arg_space(nargs - arg_regs);
+    gen_call_args(e->args, tgt, nargs, space);
+    cg_vector_count(0);
+    emit_sym_line("\tbl\t", name);
+    if (space > 0) { emit_s("\tadd\tsp, sp, #"); emit_num(space); emit_ch('\n'); }
+    cg_call_result(name);
     return 0;
   }
-
-  // Indirect call through function pointer variable
-  if (is_known_func(name) == 0 && (cg_find_slot(name) >= 0 || cg_is_global(name))) {
-    gen_value(new_var(name));
+  for (int ai = 0; ai < nargs; ai++) {
+    gen_value(e->args[ai]);
     emit_line("\tstr\tx0, [sp, #-16]!");
-    ai = 0;
-    while (ai < nargs) {
-      gen_value(e->args[ai]);
-      emit_line("\tstr\tx0, [sp, #-16]!");
-      ai++;
-    }
-    reg_nargs = nargs;
-    if (reg_nargs > 8) { reg_nargs = 8; }
-    extra = nargs - reg_nargs;
-    stack_arg_space = 0;
-    if (extra > 0) { stack_arg_space = ((extra * 8 + 15) / 16) * 16; }
-    if (stack_arg_space > 0) {
-      emit_s("\tsub\tsp, sp, #"); emit_num(stack_arg_space); emit_ch('\n');
-    }
-    ai = 0;
-    while (ai < extra) {
-      src_disp = (nargs - 1 - (8 + ai)) * 16 + stack_arg_space;
-      emit_s("\tldr\tx9, [sp, #"); emit_num(src_disp); emit_line("]");
-      emit_s("\tstr\tx9, [sp, #"); emit_num(ai * 8); emit_line("]");
-      ai++;
-    }
-    emit_s("\tldr\tx8, [sp, #"); emit_num(nargs * 16 + stack_arg_space); emit_line("]");
-    ai = 0;
-    while (ai < reg_nargs) {
-      disp = (nargs - 1 - ai) * 16 + stack_arg_space;
-      emit_s("\tldr\tx"); emit_num(ai); emit_s(", [sp, #"); emit_num(disp); emit_line("]");
-      ai++;
-    }
-    emit_line("\tblr\tx8");
-    if (stack_arg_space > 0) {
-      emit_s("\tadd\tsp, sp, #"); emit_num(stack_arg_space); emit_ch('\n');
+  }
+  for (int ai = 0; ai < nargs; ai++) {
+    if (in_fpr[ai] && nfr < 8) { nfr++; }
+    else if (in_fpr[ai] == 0 && ngr < arg_regs) { ngr++; }
+    else { nstk++; }
+  }
+  int space = ((nstk * 8 + 15) / 16) * 16;
+  if (space > 0) { emit_s("\tsub\tsp, sp, #"); emit_num(space); emit_ch('\n'); }
+  ngr = 0;
+  nfr = 0;
+  nstk = 0;
+  for (int ai = 0; ai < nargs; ai++) {
+    int disp = (nargs - 1 - ai) * 16 + space;
+    if (in_fpr[ai] && nfr < 8) {
+      emit_s("\tldr\td"); emit_num(nfr); emit_s(", [sp, #"); emit_num(disp); emit_line("]");
+      nfr++;
+    } else if (in_fpr[ai] == 0 && ngr < arg_regs) {
+      emit_s("\tldr\tx"); emit_num(ngr); emit_s(", [sp, #"); emit_num(disp); emit_line("]");
+      ngr++;
+    } else {
+      emit_s("\tldr\tx9, [sp, #"); emit_num(disp); emit_line("]");
+      emit_s("\tstr\tx9, [sp, #"); emit_num(nstk * 8); emit_line("]");
+      nstk++;
     }
-    emit_s("\tadd\tsp, sp, #"); emit_num((nargs + 1) * 16); emit_ch('\n');
+  }
+  cg_vector_count(nfr);
+  emit_sym_line("\tbl\t", name);
+  if (space + nargs > 0) { emit_s("\tadd\tsp, sp, #"); emit_num(space + nargs * 16); emit_ch('\n'); }
+  cg_call_result(name);
+  return 0;
+}
+
+int gen_val_call_site(struct Expr *e, int *name) {
+  int nargs = e->nargs;
+  struct Expr **ex = my_malloc(nargs * 8 + 16);
+  int *tgt = my_malloc(nargs * 8 + 16);
+  int space = 0;
+
+  // Generic variadic function call (Apple ARM64 variadic ABI)
+  int vnp = cg_variadic_nparams(name);
+  if (vnp >= 0 && target_elf) {
+    gen_val_call_elf_variadic(e, name);
+    return 0;
+  }
+  if (vnp >= 0) {
+    int n_named = vnp;
+    if (n_named > nargs) { n_named = nargs; }
+    int n_var = nargs - n_named;
+    // The variadic arguments all go on the stack and are evaluated first
+    for (int vi = 0; vi < n_var; vi++) {
+      ex[vi] = e->args[n_named + vi];
+      tgt[vi] = 0 - 1 - vi;
+    }
+    for (int ni = 0; ni < n_named; ni++) {
+      ex[n_var + ni] = e->args[ni];
+      tgt[n_var + ni] = ni;
+    }
+    space = cg_arg_space(n_var);
+    gen_call_args(ex, tgt, nargs, space);
+    emit_sym_line("\tbl\t", name);
+    if (space > 0) { emit_s("\tadd\tsp, sp, #"); emit_num(space); emit_ch('\n'); }
+    cg_call_result(name);
     return 0;
   }
 
-  // Direct function call
-  ai = 0;
-  while (ai < nargs) {
-    gen_value(e->args[ai]);
-    emit_line("\tstr\tx0, [sp, #-16]!");
-    ai++;
-  }
-  reg_nargs = nargs;
-  if (reg_nargs > 8) { reg_nargs = 8; }
-  extra = nargs - reg_nargs;
-  stack_arg_space = 0;
-  if (extra > 0) { stack_arg_space = ((extra * 8 + 15) / 16) * 16; }
-  if (stack_arg_space > 0) {
-    emit_s("\tsub\tsp, sp, #"); emit_num(stack_arg_space); emit_ch('\n');
-  }
-  ai = 0;
-  while (ai < extra) {
-    src_disp = (nargs - 1 - (8 + ai)) * 16 + stack_arg_space;
-    emit_s("\tldr\tx9, [sp, #"); emit_num(src_disp); emit_line("]");
-    emit_s("\tstr\tx9, [sp, #"); emit_num(ai * 8); emit_line("]");
-    ai++;
-  }
-  ai = 0;
-  while (ai < reg_nargs) {
-    disp = (nargs - 1 - ai) * 16 + stack_arg_space;
-    emit_s("\tldr\tx"); emit_num(ai); emit_s(", [sp, #"); emit_num(disp); emit_line("]");
-    ai++;
-  }
-  emit_s("\tbl\t_"); emit_line(name);
-  if (stack_arg_space > 0) {
-    emit_s("\tadd\tsp, sp, #"); emit_num(stack_arg_space); emit_ch('\n');
-  }
-  if (nargs > 0) {
-    emit_s("\tadd\tsp, sp, #"); emit_num(nargs * 16); emit_ch('\n');
+  // Indirect call through arbitrary expression (e.g. s.field(args)), or
+  // through a function pointer variable: the callee goes to x8
+  int indirect = 0;
+  int first = 0;
+  if (my_strcmp(name, "__indirect_call") == 0) {
+    indirect = 1;
+    ex[0] = e->args[0];
+    first = 1;
+  } else if (is_known_func(name) == 0 && (cg_find_slot(name) >= 0 || cg_is_global(name))) {
+    indirect = 1;
+    ex[0] = new_var(name);
+  }
+  int n = indirect;
+  if (indirect) { tgt[0] = 8; }
+  for (int ai = first; ai < nargs; ai++) {
+    int k = ai - first;
+    ex[n] = e->args[ai];
+    tgt[n] = k;
+    if (k >= arg_regs) { tgt[n] = 0 - 1 - (k - arg_regs); }
+    n++;
   }
-  if (func_returns_float(name)) {
-    emit_line("\tfmov\tx0, d0");
-  } else if (func_returns_ptr(name) == 0 && func_ret_stype(name) == 0 && func_returns_unsigned(name) == 0) {
-    emit_line("\tsxtw\tx0, w0");
+  space = cg_arg_space(n - indirect - arg_regs);
+  gen_call_args(ex, tgt, n, space);
+  if (indirect) {
+    emit_line("\tblr\tx8");
+  } else {
+    emit_sym_line("\tbl\t", name);
+  }
+  if (space > 0) {
+    emit_s("\tadd\tsp, sp, #"); emit_num(space); emit_ch('\n');
   }
+  if (indirect) return 0;
+  cg_call_result(name);
   return 0;
 }
 
 int gen_val_label_addr(struct Expr *e) {
-  int *la_tmp1 = build_str2("L_usr_", cg_cur_func_name);
+  int *la_tmp1 = build_str2(build_str2(lab_pfx, "usr_"), cg_cur_func_name);
   int *la_tmp2 = build_str2(la_tmp1, "_");
   int *la_lbl = build_str2(la_tmp2, e->sval);
-  emit_s("\tadrp\tx0, ");
-  emit_s(la_lbl);
-  emit_line("@PAGE");
-  emit_s("\tadd\tx0, x0, ");
-  emit_s(la_lbl);
-  emit_line("@PAGEOFF");
+  emit_sym_addr("x0", "", la_lbl, 0);
   return 0;
 }
 
@@ -10583,7 +13618,9 @@ int gen_stmt_vardecl(struct Stmt *st, int *ret_label) {
     } else {
       emit_line("\tmov\tx0, #0");
     }
-    if (vd_bsz == 1) {
+    if (cg_var_reg(vd->name) > 0) {
+      cg_set_var_reg(cg_var_reg(vd->name), vd->name);
+    } else if (vd_bsz == 1) {
       emit_sub_imm("x9", "x29", off);
       emit_line("\tstrb\tw0, [x9]");
     } else if (vd_bsz == 2) {
@@ -10606,19 +13643,111 @@ int gen_stmt_vardecl(struct Stmt *st, int *ret_label) {
   return 0;
 }
 
+// cmp w0|x0 against an immediate k with |k| <= 4095
+int cg_cmp_imm(int *w, long k) {
+  if (k >= 0) { emit_s("\tcmp\t"); emit_s(w); emit_s("0, #"); emit_num(k); }
+  else { emit_s("\tcmn\t"); emit_s(w); emit_s("0, #"); emit_num(0 - k); }
+  emit_ch('\n');
+  return 0;
+}
+
+// Bit k when e is x & 2^k for some k <= 30, else -1
+int cg_bit_test(struct Expr *e) {
+  if (e->kind != ND_BINARY || my_strcmp(e->sval2, "&") != 0) return 0 - 1;
+  if (e->right->kind != ND_NUM || e->right->nargs != 0 || expr_is_float(e->left)) return 0 - 1;
+  int k = cg_log2(e->right->ival);
+  if (k > 30) return 0 - 1;
+  return k;
+}
+
+// Branch to label when the truth of e equals jump_if. Comparisons branch on
+// the flags and && / || become control flow, so no 0/1 is materialized.
+int gen_cond(struct Expr *e, int *label, int jump_if) {
+  if (e->kind == ND_NUM && e->nargs == 0) {
+    long cv = e->ival;
+    if ((cv != 0) == jump_if) { emit_s("\tb\t"); emit_line(label); }
+    return 0;
+  }
+  if (e->kind == ND_UNARY && e->ival == '!') {
+    return gen_cond(e->left, label, jump_if == 0);
+  }
+  if (e->kind != ND_BINARY) {
+    gen_value(e);
+    if (jump_if) { emit_s("\tcbnz\tx0, "); } else { emit_s("\tcbz\tx0, "); }
+    emit_line(label);
+    return 0;
+  }
+  int *op = e->sval2;
+  if (my_strcmp(op, "&&") == 0 || my_strcmp(op, "||") == 0) {
+    int is_and = (my_strcmp(op, "&&") == 0);
+    if (is_and != jump_if) {
+      // && jumping on false, || jumping on true: either side decides
+      gen_cond(e->left, label, jump_if);
+      gen_cond(e->right, label, jump_if);
+    } else {
+      int *skip = cg_new_label("sc_skip");
+      gen_cond(e->left, skip, jump_if == 0);
+      gen_cond(e->right, label, jump_if);
+      emit_s(skip); emit_line(":");
+    }
+    return 0;
+  }
+  int bit = cg_bit_test(e);
+  if (bit >= 0) {
+    gen_value(e->left);
+    emit_s("\ttst\tx0, #"); emit_num(1 << bit); emit_ch('\n');
+    if (jump_if) { emit_s("\tb.ne\t"); } else { emit_s("\tb.eq\t"); }
+    emit_line(label);
+    return 0;
+  }
+  int cc = ir_cc_of(op, cg_binary_unsigned(e));
+  if (cc < 0 || expr_is_float(e->left) || expr_is_float(e->right)) {
+    gen_value(e);
+    if (jump_if) { emit_s("\tcbnz\tx0, "); } else { emit_s("\tcbz\tx0, "); }
+    emit_line(label);
+    return 0;
+  }
+  struct Expr *r = e->right;
+  int r_imm = (r->kind == ND_NUM && r->nargs == 0);
+  long k = 0;
+  if (r_imm) { k = r->ival; }
+  int is_zero = (r_imm && k == 0);
+  if (is_zero && (cc == IR_CC_EQ || cc == IR_CC_NE) && cg_bit_test(e->left) >= 0) {
+    return gen_cond(e->left, label, jump_if == (cc == IR_CC_NE));
+  }
+  if (jump_if == 0) { cc = ir_cc_invert(cc); }
+  int *w = "w";
+  if (expr_is_long(e->left) || expr_is_long(e->right)) { w = "x"; }
+  if (r_imm && k >= 0 - 4095 && k <= 4095) {
+    gen_value(e->left);
+    if (is_zero && (cc == IR_CC_EQ || cc == IR_CC_NE)) {
+      if (cc == IR_CC_EQ) { emit_s("\tcbz\t"); } else { emit_s("\tcbnz\t"); }
+      emit_s(w); emit_s("0, "); emit_line(label);
+      return 0;
+    }
+    cg_cmp_imm(w, k);
+  } else {
+    gen_value(e->left);
+    cg_push_tmp();
+    gen_value(e->right);
+    cg_pop_tmp(1);
+    emit_s("\tcmp\t"); emit_s(w); emit_s("1, "); emit_s(w); emit_line("0");
+  }
+  emit_s("\tb."); emit_s(ir_cc_name(cc)); emit_s("\t"); emit_line(label);
+  return 0;
+}
+
 int gen_stmt_if(struct Stmt *st, int *ret_label) {
   int *else_l = 0;
   int *end_l = 0;
   else_l = cg_new_label("else");
   end_l = cg_new_label("endif");
-  gen_value(st->expr);
-  emit_line("\tcmp\tx0, #0");
   if (st->body2 == 0) {
-    emit_s("\tb.eq\t"); emit_line(end_l);
+    gen_cond(st->expr, end_l, 0);
     gen_block(st->body, st->nbody, ret_label);
     emit_s(end_l); emit_line(":");
   } else {
-    emit_s("\tb.eq\t"); emit_line(else_l);
+    gen_cond(st->expr, else_l, 0);
     gen_block(st->body, st->nbody, ret_label);
     emit_s("\tb\t"); emit_line(end_l);
     emit_s(else_l); emit_line(":");
@@ -10628,21 +13757,24 @@ int gen_stmt_if(struct Stmt *st, int *ret_label) {
   return 0;
 }
 
+// Loops test their condition at the bottom, so each iteration takes one
+// conditional branch
 int gen_stmt_while(struct Stmt *st, int *ret_label) {
-  int *start_l = 0;
+  int *body_l = 0;
+  int *cond_l = 0;
   int *end_l = 0;
-  start_l = cg_new_label("while_start");
+  body_l = cg_new_label("while_body");
+  cond_l = cg_new_label("while_start");
   end_l = cg_new_label("while_end");
   loop_brk[nloop] = end_l;
-  loop_cont[nloop] = start_l;
+  loop_cont[nloop] = cond_l;
   nloop++;
 
-  emit_s(start_l); emit_line(":");
-  gen_value(st->expr);
-  emit_line("\tcmp\tx0, #0");
-  emit_s("\tb.eq\t"); emit_line(end_l);
+  emit_s("\tb\t"); emit_line(cond_l);
+  emit_s(body_l); emit_line(":");
   gen_block(st->body, st->nbody, ret_label);
-  emit_s("\tb\t"); emit_line(start_l);
+  emit_s(cond_l); emit_line(":");
+  gen_cond(st->expr, body_l, 1);
   emit_s(end_l); emit_line(":");
 
   nloop--;
@@ -10650,10 +13782,12 @@ int gen_stmt_while(struct Stmt *st, int *ret_label) {
 }
 
 int gen_stmt_for(struct Stmt *st, int *ret_label) {
-  int *start_l = 0;
+  int *body_l = 0;
+  int *cond_l = 0;
   int *end_l = 0;
   int *post_l = 0;
-  start_l = cg_new_label("for_start");
+  body_l = cg_new_label("for_body");
+  cond_l = cg_new_label("for_start");
   post_l = cg_new_label("for_post");
   end_l = cg_new_label("for_end");
 
@@ -10665,13 +13799,8 @@ int gen_stmt_for(struct Stmt *st, int *ret_label) {
   loop_cont[nloop] = post_l;
   nloop++;
 
-  emit_s(start_l); emit_line(":");
-  if (st->expr != 0) {
-    gen_value(st->expr);
-    emit_line("\tcmp\tx0, #0");
-    emit_s("\tb.eq\t"); emit_line(end_l);
-  }
-
+  emit_s("\tb\t"); emit_line(cond_l);
+  emit_s(body_l); emit_line(":");
   gen_block(st->body, st->nbody, ret_label);
 
   emit_s(post_l); emit_line(":");
@@ -10679,7 +13808,12 @@ int gen_stmt_for(struct Stmt *st, int *ret_label) {
     gen_value(st->expr2);
   }
 
-  emit_s("\tb\t"); emit_line(start_l);
+  emit_s(cond_l); emit_line(":");
+  if (st->expr != 0) {
+    gen_cond(st->expr, body_l, 1);
+  } else {
+    emit_s("\tb\t"); emit_line(body_l);
+  }
   emit_s(end_l); emit_line(":");
 
   nloop--;
@@ -10710,9 +13844,7 @@ int gen_stmt_dowhile(struct Stmt *st, int *ret_label) {
   emit_s(start_l); emit_line(":");
   gen_block(st->body, st->nbody, ret_label);
   emit_s(cont_l); emit_line(":");
-  gen_value(st->expr);
-  emit_line("\tcmp\tx0, #0");
-  emit_s("\tb.ne\t"); emit_line(start_l);
+  gen_cond(st->expr, start_l, 1);
   emit_s(end_l); emit_line(":");
 
   nloop--;
@@ -10723,7 +13855,7 @@ int gen_stmt_goto(struct Stmt *st, int *ret_label) {
   int *goto_tmp1 = 0;
   int *goto_tmp2 = 0;
   int *goto_lbl = 0;
-  goto_tmp1 = build_str2("L_usr_", cg_cur_func_name);
+  goto_tmp1 = build_str2(build_str2(lab_pfx, "usr_"), cg_cur_func_name);
   goto_tmp2 = build_str2(goto_tmp1, "_");
   goto_lbl = build_str2(goto_tmp2, st->sval);
   emit_s("\tb\t"); emit_line(goto_lbl);
@@ -10734,7 +13866,7 @@ int gen_stmt_label(struct Stmt *st, int *ret_label) {
   int *goto_tmp1 = 0;
   int *goto_tmp2 = 0;
   int *goto_lbl = 0;
-  goto_tmp1 = build_str2("L_usr_", cg_cur_func_name);
+  goto_tmp1 = build_str2(build_str2(lab_pfx, "usr_"), cg_cur_func_name);
   goto_tmp2 = build_str2(goto_tmp1, "_");
   goto_lbl = build_str2(goto_tmp2, st->sval);
   emit_s(goto_lbl); emit_line(":");
@@ -10742,12 +13874,123 @@ int gen_stmt_label(struct Stmt *st, int *ret_label) {
   return 0;
 }
 
+// Put a case value (an int) in sx; sw is the same register's w form
+int cg_switch_imm(int *sx, int *sw, long val) {
+  if (val >= 0 - 65536 && val <= 65535) {
+    emit_mov_imm(sx, val);
+    return 0;
+  }
+  emit_s("\tmovz\t"); emit_s(sw); emit_s(", #"); emit_num(val & 65535); emit_ch('\n');
+  emit_s("\tmovk\t"); emit_s(sw); emit_s(", #"); emit_num((val >> 16) & 65535); emit_line(", lsl #16");
+  if (val < 0) { emit_s("\tsxtw\t"); emit_s(sx); emit_s(", "); emit_s(sw); emit_ch('\n'); }
+  return 0;
+}
+
+int cg_switch_cmp(int *reg, long val, int *sx, int *sw) {
+  if (val >= 0 && val <= 4095) {
+    emit_s("\tcmp\t"); emit_s(reg); emit_s(", #"); emit_num(val); emit_ch('\n');
+  } else if (val < 0 && val >= 0 - 4095) {
+    emit_s("\tcmn\t"); emit_s(reg); emit_s(", #"); emit_num(0 - val); emit_ch('\n');
+  } else {
+    cg_switch_imm(sx, sw, val);
+    emit_s("\tcmp\t"); emit_s(reg); emit_s(", "); emit_s(sx); emit_ch('\n');
+  }
+  return 0;
+}
+
+// Table dispatch over the sorted cases [first, last): reg - lo indexes a
+// table of 32-bit offsets from the table to each body, holes go to def
+int cg_switch_table(int *reg, long *vals, int **labels, int first, int last, int *def, int *s1, int *s1w, int *s2) {
+  long lo = vals[first];
+  int range = vals[last - 1] - lo + 1;
+  int *tab = cg_new_label("sw_tab");
+  if (njt >= MAX_JUMP_TABLES || njt_entry + range > MAX_JT_ENTRIES) {
+    my_fatal("too many switch tables");
+  }
+  // The tables are emitted after the last function, so their labels are kept
+  int prev = arena_use(AR_PERM);
+  jt_label[njt] = my_strdup(tab);
+  jt_first[njt] = njt_entry;
+  jt_count[njt] = range;
+  njt++;
+  int *kept_def = my_strdup(def);
+  for (int k = 0; k < range; k++) { jt_entry[njt_entry + k] = kept_def; }
+  for (int k = last - 1; k >= first; k--) { jt_entry[njt_entry + (vals[k] - lo)] = my_strdup(labels[k]); }
+  arena_use(prev);
+  njt_entry = njt_entry + range;
+
+  // A table starting at 0 is indexed by reg itself
+  int *idx = s1;
+  if (lo == 0) {
+    idx = reg;
+  } else if (lo > 0 && lo <= 4095) {
+    emit_s("\tsub\t"); emit_s(s1); emit_s(", "); emit_s(reg); emit_s(", #"); emit_num(lo); emit_ch('\n');
+  } else if (lo < 0 && lo >= 0 - 4095) {
+    emit_s("\tadd\t"); emit_s(s1); emit_s(", "); emit_s(reg); emit_s(", #"); emit_num(0 - lo); emit_ch('\n');
+  } else {
+    cg_switch_imm(s1, s1w, lo);
+    emit_s("\tsub\t"); emit_s(s1); emit_s(", "); emit_s(reg); emit_s(", "); emit_s(s1); emit_ch('\n');
+  }
+  // Unsigned compare also sends values below lo to def
+  emit_s("\tcmp\t"); emit_s(idx); emit_s(", #"); emit_num(range - 1); emit_ch('\n');
+  emit_s("\tb.hi\t"); emit_line(def);
+  emit_sym_addr(s2, "", tab, 0);
+  emit_s("\tldrsw\t"); emit_s(s1); emit_s(", ["); emit_s(s2); emit_s(", "); emit_s(idx); emit_line(", lsl #2]");
+  emit_s("\tadd\t"); emit_s(s2); emit_s(", "); emit_s(s2); emit_s(", "); emit_s(s1); emit_ch('\n');
+  emit_s("\tbr\t"); emit_line(s2);
+  return 0;
+}
+
+// Dispatch over the sorted cases [first, last): dense runs use a table,
+// short runs a chain of compares, anything else splits at the median
+int cg_switch_tree(int *reg, long *vals, int **labels, int first, int last, int *def, int *s1, int *s1w, int *s2) {
+  int n = last - first;
+  if (n >= 4) {
+    long range = vals[last - 1] - vals[first] + 1;
+    if (range <= 3 * n && range <= 4096) {
+      return cg_switch_table(reg, vals, labels, first, last, def, s1, s1w, s2);
+    }
+  }
+  if (n <= 3) {
+    for (int k = first; k < last; k++) {
+      cg_switch_cmp(reg, vals[k], s1, s1w);
+      emit_s("\tb.eq\t"); emit_line(labels[k]);
+    }
+    emit_s("\tb\t"); emit_line(def);
+    return 0;
+  }
+  int mid = first + n / 2;
+  int *lt = cg_new_label("sw_lt");
+  cg_switch_cmp(reg, vals[mid], s1, s1w);
+  emit_s("\tb.eq\t"); emit_line(labels[mid]);
+  emit_s("\tb.lt\t"); emit_line(lt);
+  cg_switch_tree(reg, vals, labels, mid + 1, last, def, s1, s1w, s2);
+  emit_s(lt); emit_line(":");
+  cg_switch_tree(reg, vals, labels, first, mid, def, s1, s1w, s2);
+  return 0;
+}
+
+// Jump to labels[k] when reg == vals[k], otherwise to def; s1 and s2 are
+// scratch registers distinct from reg
+int cg_emit_switch(int *reg, int *vals, int **labels, int n, int *def, int *s1, int *s1w, int *s2) {
+  long *sv = my_malloc((n + 1) * 8);
+  int **sl = my_malloc((n + 1) * 8);
+  for (int k = 0; k < n; k++) {
+    int j = k;
+    while (j > 0 && sv[j - 1] > vals[k]) {
+      sv[j] = sv[j - 1];
+      sl[j] = sl[j - 1];
+      j--;
+    }
+    sv[j] = vals[k];
+    sl[j] = labels[k];
+  }
+  return cg_switch_tree(reg, sv, sl, 0, n, def, s1, s1w, s2);
+}
+
 int gen_stmt_switch(struct Stmt *st, int *ret_label) {
   int *end_l = 0;
-  int **tramp_labels = 0;
   int **body_labels = 0;
-  int *tl = 0;
-  int *bl = 0;
   int *def_label = 0;
   int ci = 0;
   end_l = cg_new_label("sw_end");
@@ -10756,47 +13999,25 @@ int gen_stmt_switch(struct Stmt *st, int *ret_label) {
   else { loop_cont[nloop] = 0; }
   nloop++;
 
-  // Evaluate condition, push to stack
-  gen_value(st->expr);
-  emit_line("\tstr\tx0, [sp, #-16]!");
-
-  // Generate comparisons for each case
-  tramp_labels = my_malloc((st->ncases + 1) * 8);
+  body_labels = my_malloc((st->ncases + 1) * 8);
   ci = 0;
   while (ci < st->ncases) {
-    tl = cg_new_label("sw_tramp");
-    tramp_labels[ci] = tl;
-    emit_line("\tldr\tx0, [sp]");
-    emit_mov_imm("x1", st->case_vals[ci]);
-    emit_line("\tcmp\tx0, x1");
-    emit_s("\tb.eq\t"); emit_line(tl);
+    body_labels[ci] = cg_new_label("sw_body");
     ci++;
   }
-
-  // After all comparisons: jump to default or end
-  def_label = 0;
+  def_label = end_l;
   if (st->default_body != 0 && st->ndefault > 0) {
     def_label = cg_new_label("sw_def");
-    // Pop condition and jump to default
-    emit_line("\tadd\tsp, sp, #16");
-    emit_s("\tb\t"); emit_line(def_label);
-  } else {
-    // Pop condition and jump to end
-    emit_line("\tadd\tsp, sp, #16");
-    emit_s("\tb\t"); emit_line(end_l);
   }
 
-  // Trampolines: pop condition, jump to body
-  body_labels = my_malloc((st->ncases + 1) * 8);
-  ci = 0;
-  while (ci < st->ncases) {
-    bl = cg_new_label("sw_body");
-    body_labels[ci] = bl;
-    emit_s(tramp_labels[ci]); emit_line(":");
-    emit_line("\tadd\tsp, sp, #16");
-    emit_s("\tb\t"); emit_line(bl);
-    ci++;
-  }
+  // The condition stays in x0 for the whole dispatch; a register local
+  // is dispatched on where it lives
+  int *sw_reg = "x0";
+  int sw_vr = 0;
+  if (st->expr->kind == ND_VAR) { sw_vr = cg_var_reg(st->expr->sval); }
+  if (sw_vr > 0) { sw_reg = build_str2("x", int_to_str(sw_vr)); }
+  else { gen_value(st->expr); }
+  cg_emit_switch(sw_reg, st->case_vals, body_labels, st->ncases, def_label, "x9", "w9", "x10");
 
   // Case bodies (with fall-through)
   ci = 0;
@@ -10807,7 +14028,7 @@ int gen_stmt_switch(struct Stmt *st, int *ret_label) {
   }
 
   // Default body
-  if (def_label != 0) {
+  if (def_label != end_l) {
     emit_s(def_label); emit_line(":");
     gen_block(st->default_body, st->ndefault, ret_label);
   }
@@ -10846,766 +14067,3536 @@ int gen_stmt(struct Stmt *st, int *ret_label) {
 }
 
 
-int gen_func(struct FuncDef *f) {
-  if (f->name == 0) { printf("cc: gen_func NULL name, skip\n"); fflush(0); return 0; }
-  cg_cur_func_name = f->name;
-  cg_cur_func_ret_stype = f->ret_stype;
-  cg_cur_func_ret_is_float = f->ret_is_float;
-  cg_cl_counter = 0;
-  cg_cl_gen_counter = 0;
-  layout_func(f);
+// ---- IR ----
+// Function bodies are lowered from the AST into a linear three-address form
+// over virtual registers, optimized at the function level, given physical
+// registers by a linear scan and then emitted. Constructs the lowering does
+// not model make it give up; that function is then generated from the AST.
+
+int ir_op[MAX_IR];
+int ir_dst[MAX_IR];
+int ir_a[MAX_IR];       // first operand; 0 as a load/store base means x29
+int ir_b[MAX_IR];       // second operand (or index for load/store)
+int ir_c[MAX_IR];       // stored value
+long ir_imm[MAX_IR];    // constant, offset, or b when ir_bimm is set
+int ir_bimm[MAX_IR];
+int ir_w[MAX_IR];       // 32-bit form
+int ir_sgn[MAX_IR];     // signed divide/shift/load/extend
+int ir_size[MAX_IR];    // load/store/extend width in bytes
+int ir_sh[MAX_IR];      // left shift applied to b
+int ir_cc[MAX_IR];      // condition for set/br, symbol kind for addr
+int ir_lab[MAX_IR];     // branch target / label id
+int *ir_sym[MAX_IR];    // addr and call symbol
+int ir_argi[MAX_IR];    // call arguments are ir_args[argi..argi+nargs)
+int ir_nargs[MAX_IR];
+int nir;
+int ir_args[MAX_IR];
+int nir_args;
+int nir_vregs;
+int nir_labels;
+int ir_fail;
+int ir_var_vreg[MAX_LAYOUT];      // vreg of a register-resident local, or 0
+int *ir_label_user[MAX_IR_LABELS];  // goto label name, or 0
+int *ir_label_str[MAX_IR_LABELS];   // assembler name, made on first use
+int ir_label_pos[MAX_IR_LABELS];
+int ir_label_refs[MAX_IR_LABELS];
+int ir_brk[MAX_LOOP_STACK];
+int ir_cont[MAX_LOOP_STACK];
+int nir_loop;
+
+// Per-vreg facts for the passes and the allocator
+int ir_ndef[MAX_IR_VREGS];
+int ir_nuse[MAX_IR_VREGS];
+int ir_defi[MAX_IR_VREGS];    // defining instruction when ndef == 1
+int ir_start[MAX_IR_VREGS];
+int ir_end[MAX_IR_VREGS];
+int ir_preg[MAX_IR_VREGS];    // physical register, 0 when spilled
+int ir_slot[MAX_IR_VREGS];    // spill slot frame offset
+int ir_order[MAX_IR_VREGS];
+int ir_map[MAX_IR_VREGS];
+int ir_bucket[MAX_IR];
+int ir_pfx_lab[MAX_IR];       // labels before each position
+int ir_pfx_call[MAX_IR];      // calls before each position
+int ir_nslots;
+int ir_ncallee;
+
+int *ir_cc_name(int cc) {
+  if (cc == IR_CC_EQ) return "eq";
+  if (cc == IR_CC_NE) return "ne";
+  if (cc == IR_CC_LT) return "lt";
+  if (cc == IR_CC_LE) return "le";
+  if (cc == IR_CC_GT) return "gt";
+  if (cc == IR_CC_GE) return "ge";
+  if (cc == IR_CC_LO) return "lo";
+  if (cc == IR_CC_LS) return "ls";
+  if (cc == IR_CC_HI) return "hi";
+  return "hs";
+}
+
+int ir_cc_invert(int cc) {
+  if (cc == IR_CC_EQ) return IR_CC_NE;
+  if (cc == IR_CC_NE) return IR_CC_EQ;
+  if (cc == IR_CC_LT) return IR_CC_GE;
+  if (cc == IR_CC_GE) return IR_CC_LT;
+  if (cc == IR_CC_LE) return IR_CC_GT;
+  if (cc == IR_CC_GT) return IR_CC_LE;
+  if (cc == IR_CC_LO) return IR_CC_HS;
+  if (cc == IR_CC_HS) return IR_CC_LO;
+  if (cc == IR_CC_LS) return IR_CC_HI;
+  return IR_CC_LS;
+}
+
+// Condition that holds for (b, a) when cc holds for (a, b)
+int ir_cc_swap(int cc) {
+  if (cc == IR_CC_LT) return IR_CC_GT;
+  if (cc == IR_CC_GT) return IR_CC_LT;
+  if (cc == IR_CC_LE) return IR_CC_GE;
+  if (cc == IR_CC_GE) return IR_CC_LE;
+  if (cc == IR_CC_LO) return IR_CC_HI;
+  if (cc == IR_CC_HI) return IR_CC_LO;
+  if (cc == IR_CC_LS) return IR_CC_HS;
+  if (cc == IR_CC_HS) return IR_CC_LS;
+  return cc;
+}
+
+int ir_cc_of(int *op, int is_unsigned) {
+  if (my_strcmp(op, "==") == 0) return IR_CC_EQ;
+  if (my_strcmp(op, "!=") == 0) return IR_CC_NE;
+  if (my_strcmp(op, "<") == 0) { if (is_unsigned) return IR_CC_LO; return IR_CC_LT; }
+  if (my_strcmp(op, "<=") == 0) { if (is_unsigned) return IR_CC_LS; return IR_CC_LE; }
+  if (my_strcmp(op, ">") == 0) { if (is_unsigned) return IR_CC_HI; return IR_CC_GT; }
+  if (my_strcmp(op, ">=") == 0) { if (is_unsigned) return IR_CC_HS; return IR_CC_GE; }
+  return 0 - 1;
+}
 
-  int *ret_label = cg_new_label("ret");
+int ir_new_vreg() {
+  nir_vregs++;
+  if (nir_vregs >= MAX_IR_VREGS) { ir_fail = 1; nir_vregs = 1; }
+  return nir_vregs;
+}
+
+int ir_new_label() {
+  nir_labels++;
+  if (nir_labels >= MAX_IR_LABELS) { ir_fail = 1; nir_labels = 1; }
+  ir_label_user[nir_labels] = 0;
+  ir_label_str[nir_labels] = 0;
+  return nir_labels;
+}
+
+int ir_emit_op(int op, int dst, int a, int b) {
+  if (nir >= MAX_IR - 1) { ir_fail = 1; nir = 0; }
+  int i = nir;
+  ir_op[i] = op;
+  ir_dst[i] = dst;
+  ir_a[i] = a;
+  ir_b[i] = b;
+  ir_c[i] = 0;
+  ir_imm[i] = 0;
+  ir_bimm[i] = 0;
+  ir_w[i] = 0;
+  ir_sgn[i] = 0;
+  ir_size[i] = 8;
+  ir_sh[i] = 0;
+  ir_cc[i] = 0;
+  ir_lab[i] = 0;
+  ir_sym[i] = 0;
+  ir_argi[i] = 0;
+  ir_nargs[i] = 0;
+  nir++;
+  return i;
+}
 
-  emit_ch('\n');
-  emit_line("\t.p2align\t2");
-  if (f->is_static == 0) { emit_s("\t.globl\t_"); emit_line(f->name); }
-  emit_s("_"); emit_s(f->name); emit_line(":");
-  emit_line("\tstp\tx29, x30, [sp, #-16]!");
-  emit_line("\tmov\tx29, sp");
-  if (lay_stack_size > 0) {
-    if (lay_stack_size <= 4095) {
-      emit_s("\tsub\tsp, sp, #");
-      emit_num(lay_stack_size);
-      emit_ch('\n');
-    } else {
-      emit_mov_imm("x9", lay_stack_size);
-      emit_line("\tsub\tsp, sp, x9");
-    }
+int ir_const(long val) {
+  int d = ir_new_vreg();
+  int i = ir_emit_op(IR_IMM, d, 0, 0);
+  ir_imm[i] = val;
+  return d;
+}
+
+int ir_binop(int op, int a, int b) {
+  int d = ir_new_vreg();
+  ir_emit_op(op, d, a, b);
+  return d;
+}
+
+int ir_binop_imm(int op, int a, long val) {
+  int d = ir_new_vreg();
+  int i = ir_emit_op(op, d, a, 0);
+  ir_bimm[i] = 1;
+  ir_imm[i] = val;
+  return d;
+}
+
+int ir_unop(int op, int a) {
+  int d = ir_new_vreg();
+  ir_emit_op(op, d, a, 0);
+  return d;
+}
+
+int ir_copy(int a) {
+  return ir_unop(IR_MOV, a);
+}
+
+// Extend the low size bytes of a into d (d = 0 makes a new vreg)
+int ir_extend(int d, int a, int size, int sgn) {
+  if (d == 0) { d = ir_new_vreg(); }
+  int i = ir_emit_op(IR_EXT, d, a, 0);
+  ir_size[i] = size;
+  ir_sgn[i] = sgn;
+  return d;
+}
+
+int ir_set(int cc, int a, int b, int w) {
+  int d = ir_new_vreg();
+  int i = ir_emit_op(IR_SET, d, a, b);
+  ir_cc[i] = cc;
+  ir_w[i] = w;
+  return d;
+}
+
+// Load with the widths of gen_load_by_bsz: bytes are always zero-extended
+int ir_load(int addr, int bsz, int is_unsigned) {
+  int d = ir_new_vreg();
+  int i = ir_emit_op(IR_LOAD, d, addr, 0);
+  if (bsz != 1 && bsz != 2 && bsz != 4) { bsz = 8; }
+  ir_size[i] = bsz;
+  ir_sgn[i] = (bsz == 1 || is_unsigned) ? 0 : 1;
+  return d;
+}
+
+int ir_store(int addr, int val, int bsz) {
+  int i = ir_emit_op(IR_STORE, 0, addr, 0);
+  if (bsz != 1 && bsz != 2 && bsz != 4) { bsz = 8; }
+  ir_c[i] = val;
+  ir_size[i] = bsz;
+  return i;
+}
+
+int ir_addr_sym(int *sym, int kind) {
+  int d = ir_new_vreg();
+  int i = ir_emit_op(IR_ADDR, d, 0, 0);
+  ir_sym[i] = sym;
+  ir_cc[i] = kind;
+  return d;
+}
+
+int ir_frame(int off) {
+  int d = ir_new_vreg();
+  int i = ir_emit_op(IR_FRAME, d, 0, 0);
+  ir_imm[i] = off;
+  return d;
+}
+
+int ir_label(int l) {
+  int i = ir_emit_op(IR_LABEL, 0, 0, 0);
+  ir_lab[i] = l;
+  return i;
+}
+
+int ir_jump(int l) {
+  int i = ir_emit_op(IR_JMP, 0, 0, 0);
+  ir_lab[i] = l;
+  return i;
+}
+
+int ir_branch(int cc, int a, int b, int w, int l) {
+  int i = ir_emit_op(IR_BR, 0, a, b);
+  ir_cc[i] = cc;
+  ir_w[i] = w;
+  ir_lab[i] = l;
+  return i;
+}
+
+int ir_branch_zero(int op, int a, int l) {
+  int i = ir_emit_op(op, 0, a, 0);
+  ir_lab[i] = l;
+  return i;
+}
+
+int ir_user_label(int *name) {
+  int l = 1;
+  while (l <= nir_labels) {
+    if (ir_label_user[l] != 0 && my_strcmp(ir_label_user[l], name) == 0) return l;
+    l++;
   }
+  l = ir_new_label();
+  ir_label_user[l] = name;
+  return l;
+}
 
-  for (int i = 0; i < f->nparams && i < 8; i++) {
-    int off = cg_find_slot(f->params[i]);
-    if (f->param_stypes != 0 && f->param_stypes[i] != 0) {
-      int bsz = cg_struct_byte_size(f->param_stypes[i]);
-      int nf_copy = (bsz + 7) / 8;
-      for (int fi = 0; fi < nf_copy; fi++) {
-        int src_off = fi * 8;
-        int dst_off = off - fi * 8;
-        if (src_off <= 32760) {
-          emit_s("\tldr\tx9, [x"); emit_num(i); emit_s(", #"); emit_num(src_off); emit_line("]");
-        } else {
-          emit_mov_imm("x10", src_off);
-          emit_s("\tadd\tx10, x"); emit_num(i); emit_line(", x10");
-          emit_line("\tldr\tx9, [x10]");
-        }
-        if (dst_off <= 255) {
-          emit_s("\tstr\tx9, [x29, #-");
-          emit_num(dst_off);
-          emit_line("]");
-        } else {
-          emit_mov_imm("x10", dst_off);
-          emit_line("\tsub\tx10, x29, x10");
-          emit_line("\tstr\tx9, [x10]");
-        }
-      }
-    } else {
-      // Extend params to clean upper 32 bits based on type width
-      int is_64bit_param = 0;
-      if (f->param_is_intptr != 0 && f->param_is_intptr[i]) { is_64bit_param = 1; }
-      if (f->param_is_char != 0 && f->param_is_char[i]) { is_64bit_param = 1; }
-      if (f->param_stypes != 0 && f->param_stypes[i] != 0) { is_64bit_param = 1; }
-      if (f->param_is_long != 0 && f->param_is_long[i]) { is_64bit_param = 1; }
-      if (is_64bit_param == 0) {
-        int p_is_unsigned = (f->param_is_unsigned != 0 && f->param_is_unsigned[i]);
-        int p_is_short = (f->param_is_short != 0 && f->param_is_short[i]);
-        if (p_is_short) {
-          if (p_is_unsigned) { emit_s("\tuxth\tw"); emit_num(i); emit_s(", w"); emit_num(i); emit_ch('\n'); }
-          else { emit_s("\tsxth\tx"); emit_num(i); emit_s(", w"); emit_num(i); emit_ch('\n'); }
-        } else if (p_is_unsigned) {
-          // unsigned int: writing to wN zero-extends to xN, but value may already be clean
-          emit_s("\tmov\tw"); emit_num(i); emit_s(", w"); emit_num(i); emit_ch('\n');
-        } else {
-          emit_s("\tsxtw\tx"); emit_num(i); emit_s(", w"); emit_num(i); emit_ch('\n');
+// Scale v by an element size the way pointer arithmetic does
+int ir_scale(int v, int scale) {
+  if (scale == 1) return v;
+  if (cg_log2(scale) > 0) return ir_binop_imm(IR_SHL, v, cg_log2(scale));
+  return ir_binop(IR_MUL, v, ir_const(scale));
+}
+
+int ir_add_const(int v, long k) {
+  if (k == 0) return v;
+  return ir_binop_imm(IR_ADD, v, k);
+}
+
+// Register-resident local for name, or 0 if it lives in memory
+int ir_var(int *name) {
+  int li = lay_index(name);
+  if (li < 0) return 0;
+  return ir_var_vreg[li];
+}
+
+// Assign v to register local r, normalized the way a load of its slot would be
+int ir_set_var(int r, int *name, int v) {
+  int vbsz = cg_var_bsz(name);
+  int vu = cg_is_unsigned(name);
+  if (vbsz == 1 || vbsz == 2 || vbsz == 4) {
+    ir_extend(r, v, vbsz, vu == 0);
+  } else {
+    ir_emit_op(IR_MOV, r, v, 0);
+  }
+  return 0;
+}
+
+// Truncation applied when assigning to a bare char variable
+int ir_barechar_trunc(int *name, int v) {
+  int bc = cg_is_barechar(name);
+  if (bc == 2) return ir_extend(0, v, 1, 0);
+  if (bc == 1) return ir_extend(0, v, 1, 1);
+  return v;
+}
+
+int ir_expr(struct Expr *e);
+int ir_cond(struct Expr *e, int l, int jump_if);
+int ir_stmts(struct Stmt **stmts, int n);
+
+int ir_addr(struct Expr *e) {
+  if (e->kind == ND_VAR) {
+    int off = cg_find_slot(e->sval);
+    if (ir_var(e->sval) > 0) { ir_fail = 1; return ir_const(0); }
+    if (off > 0) return ir_frame(off);
+    // Stack-passed parameter above the frame record
+    if (off <= (0 - 2)) return ir_frame(off);
+    if (off == (0 - 1)) {
+      int sli = 0;
+      while (sli < nsl) {
+        if (my_strcmp(sl[sli].name, e->sval) == 0 && my_strcmp(sl[sli].func, cg_cur_func_name) == 0) {
+          ir_fail = 1;
+          return ir_const(0);
         }
-      }
-      if (off <= 255) {
-        emit_s("\tstr\tx");
-        emit_num(i);
-        emit_s(", [x29, #-");
-        emit_num(off);
-        emit_line("]");
-      } else {
-        emit_mov_imm("x9", off);
-        emit_line("\tsub\tx9, x29, x9");
-        emit_s("\tstr\tx");
-        emit_num(i);
-        emit_line(", [x9]");
+        sli++;
       }
     }
+    if (cg_is_global(e->sval)) return ir_addr_sym(e->sval, 0);
+    if (is_known_func(e->sval)) {
+      if (is_defined_func(e->sval)) return ir_addr_sym(e->sval, 0);
+      return ir_addr_sym(e->sval, 1);
+    }
+    for (int evi = 0; evi < nglv; evi++) {
+      if (my_strcmp(glv[evi].name, e->sval) == 0) return ir_addr_sym(e->sval, 1);
+    }
+    ir_fail = 1;
+    return ir_const(0);
   }
-  // Params 8+ are already on stack at [x29+16], [x29+24], etc.
-
-  gen_block(f->body, f->nbody, ret_label);
-
-  emit_line("\tmov\tw0, #0");
-  emit_s(ret_label); emit_line(":");
-  if (lay_stack_size > 0) {
-    if (lay_stack_size <= 4095) {
-      emit_s("\tadd\tsp, sp, #");
-      emit_num(lay_stack_size);
-      emit_ch('\n');
-    } else {
-      emit_mov_imm("x9", lay_stack_size);
-      emit_line("\tadd\tsp, sp, x9");
+  if (e->kind == ND_UNARY && e->ival == '*') return ir_expr(e->left);
+  if (e->kind == ND_INDEX) {
+    int stride = cg_index_stride(e);
+    int base = ir_expr(e->left);
+    int idx = ir_expr(e->right);
+    if (stride > 1 && cg_log2(stride) > 0) {
+      int d = ir_binop(IR_ADD, base, idx);
+      ir_sh[nir - 1] = cg_log2(stride);
+      return d;
     }
+    return ir_binop(IR_ADD, base, ir_scale(idx, stride));
   }
-  if (cg_cur_func_ret_is_float) {
-    emit_line("\tfmov\td0, x0");
+  if (e->kind == ND_FIELD) {
+    int boff = cg_field_byte_offset(e->sval2, e->sval);
+    if (e->left->kind == ND_INDEX) {
+      int *fi_stype = 0;
+      int fi_stride = 8;
+      if (e->left->left->kind == ND_VAR) {
+        fi_stype = cg_structvar_type(e->left->left->sval);
+        if (fi_stype == 0) { fi_stype = cg_ptr_structvar_type(e->left->left->sval); }
+      }
+      if (fi_stype == 0) { fi_stype = e->sval2; }
+      if (fi_stype != 0) { fi_stride = cg_struct_byte_size(fi_stype); }
+      int base = ir_expr(e->left->left);
+      int idx = ir_expr(e->left->right);
+      int elem = ir_binop(IR_ADD, base, ir_scale(idx, fi_stride));
+      if (boff > 0) return ir_add_const(elem, boff);
+      return elem;
+    }
+    int fbase = ir_addr(e->left);
+    if (boff > 0) return ir_add_const(fbase, boff);
+    return fbase;
   }
-  emit_line("\tldp\tx29, x30, [sp], #16");
-  emit_line("\tret");
-  return 0;
+  if (e->kind == ND_ARROW) {
+    int boff = cg_field_byte_offset(e->sval2, e->sval);
+    int abase = ir_expr(e->left);
+    if (boff > 0) return ir_add_const(abase, boff);
+    return abase;
+  }
+  ir_fail = 1;
+  return ir_const(0);
 }
 
-int register_builtin_variadic(int *name, int np) {
-  int vj;
-  vj = 0;
-  while (vj < nvar_funcs) {
-    if (my_strcmp(var_funcs[vj], name) == 0) {
-      return 0;
-    }
-    vj++;
+int ir_var_value(struct Expr *e) {
+  int r = ir_var(e->sval);
+  // Snapshot: the variable may change before the value is consumed
+  if (r > 0) return ir_copy(r);
+  if (cg_find_slot(e->sval) < 0 && cg_is_global(e->sval) == 0 && is_known_func(e->sval)) {
+    return ir_addr(e);
   }
-  var_funcs[nvar_funcs] = name;
-  var_nparams[nvar_funcs] = np;
-  nvar_funcs++;
-  return 0;
+  int addr = ir_addr(e);
+  if (cg_find_slot(e->sval) >= 0) {
+    if (cg_is_array(e->sval) || cg_is_structvar(e->sval)) return addr;
+    int vbsz = cg_var_bsz(e->sval);
+    int vu = cg_is_unsigned(e->sval);
+    int d = ir_load(addr, vbsz, vu);
+    // Signed char locals sign-extend, unlike other byte loads
+    if (vbsz == 1 && vu == 0) { ir_sgn[nir - 1] = 1; }
+    return d;
+  }
+  if (cg_is_array(e->sval) || cg_is_structvar(e->sval) || cg_global_is_array(e->sval) || cg_global_stype(e->sval) != 0) {
+    return addr;
+  }
+  return ir_load(addr, 8, 0);
 }
 
-int cg_register_functions(struct Program *prog) {
-  struct FuncDef *fd = 0;
-  // Register ptr-returning functions from prototypes
-  int pi = 0;
-  while (pi < prog->nprotos) {
-    if (prog->proto_ret_is_ptr[pi] != 0 || prog->proto_ret_stype[pi] != 0) {
-      ptr_ret_names[n_ptr_ret] = prog->proto_names[pi];
-      n_ptr_ret++;
+int ir_field_value(struct Expr *e) {
+  int bf_bit_off = 0;
+  int bf_width = cg_get_bitfield_info(e->sval2, e->sval, &bf_bit_off);
+  int addr = ir_addr(e);
+  if (cg_field_is_array(e->sval2, e->sval)) return addr;
+  int v = ir_load(addr, cg_field_byte_size(e->sval2, e->sval), cg_field_is_unsigned(e->sval2, e->sval));
+  if (bf_width > 0) {
+    if (bf_bit_off > 0) {
+      v = ir_binop_imm(IR_SHR, v, bf_bit_off);
     }
-    pi++;
+    v = ir_binop_imm(IR_AND, v, (1 << bf_width) - 1);
   }
-  // Register ptr-returning functions from definitions
-  pi = 0;
-  while (pi < prog->nfuncs) {
-    fd = prog->funcs[pi];
-    if (fd->ret_is_ptr != 0 || fd->ret_stype != 0) {
-      ptr_ret_names[n_ptr_ret] = fd->name;
-      n_ptr_ret++;
+  return v;
+}
+
+int ir_binary(struct Expr *e) {
+  int *op = e->sval2;
+  if (my_strcmp(op, ",") == 0) {
+    ir_expr(e->left);
+    return ir_expr(e->right);
+  }
+  if (my_strcmp(op, "&&") == 0 || my_strcmp(op, "||") == 0) {
+    int r = ir_new_vreg();
+    int lz = ir_new_label();
+    int lend = ir_new_label();
+    ir_cond(e, lz, 0);
+    ir_imm[ir_emit_op(IR_IMM, r, 0, 0)] = 1;
+    ir_jump(lend);
+    ir_label(lz);
+    ir_emit_op(IR_IMM, r, 0, 0);
+    ir_label(lend);
+    return r;
+  }
+  int a = ir_expr(e->left);
+  int b = ir_expr(e->right);
+  {
+    int scale_rhs = 0;
+    int scale = cg_ptr_scale(e, &scale_rhs);
+    if (scale > 0) {
+      if (scale_rhs) { b = ir_scale(b, scale); }
+      else { a = ir_scale(a, scale); }
+    }
+  }
+  int use_unsigned = cg_binary_unsigned(e);
+  int use_long = (expr_is_long(e->left) || expr_is_long(e->right));
+  int cc = ir_cc_of(op, use_unsigned);
+  if (cc >= 0) return ir_set(cc, a, b, use_long == 0);
+  if (my_strcmp(op, "+") == 0) return ir_binop(IR_ADD, a, b);
+  if (my_strcmp(op, "-") == 0) {
+    int d = ir_binop(IR_SUB, a, b);
+    int by_shift = 0;
+    int pdiv = cg_ptr_diff_div(e, &by_shift);
+    if (by_shift) {
+      d = ir_binop_imm(IR_SHR, d, by_shift);
+      ir_sgn[nir - 1] = 1;
+    } else if (pdiv > 0) {
+      d = ir_binop(IR_DIV, d, ir_const(pdiv));
+      ir_sgn[nir - 1] = 1;
+    }
+    return d;
+  }
+  if (my_strcmp(op, "*") == 0) return ir_binop(IR_MUL, a, b);
+  if (my_strcmp(op, "&") == 0) return ir_binop(IR_AND, a, b);
+  if (my_strcmp(op, "|") == 0) return ir_binop(IR_OR, a, b);
+  if (my_strcmp(op, "^") == 0) return ir_binop(IR_XOR, a, b);
+  if (my_strcmp(op, "<<") == 0) return ir_binop(IR_SHL, a, b);
+  if (my_strcmp(op, "/") == 0 || my_strcmp(op, "%") == 0 || my_strcmp(op, ">>") == 0) {
+    int dop = IR_DIV;
+    int sgn = (use_unsigned == 0);
+    if (my_strcmp(op, "%") == 0) { dop = IR_REM; }
+    if (my_strcmp(op, ">>") == 0) {
+      dop = IR_SHR;
+      if (expr_is_unsigned(e->left)) { sgn = 0; }
+    }
+    int d = ir_binop(dop, a, b);
+    ir_w[nir - 1] = (use_long == 0);
+    ir_sgn[nir - 1] = sgn;
+    return d;
+  }
+  ir_fail = 1;
+  return a;
+}
+
+int ir_assign(struct Expr *e) {
+  struct Expr *lhs = e->left;
+  if (lhs->kind == ND_FIELD || lhs->kind == ND_ARROW) {
+    int bf_bit_off = 0;
+    if (cg_get_bitfield_info(lhs->sval2, lhs->sval, &bf_bit_off) > 0) { ir_fail = 1; return ir_const(0); }
+  }
+  if (lhs->kind == ND_VAR && ir_var(lhs->sval) > 0) {
+    int v = ir_barechar_trunc(lhs->sval, ir_expr(e->right));
+    ir_set_var(ir_var(lhs->sval), lhs->sval, v);
+    return v;
+  }
+  {
+    int *sa_type = cg_assign_struct_type(e);
+    if (sa_type != 0 && cg_struct_nfields(sa_type) >= 1 && (e->right->kind != ND_UNARY || e->right->ival != '&')) {
+      ir_fail = 1;
+      return ir_const(0);
     }
-    pi++;
   }
+  int addr = ir_addr(lhs);
+  int val = ir_expr(e->right);
+  if (lhs->kind == ND_VAR) { val = ir_barechar_trunc(lhs->sval, val); }
+  ir_store(addr, val, cg_assign_store_bsz(lhs));
+  return val;
+}
 
-  // Register unsigned-returning functions from prototypes
-  pi = 0;
-  while (pi < prog->nprotos) {
-    if (prog->proto_ret_is_unsigned[pi] != 0) {
-      unsigned_ret_names[n_unsigned_ret] = prog->proto_names[pi];
-      n_unsigned_ret++;
+int ir_postinc(struct Expr *e) {
+  struct Expr *lhs = e->left;
+  long inc = 1;
+  if (lhs->kind == ND_VAR) {
+    int *pi_pstype = cg_ptr_structvar_type(lhs->sval);
+    if (pi_pstype != 0) {
+      inc = cg_struct_byte_size(pi_pstype);
+    } else if (cg_is_intptr(lhs->sval)) {
+      inc = cg_intptr_esz(lhs->sval);
+      if (inc == 0) { inc = cg_global_ptr_esz(lhs->sval); }
+      if (inc == 0) { inc = 4; }
     }
-    pi++;
   }
-  // Register unsigned-returning functions from definitions
-  pi = 0;
-  while (pi < prog->nfuncs) {
-    fd = prog->funcs[pi];
-    if (fd->ret_is_unsigned != 0) {
-      unsigned_ret_names[n_unsigned_ret] = fd->name;
-      n_unsigned_ret++;
-    }
-    pi++;
+  if (e->kind == ND_POSTDEC) { inc = 0 - inc; }
+  if (lhs->kind == ND_VAR && ir_var(lhs->sval) > 0) {
+    int r = ir_var(lhs->sval);
+    int old = ir_copy(r);
+    int nv = ir_barechar_trunc(lhs->sval, ir_add_const(old, inc));
+    ir_set_var(r, lhs->sval, nv);
+    return old;
   }
+  int addr = ir_addr(lhs);
+  int oldm = ir_load(addr, 8, 0);
+  int nvm = ir_add_const(oldm, inc);
+  int bsz = 8;
+  if (lhs->kind == ND_VAR) {
+    nvm = ir_barechar_trunc(lhs->sval, nvm);
+    bsz = cg_var_bsz(lhs->sval);
+  }
+  ir_store(addr, nvm, bsz);
+  return oldm;
+}
 
-  // Register long-returning functions (add to ptr_ret_names since both skip sxtw)
-  pi = 0;
-  while (pi < prog->nprotos) {
-    if (prog->proto_ret_is_long[pi] != 0) {
-      ptr_ret_names[n_ptr_ret] = prog->proto_names[pi];
-      n_ptr_ret++;
-    }
-    pi++;
+int ir_call(struct Expr *e) {
+  int *name = e->sval;
+  int k = 0;
+  if (my_strcmp(name, "__read_byte") == 0) {
+    int p = ir_expr(e->args[0]);
+    int i = ir_expr(e->args[1]);
+    return ir_load(ir_binop(IR_ADD, p, i), 1, 1);
   }
-  pi = 0;
-  while (pi < prog->nfuncs) {
-    fd = prog->funcs[pi];
-    if (fd->ret_is_long != 0) {
-      ptr_ret_names[n_ptr_ret] = fd->name;
-      n_ptr_ret++;
+  if (my_strcmp(name, "__write_byte") == 0) {
+    int wp = ir_expr(e->args[0]);
+    int wi = ir_expr(e->args[1]);
+    int wv = ir_expr(e->args[2]);
+    ir_store(ir_binop(IR_ADD, wp, wi), wv, 1);
+    return wv;
+  }
+  if (my_strcmp(name, "__builtin_expect") == 0) return ir_expr(e->args[0]);
+  if (my_strcmp(name, "__indirect_call") == 0 || my_strcmp(name, "alloca") == 0 ||
+      (__read_byte(name, 0) == '_' && __read_byte(name, 1) == '_' && __read_byte(name, 2) == 'b') ||
+      func_returns_float(name) ||
+      (is_known_func(name) == 0 && (cg_find_slot(name) >= 0 || cg_is_global(name)))) {
+    ir_fail = 1;
+    return ir_const(0);
+  }
+  int vnp = cg_variadic_nparams(name);
+  int var_sgn = (vnp >= 0);
+  if (vnp >= 0 && target_elf) {
+    // AAPCS64 passes variadic arguments like named ones, unless they are
+    // floating point
+    for (k = 0; k < e->nargs; k++) {
+      if (expr_is_float(e->args[k])) { ir_fail = 1; return ir_const(0); }
     }
-    pi++;
+    k = 0;
+    vnp = 0 - 1;
+  }
+  int n_named = e->nargs;
+  if (vnp >= 0 && vnp < n_named) { n_named = vnp; }
+  if (vnp >= 0 && n_named > 8) { ir_fail = 1; return ir_const(0); }
+  if (nir_args + e->nargs >= MAX_IR) { ir_fail = 1; return ir_const(0); }
+  int argi = nir_args;
+  nir_args = nir_args + e->nargs;
+  // Variadic calls evaluate the stack-passed arguments first
+  if (vnp >= 0) {
+    k = n_named;
+    while (k < e->nargs) { ir_args[argi + k] = ir_expr(e->args[k]); k++; }
+    k = 0;
+    while (k < n_named) { ir_args[argi + k] = ir_expr(e->args[k]); k++; }
+  } else {
+    while (k < e->nargs) { ir_args[argi + k] = ir_expr(e->args[k]); k++; }
+  }
+  int d = ir_new_vreg();
+  int ci = ir_emit_op(IR_CALL, d, 0, 0);
+  ir_sym[ci] = name;
+  ir_argi[ci] = argi;
+  ir_nargs[ci] = e->nargs;
+  ir_imm[ci] = vnp;
+  if (var_sgn) {
+    ir_sgn[ci] = (func_returns_ptr(name) == 0 && func_returns_unsigned(name) == 0);
+  } else {
+    ir_sgn[ci] = (func_returns_ptr(name) == 0 && func_ret_stype(name) == 0 && func_returns_unsigned(name) == 0);
   }
+  return d;
+}
 
-  // Register struct-returning functions from prototypes (keep parse-time entries)
-  pi = 0;
-  while (pi < prog->nprotos) {
-    if (prog->proto_ret_stype[pi] != 0) {
-      struct_ret_names[n_struct_ret] = prog->proto_names[pi];
-      struct_ret_stypes[n_struct_ret] = prog->proto_ret_stype[pi];
-      n_struct_ret++;
+int ir_expr(struct Expr *e) {
+  if (e == 0 || e < 4096 || ir_fail) { ir_fail = 1; return ir_const(0); }
+  if (e->kind == ND_NUM) {
+    if (e->nargs == 1) { ir_fail = 1; }
+    return ir_const(e->ival);
+  }
+  if (e->kind == ND_VAR) {
+    if (cg_is_float(e->sval)) { ir_fail = 1; }
+    return ir_var_value(e);
+  }
+  if (e->kind == ND_STRLIT) {
+    return ir_addr_sym(cg_intern_string(cg_decode_string(e->sval)), 2);
+  }
+  if (e->kind == ND_CAST) {
+    if (e->ival == 1) { ir_fail = 1; }
+    int cv = ir_expr(e->left);
+    if (e->ival == 3) return ir_extend(0, cv, 1, 1);
+    if (e->ival == 4) return ir_extend(0, cv, 1, 0);
+    if (e->ival == 5) return ir_extend(0, cv, 2, 1);
+    if (e->ival == 6) return ir_extend(0, cv, 2, 0);
+    return cv;
+  }
+  if (e->kind == ND_UNARY) {
+    if (e->ival == '&') return ir_addr(e->left);
+    if (e->ival == '*') {
+      int deref_unsigned = 0;
+      int deref_bsz = cg_deref_bsz(e, &deref_unsigned);
+      return ir_load(ir_expr(e->left), deref_bsz, deref_unsigned);
     }
-    pi++;
+    int uv = ir_expr(e->left);
+    if (e->ival == '-') return ir_unop(IR_NEG, uv);
+    if (e->ival == '~') return ir_unop(IR_NOT, uv);
+    if (e->ival == '!') {
+      int d = ir_binop_imm(IR_SET, uv, 0);
+      ir_cc[nir - 1] = IR_CC_EQ;
+      return d;
+    }
+    return uv;
   }
-  // Register struct-returning functions from definitions
-  pi = 0;
-  while (pi < prog->nfuncs) {
-    fd = prog->funcs[pi];
-    if (fd->ret_stype != 0) {
-      struct_ret_names[n_struct_ret] = fd->name;
-      struct_ret_stypes[n_struct_ret] = fd->ret_stype;
-      n_struct_ret++;
+  if (e->kind == ND_BINARY) return ir_binary(e);
+  if (e->kind == ND_INDEX) {
+    int idx_unsigned = 0;
+    int idx_bsz = cg_index_load_bsz(e, &idx_unsigned);
+    int iaddr = ir_addr(e);
+    if (idx_bsz == 0) return iaddr;
+    return ir_load(iaddr, idx_bsz, idx_unsigned);
+  }
+  if (e->kind == ND_FIELD || e->kind == ND_ARROW) return ir_field_value(e);
+  if (e->kind == ND_ASSIGN) return ir_assign(e);
+  if (e->kind == ND_POSTINC || e->kind == ND_POSTDEC) return ir_postinc(e);
+  if (e->kind == ND_TERNARY) {
+    int r = ir_new_vreg();
+    int lelse = ir_new_label();
+    int lend = ir_new_label();
+    ir_cond(e->left, lelse, 0);
+    ir_emit_op(IR_MOV, r, ir_expr(e->right), 0);
+    ir_jump(lend);
+    ir_label(lelse);
+    ir_emit_op(IR_MOV, r, ir_expr(e->args[0]), 0);
+    ir_label(lend);
+    return r;
+  }
+  if (e->kind == ND_CALL) return ir_call(e);
+  if (e->kind == ND_STMT_EXPR) {
+    // The block's last expression statement gives the value
+    struct Stmt *se_blk = e->left;
+    struct Expr *se_val = cg_stmt_expr_value(e);
+    if (se_blk == 0 || se_blk->kind != ST_BLOCK) { ir_fail = 1; return ir_const(0); }
+    if (se_val == 0) {
+      ir_stmts(se_blk->body, se_blk->nbody);
+      return ir_const(0);
     }
-    pi++;
+    ir_stmts(se_blk->body, se_blk->nbody - 1);
+    return ir_expr(se_val);
   }
+  ir_fail = 1;
+  return ir_const(0);
+}
 
-  // Register float-returning functions from prototypes and definitions
-  n_float_ret = 0;
-  pi = 0;
-  while (pi < prog->nprotos) {
-    if (prog->proto_ret_is_float[pi] != 0) {
-      float_ret_names[n_float_ret] = prog->proto_names[pi];
-      n_float_ret++;
+// Branch to l when the truth of e equals jump_if
+int ir_cond(struct Expr *e, int l, int jump_if) {
+  if (e == 0 || e < 4096) { ir_fail = 1; return 0; }
+  if (e->kind == ND_NUM && e->nargs == 0) {
+    long cv = e->ival;
+    if ((cv != 0) == jump_if) { ir_jump(l); }
+    return 0;
+  }
+  if (e->kind == ND_UNARY && e->ival == '!') {
+    return ir_cond(e->left, l, jump_if == 0);
+  }
+  if (e->kind == ND_BINARY && (my_strcmp(e->sval2, "&&") == 0 || my_strcmp(e->sval2, "||") == 0)) {
+    int is_and = (my_strcmp(e->sval2, "&&") == 0);
+    if (is_and != jump_if) {
+      // && jumping on false, || jumping on true: either side decides
+      ir_cond(e->left, l, jump_if);
+      ir_cond(e->right, l, jump_if);
+    } else {
+      int skip = ir_new_label();
+      ir_cond(e->left, skip, jump_if == 0);
+      ir_cond(e->right, l, jump_if);
+      ir_label(skip);
     }
-    pi++;
+    return 0;
   }
-  pi = 0;
-  while (pi < prog->nfuncs) {
-    fd = prog->funcs[pi];
-    if (fd->ret_is_float != 0) {
-      float_ret_names[n_float_ret] = fd->name;
-      n_float_ret++;
+  if (e->kind == ND_BINARY && ir_cc_of(e->sval2, 0) >= 0 && expr_is_float(e->left) == 0 && expr_is_float(e->right) == 0) {
+    int a = ir_expr(e->left);
+    int b = ir_expr(e->right);
+    int cc = ir_cc_of(e->sval2, cg_binary_unsigned(e));
+    if (jump_if == 0) { cc = ir_cc_invert(cc); }
+    ir_branch(cc, a, b, (expr_is_long(e->left) || expr_is_long(e->right)) == 0, l);
+    return 0;
+  }
+  int v = ir_expr(e);
+  if (jump_if) { ir_branch_zero(IR_BNZ, v, l); }
+  else { ir_branch_zero(IR_BZ, v, l); }
+  return 0;
+}
+
+int ir_vardecl(struct Stmt *st) {
+  for (int i = 0; i < st->ndecls; i++) {
+    struct VarDecl *vd = st->decls[i];
+    if (vd->is_static) continue;
+    if ((vd->stype != 0 && vd->is_ptr == 0 && vd->arr_size < 0) || vd->arr_size >= 0) {
+      if (vd->init != 0) { ir_fail = 1; }
+      continue;
+    }
+    if (vd->is_float) { ir_fail = 1; return 0; }
+    int v = 0;
+    if (vd->init != 0) {
+      v = ir_barechar_trunc(vd->name, ir_expr(vd->init));
+    } else {
+      v = ir_const(0);
+    }
+    int r = ir_var(vd->name);
+    if (r > 0) {
+      ir_set_var(r, vd->name, v);
+    } else {
+      int off = cg_find_slot(vd->name);
+      if (off <= 0) { ir_fail = 1; return 0; }
+      ir_store(ir_frame(off), v, cg_var_bsz(vd->name));
     }
-    pi++;
   }
+  return 0;
+}
 
-  // Register variadic functions
-  nvar_funcs = 0;
-  pi = 0;
-  while (pi < prog->nprotos) {
-    if (prog->proto_is_variadic[pi] != 0) {
-      var_funcs[nvar_funcs] = prog->proto_names[pi];
-      var_nparams[nvar_funcs] = prog->proto_nparams[pi];
-      nvar_funcs++;
+int ir_stmt(struct Stmt *st) {
+  if (st == 0 || st < 4096 || st->kind < 0 || st->kind > 13 || ir_fail) return 0;
+  if (st->kind == ST_RETURN) {
+    int rv = 0;
+    if (cg_cur_func_ret_stype != 0) { ir_fail = 1; return 0; }
+    if (st->expr != 0) { rv = ir_expr(st->expr); } else { rv = ir_const(0); }
+    ir_emit_op(IR_RET, 0, rv, 0);
+    return 0;
+  }
+  if (st->kind == ST_EXPR) {
+    if (st->expr != 0) { ir_expr(st->expr); }
+    return 0;
+  }
+  if (st->kind == ST_BLOCK) return ir_stmts(st->body, st->nbody);
+  if (st->kind == ST_VARDECL) return ir_vardecl(st);
+  if (st->kind == ST_IF) {
+    int lelse = ir_new_label();
+    ir_cond(st->expr, lelse, 0);
+    ir_stmts(st->body, st->nbody);
+    if (st->body2 != 0) {
+      int lend = ir_new_label();
+      ir_jump(lend);
+      ir_label(lelse);
+      ir_stmts(st->body2, st->nbody2);
+      ir_label(lend);
+    } else {
+      ir_label(lelse);
     }
-    pi++;
+    return 0;
   }
-  pi = 0;
-  while (pi < prog->nfuncs) {
-    fd = prog->funcs[pi];
-    if (fd->is_variadic != 0) {
-      var_funcs[nvar_funcs] = fd->name;
-      var_nparams[nvar_funcs] = fd->nparams;
-      nvar_funcs++;
+  if (st->kind == ST_WHILE || st->kind == ST_FOR || st->kind == ST_DOWHILE) {
+    // Loops test at the bottom: one conditional branch per iteration
+    int ltop = ir_new_label();
+    int lcont = ir_new_label();
+    int lcond = ir_new_label();
+    int lend = ir_new_label();
+    if (nir_loop >= MAX_LOOP_STACK) { ir_fail = 1; return 0; }
+    if (st->kind == ST_FOR && st->init != 0) { ir_stmt(st->init); }
+    if (st->kind != ST_DOWHILE) { ir_jump(lcond); }
+    ir_label(ltop);
+    ir_brk[nir_loop] = lend;
+    ir_cont[nir_loop] = lcont;
+    nir_loop++;
+    ir_stmts(st->body, st->nbody);
+    nir_loop--;
+    ir_label(lcont);
+    if (st->kind == ST_FOR && st->expr2 != 0) { ir_expr(st->expr2); }
+    ir_label(lcond);
+    if (st->expr != 0) { ir_cond(st->expr, ltop, 1); }
+    else { ir_jump(ltop); }
+    ir_label(lend);
+    return 0;
+  }
+  if (st->kind == ST_SWITCH) {
+    // One dispatch instruction; the emitter picks tables or compares
+    int v = ir_expr(st->expr);
+    int lend = ir_new_label();
+    int ldef = lend;
+    if (nir_loop >= MAX_LOOP_STACK || nir_args + 2 * st->ncases >= MAX_IR) { ir_fail = 1; return 0; }
+    if (st->default_body != 0 && st->ndefault > 0) { ldef = ir_new_label(); }
+    int si = ir_emit_op(IR_SWITCH, 0, v, 0);
+    int argi = nir_args;
+    ir_lab[si] = ldef;
+    ir_argi[si] = argi;
+    ir_nargs[si] = st->ncases;
+    for (int k = 0; k < st->ncases; k++) {
+      ir_args[nir_args] = st->case_vals[k];
+      ir_args[nir_args + 1] = ir_new_label();
+      nir_args = nir_args + 2;
+    }
+    ir_brk[nir_loop] = lend;
+    ir_cont[nir_loop] = 0;
+    if (nir_loop > 0) { ir_cont[nir_loop] = ir_cont[nir_loop - 1]; }
+    nir_loop++;
+    for (int k = 0; k < st->ncases; k++) {
+      ir_label(ir_args[argi + 2 * k + 1]);
+      ir_stmts(st->case_bodies[k], st->case_nbodies[k]);
+    }
+    if (ldef != lend) {
+      ir_label(ldef);
+      ir_stmts(st->default_body, st->ndefault);
+    }
+    nir_loop--;
+    ir_label(lend);
+    return 0;
+  }
+  if (st->kind == ST_BREAK || st->kind == ST_CONTINUE) {
+    if (nir_loop == 0) { ir_fail = 1; return 0; }
+    if (st->kind == ST_BREAK) { ir_jump(ir_brk[nir_loop - 1]); }
+    else if (ir_cont[nir_loop - 1] == 0) { ir_fail = 1; }
+    else { ir_jump(ir_cont[nir_loop - 1]); }
+    return 0;
+  }
+  if (st->kind == ST_GOTO) {
+    ir_jump(ir_user_label(st->sval));
+    return 0;
+  }
+  if (st->kind == ST_LABEL) {
+    ir_label(ir_user_label(st->sval));
+    return ir_stmts(st->body, st->nbody);
+  }
+  ir_fail = 1;
+  return 0;
+}
+
+int ir_stmts(struct Stmt **stmts, int n) {
+  for (int i = 0; i < n; i++) {
+    ir_stmt(stmts[i]);
+  }
+  return 0;
+}
+
+// Lower f into the IR; returns 0 when f has to go through the AST emitter
+int ir_lower_func(struct FuncDef *f) {
+  nir = 0;
+  nir_args = 0;
+  nir_vregs = 0;
+  nir_labels = 0;
+  nir_loop = 0;
+  ir_fail = 0;
+  if (lay_reg_ok == 0 || f->is_variadic || cg_cur_func_ret_is_float || cg_cur_func_ret_stype != 0 || nlay_float > 0) return 0;
+  for (int li = 0; li < nlay; li++) {
+    ir_var_vreg[li] = 0;
+    if (lay_off[li] > 0 && lay_reg_uses[li] >= 0 && cg_is_array(lay_name[li]) == 0 && cg_is_structvar(lay_name[li]) == 0) {
+      ir_var_vreg[li] = ir_new_vreg();
+    }
+  }
+  for (int i = 0; i < f->nparams; i++) {
+    if (f->param_stypes != 0 && f->param_stypes[i] != 0) return 0;
+    if (i < arg_regs) {
+      int pv = ir_new_vreg();
+      int pi = ir_emit_op(IR_PARAM, pv, 0, 0);
+      ir_imm[pi] = i;
+      if (ir_var(f->params[i]) > 0) {
+        ir_emit_op(IR_MOV, ir_var(f->params[i]), pv, 0);
+      } else {
+        ir_store(ir_frame(cg_find_slot(f->params[i])), pv, 8);
+      }
     }
-    pi++;
   }
+  ir_stmts(f->body, f->nbody);
+  if (ir_fail) return 0;
+  return 1;
+}
 
-  // Register well-known variadic functions if not already declared
-  register_builtin_variadic("printf", 1);
-  register_builtin_variadic("fprintf", 2);
-  register_builtin_variadic("sprintf", 2);
-  register_builtin_variadic("snprintf", 3);
-  register_builtin_variadic("scanf", 1);
-  register_builtin_variadic("fscanf", 2);
-  register_builtin_variadic("sscanf", 2);
+// ---- IR passes ----
 
-  // Register all known function names (for function pointer support)
-  nknown_funcs = 0;
-  pi = 0;
-  while (pi < prog->nprotos) {
-    known_funcs[nknown_funcs] = prog->proto_names[pi];
-    nknown_funcs++;
-    pi++;
+int ir_changed;
+
+int ir_is_branch(int op) {
+  return op == IR_JMP || op == IR_BR || op == IR_BZ || op == IR_BNZ;
+}
+
+int ir_breg(int i) {
+  if (ir_bimm[i]) return 0;
+  return ir_b[i];
+}
+
+// Number of times instruction i reads v
+int ir_uses_of(int i, int v) {
+  int n = 0;
+  if (v == 0) return 0;
+  if (ir_a[i] == v) { n++; }
+  if (ir_breg(i) == v) { n++; }
+  if (ir_c[i] == v) { n++; }
+  if (ir_op[i] == IR_CALL) {
+    for (int k = 0; k < ir_nargs[i]; k++) {
+      if (ir_args[ir_argi[i] + k] == v) { n++; }
+    }
   }
-  ndefined_funcs = 0;
-  pi = 0;
-  while (pi < prog->nfuncs) {
-    fd = prog->funcs[pi];
-    known_funcs[nknown_funcs] = fd->name;
-    nknown_funcs++;
-    defined_funcs[ndefined_funcs] = fd->name;
-    ndefined_funcs++;
-    pi++;
+  return n;
+}
+
+int ir_replace_uses(int i, int from, int to) {
+  if (ir_a[i] == from) { ir_a[i] = to; }
+  if (ir_breg(i) == from) { ir_b[i] = to; }
+  if (ir_c[i] == from) { ir_c[i] = to; }
+  if (ir_op[i] == IR_CALL) {
+    for (int k = 0; k < ir_nargs[i]; k++) {
+      if (ir_args[ir_argi[i] + k] == from) { ir_args[ir_argi[i] + k] = to; }
+    }
   }
   return 0;
 }
 
-int cg_register_globals(struct Program *prog) {
-  struct GDecl *gd = 0;
-  // Register global variables
-  ncg_g = 0;
-  for (int gi = 0; gi < prog->nglobals; gi++) {
-    gd = prog->globals[gi];
-    cgg[ncg_g].name = gd->name;
-    cgg[ncg_g].is_array = 0;
-    if (gd->array_size >= 0) { cgg[ncg_g].is_array = 1; }
-    cgg[ncg_g].is_char = (gd->is_char && gd->is_ptr == 1 && gd->array_size < 0) ? 1 : 0;
-    cgg[ncg_g].is_char_arr = (gd->is_char && gd->is_ptr == 1 && gd->array_size >= 0) ? 1 : 0;
-    cgg[ncg_g].stype = (gd->is_ptr == 0) ? gd->stype : 0;
-    cgg[ncg_g].ptr_stype = 0;
-    if (gd->is_ptr == 1) { if (gd->array_size < 0) { cgg[ncg_g].ptr_stype = gd->stype; } }
-    cgg[ncg_g].is_barechar = (gd->is_char && gd->is_ptr == 0 && gd->array_size < 0) ? (gd->is_unsigned ? 2 : 1) : 0;
-    cgg[ncg_g].is_intptr = (gd->is_ptr > 0 && gd->stype == 0 && (gd->is_char == 0 || gd->is_ptr >= 2) && gd->array_size < 0) ? 1 : 0;
-    cgg[ncg_g].is_bare_char_arr = 0;
-    if (gd->is_char && gd->is_ptr == 0 && gd->array_size >= 0) {
-      cgg[ncg_g].is_bare_char_arr = 1;
-    }
-    {
-      int gesz = 8;
-      if (gd->is_char && gd->is_ptr == 0) { gesz = 1; }
-      else if (gd->stype != 0 && gd->is_ptr == 0) { gesz = 8; }
-      else if (gd->is_short && gd->is_ptr == 0) { gesz = 2; }
-      else if (gd->is_char == 0 && gd->is_ptr == 0 && gd->stype == 0 && gd->is_long == 0 && gd->is_short == 0) { gesz = 4; }
-      if (gd->is_ptr > 0) { gesz = 8; }
-      cgg[ncg_g].esz = gesz;
+int ir_kill(int i) {
+  ir_op[i] = IR_NOP;
+  ir_dst[i] = 0;
+  ir_a[i] = 0;
+  ir_b[i] = 0;
+  ir_c[i] = 0;
+  ir_bimm[i] = 0;
+  ir_changed = 1;
+  return 0;
+}
+
+// Def and use counts of every vreg, label reference counts
+int ir_analyze() {
+  int v = 0;
+  while (v <= nir_vregs) { ir_ndef[v] = 0; ir_nuse[v] = 0; ir_defi[v] = 0 - 1; v++; }
+  int l = 0;
+  while (l <= nir_labels) { ir_label_refs[l] = 0; l++; }
+  for (int i = 0; i < nir; i++) {
+    if (ir_dst[i] != 0) {
+      ir_ndef[ir_dst[i]]++;
+      ir_defi[ir_dst[i]] = i;
     }
-    {
-      int pesz = 0;
-      if (gd->is_ptr > 0) {
-        if (gd->is_ptr >= 2) { pesz = 8; }
-        else if (gd->is_char) { pesz = 1; }
-        else if (gd->is_short) { pesz = 2; }
-        else if (gd->is_long) { pesz = 8; }
-        else if (gd->stype != 0) { pesz = 0; }
-        else { pesz = 4; }
-      }
-      cgg[ncg_g].ptr_esz = pesz;
+    if (ir_a[i] != 0) { ir_nuse[ir_a[i]]++; }
+    if (ir_breg(i) != 0) { ir_nuse[ir_breg(i)]++; }
+    if (ir_c[i] != 0) { ir_nuse[ir_c[i]]++; }
+    if (ir_op[i] == IR_CALL) {
+      for (int k = 0; k < ir_nargs[i]; k++) { ir_nuse[ir_args[ir_argi[i] + k]]++; }
     }
-    {
-      int vbsz = 4;
-      if (gd->is_char && gd->is_ptr == 0 && gd->array_size < 0) { vbsz = 1; }
-      else if (gd->is_short && gd->is_ptr == 0 && gd->array_size < 0) { vbsz = 2; }
-      else if (gd->is_long || gd->is_ptr > 0 || gd->stype != 0 || gd->array_size >= 0) { vbsz = 8; }
-      cgg_var_bsz[ncg_g] = vbsz;
+    if (ir_is_branch(ir_op[i])) { ir_label_refs[ir_lab[i]]++; }
+    if (ir_op[i] == IR_SWITCH) {
+      ir_label_refs[ir_lab[i]]++;
+      for (int k = 0; k < ir_nargs[i]; k++) { ir_label_refs[ir_args[ir_argi[i] + 2 * k + 1]]++; }
     }
-    cgg_is_unsigned[ncg_g] = gd->is_unsigned;
-    ncg_g++;
   }
   return 0;
 }
 
-int cg_find_struct_index(int *sname) {
-  if (sname == 0) return -1;
-  int i = 0;
-  while (i < ncg_s) {
-    if (cg_sname[i] != 0 && my_strcmp(cg_sname[i], sname) == 0) return i;
-    i++;
-  }
-  return -1;
+int ir_const_of(int v, long *out) {
+  if (v == 0 || ir_ndef[v] != 1) return 0;
+  if (ir_op[ir_defi[v]] != IR_IMM) return 0;
+  *out = ir_imm[ir_defi[v]];
+  return 1;
 }
 
-int cg_align_up(int val, int align) {
-  return (val + align - 1) / align * align;
+// v has the same value at position to as right after position from
+int ir_stable(int v, int from, int to) {
+  if (v == 0 || ir_ndef[v] == 1) return 1;
+  int j = from + 1;
+  while (j < to) {
+    if (ir_op[j] == IR_LABEL || ir_dst[j] == v) return 0;
+    j++;
+  }
+  return 1;
 }
 
-int cg_compute_struct_layout(int si) {
-  int nf = cg_snfields[si];
-  int *fbyteoff = my_malloc(nf * 8);
-  int *fbytesize = my_malloc(nf * 8);
-  int offset = 0;
-  int max_align = 1;
-  int is_union = cg_s_is_union[si];
-  int max_size = 0;
+// Truth of cc over two constants, or -1 when it cannot be decided here
+int ir_eval_cc(int cc, long a, long b, int w) {
+  if (w && (a < 0 || b < 0 || a > 2147483647 || b > 2147483647)) return 0 - 1;
+  if (cc >= IR_CC_LO && (a < 0 || b < 0)) return 0 - 1;
+  if (cc == IR_CC_EQ) return a == b;
+  if (cc == IR_CC_NE) return a != b;
+  if (cc == IR_CC_LT || cc == IR_CC_LO) return a < b;
+  if (cc == IR_CC_LE || cc == IR_CC_LS) return a <= b;
+  if (cc == IR_CC_GT || cc == IR_CC_HI) return a > b;
+  return a >= b;
+}
 
-  // Bitfield structs: use nwords * 4 bytes
-  if (cg_s_nw[si] > 0) {
-    int nw = cg_s_nw[si];
-    int j = 0;
-    while (j < nf) {
-      int wi = (cg_s_wi[si] != 0) ? cg_s_wi[si][j] : 0;
-      fbyteoff[j] = wi * 4;
-      fbytesize[j] = 4;
-      j++;
-    }
-    cg_s_fbyteoff[si] = fbyteoff;
-    cg_s_fbytesize[si] = fbytesize;
-    cg_s_bytesize[si] = nw * 4;
-    return 0;
+long ir_eval_ext(long v, int size, int sgn) {
+  if (size == 1) {
+    if (sgn) return (v << 56) >> 56;
+    return v & 255;
   }
+  if (size == 2) {
+    if (sgn) return (v << 48) >> 48;
+    return v & 65535;
+  }
+  if (size == 4) {
+    if (sgn) return (v << 32) >> 32;
+    return v & 4294967295;
+  }
+  return v;
+}
 
-  int j = 0;
-  while (j < nf) {
-    int fsz = 4;  // default: int = 4 bytes
-    int falign = 4;
-    int f_is_ptr = (cg_s_fp[si] != 0 && cg_s_fp[si][j]) ? 1 : 0;
-    int f_is_char = (cg_s_fc[si] != 0 && cg_s_fc[si][j]) ? 1 : 0;
-    int f_is_char_type = (cg_s_fct[si] != 0 && cg_s_fct[si][j]) ? 1 : 0;
-    int f_is_arr = (cg_s_fa[si] != 0) ? cg_s_fa[si][j] : 0;
-    int f_is_short = (cg_s_fsh[si] != 0) ? cg_s_fsh[si][j] : 0;
-    int f_is_long = (cg_s_fl[si] != 0) ? cg_s_fl[si][j] : 0;
-    int *f_stype = cg_sfield_types[si][j];
+int ir_make_imm(int i, long val) {
+  int d = ir_dst[i];
+  ir_kill(i);
+  ir_op[i] = IR_IMM;
+  ir_dst[i] = d;
+  ir_imm[i] = val;
+  ir_size[i] = 8;
+  return 0;
+}
 
-    if (f_is_ptr > 0) {
-      // Any pointer type: 8 bytes
-      fsz = 8; falign = 8;
-    } else if (f_stype != 0) {
-      // Embedded struct/union
-      int inner = cg_find_struct_index(f_stype);
-      if (inner < 0) {
-        // Try typedef resolution
-        int *resolved = find_typedef(f_stype);
-        if (resolved != 0) { inner = cg_find_struct_index(resolved); }
+int ir_make_mov(int i, int src) {
+  int d = ir_dst[i];
+  ir_kill(i);
+  ir_op[i] = IR_MOV;
+  ir_dst[i] = d;
+  ir_a[i] = src;
+  return 0;
+}
+
+int ir_set_bimm(int i, long val) {
+  ir_b[i] = 0;
+  ir_bimm[i] = 1;
+  ir_imm[i] = val;
+  ir_changed = 1;
+  return 0;
+}
+
+// cbz/cbnz of x & 2^k becomes a test of bit k of x (tbz/tbnz)
+int ir_fold_bit_test(int i) {
+  int v = ir_a[i];
+  if (ir_ndef[v] != 1 || ir_nuse[v] != 1) return 0;
+  int di = ir_defi[v];
+  if (ir_op[di] != IR_AND || ir_sh[di] != 0 || di > i) return 0;
+  long mask = ir_imm[di];
+  if (ir_bimm[di] == 0 && ir_const_of(ir_b[di], &mask) == 0) return 0;
+  int bit = cg_log2(mask);
+  if (bit < 0 || bit > 30) return 0;
+  int src = ir_a[di];
+  if (ir_ndef[src] != 1) {
+    // x must still hold the value the and saw
+    for (int j = di + 1; j < i; j++) {
+      if (ir_op[j] == IR_LABEL || ir_dst[j] == src) return 0;
+    }
+  }
+  ir_a[i] = src;
+  ir_set_bimm(i, bit);
+  return 1;
+}
+
+// Constant folding, immediate operands and algebraic identities
+int ir_fold() {
+  for (int i = 0; i < nir; i++) {
+    int op = ir_op[i];
+    long ka = 0;
+    long kb = 0;
+    int has_a = ir_const_of(ir_a[i], &ka);
+    int has_b = 0;
+    if (ir_bimm[i]) { kb = ir_imm[i]; has_b = 1; }
+    else { has_b = ir_const_of(ir_b[i], &kb); }
+    if (op == IR_MOV && has_a) { ir_make_imm(i, ka); continue; }
+    if ((op == IR_NEG || op == IR_NOT) && has_a) {
+      if (op == IR_NEG) { ir_make_imm(i, 0 - ka); } else { ir_make_imm(i, 0 - ka - 1); }
+      continue;
+    }
+    if (op == IR_EXT && has_a) { ir_make_imm(i, ir_eval_ext(ka, ir_size[i], ir_sgn[i])); continue; }
+    if (op == IR_BZ || op == IR_BNZ) {
+      if (ir_bimm[i] == 0) { ir_fold_bit_test(i); }
+      continue;
+    }
+    if (op == IR_SWITCH && has_a) {
+      // A constant selector jumps straight to its case
+      int l = ir_lab[i];
+      for (int k = 0; k < ir_nargs[i]; k++) {
+        if (ir_args[ir_argi[i] + 2 * k] == ka) { l = ir_args[ir_argi[i] + 2 * k + 1]; }
       }
-      if (inner >= 0 && cg_s_fbyteoff[inner] != 0) {
-        fsz = cg_s_bytesize[inner];
-        // Use stored max alignment of inner struct (not byte size!)
-        falign = cg_s_max_align[inner];
-        if (falign < 1) { falign = 1; }
-      } else {
-        fsz = 8; falign = 8;  // fallback
+      ir_kill(i);
+      ir_op[i] = IR_JMP;
+      ir_lab[i] = l;
+      continue;
+    }
+    if (op == IR_ADD || op == IR_MUL || op == IR_AND || op == IR_OR || op == IR_XOR) {
+      if (has_a && has_b == 0 && ir_sh[i] == 0) {
+        int t = ir_a[i];
+        ir_a[i] = ir_b[i];
+        ir_b[i] = t;
+        has_b = 1;
+        kb = ka;
+        has_a = 0;
+        ir_changed = 1;
       }
-    } else if (f_is_char_type || f_is_char) {
-      // char type field (plain char, char*, char[])
-      fsz = 1; falign = 1;
-    } else if (f_is_short) {
-      fsz = 2; falign = 2;
-    } else if (f_is_long) {
-      fsz = 8; falign = 8;
-    } else {
-      // Default: int = 4 bytes
-      fsz = 4; falign = 4;
     }
-
-    // Handle arrays
-    if (f_is_arr > 0) {
-      if (f_is_char && f_is_ptr == 0) {
-        // char arr[N]: N bytes, align 1
-        fsz = f_is_arr;
-        falign = 1;
-      } else {
-        fsz = fsz * f_is_arr;
+    if ((op == IR_SET || op == IR_BR) && has_a && has_b == 0) {
+      int t2 = ir_a[i];
+      ir_a[i] = ir_b[i];
+      ir_b[i] = t2;
+      ir_cc[i] = ir_cc_swap(ir_cc[i]);
+      has_b = 1;
+      kb = ka;
+      has_a = 0;
+      ir_changed = 1;
+    }
+    if (has_b == 0) continue;
+    if (op == IR_SET || op == IR_BR) {
+      if (has_a) {
+        int t3 = ir_eval_cc(ir_cc[i], ka, kb, ir_w[i]);
+        if (t3 >= 0 && op == IR_SET) { ir_make_imm(i, t3); continue; }
+        if (t3 >= 0) {
+          int l = ir_lab[i];
+          ir_kill(i);
+          if (t3) { ir_op[i] = IR_JMP; ir_lab[i] = l; }
+          continue;
+        }
       }
+      if (ir_bimm[i] == 0 && kb >= 0 - 4095 && kb <= 4095) { ir_set_bimm(i, kb); }
+      // Compare against zero becomes cbz/cbnz
+      if (op == IR_BR && ir_bimm[i] && kb == 0 && (ir_cc[i] == IR_CC_EQ || ir_cc[i] == IR_CC_NE)) {
+        int l2 = ir_lab[i];
+        int a2 = ir_a[i];
+        int w2 = ir_w[i];
+        int z = (ir_cc[i] == IR_CC_EQ);
+        ir_kill(i);
+        ir_w[i] = w2;
+        if (z) { ir_op[i] = IR_BZ; } else { ir_op[i] = IR_BNZ; }
+        ir_a[i] = a2;
+        ir_lab[i] = l2;
+      }
+      continue;
     }
-
-    // Align offset
-    if (is_union == 0) {
-      offset = cg_align_up(offset, falign);
+    if (op == IR_ADD || op == IR_SUB) {
+      if (ir_sh[i] > 0) {
+        kb = kb << ir_sh[i];
+        ir_sh[i] = 0;
+        ir_set_bimm(i, kb);
+      }
+      if (has_a) {
+        if (op == IR_ADD) { ir_make_imm(i, ka + kb); } else { ir_make_imm(i, ka - kb); }
+        continue;
+      }
+      if (kb == 0) { ir_make_mov(i, ir_a[i]); continue; }
+      if (ir_bimm[i] == 0 && kb >= 0 - 16777215 && kb <= 16777215) { ir_set_bimm(i, kb); }
+      // (x + k1) + k2 => x + (k1 + k2)
+      if (ir_bimm[i] && ir_ndef[ir_a[i]] == 1) {
+        int di = ir_defi[ir_a[i]];
+        if ((ir_op[di] == IR_ADD || ir_op[di] == IR_SUB) && ir_bimm[di] && ir_stable(ir_a[di], di, i)) {
+          long k1 = ir_imm[di];
+          long k2 = ir_imm[i];
+          if (ir_op[di] == IR_SUB) { k1 = 0 - k1; }
+          if (op == IR_SUB) { k2 = 0 - k2; }
+          ir_op[i] = IR_ADD;
+          ir_a[i] = ir_a[di];
+          ir_imm[i] = k1 + k2;
+          ir_changed = 1;
+        }
+      }
+      continue;
     }
-    fbyteoff[j] = is_union ? 0 : offset;
-    fbytesize[j] = fsz;
-
-    if (falign > max_align) { max_align = falign; }
-    if (is_union) {
-      if (fsz > max_size) { max_size = fsz; }
-    } else {
-      offset = offset + fsz;
+    if (op == IR_MUL) {
+      if (has_a) { ir_make_imm(i, ka * kb); continue; }
+      if (kb == 1) { ir_make_mov(i, ir_a[i]); continue; }
+      if (kb == 0) { ir_make_imm(i, 0); continue; }
+      // Powers of two become shifts, which fold into adds and addressing
+      int sh = cg_log2(kb);
+      if (sh > 0 && (sh < 32 || ir_w[i] == 0)) {
+        ir_op[i] = IR_SHL;
+        ir_set_bimm(i, sh);
+        continue;
+      }
+      if (ir_bimm[i] == 0 && cg_emit_mul_const(0, 0, kb, ir_w[i], 0)) { ir_set_bimm(i, kb); }
+      continue;
+    }
+    if (op == IR_DIV || op == IR_REM) {
+      if (ir_bimm[i] == 0 && cg_emit_div_const(0, 0, kb, ir_w[i], ir_sgn[i], op == IR_REM, 0)) { ir_set_bimm(i, kb); }
+      continue;
+    }
+    if (op == IR_AND || op == IR_OR || op == IR_XOR) {
+      if (has_a) {
+        if (op == IR_AND) { ir_make_imm(i, ka & kb); }
+        else if (op == IR_OR) { ir_make_imm(i, ka | kb); }
+        else { ir_make_imm(i, ka ^ kb); }
+        continue;
+      }
+      if (kb == 0) {
+        if (op == IR_AND) { ir_make_imm(i, 0); } else { ir_make_mov(i, ir_a[i]); }
+        continue;
+      }
+      if (ir_bimm[i] == 0 && is_logical_imm(kb, ir_w[i])) { ir_set_bimm(i, kb); }
+      continue;
+    }
+    if (op == IR_SHL || op == IR_SHR) {
+      int wbits = 64;
+      if (ir_w[i]) { wbits = 32; }
+      kb = kb & (wbits - 1);
+      if (has_a && ir_w[i] == 0) {
+        if (op == IR_SHL) { ir_make_imm(i, ka << kb); continue; }
+        if (ir_sgn[i] || ka >= 0) { ir_make_imm(i, ka >> kb); continue; }
+      }
+      if (kb == 0 && ir_w[i] == 0) { ir_make_mov(i, ir_a[i]); continue; }
+      if (ir_bimm[i] == 0) { ir_set_bimm(i, kb); }
+      continue;
     }
-    j++;
   }
+  return 0;
+}
 
-  int total;
-  if (is_union) {
-    total = cg_align_up(max_size, max_align);
-  } else {
-    total = cg_align_up(offset, max_align);
-  }
-  if (total == 0) { total = max_align; }
+// Replacement vreg for v, set by copy propagation and CSE
+int ir_resolve(int v) {
+  while (v != 0 && ir_map[v] != 0) { v = ir_map[v]; }
+  return v;
+}
 
-  cg_s_fbyteoff[si] = fbyteoff;
-  cg_s_fbytesize[si] = fbytesize;
-  cg_s_bytesize[si] = total;
-  cg_s_max_align[si] = max_align;
+int ir_apply_map(int i) {
+  if (ir_a[i] != 0) { ir_a[i] = ir_resolve(ir_a[i]); }
+  if (ir_breg(i) != 0) { ir_b[i] = ir_resolve(ir_b[i]); }
+  if (ir_c[i] != 0) { ir_c[i] = ir_resolve(ir_c[i]); }
+  if (ir_op[i] == IR_CALL) {
+    for (int k = 0; k < ir_nargs[i]; k++) {
+      ir_args[ir_argi[i] + k] = ir_resolve(ir_args[ir_argi[i] + k]);
+    }
+  }
   return 0;
 }
 
-// Build flat slot layout: for each flattened slot index, compute byte offset and byte size
-// Returns number of slots filled
-int cg_build_slot_layout(int *sname, int *slot_off, int *slot_sz, int max_slots) {
-  sname = cg_resolve_sname(sname);
-  int si = cg_find_struct_index(sname);
-  if (si < 0 || cg_s_fbyteoff[si] == 0) return 0;
+int ir_clear_map() {
+  int v = 0;
+  while (v <= nir_vregs) { ir_map[v] = 0; v++; }
+  return 0;
+}
 
-  // Union: 1 slot at offset 0
-  if (cg_s_is_union[si]) {
-    if (max_slots > 0) { slot_off[0] = 0; slot_sz[0] = cg_s_bytesize[si]; }
-    return 1;
+// Forward the source of single-def copies into their uses
+int ir_copy_prop() {
+  ir_clear_map();
+  for (int i = 0; i < nir; i++) {
+    if (ir_op[i] != IR_MOV) continue;
+    int d = ir_dst[i];
+    int s = ir_resolve(ir_a[i]);
+    if (d == s) { ir_kill(i); continue; }
+    if (ir_ndef[d] != 1) continue;
+    if (ir_ndef[s] == 1) {
+      ir_map[d] = s;
+      ir_kill(i);
+      continue;
+    }
+    // s may be reassigned: every use of d must come before that, with no
+    // label in between
+    int seen = 0;
+    int j = i + 1;
+    int ok = 0;
+    while (j < nir) {
+      seen = seen + ir_uses_of(j, d);
+      if (seen >= ir_nuse[d]) { ok = 1; break; }
+      if (ir_op[j] == IR_LABEL || ir_dst[j] == s) break;
+      j++;
+    }
+    if (ok) {
+      int k = i + 1;
+      while (k <= j) { ir_replace_uses(k, d, s); k++; }
+      ir_kill(i);
+    }
+  }
+  for (int i = 0; i < nir; i++) { ir_apply_map(i); }
+  ir_analyze();
+  // "t = ...; d = t" computes straight into d
+  for (int i = 1; i < nir; i++) {
+    if (ir_op[i] != IR_MOV) continue;
+    int t = ir_a[i];
+    int p = i - 1;
+    if (ir_dst[p] != t || ir_ndef[t] != 1 || ir_nuse[t] != 1) continue;
+    ir_dst[p] = ir_dst[i];
+    ir_kill(i);
   }
+  return 0;
+}
 
-  int slot = 0;
-  int j = 0;
-  while (j < cg_snfields[si]) {
-    int f_off = cg_s_fbyteoff[si][j];
-    int f_sz = cg_s_fbytesize[si][j];
-    int f_is_ptr = (cg_s_fp[si] != 0) ? cg_s_fp[si][j] : 0;
-    int f_is_arr = (cg_s_fa[si] != 0) ? cg_s_fa[si][j] : 0;
-    int f_is_char = (cg_s_fc[si] != 0) ? cg_s_fc[si][j] : 0;
-    int *f_stype = cg_sfield_types[si][j];
+int ir_same(int i, int j) {
+  if (ir_op[i] != ir_op[j] || ir_a[i] != ir_a[j] || ir_b[i] != ir_b[j] || ir_c[i] != ir_c[j]) return 0;
+  if (ir_imm[i] != ir_imm[j] || ir_bimm[i] != ir_bimm[j] || ir_w[i] != ir_w[j] || ir_sgn[i] != ir_sgn[j]) return 0;
+  if (ir_size[i] != ir_size[j] || ir_sh[i] != ir_sh[j] || ir_cc[i] != ir_cc[j]) return 0;
+  if (ir_op[i] == IR_ADDR && my_strcmp(ir_sym[i], ir_sym[j]) != 0) return 0;
+  return 1;
+}
 
-    if (f_stype != 0 && f_is_ptr == 0 && f_is_arr == 0) {
-      // Embedded struct: recurse into sub-fields
-      int sub_nf = cg_struct_nfields(f_stype);
-      int *sub_off = my_malloc(sub_nf * 8);
-      int *sub_sz = my_malloc(sub_nf * 8);
-      int sub_n = cg_build_slot_layout(f_stype, sub_off, sub_sz, sub_nf);
-      int si2 = 0;
-      while (si2 < sub_n && slot < max_slots) {
-        slot_off[slot] = f_off + sub_off[si2];
-        slot_sz[slot] = sub_sz[si2];
-        slot++;
-        si2++;
+// Local common subexpressions within a straight-line window
+int ir_cse() {
+  ir_clear_map();
+  for (int i = 0; i < nir; i++) {
+    ir_apply_map(i);
+    int op = ir_op[i];
+    int d = ir_dst[i];
+    if (d == 0 || ir_ndef[d] != 1) continue;
+    if (op == IR_MOV || op == IR_CALL || op == IR_PARAM || op == IR_NOP) continue;
+    int j = i - 1;
+    int lim = i - 64;
+    if (lim < 0) { lim = 0; }
+    while (j >= lim) {
+      int oj = ir_op[j];
+      if (oj == IR_LABEL) break;
+      if (op == IR_LOAD && (oj == IR_STORE || oj == IR_CALL)) break;
+      if (ir_dst[j] != 0 && (ir_dst[j] == ir_a[i] || ir_dst[j] == ir_breg(i))) break;
+      if (oj == op && ir_ndef[ir_dst[j]] == 1 && ir_same(i, j)) {
+        ir_map[d] = ir_dst[j];
+        ir_kill(i);
+        break;
       }
-    } else if (f_is_arr > 0 && f_is_char && f_is_ptr == 0) {
-      // Char array: ceil(arr_size / 8) packed slots
-      int ca_nslots = (f_is_arr + 7) / 8;
-      int csi = 0;
-      while (csi < ca_nslots && slot < max_slots) {
-        slot_off[slot] = f_off + csi * 8;
-        slot_sz[slot] = 8;
-        slot++;
-        csi++;
+      j--;
+    }
+  }
+  return 0;
+}
+
+int ir_dce() {
+  for (int i = nir - 1; i >= 0; i--) {
+    int d = ir_dst[i];
+    if (d == 0 || ir_op[i] == IR_CALL || ir_nuse[d] > 0) continue;
+    // Drop the operands' uses so their own definitions can die too
+    if (ir_a[i] != 0) { ir_nuse[ir_a[i]]--; }
+    if (ir_breg(i) != 0) { ir_nuse[ir_breg(i)]--; }
+    ir_kill(i);
+  }
+  return 0;
+}
+
+int ir_next_real(int i) {
+  while (i < nir && ir_op[i] == IR_NOP) { i++; }
+  return i;
+}
+
+// Unreachable code, jumps to the next instruction, unused labels
+int ir_branches() {
+  int dead = 0;
+  for (int i = 0; i < nir; i++) {
+    int op = ir_op[i];
+    if (op == IR_LABEL) {
+      if (ir_label_refs[ir_lab[i]] == 0) { ir_kill(i); continue; }
+      dead = 0;
+      continue;
+    }
+    if (dead) {
+      if (ir_is_branch(op)) { ir_label_refs[ir_lab[i]]--; }
+      if (op == IR_SWITCH) {
+        ir_label_refs[ir_lab[i]]--;
+        for (int k = 0; k < ir_nargs[i]; k++) { ir_label_refs[ir_args[ir_argi[i] + 2 * k + 1]]--; }
       }
-    } else if (f_is_arr > 0 && f_stype != 0 && f_is_ptr == 0) {
-      // Array of structs
-      int sub_nf = cg_struct_nfields(f_stype);
-      int elem_bsz = cg_struct_byte_size(f_stype);
-      int ai = 0;
-      while (ai < f_is_arr) {
-        int *sub_off = my_malloc(sub_nf * 8);
-        int *sub_sz = my_malloc(sub_nf * 8);
-        int sub_n = cg_build_slot_layout(f_stype, sub_off, sub_sz, sub_nf);
-        int si2 = 0;
-        while (si2 < sub_n && slot < max_slots) {
-          slot_off[slot] = f_off + ai * elem_bsz + sub_off[si2];
-          slot_sz[slot] = sub_sz[si2];
-          slot++;
-          si2++;
-        }
-        ai++;
+      if (op != IR_NOP) { ir_kill(i); }
+      continue;
+    }
+    if (ir_is_branch(op)) {
+      int n = ir_next_real(i + 1);
+      while (n < nir && ir_op[n] == IR_LABEL) {
+        if (ir_lab[n] == ir_lab[i]) break;
+        n = ir_next_real(n + 1);
       }
-    } else if (f_is_arr > 0) {
-      // Array of scalars
-      int elem_sz = f_sz / f_is_arr;
-      if (elem_sz < 1) { elem_sz = 1; }
-      int ai = 0;
-      while (ai < f_is_arr && slot < max_slots) {
-        slot_off[slot] = f_off + ai * elem_sz;
-        slot_sz[slot] = elem_sz;
-        slot++;
-        ai++;
+      if (n < nir && ir_op[n] == IR_LABEL && ir_lab[n] == ir_lab[i]) {
+        ir_label_refs[ir_lab[i]]--;
+        ir_kill(i);
+        continue;
       }
+    }
+    if (op == IR_JMP || op == IR_RET || op == IR_SWITCH) { dead = 1; }
+  }
+  return 0;
+}
+
+int ir_compact() {
+  int n = 0;
+  for (int i = 0; i < nir; i++) {
+    if (ir_op[i] == IR_NOP) continue;
+    if (n != i) {
+      ir_op[n] = ir_op[i];
+      ir_dst[n] = ir_dst[i];
+      ir_a[n] = ir_a[i];
+      ir_b[n] = ir_b[i];
+      ir_c[n] = ir_c[i];
+      ir_imm[n] = ir_imm[i];
+      ir_bimm[n] = ir_bimm[i];
+      ir_w[n] = ir_w[i];
+      ir_sgn[n] = ir_sgn[i];
+      ir_size[n] = ir_size[i];
+      ir_sh[n] = ir_sh[i];
+      ir_cc[n] = ir_cc[i];
+      ir_lab[n] = ir_lab[i];
+      ir_sym[n] = ir_sym[i];
+      ir_argi[n] = ir_argi[i];
+      ir_nargs[n] = ir_nargs[i];
+    }
+    n++;
+  }
+  nir = n;
+  return 0;
+}
+
+// Fold address arithmetic into load/store addressing modes
+int ir_addr_modes() {
+  for (int i = 0; i < nir; i++) {
+    if (ir_op[i] != IR_LOAD && ir_op[i] != IR_STORE) continue;
+    int t = ir_a[i];
+    if (t == 0 || ir_ndef[t] != 1 || ir_b[i] != 0) continue;
+    int di = ir_defi[t];
+    int dop = ir_op[di];
+    if (dop == IR_FRAME) {
+      ir_a[i] = 0;
+      ir_imm[i] = ir_imm[i] - ir_imm[di];
+      ir_changed = 1;
+    } else if ((dop == IR_ADD || dop == IR_SUB) && ir_bimm[di] && ir_stable(ir_a[di], di, i)) {
+      if (dop == IR_ADD) { ir_imm[i] = ir_imm[i] + ir_imm[di]; }
+      else { ir_imm[i] = ir_imm[i] - ir_imm[di]; }
+      ir_a[i] = ir_a[di];
+      ir_changed = 1;
+    } else if (dop == IR_ADD && ir_bimm[di] == 0 && ir_imm[i] == 0 &&
+               (ir_sh[di] == 0 || ir_sh[di] == cg_log2(ir_size[i])) &&
+               ir_stable(ir_a[di], di, i) && ir_stable(ir_b[di], di, i)) {
+      ir_a[i] = ir_a[di];
+      ir_b[i] = ir_b[di];
+      ir_sh[i] = ir_sh[di];
+      ir_changed = 1;
     } else {
-      // Simple scalar field
-      if (slot < max_slots) {
-        slot_off[slot] = f_off;
-        slot_sz[slot] = f_sz;
-        slot++;
-      }
+      continue;
     }
-    j++;
+    ir_nuse[t]--;
+    if (ir_a[i] != 0) { ir_nuse[ir_a[i]]++; }
+    if (ir_b[i] != 0) { ir_nuse[ir_b[i]]++; }
   }
-  return slot;
+  return 0;
 }
 
-int cg_register_structs(struct Program *prog) {
-#ifndef __STDC__
-  struct SDef *sd = 0;
-#endif
-  // Register struct/union definitions
-  int i = 0;
-  struct SDef *sd = 0;
-  while (i < prog->nstructs) {
-    sd = prog->structs[i];
-    cg_sname[ncg_s] = sd->name;
-    cg_sfields[ncg_s] = sd->fields;
-    cg_sfield_types[ncg_s] = sd->field_types;
-    cg_snfields[ncg_s] = sd->nfields;
-    cg_s_is_union[ncg_s] = sd->is_union;
-    cg_s_bw[ncg_s] = sd->bit_widths;
-    cg_s_bo[ncg_s] = sd->bit_offsets;
-    cg_s_wi[ncg_s] = sd->word_indices;
-    cg_s_nw[ncg_s] = sd->nwords;
-    cg_s_fa[ncg_s] = sd->field_is_array;
-    cg_s_fc[ncg_s] = sd->field_is_char;
-    cg_s_fp[ncg_s] = sd->field_is_ptr;
-    cg_s_fsh[ncg_s] = sd->field_is_short;
-    cg_s_fl[ncg_s] = sd->field_is_long;
-    cg_s_fct[ncg_s] = sd->field_is_char_type;
-    cg_s_fu[ncg_s] = sd->field_is_unsigned;
-    ncg_s++;
-    i++;
+int ir_optimize() {
+  int iter = 0;
+  ir_changed = 1;
+  while (ir_changed && iter < 16) {
+    ir_changed = 0;
+    ir_analyze();
+    ir_fold();
+    ir_analyze();
+    ir_copy_prop();
+    ir_analyze();
+    ir_cse();
+    ir_analyze();
+    ir_addr_modes();
+    ir_dce();
+    ir_branches();
+    ir_compact();
+    iter++;
+  }
+  ir_analyze();
+  return 0;
+}
+
+// ---- IR register allocation ----
+
+int ir_mention(int v, int i) {
+  if (v == 0) return 0;
+  if (ir_start[v] < 0) { ir_start[v] = i; }
+  ir_end[v] = i;
+  return 0;
+}
+
+// Live intervals: first to last mention, widened over loops the vreg is
+// live across
+int ir_intervals() {
+  int v = 0;
+  while (v <= nir_vregs) { ir_start[v] = 0 - 1; ir_end[v] = 0 - 1; v++; }
+  int nlab = 0;
+  int ncall = 0;
+  for (int i = 0; i < nir; i++) {
+    ir_pfx_lab[i] = nlab;
+    ir_pfx_call[i] = ncall;
+    if (ir_op[i] == IR_LABEL) { ir_label_pos[ir_lab[i]] = i; nlab++; }
+    if (ir_op[i] == IR_CALL) { ncall++; }
+  }
+  ir_pfx_lab[nir] = nlab;
+  ir_pfx_call[nir] = ncall;
+  for (int i = 0; i < nir; i++) {
+    ir_mention(ir_dst[i], i);
+    ir_mention(ir_a[i], i);
+    ir_mention(ir_breg(i), i);
+    ir_mention(ir_c[i], i);
+    if (ir_op[i] == IR_CALL) {
+      for (int k = 0; k < ir_nargs[i]; k++) { ir_mention(ir_args[ir_argi[i] + k], i); }
+    }
+  }
+  int changed = 1;
+  while (changed) {
+    changed = 0;
+    for (int i = 0; i < nir; i++) {
+      if (ir_is_branch(ir_op[i]) == 0) continue;
+      int q = ir_label_pos[ir_lab[i]];
+      if (q > i) continue;
+      v = 1;
+      while (v <= nir_vregs) {
+        int s = ir_start[v];
+        int e = ir_end[v];
+        // A single definition with no label inside is dead at the loop top
+        int local = (ir_ndef[v] == 1 && ir_defi[v] == s && ir_pfx_lab[e + 1] == ir_pfx_lab[s + 1]);
+        if (s >= 0 && local == 0 && s <= i && e >= q && (s > q || e < i)) {
+          if (q < s) { ir_start[v] = q; }
+          if (i > e) { ir_end[v] = i; }
+          changed = 1;
+        }
+        v++;
+      }
+    }
   }
-  // Register inline anonymous structs
-  i = 0;
-  while (i < ninline_sdefs) {
-    sd = inline_sdefs[i];
-    cg_sname[ncg_s] = sd->name;
-    cg_sfields[ncg_s] = sd->fields;
-    cg_sfield_types[ncg_s] = sd->field_types;
-    cg_snfields[ncg_s] = sd->nfields;
-    cg_s_is_union[ncg_s] = sd->is_union;
-    cg_s_bw[ncg_s] = sd->bit_widths;
-    cg_s_bo[ncg_s] = sd->bit_offsets;
-    cg_s_wi[ncg_s] = sd->word_indices;
-    cg_s_nw[ncg_s] = sd->nwords;
-    cg_s_fa[ncg_s] = sd->field_is_array;
-    cg_s_fc[ncg_s] = sd->field_is_char;
-    cg_s_fp[ncg_s] = sd->field_is_ptr;
-    cg_s_fsh[ncg_s] = sd->field_is_short;
-    cg_s_fl[ncg_s] = sd->field_is_long;
-    cg_s_fct[ncg_s] = sd->field_is_char_type;
-    cg_s_fu[ncg_s] = sd->field_is_unsigned;
-    ncg_s++;
-    i++;
+  return 0;
+}
+
+int ir_crosses_call(int v) {
+  return ir_pfx_call[ir_end[v]] - ir_pfx_call[ir_start[v] + 1] > 0;
+}
+
+int ir_reg_free(int r, int *active, int nactive) {
+  for (int k = 0; k < nactive; k++) {
+    if (ir_preg[active[k]] == r) return 0;
+  }
+  return 1;
+}
+
+// Caller-saved x9..x15 unless v lives across a call, then x19 up. On
+// x86-64 x10..x15 live in the frame, so they come after the callee-saved
+// registers there.
+int ir_pick_reg(int v, int *active, int nactive) {
+  int cross = ir_crosses_call(v);
+  int r = 9;
+  if (cross == 0) {
+    while (r <= 15) {
+      if (ir_reg_free(r, active, nactive)) return r;
+      if (target_x86) break;
+      r++;
+    }
+  }
+  r = 19;
+  while (r < 19 + var_regs) {
+    if (ir_reg_free(r, active, nactive)) return r;
+    r++;
+  }
+  r = 10;
+  while (cross == 0 && target_x86 && r <= 15) {
+    if (ir_reg_free(r, active, nactive)) return r;
+    r++;
   }
-  // Compute proper struct layouts
-  { int li = 0; while (li < ncg_s) { cg_compute_struct_layout(li); li++; } }
   return 0;
 }
 
-// Try to evaluate an AST expression to a compile-time constant.
-// Returns 1 if successful, 0 if not. Result stored in *out.
-int try_eval_const(struct Expr *e, int *out) {
-  if (e == 0) return 0;
-  if (e->kind == ND_NUM) { *out = e->ival; return 1; }
-  if (e->kind == ND_CAST && e->left != 0) { return try_eval_const(e->left, out); }
-  if (e->kind == ND_UNARY && e->ival == '-') {
-    int v = 0;
-    if (try_eval_const(e->left, &v)) { *out = 0 - v; return 1; }
-    return 0;
+int ir_spill(int v) {
+  ir_preg[v] = 0;
+  ir_nslots++;
+  ir_slot[v] = lay_locals_size + ir_nslots * 8;
+  return 0;
+}
+
+int ir_regalloc() {
+  int active[32];
+  int nactive = 0;
+  int n = 0;
+  ir_intervals();
+  ir_nslots = 0;
+  ir_ncallee = 0;
+  // Order vregs by interval start
+  for (int i = 0; i <= nir; i++) { ir_bucket[i] = 0; }
+  int v = 1;
+  while (v <= nir_vregs) {
+    ir_preg[v] = 0;
+    ir_slot[v] = 0;
+    if (ir_start[v] >= 0) { ir_bucket[ir_start[v] + 1]++; }
+    v++;
+  }
+  for (int i = 1; i <= nir; i++) { ir_bucket[i] = ir_bucket[i] + ir_bucket[i - 1]; }
+  v = 1;
+  while (v <= nir_vregs) {
+    if (ir_start[v] >= 0) {
+      ir_order[ir_bucket[ir_start[v]]] = v;
+      ir_bucket[ir_start[v]]++;
+      n++;
+    }
+    v++;
+  }
+  for (int oi = 0; oi < n; oi++) {
+    v = ir_order[oi];
+    int k = 0;
+    while (k < nactive) {
+      int e = ir_end[active[k]];
+      // An operand's register may be reused by the result of the same instruction
+      if (e < ir_start[v] || (e == ir_start[v] && ir_dst[e] == v)) {
+        active[k] = active[nactive - 1];
+        nactive--;
+      } else {
+        k++;
+      }
+    }
+    int r = ir_pick_reg(v, active, nactive);
+    if (r == 0) {
+      // Evict the interval ending last if it outlives v and its register fits
+      int far = 0 - 1;
+      k = 0;
+      while (k < nactive) {
+        int a = active[k];
+        if ((ir_preg[a] >= 19 || ir_crosses_call(v) == 0) && (far < 0 || ir_end[a] > ir_end[active[far]])) { far = k; }
+        k++;
+      }
+      if (far >= 0 && ir_end[active[far]] > ir_end[v]) {
+        r = ir_preg[active[far]];
+        ir_spill(active[far]);
+        active[far] = active[nactive - 1];
+        nactive--;
+      } else {
+        ir_spill(v);
+        continue;
+      }
+    }
+    ir_preg[v] = r;
+    if (r >= 19 && r - 18 > ir_ncallee) { ir_ncallee = r - 18; }
+    active[nactive] = v;
+    nactive++;
   }
-  if (e->kind == ND_UNARY && e->ival == '~') {
-    int v = 0;
-    if (try_eval_const(e->left, &v)) { *out = ~v; return 1; }
+  // Frame: locals, spill slots, then the callee-saved registers
+  int offset = lay_locals_size + ir_nslots * 8;
+  for (int li = 0; li < nlay; li++) { lay_reg[li] = 0; }
+  lay_nsave = ir_ncallee;
+  lay_save_off = 0;
+  if (lay_nsave > 0) {
+    offset = offset + lay_nsave * 8;
+    lay_save_off = offset;
+  }
+  lay_stack_size = ((offset + 15) / 16) * 16;
+  return 0;
+}
+
+// ---- IR emission ----
+
+int ir_emit_reg(int r, int w) {
+  if (w) { emit_s("w"); } else { emit_s("x"); }
+  emit_num(r);
+  return 0;
+}
+
+// Materialize a 64-bit constant in xr
+int ir_emit_imm(int r, long val) {
+  if (val >= 0 - 65536 && val <= 65535) {
+    emit_s("\tmov\tx"); emit_num(r); emit_s(", #"); emit_num(val); emit_ch('\n');
     return 0;
   }
-  if (e->kind == ND_BINARY) {
-    int lv = 0; int rv = 0;
-    int *op = e->sval2;
-    if (op == 0) return 0;
-    if (try_eval_const(e->left, &lv) == 0) return 0;
-    if (try_eval_const(e->right, &rv) == 0) return 0;
-    if (my_strcmp(op, "+") == 0) { *out = lv + rv; return 1; }
-    if (my_strcmp(op, "-") == 0) { *out = lv - rv; return 1; }
-    if (my_strcmp(op, "*") == 0) { *out = lv * rv; return 1; }
-    if (my_strcmp(op, "/") == 0 && rv != 0) { *out = lv / rv; return 1; }
-    if (my_strcmp(op, "%") == 0 && rv != 0) { *out = lv % rv; return 1; }
-    if (my_strcmp(op, "&") == 0) { *out = lv & rv; return 1; }
-    if (my_strcmp(op, "|") == 0) { *out = lv | rv; return 1; }
-    if (my_strcmp(op, "^") == 0) { *out = lv ^ rv; return 1; }
-    if (my_strcmp(op, "<<") == 0) { *out = lv << rv; return 1; }
-    if (my_strcmp(op, ">>") == 0) { *out = lv >> rv; return 1; }
+  int first = 1;
+  int sh = 0;
+  long rest = val;
+  while (sh < 64) {
+    int chunk = rest & 65535;
+    if (chunk != 0 || (first && sh == 48)) {
+      if (first) { emit_s("\tmovz\tx"); } else { emit_s("\tmovk\tx"); }
+      emit_num(r); emit_s(", #"); emit_unum(chunk);
+      if (sh > 0) { emit_s(", lsl #"); emit_num(sh); }
+      emit_ch('\n');
+      first = 0;
+    }
+    rest = rest >> 16;
+    sh = sh + 16;
+  }
+  return 0;
+}
+
+// xr = x29 - off
+int ir_emit_frame_addr(int r, long off) {
+  if (off >= 0 && off <= 4095) {
+    emit_s("\tsub\tx"); emit_num(r); emit_s(", x29, #"); emit_num(off); emit_ch('\n');
+  } else if (off < 0 && off >= 0 - 4095) {
+    emit_s("\tadd\tx"); emit_num(r); emit_s(", x29, #"); emit_num(0 - off); emit_ch('\n');
+  } else if (off > 0 && off <= 16777215) {
+    int *rn = build_str2("x", int_to_str(r));
+    emit_addsub_imm("sub", rn, "x29", off);
+  } else {
+    ir_emit_imm(r, off);
+    emit_s("\tsub\tx"); emit_num(r); emit_s(", x29, x"); emit_num(r); emit_ch('\n');
+  }
+  return 0;
+}
+
+int ir_emit_slot(int *op, int r, int slot, int tmp) {
+  if (slot <= 255) {
+    emit_s("\t"); emit_s(op); emit_s("\tx"); emit_num(r); emit_s(", [x29, #-"); emit_num(slot); emit_line("]");
+  } else {
+    ir_emit_frame_addr(tmp, slot);
+    emit_s("\t"); emit_s(op); emit_s("\tx"); emit_num(r); emit_s(", [x"); emit_num(tmp); emit_line("]");
+  }
+  return 0;
+}
+
+// Register holding v, reloading a spilled v into scratch
+int ir_use(int v, int scratch) {
+  if (ir_preg[v] > 0) return ir_preg[v];
+  ir_emit_slot("ldr", scratch, ir_slot[v], scratch);
+  return scratch;
+}
+
+int ir_def(int v) {
+  if (ir_preg[v] > 0) return ir_preg[v];
+  return 16;
+}
+
+int ir_def_done(int v) {
+  if (ir_preg[v] == 0) { ir_emit_slot("str", 16, ir_slot[v], 17); }
+  return 0;
+}
+
+int *ir_label_name(int l) {
+  if (ir_label_str[l] == 0) { ir_label_str[l] = cg_new_label("ir"); }
+  return ir_label_str[l];
+}
+
+int ir_emit_cmp(int i) {
+  int w = ir_w[i];
+  int ra = ir_use(ir_a[i], 16);
+  if (ir_bimm[i]) {
+    long k = ir_imm[i];
+    if (k >= 0 && k <= 4095) {
+      emit_s("\tcmp\t"); ir_emit_reg(ra, w); emit_s(", #"); emit_num(k); emit_ch('\n');
+      return 0;
+    }
+    if (k < 0 && k >= 0 - 4095) {
+      emit_s("\tcmn\t"); ir_emit_reg(ra, w); emit_s(", #"); emit_num(0 - k); emit_ch('\n');
+      return 0;
+    }
+    ir_emit_imm(17, k);
+    emit_s("\tcmp\t"); ir_emit_reg(ra, w); emit_s(", "); ir_emit_reg(17, w); emit_ch('\n');
     return 0;
   }
+  int rb = ir_use(ir_b[i], 17);
+  emit_s("\tcmp\t"); ir_emit_reg(ra, w); emit_s(", "); ir_emit_reg(rb, w); emit_ch('\n');
   return 0;
 }
 
-int cg_emit_globals(struct Program *prog) {
-  int ch = 0;
-  int i = 0;
+// Second operand of a binary op: a register, or 0 after printing "#imm"
+int ir_operand_b(int i, int encodable) {
+  if (ir_bimm[i] == 0) return ir_use(ir_b[i], 17);
+  if (encodable) return 0;
+  ir_emit_imm(17, ir_imm[i]);
+  return 17;
+}
+
+int ir_emit_binop(int *mn, int i, int rd, int ra, int rb) {
+  int w = ir_w[i];
+  emit_s("\t"); emit_s(mn); emit_s("\t"); ir_emit_reg(rd, w); emit_s(", "); ir_emit_reg(ra, w); emit_s(", ");
+  if (rb == 0) {
+    long k = ir_imm[i];
+    int op = ir_op[i];
+    emit_s("#");
+    if (op == IR_AND || op == IR_OR || op == IR_XOR) {
+      if (w) { k = k & low_bits(32); }
+      emit_hex(k);
+    } else {
+      emit_num(k);
+    }
+  } else {
+    ir_emit_reg(rb, w);
+    if (ir_sh[i] > 0) { emit_s(", lsl #"); emit_num(ir_sh[i]); }
+  }
+  emit_ch('\n');
+  return 0;
+}
+
+int *ir_load_mn(int size, int sgn, int unscaled) {
+  if (size == 1) {
+    if (sgn) { if (unscaled) return "ldursb"; return "ldrsb"; }
+    if (unscaled) return "ldurb";
+    return "ldrb";
+  }
+  if (size == 2) {
+    if (sgn) { if (unscaled) return "ldursh"; return "ldrsh"; }
+    if (unscaled) return "ldurh";
+    return "ldrh";
+  }
+  if (size == 4 && sgn) {
+    if (unscaled) return "ldursw";
+    return "ldrsw";
+  }
+  if (unscaled) return "ldur";
+  return "ldr";
+}
+
+int *ir_store_mn(int size, int unscaled) {
+  if (size == 1) { if (unscaled) return "sturb"; return "strb"; }
+  if (size == 2) { if (unscaled) return "sturh"; return "strh"; }
+  if (unscaled) return "stur";
+  return "str";
+}
+
+// Load or store with the value in xr
+int ir_emit_mem(int i, int r) {
+  int size = ir_size[i];
+  int is_load = (ir_op[i] == IR_LOAD);
+  // 32-bit register unless the access sign-extends to 64 bits or is 8 bytes
+  int w = (size < 8);
+  if (is_load && ir_sgn[i] && size < 8) { w = 0; }
+  int base = 29;
+  if (ir_a[i] != 0) { base = ir_use(ir_a[i], 16); }
+  long off = ir_imm[i];
+  int unscaled = 0;
+  int idx = 0;
+  if (ir_b[i] != 0) {
+    idx = ir_use(ir_b[i], 17);
+  } else if (off < 0 || off % size != 0 || off / size > 4095) {
+    if (off >= 0 - 256 && off <= 255) {
+      unscaled = 1;
+    } else {
+      ir_emit_imm(17, off);
+      idx = 17;
+    }
+  }
+  emit_s("\t");
+  if (is_load) { emit_s(ir_load_mn(size, ir_sgn[i], unscaled)); }
+  else { emit_s(ir_store_mn(size, unscaled)); }
+  emit_s("\t"); ir_emit_reg(r, w); emit_s(", [x"); emit_num(base);
+  if (idx > 0) {
+    emit_s(", x"); emit_num(idx);
+    if (ir_b[i] != 0 && ir_sh[i] > 0) { emit_s(", lsl #"); emit_num(ir_sh[i]); }
+  } else if (off != 0) {
+    emit_s(", #"); emit_num(off);
+  }
+  emit_line("]");
+  return 0;
+}
+
+int ir_emit_call(int i) {
+  int n = ir_nargs[i];
+  int vnp = ir_imm[i];
+  int nreg = n;
+  int space = 0;
   int k = 0;
-#ifdef __STDC__
-  int fsi = 0;
-#endif
-  struct GDecl *gd = 0;
-  // Emit global variables
-  if (prog->nglobals > 0) {
-    int has_data = 0;
-    i = 0;
-    while (i < prog->nglobals) {
-      gd = prog->globals[i];
-      if (gd == 0 || gd < 4096) { i++; continue; }
-      if (gd->array_size >= 0 && gd->init_list != 0 && gd->init_list->kind == ND_INITLIST) {
-        // Initialized array: emit .data with .quad per element
-        // Build a flat array of Expr* slots to handle designated initializers
-        int nf_per_elem = 1;
-        if (gd->stype != 0 && gd->is_ptr == 0) { nf_per_elem = cg_struct_nfields(gd->stype); }
-        int total_slots = gd->array_size * nf_per_elem;
-        // Build char-array-slot map for struct arrays (before flattening)
-        int *ca_slot_map = 0;
-        int *ca_slot_byte_off = 0;
-        if (gd->stype != 0 && gd->is_ptr == 0 && nf_per_elem > 0) {
-          ca_slot_map = my_malloc(nf_per_elem * 8);
-          ca_slot_byte_off = my_malloc(nf_per_elem * 8);
-          int csm = 0;
-          while (csm < nf_per_elem) { ca_slot_map[csm] = 0; ca_slot_byte_off[csm] = 0; csm++; }
-          int *resolved_s = cg_resolve_sname(gd->stype);
-          int sci = 0;
-          while (sci < ncg_s) {
-            if (cg_sname[sci] != 0 && my_strcmp(cg_sname[sci], resolved_s) == 0) {
-              int slot_pos = 0;
-              int fj = 0;
-              while (fj < cg_snfields[sci]) {
-                int f_slots = 1;
-                if (cg_sfield_types[sci][fj] != 0) {
-                  f_slots = cg_struct_nfields(cg_sfield_types[sci][fj]);
-                }
-                if (cg_s_fa[sci] != 0 && cg_s_fa[sci][fj] > 0) {
-                  if (cg_s_fc[sci] != 0 && cg_s_fc[sci][fj]) {
-                    int ca_nslots = (cg_s_fa[sci][fj] + 7) / 8;
-                    int csi = 0;
-                    while (csi < ca_nslots && (slot_pos + csi) < nf_per_elem) {
-                      ca_slot_map[slot_pos + csi] = cg_s_fa[sci][fj];
-                      ca_slot_byte_off[slot_pos + csi] = csi * 8;
-                      csi++;
-                    }
-                    f_slots = ca_nslots;
-                  } else {
-                    f_slots = f_slots * cg_s_fa[sci][fj];
-                  }
-                }
-                slot_pos += f_slots;
-                fj++;
-              }
-              break;
-            }
-            sci++;
-          }
-        }
-        struct Expr **flat = my_malloc(total_slots * 8);
-        int fsi = 0;
-        while (fsi < total_slots) { flat[fsi] = 0; fsi++; }
-        int **g_di = gd->init_list->desig;
-        int g_pos_idx = 0;
-        k = 0;
-        while (k < gd->init_list->nargs) {
-          int g_target = g_pos_idx;
-          if (g_di != 0 && g_di[k] >= 0) { g_target = g_di[k]; }
-          struct Expr *elem = gd->init_list->args[k];
-          if (elem->kind == ND_INITLIST) {
-            int si = 0;
-            int flat_base = g_target * nf_per_elem;
-            int flat_off = 0;
-            while (si < elem->nargs && flat_base + flat_off < total_slots) {
-              flat[flat_base + flat_off] = elem->args[si];
-              // If this slot starts a multi-slot char array, fill remaining slots with same string
-              if (ca_slot_map != 0 && ca_slot_map[flat_off] > 0) {
-                int ca_nsl = (ca_slot_map[flat_off] + 7) / 8;
-                int csi2 = 1;
-                while (csi2 < ca_nsl && flat_base + flat_off + csi2 < total_slots) {
-                  flat[flat_base + flat_off + csi2] = elem->args[si];
-                  csi2++;
-                }
-                flat_off += ca_nsl;
-              } else {
-                flat_off++;
-              }
-              si++;
-            }
-            g_pos_idx = g_target + 1;
-          } else if (elem->kind == ND_STRLIT && gd->is_char && gd->is_ptr == 0) {
-            // char array initialized with string: expand bytes into slots
-            int *decoded = cg_decode_string(elem->sval);
-            int slen = my_strlen(decoded) + 1;
-            int sc = 0;
-            int flat_base = g_target * nf_per_elem;
-            while (sc < slen && flat_base + sc < total_slots) {
-              struct Expr *byte_e = my_malloc(80);
-              byte_e->kind = ND_NUM;
-              byte_e->ival = __read_byte(decoded, sc);
-              flat[flat_base + sc] = byte_e;
-              sc++;
-            }
-            g_pos_idx = g_target + 1;
-          } else {
-            int flat_idx = g_target * nf_per_elem;
-            if (flat_idx < total_slots) { flat[flat_idx] = elem; }
-            g_pos_idx = g_target + 1;
-          }
-          k++;
+  if (vnp >= 0 && vnp < nreg) { nreg = vnp; }
+  if (nreg > arg_regs) { nreg = arg_regs; }
+  if (n > nreg) {
+    space = (((n - nreg) * 8 + 15) / 16) * 16;
+    emit_s("\tsub\tsp, sp, #"); emit_num(space); emit_ch('\n');
+    k = nreg;
+    while (k < n) {
+      int ra = ir_use(ir_args[ir_argi[i] + k], 16);
+      emit_s("\tstr\tx"); emit_num(ra); emit_s(", [sp, #"); emit_num((k - nreg) * 8); emit_line("]");
+      k++;
+    }
+  }
+  k = 0;
+  while (k < nreg) {
+    int v = ir_args[ir_argi[i] + k];
+    if (ir_preg[v] > 0) {
+      emit_s("\tmov\tx"); emit_num(k); emit_s(", x"); emit_num(ir_preg[v]); emit_ch('\n');
+    } else {
+      ir_use(v, k);
+    }
+    k++;
+  }
+  if (cg_variadic_nparams(ir_sym[i]) >= 0) { cg_vector_count(0); }
+  emit_sym_line("\tbl\t", ir_sym[i]);
+  if (space > 0) { emit_s("\tadd\tsp, sp, #"); emit_num(space); emit_ch('\n'); }
+  int rd = ir_def(ir_dst[i]);
+  if (ir_sgn[i]) {
+    emit_s("\tsxtw\tx"); emit_num(rd); emit_line(", w0");
+  } else {
+    emit_s("\tmov\tx"); emit_num(rd); emit_line(", x0");
+  }
+  ir_def_done(ir_dst[i]);
+  return 0;
+}
+
+int ir_emit_ext(int i, int rd, int ra) {
+  int size = ir_size[i];
+  if (size == 1 || size == 2) {
+    if (ir_sgn[i]) {
+      if (size == 1) { emit_s("\tsxtb\tx"); } else { emit_s("\tsxth\tx"); }
+      emit_num(rd); emit_s(", w"); emit_num(ra); emit_ch('\n');
+    } else {
+      emit_s("\tand\tx"); emit_num(rd); emit_s(", x"); emit_num(ra);
+      if (size == 1) { emit_line(", #255"); } else { emit_line(", #65535"); }
+    }
+  } else if (size == 4) {
+    if (ir_sgn[i]) { emit_s("\tsxtw\tx"); emit_num(rd); emit_s(", w"); }
+    else { emit_s("\tmov\tw"); emit_num(rd); emit_s(", w"); }
+    emit_num(ra); emit_ch('\n');
+  } else if (rd != ra) {
+    emit_s("\tmov\tx"); emit_num(rd); emit_s(", x"); emit_num(ra); emit_ch('\n');
+  }
+  return 0;
+}
+
+int ir_emit_switch(int i) {
+  int n = ir_nargs[i];
+  int *vals = my_malloc((n + 1) * 8);
+  int **labels = my_malloc((n + 1) * 8);
+  for (int k = 0; k < n; k++) {
+    vals[k] = ir_args[ir_argi[i] + 2 * k];
+    labels[k] = ir_label_name(ir_args[ir_argi[i] + 2 * k + 1]);
+  }
+  // A spilled value is reloaded into x8, leaving x16/x17 as scratch
+  int ra = ir_use(ir_a[i], 8);
+  cg_emit_switch(build_str2("x", int_to_str(ra)), vals, labels, n, ir_label_name(ir_lab[i]), "x16", "w16", "x17");
+  return 0;
+}
+
+int ir_emit_insn(int i, int *ret_label) {
+  int op = ir_op[i];
+  int rd = 0;
+  int ra = 0;
+  int rb = 0;
+  if (op == IR_LABEL) {
+    emit_s(ir_label_name(ir_lab[i])); emit_line(":");
+    return 0;
+  }
+  if (op == IR_JMP) {
+    emit_s("\tb\t"); emit_line(ir_label_name(ir_lab[i]));
+    return 0;
+  }
+  if (op == IR_BR) {
+    ir_emit_cmp(i);
+    emit_s("\tb."); emit_s(ir_cc_name(ir_cc[i])); emit_s("\t"); emit_line(ir_label_name(ir_lab[i]));
+    return 0;
+  }
+  if (op == IR_SWITCH) return ir_emit_switch(i);
+  if (op == IR_BZ || op == IR_BNZ) {
+    ra = ir_use(ir_a[i], 16);
+    if (ir_bimm[i]) {
+      // tbz reaches only +-32KB, so far targets test with tst
+      int dist = ir_label_pos[ir_lab[i]] - i;
+      if (dist > 0 - 256 && dist < 256) {
+        if (op == IR_BZ) { emit_s("\ttbz\t"); } else { emit_s("\ttbnz\t"); }
+        ir_emit_reg(ra, 0); emit_s(", #"); emit_num(ir_imm[i]);
+        emit_s(", "); emit_line(ir_label_name(ir_lab[i]));
+        return 0;
+      }
+      emit_s("\ttst\t"); ir_emit_reg(ra, 0); emit_s(", #"); emit_num(1 << ir_imm[i]); emit_ch('\n');
+      if (op == IR_BZ) { emit_s("\tb.eq\t"); } else { emit_s("\tb.ne\t"); }
+      emit_line(ir_label_name(ir_lab[i]));
+      return 0;
+    }
+    if (op == IR_BZ) { emit_s("\tcbz\t"); } else { emit_s("\tcbnz\t"); }
+    ir_emit_reg(ra, ir_w[i]); emit_s(", "); emit_line(ir_label_name(ir_lab[i]));
+    return 0;
+  }
+  if (op == IR_RET) {
+    if (ir_preg[ir_a[i]] > 0) {
+      emit_s("\tmov\tx0, x"); emit_num(ir_preg[ir_a[i]]); emit_ch('\n');
+    } else {
+      ir_use(ir_a[i], 0);
+    }
+    if (i + 1 < nir) { emit_s("\tb\t"); emit_line(ret_label); }
+    return 0;
+  }
+  if (op == IR_STORE) {
+    ir_emit_mem(i, ir_use(ir_c[i], 8));
+    return 0;
+  }
+  if (op == IR_CALL) return ir_emit_call(i);
+  rd = ir_def(ir_dst[i]);
+  if (op == IR_IMM) {
+    ir_emit_imm(rd, ir_imm[i]);
+  } else if (op == IR_PARAM) {
+    emit_s("\tmov\tx"); emit_num(rd); emit_s(", x"); emit_num(ir_imm[i]); emit_ch('\n');
+  } else if (op == IR_FRAME) {
+    ir_emit_frame_addr(rd, ir_imm[i]);
+  } else if (op == IR_ADDR) {
+    int *pfx = sym_pfx;
+    if (ir_cc[i] == 2) { pfx = ""; }
+    emit_sym_addr(build_str2("x", int_to_str(rd)), pfx, ir_sym[i], ir_cc[i] == 1);
+  } else if (op == IR_LOAD) {
+    ir_emit_mem(i, rd);
+  } else if (op == IR_SET) {
+    ir_emit_cmp(i);
+    emit_s("\tcset\tw"); emit_num(rd); emit_s(", "); emit_line(ir_cc_name(ir_cc[i]));
+  } else {
+    ra = ir_use(ir_a[i], 16);
+    if (op == IR_MOV) {
+      if (rd != ra) { emit_s("\tmov\tx"); emit_num(rd); emit_s(", x"); emit_num(ra); emit_ch('\n'); }
+    } else if (op == IR_NEG) {
+      emit_s("\tneg\tx"); emit_num(rd); emit_s(", x"); emit_num(ra); emit_ch('\n');
+    } else if (op == IR_NOT) {
+      emit_s("\tmvn\tx"); emit_num(rd); emit_s(", x"); emit_num(ra); emit_ch('\n');
+    } else if (op == IR_EXT) {
+      ir_emit_ext(i, rd, ra);
+    } else if (op == IR_ADD || op == IR_SUB) {
+      int *mn = "add";
+      if (op == IR_SUB) { mn = "sub"; }
+      if (ir_bimm[i] && ir_imm[i] < 0 && ir_imm[i] >= 0 - 16777215) {
+        // x + -k is x - k
+        ir_imm[i] = 0 - ir_imm[i];
+        if (op == IR_SUB) { mn = "add"; } else { mn = "sub"; }
+      }
+      long k = ir_imm[i];
+      if (ir_bimm[i] && k > 4095 && k <= 16777215) {
+        // High 12 bits as a shifted immediate, then the low 12 bits
+        int w = ir_w[i];
+        emit_s("\t"); emit_s(mn); emit_s("\t"); ir_emit_reg(rd, w); emit_s(", "); ir_emit_reg(ra, w);
+        emit_s(", #"); emit_num(k >> 12); emit_line(", lsl #12");
+        if ((k & 4095) != 0) {
+          emit_s("\t"); emit_s(mn); emit_s("\t"); ir_emit_reg(rd, w); emit_s(", "); ir_emit_reg(rd, w);
+          emit_s(", #"); emit_num(k & 4095); emit_ch('\n');
         }
-        if (has_data == 0) { emit_ch('\n'); emit_line("\t.data"); has_data = 1; }
-        if (gd->is_static == 0) { emit_s("\t.globl\t_"); emit_line(gd->name); }
-        int gd_is_char_arr = (gd->is_char && gd->is_ptr == 0);
-        int gd_esz = 8;
-        if (gd_is_char_arr) { gd_esz = 1; }
+      } else {
+        rb = ir_operand_b(i, k >= 0 && k <= 4095);
+        ir_emit_binop(mn, i, rd, ra, rb);
+      }
+    } else if (op == IR_MUL && ir_bimm[i] && cg_emit_mul_const(rd, ra, ir_imm[i], ir_w[i], 1)) {
+      // Shifts and adds
+    } else if ((op == IR_DIV || op == IR_REM) && ir_bimm[i] &&
+               cg_emit_div_const(rd, ra, ir_imm[i], ir_w[i], ir_sgn[i], op == IR_REM, 1)) {
+      // Shifts, masks or a multiply-high
+    } else if (op == IR_MUL) {
+      ir_emit_binop("mul", i, rd, ra, ir_operand_b(i, 0));
+    } else if (op == IR_DIV) {
+      if (ir_sgn[i]) { ir_emit_binop("sdiv", i, rd, ra, ir_operand_b(i, 0)); }
+      else { ir_emit_binop("udiv", i, rd, ra, ir_operand_b(i, 0)); }
+    } else if (op == IR_REM) {
+      int w = ir_w[i];
+      rb = ir_operand_b(i, 0);
+      if (ir_sgn[i]) { emit_s("\tsdiv\t"); } else { emit_s("\tudiv\t"); }
+      ir_emit_reg(8, w); emit_s(", "); ir_emit_reg(ra, w); emit_s(", "); ir_emit_reg(rb, w); emit_ch('\n');
+      emit_s("\tmsub\t"); ir_emit_reg(rd, w); emit_s(", "); ir_emit_reg(8, w); emit_s(", ");
+      ir_emit_reg(rb, w); emit_s(", "); ir_emit_reg(ra, w); emit_ch('\n');
+    } else if (op == IR_AND || op == IR_OR || op == IR_XOR) {
+      int *lmn = "and";
+      if (op == IR_OR) { lmn = "orr"; }
+      if (op == IR_XOR) { lmn = "eor"; }
+      ir_emit_binop(lmn, i, rd, ra, ir_operand_b(i, is_logical_imm(ir_imm[i], ir_w[i])));
+    } else if (op == IR_SHL) {
+      ir_emit_binop("lsl", i, rd, ra, ir_operand_b(i, 1));
+    } else if (op == IR_SHR) {
+      if (ir_sgn[i]) { ir_emit_binop("asr", i, rd, ra, ir_operand_b(i, 1)); }
+      else { ir_emit_binop("lsr", i, rd, ra, ir_operand_b(i, 1)); }
+    }
+    // The 32-bit forms zero the upper half; a signed int result has to
+    // stay sign-extended like every other, or it is wrong once read as a long
+    if ((op == IR_DIV || op == IR_REM || op == IR_SHR) && ir_w[i] && ir_sgn[i]) {
+      emit_s("\tsxtw\tx"); emit_num(rd); emit_s(", w"); emit_num(rd); emit_ch('\n');
+    }
+  }
+  ir_def_done(ir_dst[i]);
+  return 0;
+}
+
+// Emit the allocated body; returns 1 when control can fall off the end
+int ir_emit(int *ret_label) {
+  for (int i = 0; i < nir; i++) {
+    ir_emit_insn(i, ret_label);
+  }
+  if (nir == 0) return 1;
+  return ir_op[nir - 1] != IR_RET && ir_op[nir - 1] != IR_JMP && ir_op[nir - 1] != IR_SWITCH;
+}
+
+// Lower, optimize and allocate f; 0 sends it down the AST path instead
+int ir_gen_func(struct FuncDef *f) {
+  if (ir_lower_func(f) == 0) return 0;
+  ir_optimize();
+  ir_regalloc();
+  return 1;
+}
+
+// ---- Peephole ----
+// While a function is emitted emit_ch records where its lines end; a table
+// of rules then rewrites adjacent instructions and, if anything changed,
+// the survivors are emitted again. Labels and directives are never moved or
+// removed.
+
+enum { PEEP_PUSH_POP, PEEP_ZERO_STORE, PEEP_UNREACHABLE, PEEP_JUMP_NEXT,
+       PEEP_STORE_RELOAD, PEEP_COPY_BACK, PEEP_SELF_MOVE, PEEP_NRULES };
+
+// Mnemonics the rules look at; everything else is PO_OTHER
+enum { PO_OTHER, PO_STR, PO_STRB, PO_STRH, PO_LDR, PO_LDRSW, PO_LDRB, PO_LDRH,
+       PO_MOV, PO_B, PO_BR, PO_RET };
+
+enum { PEEP_NOREG = 0 - 1, PEEP_IMM0 = 0 - 2 };
+
+int peep_removed[PEEP_NRULES];    // instructions removed per rule
+int peep_rewritten[PEEP_NRULES];  // instructions replaced by cheaper ones
+
+int *peep_src;
+int peep_srccap;
+int peep_start[MAX_PEEP_LINES];
+int peep_len[MAX_PEEP_LINES];
+int peep_kind[MAX_PEEP_LINES];    // 0 instruction, 1 label, 2 anything else
+int peep_opc[MAX_PEEP_LINES];
+int peep_a1s[MAX_PEEP_LINES];     // first operand (label name) in outbuf
+int peep_a1e[MAX_PEEP_LINES];
+int peep_rs[MAX_PEEP_LINES];      // remaining operands in outbuf, -1 once rewritten
+int peep_r1[MAX_PEEP_LINES];      // first operand register, or PEEP_NOREG
+int peep_w1[MAX_PEEP_LINES];
+int peep_r2[MAX_PEEP_LINES];      // sole second operand: register, PEEP_IMM0 or PEEP_NOREG
+int peep_w2[MAX_PEEP_LINES];
+int *peep_text[MAX_PEEP_LINES];   // replacement text, or 0
+int peep_dead[MAX_PEEP_LINES];
+int npeep;
+int peep_changed;
+
+int *peep_rule_name(int r) {
+  if (r == PEEP_PUSH_POP) return "push-pop";
+  if (r == PEEP_ZERO_STORE) return "zero-store";
+  if (r == PEEP_UNREACHABLE) return "unreachable";
+  if (r == PEEP_JUMP_NEXT) return "jump-to-next";
+  if (r == PEEP_STORE_RELOAD) return "store-reload";
+  if (r == PEEP_COPY_BACK) return "copy-back";
+  return "self-move";
+}
+
+int peep_is_word(int c) {
+  return is_alnum(c) || c == '_';
+}
+
+// Register number of outbuf[s, e) when it is exactly xN or wN
+int peep_reg(int s, int e) {
+  int c = __read_byte(outbuf, s);
+  if (e - s < 2 || e - s > 3 || (c != 'x' && c != 'w')) return PEEP_NOREG;
+  int n = 0;
+  for (int k = s + 1; k < e; k++) {
+    c = __read_byte(outbuf, k);
+    if (c < '0' || c > '9') return PEEP_NOREG;
+    n = n * 10 + c - '0';
+  }
+  return n;
+}
+
+// Does outbuf[s, e) name register n in either width?
+int peep_mentions(int s, int e, int n) {
+  int prev = 0;
+  for (int i = s; i < e; i++) {
+    int c = __read_byte(outbuf, i);
+    if ((c == 'x' || c == 'w') && peep_is_word(prev) == 0 && i + 1 < e && is_digit(__read_byte(outbuf, i + 1))) {
+      int v = 0;
+      int k = i + 1;
+      while (k < e && is_digit(__read_byte(outbuf, k))) { v = v * 10 + __read_byte(outbuf, k) - '0'; k++; }
+      if (v == n && (k == e || peep_is_word(__read_byte(outbuf, k)) == 0)) return 1;
+    }
+    prev = c;
+  }
+  return 0;
+}
+
+// Does outbuf[p, p + n) spell lit?
+int peep_spells(int p, int n, int *lit) {
+  for (int k = 0; k < n; k++) {
+    if (__read_byte(outbuf, p + k) != __read_byte(lit, k)) return 0;
+  }
+  return __read_byte(lit, n) == 0;
+}
+
+int peep_same(int s1, int e1, int s2, int e2) {
+  if (e1 - s1 != e2 - s2) return 0;
+  for (int k = 0; k < e1 - s1; k++) {
+    if (__read_byte(outbuf, s1 + k) != __read_byte(outbuf, s2 + k)) return 0;
+  }
+  return 1;
+}
+
+int peep_classify(int p, int n) {
+  int c = __read_byte(outbuf, p);
+  if (c == 's') {
+    if (peep_spells(p, n, "str")) return PO_STR;
+    if (peep_spells(p, n, "strb")) return PO_STRB;
+    if (peep_spells(p, n, "strh")) return PO_STRH;
+  } else if (c == 'l') {
+    if (peep_spells(p, n, "ldr")) return PO_LDR;
+    if (peep_spells(p, n, "ldrsw")) return PO_LDRSW;
+    if (peep_spells(p, n, "ldrb")) return PO_LDRB;
+    if (peep_spells(p, n, "ldrh")) return PO_LDRH;
+  } else if (c == 'm') {
+    if (peep_spells(p, n, "mov")) return PO_MOV;
+  } else if (c == 'b') {
+    if (n == 1) return PO_B;
+    if (peep_spells(p, n, "br")) return PO_BR;
+  } else if (c == 'r') {
+    if (peep_spells(p, n, "ret")) return PO_RET;
+  }
+  return PO_OTHER;
+}
+
+int peep_scan(int li, int s, int e) {
+  peep_start[li] = s;
+  peep_len[li] = e - s;
+  peep_text[li] = 0;
+  peep_dead[li] = 0;
+  peep_opc[li] = PO_OTHER;
+  peep_kind[li] = 2;
+  peep_r1[li] = PEEP_NOREG;
+  peep_r2[li] = PEEP_NOREG;
+  peep_rs[li] = 0 - 1;
+  if (s == e) return 0;
+  if (__read_byte(outbuf, s) != '\t') {
+    if (__read_byte(outbuf, e - 1) == ':') {
+      peep_kind[li] = 1;
+      peep_a1s[li] = s;
+      peep_a1e[li] = e - 1;
+    }
+    return 0;
+  }
+  if (__read_byte(outbuf, s + 1) == '.') return 0;
+  peep_kind[li] = 0;
+  int p = s + 1;
+  while (p < e && __read_byte(outbuf, p) != '\t') { p++; }
+  int opc = peep_classify(s + 1, p - s - 1);
+  peep_opc[li] = opc;
+  if (opc == PO_OTHER || p >= e) return 0;
+  p++;
+  // The first operand ends at the first comma outside brackets
+  int q = p;
+  int depth = 0;
+  while (q < e && (depth > 0 || __read_byte(outbuf, q) != ',')) {
+    if (__read_byte(outbuf, q) == '[') { depth++; }
+    if (__read_byte(outbuf, q) == ']') { depth--; }
+    q++;
+  }
+  peep_a1s[li] = p;
+  peep_a1e[li] = q;
+  peep_r1[li] = peep_reg(p, q);
+  peep_w1[li] = __read_byte(outbuf, p) == 'w';
+  if (q + 2 > e) return 0;
+  peep_rs[li] = q + 2;
+  peep_r2[li] = peep_reg(q + 2, e);
+  peep_w2[li] = __read_byte(outbuf, q + 2) == 'w';
+  if (peep_spells(q + 2, e - q - 2, "#0")) { peep_r2[li] = PEEP_IMM0; }
+  return 0;
+}
+
+int peep_next(int i) {
+  i++;
+  while (i < npeep && peep_dead[i]) { i++; }
+  return i;
+}
+
+int peep_is(int i, int opc) {
+  return i < npeep && peep_kind[i] == 0 && peep_opc[i] == opc;
+}
+
+int *peep_regname(int n, int w) {
+  if (w) return build_str2("w", int_to_str(n));
+  return build_str2("x", int_to_str(n));
+}
+
+// Replace line i by "op a1, rest" (rest may be 0)
+int peep_set(int i, int opc, int *op, int *a1, int *rest) {
+  int *t = build_str2("\t", op);
+  t = build_str2(t, "\t");
+  t = build_str2(t, a1);
+  if (rest != 0) {
+    t = build_str2(t, ", ");
+    t = build_str2(t, rest);
+  }
+  peep_text[i] = t;
+  peep_opc[i] = opc;
+  peep_rs[i] = 0 - 1;
+  peep_r1[i] = PEEP_NOREG;
+  peep_r2[i] = PEEP_NOREG;
+  peep_changed = 1;
+  return 0;
+}
+
+// Replace line i by "mov rd, rs" in the given width
+int peep_set_mov(int i, int rd, int rs, int w) {
+  peep_set(i, PO_MOV, "mov", peep_regname(rd, w), peep_regname(rs, w));
+  peep_r1[i] = rd;
+  peep_w1[i] = w;
+  peep_r2[i] = rs;
+  peep_w2[i] = w;
+  return 0;
+}
+
+int peep_kill(int i, int rule) {
+  peep_dead[i] = 1;
+  peep_removed[rule]++;
+  peep_changed = 1;
+  return 1;
+}
+
+// Instructions that write their first operand without reading it again
+int peep_pure_def(int *op) {
+  if (my_strcmp(op, "mov") == 0 || my_strcmp(op, "movz") == 0 || my_strcmp(op, "movn") == 0) return 1;
+  if (my_strcmp(op, "ldr") == 0 || my_strcmp(op, "ldrsw") == 0 || my_strcmp(op, "ldrb") == 0) return 1;
+  if (my_strcmp(op, "ldrh") == 0 || my_strcmp(op, "ldrsb") == 0 || my_strcmp(op, "ldrsh") == 0) return 1;
+  if (my_strcmp(op, "adrp") == 0 || my_strcmp(op, "adr") == 0 || my_strcmp(op, "cset") == 0) return 1;
+  if (my_strcmp(op, "add") == 0 || my_strcmp(op, "sub") == 0 || my_strcmp(op, "mul") == 0) return 1;
+  if (my_strcmp(op, "sdiv") == 0 || my_strcmp(op, "udiv") == 0 || my_strcmp(op, "neg") == 0) return 1;
+  if (my_strcmp(op, "and") == 0 || my_strcmp(op, "orr") == 0 || my_strcmp(op, "eor") == 0) return 1;
+  if (my_strcmp(op, "lsl") == 0 || my_strcmp(op, "lsr") == 0 || my_strcmp(op, "asr") == 0) return 1;
+  if (my_strcmp(op, "sxtw") == 0 || my_strcmp(op, "sxtb") == 0 || my_strcmp(op, "sxth") == 0) return 1;
+  if (my_strcmp(op, "uxtb") == 0 || my_strcmp(op, "uxth") == 0 || my_strcmp(op, "mvn") == 0) return 1;
+  return 0;
+}
+
+// Is register n dead on entry to instruction i?
+int peep_kills(int i, int n) {
+  if (i >= npeep || peep_kind[i] != 0 || peep_text[i] != 0) return 0;
+  int s = peep_start[i];
+  int e = s + peep_len[i];
+  int p = s + 1;
+  while (p < e && __read_byte(outbuf, p) != '\t') { p++; }
+  if (p >= e || peep_pure_def(make_str(outbuf, s + 1, p - s - 1)) == 0) return 0;
+  int q = p + 1;
+  while (q < e && __read_byte(outbuf, q) != ',') { q++; }
+  if (peep_reg(p + 1, q) != n) return 0;
+  return peep_mentions(q, e, n) == 0;
+}
+
+// str xA, [sp, #-16]! ; ldr xB, [sp], #16  ->  mov xB, xA
+int peep_push_pop(int i, int j) {
+  if (peep_opc[i] != PO_STR || peep_is(j, PO_LDR) == 0) return 0;
+  if (peep_r1[i] < 0 || peep_r1[j] < 0 || peep_w1[i] || peep_w1[j] || peep_rs[i] < 0 || peep_rs[j] < 0) return 0;
+  int ei = peep_start[i] + peep_len[i];
+  int ej = peep_start[j] + peep_len[j];
+  if (peep_spells(peep_rs[i], ei - peep_rs[i], "[sp, #-16]!") == 0) return 0;
+  if (peep_spells(peep_rs[j], ej - peep_rs[j], "[sp], #16") == 0) return 0;
+  if (peep_r1[i] == peep_r1[j]) {
+    peep_kill(i, PEEP_PUSH_POP);
+    return peep_kill(j, PEEP_PUSH_POP);
+  }
+  peep_set_mov(i, peep_r1[j], peep_r1[i], 0);
+  peep_rewritten[PEEP_PUSH_POP]++;
+  return peep_kill(j, PEEP_PUSH_POP);
+}
+
+// mov rA, #0 ; str rA, [m] with rA dead afterwards  ->  str xzr, [m]
+int peep_zero_store(int i, int j) {
+  if (peep_opc[i] != PO_MOV || peep_r2[i] != PEEP_IMM0) return 0;
+  if (peep_is(j, PO_STR) == 0 && peep_is(j, PO_STRB) == 0 && peep_is(j, PO_STRH) == 0) return 0;
+  int n = peep_r1[i];
+  if (n < 0 || peep_r1[j] != n || peep_rs[j] < 0) return 0;
+  int ej = peep_start[j] + peep_len[j];
+  if (peep_mentions(peep_rs[j], ej, n) || peep_kills(peep_next(j), n) == 0) return 0;
+  int *op = "str";
+  if (peep_opc[j] == PO_STRB) { op = "strb"; }
+  if (peep_opc[j] == PO_STRH) { op = "strh"; }
+  int *zr = "wzr";
+  if (peep_w1[j] == 0) { zr = "xzr"; }
+  peep_set(j, peep_opc[j], op, zr, make_str(outbuf, peep_rs[j], ej - peep_rs[j]));
+  return peep_kill(i, PEEP_ZERO_STORE);
+}
+
+// Nothing falls into the instructions after b/br/ret up to the next label
+int peep_unreachable(int i, int j) {
+  if (peep_opc[i] != PO_B && peep_opc[i] != PO_BR && peep_opc[i] != PO_RET) return 0;
+  if (j >= npeep || peep_kind[j] != 0) return 0;
+  while (j < npeep && peep_kind[j] == 0) {
+    peep_kill(j, PEEP_UNREACHABLE);
+    j = peep_next(j);
+  }
+  return 1;
+}
+
+// b L ; L:  ->  L:
+int peep_jump_next(int i, int j) {
+  if (peep_opc[i] != PO_B) return 0;
+  while (j < npeep && peep_kind[j] == 1) {
+    if (peep_same(peep_a1s[i], peep_a1e[i], peep_a1s[j], peep_a1e[j])) return peep_kill(i, PEEP_JUMP_NEXT);
+    j = peep_next(j);
+  }
+  return 0;
+}
+
+// str rA, [m] ; ldr rB, [m]  ->  str rA, [m] ; mov rB, rA
+int peep_store_reload(int i, int j) {
+  if (peep_opc[i] != PO_STR && peep_opc[i] != PO_STRB && peep_opc[i] != PO_STRH) return 0;
+  if (j >= npeep || peep_kind[j] != 0) return 0;
+  int st = peep_opc[i];
+  int ld = peep_opc[j];
+  if (ld != PO_LDR && ld != PO_LDRSW && ld != PO_LDRB && ld != PO_LDRH) return 0;
+  int ra = peep_r1[i];
+  int rb = peep_r1[j];
+  if (ra < 0 || rb < 0 || peep_rs[i] < 0 || peep_rs[j] < 0) return 0;
+  int ei = peep_start[i] + peep_len[i];
+  int ej = peep_start[j] + peep_len[j];
+  // Pre/post-indexed forms move the base
+  if (__read_byte(outbuf, peep_rs[i]) != '[' || __read_byte(outbuf, ei - 1) != ']') return 0;
+  if (peep_same(peep_rs[i], ei, peep_rs[j], ej) == 0) return 0;
+  int wa = peep_w1[i];
+  int wb = peep_w1[j];
+  if (st == PO_STR && ld == PO_LDR && wa == wb) {
+    if (wa == 0 && ra == rb) return peep_kill(j, PEEP_STORE_RELOAD);
+    peep_set_mov(j, rb, ra, wa);
+  } else if (st == PO_STR && ld == PO_LDRSW && wa && wb == 0) {
+    peep_set(j, PO_OTHER, "sxtw", peep_regname(rb, 0), peep_regname(ra, 1));
+  } else if (st == PO_STRB && ld == PO_LDRB && wb) {
+    peep_set(j, PO_OTHER, "and", peep_regname(rb, 1), build_str2(peep_regname(ra, 1), ", #255"));
+  } else if (st == PO_STRH && ld == PO_LDRH && wb) {
+    peep_set(j, PO_OTHER, "and", peep_regname(rb, 1), build_str2(peep_regname(ra, 1), ", #65535"));
+  } else {
+    return 0;
+  }
+  peep_rewritten[PEEP_STORE_RELOAD]++;
+  return 1;
+}
+
+// mov xA, xB ; mov xB, xA  ->  mov xA, xB
+int peep_copy_back(int i, int j) {
+  if (peep_opc[i] != PO_MOV || peep_is(j, PO_MOV) == 0) return 0;
+  if (peep_r1[i] < 0 || peep_r2[i] < 0 || peep_w1[i] || peep_w2[i] || peep_w1[j] || peep_w2[j]) return 0;
+  if (peep_r1[i] != peep_r2[j] || peep_r2[i] != peep_r1[j]) return 0;
+  return peep_kill(j, PEEP_COPY_BACK);
+}
+
+// mov xA, xA (the w form zero-extends and has to stay)
+int peep_self_move(int i, int j) {
+  if (peep_opc[i] != PO_MOV || peep_r1[i] < 0 || peep_w1[i] || peep_w2[i]) return 0;
+  if (peep_r1[i] != peep_r2[i]) return 0;
+  return peep_kill(i, PEEP_SELF_MOVE);
+}
+
+// i is a live instruction, j the next live line
+int peep_apply(int r, int i, int j) {
+  if (r == PEEP_PUSH_POP) return peep_push_pop(i, j);
+  if (r == PEEP_ZERO_STORE) return peep_zero_store(i, j);
+  if (r == PEEP_UNREACHABLE) return peep_unreachable(i, j);
+  if (r == PEEP_JUMP_NEXT) return peep_jump_next(i, j);
+  if (r == PEEP_STORE_RELOAD) return peep_store_reload(i, j);
+  if (r == PEEP_COPY_BACK) return peep_copy_back(i, j);
+  return peep_self_move(i, j);
+}
+
+// Rewrite the function in outbuf[start, outlen)
+int peep_func(int start) {
+  if (npeep_line_end >= MAX_PEEP_LINES) return 0;
+  npeep = npeep_line_end;
+  int ls = start;
+  for (int li = 0; li < npeep; li++) {
+    peep_scan(li, ls, peep_line_end[li]);
+    ls = peep_line_end[li] + 1;
+  }
+  if (ls != outlen) return 0;
+
+  int any = 0;
+  peep_changed = 1;
+  while (peep_changed) {
+    peep_changed = 0;
+    for (int i = 0; i < npeep; i++) {
+      // Every rule starts at a store, a move or a branch
+      int opc = peep_opc[i];
+      if (peep_dead[i] || peep_kind[i] != 0 || opc == PO_OTHER || opc >= PO_LDR && opc <= PO_LDRH) continue;
+      int j = peep_next(i);
+      for (int r = 0; r < PEEP_NRULES && peep_dead[i] == 0; r++) {
+        if (peep_apply(r, i, j)) { j = peep_next(i); }
+      }
+    }
+    if (peep_changed) { any = 1; }
+  }
+  if (any == 0) return 0;
+
+  // Compact in place unless some replacement would overrun unread text
+  int w = start;
+  int fits = 1;
+  for (int li = 0; li < npeep && fits; li++) {
+    if (peep_dead[li]) continue;
+    if (peep_text[li] != 0) { w = w + my_strlen(peep_text[li]) + 1; }
+    else { w = w + peep_len[li] + 1; }
+    if (w > peep_start[li] + peep_len[li] + 1) { fits = 0; }
+  }
+  int *src = outbuf;
+  int off = 0;
+  if (fits == 0) {
+    int n = outlen - start;
+    if (n > peep_srccap) {
+      peep_srccap = n * 2;
+      peep_src = perm_malloc(peep_srccap);
+    }
+    for (int k = 0; k < n; k++) { __write_byte(peep_src, k, __read_byte(outbuf, start + k)); }
+    src = peep_src;
+    off = start;
+  }
+  outlen = start;
+  for (int li = 0; li < npeep; li++) {
+    if (peep_dead[li]) continue;
+    if (peep_text[li] != 0) {
+      emit_s(peep_text[li]);
+    } else if (fits) {
+      // Lines only move down, so copying forward is safe
+      int p0 = peep_start[li];
+      if (p0 != outlen) {
+        for (int k = 0; k < peep_len[li]; k++) { __write_byte(outbuf, outlen + k, __read_byte(outbuf, p0 + k)); }
+      }
+      outlen = outlen + peep_len[li];
+    } else {
+      int p = peep_start[li] - off;
+      for (int k = 0; k < peep_len[li]; k++) { emit_ch(__read_byte(src, p + k)); }
+    }
+    emit_ch('\n');
+  }
+  return 0;
+}
+
+int peep_print_report() {
+  for (int r = 0; r < PEEP_NRULES; r++) {
+    printf("peephole: %s: %d removed, %d rewritten\n", peep_rule_name(r), peep_removed[r], peep_rewritten[r]);
+  }
+  return 0;
+}
+
+// ---- Frames ----
+//
+// gen_func emits the body first and then picks the smallest frame that
+// still works: none for a leaf that never touches its frame, x29 without
+// the link register for other leaves, and with -fomit-frame-pointer
+// sp-relative slots in place of x29.
+
+int *frame_src;
+int frame_srccap;
+
+// Does evaluating e make a call?
+int cg_expr_calls(struct Expr *e) {
+  if (e == 0 || e < 4096) return 0;
+  int k = e->kind;
+  if (k == ND_CALL) return 1;
+  if (k == ND_INITLIST) {
+    for (int i = 0; i < e->nargs; i++) {
+      if (cg_expr_calls(e->args[i])) return 1;
+    }
+  } else if (k == ND_STMT_EXPR) {
+    struct Stmt *se_blk = e->left;
+    if (se_blk != 0 && se_blk->kind == ST_BLOCK) return cg_stmts_call(se_blk->body, se_blk->nbody);
+  } else if (k == ND_BINARY || k == ND_INDEX || k == ND_ASSIGN || k == ND_TERNARY) {
+    if (cg_expr_calls(e->left) || cg_expr_calls(e->right)) return 1;
+    if (k == ND_TERNARY) return cg_expr_calls(e->args[0]);
+  } else if (k == ND_UNARY || k == ND_CAST || k == ND_FIELD || k == ND_ARROW ||
+             k == ND_POSTINC || k == ND_POSTDEC || k == ND_COMPOUND_LIT) {
+    return cg_expr_calls(e->left);
+  }
+  return 0;
+}
+
+int cg_stmts_call(struct Stmt **stmts, int n) {
+  for (int i = 0; i < n; i++) {
+    struct Stmt *st = stmts[i];
+    if (st == 0 || st < 4096 || st == (0 - 1)) continue;
+    int k = st->kind;
+    if (cg_expr_calls(st->expr)) return 1;
+    if (k == ST_VARDECL) {
+      for (int j = 0; j < st->ndecls; j++) {
+        if (cg_expr_calls(st->decls[j]->init)) return 1;
+      }
+    } else if (k == ST_IF) {
+      if (cg_stmts_call(st->body, st->nbody)) return 1;
+      if (st->body2 != 0 && cg_stmts_call(st->body2, st->nbody2)) return 1;
+    } else if (k == ST_FOR) {
+      if (st->init != 0) {
+        struct Stmt *arr[1];
+        arr[0] = st->init;
+        if (cg_stmts_call(arr, 1)) return 1;
+      }
+      if (cg_expr_calls(st->expr2)) return 1;
+      if (cg_stmts_call(st->body, st->nbody)) return 1;
+    } else if (k == ST_SWITCH) {
+      for (int ci = 0; ci < st->ncases; ci++) {
+        if (cg_stmts_call(st->case_bodies[ci], st->case_nbodies[ci])) return 1;
+      }
+      if (st->default_body != 0 && cg_stmts_call(st->default_body, st->ndefault)) return 1;
+    } else if (k == ST_WHILE || k == ST_DOWHILE || k == ST_BLOCK || k == ST_LABEL) {
+      if (cg_stmts_call(st->body, st->nbody)) return 1;
+    }
+  }
+  return 0;
+}
+
+// A leaf never calls, so x30 survives the whole body
+int cg_func_is_leaf(struct FuncDef *f) {
+  return cg_stmts_call(f->body, f->nbody) == 0;
+}
+
+// Position of register r as a whole word in buf[s, e), or -1
+int frame_find_reg(int *buf, int s, int e, int *r) {
+  int n = my_strlen(r);
+  int c0 = __read_byte(r, 0);
+  for (int p = s; p + n <= e; p++) {
+    if (__read_byte(buf, p) != c0) continue;
+    if (p > s && peep_is_word(__read_byte(buf, p - 1))) continue;
+    if (p + n < e && peep_is_word(__read_byte(buf, p + n))) continue;
+    int k = 0;
+    while (k < n && __read_byte(buf, p + k) == __read_byte(r, k)) { k++; }
+    if (k == n) return p;
+  }
+  return 0 - 1;
+}
+
+// Unsigned decimal at buf[p, e); frame_num_end is left just past it
+int frame_num_end;
+int frame_num(int *buf, int p, int e) {
+  int v = 0;
+  frame_num_end = p;
+  while (frame_num_end < e && __read_byte(buf, frame_num_end) >= '0' && __read_byte(buf, frame_num_end) <= '9') {
+    v = v * 10 + __read_byte(buf, frame_num_end) - '0';
+    frame_num_end++;
+  }
+  if (frame_num_end == p || frame_num_end - p > 6) return 0 - 1;
+  return v;
+}
+
+// Rewrite one body line of buf[s, e) from x29 to sp, where the old x29 is
+// sp + size and the caller's sp is sp + size + hdr. With emit 0 only
+// report whether the line can be rewritten.
+int frame_sp_line(int *buf, int s, int e, int size, int hdr, int emit) {
+  if (frame_find_reg(buf, s, e, "sp") >= 0) return 0;
+  int p = frame_find_reg(buf, s, e, "x29");
+  if (p < 0) {
+    if (emit) { for (int k = s; k < e; k++) { emit_ch(__read_byte(buf, k)); } }
+    return 1;
+  }
+  if (frame_find_reg(buf, p + 3, e, "x29") >= 0) return 0;
+  int q = p + 3;
+  if (q + 3 > e || __read_byte(buf, q) != ',' || __read_byte(buf, q + 1) != ' ' || __read_byte(buf, q + 2) != '#') return 0;
+  q = q + 3;
+  int mem = p > s && __read_byte(buf, p - 1) == '[';
+  int c1 = __read_byte(buf, s + 1);
+  int c2 = __read_byte(buf, s + 2);
+  int c3 = __read_byte(buf, s + 3);
+  int down = 0;
+  if (mem) {
+    if (q < e && __read_byte(buf, q) == '-') { down = 1; q++; }
+  } else {
+    // sub xN, x29, #off / add xN, x29, #off
+    if (__read_byte(buf, s) != '\t' || __read_byte(buf, s + 4) != '\t') return 0;
+    if (p < s + 7 || __read_byte(buf, p - 2) != ',' || __read_byte(buf, p - 1) != ' ') return 0;
+    if (c1 == 's' && c2 == 'u' && c3 == 'b') { down = 1; }
+    else if (c1 != 'a' || c2 != 'd' || c3 != 'd') return 0;
+  }
+  int v = frame_num(buf, q, e);
+  if (v < 0) return 0;
+  int m = size - v;
+  if (down == 0) {
+    if (v < 16) return 0;  // the saved x29 and x30
+    m = size + hdr + v - 16;
+  }
+  if (m < 0) return 0;
+  if (mem) {
+    // Pre-index forms stay out of it
+    if (frame_num_end + 1 != e || __read_byte(buf, frame_num_end) != ']') return 0;
+    if ((c1 == 'l' || c1 == 's') && c3 == 'p') {
+      if (m % 8 != 0 || m > 504) return 0;
+    } else if (c3 == 'u') {
+      if (m > 255) return 0;  // ldur/stur only have the unscaled form
+    } else if (m > 255 && (m % 8 != 0 || m > 4095)) {
+      return 0;
+    }
+    if (emit) {
+      for (int k = s; k < p; k++) { emit_ch(__read_byte(buf, k)); }
+      emit_s("sp, #"); emit_num(m); emit_ch(']');
+    }
+    return 1;
+  }
+  if (frame_num_end != e || m > 4095) return 0;
+  if (emit) {
+    emit_s("\tadd\t");
+    for (int k = s + 5; k < p; k++) { emit_ch(__read_byte(buf, k)); }
+    emit_s("sp, #"); emit_num(m);
+  }
+  return 1;
+}
+
+// Can every line of outbuf[s, outlen) address the frame through sp?
+int frame_sp_ok(int s, int size, int hdr) {
+  int ls = s;
+  for (int p = s; p < outlen; p++) {
+    if (__read_byte(outbuf, p) != '\n') continue;
+    if (frame_sp_line(outbuf, ls, p, size, hdr, 0) == 0) return 0;
+    ls = p + 1;
+  }
+  return 1;
+}
+
+int frame_adjust_sp(int *op, int total) {
+  if (total <= 0) return 0;
+  if (total <= 4095) {
+    emit_s("\t"); emit_s(op); emit_s("\tsp, sp, #"); emit_num(total); emit_ch('\n');
+  } else {
+    emit_mov_imm("x9", total);
+    emit_s("\t"); emit_s(op); emit_line("\tsp, sp, x9");
+  }
+  return 0;
+}
+
+// Index of the first recorded line end at or after pos
+int frame_line_index(int pos) {
+  int i = npeep_line_end;
+  while (i > 0 && peep_line_end[i - 1] >= pos) { i--; }
+  return i;
+}
+
+// Move the lines emitted at outbuf[from, outlen) up to position at
+int frame_move_tail(int at, int from) {
+  int n = outlen - from;
+  if (n > frame_srccap) {
+    frame_srccap = n * 2;
+    frame_src = perm_malloc(frame_srccap);
+  }
+  for (int k = 0; k < n; k++) { __write_byte(frame_src, k, __read_byte(outbuf, from + k)); }
+  for (int k = from - 1; k >= at; k--) { __write_byte(outbuf, k + n, __read_byte(outbuf, k)); }
+  for (int k = 0; k < n; k++) { __write_byte(outbuf, at + k, __read_byte(frame_src, k)); }
+  // Keep the line ends the peephole pass reads in order
+  int i0 = frame_line_index(at);
+  int i1 = frame_line_index(from);
+  int nt = npeep_line_end - i1;
+  for (int i = npeep_line_end - 1; i >= i1; i--) { peep_line_end[i] = peep_line_end[i] - (from - at); }
+  for (int i = i1 - 1; i >= i0; i--) { peep_line_end[i] = peep_line_end[i] + n; }
+  for (int r = 0; r < nt; r++) {
+    int v = peep_line_end[npeep_line_end - 1];
+    for (int i = npeep_line_end - 1; i > i0; i--) { peep_line_end[i] = peep_line_end[i - 1]; }
+    peep_line_end[i0] = v;
+  }
+  return 0;
+}
+
+// Put the prologue for the chosen frame in front of the body at
+// outbuf[body, outlen) and emit the epilogue up to the x29 restore.
+// Frames: 0 none, 1 x29 only, 2 x29 and x30, 3 sp-relative, 4 sp-relative
+// with x30 saved.
+int frame_place(int body, int mode, int size) {
+  int total = size;
+  if (mode == 4) { total = size + 16; }
+  if (mode >= 3) {
+    // Slots move from x29 to sp, so the body is rewritten line by line
+    int n = outlen - body;
+    if (n > frame_srccap) {
+      frame_srccap = n * 2;
+      frame_src = perm_malloc(frame_srccap);
+    }
+    for (int k = 0; k < n; k++) { __write_byte(frame_src, k, __read_byte(outbuf, body + k)); }
+    npeep_line_end = frame_line_index(body);
+    outlen = body;
+    frame_adjust_sp("sub", total);
+    if (mode == 4) { emit_s("\tstr\tx30, [sp, #"); emit_num(size + 8); emit_line("]"); }
+    int ls = 0;
+    for (int p = 0; p < n; p++) {
+      if (__read_byte(frame_src, p) != '\n') continue;
+      frame_sp_line(frame_src, ls, p, size, total - size, 1);
+      emit_ch('\n');
+      ls = p + 1;
+    }
+    if (mode == 4) { emit_s("\tldr\tx30, [sp, #"); emit_num(size + 8); emit_line("]"); }
+  } else if (mode > 0) {
+    int from = outlen;
+    if (cg_va_save) {
+      int gr = cg_va_gr_off();
+      int vr = cg_va_vr_off();
+      emit_s("\tsub\tsp, sp, #"); emit_num(cg_va_area()); emit_ch('\n');
+      for (int r = 0; r < va_spill_regs; r = r + 2) {
+        emit_s("\tstp\tx"); emit_num(r); emit_s(", x"); emit_num(r + 1);
+        emit_s(", [sp, #"); emit_num(gr + r * 8); emit_line("]");
+      }
+      for (int r = 0; r < 8; r++) {
+        emit_s("\tstr\td"); emit_num(r); emit_s(", [sp, #"); emit_num(vr + r * 16); emit_line("]");
+      }
+    }
+    if (mode == 1) { emit_line("\tstr\tx29, [sp, #-16]!"); }
+    else { emit_line("\tstp\tx29, x30, [sp, #-16]!"); }
+    emit_line("\tmov\tx29, sp");
+    frame_adjust_sp("sub", total);
+    frame_move_tail(body, from);
+  }
+  frame_adjust_sp("add", total);
+  return 0;
+}
+
+// Frame for the body just emitted at outbuf[body, outlen), numbered as
+// for frame_place; size is its stack size
+int cg_frame_mode(struct FuncDef *f, int body, int size) {
+  if (use_omit_fp < 0 || cg_va_save) return 2;
+  int leaf = cg_func_is_leaf(f);
+  if (leaf && size == 0) return 0;
+  if (target_x86) {
+    // x86-64 frames are rbp-based: the return address already sits where
+    // x30 would be saved, so there is nothing to gain from sp-relative ones
+    if (leaf) return 1;
+    return 2;
+  }
+  if (use_omit_fp > 0) {
+    if (leaf && frame_sp_ok(body, size, 0)) return 3;
+    if (leaf == 0 && frame_sp_ok(body, size, 16)) return 4;
+  }
+  if (leaf) return 1;
+  return 2;
+}
+
+int gen_func(struct FuncDef *f) {
+  if (f->name == 0) { printf("cc: gen_func NULL name, skip\n"); fflush(0); return 0; }
+  cg_cur_func_name = f->name;
+  cg_cur_func_ret_stype = f->ret_stype;
+  cg_cur_func_ret_is_float = f->ret_is_float;
+  cg_va_save = (target_elf && f->is_variadic);
+  cg_va_ngr = 0;
+  cg_va_nvr = 0;
+  for (int i = 0; i < f->nparams; i++) {
+    if (f->param_is_float != 0 && f->param_is_float[i]) { cg_va_nvr++; } else { cg_va_ngr++; }
+  }
+  cg_cl_counter = 0;
+  cg_cl_gen_counter = 0;
+  cg_tmp_depth = 0;
+  cg_tmp_base = 0;
+  layout_func(f);
+  int fstart = outlen;
+  npeep_line_end = 0;
+  int ir_ok = 0;
+  if (use_ir) { ir_ok = ir_gen_func(f); }
+
+  int *ret_label = cg_new_label("ret");
+
+  emit_ch('\n');
+  emit_line("\t.p2align\t2");
+  if (f->is_static == 0) { emit_sym_line("\t.globl\t", f->name); }
+  if (target_elf) { emit_s("\t.type\t"); emit_s(f->name); emit_line(", %function"); }
+  emit_sym_label(f->name);
+  // The prologue goes in front of this once the frame is known
+  int body = outlen;
+  cg_emit_var_reg_saves("str", "stp");
+
+  for (int i = 0; i < f->nparams && i < arg_regs; i++) {
+    int off = cg_find_slot(f->params[i]);
+    if (f->param_stypes != 0 && f->param_stypes[i] != 0) {
+      int bsz = cg_struct_byte_size(f->param_stypes[i]);
+      int nf_copy = (bsz + 7) / 8;
+      for (int fi = 0; fi < nf_copy; fi++) {
+        int src_off = fi * 8;
+        int dst_off = off - fi * 8;
+        if (src_off <= 32760) {
+          emit_s("\tldr\tx9, [x"); emit_num(i); emit_s(", #"); emit_num(src_off); emit_line("]");
+        } else {
+          emit_mov_imm("x10", src_off);
+          emit_s("\tadd\tx10, x"); emit_num(i); emit_line(", x10");
+          emit_line("\tldr\tx9, [x10]");
+        }
+        if (dst_off <= 255) {
+          emit_s("\tstr\tx9, [x29, #-");
+          emit_num(dst_off);
+          emit_line("]");
+        } else {
+          emit_mov_imm("x10", dst_off);
+          emit_line("\tsub\tx10, x29, x10");
+          emit_line("\tstr\tx9, [x10]");
+        }
+      }
+    } else {
+      // Extend params to clean upper 32 bits based on type width
+      int is_64bit_param = 0;
+      if (f->param_is_intptr != 0 && f->param_is_intptr[i]) { is_64bit_param = 1; }
+      if (f->param_is_char != 0 && f->param_is_char[i]) { is_64bit_param = 1; }
+      if (f->param_stypes != 0 && f->param_stypes[i] != 0) { is_64bit_param = 1; }
+      if (f->param_is_long != 0 && f->param_is_long[i]) { is_64bit_param = 1; }
+      if (f->param_is_float != 0 && f->param_is_float[i]) { is_64bit_param = 1; }
+      if (is_64bit_param == 0) {
+        int p_is_unsigned = (f->param_is_unsigned != 0 && f->param_is_unsigned[i]);
+        int p_is_short = (f->param_is_short != 0 && f->param_is_short[i]);
+        if (p_is_short) {
+          if (p_is_unsigned) { emit_s("\tuxth\tw"); emit_num(i); emit_s(", w"); emit_num(i); emit_ch('\n'); }
+          else { emit_s("\tsxth\tx"); emit_num(i); emit_s(", w"); emit_num(i); emit_ch('\n'); }
+        } else if (p_is_unsigned) {
+          // unsigned int: writing to wN zero-extends to xN, but value may already be clean
+          emit_s("\tmov\tw"); emit_num(i); emit_s(", w"); emit_num(i); emit_ch('\n');
+        } else {
+          emit_s("\tsxtw\tx"); emit_num(i); emit_s(", w"); emit_num(i); emit_ch('\n');
+        }
+      }
+      if (ir_ok) {
+        // The IR body picks the parameter up from its argument register
+      } else if (cg_var_reg(f->params[i]) > 0) {
+        emit_s("\tmov\tx"); emit_num(cg_var_reg(f->params[i])); emit_s(", x"); emit_num(i); emit_ch('\n');
+      } else if (off <= 255) {
+        emit_s("\tstr\tx");
+        emit_num(i);
+        emit_s(", [x29, #-");
+        emit_num(off);
+        emit_line("]");
+      } else {
+        emit_mov_imm("x9", off);
+        emit_line("\tsub\tx9, x29, x9");
+        emit_s("\tstr\tx");
+        emit_num(i);
+        emit_line(", [x9]");
+      }
+    }
+  }
+  // The rest of the params are already on stack at [x29+16], [x29+24], etc.
+
+  if (ir_ok) {
+    if (ir_emit(ret_label)) { emit_line("\tmov\tw0, #0"); }
+  } else {
+    gen_block(f->body, f->nbody, ret_label);
+    emit_line("\tmov\tw0, #0");
+  }
+  emit_s(ret_label); emit_line(":");
+  cg_emit_var_reg_saves("ldr", "ldp");
+  // Slots nothing refers to need no stack
+  int size = lay_stack_size;
+  if (frame_find_reg(outbuf, body, outlen, "x29") < 0 && (target_x86 == 0 || x86_frame_regs_used(body) == 0)) { size = 0; }
+  int frame = cg_frame_mode(f, body, size);
+  frame_place(body, frame, size);
+  if (cg_cur_func_ret_is_float) {
+    emit_line("\tfmov\td0, x0");
+  }
+  if (frame == 1) { emit_line("\tldr\tx29, [sp], #16"); }
+  if (frame == 2) { emit_line("\tldp\tx29, x30, [sp], #16"); }
+  if (cg_va_save) { emit_s("\tadd\tsp, sp, #"); emit_num(cg_va_area()); emit_ch('\n'); }
+  emit_line("\tret");
+  if (use_peephole) { peep_func(fstart); }
+  if (target_elf) { emit_s("\t.size\t"); emit_s(f->name); emit_s(", .-"); emit_line(f->name); }
+  return 0;
+}
+
+int register_builtin_variadic(int *name, int np) {
+  int vj;
+  vj = 0;
+  while (vj < nvar_funcs) {
+    if (my_strcmp(var_funcs[vj], name) == 0) {
+      return 0;
+    }
+    vj++;
+  }
+  var_funcs[nvar_funcs] = name;
+  var_nparams[nvar_funcs] = np;
+  nvar_funcs++;
+  return 0;
+}
+
+int cg_register_functions(struct Program *prog) {
+  struct FuncDef *fd = 0;
+  // Register ptr-returning functions from prototypes
+  int pi = 0;
+  while (pi < prog->nprotos) {
+    if (prog->proto_ret_is_ptr[pi] != 0 || prog->proto_ret_stype[pi] != 0) {
+      ptr_ret_names[n_ptr_ret] = atom(prog->proto_names[pi]);
+      n_ptr_ret++;
+    }
+    pi++;
+  }
+  // Register ptr-returning functions from definitions
+  pi = 0;
+  while (pi < prog->nfuncs) {
+    fd = prog->funcs[pi];
+    if (fd->ret_is_ptr != 0 || fd->ret_stype != 0) {
+      ptr_ret_names[n_ptr_ret] = atom(fd->name);
+      n_ptr_ret++;
+    }
+    pi++;
+  }
+
+  // Register unsigned-returning functions from prototypes
+  pi = 0;
+  while (pi < prog->nprotos) {
+    if (prog->proto_ret_is_unsigned[pi] != 0) {
+      unsigned_ret_names[n_unsigned_ret] = atom(prog->proto_names[pi]);
+      n_unsigned_ret++;
+    }
+    pi++;
+  }
+  // Register unsigned-returning functions from definitions
+  pi = 0;
+  while (pi < prog->nfuncs) {
+    fd = prog->funcs[pi];
+    if (fd->ret_is_unsigned != 0) {
+      unsigned_ret_names[n_unsigned_ret] = atom(fd->name);
+      n_unsigned_ret++;
+    }
+    pi++;
+  }
+
+  // Register long-returning functions (add to ptr_ret_names since both skip sxtw)
+  pi = 0;
+  while (pi < prog->nprotos) {
+    if (prog->proto_ret_is_long[pi] != 0) {
+      ptr_ret_names[n_ptr_ret] = atom(prog->proto_names[pi]);
+      n_ptr_ret++;
+    }
+    pi++;
+  }
+  pi = 0;
+  while (pi < prog->nfuncs) {
+    fd = prog->funcs[pi];
+    if (fd->ret_is_long != 0) {
+      ptr_ret_names[n_ptr_ret] = atom(fd->name);
+      n_ptr_ret++;
+    }
+    pi++;
+  }
+
+  // Register struct-returning functions from prototypes (keep parse-time entries)
+  pi = 0;
+  while (pi < prog->nprotos) {
+    if (prog->proto_ret_stype[pi] != 0) {
+      struct_ret_names[n_struct_ret] = atom(prog->proto_names[pi]);
+      struct_ret_stypes[n_struct_ret] = prog->proto_ret_stype[pi];
+      n_struct_ret++;
+    }
+    pi++;
+  }
+  // Register struct-returning functions from definitions
+  pi = 0;
+  while (pi < prog->nfuncs) {
+    fd = prog->funcs[pi];
+    if (fd->ret_stype != 0) {
+      struct_ret_names[n_struct_ret] = atom(fd->name);
+      struct_ret_stypes[n_struct_ret] = fd->ret_stype;
+      n_struct_ret++;
+    }
+    pi++;
+  }
+
+  // Register float-returning functions from prototypes and definitions
+  n_float_ret = 0;
+  pi = 0;
+  while (pi < prog->nprotos) {
+    if (prog->proto_ret_is_float[pi] != 0) {
+      float_ret_names[n_float_ret] = prog->proto_names[pi];
+      n_float_ret++;
+    }
+    pi++;
+  }
+  pi = 0;
+  while (pi < prog->nfuncs) {
+    fd = prog->funcs[pi];
+    if (fd->ret_is_float != 0) {
+      float_ret_names[n_float_ret] = fd->name;
+      n_float_ret++;
+    }
+    pi++;
+  }
+
+  // Register variadic functions
+  nvar_funcs = 0;
+  pi = 0;
+  while (pi < prog->nprotos) {
+    if (prog->proto_is_variadic[pi] != 0) {
+      var_funcs[nvar_funcs] = prog->proto_names[pi];
+      var_nparams[nvar_funcs] = prog->proto_nparams[pi];
+      nvar_funcs++;
+    }
+    pi++;
+  }
+  pi = 0;
+  while (pi < prog->nfuncs) {
+    fd = prog->funcs[pi];
+    if (fd->is_variadic != 0) {
+      var_funcs[nvar_funcs] = fd->name;
+      var_nparams[nvar_funcs] = fd->nparams;
+      nvar_funcs++;
+    }
+    pi++;
+  }
+
+  // Register well-known variadic functions if not already declared
+  register_builtin_variadic("printf", 1);
+  register_builtin_variadic("fprintf", 2);
+  register_builtin_variadic("sprintf", 2);
+  register_builtin_variadic("snprintf", 3);
+  register_builtin_variadic("scanf", 1);
+  register_builtin_variadic("fscanf", 2);
+  register_builtin_variadic("sscanf", 2);
+
+  // Register all known function names (for function pointer support)
+  nknown_funcs = 0;
+  nx_clear(known_ix);
+  pi = 0;
+  while (pi < prog->nprotos) {
+    known_funcs[nknown_funcs] = atom(prog->proto_names[pi]);
+    nx_add(known_ix, known_funcs[nknown_funcs], nknown_funcs);
+    nknown_funcs++;
+    pi++;
+  }
+  ndefined_funcs = 0;
+  nx_clear(defined_ix);
+  pi = 0;
+  while (pi < prog->nfuncs) {
+    fd = prog->funcs[pi];
+    known_funcs[nknown_funcs] = atom(fd->name);
+    nx_add(known_ix, known_funcs[nknown_funcs], nknown_funcs);
+    nknown_funcs++;
+    defined_funcs[ndefined_funcs] = atom(fd->name);
+    nx_add(defined_ix, defined_funcs[ndefined_funcs], ndefined_funcs);
+    ndefined_funcs++;
+    pi++;
+  }
+  return 0;
+}
+
+int cg_register_globals(struct Program *prog) {
+  struct GDecl *gd = 0;
+  // Register global variables
+  ncg_g = 0;
+  nx_clear(cgg_ix);
+  for (int gi = 0; gi < prog->nglobals; gi++) {
+    gd = prog->globals[gi];
+    cgg[ncg_g].name = atom(gd->name);
+    nx_add(cgg_ix, cgg[ncg_g].name, ncg_g);
+    cgg[ncg_g].is_array = 0;
+    if (gd->array_size >= 0) { cgg[ncg_g].is_array = 1; }
+    cgg[ncg_g].is_char = (gd->is_char && gd->is_ptr == 1 && gd->array_size < 0) ? 1 : 0;
+    cgg[ncg_g].is_char_arr = (gd->is_char && gd->is_ptr == 1 && gd->array_size >= 0) ? 1 : 0;
+    cgg[ncg_g].stype = (gd->is_ptr == 0) ? gd->stype : 0;
+    cgg[ncg_g].ptr_stype = 0;
+    if (gd->is_ptr == 1) { if (gd->array_size < 0) { cgg[ncg_g].ptr_stype = gd->stype; } }
+    cgg[ncg_g].is_barechar = (gd->is_char && gd->is_ptr == 0 && gd->array_size < 0) ? (gd->is_unsigned ? 2 : 1) : 0;
+    cgg[ncg_g].is_intptr = (gd->is_ptr > 0 && gd->stype == 0 && (gd->is_char == 0 || gd->is_ptr >= 2) && gd->array_size < 0) ? 1 : 0;
+    cgg[ncg_g].is_bare_char_arr = 0;
+    if (gd->is_char && gd->is_ptr == 0 && gd->array_size >= 0) {
+      cgg[ncg_g].is_bare_char_arr = 1;
+    }
+    {
+      int gesz = 8;
+      if (gd->is_char && gd->is_ptr == 0) { gesz = 1; }
+      else if (gd->stype != 0 && gd->is_ptr == 0) { gesz = 8; }
+      else if (gd->is_short && gd->is_ptr == 0) { gesz = 2; }
+      else if (gd->is_char == 0 && gd->is_ptr == 0 && gd->stype == 0 && gd->is_long == 0 && gd->is_short == 0) { gesz = 4; }
+      if (gd->is_ptr > 0) { gesz = 8; }
+      cgg[ncg_g].esz = gesz;
+    }
+    {
+      int pesz = 0;
+      if (gd->is_ptr > 0) {
+        if (gd->is_ptr >= 2) { pesz = 8; }
+        else if (gd->is_char) { pesz = 1; }
+        else if (gd->is_short) { pesz = 2; }
+        else if (gd->is_long) { pesz = 8; }
+        else if (gd->stype != 0) { pesz = 0; }
+        else { pesz = 4; }
+      }
+      cgg[ncg_g].ptr_esz = pesz;
+    }
+    {
+      int vbsz = 4;
+      if (gd->is_char && gd->is_ptr == 0 && gd->array_size < 0) { vbsz = 1; }
+      else if (gd->is_short && gd->is_ptr == 0 && gd->array_size < 0) { vbsz = 2; }
+      else if (gd->is_long || gd->is_ptr > 0 || gd->stype != 0 || gd->array_size >= 0) { vbsz = 8; }
+      cgg_var_bsz[ncg_g] = vbsz;
+    }
+    cgg_is_unsigned[ncg_g] = gd->is_unsigned;
+    ncg_g++;
+  }
+  return 0;
+}
+
+int cg_find_struct_index(int *sname) {
+  return nx_first(cg_s_ix, sname);
+}
+
+int cg_align_up(int val, int align) {
+  return (val + align - 1) / align * align;
+}
+
+int cg_compute_struct_layout(int si) {
+  int nf = cg_snfields[si];
+  cg_s_fix[si] = nx_new(nf);
+  for (int k = 0; k < nf; k++) {
+    if (cg_sfields[si][k] != 0) { nx_add(cg_s_fix[si], atom(cg_sfields[si][k]), k); }
+  }
+  cg_s_fslot[si] = 0;
+  cg_s_ca_len[si] = 0;
+  cg_s_ca_off[si] = 0;
+  int *fbyteoff = my_malloc(nf * 8);
+  int *fbytesize = my_malloc(nf * 8);
+  int offset = 0;
+  int max_align = 1;
+  int is_union = cg_s_is_union[si];
+  int max_size = 0;
+
+  // Bitfield structs: use nwords * 4 bytes
+  if (cg_s_nw[si] > 0) {
+    int nw = cg_s_nw[si];
+    int j = 0;
+    while (j < nf) {
+      int wi = (cg_s_wi[si] != 0) ? cg_s_wi[si][j] : 0;
+      fbyteoff[j] = wi * 4;
+      fbytesize[j] = 4;
+      j++;
+    }
+    cg_s_fbyteoff[si] = fbyteoff;
+    cg_s_fbytesize[si] = fbytesize;
+    cg_s_bytesize[si] = nw * 4;
+    return 0;
+  }
+
+  int j = 0;
+  while (j < nf) {
+    int fsz = 4;  // default: int = 4 bytes
+    int falign = 4;
+    int f_is_ptr = (cg_s_fp[si] != 0 && cg_s_fp[si][j]) ? 1 : 0;
+    int f_is_char = (cg_s_fc[si] != 0 && cg_s_fc[si][j]) ? 1 : 0;
+    int f_is_char_type = (cg_s_fct[si] != 0 && cg_s_fct[si][j]) ? 1 : 0;
+    int f_is_arr = (cg_s_fa[si] != 0) ? cg_s_fa[si][j] : 0;
+    int f_is_short = (cg_s_fsh[si] != 0) ? cg_s_fsh[si][j] : 0;
+    int f_is_long = (cg_s_fl[si] != 0) ? cg_s_fl[si][j] : 0;
+    int *f_stype = cg_sfield_types[si][j];
+
+    if (f_is_ptr > 0) {
+      // Any pointer type: 8 bytes
+      fsz = 8; falign = 8;
+    } else if (f_stype != 0) {
+      // Embedded struct/union
+      int inner = cg_find_struct_index(f_stype);
+      if (inner < 0) {
+        // Try typedef resolution
+        int *resolved = find_typedef(f_stype);
+        if (resolved != 0) { inner = cg_find_struct_index(resolved); }
+      }
+      if (inner >= 0 && cg_s_fbyteoff[inner] != 0) {
+        fsz = cg_s_bytesize[inner];
+        // Use stored max alignment of inner struct (not byte size!)
+        falign = cg_s_max_align[inner];
+        if (falign < 1) { falign = 1; }
+      } else {
+        fsz = 8; falign = 8;  // fallback
+      }
+    } else if (f_is_char_type || f_is_char) {
+      // char type field (plain char, char*, char[])
+      fsz = 1; falign = 1;
+    } else if (f_is_short) {
+      fsz = 2; falign = 2;
+    } else if (f_is_long) {
+      fsz = 8; falign = 8;
+    } else {
+      // Default: int = 4 bytes
+      fsz = 4; falign = 4;
+    }
+
+    // Handle arrays
+    if (f_is_arr > 0) {
+      if (f_is_char && f_is_ptr == 0) {
+        // char arr[N]: N bytes, align 1
+        fsz = f_is_arr;
+        falign = 1;
+      } else {
+        fsz = fsz * f_is_arr;
+      }
+    }
+
+    // Align offset
+    if (is_union == 0) {
+      offset = cg_align_up(offset, falign);
+    }
+    fbyteoff[j] = is_union ? 0 : offset;
+    fbytesize[j] = fsz;
+
+    if (falign > max_align) { max_align = falign; }
+    if (is_union) {
+      if (fsz > max_size) { max_size = fsz; }
+    } else {
+      offset = offset + fsz;
+    }
+    j++;
+  }
+
+  int total;
+  if (is_union) {
+    total = cg_align_up(max_size, max_align);
+  } else {
+    total = cg_align_up(offset, max_align);
+  }
+  if (total == 0) { total = max_align; }
+
+  cg_s_fbyteoff[si] = fbyteoff;
+  cg_s_fbytesize[si] = fbytesize;
+  cg_s_bytesize[si] = total;
+  cg_s_max_align[si] = max_align;
+  return 0;
+}
+
+// Build flat slot layout: for each flattened slot index, compute byte offset and byte size
+// Returns number of slots filled
+int cg_build_slot_layout(int *sname, int *slot_off, int *slot_sz, int max_slots) {
+  sname = cg_resolve_sname(sname);
+  int si = cg_find_struct_index(sname);
+  if (si < 0 || cg_s_fbyteoff[si] == 0) return 0;
+
+  // Union: 1 slot at offset 0
+  if (cg_s_is_union[si]) {
+    if (max_slots > 0) { slot_off[0] = 0; slot_sz[0] = cg_s_bytesize[si]; }
+    return 1;
+  }
+
+  int slot = 0;
+  int j = 0;
+  while (j < cg_snfields[si]) {
+    int f_off = cg_s_fbyteoff[si][j];
+    int f_sz = cg_s_fbytesize[si][j];
+    int f_is_ptr = (cg_s_fp[si] != 0) ? cg_s_fp[si][j] : 0;
+    int f_is_arr = (cg_s_fa[si] != 0) ? cg_s_fa[si][j] : 0;
+    int f_is_char = (cg_s_fc[si] != 0) ? cg_s_fc[si][j] : 0;
+    int *f_stype = cg_sfield_types[si][j];
+
+    if (f_stype != 0 && f_is_ptr == 0 && f_is_arr == 0) {
+      // Embedded struct: recurse into sub-fields
+      int sub_nf = cg_struct_nfields(f_stype);
+      int *sub_off = my_malloc(sub_nf * 8);
+      int *sub_sz = my_malloc(sub_nf * 8);
+      int sub_n = cg_build_slot_layout(f_stype, sub_off, sub_sz, sub_nf);
+      int si2 = 0;
+      while (si2 < sub_n && slot < max_slots) {
+        slot_off[slot] = f_off + sub_off[si2];
+        slot_sz[slot] = sub_sz[si2];
+        slot++;
+        si2++;
+      }
+    } else if (f_is_arr > 0 && f_is_char && f_is_ptr == 0) {
+      // Char array: ceil(arr_size / 8) packed slots
+      int ca_nslots = (f_is_arr + 7) / 8;
+      int csi = 0;
+      while (csi < ca_nslots && slot < max_slots) {
+        slot_off[slot] = f_off + csi * 8;
+        slot_sz[slot] = 8;
+        slot++;
+        csi++;
+      }
+    } else if (f_is_arr > 0 && f_stype != 0 && f_is_ptr == 0) {
+      // Array of structs
+      int sub_nf = cg_struct_nfields(f_stype);
+      int elem_bsz = cg_struct_byte_size(f_stype);
+      int ai = 0;
+      while (ai < f_is_arr) {
+        int *sub_off = my_malloc(sub_nf * 8);
+        int *sub_sz = my_malloc(sub_nf * 8);
+        int sub_n = cg_build_slot_layout(f_stype, sub_off, sub_sz, sub_nf);
+        int si2 = 0;
+        while (si2 < sub_n && slot < max_slots) {
+          slot_off[slot] = f_off + ai * elem_bsz + sub_off[si2];
+          slot_sz[slot] = sub_sz[si2];
+          slot++;
+          si2++;
+        }
+        ai++;
+      }
+    } else if (f_is_arr > 0) {
+      // Array of scalars
+      int elem_sz = f_sz / f_is_arr;
+      if (elem_sz < 1) { elem_sz = 1; }
+      int ai = 0;
+      while (ai < f_is_arr && slot < max_slots) {
+        slot_off[slot] = f_off + ai * elem_sz;
+        slot_sz[slot] = elem_sz;
+        slot++;
+        ai++;
+      }
+    } else {
+      // Simple scalar field
+      if (slot < max_slots) {
+        slot_off[slot] = f_off;
+        slot_sz[slot] = f_sz;
+        slot++;
+      }
+    }
+    j++;
+  }
+  return slot;
+}
+
+int cg_register_structs(struct Program *prog) {
+#ifndef __STDC__
+  struct SDef *sd = 0;
+#endif
+  // Register struct/union definitions
+  int i = 0;
+  struct SDef *sd = 0;
+  while (i < prog->nstructs) {
+    sd = prog->structs[i];
+    cg_sname[ncg_s] = atom(sd->name);
+    nx_add(cg_s_ix, cg_sname[ncg_s], ncg_s);
+    cg_sfields[ncg_s] = sd->fields;
+    cg_sfield_types[ncg_s] = sd->field_types;
+    cg_snfields[ncg_s] = sd->nfields;
+    cg_s_is_union[ncg_s] = sd->is_union;
+    cg_s_bw[ncg_s] = sd->bit_widths;
+    cg_s_bo[ncg_s] = sd->bit_offsets;
+    cg_s_wi[ncg_s] = sd->word_indices;
+    cg_s_nw[ncg_s] = sd->nwords;
+    cg_s_fa[ncg_s] = sd->field_is_array;
+    cg_s_fc[ncg_s] = sd->field_is_char;
+    cg_s_fp[ncg_s] = sd->field_is_ptr;
+    cg_s_fsh[ncg_s] = sd->field_is_short;
+    cg_s_fl[ncg_s] = sd->field_is_long;
+    cg_s_fct[ncg_s] = sd->field_is_char_type;
+    cg_s_fu[ncg_s] = sd->field_is_unsigned;
+    ncg_s++;
+    i++;
+  }
+  // Register inline anonymous structs
+  i = 0;
+  while (i < ninline_sdefs) {
+    sd = inline_sdefs[i];
+    cg_sname[ncg_s] = atom(sd->name);
+    nx_add(cg_s_ix, cg_sname[ncg_s], ncg_s);
+    cg_sfields[ncg_s] = sd->fields;
+    cg_sfield_types[ncg_s] = sd->field_types;
+    cg_snfields[ncg_s] = sd->nfields;
+    cg_s_is_union[ncg_s] = sd->is_union;
+    cg_s_bw[ncg_s] = sd->bit_widths;
+    cg_s_bo[ncg_s] = sd->bit_offsets;
+    cg_s_wi[ncg_s] = sd->word_indices;
+    cg_s_nw[ncg_s] = sd->nwords;
+    cg_s_fa[ncg_s] = sd->field_is_array;
+    cg_s_fc[ncg_s] = sd->field_is_char;
+    cg_s_fp[ncg_s] = sd->field_is_ptr;
+    cg_s_fsh[ncg_s] = sd->field_is_short;
+    cg_s_fl[ncg_s] = sd->field_is_long;
+    cg_s_fct[ncg_s] = sd->field_is_char_type;
+    cg_s_fu[ncg_s] = sd->field_is_unsigned;
+    ncg_s++;
+    i++;
+  }
+  // Compute proper struct layouts
+  { int li = 0; while (li < ncg_s) { cg_compute_struct_layout(li); li++; } }
+  return 0;
+}
+
+// Try to evaluate an AST expression to a compile-time constant.
+// Returns 1 if successful, 0 if not. Result stored in *out.
+int try_eval_const(struct Expr *e, int *out) {
+  if (e == 0) return 0;
+  if (e->kind == ND_NUM) { *out = e->ival; return 1; }
+  if (e->kind == ND_CAST && e->left != 0) { return try_eval_const(e->left, out); }
+  if (e->kind == ND_UNARY && e->ival == '-') {
+    int v = 0;
+    if (try_eval_const(e->left, &v)) { *out = 0 - v; return 1; }
+    return 0;
+  }
+  if (e->kind == ND_UNARY && e->ival == '~') {
+    int v = 0;
+    if (try_eval_const(e->left, &v)) { *out = ~v; return 1; }
+    return 0;
+  }
+  if (e->kind == ND_BINARY) {
+    int lv = 0; int rv = 0;
+    int *op = e->sval2;
+    if (op == 0) return 0;
+    if (try_eval_const(e->left, &lv) == 0) return 0;
+    if (try_eval_const(e->right, &rv) == 0) return 0;
+    if (my_strcmp(op, "+") == 0) { *out = lv + rv; return 1; }
+    if (my_strcmp(op, "-") == 0) { *out = lv - rv; return 1; }
+    if (my_strcmp(op, "*") == 0) { *out = lv * rv; return 1; }
+    if (my_strcmp(op, "/") == 0 && rv != 0) { *out = lv / rv; return 1; }
+    if (my_strcmp(op, "%") == 0 && rv != 0) { *out = lv % rv; return 1; }
+    if (my_strcmp(op, "&") == 0) { *out = lv & rv; return 1; }
+    if (my_strcmp(op, "|") == 0) { *out = lv | rv; return 1; }
+    if (my_strcmp(op, "^") == 0) { *out = lv ^ rv; return 1; }
+    if (my_strcmp(op, "<<") == 0) { *out = lv << rv; return 1; }
+    if (my_strcmp(op, ">>") == 0) { *out = lv >> rv; return 1; }
+    return 0;
+  }
+  return 0;
+}
+
+int cg_emit_globals(struct Program *prog) {
+  int ch = 0;
+  int i = 0;
+  int k = 0;
+#ifdef __STDC__
+  int fsi = 0;
+#endif
+  struct GDecl *gd = 0;
+  // Emit global variables
+  if (prog->nglobals > 0) {
+    int has_data = 0;
+    i = 0;
+    while (i < prog->nglobals) {
+      gd = prog->globals[i];
+      if (gd == 0 || gd < 4096) { i++; continue; }
+      if (gd->array_size >= 0 && gd->init_list != 0 && gd->init_list->kind == ND_INITLIST) {
+        // Initialized array: emit .data with .quad per element
+        // Build a flat array of Expr* slots to handle designated initializers
+        int nf_per_elem = 1;
+        if (gd->stype != 0 && gd->is_ptr == 0) { nf_per_elem = cg_struct_nfields(gd->stype); }
+        int total_slots = gd->array_size * nf_per_elem;
+        // Char-array slot map for struct arrays (before flattening)
+        int *ca_slot_map = 0;
+        int *ca_slot_byte_off = 0;
+        if (gd->stype != 0 && gd->is_ptr == 0 && nf_per_elem > 0) {
+          int ca_si = cg_find_struct_index(cg_resolve_sname(gd->stype));
+          if (ca_si >= 0) {
+            cg_struct_ca_map(ca_si);
+            ca_slot_map = cg_s_ca_len[ca_si];
+            ca_slot_byte_off = cg_s_ca_off[ca_si];
+          }
+        }
+        struct Expr **flat = my_malloc(total_slots * 8);
+        int fsi = 0;
+        while (fsi < total_slots) { flat[fsi] = 0; fsi++; }
+        int **g_di = gd->init_list->desig;
+        int g_pos_idx = 0;
+        k = 0;
+        while (k < gd->init_list->nargs) {
+          int g_target = g_pos_idx;
+          if (g_di != 0 && g_di[k] >= 0) { g_target = g_di[k]; }
+          struct Expr *elem = gd->init_list->args[k];
+          if (elem->kind == ND_INITLIST) {
+            int si = 0;
+            int flat_base = g_target * nf_per_elem;
+            int flat_off = 0;
+            while (si < elem->nargs && flat_base + flat_off < total_slots) {
+              flat[flat_base + flat_off] = elem->args[si];
+              // If this slot starts a multi-slot char array, fill remaining slots with same string
+              if (ca_slot_map != 0 && ca_slot_map[flat_off] > 0) {
+                int ca_nsl = (ca_slot_map[flat_off] + 7) / 8;
+                int csi2 = 1;
+                while (csi2 < ca_nsl && flat_base + flat_off + csi2 < total_slots) {
+                  flat[flat_base + flat_off + csi2] = elem->args[si];
+                  csi2++;
+                }
+                flat_off += ca_nsl;
+              } else {
+                flat_off++;
+              }
+              si++;
+            }
+            g_pos_idx = g_target + 1;
+          } else if (elem->kind == ND_STRLIT && gd->is_char && gd->is_ptr == 0) {
+            // char array initialized with string: expand bytes into slots
+            int *decoded = cg_decode_string(elem->sval);
+            int slen = my_strlen(decoded) + 1;
+            int sc = 0;
+            int flat_base = g_target * nf_per_elem;
+            while (sc < slen && flat_base + sc < total_slots) {
+              struct Expr *byte_e = my_malloc(80);
+              byte_e->ty = 0;
+              byte_e->kind = ND_NUM;
+              byte_e->ival = __read_byte(decoded, sc);
+              flat[flat_base + sc] = byte_e;
+              sc++;
+            }
+            g_pos_idx = g_target + 1;
+          } else {
+            int flat_idx = g_target * nf_per_elem;
+            if (flat_idx < total_slots) { flat[flat_idx] = elem; }
+            g_pos_idx = g_target + 1;
+          }
+          k++;
+        }
+        if (has_data == 0) { emit_ch('\n'); emit_line("\t.data"); has_data = 1; }
+        if (gd->is_static == 0) { emit_sym_line("\t.globl\t", gd->name); }
+        int gd_is_char_arr = (gd->is_char && gd->is_ptr == 0);
+        int gd_esz = 8;
+        if (gd_is_char_arr) { gd_esz = 1; }
         else if (gd->stype != 0 && gd->is_ptr == 0) { gd_esz = 8; }
         else if (gd->is_short && gd->is_ptr == 0) { gd_esz = 2; }
         else if (gd->is_char == 0 && gd->is_ptr == 0 && gd->stype == 0 && gd->is_long == 0 && gd->is_short == 0) { gd_esz = 4; }
@@ -11618,456 +17609,3336 @@ int cg_emit_globals(struct Program *prog) {
         else if (gd_esz == 2) { emit_line("\t.p2align\t1"); }
         else if (gd_esz == 4) { emit_line("\t.p2align\t2"); }
         else { emit_line("\t.p2align\t3"); }
-        emit_s("_"); emit_s(gd->name); emit_line(":");
+        emit_sym_label(gd->name);
+        fsi = 0;
+        while (fsi < total_slots) {
+          struct Expr *fe = flat[fsi];
+          if (fe == 0) {
+            emit_s(gd_dir); emit_line("0");
+          } else if (fe->kind == ND_NUM) {
+            emit_s(gd_dir); emit_num(fe->ival); emit_ch('\n');
+          } else if (fe->kind == ND_UNARY && fe->ival == '-' && fe->left->kind == ND_NUM) {
+            emit_s(gd_dir); emit_ch('-'); emit_num(fe->left->ival); emit_ch('\n');
+          } else if (fe->kind == ND_STRLIT) {
+            // Check if this slot is a char array field - pack bytes inline
+            if (ca_slot_map != 0 && ca_slot_map[fsi % nf_per_elem] > 0) {
+              int *decoded = cg_decode_string(fe->sval);
+              int plen = my_strlen(decoded);
+              int byte_start = 0;
+              if (ca_slot_byte_off != 0) { byte_start = ca_slot_byte_off[fsi % nf_per_elem]; }
+              int packed_lo = 0;
+              int packed_hi = 0;
+              int pi = 0;
+              while (pi < 4 && (byte_start + pi) < plen) {
+                int byte_val = __read_byte(decoded, byte_start + pi);
+                packed_lo = packed_lo | (byte_val << (pi * 8));
+                pi++;
+              }
+              while (pi < 8 && (byte_start + pi) < plen) {
+                int byte_val = __read_byte(decoded, byte_start + pi);
+                packed_hi = packed_hi | (byte_val << ((pi - 4) * 8));
+                pi++;
+              }
+              // Emit as hex: high 32 bits then low 32 bits
+              emit_s("\t.quad\t0x");
+              int hi = 7;
+              while (hi >= 0) {
+                int nibble = (packed_hi >> (hi * 4)) & 0xF;
+                if (nibble < 10) { emit_ch('0' + nibble); }
+                else { emit_ch('a' + nibble - 10); }
+                hi = hi - 1;
+              }
+              hi = 7;
+              while (hi >= 0) {
+                int nibble = (packed_lo >> (hi * 4)) & 0xF;
+                if (nibble < 10) { emit_ch('0' + nibble); }
+                else { emit_ch('a' + nibble - 10); }
+                hi = hi - 1;
+              }
+              emit_ch('\n');
+            } else {
+              int *slabel = cg_intern_string(fe->sval);
+              emit_s("\t.quad\t"); emit_line(slabel);
+            }
+          } else if (fe->kind == ND_VAR) {
+            emit_sym_line("\t.quad\t", fe->sval);
+          } else if (fe->kind == ND_UNARY && fe->ival == '&' && fe->left != 0 && fe->left->kind == ND_VAR) {
+            emit_sym_line("\t.quad\t", fe->left->sval);
+          } else if (fe->kind == ND_CAST && fe->left != 0 && fe->left->kind == ND_NUM) {
+            emit_s(gd_dir); emit_num(fe->left->ival); emit_ch('\n');
+          } else if (fe->kind == ND_CAST && fe->left != 0 && fe->left->kind == ND_VAR) {
+            emit_sym_line("\t.quad\t", fe->left->sval);
+          } else {
+            int cval = 0;
+            if (try_eval_const(fe, &cval)) {
+              emit_s(gd_dir); emit_num(cval); emit_ch('\n');
+            } else {
+              emit_s(gd_dir); emit_line("0");
+            }
+          }
+          fsi++;
+        }
+      } else if (gd->array_size >= 0 && gd->init_str != 0) {
+        // String-initialized array
+        int *decoded = cg_decode_string(gd->init_str);
+        int slen = my_strlen(decoded) + 1;
+        if (has_data == 0) { emit_ch('\n'); emit_line("\t.data"); has_data = 1; }
+        if (gd->is_static == 0) { emit_sym_line("\t.globl\t", gd->name); }
+        if (gd->is_char && gd->is_ptr == 0) {
+          // Bare char array: emit .byte per character
+          emit_line("\t.p2align\t0");
+          emit_sym_label(gd->name);
+          k = 0;
+          while (k < slen && k < gd->array_size) {
+            ch = __read_byte(decoded, k);
+            emit_s("\t.byte\t"); emit_num(ch); emit_ch('\n');
+            k++;
+          }
+          // Zero-pad remaining bytes if array_size > slen
+          while (k < gd->array_size) {
+            emit_line("\t.byte\t0");
+            k++;
+          }
+        } else {
+          // Non-char array: emit element-sized directives per character
+          int nc_esz = 8;
+          if (gd->is_short && gd->is_ptr == 0) { nc_esz = 2; }
+          else if (gd->is_char == 0 && gd->is_ptr == 0 && gd->stype == 0 && gd->is_long == 0) { nc_esz = 4; }
+          if (nc_esz == 4) { emit_line("\t.p2align\t2"); }
+          else if (nc_esz == 2) { emit_line("\t.p2align\t1"); }
+          else { emit_line("\t.p2align\t3"); }
+          emit_sym_label(gd->name);
+          k = 0;
+          while (k < slen && k < gd->array_size) {
+            ch = __read_byte(decoded, k);
+            if (nc_esz == 4) { emit_s("\t.long\t"); }
+            else if (nc_esz == 2) { emit_s("\t.short\t"); }
+            else { emit_s("\t.quad\t"); }
+            emit_num(ch); emit_ch('\n');
+            k++;
+          }
+        }
+      } else if (gd->array_size >= 0) {
+        // Uninitialized array: use .comm (or .zerofill for static)
+        int elem_sz = 8;
+        if (gd->is_char && gd->is_ptr == 0) {
+          elem_sz = 1;
+        } else if (gd->stype != 0 && gd->is_ptr == 0) {
+          elem_sz = cg_struct_byte_size(gd->stype);
+        } else if (gd->is_short && gd->is_ptr == 0) {
+          elem_sz = 2;
+        } else if (gd->is_char == 0 && gd->is_ptr == 0 && gd->stype == 0 && gd->is_long == 0) {
+          elem_sz = 4;
+        }
+        if (gd->is_ptr > 0) { elem_sz = 8; }
+        int sz = gd->array_size * elem_sz;
+        if (sz == 0 && gd->stype != 0) { sz = elem_sz; }
+        cg_emit_bss(gd->name, sz, gd->is_static);
+      } else if (gd->init_list != 0 && gd->init_list->kind == ND_INITLIST) {
+        // Struct (non-array) with init list: struct S obj = {10, 20};
+        if (gd->stype != 0) { printf("cc: struct init '%s' stype='%s' nargs=%d\n", gd->name, gd->stype, gd->init_list->nargs); }
+        int nf_total = 0;
+        if (gd->stype != 0) { nf_total = cg_struct_nfields(gd->stype); }
+        if (nf_total < gd->init_list->nargs) { nf_total = gd->init_list->nargs; }
+        struct Expr **sflat = my_malloc(nf_total * 8);
         fsi = 0;
-        while (fsi < total_slots) {
-          struct Expr *fe = flat[fsi];
-          if (fe == 0) {
-            emit_s(gd_dir); emit_line("0");
-          } else if (fe->kind == ND_NUM) {
-            emit_s(gd_dir); emit_num(fe->ival); emit_ch('\n');
-          } else if (fe->kind == ND_UNARY && fe->ival == '-' && fe->left->kind == ND_NUM) {
-            emit_s(gd_dir); emit_ch('-'); emit_num(fe->left->ival); emit_ch('\n');
-          } else if (fe->kind == ND_STRLIT) {
-            // Check if this slot is a char array field - pack bytes inline
-            if (ca_slot_map != 0 && ca_slot_map[fsi % nf_per_elem] > 0) {
-              int *decoded = cg_decode_string(fe->sval);
+        while (fsi < nf_total) { sflat[fsi] = 0; fsi++; }
+        int **gs_di = gd->init_list->desig;
+        int gs_pos = 0;
+        k = 0;
+        while (k < gd->init_list->nargs) {
+          int gs_target = gs_pos;
+          if (gs_di != 0 && gs_di[k] >= 0) { gs_target = gs_di[k]; }
+          if (gs_target < nf_total) { sflat[gs_target] = gd->init_list->args[k]; }
+          gs_pos = gs_target + 1;
+          k++;
+        }
+        if (has_data == 0) { emit_ch('\n'); emit_line("\t.data"); has_data = 1; }
+        if (gd->is_static == 0) { emit_sym_line("\t.globl\t", gd->name); }
+        emit_line("\t.p2align\t3");
+        emit_sym_label(gd->name);
+        if (gd->stype != 0) {
+          // Proper layout: emit each slot at its correct byte offset with correct size
+          int *sl_off = my_malloc(nf_total * 8);
+          int *sl_sz = my_malloc(nf_total * 8);
+          int sl_n = cg_build_slot_layout(gd->stype, sl_off, sl_sz, nf_total);
+          if (my_strcmp(gd->name, "sqlite3Config") == 0) {
+            printf("cc: slot_layout for '%s': sl_n=%d nf_total=%d\n", gd->name, sl_n, nf_total);
+            int di = 0;
+            while (di < sl_n && di < 15) { printf("  slot[%d]: off=%d sz=%d\n", di, sl_off[di], sl_sz[di]); di++; }
+          }
+          int cur_off = 0;
+          fsi = 0;
+          while (fsi < nf_total) {
+            int f_off = (fsi < sl_n) ? sl_off[fsi] : cur_off;
+            int f_sz = (fsi < sl_n) ? sl_sz[fsi] : 8;
+            // Emit padding
+            if (f_off > cur_off) {
+              emit_s("\t.zero\t"); emit_num(f_off - cur_off); emit_ch('\n');
+              cur_off = f_off;
+            }
+            // Choose directive
+            int *dir = "\t.quad\t";
+            if (f_sz == 1) { dir = "\t.byte\t"; }
+            else if (f_sz == 2) { dir = "\t.short\t"; }
+            else if (f_sz == 4) { dir = "\t.long\t"; }
+            struct Expr *fe = sflat[fsi];
+            if (fe == 0) {
+              emit_s(dir); emit_line("0");
+            } else if (fe->kind == ND_NUM) {
+              emit_s(dir); emit_num(fe->ival); emit_ch('\n');
+            } else if (fe->kind == ND_UNARY && fe->ival == '-' && fe->left->kind == ND_NUM) {
+              emit_s(dir); emit_ch('-'); emit_num(fe->left->ival); emit_ch('\n');
+            } else if (fe->kind == ND_STRLIT) {
+              int *slabel = cg_intern_string(fe->sval);
+              emit_s("\t.quad\t"); emit_line(slabel);
+            } else if (fe->kind == ND_VAR) {
+              emit_sym_line("\t.quad\t", fe->sval);
+            } else if (fe->kind == ND_UNARY && fe->ival == '&' && fe->left != 0 && fe->left->kind == ND_VAR) {
+              emit_sym_line("\t.quad\t", fe->left->sval);
+            } else if (fe->kind == ND_CAST && fe->left != 0 && fe->left->kind == ND_NUM) {
+              emit_s(dir); emit_num(fe->left->ival); emit_ch('\n');
+            } else if (fe->kind == ND_CAST && fe->left != 0 && fe->left->kind == ND_VAR) {
+              emit_sym_line("\t.quad\t", fe->left->sval);
+            } else {
+              int cval = 0;
+              if (try_eval_const(fe, &cval)) {
+                emit_s(dir); emit_num(cval); emit_ch('\n');
+              } else {
+                emit_s(dir); emit_line("0");
+              }
+            }
+            cur_off = cur_off + f_sz;
+            fsi++;
+          }
+          // Trailing padding
+          int total_bsz = cg_struct_byte_size(gd->stype);
+          if (cur_off < total_bsz) {
+            emit_s("\t.zero\t"); emit_num(total_bsz - cur_off); emit_ch('\n');
+          }
+        } else {
+          // Legacy: .quad per slot
+          fsi = 0;
+          while (fsi < nf_total) {
+            struct Expr *fe = sflat[fsi];
+            if (fe == 0) {
+              emit_line("\t.quad\t0");
+            } else if (fe->kind == ND_NUM) {
+              emit_s("\t.quad\t"); emit_num(fe->ival); emit_ch('\n');
+            } else if (fe->kind == ND_UNARY && fe->ival == '-' && fe->left->kind == ND_NUM) {
+              emit_s("\t.quad\t-"); emit_num(fe->left->ival); emit_ch('\n');
+            } else if (fe->kind == ND_STRLIT) {
+              int *slabel = cg_intern_string(fe->sval);
+              emit_s("\t.quad\t"); emit_line(slabel);
+            } else if (fe->kind == ND_VAR) {
+              emit_sym_line("\t.quad\t", fe->sval);
+            } else if (fe->kind == ND_UNARY && fe->ival == '&' && fe->left != 0 && fe->left->kind == ND_VAR) {
+              emit_sym_line("\t.quad\t", fe->left->sval);
+            } else if (fe->kind == ND_CAST && fe->left != 0 && fe->left->kind == ND_NUM) {
+              emit_s("\t.quad\t"); emit_num(fe->left->ival); emit_ch('\n');
+            } else if (fe->kind == ND_CAST && fe->left != 0 && fe->left->kind == ND_VAR) {
+              emit_sym_line("\t.quad\t", fe->left->sval);
+            } else {
+              int cval = 0;
+              if (try_eval_const(fe, &cval)) {
+                emit_s("\t.quad\t"); emit_num(cval); emit_ch('\n');
+              } else {
+                emit_line("\t.quad\t0");
+              }
+            }
+            fsi++;
+          }
+        }
+      } else if (gd->has_init != 0 && gd->init_str != 0) {
+        // String initialized
+        if (has_data == 0) { emit_ch('\n'); emit_line("\t.data"); has_data = 1; }
+        if (gd->is_static == 0) { emit_sym_line("\t.globl\t", gd->name); }
+        emit_line("\t.p2align\t3");
+        emit_sym_label(gd->name);
+        int *slabel = cg_intern_string(cg_decode_string(gd->init_str));
+        emit_s("\t.quad\t"); emit_line(slabel);
+      } else if (gd->has_init != 0) {
+        // Integer initialized
+        if (has_data == 0) { emit_ch('\n'); emit_line("\t.data"); has_data = 1; }
+        if (gd->is_static == 0) { emit_sym_line("\t.globl\t", gd->name); }
+        emit_line("\t.p2align\t3");
+        emit_sym_label(gd->name);
+        emit_s("\t.quad\t"); emit_num(gd->init_val); emit_ch('\n');
+      } else {
+        // Uninitialized (tentative def): skip if an initialized def exists
+        int skip_tentative = 0;
+        int ti = 0;
+        while (ti < prog->nglobals) {
+          if (ti != i) {
+            struct GDecl *tgd = prog->globals[ti];
+            if (tgd != 0 && tgd >= 4096) {
+              if (my_strcmp(tgd->name, gd->name) == 0) {
+                if (tgd->has_init || tgd->init_list != 0 || tgd->init_str != 0) {
+                  skip_tentative = 1;
+                }
+              }
+            }
+          }
+          ti++;
+        }
+        if (skip_tentative) { i++; continue; }
+        // Uninitialized: use .comm (or .zerofill for static)
+        int gsz = 8;
+        if (gd->stype != 0 && gd->is_ptr == 0) {
+          gsz = cg_struct_byte_size(gd->stype);
+        }
+        cg_emit_bss(gd->name, gsz, gd->is_static);
+      }
+      i++;
+    }
+  }
+  return 0;
+}
+
+// Zero-initialized storage for a global, 8-byte aligned. ELF has no
+// .zerofill; a .local symbol makes .comm allocate it in .bss instead
+int cg_emit_bss(int *name, int sz, int is_static) {
+  if (target_elf) {
+    if (is_static) { emit_sym_line("\t.local\t", name); }
+    emit_s("\t.comm\t"); emit_s(name);
+    emit_s(", "); emit_num(sz); emit_line(", 8");
+  } else if (is_static) {
+    emit_s("\t.zerofill __DATA,__bss,_"); emit_s(name);
+    emit_s(","); emit_num(sz); emit_line(",3");
+  } else {
+    emit_s("\t.comm\t_"); emit_s(name);
+    emit_s(", "); emit_num(sz); emit_line(", 3");
+  }
+  return 0;
+}
+
+int cg_emit_strings() {
+  int i = 0;
+  // String pool (emitted last so globals/static locals can intern strings)
+  if (nsp > 0) {
+    emit_ch('\n');
+    if (target_elf) { emit_line("\t.section\t.rodata.str1.1,\"aMS\",@progbits,1"); }
+    else { emit_line("\t.section\t__TEXT,__cstring,cstring_literals"); }
+    i = 0;
+    while (i < nsp) {
+      emit_s(sp_label[i]); emit_line(":");
+      emit_s("\t.asciz\t\"");
+      cg_emit_escaped_string(sp_decoded[i]);
+      emit_line("\"");
+      i++;
+    }
+  }
+  return 0;
+}
+
+int cg_emit_jump_tables() {
+  if (njt == 0) return 0;
+  emit_ch('\n');
+  if (target_elf) { emit_line("\t.section\t.rodata"); }
+  else { emit_line("\t.section\t__TEXT,__const"); }
+  emit_line("\t.p2align\t2");
+  for (int t = 0; t < njt; t++) {
+    emit_s(jt_label[t]); emit_line(":");
+    for (int k = 0; k < jt_count[t]; k++) {
+      emit_s("\t.long\t"); emit_s(jt_entry[jt_first[t] + k]); emit_ch('-'); emit_line(jt_label[t]);
+    }
+  }
+  return 0;
+}
+
+int codegen(struct Program *prog) {
+  struct FuncDef *fd = 0;
+  struct GDecl *gd = 0;
+  int i = 0;
+  int k = 0;
+  int ch = 0;
+  label_id = 0;
+  nsp = 0;
+  njt = 0;
+  njt_entry = 0;
+  nloop = 0;
+  ncg_s = 0;
+  nx_clear(cg_s_ix);
+  n_ptr_ret = 0;
+  n_unsigned_ret = 0;
+  nsl = 0;
+
+  cg_register_functions(prog);
+  cg_register_globals(prog);
+  cg_register_structs(prog);
+  if (use_inline) { inline_program(prog); }
+
+  // The same deployment target clang puts in objects it assembles
+  if (!target_elf) { emit_line("\t.build_version macos, 11, 0"); }
+  emit_line("\t.text");
+
+  i = 0;
+  // Whatever one function allocates goes once its text has been passed on
+  while (i < prog->nfuncs) {
+    rep_func_begin();
+    arena_use(AR_FUNC);
+    gen_func(prog->funcs[i]);
+    arena_use(AR_PERM);
+    out_flush();
+    arena_reset(AR_FUNC, 0);
+    rep_func_end(prog->funcs[i]->name);
+    i++;
+  }
+
+  cg_emit_globals(prog);
+
+  // Emit static local variables
+  if (nsl > 0) {
+    emit_ch('\n');
+    emit_line("\t.data");
+    i = 0;
+    while (i < nsl) {
+      emit_line("\t.p2align\t3");
+      emit_s(sl[i].label);
+      emit_line(":");
+      if (sl[i].has_init == 2 && sl[i].init_list != 0) {
+        // Init list for static local array
+        int si_j = 0;
+        int si_n = sl[i].init_list->nargs;
+        int si_arr = sl[i].arr_size;
+        if (si_arr < 0) { si_arr = si_n; }
+        // Char-array slot map for static local struct arrays
+        int *sl_ca_map = 0;
+        int *sl_ca_off = 0;
+        int sl_nfpe = 1;
+        if (sl[i].stype != 0) {
+          sl_nfpe = cg_struct_nfields(sl[i].stype);
+          int sl_si = cg_find_struct_index(cg_resolve_sname(sl[i].stype));
+          if (sl_nfpe > 1 && sl_si >= 0) {
+            cg_struct_ca_map(sl_si);
+            sl_ca_map = cg_s_ca_len[sl_si];
+            sl_ca_off = cg_s_ca_off[sl_si];
+          }
+        }
+        while (si_j < si_arr) {
+          if (si_j < si_n && sl[i].init_list->args[si_j] != 0 && sl[i].init_list->args[si_j]->kind == ND_NUM) {
+            emit_s("\t.quad\t"); emit_num(sl[i].init_list->args[si_j]->ival); emit_ch('\n');
+          } else if (si_j < si_n && sl[i].init_list->args[si_j] != 0 && sl[i].init_list->args[si_j]->kind == ND_STRLIT) {
+            if (sl_ca_map != 0 && sl_ca_map[si_j % sl_nfpe] > 0 && sl_ca_off[si_j % sl_nfpe] == 0) {
+              // Pack string bytes into .quad hex for char array field
+              int *decoded = cg_decode_string(sl[i].init_list->args[si_j]->sval);
               int plen = my_strlen(decoded);
-              int byte_start = 0;
-              if (ca_slot_byte_off != 0) { byte_start = ca_slot_byte_off[fsi % nf_per_elem]; }
-              int packed_lo = 0;
-              int packed_hi = 0;
+              int packed = 0;
               int pi = 0;
-              while (pi < 4 && (byte_start + pi) < plen) {
-                int byte_val = __read_byte(decoded, byte_start + pi);
-                packed_lo = packed_lo | (byte_val << (pi * 8));
-                pi++;
-              }
-              while (pi < 8 && (byte_start + pi) < plen) {
-                int byte_val = __read_byte(decoded, byte_start + pi);
-                packed_hi = packed_hi | (byte_val << ((pi - 4) * 8));
+              while (pi < 8 && pi < plen) {
+                packed = packed | (__read_byte(decoded, pi) << (pi * 8));
                 pi++;
               }
-              // Emit as hex: high 32 bits then low 32 bits
               emit_s("\t.quad\t0x");
-              int hi = 7;
-              while (hi >= 0) {
-                int nibble = (packed_hi >> (hi * 4)) & 0xF;
-                if (nibble < 10) { emit_ch('0' + nibble); }
-                else { emit_ch('a' + nibble - 10); }
-                hi = hi - 1;
-              }
-              hi = 7;
+              int hi = 15;
               while (hi >= 0) {
-                int nibble = (packed_lo >> (hi * 4)) & 0xF;
+                int nibble = (packed >> (hi * 4)) & 0xF;
                 if (nibble < 10) { emit_ch('0' + nibble); }
                 else { emit_ch('a' + nibble - 10); }
                 hi = hi - 1;
               }
               emit_ch('\n');
             } else {
-              int *slabel = cg_intern_string(fe->sval);
-              emit_s("\t.quad\t"); emit_line(slabel);
+              int *sl_str_label = cg_intern_string(sl[i].init_list->args[si_j]->sval);
+              emit_s("\t.quad\t"); emit_s(sl_str_label); emit_ch('\n');
             }
-          } else if (fe->kind == ND_VAR) {
-            emit_s("\t.quad\t_"); emit_line(fe->sval);
-          } else if (fe->kind == ND_UNARY && fe->ival == '&' && fe->left != 0 && fe->left->kind == ND_VAR) {
-            emit_s("\t.quad\t_"); emit_line(fe->left->sval);
-          } else if (fe->kind == ND_CAST && fe->left != 0 && fe->left->kind == ND_NUM) {
-            emit_s(gd_dir); emit_num(fe->left->ival); emit_ch('\n');
-          } else if (fe->kind == ND_CAST && fe->left != 0 && fe->left->kind == ND_VAR) {
-            emit_s("\t.quad\t_"); emit_line(fe->left->sval);
           } else {
-            int cval = 0;
-            if (try_eval_const(fe, &cval)) {
-              emit_s(gd_dir); emit_num(cval); emit_ch('\n');
-            } else {
-              emit_s(gd_dir); emit_line("0");
-            }
-          }
-          fsi++;
-        }
-      } else if (gd->array_size >= 0 && gd->init_str != 0) {
-        // String-initialized array
-        int *decoded = cg_decode_string(gd->init_str);
-        int slen = my_strlen(decoded) + 1;
-        if (has_data == 0) { emit_ch('\n'); emit_line("\t.data"); has_data = 1; }
-        if (gd->is_static == 0) { emit_s("\t.globl\t_"); emit_line(gd->name); }
-        if (gd->is_char && gd->is_ptr == 0) {
-          // Bare char array: emit .byte per character
-          emit_line("\t.p2align\t0");
-          emit_s("_"); emit_s(gd->name); emit_line(":");
-          k = 0;
-          while (k < slen && k < gd->array_size) {
-            ch = __read_byte(decoded, k);
-            emit_s("\t.byte\t"); emit_num(ch); emit_ch('\n');
-            k++;
-          }
-          // Zero-pad remaining bytes if array_size > slen
-          while (k < gd->array_size) {
-            emit_line("\t.byte\t0");
-            k++;
-          }
-        } else {
-          // Non-char array: emit element-sized directives per character
-          int nc_esz = 8;
-          if (gd->is_short && gd->is_ptr == 0) { nc_esz = 2; }
-          else if (gd->is_char == 0 && gd->is_ptr == 0 && gd->stype == 0 && gd->is_long == 0) { nc_esz = 4; }
-          if (nc_esz == 4) { emit_line("\t.p2align\t2"); }
-          else if (nc_esz == 2) { emit_line("\t.p2align\t1"); }
-          else { emit_line("\t.p2align\t3"); }
-          emit_s("_"); emit_s(gd->name); emit_line(":");
-          k = 0;
-          while (k < slen && k < gd->array_size) {
-            ch = __read_byte(decoded, k);
-            if (nc_esz == 4) { emit_s("\t.long\t"); }
-            else if (nc_esz == 2) { emit_s("\t.short\t"); }
-            else { emit_s("\t.quad\t"); }
-            emit_num(ch); emit_ch('\n');
-            k++;
+            emit_line("\t.quad\t0");
           }
+          si_j++;
         }
-      } else if (gd->array_size >= 0) {
-        // Uninitialized array: use .comm (or .zerofill for static)
-        int elem_sz = 8;
-        if (gd->is_char && gd->is_ptr == 0) {
-          elem_sz = 1;
-        } else if (gd->stype != 0 && gd->is_ptr == 0) {
-          elem_sz = cg_struct_byte_size(gd->stype);
-        } else if (gd->is_short && gd->is_ptr == 0) {
-          elem_sz = 2;
-        } else if (gd->is_char == 0 && gd->is_ptr == 0 && gd->stype == 0 && gd->is_long == 0) {
-          elem_sz = 4;
-        }
-        if (gd->is_ptr > 0) { elem_sz = 8; }
-        int sz = gd->array_size * elem_sz;
-        if (sz == 0 && gd->stype != 0) { sz = elem_sz; }
-        if (gd->is_static) {
-          emit_s("\t.zerofill __DATA,__bss,_");
-          emit_s(gd->name);
-          emit_s(","); emit_num(sz); emit_line(",3");
+      } else if (sl[i].has_init == 1) {
+        emit_s("\t.quad\t");
+        emit_num(sl[i].init_val);
+        emit_ch('\n');
+      } else {
+        emit_line("\t.quad\t0");
+      }
+      i++;
+    }
+  }
+
+  cg_emit_strings();
+  cg_emit_jump_tables();
+
+  return 0;
+}
+
+
+// ---- Assembler ----
+// Encodes the ARM64 text in outbuf into section contents, symbols and
+// relocations. Every instruction is four bytes, so one pass is enough:
+// operands that name labels record fixups, and as_resolve() patches them or
+// turns them into relocations once every label is known.
+
+int *as_sec_seg[MAX_AS_SECTS];    // segment name
+int *as_sec_name[MAX_AS_SECTS];   // section name
+int as_sec_flags[MAX_AS_SECTS];   // Mach-O section type and attributes
+int as_sec_align[MAX_AS_SECTS];   // log2 of the largest alignment requested
+int *as_sec_buf[MAX_AS_SECTS];    // contents (none for zerofill sections)
+int as_sec_cap[MAX_AS_SECTS];
+int as_sec_size[MAX_AS_SECTS];
+int as_sec_atom[MAX_AS_SECTS];    // last non-temporary symbol defined in it
+int as_sec_nrel[MAX_AS_SECTS];
+long as_sec_addr[MAX_AS_SECTS];   // assigned when the object is laid out
+int as_nsect;
+int as_cur;
+
+int *as_sym_name[MAX_AS_SYMS];
+int as_sym_sect[MAX_AS_SYMS];     // -1 while undefined
+int as_sym_off[MAX_AS_SYMS];
+int as_sym_atom[MAX_AS_SYMS];     // what relocations name instead of a temporary label
+int as_sym_global[MAX_AS_SYMS];
+int as_sym_comm[MAX_AS_SYMS];     // .comm size, 0 if not common
+int as_sym_comm_align[MAX_AS_SYMS];
+int as_sym_next[MAX_AS_SYMS];     // hash chain
+int as_sym_index[MAX_AS_SYMS];    // position in the object's symbol table
+int as_sym_head[MAX_AS_BUCKETS];
+int as_nsym;
+
+int as_fx_sect[MAX_AS_FIXUPS];
+int as_fx_off[MAX_AS_FIXUPS];
+int as_fx_kind[MAX_AS_FIXUPS];
+int as_fx_sym[MAX_AS_FIXUPS];
+int as_fx_sym2[MAX_AS_FIXUPS];    // FX_DATA: symbol subtracted, -1 if none
+int as_fx_arg[MAX_AS_FIXUPS];     // FX_DATA: size in bytes; FX_PAGEOFF: log2 access size
+long as_fx_add[MAX_AS_FIXUPS];
+int as_nfx;
+
+// Relocations in creation order; each section's list is written back to front
+int as_rl_sect[MAX_AS_FIXUPS];
+int as_rl_off[MAX_AS_FIXUPS];
+int as_rl_type[MAX_AS_FIXUPS];
+int as_rl_pcrel[MAX_AS_FIXUPS];
+int as_rl_len[MAX_AS_FIXUPS];     // log2 of the patched size
+int as_rl_sym[MAX_AS_FIXUPS];     // -1 for ARM64_RELOC_ADDEND
+long as_rl_val[MAX_AS_FIXUPS];    // the addend of an ARM64_RELOC_ADDEND
+int as_nrl;
+
+// .build_version: platform (0 if none was given), minimum OS and SDK, each
+// version packed as major << 16 | minor << 8 | patch
+int as_build_platform;
+int as_build_minos;
+int as_build_sdk;
+
+int *as_mn_name[MAX_AS_MNEMONICS];
+int as_mn_class[MAX_AS_MNEMONICS];
+long as_mn_aux[MAX_AS_MNEMONICS];
+int as_mn_next[MAX_AS_MNEMONICS];
+int as_mn_head[256];
+int as_nmn;
+
+// Operands of the instruction being assembled
+int as_nop;
+int as_ok[8];      // OPK_*
+int as_or[8];      // register, or base register of a memory operand
+int as_ork[8];     // RK_* of as_or
+int as_osp[8];     // register 31 names sp rather than zr
+int as_oq[8];      // vector register with a 16-byte arrangement
+int as_ox[8];      // index register of a memory operand, -1 if none
+int as_os[8];      // shift or extend (SH_*), -1 if none
+int as_oa[8];      // its amount, -1 if not written
+long as_ov[8];     // immediate, memory offset or symbol addend
+int as_osym[8];    // start of the operand's name in as_text, -1 if none
+int as_olen[8];
+int as_omod[8];    // AM_* relocation modifier
+int as_owb[8];     // memory operand ends in '!'
+
+int *as_text;     // the text being parsed, outbuf unless lowering
+int as_line;       // start of the line being assembled
+int as_end;        // its end
+int as_p;
+int as_preg;       // results of as_reg_at
+int as_prk;
+int as_psp;
+int as_pq;
+
+int as_error(int *msg) {
+  printf("cc: as: %s: ", msg);
+  int i = as_line;
+  while (i < as_end) { printf("%c", __read_byte(as_text, i)); i++; }
+  printf("\n");
+  exit(1);
+  return 0;
+}
+
+int as_def(int *name, int cls, long aux) {
+  int h = 0;
+  int i = 0;
+  while (__read_byte(name, i) != 0) { h = h * 31 + __read_byte(name, i); i++; }
+  h = h & 255;
+  as_mn_name[as_nmn] = name;
+  as_mn_class[as_nmn] = cls;
+  as_mn_aux[as_nmn] = aux;
+  as_mn_next[as_nmn] = as_mn_head[h];
+  as_mn_head[h] = as_nmn;
+  as_nmn++;
+  return 0;
+}
+
+// The instruction table: mnemonic, encoding class and the bits that tell
+// members of a class apart
+int as_init_mnemonics() {
+  for (int i = 0; i < 256; i++) { as_mn_head[i] = 0 - 1; }
+  as_nmn = 0;
+  as_def("add", AC_ADDSUB, 0); as_def("adds", AC_ADDSUB, 1);
+  as_def("sub", AC_ADDSUB, 2); as_def("subs", AC_ADDSUB, 3);
+  as_def("cmn", AC_CMP, 1); as_def("cmp", AC_CMP, 3);
+  as_def("neg", AC_NEG, 2); as_def("negs", AC_NEG, 3);
+  as_def("and", AC_LOGIC, 0); as_def("orr", AC_LOGIC, 1);
+  as_def("eor", AC_LOGIC, 2); as_def("ands", AC_LOGIC, 3);
+  as_def("bic", AC_LOGIC, 4); as_def("orn", AC_LOGIC, 5);
+  as_def("eon", AC_LOGIC, 6); as_def("bics", AC_LOGIC, 7);
+  as_def("tst", AC_TST, 3); as_def("mvn", AC_MVN, 5);
+  as_def("mov", AC_MOV, 0);
+  as_def("movn", AC_MOVW, 0); as_def("movz", AC_MOVW, 2); as_def("movk", AC_MOVW, 3);
+  as_def("lsl", AC_SHIFT, 0); as_def("lsr", AC_SHIFT, 1);
+  as_def("asr", AC_SHIFT, 2); as_def("ror", AC_SHIFT, 3);
+  as_def("sxtb", AC_EXTEND, 256 + 7); as_def("sxth", AC_EXTEND, 256 + 15);
+  as_def("sxtw", AC_EXTEND, 256 + 31);
+  as_def("uxtb", AC_EXTEND, 7); as_def("uxth", AC_EXTEND, 15);
+  as_def("rbit", AC_DP1, 0x5AC00000); as_def("rev16", AC_DP1, 0x5AC00400);
+  as_def("rev", AC_DP1, 0x5AC00C00); as_def("rev32", AC_DP1, 0x5AC00800);
+  as_def("clz", AC_DP1, 0x5AC01000); as_def("cls", AC_DP1, 0x5AC01400);
+  as_def("udiv", AC_DP2, 0x1AC00800); as_def("sdiv", AC_DP2, 0x1AC00C00);
+  as_def("lslv", AC_DP2, 0x1AC02000); as_def("lsrv", AC_DP2, 0x1AC02400);
+  as_def("asrv", AC_DP2, 0x1AC02800); as_def("rorv", AC_DP2, 0x1AC02C00);
+  as_def("mul", AC_MUL, 0x1B007C00); as_def("mneg", AC_MUL, 0x1B00FC00);
+  as_def("smulh", AC_MUL, 0x9B407C00); as_def("umulh", AC_MUL, 0x9BC07C00);
+  as_def("smull", AC_MUL, 0x9B207C00); as_def("umull", AC_MUL, 0x9BA07C00);
+  as_def("madd", AC_MADD, 0x1B000000); as_def("msub", AC_MADD, 0x1B008000);
+  as_def("csel", AC_CSEL, 0x1A800000); as_def("csinc", AC_CSEL, 0x1A800400);
+  as_def("csinv", AC_CSEL, 0x5A800000); as_def("csneg", AC_CSEL, 0x5A800400);
+  as_def("cset", AC_CSET, 0x1A800400); as_def("csetm", AC_CSET, 0x5A800000);
+  as_def("cinc", AC_CINC, 0x1A800400); as_def("cinv", AC_CINC, 0x5A800000);
+  as_def("cneg", AC_CINC, 0x5A800400);
+  // Loads and stores: size | opc << 2, 16 = size from the register,
+  // 32 = sign-extending to the register's width, 64 = unscaled only
+  as_def("str", AC_LDST, 16); as_def("ldr", AC_LDST, 16 + 4);
+  as_def("strb", AC_LDST, 0); as_def("ldrb", AC_LDST, 4); as_def("ldrsb", AC_LDST, 32);
+  as_def("strh", AC_LDST, 1); as_def("ldrh", AC_LDST, 5); as_def("ldrsh", AC_LDST, 32 + 1);
+  as_def("ldrsw", AC_LDST, 2 + 8);
+  as_def("stur", AC_LDST, 64 + 16); as_def("ldur", AC_LDST, 64 + 16 + 4);
+  as_def("sturb", AC_LDST, 64); as_def("ldurb", AC_LDST, 64 + 4); as_def("ldursb", AC_LDST, 64 + 32);
+  as_def("sturh", AC_LDST, 64 + 1); as_def("ldurh", AC_LDST, 64 + 5); as_def("ldursh", AC_LDST, 64 + 32 + 1);
+  as_def("ldursw", AC_LDST, 64 + 2 + 8);
+  as_def("stp", AC_LDP, 0); as_def("ldp", AC_LDP, 1); as_def("ldpsw", AC_LDP, 3);
+  as_def("b", AC_B, 0); as_def("bl", AC_B, 1);
+  as_def("b.eq", AC_BCOND, 0); as_def("b.ne", AC_BCOND, 1);
+  as_def("b.hs", AC_BCOND, 2); as_def("b.cs", AC_BCOND, 2);
+  as_def("b.lo", AC_BCOND, 3); as_def("b.cc", AC_BCOND, 3);
+  as_def("b.mi", AC_BCOND, 4); as_def("b.pl", AC_BCOND, 5);
+  as_def("b.vs", AC_BCOND, 6); as_def("b.vc", AC_BCOND, 7);
+  as_def("b.hi", AC_BCOND, 8); as_def("b.ls", AC_BCOND, 9);
+  as_def("b.ge", AC_BCOND, 10); as_def("b.lt", AC_BCOND, 11);
+  as_def("b.gt", AC_BCOND, 12); as_def("b.le", AC_BCOND, 13);
+  as_def("b.al", AC_BCOND, 14);
+  as_def("cbz", AC_CB, 0); as_def("cbnz", AC_CB, 1);
+  as_def("tbz", AC_TB, 0); as_def("tbnz", AC_TB, 1);
+  as_def("br", AC_BR, 0xD61F0000); as_def("blr", AC_BR, 0xD63F0000);
+  as_def("ret", AC_BR, 0xD65F0000);
+  as_def("adrp", AC_ADRP, 0);
+  as_def("nop", AC_NOP, 0xD503201F);
+  as_def("fmov", AC_FMOV, 0);
+  as_def("scvtf", AC_FCVTI, 0); as_def("ucvtf", AC_FCVTI, 1);
+  as_def("fcvtzs", AC_FCVTI, 2); as_def("fcvtzu", AC_FCVTI, 3);
+  as_def("fcvt", AC_FCVT, 0);
+  as_def("fneg", AC_FP1, 0x1E214000); as_def("fabs", AC_FP1, 0x1E20C000);
+  as_def("fsqrt", AC_FP1, 0x1E21C000);
+  as_def("fadd", AC_FP2, 0x1E202800); as_def("fsub", AC_FP2, 0x1E203800);
+  as_def("fmul", AC_FP2, 0x1E200800); as_def("fdiv", AC_FP2, 0x1E201800);
+  as_def("fcmp", AC_FCMP, 0); as_def("fcmpe", AC_FCMP, 16);
+  as_def("cnt", AC_SIMD, 0x0E205800); as_def("addv", AC_SIMD, 0x0E31B800);
+  return 0;
+}
+
+int as_lookup_mnemonic(int st, int len) {
+  int h = 0;
+  for (int i = 0; i < len; i++) { h = h * 31 + __read_byte(as_text, st + i); }
+  int m = as_mn_head[h & 255];
+  while (m >= 0) {
+    int *nm = as_mn_name[m];
+    int k = 0;
+    while (k < len && __read_byte(nm, k) == __read_byte(as_text, st + k)) { k++; }
+    if (k == len && __read_byte(nm, len) == 0) return m;
+    m = as_mn_next[m];
+  }
+  return 0 - 1;
+}
+
+// ---- Assembler: symbols and sections ----
+
+int as_intern(int *buf, int start, int len) {
+  int h = 0;
+  for (int i = 0; i < len; i++) { h = h * 31 + __read_byte(buf, start + i); }
+  h = h & (MAX_AS_BUCKETS - 1);
+  int s = as_sym_head[h];
+  while (s >= 0) {
+    int *nm = as_sym_name[s];
+    int k = 0;
+    while (k < len && __read_byte(nm, k) == __read_byte(buf, start + k)) { k++; }
+    if (k == len && __read_byte(nm, len) == 0) return s;
+    s = as_sym_next[s];
+  }
+  if (as_nsym >= MAX_AS_SYMS) { my_fatal("too many assembler symbols"); }
+  s = as_nsym;
+  as_nsym++;
+  as_sym_name[s] = make_str(buf, start, len);
+  as_sym_sect[s] = 0 - 1;
+  as_sym_off[s] = 0;
+  as_sym_atom[s] = s;
+  as_sym_global[s] = 0;
+  as_sym_comm[s] = 0;
+  as_sym_comm_align[s] = 0;
+  as_sym_next[s] = as_sym_head[h];
+  as_sym_head[h] = s;
+  return s;
+}
+
+// Temporary labels never reach the object's symbol table
+int as_is_temp(int s) {
+  return __read_byte(as_sym_name[s], 0) == 'L';
+}
+
+int as_define(int s, int sect, int off) {
+  if (as_sym_sect[s] >= 0) { as_error("symbol already defined"); }
+  as_sym_sect[s] = sect;
+  as_sym_off[s] = off;
+  if (as_is_temp(s)) { as_sym_atom[s] = as_sec_atom[sect]; } else { as_sec_atom[sect] = s; }
+  return 0;
+}
+
+int as_section(int *seg, int *name, int flags) {
+  for (int i = 0; i < as_nsect; i++) {
+    if (my_strcmp(as_sec_seg[i], seg) == 0 && my_strcmp(as_sec_name[i], name) == 0) return i;
+  }
+  if (as_nsect >= MAX_AS_SECTS) { my_fatal("too many sections"); }
+  int s = as_nsect;
+  as_nsect++;
+  as_sec_seg[s] = seg;
+  as_sec_name[s] = name;
+  as_sec_flags[s] = flags;
+  as_sec_align[s] = 0;
+  as_sec_size[s] = 0;
+  as_sec_cap[s] = 0;
+  as_sec_buf[s] = 0;
+  if ((flags & 255) != 1) {
+    as_sec_cap[s] = 4096;
+    as_sec_buf[s] = my_malloc(as_sec_cap[s]);
+  }
+  // Every section starts with a local symbol for temporaries at its head
+  int *nm = my_malloc(16);
+  __write_byte(nm, 0, 'l'); __write_byte(nm, 1, 't'); __write_byte(nm, 2, 'm'); __write_byte(nm, 3, 'p');
+  int k = 4;
+  if (s >= 10) { __write_byte(nm, k, '0' + s / 10); k++; }
+  __write_byte(nm, k, '0' + s % 10);
+  k++;
+  int sym = as_intern(nm, 0, k);
+  as_sym_sect[sym] = s;
+  as_sym_off[sym] = 0;
+  as_sec_atom[s] = sym;
+  return s;
+}
+
+int as_byte(int c) {
+  int s = as_cur;
+  if (as_sec_buf[s] == 0) { as_error("data in a zerofill section"); }
+  if (as_sec_size[s] >= as_sec_cap[s]) {
+    int ncap = as_sec_cap[s] * 2;
+    int *nb = my_malloc(ncap);
+    for (int i = 0; i < as_sec_size[s]; i++) { __write_byte(nb, i, __read_byte(as_sec_buf[s], i)); }
+    as_sec_buf[s] = nb;
+    as_sec_cap[s] = ncap;
+  }
+  __write_byte(as_sec_buf[s], as_sec_size[s], c & 255);
+  as_sec_size[s]++;
+  return 0;
+}
+
+int as_data(long v, int size) {
+  for (int i = 0; i < size; i++) { as_byte(v & 255); v = v >> 8; }
+  return 0;
+}
+
+int as_word(long w) {
+  as_sec_flags[as_cur] = as_sec_flags[as_cur] | 0x400;
+  return as_data(w, 4);
+}
+
+int as_align(int p2) {
+  int s = as_cur;
+  if (p2 > as_sec_align[s]) { as_sec_align[s] = p2; }
+  int a = 1 << p2;
+  if (as_sec_buf[s] == 0) {
+    as_sec_size[s] = (as_sec_size[s] + a - 1) & (0 - a);
+    return 0;
+  }
+  while (as_sec_size[s] & (a - 1)) {
+    if ((as_sec_flags[s] & 0x80000000) != 0 && (as_sec_size[s] & 3) == 0) { as_data(0xD503201F, 4); }
+    else { as_byte(0); }
+  }
+  return 0;
+}
+
+int as_fixup(int kind, int sym, long add, int arg) {
+  if (as_nfx >= MAX_AS_FIXUPS) { my_fatal("too many fixups"); }
+  as_fx_sect[as_nfx] = as_cur;
+  as_fx_off[as_nfx] = as_sec_size[as_cur];
+  as_fx_kind[as_nfx] = kind;
+  as_fx_sym[as_nfx] = sym;
+  as_fx_sym2[as_nfx] = 0 - 1;
+  as_fx_arg[as_nfx] = arg;
+  as_fx_add[as_nfx] = add;
+  as_nfx++;
+  return as_nfx - 1;
+}
+
+// ---- Assembler: operand parsing ----
+
+int as_ch() {
+  if (as_p >= as_end) return '\n';
+  return __read_byte(as_text, as_p);
+}
+
+int as_skip() {
+  while (as_p < as_end && (__read_byte(as_text, as_p) == ' ' || __read_byte(as_text, as_p) == '\t')) { as_p++; }
+  return 0;
+}
+
+int as_is_ident(int c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '.' || c == '$';
+}
+
+int as_ident_end(int p) {
+  while (p < as_end && as_is_ident(__read_byte(as_text, p))) { p++; }
+  return p;
+}
+
+int as_is(int st, int len, int *s) {
+  int k = 0;
+  while (k < len && __read_byte(s, k) == __read_byte(as_text, st + k)) { k++; }
+  return k == len && __read_byte(s, len) == 0;
+}
+
+int as_expect(int c) {
+  as_skip();
+  if (as_ch() != c) { as_error("syntax error"); }
+  as_p++;
+  return 0;
+}
+
+long as_number() {
+  as_skip();
+  if (as_ch() == '#') { as_p++; }
+  int neg = 0;
+  if (as_ch() == '-') { neg = 1; as_p++; } else if (as_ch() == '+') { as_p++; }
+  int c = as_ch();
+  if (c < '0' || c > '9') { as_error("expected a number"); }
+  long v = 0;
+  if (c == '0' && as_p + 1 < as_end && (__read_byte(as_text, as_p + 1) == 'x' || __read_byte(as_text, as_p + 1) == 'X')) {
+    as_p = as_p + 2;
+    while (1) {
+      c = as_ch();
+      if (c >= '0' && c <= '9') { v = v * 16 + c - '0'; }
+      else if (c >= 'a' && c <= 'f') { v = v * 16 + c - 'a' + 10; }
+      else if (c >= 'A' && c <= 'F') { v = v * 16 + c - 'A' + 10; }
+      else { break; }
+      as_p++;
+    }
+  } else {
+    while (c >= '0' && c <= '9') { v = v * 10 + c - '0'; as_p++; c = as_ch(); }
+  }
+  if (neg) { v = 0 - v; }
+  return v;
+}
+
+// fmov's 8-bit immediate for the decimal at as_p, 256 for zero
+long as_fp_imm() {
+  as_skip();
+  if (as_ch() == '#') { as_p++; }
+  int neg = 0;
+  if (as_ch() == '-') { neg = 1; as_p++; }
+  long num = 0;
+  long den = 1;
+  int frac = 0;
+  int c = as_ch();
+  while ((c >= '0' && c <= '9') || c == '.') {
+    if (c == '.') { frac = 1; }
+    else { num = num * 10 + c - '0'; if (frac) { den = den * 10; } }
+    as_p++;
+    c = as_ch();
+  }
+  if (num == 0) return 256;
+  // value * 128 = (16 + frac4) << e for e in 0..7
+  if ((num * 128) % den != 0) { as_error("floating-point immediate not encodable"); }
+  long v128 = num * 128 / den;
+  for (int imm = 0; imm < 128; imm++) {
+    int e = ((imm >> 4) & 3) + 4;
+    if (imm & 64) { e = (imm >> 4) & 3; }
+    if (((16 + (imm & 15)) << e) == v128) { return imm | (neg << 7); }
+  }
+  as_error("floating-point immediate not encodable");
+  return 0;
+}
+
+// Register name in as_text[p, p + len): sets as_preg/as_prk/as_psp/as_pq
+int as_reg_at(int p, int len) {
+  int c = __read_byte(as_text, p);
+  as_psp = 0;
+  as_pq = 0;
+  if (len == 2 && as_is(p, 2, "sp")) { as_preg = 31; as_prk = RK_X; as_psp = 1; return 1; }
+  if (len == 3 && as_is(p, 3, "wsp")) { as_preg = 31; as_prk = RK_W; as_psp = 1; return 1; }
+  if (len == 3 && as_is(p, 3, "xzr")) { as_preg = 31; as_prk = RK_X; return 1; }
+  if (len == 3 && as_is(p, 3, "wzr")) { as_preg = 31; as_prk = RK_W; return 1; }
+  if (len == 2 && as_is(p, 2, "fp")) { as_preg = 29; as_prk = RK_X; return 1; }
+  if (len == 2 && as_is(p, 2, "lr")) { as_preg = 30; as_prk = RK_X; return 1; }
+  int kind = 0 - 1;
+  if (c == 'x') { kind = RK_X; }
+  else if (c == 'w') { kind = RK_W; }
+  else if (c == 'd') { kind = RK_D; }
+  else if (c == 's') { kind = RK_S; }
+  else if (c == 'h') { kind = RK_H; }
+  else if (c == 'b') { kind = RK_B; }
+  else if (c == 'q') { kind = RK_Q; }
+  else if (c == 'v') { kind = RK_V; }
+  if (kind < 0 || len < 2) return 0;
+  int n = 0;
+  int i = 1;
+  while (i < len && __read_byte(as_text, p + i) >= '0' && __read_byte(as_text, p + i) <= '9') {
+    n = n * 10 + __read_byte(as_text, p + i) - '0';
+    i++;
+  }
+  if (i == 1 || i > 3 || n > 31) return 0;
+  if (kind == RK_V && i < len && __read_byte(as_text, p + i) == '.') {
+    if (__read_byte(as_text, p + i + 1) == '1') { as_pq = 1; }
+    i = len;
+  }
+  if (i != len) return 0;
+  if (n == 31 && (kind == RK_X || kind == RK_W)) return 0;
+  as_preg = n;
+  as_prk = kind;
+  return 1;
+}
+
+int as_shift_kind(int st, int len) {
+  if (len != 3 && len != 4) return 0 - 1;
+  if (as_is(st, len, "lsl")) return SH_LSL;
+  if (as_is(st, len, "lsr")) return SH_LSR;
+  if (as_is(st, len, "asr")) return SH_ASR;
+  if (as_is(st, len, "ror")) return SH_ROR;
+  if (as_is(st, len, "uxtb")) return SH_UXTB;
+  if (as_is(st, len, "uxth")) return SH_UXTH;
+  if (as_is(st, len, "uxtw")) return SH_UXTW;
+  if (as_is(st, len, "uxtx")) return SH_UXTX;
+  if (as_is(st, len, "sxtb")) return SH_SXTB;
+  if (as_is(st, len, "sxth")) return SH_SXTH;
+  if (as_is(st, len, "sxtw")) return SH_SXTW;
+  if (as_is(st, len, "sxtx")) return SH_SXTX;
+  return 0 - 1;
+}
+
+// "lsl #n", "sxtw" etc. into as_os[i]/as_oa[i]
+int as_shift(int i) {
+  as_skip();
+  int st = as_p;
+  int e = as_ident_end(st);
+  as_os[i] = as_shift_kind(st, e - st);
+  if (as_os[i] < 0) { as_error("expected a shift or extend"); }
+  as_p = e;
+  as_skip();
+  if (as_ch() == '#') { as_oa[i] = as_number(); }
+  return 0;
+}
+
+// name[@MODIFIER][+-addend] or ELF's [:modifier:]name[+-addend] into
+// as_osym/as_olen/as_omod/as_ov
+int as_symref(int i) {
+  as_skip();
+  if (as_ch() == ':') {
+    int ms = as_p + 1;
+    int me = as_ident_end(ms);
+    if (as_is(ms, me - ms, "lo12")) { as_omod[i] = AM_PAGEOFF; }
+    else if (as_is(ms, me - ms, "got")) { as_omod[i] = AM_GOTPAGE; }
+    else if (as_is(ms, me - ms, "got_lo12")) { as_omod[i] = AM_GOTPAGEOFF; }
+    else { as_error("unknown relocation modifier"); }
+    as_p = me;
+    as_expect(':');
+  }
+  int st = as_p;
+  int e = as_ident_end(st);
+  if (e == st) { as_error("expected a symbol"); }
+  as_osym[i] = st;
+  as_olen[i] = e - st;
+  as_p = e;
+  if (as_ch() == '@') {
+    as_p++;
+    int ms = as_p;
+    int me = as_ident_end(ms);
+    if (as_is(ms, me - ms, "PAGE")) { as_omod[i] = AM_PAGE; }
+    else if (as_is(ms, me - ms, "PAGEOFF")) { as_omod[i] = AM_PAGEOFF; }
+    else if (as_is(ms, me - ms, "GOTPAGE")) { as_omod[i] = AM_GOTPAGE; }
+    else if (as_is(ms, me - ms, "GOTPAGEOFF")) { as_omod[i] = AM_GOTPAGEOFF; }
+    else { as_error("unknown relocation modifier"); }
+    as_p = me;
+  }
+  as_skip();
+  if ((as_ch() == '+' || as_ch() == '-') && as_p + 1 < as_end) {
+    int d = __read_byte(as_text, as_p + 1);
+    if (d >= '0' && d <= '9') { as_ov[i] = as_number(); }
+  }
+  return 0;
+}
+
+int as_operand(int i) {
+  as_skip();
+  as_os[i] = 0 - 1;
+  as_oa[i] = 0 - 1;
+  as_ox[i] = 0 - 1;
+  as_osym[i] = 0 - 1;
+  as_omod[i] = AM_NONE;
+  as_owb[i] = 0;
+  as_ov[i] = 0;
+  as_osp[i] = 0;
+  as_oq[i] = 0;
+  int c = as_ch();
+  if (c == '[') {
+    as_p++;
+    as_ok[i] = OPK_MEM;
+    as_skip();
+    int st = as_p;
+    int e = as_ident_end(st);
+    if (!as_reg_at(st, e - st)) { as_error("expected a base register"); }
+    as_or[i] = as_preg;
+    as_ork[i] = as_prk;
+    as_p = e;
+    as_skip();
+    if (as_ch() == ',') {
+      as_p++;
+      as_skip();
+      if (as_ch() == '#') {
+        as_ov[i] = as_number();
+      } else {
+        st = as_p;
+        e = as_ident_end(st);
+        if (as_reg_at(st, e - st)) {
+          as_ox[i] = as_preg;
+          as_p = e;
+          as_skip();
+          if (as_ch() == ',') { as_p++; as_shift(i); }
         } else {
-          emit_s("\t.comm\t_");
-          emit_s(gd->name);
-          emit_s(", ");
-          emit_num(sz);
-          emit_line(", 3");
+          as_symref(i);
         }
-      } else if (gd->init_list != 0 && gd->init_list->kind == ND_INITLIST) {
-        // Struct (non-array) with init list: struct S obj = {10, 20};
-        if (gd->stype != 0) { printf("cc: struct init '%s' stype='%s' nargs=%d\n", gd->name, gd->stype, gd->init_list->nargs); }
-        int nf_total = 0;
-        if (gd->stype != 0) { nf_total = cg_struct_nfields(gd->stype); }
-        if (nf_total < gd->init_list->nargs) { nf_total = gd->init_list->nargs; }
-        struct Expr **sflat = my_malloc(nf_total * 8);
-        fsi = 0;
-        while (fsi < nf_total) { sflat[fsi] = 0; fsi++; }
-        int **gs_di = gd->init_list->desig;
-        int gs_pos = 0;
-        k = 0;
-        while (k < gd->init_list->nargs) {
-          int gs_target = gs_pos;
-          if (gs_di != 0 && gs_di[k] >= 0) { gs_target = gs_di[k]; }
-          if (gs_target < nf_total) { sflat[gs_target] = gd->init_list->args[k]; }
-          gs_pos = gs_target + 1;
-          k++;
+      }
+    }
+    as_expect(']');
+    if (as_ch() == '!') { as_owb[i] = 1; as_p++; }
+    return 0;
+  }
+  if (c == '#') {
+    int q = as_p + 1;
+    while (q < as_end && __read_byte(as_text, q) != ',' && __read_byte(as_text, q) != '.') { q++; }
+    if (q < as_end && __read_byte(as_text, q) == '.') {
+      as_ok[i] = OPK_FIMM;
+      as_ov[i] = as_fp_imm();
+      return 0;
+    }
+  }
+  if (c == '#' || c == '-' || (c >= '0' && c <= '9')) {
+    as_ok[i] = OPK_IMM;
+    as_ov[i] = as_number();
+    return 0;
+  }
+  if (c == ':') {
+    as_ok[i] = OPK_SYM;
+    as_symref(i);
+    return 0;
+  }
+  int st = as_p;
+  int e = as_ident_end(st);
+  if (e == st) { as_error("bad operand"); }
+  if (as_reg_at(st, e - st)) {
+    as_ok[i] = OPK_REG;
+    as_or[i] = as_preg;
+    as_ork[i] = as_prk;
+    as_osp[i] = as_psp;
+    as_oq[i] = as_pq;
+    as_osym[i] = st;
+    as_olen[i] = e - st;
+    as_p = e;
+    return 0;
+  }
+  if (i > 0 && as_shift_kind(st, e - st) >= 0) {
+    as_ok[i] = OPK_SHIFT;
+    as_shift(i);
+    if (as_oa[i] < 0) { as_oa[i] = 0; }
+    return 0;
+  }
+  as_ok[i] = OPK_SYM;
+  as_symref(i);
+  return 0;
+}
+
+int as_need(int i, int kind) {
+  if (i >= as_nop) { as_error("missing operand"); }
+  if (as_ok[i] != kind) { as_error("invalid operand"); }
+  return 0;
+}
+
+// Symbol operand (a branch target may also look like a register name)
+int as_sym_of(int i) {
+  if (i >= as_nop || as_osym[i] < 0) { as_error("expected a symbol"); }
+  return as_intern(as_text, as_osym[i], as_olen[i]);
+}
+
+int as_cond(int i) {
+  if (i >= as_nop || as_osym[i] < 0 || as_olen[i] != 2) { as_error("expected a condition"); }
+  int st = as_osym[i];
+  if (as_is(st, 2, "eq")) return 0;
+  if (as_is(st, 2, "ne")) return 1;
+  if (as_is(st, 2, "hs") || as_is(st, 2, "cs")) return 2;
+  if (as_is(st, 2, "lo") || as_is(st, 2, "cc")) return 3;
+  if (as_is(st, 2, "mi")) return 4;
+  if (as_is(st, 2, "pl")) return 5;
+  if (as_is(st, 2, "vs")) return 6;
+  if (as_is(st, 2, "vc")) return 7;
+  if (as_is(st, 2, "hi")) return 8;
+  if (as_is(st, 2, "ls")) return 9;
+  if (as_is(st, 2, "ge")) return 10;
+  if (as_is(st, 2, "lt")) return 11;
+  if (as_is(st, 2, "gt")) return 12;
+  if (as_is(st, 2, "le")) return 13;
+  if (as_is(st, 2, "al")) return 14;
+  as_error("expected a condition");
+  return 0;
+}
+
+// Insert the zero register as operand i (cmp, neg, tst, mvn aliases)
+int as_insert_zr(int i, int kind) {
+  for (int k = as_nop; k > i; k--) {
+    as_ok[k] = as_ok[k - 1]; as_or[k] = as_or[k - 1]; as_ork[k] = as_ork[k - 1];
+    as_osp[k] = as_osp[k - 1]; as_oq[k] = as_oq[k - 1]; as_ox[k] = as_ox[k - 1];
+    as_os[k] = as_os[k - 1]; as_oa[k] = as_oa[k - 1]; as_ov[k] = as_ov[k - 1];
+    as_osym[k] = as_osym[k - 1]; as_olen[k] = as_olen[k - 1]; as_omod[k] = as_omod[k - 1];
+    as_owb[k] = as_owb[k - 1];
+  }
+  as_ok[i] = OPK_REG;
+  as_or[i] = 31;
+  as_ork[i] = kind;
+  as_osp[i] = 0;
+  as_osym[i] = 0 - 1;
+  as_nop++;
+  return 0;
+}
+
+// ---- Assembler: instruction encoding ----
+
+int as_popcount(long v) {
+  int n = 0;
+  while (v != 0) { n = n + (v & 1); v = (v >> 1) & low_bits(63); }
+  return n;
+}
+
+// N:immr:imms of a logical immediate, -1 if v has no encoding
+int as_bitmask(long v, int w) {
+  if (w) {
+    v = v & low_bits(32);
+    v = v | (v << 32);
+  }
+  if (v == 0 || v == 0 - 1) return 0 - 1;
+  int size = 64;
+  while (size > 2) {
+    int half = size / 2;
+    long hmask = low_bits(half);
+    if ((v & hmask) != ((v >> half) & hmask)) break;
+    size = half;
+  }
+  long mask = low_bits(size);
+  long elem = v & mask;
+  for (int r = 0; r < size; r++) {
+    long rot = elem;
+    if (r > 0) { rot = ((elem >> r) & low_bits(size - r)) | ((elem << (size - r)) & mask); }
+    if ((rot & (rot + 1)) == 0) {
+      int n = 0;
+      if (size == 64) { n = 1; }
+      int immr = (size - r) % size;
+      int imms = ((0 - 2 * size) & 63) | (as_popcount(rot) - 1);
+      return (n << 12) | (immr << 6) | imms;
+    }
+  }
+  return 0 - 1;
+}
+
+int as_mov_imm(long sf, long rd, long val) {
+  int bits = 32;
+  if (sf) { bits = 64; }
+  long v = val & low_bits(bits);
+  long nv = (0 - 1 - val) & low_bits(bits);
+  long chunk = 65535;
+  for (int hw = 0; hw < bits / 16; hw++) {
+    if ((v & (0 - 1 - (chunk << (16 * hw)))) == 0) {
+      return as_word(0x52800000 | (sf << 31) | (hw << 21) | (((v >> (16 * hw)) & 65535) << 5) | rd);
+    }
+  }
+  for (int hw = 0; hw < bits / 16; hw++) {
+    if ((nv & (0 - 1 - (chunk << (16 * hw)))) == 0) {
+      return as_word(0x12800000 | (sf << 31) | (hw << 21) | (((nv >> (16 * hw)) & 65535) << 5) | rd);
+    }
+  }
+  long enc = as_bitmask(v, 1 - sf);
+  if (enc < 0) { as_error("immediate not encodable"); }
+  return as_word(0x320003E0 | (sf << 31) | (enc << 10) | rd);
+}
+
+// add/adds/sub/subs; aux bit 0 sets flags, bit 1 subtracts
+int as_addsub(long aux) {
+  as_need(0, OPK_REG);
+  as_need(1, OPK_REG);
+  if (as_nop < 3) { as_error("missing operand"); }
+  long sf = as_ork[0] == RK_X;
+  long rd = as_or[0];
+  long rn = as_or[1];
+  long op = (aux >> 1) & 1;
+  long s = aux & 1;
+  if (as_ok[2] == OPK_IMM) {
+    long imm = as_ov[2];
+    long sh = 0;
+    if (as_nop > 3) {
+      as_need(3, OPK_SHIFT);
+      if (as_os[3] != SH_LSL || (as_oa[3] != 0 && as_oa[3] != 12)) { as_error("invalid shift"); }
+      if (as_oa[3] == 12) { sh = 1; }
+    }
+    if (imm < 0) { imm = 0 - imm; op = 1 - op; }
+    if (sh == 0 && imm > 4095 && (imm & 4095) == 0 && (imm >> 12) <= 4095) { imm = imm >> 12; sh = 1; }
+    if (imm > 4095) { as_error("immediate out of range"); }
+    return as_word(0x11000000 | (sf << 31) | (op << 30) | (s << 29) | (sh << 22) | (imm << 10) | (rn << 5) | rd);
+  }
+  if (as_ok[2] == OPK_SYM) {
+    if (as_omod[2] != AM_PAGEOFF) { as_error("expected @PAGEOFF"); }
+    as_fixup(FX_PAGEOFF, as_sym_of(2), as_ov[2], 0);
+    return as_word(0x11000000 | (sf << 31) | (op << 30) | (s << 29) | (rn << 5) | rd);
+  }
+  as_need(2, OPK_REG);
+  long rm = as_or[2];
+  long sht = SH_LSL;
+  long amt = 0;
+  if (as_nop > 3) {
+    as_need(3, OPK_SHIFT);
+    sht = as_os[3];
+    amt = as_oa[3];
+  }
+  if (as_osp[0] || as_osp[1] || sht >= SH_UXTB) {
+    long opt = sht - SH_UXTB;
+    if (sht < SH_UXTB) {
+      if (sht != SH_LSL) { as_error("invalid shift"); }
+      opt = 2 + sf;
+    }
+    return as_word(0x0B200000 | (sf << 31) | (op << 30) | (s << 29) | (rm << 16) | (opt << 13) | (amt << 10) | (rn << 5) | rd);
+  }
+  if (sht > SH_ASR) { as_error("invalid shift"); }
+  return as_word(0x0B000000 | (sf << 31) | (op << 30) | (s << 29) | (sht << 22) | (rm << 16) | (amt << 10) | (rn << 5) | rd);
+}
+
+// and/orr/eor/ands; aux bit 2 inverts the second operand (bic, orn, eon, bics)
+int as_logic(long aux) {
+  as_need(0, OPK_REG);
+  as_need(1, OPK_REG);
+  if (as_nop < 3) { as_error("missing operand"); }
+  long sf = as_ork[0] == RK_X;
+  long opc = aux & 3;
+  long inv = (aux >> 2) & 1;
+  long rd = as_or[0];
+  long rn = as_or[1];
+  if (as_ok[2] == OPK_IMM) {
+    long v = as_ov[2];
+    if (inv) { v = 0 - 1 - v; }
+    long enc = as_bitmask(v, 1 - sf);
+    if (enc < 0) { as_error("immediate not encodable"); }
+    return as_word(0x12000000 | (sf << 31) | (opc << 29) | (enc << 10) | (rn << 5) | rd);
+  }
+  as_need(2, OPK_REG);
+  long sht = SH_LSL;
+  long amt = 0;
+  if (as_nop > 3) {
+    as_need(3, OPK_SHIFT);
+    sht = as_os[3];
+    amt = as_oa[3];
+    if (sht > SH_ROR) { as_error("invalid shift"); }
+  }
+  return as_word(0x0A000000 | (sf << 31) | (opc << 29) | (sht << 22) | (inv << 21) | (as_or[2] << 16) | (amt << 10) | (rn << 5) | rd);
+}
+
+int as_shift_insn(long aux) {
+  as_need(0, OPK_REG);
+  as_need(1, OPK_REG);
+  if (as_nop < 3) { as_error("missing operand"); }
+  long sf = as_ork[0] == RK_X;
+  long rd = as_or[0];
+  long rn = as_or[1];
+  if (as_ok[2] == OPK_REG) {
+    return as_word(0x1AC02000 | (sf << 31) | (as_or[2] << 16) | (aux << 10) | (rn << 5) | rd);
+  }
+  as_need(2, OPK_IMM);
+  long bits = 32 + 32 * sf;
+  long s = as_ov[2];
+  if (s < 0 || s >= bits) { as_error("shift out of range"); }
+  if (aux == 3) {
+    return as_word(0x13800000 | (sf << 31) | (sf << 22) | (rn << 16) | (s << 10) | (rn << 5) | rd);
+  }
+  long base = 0x53000000;
+  long immr = s;
+  long imms = bits - 1;
+  if (aux == 0) { immr = (bits - s) % bits; imms = bits - 1 - s; }
+  if (aux == 2) { base = 0x13000000; }
+  return as_word(base | (sf << 31) | (sf << 22) | (immr << 16) | (imms << 10) | (rn << 5) | rd);
+}
+
+int as_ldst(long aux) {
+  as_need(0, OPK_REG);
+  as_need(1, OPK_MEM);
+  long rt = as_or[0];
+  int k = as_ork[0];
+  long size = aux & 3;
+  long opc = (aux >> 2) & 3;
+  long v = 0;
+  if (aux & 16) {
+    if (k == RK_X) { size = 3; }
+    else if (k == RK_W) { size = 2; }
+    else {
+      v = 1;
+      if (k == RK_D) { size = 3; }
+      else if (k == RK_S) { size = 2; }
+      else if (k == RK_H) { size = 1; }
+      else if (k == RK_B) { size = 0; }
+      else if (k == RK_Q) { size = 0; opc = opc + 2; }
+      else { as_error("invalid register"); }
+    }
+  }
+  if (aux & 32) {
+    opc = 2;
+    if (k == RK_W) { opc = 3; }
+  }
+  long scale = size;
+  if (v && opc >= 2) { scale = 4; }
+  long base = (size << 30) | (v << 26) | (opc << 22) | (as_or[1] << 5) | rt;
+  if (as_ox[1] >= 0) {
+    long opt = 3;
+    long s = 0;
+    if (as_os[1] >= SH_UXTB) { opt = as_os[1] - SH_UXTB; }
+    else if (as_os[1] >= 0 && as_os[1] != SH_LSL) { as_error("invalid extend"); }
+    if (as_oa[1] >= 0) {
+      if (as_oa[1] != 0 && as_oa[1] != scale) { as_error("invalid shift amount"); }
+      if (as_oa[1] == scale) { s = 1; }
+    }
+    return as_word(0x38200800 | base | (as_ox[1] << 16) | (opt << 13) | (s << 12));
+  }
+  if (as_osym[1] >= 0) {
+    int kind = FX_PAGEOFF;
+    if (as_omod[1] == AM_GOTPAGEOFF) { kind = FX_GOTPAGEOFF; }
+    else if (as_omod[1] != AM_PAGEOFF) { as_error("expected @PAGEOFF"); }
+    as_fixup(kind, as_sym_of(1), as_ov[1], scale);
+    return as_word(0x39000000 | base);
+  }
+  long off = as_ov[1];
+  if (as_nop > 2 || as_owb[1]) {
+    long mode = 0xC00;
+    if (as_nop > 2) { as_need(2, OPK_IMM); off = as_ov[2]; mode = 0x400; }
+    if (off < 0 - 256 || off > 255) { as_error("offset out of range"); }
+    return as_word(0x38000000 | mode | base | ((off & 511) << 12));
+  }
+  if ((aux & 64) == 0 && off >= 0 && (off & low_bits(scale)) == 0 && (off >> scale) < 4096) {
+    return as_word(0x39000000 | base | ((off >> scale) << 10));
+  }
+  if (off < 0 - 256 || off > 255) { as_error("offset out of range"); }
+  return as_word(0x38000000 | base | ((off & 511) << 12));
+}
+
+int as_ldp(long aux) {
+  as_need(0, OPK_REG);
+  as_need(1, OPK_REG);
+  as_need(2, OPK_MEM);
+  int k = as_ork[0];
+  long opc = 0;
+  long v = 0;
+  long scale = 2;
+  if (aux == 3) { opc = 1; }
+  else if (k == RK_X) { opc = 2; scale = 3; }
+  else if (k == RK_D) { v = 1; opc = 1; scale = 3; }
+  else if (k == RK_S) { v = 1; }
+  else if (k == RK_Q) { v = 1; opc = 2; scale = 4; }
+  else if (k != RK_W) { as_error("invalid register"); }
+  long mode = 2;
+  long off = as_ov[2];
+  if (as_nop > 3) { as_need(3, OPK_IMM); off = as_ov[3]; mode = 1; }
+  else if (as_owb[2]) { mode = 3; }
+  if ((off & low_bits(scale)) != 0 || (off >> scale) < 0 - 64 || (off >> scale) > 63) { as_error("offset out of range"); }
+  return as_word(0x28000000 | (opc << 30) | (v << 26) | (mode << 23) | ((aux & 1) << 22) | (((off >> scale) & 127) << 15) | (as_or[1] << 10) | (as_or[2] << 5) | as_or[0]);
+}
+
+int as_is_fp(int k) {
+  return k == RK_D || k == RK_S;
+}
+
+int as_fmov() {
+  as_need(0, OPK_REG);
+  if (as_nop < 2) { as_error("missing operand"); }
+  long rd = as_or[0];
+  int k0 = as_ork[0];
+  long type = k0 == RK_D;
+  if (as_ok[1] == OPK_FIMM) {
+    if (as_ov[1] > 255) { as_error("floating-point immediate not encodable"); }
+    return as_word(0x1E201000 | (type << 22) | (as_ov[1] << 13) | rd);
+  }
+  as_need(1, OPK_REG);
+  long rn = as_or[1];
+  int k1 = as_ork[1];
+  if (as_is_fp(k0) && as_is_fp(k1)) { return as_word(0x1E204000 | (type << 22) | (rn << 5) | rd); }
+  if (k0 == RK_D && k1 == RK_X) { return as_word(0x9E670000 | (rn << 5) | rd); }
+  if (k0 == RK_S && k1 == RK_W) { return as_word(0x1E270000 | (rn << 5) | rd); }
+  if (k0 == RK_X && k1 == RK_D) { return as_word(0x9E660000 | (rn << 5) | rd); }
+  if (k0 == RK_W && k1 == RK_S) { return as_word(0x1E260000 | (rn << 5) | rd); }
+  as_error("invalid fmov");
+  return 0;
+}
+
+int as_target(int kind, long word) {
+  int i = as_nop - 1;
+  if (i < 0 || as_osym[i] < 0 || as_ok[i] == OPK_MEM) { as_error("expected a label"); }
+  as_fixup(kind, as_sym_of(i), as_ov[i], 0);
+  return as_word(word);
+}
+
+int as_insn(int cls, long aux) {
+  long sf = 0;
+  long rd = 0;
+  long rn = 0;
+  if (as_nop > 0 && as_ok[0] == OPK_REG) { sf = as_ork[0] == RK_X; rd = as_or[0]; }
+  if (as_nop > 1 && as_ok[1] == OPK_REG) { rn = as_or[1]; }
+  if (cls == AC_ADDSUB) { return as_addsub(aux); }
+  if (cls == AC_CMP) {
+    as_need(0, OPK_REG);
+    as_insert_zr(0, as_ork[0]);
+    return as_addsub(aux);
+  }
+  if (cls == AC_NEG) {
+    as_need(0, OPK_REG);
+    as_insert_zr(1, as_ork[0]);
+    return as_addsub(aux);
+  }
+  if (cls == AC_LOGIC) { return as_logic(aux); }
+  if (cls == AC_TST) {
+    as_need(0, OPK_REG);
+    as_insert_zr(0, as_ork[0]);
+    return as_logic(aux);
+  }
+  if (cls == AC_MVN) {
+    as_need(0, OPK_REG);
+    as_insert_zr(1, as_ork[0]);
+    return as_logic(aux);
+  }
+  if (cls == AC_MOV) {
+    as_need(0, OPK_REG);
+    if (as_nop > 1 && as_ok[1] == OPK_IMM) { return as_mov_imm(sf, rd, as_ov[1]); }
+    as_need(1, OPK_REG);
+    if (as_osp[0] || as_osp[1]) { return as_word(0x11000000 | (sf << 31) | (rn << 5) | rd); }
+    return as_word(0x2A0003E0 | (sf << 31) | (rn << 16) | rd);
+  }
+  if (cls == AC_MOVW) {
+    as_need(0, OPK_REG);
+    as_need(1, OPK_IMM);
+    long hw = 0;
+    if (as_nop > 2) { as_need(2, OPK_SHIFT); hw = as_oa[2] / 16; }
+    return as_word(0x12800000 | (sf << 31) | (aux << 29) | (hw << 21) | ((as_ov[1] & 65535) << 5) | rd);
+  }
+  if (cls == AC_SHIFT) { return as_shift_insn(aux); }
+  if (cls == AC_EXTEND) {
+    as_need(1, OPK_REG);
+    long base = 0x53000000;
+    if (aux & 256) { base = 0x13000000; }
+    return as_word(base | (sf << 31) | (sf << 22) | ((aux & 63) << 10) | (rn << 5) | rd);
+  }
+  if (cls == AC_DP1) {
+    as_need(1, OPK_REG);
+    // rev is opc 3 on X registers, opc 2 (which is rev32 there) on W
+    if (aux == 0x5AC00C00 && !sf) { aux = 0x5AC00800; }
+    return as_word(aux | (sf << 31) | (rn << 5) | rd);
+  }
+  if (cls == AC_DP2 || cls == AC_MUL) {
+    as_need(1, OPK_REG);
+    as_need(2, OPK_REG);
+    return as_word(aux | (sf << 31) | (as_or[2] << 16) | (rn << 5) | rd);
+  }
+  if (cls == AC_MADD) {
+    as_need(3, OPK_REG);
+    return as_word(aux | (sf << 31) | (as_or[2] << 16) | (as_or[3] << 10) | (rn << 5) | rd);
+  }
+  if (cls == AC_CSEL) {
+    as_need(2, OPK_REG);
+    return as_word(aux | (sf << 31) | (as_or[2] << 16) | (as_cond(3) << 12) | (rn << 5) | rd);
+  }
+  if (cls == AC_CSET) {
+    return as_word(aux | (sf << 31) | (31 << 16) | ((as_cond(1) ^ 1) << 12) | (31 << 5) | rd);
+  }
+  if (cls == AC_CINC) {
+    as_need(1, OPK_REG);
+    return as_word(aux | (sf << 31) | (rn << 16) | ((as_cond(2) ^ 1) << 12) | (rn << 5) | rd);
+  }
+  if (cls == AC_LDST) { return as_ldst(aux); }
+  if (cls == AC_LDP) { return as_ldp(aux); }
+  if (cls == AC_B) { return as_target(FX_B26, 0x14000000 | (aux << 31)); }
+  if (cls == AC_BCOND) { return as_target(FX_B19, 0x54000000 | aux); }
+  if (cls == AC_CB) {
+    as_need(0, OPK_REG);
+    return as_target(FX_B19, 0x34000000 | (aux << 24) | (sf << 31) | rd);
+  }
+  if (cls == AC_TB) {
+    as_need(0, OPK_REG);
+    as_need(1, OPK_IMM);
+    long bit = as_ov[1];
+    return as_target(FX_B14, 0x36000000 | (aux << 24) | ((bit >> 5) << 31) | ((bit & 31) << 19) | rd);
+  }
+  if (cls == AC_BR) {
+    if (as_nop == 0) { return as_word(aux | (30 << 5)); }
+    as_need(0, OPK_REG);
+    return as_word(aux | (rd << 5));
+  }
+  if (cls == AC_ADRP) {
+    as_need(0, OPK_REG);
+    as_need(1, OPK_SYM);
+    int kind = FX_PAGE;
+    if (as_omod[1] == AM_GOTPAGE) { kind = FX_GOTPAGE; }
+    else if (as_omod[1] != AM_PAGE) { as_error("expected @PAGE"); }
+    as_fixup(kind, as_sym_of(1), as_ov[1], 0);
+    return as_word(0x90000000 | rd);
+  }
+  if (cls == AC_NOP) { return as_word(aux); }
+  if (cls == AC_FMOV) { return as_fmov(); }
+  if (cls == AC_FCVTI) {
+    as_need(1, OPK_REG);
+    if (aux < 2) {
+      return as_word(0x1E220000 | (aux << 16) | ((as_ork[1] == RK_X) << 31) | ((as_ork[0] == RK_D) << 22) | (rn << 5) | rd);
+    }
+    return as_word(0x1E380000 | ((aux - 2) << 16) | (sf << 31) | ((as_ork[1] == RK_D) << 22) | (rn << 5) | rd);
+  }
+  if (cls == AC_FCVT) {
+    as_need(1, OPK_REG);
+    if (as_ork[0] == RK_D) { return as_word(0x1E22C000 | (rn << 5) | rd); }
+    return as_word(0x1E624000 | (rn << 5) | rd);
+  }
+  if (cls == AC_FP1) {
+    as_need(1, OPK_REG);
+    return as_word(aux | ((as_ork[0] == RK_D) << 22) | (rn << 5) | rd);
+  }
+  if (cls == AC_FP2) {
+    as_need(2, OPK_REG);
+    return as_word(aux | ((as_ork[0] == RK_D) << 22) | (as_or[2] << 16) | (rn << 5) | rd);
+  }
+  if (cls == AC_FCMP) {
+    as_need(0, OPK_REG);
+    if (as_nop > 1 && as_ok[1] == OPK_FIMM) {
+      return as_word(0x1E202008 | aux | ((as_ork[0] == RK_D) << 22) | (rd << 5));
+    }
+    as_need(1, OPK_REG);
+    return as_word(0x1E202000 | aux | ((as_ork[0] == RK_D) << 22) | (rn << 16) | (rd << 5));
+  }
+  if (cls == AC_SIMD) {
+    as_need(1, OPK_REG);
+    return as_word(aux | (as_oq[1] << 30) | (rn << 5) | rd);
+  }
+  as_error("unsupported instruction");
+  return 0;
+}
+
+// ---- Assembler: directives ----
+
+int *as_name_arg() {
+  as_skip();
+  int st = as_p;
+  int e = as_ident_end(st);
+  if (e == st) { as_error("expected a name"); }
+  as_p = e;
+  as_skip();
+  if (as_ch() == ',') { as_p++; }
+  return make_str(as_text, st, e - st);
+}
+
+int as_sym_arg() {
+  as_skip();
+  int st = as_p;
+  int e = as_ident_end(st);
+  if (e == st) { as_error("expected a symbol"); }
+  as_p = e;
+  as_skip();
+  if (as_ch() == ',') { as_p++; }
+  return as_intern(as_text, st, e - st);
+}
+
+long as_num_arg() {
+  long v = as_number();
+  as_skip();
+  if (as_ch() == ',') { as_p++; }
+  return v;
+}
+
+// .byte/.short/.long/.quad: numbers, symbol[+-addend] or symbol differences
+int as_values(int size) {
+  while (1) {
+    as_skip();
+    int c = as_ch();
+    if (c == '\n') break;
+    if (c == '-' || (c >= '0' && c <= '9')) {
+      as_data(as_number(), size);
+    } else {
+      as_osym[0] = 0 - 1;
+      as_ov[0] = 0;
+      as_omod[0] = AM_NONE;
+      as_symref(0);
+      int f = as_fixup(FX_DATA, as_intern(as_text, as_osym[0], as_olen[0]), as_ov[0], size);
+      as_skip();
+      if (as_ch() == '-') {
+        as_p++;
+        as_skip();
+        int st = as_p;
+        int e = as_ident_end(st);
+        if (e == st) { as_error("expected a symbol"); }
+        as_fx_sym2[f] = as_intern(as_text, st, e - st);
+        as_p = e;
+      }
+      as_data(0, size);
+    }
+    as_skip();
+    if (as_ch() != ',') break;
+    as_p++;
+  }
+  return 0;
+}
+
+int as_string(int zero) {
+  as_expect('"');
+  while (as_p < as_end && as_ch() != '"') {
+    int c = as_ch();
+    as_p++;
+    if (c == '\\') {
+      c = as_ch();
+      as_p++;
+      if (c == 'n') { c = 10; }
+      else if (c == 't') { c = 9; }
+      else if (c == 'r') { c = 13; }
+      else if (c == 'a') { c = 7; }
+      else if (c == 'b') { c = 8; }
+      else if (c == 'f') { c = 12; }
+      else if (c == 'v') { c = 11; }
+      else if (c == 'x') {
+        c = 0;
+        while (1) {
+          int d = as_ch();
+          if (d >= '0' && d <= '9') { c = c * 16 + d - '0'; }
+          else if (d >= 'a' && d <= 'f') { c = c * 16 + d - 'a' + 10; }
+          else if (d >= 'A' && d <= 'F') { c = c * 16 + d - 'A' + 10; }
+          else { break; }
+          as_p++;
         }
-        if (has_data == 0) { emit_ch('\n'); emit_line("\t.data"); has_data = 1; }
-        if (gd->is_static == 0) { emit_s("\t.globl\t_"); emit_line(gd->name); }
-        emit_line("\t.p2align\t3");
-        emit_s("_"); emit_s(gd->name); emit_line(":");
-        if (gd->stype != 0) {
-          // Proper layout: emit each slot at its correct byte offset with correct size
-          int *sl_off = my_malloc(nf_total * 8);
-          int *sl_sz = my_malloc(nf_total * 8);
-          int sl_n = cg_build_slot_layout(gd->stype, sl_off, sl_sz, nf_total);
-          if (my_strcmp(gd->name, "sqlite3Config") == 0) {
-            printf("cc: slot_layout for '%s': sl_n=%d nf_total=%d\n", gd->name, sl_n, nf_total);
-            int di = 0;
-            while (di < sl_n && di < 15) { printf("  slot[%d]: off=%d sz=%d\n", di, sl_off[di], sl_sz[di]); di++; }
-          }
-          int cur_off = 0;
-          fsi = 0;
-          while (fsi < nf_total) {
-            int f_off = (fsi < sl_n) ? sl_off[fsi] : cur_off;
-            int f_sz = (fsi < sl_n) ? sl_sz[fsi] : 8;
-            // Emit padding
-            if (f_off > cur_off) {
-              emit_s("\t.zero\t"); emit_num(f_off - cur_off); emit_ch('\n');
-              cur_off = f_off;
-            }
-            // Choose directive
-            int *dir = "\t.quad\t";
-            if (f_sz == 1) { dir = "\t.byte\t"; }
-            else if (f_sz == 2) { dir = "\t.short\t"; }
-            else if (f_sz == 4) { dir = "\t.long\t"; }
-            struct Expr *fe = sflat[fsi];
-            if (fe == 0) {
-              emit_s(dir); emit_line("0");
-            } else if (fe->kind == ND_NUM) {
-              emit_s(dir); emit_num(fe->ival); emit_ch('\n');
-            } else if (fe->kind == ND_UNARY && fe->ival == '-' && fe->left->kind == ND_NUM) {
-              emit_s(dir); emit_ch('-'); emit_num(fe->left->ival); emit_ch('\n');
-            } else if (fe->kind == ND_STRLIT) {
-              int *slabel = cg_intern_string(fe->sval);
-              emit_s("\t.quad\t"); emit_line(slabel);
-            } else if (fe->kind == ND_VAR) {
-              emit_s("\t.quad\t_"); emit_line(fe->sval);
-            } else if (fe->kind == ND_UNARY && fe->ival == '&' && fe->left != 0 && fe->left->kind == ND_VAR) {
-              emit_s("\t.quad\t_"); emit_line(fe->left->sval);
-            } else if (fe->kind == ND_CAST && fe->left != 0 && fe->left->kind == ND_NUM) {
-              emit_s(dir); emit_num(fe->left->ival); emit_ch('\n');
-            } else if (fe->kind == ND_CAST && fe->left != 0 && fe->left->kind == ND_VAR) {
-              emit_s("\t.quad\t_"); emit_line(fe->left->sval);
-            } else {
-              int cval = 0;
-              if (try_eval_const(fe, &cval)) {
-                emit_s(dir); emit_num(cval); emit_ch('\n');
-              } else {
-                emit_s(dir); emit_line("0");
-              }
-            }
-            cur_off = cur_off + f_sz;
-            fsi++;
-          }
-          // Trailing padding
-          int total_bsz = cg_struct_byte_size(gd->stype);
-          if (cur_off < total_bsz) {
-            emit_s("\t.zero\t"); emit_num(total_bsz - cur_off); emit_ch('\n');
-          }
+      } else if (c >= '0' && c <= '7') {
+        c = c - '0';
+        int n = 1;
+        while (n < 3 && as_ch() >= '0' && as_ch() <= '7') { c = c * 8 + as_ch() - '0'; as_p++; n++; }
+      }
+    }
+    as_byte(c);
+  }
+  as_expect('"');
+  if (zero) { as_byte(0); }
+  return 0;
+}
+
+// major, minor[, patch] of .build_version, packed the way Mach-O stores it
+int as_version_arg() {
+  int v = as_num_arg() << 16;
+  v = v | (as_num_arg() << 8);
+  as_skip();
+  if (as_ch() >= '0' && as_ch() <= '9') { v = v | as_number(); }
+  return v;
+}
+
+int as_directive(int st, int len) {
+  as_p = st + len;
+  if (as_is(st, len, ".text")) { as_cur = as_section("__TEXT", "__text", 0x80000000); return 0; }
+  if (as_is(st, len, ".data")) { as_cur = as_section("__DATA", "__data", 0); return 0; }
+  if (as_is(st, len, ".section")) {
+    int *seg = as_name_arg();
+    int *name = as_name_arg();
+    int flags = 0;
+    as_skip();
+    if (as_ch() != '\n') {
+      int ts = as_p;
+      int te = as_ident_end(ts);
+      if (as_is(ts, te - ts, "cstring_literals")) { flags = 2; }
+      else if (as_is(ts, te - ts, "zerofill")) { flags = 1; }
+      else if (!as_is(ts, te - ts, "regular")) { as_error("unsupported section type"); }
+    }
+    if (my_strcmp(seg, "__TEXT") == 0 && my_strcmp(name, "__text") == 0) { flags = 0x80000000; }
+    as_cur = as_section(seg, name, flags);
+    return 0;
+  }
+  if (as_is(st, len, ".globl") || as_is(st, len, ".global")) {
+    as_sym_global[as_sym_arg()] = 1;
+    return 0;
+  }
+  if (as_is(st, len, ".p2align") || as_is(st, len, ".align")) {
+    as_align(as_number());
+    return 0;
+  }
+  if (as_is(st, len, ".byte")) return as_values(1);
+  if (as_is(st, len, ".short") || as_is(st, len, ".hword")) return as_values(2);
+  if (as_is(st, len, ".long") || as_is(st, len, ".word") || as_is(st, len, ".int")) return as_values(4);
+  if (as_is(st, len, ".quad") || as_is(st, len, ".xword")) return as_values(8);
+  if (as_is(st, len, ".asciz") || as_is(st, len, ".string")) return as_string(1);
+  if (as_is(st, len, ".ascii")) return as_string(0);
+  if (as_is(st, len, ".zero") || as_is(st, len, ".space")) {
+    long n = as_number();
+    if (as_sec_buf[as_cur] == 0) { as_sec_size[as_cur] = as_sec_size[as_cur] + n; }
+    else { for (long i = 0; i < n; i++) { as_byte(0); } }
+    return 0;
+  }
+  if (as_is(st, len, ".comm")) {
+    int s = as_sym_arg();
+    as_sym_comm[s] = as_num_arg();
+    as_skip();
+    if (as_ch() != '\n') { as_sym_comm_align[s] = as_number(); }
+    as_sym_global[s] = 1;
+    return 0;
+  }
+  if (as_is(st, len, ".zerofill")) {
+    int *seg = as_name_arg();
+    int *name = as_name_arg();
+    int z = as_section(seg, name, 1);
+    int s = as_sym_arg();
+    long size = as_num_arg();
+    int p2 = 0;
+    as_skip();
+    if (as_ch() != '\n') { p2 = as_number(); }
+    if (p2 > as_sec_align[z]) { as_sec_align[z] = p2; }
+    int a = 1 << p2;
+    int off = (as_sec_size[z] + a - 1) & (0 - a);
+    as_define(s, z, off);
+    as_sec_size[z] = off + size;
+    return 0;
+  }
+  if (as_is(st, len, ".build_version")) {
+    int *plat = as_name_arg();
+    if (my_strcmp(plat, "macos") != 0) { as_error("unsupported platform"); }
+    as_build_platform = 1;
+    as_build_minos = as_version_arg();
+    as_skip();
+    if (as_ch() != '\n') {
+      int ts = as_p;
+      int te = as_ident_end(ts);
+      if (!as_is(ts, te - ts, "sdk_version")) { as_error("expected sdk_version"); }
+      as_p = te;
+      as_build_sdk = as_version_arg();
+    }
+    return 0;
+  }
+  as_error("unsupported directive");
+  return 0;
+}
+
+int as_statement() {
+  as_skip();
+  int st = as_p;
+  int e = as_ident_end(st);
+  if (e > st && e < as_end && __read_byte(as_text, e) == ':') {
+    as_define(as_intern(as_text, st, e - st), as_cur, as_sec_size[as_cur]);
+    as_p = e + 1;
+    as_skip();
+    st = as_p;
+    e = as_ident_end(st);
+  }
+  if (e == st) {
+    if (as_ch() != '\n') { as_error("syntax error"); }
+    return 0;
+  }
+  if (__read_byte(as_text, st) == '.') return as_directive(st, e - st);
+  int m = as_lookup_mnemonic(st, e - st);
+  if (m < 0) { as_error("unknown instruction"); }
+  as_p = e;
+  as_nop = 0;
+  as_skip();
+  while (as_ch() != '\n') {
+    if (as_nop >= 6) { as_error("too many operands"); }
+    as_operand(as_nop);
+    as_nop++;
+    as_skip();
+    if (as_ch() == ',') { as_p++; }
+    else if (as_ch() != '\n') { as_error("syntax error"); }
+  }
+  return as_insn(as_mn_class[m], as_mn_aux[m]);
+}
+
+// ---- Assembler: fixups ----
+
+int as_reloc(int sect, int off, int type, int pcrel, int len, int sym, long val) {
+  if (as_nrl >= MAX_AS_FIXUPS) { my_fatal("too many relocations"); }
+  as_rl_sect[as_nrl] = sect;
+  as_rl_off[as_nrl] = off;
+  as_rl_type[as_nrl] = type;
+  as_rl_pcrel[as_nrl] = pcrel;
+  as_rl_len[as_nrl] = len;
+  as_rl_sym[as_nrl] = sym;
+  as_rl_val[as_nrl] = val;
+  as_nrl++;
+  return 0;
+}
+
+int as_patch(int sect, int off, long bits) {
+  int *b = as_sec_buf[sect];
+  for (int i = 0; i < 4; i++) {
+    __write_byte(b, off + i, __read_byte(b, off + i) | (bits & 255));
+    bits = bits >> 8;
+  }
+  return 0;
+}
+
+int as_undefined(int s) {
+  printf("cc: as: undefined label %s\n", as_sym_name[s]);
+  exit(1);
+  return 0;
+}
+
+// Offset of a defined symbol from the symbol its relocations name
+long as_atom_delta(int s) {
+  if (as_sym_sect[s] < 0) return 0;
+  return as_sym_off[s] - as_sym_off[as_sym_atom[s]];
+}
+
+int as_resolve() {
+  for (int f = 0; f < as_nfx; f++) {
+    int s = as_fx_sym[f];
+    int sect = as_fx_sect[f];
+    int off = as_fx_off[f];
+    int kind = as_fx_kind[f];
+    long add = as_fx_add[f];
+    if (as_sym_sect[s] < 0 && as_is_temp(s)) { as_undefined(s); }
+    if (kind == FX_B26 || kind == FX_B19 || kind == FX_B14) {
+      if (as_sym_sect[s] == sect) {
+        long delta = (as_sym_off[s] + add - off) >> 2;
+        long lim = 1 << 25;
+        if (kind == FX_B19) { lim = 1 << 18; }
+        if (kind == FX_B14) { lim = 1 << 13; }
+        if (delta < 0 - lim || delta >= lim) { as_line = 0; as_end = 0; printf("cc: as: branch to %s out of range\n", as_sym_name[s]); exit(1); }
+        if (kind == FX_B26) { as_patch(sect, off, delta & low_bits(26)); }
+        else { as_patch(sect, off, (delta & (lim * 2 - 1)) << 5); }
+        continue;
+      }
+      if (kind != FX_B26 || add + as_atom_delta(s) != 0) {
+        printf("cc: as: cannot branch to %s in another section\n", as_sym_name[s]);
+        exit(1);
+      }
+      as_reloc(sect, off, 2, 1, 2, as_sym_atom[s], 0);
+      continue;
+    }
+    if (kind == FX_DATA) {
+      int len = 2;
+      if (as_fx_arg[f] == 8) { len = 3; }
+      else if (as_fx_arg[f] != 4) { printf("cc: as: %d-byte relocation against %s\n", as_fx_arg[f], as_sym_name[s]); exit(1); }
+      int s2 = as_fx_sym2[f];
+      long val = add;
+      if (s2 >= 0) {
+        if (as_sym_sect[s2] < 0) { as_undefined(s2); }
+        if (as_sym_sect[s] == as_sym_sect[s2]) {
+          val = val + as_sym_off[s] - as_sym_off[s2];
         } else {
-          // Legacy: .quad per slot
-          fsi = 0;
-          while (fsi < nf_total) {
-            struct Expr *fe = sflat[fsi];
-            if (fe == 0) {
-              emit_line("\t.quad\t0");
-            } else if (fe->kind == ND_NUM) {
-              emit_s("\t.quad\t"); emit_num(fe->ival); emit_ch('\n');
-            } else if (fe->kind == ND_UNARY && fe->ival == '-' && fe->left->kind == ND_NUM) {
-              emit_s("\t.quad\t-"); emit_num(fe->left->ival); emit_ch('\n');
-            } else if (fe->kind == ND_STRLIT) {
-              int *slabel = cg_intern_string(fe->sval);
-              emit_s("\t.quad\t"); emit_line(slabel);
-            } else if (fe->kind == ND_VAR) {
-              emit_s("\t.quad\t_"); emit_line(fe->sval);
-            } else if (fe->kind == ND_UNARY && fe->ival == '&' && fe->left != 0 && fe->left->kind == ND_VAR) {
-              emit_s("\t.quad\t_"); emit_line(fe->left->sval);
-            } else if (fe->kind == ND_CAST && fe->left != 0 && fe->left->kind == ND_NUM) {
-              emit_s("\t.quad\t"); emit_num(fe->left->ival); emit_ch('\n');
-            } else if (fe->kind == ND_CAST && fe->left != 0 && fe->left->kind == ND_VAR) {
-              emit_s("\t.quad\t_"); emit_line(fe->left->sval);
-            } else {
-              int cval = 0;
-              if (try_eval_const(fe, &cval)) {
-                emit_s("\t.quad\t"); emit_num(cval); emit_ch('\n');
-              } else {
-                emit_line("\t.quad\t0");
-              }
-            }
-            fsi++;
-          }
+          val = val + as_atom_delta(s) - as_atom_delta(s2);
+          as_reloc(sect, off, 0, 0, len, as_sym_atom[s], 0);
+          as_reloc(sect, off, 1, 0, len, as_sym_atom[s2], 0);
         }
-      } else if (gd->has_init != 0 && gd->init_str != 0) {
-        // String initialized
-        if (has_data == 0) { emit_ch('\n'); emit_line("\t.data"); has_data = 1; }
-        if (gd->is_static == 0) { emit_s("\t.globl\t_"); emit_line(gd->name); }
-        emit_line("\t.p2align\t3");
-        emit_s("_"); emit_s(gd->name); emit_line(":");
-        int *slabel = cg_intern_string(cg_decode_string(gd->init_str));
-        emit_s("\t.quad\t"); emit_line(slabel);
-      } else if (gd->has_init != 0) {
-        // Integer initialized
-        if (has_data == 0) { emit_ch('\n'); emit_line("\t.data"); has_data = 1; }
-        if (gd->is_static == 0) { emit_s("\t.globl\t_"); emit_line(gd->name); }
-        emit_line("\t.p2align\t3");
-        emit_s("_"); emit_s(gd->name); emit_line(":");
-        emit_s("\t.quad\t"); emit_num(gd->init_val); emit_ch('\n');
       } else {
-        // Uninitialized (tentative def): skip if an initialized def exists
-        int skip_tentative = 0;
-        int ti = 0;
-        while (ti < prog->nglobals) {
-          if (ti != i) {
-            struct GDecl *tgd = prog->globals[ti];
-            if (tgd != 0 && tgd >= 4096) {
-              if (my_strcmp(tgd->name, gd->name) == 0) {
-                if (tgd->has_init || tgd->init_list != 0 || tgd->init_str != 0) {
-                  skip_tentative = 1;
-                }
-              }
-            }
-          }
-          ti++;
-        }
-        if (skip_tentative) { i++; continue; }
-        // Uninitialized: use .comm (or .zerofill for static)
-        int gsz = 8;
-        if (gd->stype != 0 && gd->is_ptr == 0) {
-          gsz = cg_struct_byte_size(gd->stype);
-        }
-        if (gd->is_static) {
-          emit_s("\t.zerofill __DATA,__bss,_");
-          emit_s(gd->name);
-          emit_s(","); emit_num(gsz); emit_line(",3");
+        val = val + as_atom_delta(s);
+        as_reloc(sect, off, 0, 0, len, as_sym_atom[s], 0);
+      }
+      int *b = as_sec_buf[sect];
+      for (int i = 0; i < as_fx_arg[f]; i++) { __write_byte(b, off + i, val & 255); val = val >> 8; }
+      continue;
+    }
+    // adrp and the low 12 bits; ARM64_RELOC_ADDEND carries any offset
+    int type = 3;
+    int pcrel = 1;
+    if (kind == FX_PAGEOFF) { type = 4; pcrel = 0; }
+    else if (kind == FX_GOTPAGE) { type = 5; }
+    else if (kind == FX_GOTPAGEOFF) { type = 6; pcrel = 0; }
+    long delta = add + as_atom_delta(s);
+    if (delta != 0 && type >= 5) { printf("cc: as: GOT reference to %s with an offset\n", as_sym_name[s]); exit(1); }
+    as_reloc(sect, off, type, pcrel, 2, as_sym_atom[s], 0);
+    if (delta != 0) { as_reloc(sect, off, 10, 0, 2, 0 - 1, delta); }
+  }
+  return 0;
+}
+
+// Start a new object; text is then fed in pieces by as_feed(), and
+// as_resolve() finishes it. The result stays in the as_* tables for the
+// object writer.
+int as_begin() {
+  as_init_mnemonics();
+  for (int i = 0; i < MAX_AS_BUCKETS; i++) { as_sym_head[i] = 0 - 1; }
+  as_nsym = 0;
+  as_nsect = 0;
+  as_nfx = 0;
+  as_nrl = 0;
+  as_build_platform = 0;
+  as_build_minos = 0;
+  as_build_sdk = 0;
+  as_cur = as_section("__TEXT", "__text", 0x80000000);
+  return 0;
+}
+
+// Assemble the whole lines in text[0, n)
+int as_feed(int *text, int n) {
+  as_text = text;
+  int p = 0;
+  while (p < n) {
+    int e = p;
+    while (e < n && __read_byte(text, e) != '\n') { e++; }
+    as_line = p;
+    as_end = e;
+    as_p = p;
+    as_statement();
+    p = e + 1;
+  }
+  as_line = 0;
+  as_end = 0;
+  return 0;
+}
+
+// ---- Mach-O object writer ----
+
+int *obj_buf;
+int obj_len;
+
+int obj_u8(int v) {
+  __write_byte(obj_buf, obj_len, v & 255);
+  obj_len++;
+  return 0;
+}
+
+int obj_u32(long v) {
+  for (int i = 0; i < 4; i++) { obj_u8(v & 255); v = v >> 8; }
+  return 0;
+}
+
+int obj_u64(long v) {
+  for (int i = 0; i < 8; i++) { obj_u8(v & 255); v = v >> 8; }
+  return 0;
+}
+
+int obj_name16(int *s) {
+  int i = 0;
+  while (i < 16 && __read_byte(s, i) != 0) { obj_u8(__read_byte(s, i)); i++; }
+  while (i < 16) { obj_u8(0); i++; }
+  return 0;
+}
+
+int obj_pad_to(long off) {
+  while (obj_len < off) { obj_u8(0); }
+  return 0;
+}
+
+// Sort idx[first, first + n) by symbol name (bottom-up merge sort)
+int obj_sort_syms(int *idx, int first, int n) {
+  int *tmp = my_malloc(n * 4 + 4);
+  int width = 1;
+  while (width < n) {
+    int lo = 0;
+    while (lo < n) {
+      int mid = lo + width;
+      int hi = lo + 2 * width;
+      if (mid > n) { mid = n; }
+      if (hi > n) { hi = n; }
+      int a = lo;
+      int b = mid;
+      int k = lo;
+      while (a < mid || b < hi) {
+        if (b >= hi || (a < mid && my_strcmp(as_sym_name[idx[first + a]], as_sym_name[idx[first + b]]) <= 0)) {
+          tmp[k] = idx[first + a];
+          a++;
         } else {
-          emit_s("\t.comm\t_");
-          emit_s(gd->name);
-          emit_s(", "); emit_num(gsz); emit_line(", 3");
+          tmp[k] = idx[first + b];
+          b++;
         }
+        k++;
       }
-      i++;
+      lo = hi;
+    }
+    for (int i = 0; i < n; i++) { idx[first + i] = tmp[i]; }
+    width = width * 2;
+  }
+  return 0;
+}
+
+int obj_write_macho(int *path) {
+  // Symbol table: locals, then defined externals, then undefined, each
+  // external group sorted by name
+  int *order = my_malloc(as_nsym * 4 + 4);
+  int nlocal = 0;
+  for (int s = 0; s < as_nsym; s++) {
+    if (!as_is_temp(s) && as_sym_sect[s] >= 0 && as_sym_global[s] == 0) { order[nlocal] = s; nlocal++; }
+  }
+  int next = 0;
+  for (int s = 0; s < as_nsym; s++) {
+    if (!as_is_temp(s) && as_sym_sect[s] >= 0 && as_sym_global[s]) { order[nlocal + next] = s; next++; }
+  }
+  int nundef = 0;
+  for (int s = 0; s < as_nsym; s++) {
+    if (!as_is_temp(s) && as_sym_sect[s] < 0) { order[nlocal + next + nundef] = s; nundef++; }
+  }
+  obj_sort_syms(order, nlocal, next);
+  obj_sort_syms(order, nlocal + next, nundef);
+  int nsyms = nlocal + next + nundef;
+  int strsize = 1;
+  for (int i = 0; i < nsyms; i++) {
+    as_sym_index[order[i]] = i;
+    strsize = strsize + my_strlen(as_sym_name[order[i]]) + 1;
+  }
+  strsize = (strsize + 7) & (0 - 8);
+
+  // Sections with contents first, then zerofill ones
+  long addr = 0;
+  for (int s = 0; s < as_nsect; s++) {
+    if ((as_sec_flags[s] & 255) == 1) continue;
+    addr = (addr + (1 << as_sec_align[s]) - 1) & (0 - (1 << as_sec_align[s]));
+    as_sec_addr[s] = addr;
+    addr = addr + as_sec_size[s];
+  }
+  long filesize = addr;
+  for (int s = 0; s < as_nsect; s++) {
+    if ((as_sec_flags[s] & 255) != 1) continue;
+    addr = (addr + (1 << as_sec_align[s]) - 1) & (0 - (1 << as_sec_align[s]));
+    as_sec_addr[s] = addr;
+    addr = addr + as_sec_size[s];
+  }
+  long vmsize = addr;
+  for (int s = 0; s < as_nsect; s++) { as_sec_nrel[s] = 0; }
+  for (int r = 0; r < as_nrl; r++) { as_sec_nrel[as_rl_sect[r]]++; }
+
+  int ncmds = 3;
+  int sizeofcmds = 72 + 80 * as_nsect + 24 + 80;
+  if (as_build_platform) { ncmds++; sizeofcmds = sizeofcmds + 24; }
+  long dataoff = 32 + sizeofcmds;
+  long reloff = (dataoff + filesize + 7) & (0 - 8);
+  long symoff = reloff + 8 * as_nrl;
+  long stroff = symoff + 16 * nsyms;
+  long total = stroff + strsize;
+  obj_buf = my_malloc(total + 8);
+  obj_len = 0;
+
+  // mach_header_64: MH_MAGIC_64, CPU_TYPE_ARM64, MH_OBJECT
+  obj_u32(0xfeedfacf); obj_u32(0x0100000c); obj_u32(0); obj_u32(1);
+  obj_u32(ncmds); obj_u32(sizeofcmds); obj_u32(0); obj_u32(0);
+  // LC_SEGMENT_64 holding every section
+  obj_u32(0x19); obj_u32(72 + 80 * as_nsect); obj_name16("");
+  obj_u64(0); obj_u64(vmsize); obj_u64(dataoff); obj_u64(filesize);
+  obj_u32(7); obj_u32(7); obj_u32(as_nsect); obj_u32(0);
+  long rel = reloff;
+  for (int s = 0; s < as_nsect; s++) {
+    obj_name16(as_sec_name[s]);
+    obj_name16(as_sec_seg[s]);
+    obj_u64(as_sec_addr[s]);
+    obj_u64(as_sec_size[s]);
+    if ((as_sec_flags[s] & 255) == 1) { obj_u32(0); } else { obj_u32(dataoff + as_sec_addr[s]); }
+    obj_u32(as_sec_align[s]);
+    if (as_sec_nrel[s] > 0) { obj_u32(rel); } else { obj_u32(0); }
+    obj_u32(as_sec_nrel[s]);
+    obj_u32(as_sec_flags[s]);
+    obj_u32(0); obj_u32(0); obj_u32(0);
+    rel = rel + 8 * as_sec_nrel[s];
+  }
+  // LC_BUILD_VERSION, without tool entries
+  if (as_build_platform) {
+    obj_u32(0x32); obj_u32(24); obj_u32(as_build_platform); obj_u32(as_build_minos); obj_u32(as_build_sdk); obj_u32(0);
+  }
+  // LC_SYMTAB and LC_DYSYMTAB
+  obj_u32(2); obj_u32(24); obj_u32(symoff); obj_u32(nsyms); obj_u32(stroff); obj_u32(strsize);
+  obj_u32(0xb); obj_u32(80);
+  obj_u32(0); obj_u32(nlocal); obj_u32(nlocal); obj_u32(next); obj_u32(nlocal + next); obj_u32(nundef);
+  for (int i = 0; i < 12; i++) { obj_u32(0); }
+
+  for (int s = 0; s < as_nsect; s++) {
+    if ((as_sec_flags[s] & 255) == 1) continue;
+    obj_pad_to(dataoff + as_sec_addr[s]);
+    for (int i = 0; i < as_sec_size[s]; i++) { obj_u8(__read_byte(as_sec_buf[s], i)); }
+  }
+  obj_pad_to(reloff);
+  for (int s = 0; s < as_nsect; s++) {
+    for (int r = as_nrl - 1; r >= 0; r--) {
+      if (as_rl_sect[r] != s) continue;
+      obj_u32(as_rl_off[r]);
+      long info = (as_rl_pcrel[r] << 24) | (as_rl_len[r] << 25) | (as_rl_type[r] << 28);
+      if (as_rl_sym[r] >= 0) { info = info | as_sym_index[as_rl_sym[r]] | (1 << 27); }
+      else { info = info | (as_rl_val[r] & low_bits(24)); }
+      obj_u32(info);
+    }
+  }
+  int strx = 1;
+  for (int i = 0; i < nsyms; i++) {
+    int s = order[i];
+    obj_u32(strx);
+    strx = strx + my_strlen(as_sym_name[s]) + 1;
+    if (as_sym_sect[s] >= 0) {
+      obj_u8(0x0e | as_sym_global[s]);
+      obj_u8(as_sym_sect[s] + 1);
+      obj_u8(0); obj_u8(0);
+      obj_u64(as_sec_addr[as_sym_sect[s]] + as_sym_off[s]);
+    } else {
+      obj_u8(1);
+      obj_u8(0);
+      obj_u8(0); obj_u8(as_sym_comm_align[s]);
+      obj_u64(as_sym_comm[s]);
+    }
+  }
+  obj_u8(0);
+  for (int i = 0; i < nsyms; i++) {
+    int *nm = as_sym_name[order[i]];
+    int k = 0;
+    while (__read_byte(nm, k) != 0) { obj_u8(__read_byte(nm, k)); k++; }
+    obj_u8(0);
+  }
+  obj_pad_to(total);
+
+  int *f = fopen(path, "wb");
+  if (f == 0) { my_fatal("cannot write object file"); }
+  fwrite(obj_buf, 1, obj_len, f);
+  fclose(f);
+  return 0;
+}
+
+// ---- x86-64 lowering ----
+// Rewrites the AArch64 ELF text in outbuf as x86-64 (AT&T syntax), one
+// instruction at a time, reusing the assembler's operand parser. x0-x5 are
+// the SysV argument registers rdi, rsi, rdx, rcx, r8 and r9, x9 is r10,
+// x19-x23 are the callee-saved rbx and r12-r15, x29 is rbp and w18 is the
+// vector count in al before a variadic call; rax, r11 and xmm15 are
+// scratch. The other scratch registers the emitter names (x6-x8, x10-x17)
+// get slots at the top of their function's frame, just under the saved
+// rbp. bl and ret are call and ret, and the frame record is push and pop
+// of rbp, so frames and stack arguments have the native layout.
+
+int *x86_nq[16];   // hardware register names: 64, 32, 16 and 8 bits
+int *x86_nd[16];
+int *x86_nw[16];
+int *x86_nb[16];
+int x86_of[32];    // hardware register of each AArch64 one, -1 if none
+int x86_slot_of[32];  // its frame slot below rbp otherwise, 0 if none
+int *x86_xname[32];   // "xN" and "wN", to look for in emitted text
+int *x86_wname[32];
+int x86_oreg[8];   // operand already loaded into a hardware register, -1 if not
+int *x86_icc_name[15];  // condition suffixes after integer and FP compares
+int *x86_fcc_name[15];
+int x86_fcc;       // the flags come from a floating-point compare (2: operands swapped)
+int x86_fcmp_a;    // its xmm operands; b is -1 for a compare with #0.0
+int x86_fcmp_b;
+int x86_fcmp_s;    // single precision
+int x86_kreg;      // register the last instruction set to a constant, -1 if none
+long x86_kval;
+int x86_mbase;     // address of a memory operand, from x86_addr()
+int x86_mindex;    // -1 if none
+int x86_mscale;
+long x86_mdisp;
+
+int x86_reg(int id, int *q, int *d, int *w, int *b) {
+  x86_nq[id] = q;
+  x86_nd[id] = d;
+  x86_nw[id] = w;
+  x86_nb[id] = b;
+  return 0;
+}
+
+int x86_init() {
+  x86_reg(XR_AX, "%rax", "%eax", "%ax", "%al");
+  x86_reg(XR_CX, "%rcx", "%ecx", "%cx", "%cl");
+  x86_reg(XR_DX, "%rdx", "%edx", "%dx", "%dl");
+  x86_reg(XR_BX, "%rbx", "%ebx", "%bx", "%bl");
+  x86_reg(XR_SP, "%rsp", "%esp", "%sp", "%spl");
+  x86_reg(XR_BP, "%rbp", "%ebp", "%bp", "%bpl");
+  x86_reg(XR_SI, "%rsi", "%esi", "%si", "%sil");
+  x86_reg(XR_DI, "%rdi", "%edi", "%di", "%dil");
+  x86_reg(XR_R8, "%r8", "%r8d", "%r8w", "%r8b");
+  x86_reg(XR_R9, "%r9", "%r9d", "%r9w", "%r9b");
+  x86_reg(XR_R10, "%r10", "%r10d", "%r10w", "%r10b");
+  x86_reg(XR_R11, "%r11", "%r11d", "%r11w", "%r11b");
+  x86_reg(XR_R12, "%r12", "%r12d", "%r12w", "%r12b");
+  x86_reg(XR_R13, "%r13", "%r13d", "%r13w", "%r13b");
+  x86_reg(XR_R14, "%r14", "%r14d", "%r14w", "%r14b");
+  x86_reg(XR_R15, "%r15", "%r15d", "%r15w", "%r15b");
+  for (int i = 0; i < 32; i++) { x86_of[i] = 0 - 1; }
+  x86_of[0] = XR_DI; x86_of[1] = XR_SI; x86_of[2] = XR_DX;
+  x86_of[3] = XR_CX; x86_of[4] = XR_R8; x86_of[5] = XR_R9;
+  x86_of[9] = XR_R10;
+  x86_of[19] = XR_BX; x86_of[20] = XR_R12; x86_of[21] = XR_R13;
+  x86_of[22] = XR_R14; x86_of[23] = XR_R15;
+  x86_of[29] = XR_BP;
+  x86_of[18] = XR_AX;
+  int off = 0;
+  for (int i = 0; i < 32; i++) {
+    x86_slot_of[i] = 0;
+    x86_xname[i] = build_str2("x", int_to_str(i));
+    x86_wname[i] = build_str2("w", int_to_str(i));
+    if (i >= 6 && i <= 17 && x86_of[i] < 0) {
+      off = off + 8;
+      x86_slot_of[i] = off;
+    }
+  }
+  frame_reserve = off;
+  x86_init_cc();
+  x86_fcc = 0;
+  x86_kreg = 0 - 1;
+  return 0;
+}
+
+// Does the function body at outbuf[body, outlen) name a register that
+// lives in the frame?
+int x86_frame_regs_used(int body) {
+  for (int i = 0; i < 32; i++) {
+    if (x86_slot_of[i] == 0) continue;
+    if (frame_find_reg(outbuf, body, outlen, x86_xname[i]) >= 0) return 1;
+    if (frame_find_reg(outbuf, body, outlen, x86_wname[i]) >= 0) return 1;
+  }
+  return 0;
+}
+
+int x86_num(long v) {
+  if (v < 0) {
+    // Too negative to negate: GAS takes the 64-bit pattern
+    if (v < 0 - 4611686018427387904) { emit_hex(v); return 0; }
+    emit_ch('-');
+    v = 0 - v;
+  }
+  if (v >= 10) { x86_num(v / 10); }
+  emit_ch('0' + v % 10);
+  return 0;
+}
+
+int x86_name(int id, int w) {
+  if (w == 8) { emit_s(x86_nq[id]); }
+  else if (w == 4) { emit_s(x86_nd[id]); }
+  else if (w == 2) { emit_s(x86_nw[id]); }
+  else { emit_s(x86_nb[id]); }
+  return 0;
+}
+
+// "\tmn<size suffix>\t"; w is 0 for no suffix
+int x86_ins(int *mn, int w) {
+  emit_ch('\t');
+  emit_s(mn);
+  if (w == 8) { emit_ch('q'); }
+  else if (w == 4) { emit_ch('l'); }
+  else if (w == 2) { emit_ch('w'); }
+  else if (w == 1) { emit_ch('b'); }
+  emit_ch('\t');
+  return 0;
+}
+
+// mn %a, %b on hardware registers
+int x86_rr(int *mn, int a, int b, int w) {
+  x86_ins(mn, w); x86_name(a, w); emit_s(", "); x86_name(b, w); emit_ch('\n');
+  return 0;
+}
+
+int x86_slot(int n) {
+  if (x86_slot_of[n] == 0) { as_error("register not available on x86-64"); }
+  emit_ch('-'); emit_num(x86_slot_of[n]); emit_s("(%rbp)");
+  return 0;
+}
+
+// AArch64 register n as a w-byte operand; 31 is sp or the zero register
+int x86_gpr(int n, int sp, int w) {
+  if (n == 31 && sp) { x86_name(XR_SP, w); return 0; }
+  if (n == 31) { emit_s("$0"); return 0; }
+  if (x86_of[n] >= 0) { x86_name(x86_of[n], w); return 0; }
+  x86_slot(n);
+  return 0;
+}
+
+int x86_xmm(int i) {
+  emit_s("%xmm"); emit_num(as_or[i]);
+  return 0;
+}
+
+// Width in bytes of register operand i
+int x86_width(int i) {
+  int k = as_ork[i];
+  if (k == RK_W || k == RK_S) return 4;
+  if (k == RK_H) return 2;
+  if (k == RK_B) return 1;
+  if (k == RK_Q) return 16;
+  return 8;
+}
+
+// Hardware register holding operand i, -1 if it is in memory, zero or not
+// a register
+int x86_hw(int i) {
+  if (x86_oreg[i] >= 0) return x86_oreg[i];
+  if (as_ok[i] != OPK_REG) return 0 - 1;
+  if (as_ork[i] != RK_X && as_ork[i] != RK_W) return 0 - 1;
+  if (as_or[i] == 31) {
+    if (as_osp[i]) return XR_SP;
+    return 0 - 1;
+  }
+  return x86_of[as_or[i]];
+}
+
+int x86_is_zr(int i) {
+  return as_ok[i] == OPK_REG && as_or[i] == 31 && as_osp[i] == 0 && x86_oreg[i] < 0;
+}
+
+// Operand i as a w-byte source
+int x86_src(int i, int w) {
+  if (x86_oreg[i] >= 0) { x86_name(x86_oreg[i], w); return 0; }
+  if (as_ok[i] == OPK_IMM) { emit_ch('$'); x86_num(as_ov[i]); return 0; }
+  x86_gpr(as_or[i], as_osp[i], w);
+  return 0;
+}
+
+int x86_load(int i, int id, int w) {
+  if (x86_hw(i) == id && w == 8) return 0;
+  if (as_ok[i] == OPK_IMM && x86_oreg[i] < 0 && w == 8 && (as_ov[i] > 2147483647 || as_ov[i] < 0 - 2147483648)) {
+    x86_ins("movabsq", 0); emit_ch('$'); x86_num(as_ov[i]);
+  } else {
+    x86_ins("mov", w); x86_src(i, w);
+  }
+  emit_s(", "); x86_name(id, w); emit_ch('\n');
+  return 0;
+}
+
+// Store hardware register id into the AArch64 register of operand i
+int x86_put(int i, int id) {
+  if (as_or[i] == 31 && as_osp[i] == 0) return 0;
+  int h = x86_of[as_or[i]];
+  if (as_or[i] == 31) { h = XR_SP; }
+  if (h == id) return 0;
+  x86_ins("mov", 8); x86_name(id, 8); emit_s(", "); x86_gpr(as_or[i], as_osp[i], 8); emit_ch('\n');
+  return 0;
+}
+
+// Operand i in r11 when an instruction cannot take it as it is
+int x86_to_r11(int i, int w) {
+  x86_load(i, XR_R11, w);
+  x86_oreg[i] = XR_R11;
+  return 0;
+}
+
+// Operand i as the source of a w-byte ALU instruction: applies a shift or
+// extend in r11 and keeps immediates within 32 bits
+int x86_prep(int i, int w) {
+  if (as_ok[i] == OPK_IMM) {
+    long v = as_ov[i];
+    if (w == 4) {
+      v = v & 4294967295;
+      if (v > 2147483647) { v = v - 4294967296; }
+    }
+    as_ov[i] = v;
+    if (v > 2147483647 || v < 0 - 2147483648) { x86_to_r11(i, 8); }
+    return 0;
+  }
+  if (as_ok[i] != OPK_REG) { as_error("invalid operand on x86-64"); }
+  int s = as_os[i];
+  if (s < 0) return 0;
+  int a = as_oa[i];
+  if (a < 0) { a = 0; }
+  int n = as_or[i];
+  if (s == SH_SXTW || s == SH_SXTH || s == SH_SXTB || s == SH_UXTB || s == SH_UXTH) {
+    if (s == SH_SXTW) { x86_ins("movslq", 0); x86_gpr(n, 0, 4); }
+    else if (s == SH_SXTH) { x86_ins("movswq", 0); x86_gpr(n, 0, 2); }
+    else if (s == SH_SXTB) { x86_ins("movsbq", 0); x86_gpr(n, 0, 1); }
+    else if (s == SH_UXTH) { x86_ins("movzwl", 0); x86_gpr(n, 0, 2); }
+    else { x86_ins("movzbl", 0); x86_gpr(n, 0, 1); }
+    if (s == SH_UXTB || s == SH_UXTH) { emit_line(", %r11d"); } else { emit_line(", %r11"); }
+    x86_oreg[i] = XR_R11;
+  } else if (s == SH_UXTW) {
+    x86_to_r11(i, 4);
+  } else {
+    x86_to_r11(i, w);
+  }
+  if (a == 0) return 0;
+  int *mn = "shl";
+  if (s == SH_LSR) { mn = "shr"; }
+  else if (s == SH_ASR) { mn = "sar"; }
+  else if (s == SH_ROR) { mn = "ror"; }
+  x86_ins(mn, w); emit_ch('$'); emit_num(a); emit_s(", "); x86_name(XR_R11, w); emit_ch('\n');
+  return 0;
+}
+
+// Operand i where only a register or memory will do
+int x86_rm(int i, int w) {
+  if (as_ok[i] == OPK_IMM || x86_is_zr(i)) { x86_to_r11(i, w); }
+  return 0;
+}
+
+// d = a mn b, computed in d itself when that is a hardware register b
+// does not need
+int x86_alu(int *mn, int d, int a, int b, int w, int commute) {
+  int t = x86_hw(d);
+  if (t >= 0 && x86_hw(b) == t && x86_hw(a) != t) {
+    if (commute) {
+      int k = a;
+      a = b;
+      b = k;
+    } else {
+      t = 0 - 1;
+    }
+  }
+  if (t < 0) { t = XR_AX; }
+  x86_load(a, t, w);
+  x86_ins(mn, w); x86_src(b, w); emit_s(", "); x86_name(t, w); emit_ch('\n');
+  x86_put(d, t);
+  return 0;
+}
+
+// ucomisd sets CF, ZF and PF all for an unordered result, so the flags of
+// a - b answer gt/ge/lt/le the AArch64 way but mi/lo/ls (and their
+// inverses) need b - a. Re-issue the compare the way round c needs it.
+int x86_fcc_orient(int c) {
+  if (x86_fcc == 0) return 0;
+  int want = 1;
+  if (c == 2 || c == 3 || c == 4 || c == 5 || c == 8 || c == 9) { want = 2; }
+  if (want == x86_fcc) return 0;
+  if (x86_fcmp_b < 0) { emit_line("\txorpd\t%xmm15, %xmm15"); }
+  int l = x86_fcmp_b;
+  int r = x86_fcmp_a;
+  if (want == 2) { l = x86_fcmp_a; r = x86_fcmp_b; }
+  if (x86_fcmp_s) { emit_s("\tucomiss\t%xmm"); } else { emit_s("\tucomisd\t%xmm"); }
+  if (l < 0) { emit_num(15); } else { emit_num(l); }
+  emit_s(", %xmm");
+  if (r < 0) { emit_num(15); } else { emit_num(r); }
+  emit_ch('\n');
+  x86_fcc = want;
+  return 0;
+}
+
+// x86 condition suffix for AArch64 condition c; after a floating-point
+// compare the flags are those of an unsigned comparison, and eq/ne also
+// need PF, which the callers test separately
+int x86_cc(int c) {
+  if (x86_fcc) { emit_s(x86_fcc_name[c]); } else { emit_s(x86_icc_name[c]); }
+  return 0;
+}
+
+int x86_init_cc() {
+  int *ic[15];
+  int *fc[15];
+  ic[0] = "e"; ic[1] = "ne"; ic[2] = "ae"; ic[3] = "b"; ic[4] = "s"; ic[5] = "ns";
+  ic[6] = "o"; ic[7] = "no"; ic[8] = "a"; ic[9] = "be"; ic[10] = "ge"; ic[11] = "l";
+  ic[12] = "g"; ic[13] = "le"; ic[14] = "mp";
+  // 2-5, 8 and 9 are read from swapped flags, see x86_fcc_orient
+  fc[0] = "e"; fc[1] = "ne"; fc[2] = "be"; fc[3] = "a"; fc[4] = "a"; fc[5] = "be";
+  fc[6] = "p"; fc[7] = "np"; fc[8] = "b"; fc[9] = "ae"; fc[10] = "ae"; fc[11] = "b";
+  fc[12] = "a"; fc[13] = "be"; fc[14] = "mp";
+  for (int c = 0; c < 15; c++) {
+    x86_icc_name[c] = ic[c];
+    x86_fcc_name[c] = fc[c];
+  }
+  return 0;
+}
+
+// Branch or call target operand i
+int x86_sym(int i) {
+  for (int k = 0; k < as_olen[i]; k++) { emit_ch(__read_byte(as_text, as_osym[i] + k)); }
+  if (as_ov[i] > 0) { emit_ch('+'); }
+  if (as_ov[i] != 0) { x86_num(as_ov[i]); }
+  return 0;
+}
+
+// ---- x86-64 lowering: memory operands ----
+
+// Address of memory operand i into x86_m*, loading a base that lives in
+// the frame into rax and folding an index that needs extending into it.
+// Post-indexed operands access the base itself.
+int x86_addr(int i, int post) {
+  long disp = as_ov[i];
+  if (post || as_omod[i] != AM_NONE) { disp = 0; }
+  int hb = XR_SP;
+  if (as_or[i] != 31) { hb = x86_of[as_or[i]]; }
+  int hx = 0 - 1;
+  int scale = 1;
+  if (as_ox[i] >= 0) {
+    int n = as_ox[i];
+    int s = as_os[i];
+    if (as_oa[i] > 0) { scale = 1 << as_oa[i]; }
+    if (s == SH_SXTW) {
+      x86_ins("movslq", 0); x86_gpr(n, 0, 4); emit_line(", %r11");
+      hx = XR_R11;
+    } else if (s == SH_UXTW) {
+      x86_ins("mov", 4); x86_gpr(n, 0, 4); emit_line(", %r11d");
+      hx = XR_R11;
+    } else {
+      hx = x86_of[n];
+      if (hx < 0) {
+        x86_ins("mov", 8); x86_gpr(n, 0, 8); emit_line(", %r11");
+        hx = XR_R11;
+      }
+    }
+  }
+  if (hb < 0) {
+    x86_ins("mov", 8); x86_slot(as_or[i]); emit_line(", %rax");
+    hb = XR_AX;
+  }
+  if (hx == XR_R11) {
+    x86_ins("lea", 8); emit_ch('('); x86_name(hb, 8); emit_s(", %r11, "); emit_num(scale);
+    emit_line("), %rax");
+    hb = XR_AX;
+    hx = 0 - 1;
+    scale = 1;
+  }
+  x86_mbase = hb;
+  x86_mindex = hx;
+  x86_mscale = scale;
+  x86_mdisp = disp;
+  return 0;
+}
+
+int x86_mem(long delta) {
+  long d = x86_mdisp + delta;
+  if (d != 0) { x86_num(d); }
+  emit_ch('(');
+  x86_name(x86_mbase, 8);
+  if (x86_mindex >= 0) {
+    emit_s(", "); x86_name(x86_mindex, 8); emit_s(", "); emit_num(x86_mscale);
+  }
+  emit_ch(')');
+  return 0;
+}
+
+// Base register of memory operand i += disp
+int x86_writeback(int i, long disp) {
+  x86_ins("lea", 8); x86_num(disp); emit_ch('('); x86_name(x86_mbase, 8); emit_s("), ");
+  x86_name(x86_mbase, 8); emit_ch('\n');
+  if (x86_mbase == XR_AX) {
+    x86_ins("mov", 8); emit_s("%rax, "); x86_slot(as_or[i]); emit_ch('\n');
+  }
+  return 0;
+}
+
+// Register operand i = size bytes at x86_mem(delta), sign-extended if sgn
+int x86_ld(int i, int size, int sgn, long delta) {
+  int k = as_ork[i];
+  if (k == RK_D || k == RK_S || k == RK_Q) {
+    if (k == RK_D) { x86_ins("movsd", 0); }
+    else if (k == RK_S) { x86_ins("movss", 0); }
+    else { x86_ins("movdqu", 0); }
+    x86_mem(delta); emit_s(", "); x86_xmm(i); emit_ch('\n');
+    return 0;
+  }
+  int w = x86_width(i);
+  int t = x86_hw(i);
+  if (t < 0) { t = XR_R11; }
+  int tw = 4;
+  if (size == 8) { x86_ins("mov", 8); tw = 8; }
+  else if (size == 4 && sgn) { x86_ins("movslq", 0); tw = 8; }
+  else if (size == 4) { x86_ins("mov", 4); }
+  else if (size == 2 && sgn && w == 8) { x86_ins("movswq", 0); tw = 8; }
+  else if (size == 2 && sgn) { x86_ins("movswl", 0); }
+  else if (size == 2) { x86_ins("movzwl", 0); }
+  else if (sgn && w == 8) { x86_ins("movsbq", 0); tw = 8; }
+  else if (sgn) { x86_ins("movsbl", 0); }
+  else { x86_ins("movzbl", 0); }
+  x86_mem(delta); emit_s(", "); x86_name(t, tw); emit_ch('\n');
+  x86_put(i, t);
+  return 0;
+}
+
+int x86_st(int i, int size, long delta) {
+  int k = as_ork[i];
+  if (k == RK_D || k == RK_S || k == RK_Q) {
+    if (k == RK_D) { x86_ins("movsd", 0); }
+    else if (k == RK_S) { x86_ins("movss", 0); }
+    else { x86_ins("movdqu", 0); }
+    x86_xmm(i); emit_s(", "); x86_mem(delta); emit_ch('\n');
+    return 0;
+  }
+  int h = x86_hw(i);
+  if (h < 0 && !x86_is_zr(i)) {
+    int lw = 8;
+    if (size < 8) { lw = 4; }
+    x86_load(i, XR_R11, lw);
+    h = XR_R11;
+  }
+  x86_ins("mov", size);
+  if (h < 0) { emit_s("$0"); } else { x86_name(h, size); }
+  emit_s(", "); x86_mem(delta); emit_ch('\n');
+  return 0;
+}
+
+// Saving or restoring x29 (and x30) at [sp, #-16]!: call has already
+// pushed the return address, so the frame record is a push or pop of rbp
+int x86_frame_record(int load, int m, int post) {
+  if (as_or[0] != 29 || as_or[m] != 31) return 0;
+  if (load && post && as_ov[m + 1] == 16) { emit_line("\tpopq\t%rbp"); return 1; }
+  if (load == 0 && as_owb[m] && as_ov[m] == 0 - 16) { emit_line("\tpushq\t%rbp"); return 1; }
+  return 0;
+}
+
+// ldr/str and their sized, signed and unscaled forms
+int x86_ldst(long aux) {
+  int sgn = (aux & 32) != 0 || (aux & 8) != 0;
+  int load = (aux & 4) != 0 || sgn;
+  int size = 1 << (aux & 3);
+  if (aux & 16) { size = x86_width(0); }
+  as_need(1, OPK_MEM);
+  int post = as_nop > 2 && as_ok[2] == OPK_IMM;
+  if (x86_frame_record(load, 1, post)) return 0;
+  x86_addr(1, post);
+  if (load && as_omod[1] == AM_GOTPAGEOFF) {
+    // The GOT entry's value is already in the base (see adrp)
+    x86_ins("mov", 8); x86_name(x86_mbase, 8); emit_s(", "); x86_gpr(as_or[0], 0, 8); emit_ch('\n');
+    return 0;
+  }
+  if (load) { x86_ld(0, size, sgn, 0); } else { x86_st(0, size, 0); }
+  if (post) { x86_writeback(1, as_ov[2]); }
+  else if (as_owb[1]) { x86_writeback(1, as_ov[1]); }
+  return 0;
+}
+
+int x86_ldp(long aux) {
+  as_need(2, OPK_MEM);
+  int size = x86_width(0);
+  int sgn = aux == 3;
+  if (sgn) { size = 4; }
+  int post = as_nop > 3 && as_ok[3] == OPK_IMM;
+  if (as_or[1] == 30 && x86_frame_record(aux & 1, 2, post)) return 0;
+  x86_addr(2, post);
+  if (aux & 1) {
+    // Load the register that is also the base last
+    if (x86_hw(0) >= 0 && x86_hw(0) == x86_mbase) {
+      x86_ld(1, size, sgn, size);
+      x86_ld(0, size, sgn, 0);
+    } else {
+      x86_ld(0, size, sgn, 0);
+      x86_ld(1, size, sgn, size);
+    }
+  } else {
+    x86_st(0, size, 0);
+    x86_st(1, size, size);
+  }
+  if (post) { x86_writeback(2, as_ov[3]); }
+  else if (as_owb[2]) { x86_writeback(2, as_ov[2]); }
+  return 0;
+}
+
+// ---- x86-64 lowering: instructions ----
+
+// Operand i (a register) = v
+int x86_const(int i, long v, int w) {
+  if (w == 4) { v = v & 4294967295; }
+  int t = x86_hw(i);
+  if (t < 0) { t = XR_AX; }
+  if (w == 4 || (v >= 0 && v <= 4294967295)) {
+    x86_ins("mov", 4); emit_ch('$'); x86_num(v); emit_s(", "); x86_name(t, 4);
+  } else if (v >= 0 - 2147483648) {
+    x86_ins("mov", 8); emit_ch('$'); x86_num(v); emit_s(", "); x86_name(t, 8);
+  } else {
+    x86_ins("movabsq", 0); emit_ch('$'); x86_num(v); emit_s(", "); x86_name(t, 8);
+  }
+  emit_ch('\n');
+  x86_put(i, t);
+  x86_kreg = as_or[i];
+  x86_kval = v;
+  return 0;
+}
+
+int x86_addsub(long aux) {
+  int w = x86_width(0);
+  int *mn = "add";
+  if (aux & 2) { mn = "sub"; }
+  if (as_ok[2] == OPK_SYM) {
+    // add x, x, :lo12:sym after the adrp that already made the address
+    if (x86_hw(0) != x86_hw(1) || x86_hw(0) < 0) { x86_load(1, XR_AX, 8); x86_put(0, XR_AX); }
+    return 0;
+  }
+  x86_prep(2, w);
+  int hd = x86_hw(0);
+  int ha = x86_hw(1);
+  int hb = x86_hw(2);
+  // Without flags to set, lea leaves them alone
+  if ((aux & 1) == 0 && hd >= 0 && ha >= 0 && as_ok[2] == OPK_IMM) {
+    long v = as_ov[2];
+    if (aux & 2) { v = 0 - v; }
+    if (v == 0 && hd == ha && w == 8) return 0;
+    x86_ins("lea", w); if (v != 0) { x86_num(v); }
+    emit_ch('('); x86_name(ha, 8); emit_s("), "); x86_name(hd, w); emit_ch('\n');
+    return 0;
+  }
+  if ((aux & 3) == 0 && hd >= 0 && ha >= 0 && hb >= 0 && hb != XR_SP) {
+    x86_ins("lea", w); emit_ch('('); x86_name(ha, 8); emit_s(", "); x86_name(hb, 8);
+    emit_s("), "); x86_name(hd, w); emit_ch('\n');
+    return 0;
+  }
+  x86_alu(mn, 0, 1, 2, w, (aux & 2) == 0);
+  return 0;
+}
+
+int x86_cmp(long aux) {
+  int w = x86_width(0);
+  x86_prep(1, w);
+  x86_fcc = 0;
+  if (aux == 1) {
+    // cmn a, #k is cmp a, #-k; with a register it takes an add
+    if (as_ok[1] == OPK_IMM && x86_oreg[1] < 0) {
+      as_ov[1] = 0 - as_ov[1];
+    } else {
+      x86_load(0, XR_AX, w);
+      x86_ins("add", w); x86_src(1, w); emit_line(", %rax");
+      return 0;
+    }
+  }
+  int ha = x86_hw(0);
+  if (ha < 0 && (x86_is_zr(0) || (as_ok[1] == OPK_REG && x86_hw(1) < 0 && !x86_is_zr(1)))) {
+    x86_load(0, XR_AX, w);
+    ha = XR_AX;
+  }
+  x86_ins("cmp", w); x86_src(1, w); emit_s(", ");
+  if (ha >= 0) { x86_name(ha, w); } else { x86_gpr(as_or[0], 0, w); }
+  emit_ch('\n');
+  return 0;
+}
+
+int x86_logic(long aux) {
+  int w = x86_width(0);
+  int op = aux & 3;
+  if (aux >= 4) {
+    // bic, orn, eon, bics: the second operand inverted
+    x86_prep(2, w);
+    if (x86_oreg[2] < 0) { x86_to_r11(2, w); }
+    x86_ins("not", w); x86_name(XR_R11, w); emit_ch('\n');
+    if (aux == 4) { op = 0; }
+    if (aux == 5) { op = 1; }
+    if (aux == 6) { op = 2; }
+    if (aux == 7) { op = 3; }
+  } else {
+    x86_prep(2, w);
+  }
+  int *mn = "and";
+  if (op == 1) { mn = "or"; }
+  if (op == 2) { mn = "xor"; }
+  x86_alu(mn, 0, 1, 2, w, 1);
+  if (op == 3) { x86_fcc = 0; }
+  return 0;
+}
+
+int x86_tst() {
+  int w = x86_width(0);
+  x86_prep(1, w);
+  x86_fcc = 0;
+  int ha = x86_hw(0);
+  if (ha < 0 && (x86_is_zr(0) || (as_ok[1] == OPK_REG && x86_hw(1) < 0))) {
+    x86_load(0, XR_AX, w);
+    ha = XR_AX;
+  }
+  x86_ins("test", w); x86_src(1, w); emit_s(", ");
+  if (ha >= 0) { x86_name(ha, w); } else { x86_gpr(as_or[0], 0, w); }
+  emit_ch('\n');
+  return 0;
+}
+
+// neg and mvn: d = op(b)
+int x86_unary(int *mn) {
+  int w = x86_width(0);
+  x86_prep(1, w);
+  int t = x86_hw(0);
+  if (t < 0) { t = XR_AX; }
+  x86_load(1, t, w);
+  x86_ins(mn, w); x86_name(t, w); emit_ch('\n');
+  x86_put(0, t);
+  return 0;
+}
+
+int x86_mov() {
+  int w = x86_width(0);
+  if (as_ok[1] == OPK_IMM) { return x86_const(0, as_ov[1], w); }
+  int hd = x86_hw(0);
+  int hs = x86_hw(1);
+  if (hd >= 0 && hd == hs && w == 8) return 0;
+  if (hd >= 0) { x86_load(1, hd, w); return 0; }
+  if (hs >= 0 && w == 8) { x86_put(0, hs); return 0; }
+  x86_load(1, XR_AX, w);
+  x86_put(0, XR_AX);
+  return 0;
+}
+
+int x86_movw(long aux, int kreg, long kval) {
+  int w = x86_width(0);
+  long v = as_ov[1];
+  int sh = as_oa[1];
+  if (sh < 0) { sh = 0; }
+  if (aux == 0) { return x86_const(0, 0 - 1 - v, w); }
+  if (aux == 2) { return x86_const(0, v, w); }
+  long mask = 65535;
+  mask = mask << sh;
+  if (kreg == as_or[0]) { return x86_const(0, (kval & (0 - 1 - mask)) | v, w); }
+  x86_load(0, XR_AX, w);
+  x86_ins("movabsq", 0); emit_ch('$'); x86_num(0 - 1 - mask); emit_line(", %r11");
+  x86_rr("and", XR_R11, XR_AX, 8);
+  x86_ins("movabsq", 0); emit_ch('$'); x86_num(v); emit_line(", %r11");
+  x86_rr("or", XR_R11, XR_AX, 8);
+  x86_put(0, XR_AX);
+  return 0;
+}
+
+// Shift of a by register b; x86 wants the count in cl, which is x3
+int x86_varshift(int *mn, int w) {
+  x86_load(1, XR_AX, w);
+  x86_load(2, XR_R11, 8);
+  x86_rr("xchg", XR_CX, XR_R11, 8);
+  x86_ins(mn, w); emit_s("%cl, "); x86_name(XR_AX, w); emit_ch('\n');
+  x86_rr("mov", XR_R11, XR_CX, 8);
+  x86_put(0, XR_AX);
+  return 0;
+}
+
+int x86_shift(long aux) {
+  int w = x86_width(0);
+  int *mn = "shl";
+  if (aux == 1) { mn = "shr"; }
+  if (aux == 2) { mn = "sar"; }
+  if (aux == 3) { mn = "ror"; }
+  if (as_ok[2] != OPK_IMM) { return x86_varshift(mn, w); }
+  int t = x86_hw(0);
+  if (t < 0) { t = XR_AX; }
+  x86_load(1, t, w);
+  int n = as_ov[2] & (8 * w - 1);
+  if (n != 0) { x86_ins(mn, w); emit_ch('$'); emit_num(n); emit_s(", "); x86_name(t, w); emit_ch('\n'); }
+  x86_put(0, t);
+  return 0;
+}
+
+int x86_extend(long aux) {
+  int w = x86_width(0);
+  int bits = (aux & 255) + 1;
+  int t = x86_hw(0);
+  if (t < 0) { t = XR_AX; }
+  if (x86_is_zr(1)) { x86_ins("mov", 4); emit_s("$0, "); x86_name(t, 4); emit_ch('\n'); x86_put(0, t); return 0; }
+  int tw = 4;
+  if (aux >= 256) {
+    if (bits == 32) { x86_ins("movslq", 0); tw = 8; }
+    else if (bits == 16 && w == 8) { x86_ins("movswq", 0); tw = 8; }
+    else if (bits == 16) { x86_ins("movswl", 0); }
+    else if (w == 8) { x86_ins("movsbq", 0); tw = 8; }
+    else { x86_ins("movsbl", 0); }
+  } else if (bits == 16) {
+    x86_ins("movzwl", 0);
+  } else {
+    x86_ins("movzbl", 0);
+  }
+  x86_gpr(as_or[1], 0, bits / 8); emit_s(", "); x86_name(t, tw); emit_ch('\n');
+  x86_put(0, t);
+  return 0;
+}
+
+// Divisions by zero give zero and INT_MIN / -1 wraps, as on AArch64
+int x86_div(int sgn, int w) {
+  x86_load(1, XR_AX, w);
+  x86_load(2, XR_R11, w);
+  x86_rr("test", XR_R11, XR_R11, w);
+  emit_line("\tjz\t1f");
+  if (sgn) {
+    x86_ins("cmp", w); emit_s("$-1, "); x86_name(XR_R11, w); emit_ch('\n');
+    emit_line("\tje\t2f");
+  }
+  emit_line("\tpushq\t%rdx");
+  if (sgn && w == 8) { emit_line("\tcqto"); }
+  else if (sgn) { emit_line("\tcltd"); }
+  else { emit_line("\txorl\t%edx, %edx"); }
+  if (sgn) { x86_ins("idiv", w); } else { x86_ins("div", w); }
+  x86_name(XR_R11, w); emit_ch('\n');
+  emit_line("\tpopq\t%rdx");
+  emit_line("\tjmp\t3f");
+  emit_line("1:");
+  emit_line("\txorl\t%eax, %eax");
+  if (sgn) {
+    emit_line("\tjmp\t3f");
+    emit_line("2:");
+    x86_ins("neg", w); x86_name(XR_AX, w); emit_ch('\n');
+  }
+  emit_line("3:");
+  x86_put(0, XR_AX);
+  return 0;
+}
+
+int x86_dp(int cls, long aux) {
+  int w = x86_width(0);
+  if (cls == AC_DP2) {
+    if (aux == 0x1AC00800) return x86_div(0, w);
+    if (aux == 0x1AC00C00) return x86_div(1, w);
+    if (aux == 0x1AC02000) return x86_varshift("shl", w);
+    if (aux == 0x1AC02400) return x86_varshift("shr", w);
+    if (aux == 0x1AC02800) return x86_varshift("sar", w);
+    return x86_varshift("ror", w);
+  }
+  int t = x86_hw(0);
+  if (t < 0) { t = XR_AX; }
+  if (aux == 0x5AC00C00 || (aux == 0x5AC00800 && w == 4)) {
+    x86_load(1, t, w);
+    x86_ins("bswap", w); x86_name(t, w); emit_ch('\n');
+  } else if (aux == 0x5AC01000) {
+    x86_rm(1, w);
+    x86_ins("lzcnt", w); x86_src(1, w); emit_s(", "); x86_name(t, w); emit_ch('\n');
+  } else {
+    as_error("instruction not supported on x86-64");
+  }
+  x86_put(0, t);
+  return 0;
+}
+
+int x86_mul(long aux) {
+  int w = x86_width(0);
+  if (aux == 0x9B407C00 || aux == 0x9BC07C00) {
+    // smulh, umulh: the high half lands in rdx
+    x86_load(1, XR_AX, 8);
+    x86_load(2, XR_R11, 8);
+    emit_line("\tpushq\t%rdx");
+    if (aux == 0x9B407C00) { emit_line("\timulq\t%r11"); } else { emit_line("\tmulq\t%r11"); }
+    x86_rr("mov", XR_DX, XR_R11, 8);
+    emit_line("\tpopq\t%rdx");
+    x86_put(0, XR_R11);
+    return 0;
+  }
+  if (aux == 0x9B207C00 || aux == 0x9BA07C00) {
+    // smull, umull: 32 x 32 -> 64
+    if (aux == 0x9B207C00) {
+      x86_ins("movslq", 0); x86_gpr(as_or[1], 0, 4); emit_line(", %rax");
+      x86_ins("movslq", 0); x86_gpr(as_or[2], 0, 4); emit_line(", %r11");
+    } else {
+      x86_load(1, XR_AX, 4);
+      x86_load(2, XR_R11, 4);
+    }
+    x86_rr("imul", XR_R11, XR_AX, 8);
+    x86_put(0, XR_AX);
+    return 0;
+  }
+  x86_rm(2, w);
+  if (aux == 0x1B007C00) { return x86_alu("imul", 0, 1, 2, w, 1); }
+  x86_load(1, XR_AX, w);
+  x86_ins("imul", w); x86_src(2, w); emit_line(", %rax");
+  x86_ins("neg", w); x86_name(XR_AX, w); emit_ch('\n');
+  x86_put(0, XR_AX);
+  return 0;
+}
+
+int x86_madd(long aux) {
+  int w = x86_width(0);
+  x86_rm(2, w);
+  x86_load(1, XR_AX, w);
+  x86_ins("imul", w); x86_src(2, w); emit_s(", "); x86_name(XR_AX, w); emit_ch('\n');
+  if (aux == 0x1B000000) {
+    x86_ins("add", w); x86_src(3, w); emit_s(", "); x86_name(XR_AX, w); emit_ch('\n');
+    x86_put(0, XR_AX);
+    return 0;
+  }
+  x86_oreg[3] = 0 - 1;
+  x86_load(3, XR_R11, w);
+  x86_rr("sub", XR_AX, XR_R11, w);
+  x86_put(0, XR_R11);
+  return 0;
+}
+
+// r11 = f(r11) for the csinc/csinv/csneg family without touching the flags
+int x86_csfun(long aux, int w) {
+  if (aux == 0x5A800000 || aux == 0x5A800400) { x86_ins("not", w); x86_name(XR_R11, w); emit_ch('\n'); }
+  if (aux == 0x1A800400 || aux == 0x5A800400) {
+    x86_ins("lea", w); emit_s("1(%r11), "); x86_name(XR_R11, w); emit_ch('\n');
+  }
+  return 0;
+}
+
+// rax = r11 if condition c holds
+int x86_cmov(int c, int w) {
+  x86_fcc_orient(c);
+  if (x86_fcc && c == 0) { emit_line("\tjp\t1f"); }
+  emit_s("\tcmov"); x86_cc(c); emit_ch('\t'); x86_name(XR_R11, w); emit_s(", "); x86_name(XR_AX, w); emit_ch('\n');
+  if (x86_fcc && c == 0) { emit_line("1:"); }
+  if (x86_fcc && c == 1) { emit_s("\tcmovp\t"); x86_name(XR_R11, w); emit_s(", "); x86_name(XR_AX, w); emit_ch('\n'); }
+  return 0;
+}
+
+int x86_csel(int cls, long aux) {
+  int w = x86_width(0);
+  if (cls == AC_CSET) {
+    int c = as_cond(1);
+    int t = x86_hw(0);
+    if (t < 0) { t = XR_AX; }
+    x86_fcc_orient(c);
+    emit_s("\tset"); x86_cc(c); emit_ch('\t'); x86_name(t, 1); emit_ch('\n');
+    if (x86_fcc && c < 2) {
+      // unordered is not equal
+      if (c == 0) { emit_line("\tsetnp\t%r11b"); x86_ins("and", 1); }
+      else { emit_line("\tsetp\t%r11b"); x86_ins("or", 1); }
+      emit_s("%r11b, "); x86_name(t, 1); emit_ch('\n');
+    }
+    x86_ins("movzb", 4); x86_name(t, 1); emit_s(", "); x86_name(t, 4); emit_ch('\n');
+    if (aux == 0x5A800000) { x86_ins("neg", w); x86_name(t, w); emit_ch('\n'); }
+    x86_put(0, t);
+    return 0;
+  }
+  if (cls == AC_CINC) {
+    // d = cond ? f(a) : a
+    int c = as_cond(2);
+    x86_load(1, XR_AX, w);
+    x86_rr("mov", XR_AX, XR_R11, 8);
+    x86_csfun(aux, w);
+    x86_cmov(c, w);
+    x86_put(0, XR_AX);
+    return 0;
+  }
+  // d = cond ? a : f(b)
+  int c = as_cond(3);
+  x86_load(2, XR_R11, w);
+  x86_csfun(aux, w);
+  x86_load(1, XR_AX, w);
+  x86_cmov(c ^ 1, w);
+  x86_put(0, XR_AX);
+  return 0;
+}
+
+// The bits of fmov's 8-bit immediate as a double (64) or float (32)
+long x86_fimm_bits(long imm, int w) {
+  long b6 = (imm >> 6) & 1;
+  long sign = (imm >> 7) & 1;
+  if (w == 8) {
+    long e = ((b6 ^ 1) << 10) | ((imm >> 4) & 3);
+    if (b6) { e = e | (255 << 2); }
+    return (sign << 63) | (e << 52) | ((imm & 15) << 48);
+  }
+  long e32 = ((b6 ^ 1) << 7) | ((imm >> 4) & 3);
+  if (b6) { e32 = e32 | (31 << 2); }
+  return (sign << 31) | (e32 << 23) | ((imm & 15) << 19);
+}
+
+int x86_fmov() {
+  int kd = as_ork[0];
+  int dfp = kd == RK_D || kd == RK_S;
+  int w = x86_width(0);
+  if (as_ok[1] == OPK_FIMM) {
+    if (as_ov[1] == 256) {
+      emit_s("\txorpd\t"); x86_xmm(0); emit_s(", "); x86_xmm(0); emit_ch('\n');
+      return 0;
     }
+    x86_ins("movabsq", 0); emit_ch('$'); x86_num(x86_fimm_bits(as_ov[1], w)); emit_line(", %rax");
+    if (w == 8) { emit_s("\tmovq\t%rax, "); } else { emit_s("\tmovd\t%eax, "); }
+    x86_xmm(0); emit_ch('\n');
+    return 0;
+  }
+  int ks = as_ork[1];
+  int sfp = ks == RK_D || ks == RK_S;
+  if (dfp && sfp) {
+    if (as_or[0] == as_or[1]) return 0;
+    emit_s("\tmovapd\t"); x86_xmm(1); emit_s(", "); x86_xmm(0); emit_ch('\n');
+    return 0;
+  }
+  if (dfp) {
+    if (x86_is_zr(1)) { emit_s("\txorpd\t"); x86_xmm(0); emit_s(", "); x86_xmm(0); emit_ch('\n'); return 0; }
+    if (w == 8) { emit_s("\tmovq\t"); } else { emit_s("\tmovd\t"); }
+    x86_src(1, w); emit_s(", "); x86_xmm(0); emit_ch('\n');
+    return 0;
   }
+  int t = x86_hw(0);
+  if (t < 0) { t = XR_AX; }
+  if (w == 8) { emit_s("\tmovq\t"); } else { emit_s("\tmovd\t"); }
+  x86_xmm(1); emit_s(", "); x86_name(t, w); emit_ch('\n');
+  x86_put(0, t);
   return 0;
 }
 
-int cg_emit_strings() {
-  int i = 0;
-  // String pool (emitted last so globals/static locals can intern strings)
-  if (nsp > 0) {
-    emit_ch('\n');
-    emit_line("\t.section\t__TEXT,__cstring,cstring_literals");
-    i = 0;
-    while (i < nsp) {
-      emit_s(sp_label[i]); emit_line(":");
-      emit_s("\t.asciz\t\"");
-      cg_emit_escaped_string(sp_decoded[i]);
-      emit_line("\"");
-      i++;
+int x86_fcvti(long aux) {
+  if (aux < 2) {
+    // scvtf, ucvtf: integer operand 1 to floating-point operand 0
+    int *cv = "\tcvtsi2sd";
+    if (as_ork[0] == RK_S) { cv = "\tcvtsi2ss"; }
+    int w = x86_width(1);
+    if (aux == 1 && w == 4) {
+      x86_load(1, XR_R11, 4);
+      x86_oreg[1] = XR_R11;
+      w = 8;
+    }
+    x86_rm(1, w);
+    if (aux == 1) {
+      // Halve values with the top bit set, keeping the low bit for rounding
+      x86_load(1, XR_R11, 8);
+      emit_line("\ttestq\t%r11, %r11");
+      emit_line("\tjs\t1f");
+      emit_s(cv); emit_s("q\t%r11, "); x86_xmm(0); emit_ch('\n');
+      emit_line("\tjmp\t2f");
+      emit_line("1:");
+      emit_line("\tmovq\t%r11, %rax");
+      emit_line("\tshrq\t$1, %rax");
+      emit_line("\tandl\t$1, %r11d");
+      emit_line("\torq\t%r11, %rax");
+      emit_s(cv); emit_s("q\t%rax, "); x86_xmm(0); emit_ch('\n');
+      if (as_ork[0] == RK_S) { emit_s("\taddss\t"); } else { emit_s("\taddsd\t"); }
+      x86_xmm(0); emit_s(", "); x86_xmm(0); emit_ch('\n');
+      emit_line("2:");
+      return 0;
     }
+    emit_s(cv); if (w == 8) { emit_ch('q'); } else { emit_ch('l'); }
+    emit_ch('\t'); x86_src(1, w); emit_s(", "); x86_xmm(0); emit_ch('\n');
+    return 0;
   }
+  // fcvtzs, fcvtzu: truncate toward zero; unsigned goes through 64 bits
+  int w = x86_width(0);
+  int t = x86_hw(0);
+  if (t < 0) { t = XR_AX; }
+  int cw = w;
+  if (aux == 3) { cw = 8; }
+  if (as_ork[1] == RK_S) { emit_s("\tcvttss2si\t"); } else { emit_s("\tcvttsd2si\t"); }
+  x86_xmm(1); emit_s(", "); x86_name(t, cw); emit_ch('\n');
+  if (cw != w) { x86_rr("mov", t, t, 4); }
+  x86_put(0, t);
   return 0;
 }
 
-int codegen(struct Program *prog) {
-  struct FuncDef *fd = 0;
-  struct GDecl *gd = 0;
-  int i = 0;
-  int k = 0;
-  int ch = 0;
-  label_id = 0;
-  nsp = 0;
-  nloop = 0;
-  ncg_s = 0;
-  n_ptr_ret = 0;
-  n_unsigned_ret = 0;
-  nsl = 0;
-
-  cg_register_functions(prog);
-  cg_register_globals(prog);
-  cg_register_structs(prog);
-
-  emit_line("\t.text");
+int x86_fp(int cls, long aux) {
+  int s = as_ork[0] == RK_S;
+  if (cls == AC_FCVT) {
+    if (as_ork[0] == RK_D) { emit_s("\tcvtss2sd\t"); } else { emit_s("\tcvtsd2ss\t"); }
+    x86_xmm(1); emit_s(", "); x86_xmm(0); emit_ch('\n');
+    return 0;
+  }
+  if (cls == AC_FCMP) {
+    x86_fcc = 1;
+    x86_fcmp_a = as_or[0];
+    x86_fcmp_b = 0 - 1;
+    if (as_ok[1] != OPK_FIMM) { x86_fcmp_b = as_or[1]; }
+    x86_fcmp_s = s;
+    if (as_ok[1] == OPK_FIMM) {
+      emit_line("\txorpd\t%xmm15, %xmm15");
+      if (s) { emit_s("\tucomiss\t%xmm15, "); } else { emit_s("\tucomisd\t%xmm15, "); }
+    } else {
+      if (s) { emit_s("\tucomiss\t"); } else { emit_s("\tucomisd\t"); }
+      x86_xmm(1); emit_s(", ");
+    }
+    x86_xmm(0); emit_ch('\n');
+    return 0;
+  }
+  if (cls == AC_FP1) {
+    if (aux == 0x1E21C000) {
+      if (s) { emit_s("\tsqrtss\t"); } else { emit_s("\tsqrtsd\t"); }
+      x86_xmm(1); emit_s(", "); x86_xmm(0); emit_ch('\n');
+      return 0;
+    }
+    // fneg, fabs: flip or clear the sign bit
+    int *mn = "\tbtcq\t$63, %rax";
+    if (aux == 0x1E20C000) { mn = "\tbtrq\t$63, %rax"; }
+    if (s) {
+      mn = "\tbtcl\t$31, %eax";
+      if (aux == 0x1E20C000) { mn = "\tbtrl\t$31, %eax"; }
+      emit_s("\tmovd\t"); x86_xmm(1); emit_line(", %eax");
+      emit_line(mn);
+      emit_s("\tmovd\t%eax, "); x86_xmm(0); emit_ch('\n');
+      return 0;
+    }
+    emit_s("\tmovq\t"); x86_xmm(1); emit_line(", %rax");
+    emit_line(mn);
+    emit_s("\tmovq\t%rax, "); x86_xmm(0); emit_ch('\n');
+    return 0;
+  }
+  int *mn = "add";
+  if (aux == 0x1E203800) { mn = "sub"; }
+  if (aux == 0x1E200800) { mn = "mul"; }
+  if (aux == 0x1E201800) { mn = "div"; }
+  int *sfx = "sd\t";
+  if (s) { sfx = "ss\t"; }
+  if (as_or[0] == as_or[1]) {
+    emit_ch('\t'); emit_s(mn); emit_s(sfx); x86_xmm(2); emit_s(", "); x86_xmm(0); emit_ch('\n');
+    return 0;
+  }
+  if (as_or[0] != as_or[2]) {
+    emit_s("\tmovapd\t"); x86_xmm(1); emit_s(", "); x86_xmm(0); emit_ch('\n');
+    emit_ch('\t'); emit_s(mn); emit_s(sfx); x86_xmm(2); emit_s(", "); x86_xmm(0); emit_ch('\n');
+    return 0;
+  }
+  emit_s("\tmovapd\t"); x86_xmm(1); emit_line(", %xmm15");
+  emit_ch('\t'); emit_s(mn); emit_s(sfx); x86_xmm(2); emit_line(", %xmm15");
+  emit_s("\tmovapd\t%xmm15, "); x86_xmm(0); emit_ch('\n');
+  return 0;
+}
 
-  i = 0;
-  while (i < prog->nfuncs) {
-    gen_func(prog->funcs[i]);
-    i++;
+// cnt v.8b then addv b: a population count
+int x86_simd(long aux) {
+  if (aux == 0x0E205800) {
+    emit_s("\tmovq\t"); x86_xmm(1); emit_line(", %rax");
+    emit_line("\tpopcntq\t%rax, %rax");
+    emit_s("\tmovq\t%rax, "); x86_xmm(0); emit_ch('\n');
+  } else if (as_or[0] != as_or[1]) {
+    emit_s("\tmovapd\t"); x86_xmm(1); emit_s(", "); x86_xmm(0); emit_ch('\n');
   }
+  return 0;
+}
 
-  cg_emit_globals(prog);
+// bl and blr; the result comes back in rax and goes on to x0
+int x86_call(int reg) {
+  emit_s("\tcall\t");
+  if (reg) {
+    emit_ch('*');
+    x86_gpr(as_or[0], 0, 8);
+  } else {
+    x86_sym(0);
+  }
+  emit_ch('\n');
+  emit_line("\tmovq\t%rax, %rdi");
+  return 0;
+}
 
-  // Emit static local variables
-  if (nsl > 0) {
-    emit_ch('\n');
-    emit_line("\t.data");
-    i = 0;
-    while (i < nsl) {
-      emit_line("\t.p2align\t3");
-      emit_s(sl[i].label);
-      emit_line(":");
-      if (sl[i].has_init == 2 && sl[i].init_list != 0) {
-        // Init list for static local array
-        int si_j = 0;
-        int si_n = sl[i].init_list->nargs;
-        int si_arr = sl[i].arr_size;
-        if (si_arr < 0) { si_arr = si_n; }
-        // Build char-array-slot map for static local struct arrays
-        int *sl_ca_map = 0;
-        int sl_nfpe = 1;
-        if (sl[i].stype != 0) {
-          sl_nfpe = cg_struct_nfields(sl[i].stype);
-          if (sl_nfpe > 1) {
-            sl_ca_map = my_malloc(sl_nfpe * 8);
-            int csm = 0;
-            while (csm < sl_nfpe) { sl_ca_map[csm] = 0; csm++; }
-            int *resolved_s = cg_resolve_sname(sl[i].stype);
-            int sci = 0;
-            while (sci < ncg_s) {
-              if (cg_sname[sci] != 0 && my_strcmp(cg_sname[sci], resolved_s) == 0) {
-                int slot_pos = 0;
-                int fj = 0;
-                while (fj < cg_snfields[sci]) {
-                  int f_slots = 1;
-                  if (cg_sfield_types[sci][fj] != 0) {
-                    f_slots = cg_struct_nfields(cg_sfield_types[sci][fj]);
-                  }
-                  if (cg_s_fa[sci] != 0 && cg_s_fa[sci][fj] > 0) {
-                    if (cg_s_fc[sci] != 0 && cg_s_fc[sci][fj]) {
-                      if (slot_pos < sl_nfpe) { sl_ca_map[slot_pos] = cg_s_fa[sci][fj]; }
-                      f_slots = 1;
-                    } else {
-                      f_slots = f_slots * cg_s_fa[sci][fj];
-                    }
-                  }
-                  slot_pos += f_slots;
-                  fj++;
-                }
-                break;
-              }
-              sci++;
-            }
-          }
-        }
-        while (si_j < si_arr) {
-          if (si_j < si_n && sl[i].init_list->args[si_j] != 0 && sl[i].init_list->args[si_j]->kind == ND_NUM) {
-            emit_s("\t.quad\t"); emit_num(sl[i].init_list->args[si_j]->ival); emit_ch('\n');
-          } else if (si_j < si_n && sl[i].init_list->args[si_j] != 0 && sl[i].init_list->args[si_j]->kind == ND_STRLIT) {
-            if (sl_ca_map != 0 && sl_ca_map[si_j % sl_nfpe] > 0) {
-              // Pack string bytes into .quad hex for char array field
-              int *decoded = cg_decode_string(sl[i].init_list->args[si_j]->sval);
-              int plen = my_strlen(decoded);
-              int packed = 0;
-              int pi = 0;
-              while (pi < 8 && pi < plen) {
-                packed = packed | (__read_byte(decoded, pi) << (pi * 8));
-                pi++;
-              }
-              emit_s("\t.quad\t0x");
-              int hi = 15;
-              while (hi >= 0) {
-                int nibble = (packed >> (hi * 4)) & 0xF;
-                if (nibble < 10) { emit_ch('0' + nibble); }
-                else { emit_ch('a' + nibble - 10); }
-                hi = hi - 1;
-              }
-              emit_ch('\n');
-            } else {
-              int *sl_str_label = cg_intern_string(sl[i].init_list->args[si_j]->sval);
-              emit_s("\t.quad\t"); emit_s(sl_str_label); emit_ch('\n');
-            }
-          } else {
-            emit_line("\t.quad\t0");
-          }
-          si_j++;
-        }
-      } else if (sl[i].has_init == 1) {
-        emit_s("\t.quad\t");
-        emit_num(sl[i].init_val);
-        emit_ch('\n');
-      } else {
-        emit_line("\t.quad\t0");
-      }
-      i++;
+int x86_insn(int cls, long aux, int kreg, long kval) {
+  for (int i = 0; i < 8; i++) { x86_oreg[i] = 0 - 1; }
+  // A trailing shift belongs to the operand before it
+  if (as_nop > 1 && as_ok[as_nop - 1] == OPK_SHIFT) {
+    as_os[as_nop - 2] = as_os[as_nop - 1];
+    as_oa[as_nop - 2] = as_oa[as_nop - 1];
+    as_nop--;
+  }
+  for (int i = 0; i < as_nop; i++) {
+    if (as_ok[i] == OPK_IMM && as_os[i] == SH_LSL) {
+      as_ov[i] = as_ov[i] << as_oa[i];
+      as_os[i] = 0 - 1;
+    }
+  }
+  if (cls == AC_ADDSUB) {
+    if (aux & 1) { x86_fcc = 0; }
+    return x86_addsub(aux);
+  }
+  if (cls == AC_CMP) return x86_cmp(aux);
+  if (cls == AC_NEG) {
+    if (aux & 1) { x86_fcc = 0; }
+    return x86_unary("neg");
+  }
+  if (cls == AC_LOGIC) return x86_logic(aux);
+  if (cls == AC_TST) return x86_tst();
+  if (cls == AC_MVN) return x86_unary("not");
+  if (cls == AC_MOV) return x86_mov();
+  if (cls == AC_MOVW) return x86_movw(aux, kreg, kval);
+  if (cls == AC_SHIFT) return x86_shift(aux);
+  if (cls == AC_EXTEND) return x86_extend(aux);
+  if (cls == AC_DP1 || cls == AC_DP2) return x86_dp(cls, aux);
+  if (cls == AC_MUL) return x86_mul(aux);
+  if (cls == AC_MADD) return x86_madd(aux);
+  if (cls == AC_CSEL || cls == AC_CSET || cls == AC_CINC) return x86_csel(cls, aux);
+  if (cls == AC_LDST) return x86_ldst(aux);
+  if (cls == AC_LDP) return x86_ldp(aux);
+  if (cls == AC_B && aux == 0) { emit_s("\tjmp\t"); x86_sym(0); emit_ch('\n'); return 0; }
+  if (cls == AC_B) return x86_call(0);
+  if (cls == AC_BCOND) {
+    x86_fcc_orient(aux);
+    if (x86_fcc && aux == 0) { emit_line("\tjp\t1f"); }
+    if (x86_fcc && aux == 1) { emit_s("\tjp\t"); x86_sym(0); emit_ch('\n'); }
+    if (aux == 14) { emit_s("\tjmp\t"); } else { emit_s("\tj"); x86_cc(aux); emit_ch('\t'); }
+    x86_sym(0); emit_ch('\n');
+    if (x86_fcc && aux == 0) { emit_line("1:"); }
+    return 0;
+  }
+  if (cls == AC_CB) {
+    int w = x86_width(0);
+    int h = x86_hw(0);
+    if (h >= 0) { x86_rr("test", h, h, w); }
+    else { x86_ins("cmp", w); emit_s("$0, "); x86_gpr(as_or[0], 0, w); emit_ch('\n'); }
+    if (aux == 0) { emit_s("\tje\t"); } else { emit_s("\tjne\t"); }
+    x86_sym(1); emit_ch('\n');
+    return 0;
+  }
+  if (cls == AC_TB) {
+    int w = 4;
+    if (as_ov[1] >= 32) { w = 8; }
+    x86_ins("bt", w); emit_ch('$'); x86_num(as_ov[1]); emit_s(", "); x86_gpr(as_or[0], 0, w); emit_ch('\n');
+    if (aux == 0) { emit_s("\tjnc\t"); } else { emit_s("\tjc\t"); }
+    x86_sym(2); emit_ch('\n');
+    return 0;
+  }
+  if (cls == AC_BR) {
+    if (aux == 0xD63F0000) return x86_call(1);
+    if (aux == 0xD61F0000) { emit_s("\tjmp\t*"); x86_gpr(as_or[0], 0, 8); emit_ch('\n'); return 0; }
+    emit_line("\tmovq\t%rdi, %rax");
+    emit_line("\tret");
+    return 0;
+  }
+  if (cls == AC_ADRP) {
+    int t = x86_hw(0);
+    if (t < 0) { t = XR_AX; }
+    if (as_omod[1] == AM_GOTPAGE) {
+      x86_ins("mov", 8); x86_sym(1); emit_s("@GOTPCREL(%rip), ");
+    } else {
+      x86_ins("lea", 8); x86_sym(1); emit_s("(%rip), ");
     }
+    x86_name(t, 8); emit_ch('\n');
+    x86_put(0, t);
+    return 0;
   }
+  if (cls == AC_NOP) { emit_line("\tnop"); return 0; }
+  if (cls == AC_FMOV) return x86_fmov();
+  if (cls == AC_FCVTI) return x86_fcvti(aux);
+  if (cls == AC_FCVT || cls == AC_FP1 || cls == AC_FP2 || cls == AC_FCMP) return x86_fp(cls, aux);
+  if (cls == AC_SIMD) return x86_simd(aux);
+  as_error("instruction not supported on x86-64");
+  return 0;
+}
 
-  cg_emit_strings();
+int x86_copy_line() {
+  for (int k = as_line; k < as_end; k++) { emit_ch(__read_byte(as_text, k)); }
+  emit_ch('\n');
+  return 0;
+}
 
+int x86_statement() {
+  int kreg = x86_kreg;
+  long kval = x86_kval;
+  x86_kreg = 0 - 1;
+  as_skip();
+  int st = as_p;
+  int e = as_ident_end(st);
+  if (e > st && e < as_end && __read_byte(as_text, e) == ':') {
+    for (int k = st; k <= e; k++) { emit_ch(__read_byte(as_text, k)); }
+    emit_ch('\n');
+    as_p = e + 1;
+    as_skip();
+    st = as_p;
+    e = as_ident_end(st);
+    if (e == st) return 0;
+  }
+  if (e == st || __read_byte(as_text, st) == '.') return x86_copy_line();
+  int m = as_lookup_mnemonic(st, e - st);
+  if (m < 0) { as_error("unknown instruction"); }
+  as_p = e;
+  as_nop = 0;
+  as_skip();
+  while (as_ch() != '\n') {
+    if (as_nop >= 6) { as_error("too many operands"); }
+    as_operand(as_nop);
+    as_nop++;
+    as_skip();
+    if (as_ch() == ',') { as_p++; }
+    else if (as_ch() != '\n') { as_error("syntax error"); }
+  }
+  return x86_insn(as_mn_class[m], as_mn_aux[m], kreg, kval);
+}
+
+// Emit the x86-64 translation of the whole functions or data in
+// text[0, n) to outbuf
+int x86_lower(int *text, int n) {
+  as_text = text;
+  npeep_line_end = MAX_PEEP_LINES;
+  int p = 0;
+  while (p < n) {
+    int e = p;
+    while (e < n && __read_byte(as_text, e) != '\n') { e++; }
+    as_line = p;
+    as_end = e;
+    as_p = p;
+    x86_statement();
+    p = e + 1;
+  }
+  as_line = 0;
+  as_end = 0;
   return 0;
 }
 
+// What follows the last translated line
+int x86_finish() {
+  emit_line("\t.section\t.note.GNU-stack,\"\",@progbits");
+  return 0;
+}
 
 // ---- Driver ----
 
@@ -12079,12 +20950,54 @@ int ninclude_dirs;
 int *cc_out_path;
 int *cc_c_path;
 
+// Does sub occur in s at byte k?
+int str_at(int *s, int k, int *sub) {
+  int j = 0;
+  while (__read_byte(sub, j) != 0) {
+    if (__read_byte(s, k + j) != __read_byte(sub, j)) return 0;
+    j++;
+  }
+  return 1;
+}
+
+// Select the object format for a target triple: Linux means ELF/GAS
+// syntax linked by the GNU cross toolchain, Apple means Mach-O. x86-64 is
+// Linux only and is built by the host's own cc.
+int set_target(int *triple) {
+  int x86 = str_at(triple, 0, "x86_64-") || str_at(triple, 0, "amd64-");
+  int n = my_strlen(triple);
+  int is_linux = 0;
+  for (int k = 0; k < n; k++) {
+    if (str_at(triple, k, "linux")) { is_linux = 1; }
+  }
+  if ((x86 && !is_linux) || (!x86 && str_at(triple, 0, "aarch64-") == 0 && str_at(triple, 0, "arm64-") == 0)) {
+    printf("Unsupported target: %s\n", triple);
+    exit(1);
+  }
+  target_elf = is_linux;
+  target_x86 = x86;
+  if (is_linux) {
+    sym_pfx = "";
+    lab_pfx = ".L_";
+    str_pfx = ".L.str_";
+    cc_driver = "aarch64-linux-gnu-gcc -static ";
+  }
+  if (x86) {
+    cc_driver = "cc ";
+    arg_regs = 6;
+    var_regs = 5;
+    va_spill_regs = 6;
+    va_area_gap = 8;
+  }
+  return 0;
+}
+
 #ifdef __STDC__
 int *parse_args(int argc, char **argv) {
 #else
 int *parse_args(int argc, int **argv) {
 #endif
-  int *out_path = "a.out";
+  int *out_path = 0;
   int *c_path = 0;
 
   sys_include_dir = 0;
@@ -12096,6 +21009,8 @@ int *parse_args(int argc, int **argv) {
       if (i + 1 >= argc) { my_fatal("missing arg for -o"); }
       i++;
       out_path = argv[i];
+    } else if (my_strcmp(arg, "-c") == 0) {
+      compile_only = 1;
     } else if (__read_byte(arg, 0) == '-' && __read_byte(arg, 1) == 'D') {
       if (__read_byte(arg, 2) != 0) {
         // Extract substring starting at byte 2
@@ -12127,6 +21042,34 @@ int *parse_args(int argc, int **argv) {
       ninclude_dirs++;
     } else if (my_strcmp(arg, "-fproper-layout") == 0) {
       // use_proper_layout is always 1; flag accepted for compatibility
+    } else if (my_strcmp(arg, "-fno-ir") == 0) {
+      use_ir = 0;
+    } else if (my_strcmp(arg, "-fno-peephole") == 0) {
+      use_peephole = 0;
+    } else if (my_strcmp(arg, "-fpeephole-report") == 0) {
+      peep_report = 1;
+    } else if (my_strcmp(arg, "-ftime-report") == 0) {
+      time_report = 1;
+    } else if (my_strcmp(arg, "-fmem-report") == 0) {
+      mem_report = 1;
+    } else if (my_strcmp(arg, "-fno-fold") == 0) {
+      use_fold = 0;
+    } else if (my_strcmp(arg, "-fno-inline") == 0) {
+      use_inline = 0;
+    } else if (my_strcmp(arg, "-fomit-frame-pointer") == 0) {
+      use_omit_fp = 1;
+    } else if (my_strcmp(arg, "-fno-omit-frame-pointer") == 0) {
+      use_omit_fp = 0 - 1;
+    } else if (my_strcmp(arg, "-target") == 0) {
+      if (i + 1 >= argc) { my_fatal("missing arg for -target"); }
+      i++;
+      set_target(argv[i]);
+    } else if (str_at(arg, 0, "--target=")) {
+      set_target(make_str(arg, 9, my_strlen(arg) - 9));
+    } else if (my_strcmp(arg, "-fintegrated-as") == 0) {
+      use_integrated_as = 1;
+    } else if (my_strcmp(arg, "-fno-integrated-as") == 0) {
+      use_integrated_as = 0;
     } else if (__read_byte(arg, 0) == '-') {
       printf("Unknown option: %s\n", arg);
       exit(1);
@@ -12138,7 +21081,7 @@ int *parse_args(int argc, int **argv) {
   }
 
   if (c_path == 0) {
-    printf("Usage: cc [-o output] program.c\n");
+    printf("Usage: cc [-c] [-target triple] [-o output] program.c\n");
     return 2;
   }
 
@@ -12165,14 +21108,16 @@ int *parse_args(int argc, int **argv) {
     sys_include_dir = def_inc;
   }
 
+  // The integrated assembler only writes Mach-O
+  if (target_elf) { use_integrated_as = 0; }
+  if (out_path == 0 && !compile_only) { out_path = "a.out"; }
   cc_out_path = out_path;
   cc_c_path = c_path;
   return c_path;
 }
 
-int write_and_link(int *c_path, int *out_path) {
-  // Write .s file
-  // Build .s path: replace .c extension with .s
+// c_path with its extension replaced by .ext
+int *replace_ext(int *c_path, int ext) {
   int pathlen = my_strlen(c_path);
   int *s_path = my_malloc(pathlen + 4);
   int dot = 0 - 1;
@@ -12185,70 +21130,126 @@ int write_and_link(int *c_path, int *out_path) {
     if (__read_byte(c_path, pi) == '/') { break; }
     pi--;
   }
+  if (dot < 0) { dot = pathlen; }
   int k = 0;
-  if (dot >= 0) {
-    k = 0;
-    while (k < dot) {
-      __write_byte(s_path, k, __read_byte(c_path, k));
-      k++;
-    }
-    __write_byte(s_path, dot, '.');
-    __write_byte(s_path, dot + 1, 's');
-    __write_byte(s_path, dot + 2, 0);
-  } else {
-    k = 0;
-    while (k < pathlen) {
-      __write_byte(s_path, k, __read_byte(c_path, k));
-      k++;
-    }
-    __write_byte(s_path, pathlen, '.');
-    __write_byte(s_path, pathlen + 1, 's');
-    __write_byte(s_path, pathlen + 2, 0);
-  }
-
-  int *sf = fopen(s_path, "w");
-  if (sf == 0) { my_fatal("cannot write .s file"); }
-  int wi = 0;
-  while (wi < outlen) {
-    fputc(__read_byte(outbuf, wi), sf);
-    wi++;
+  while (k < dot) {
+    __write_byte(s_path, k, __read_byte(c_path, k));
+    k++;
   }
-  fclose(sf);
+  __write_byte(s_path, dot, '.');
+  __write_byte(s_path, dot + 1, ext);
+  __write_byte(s_path, dot + 2, 0);
+  return s_path;
+}
 
-  // Run clang
-  int *cmd = my_malloc(4096);
+// Run "<cc_driver> <args> <in> -o <out>"
+int run_driver(int *args, int *in_path, int *out_path) {
+  int *cmd = my_malloc(my_strlen(cc_driver) + my_strlen(args) + my_strlen(in_path) + my_strlen(out_path) + 16);
   int cpos = 0;
-  int *clang_str = "clang ";
-  int ci2 = 0;
-  while (__read_byte(clang_str, ci2) != 0) {
-    __write_byte(cmd, cpos, __read_byte(clang_str, ci2));
-    cpos++;
-    ci2++;
-  }
-  ci2 = 0;
-  while (__read_byte(s_path, ci2) != 0) {
-    __write_byte(cmd, cpos, __read_byte(s_path, ci2));
-    cpos++;
-    ci2++;
-  }
-  int *o_str = " -o ";
-  ci2 = 0;
-  while (__read_byte(o_str, ci2) != 0) {
-    __write_byte(cmd, cpos, __read_byte(o_str, ci2));
-    cpos++;
-    ci2++;
-  }
-  ci2 = 0;
-  while (__read_byte(out_path, ci2) != 0) {
-    __write_byte(cmd, cpos, __read_byte(out_path, ci2));
-    cpos++;
-    ci2++;
+  int *parts[5];
+  parts[0] = cc_driver;
+  parts[1] = args;
+  parts[2] = in_path;
+  parts[3] = " -o ";
+  parts[4] = out_path;
+  for (int pi = 0; pi < 5; pi++) {
+    int ci2 = 0;
+    while (__read_byte(parts[pi], ci2) != 0) {
+      __write_byte(cmd, cpos, __read_byte(parts[pi], ci2));
+      cpos++;
+      ci2++;
+    }
   }
   __write_byte(cmd, cpos, 0);
 
   int rc = system(cmd);
-  if (rc != 0) { my_fatal("clang failed"); }
+  if (rc != 0) { my_fatal("assembler or linker failed"); }
+  return 0;
+}
+
+// ---- Output ----
+// Codegen appends to outbuf and out_flush() passes the text on after each
+// function: to the .s file next to the source with one fwrite, through the
+// x86-64 lowering first on that target, and into the integrated assembler.
+// outbuf so holds about one function rather than the whole program.
+int *out_sfile;
+int *out_spath;
+int *out_xbuf;     // x86-64 text; trades places with outbuf while lowering
+int out_xcap;
+
+int out_open(int *c_path) {
+  out_spath = replace_ext(c_path, 's');
+  out_sfile = fopen(out_spath, "w");
+  if (out_sfile == 0) { my_fatal("cannot write .s file"); }
+  outcap = 1024 * 1024;
+  outbuf = my_malloc(outcap);
+  outlen = 0;
+  if (target_x86) {
+    x86_init();
+    as_init_mnemonics();
+    out_xcap = outcap;
+    out_xbuf = my_malloc(out_xcap);
+  }
+  if (use_integrated_as) { as_begin(); }
+  return 0;
+}
+
+int out_flush() {
+  if (outlen == 0) return 0;
+  if (target_x86) {
+    int *text = outbuf;
+    int tcap = outcap;
+    int n = outlen;
+    outbuf = out_xbuf;
+    outcap = out_xcap;
+    outlen = 0;
+    x86_lower(text, n);
+    fwrite(outbuf, 1, outlen, out_sfile);
+    n_out_bytes = n_out_bytes + outlen;
+    out_xbuf = outbuf;
+    out_xcap = outcap;
+    outbuf = text;
+    outcap = tcap;
+  } else {
+    fwrite(outbuf, 1, outlen, out_sfile);
+    n_out_bytes = n_out_bytes + outlen;
+    if (use_integrated_as) { as_feed(outbuf, outlen); }
+  }
+  outlen = 0;
+  return 0;
+}
+
+int out_close() {
+  out_flush();
+  if (target_x86) {
+    x86_finish();
+    fwrite(outbuf, 1, outlen, out_sfile);
+    n_out_bytes = n_out_bytes + outlen;
+    outlen = 0;
+  }
+  fclose(out_sfile);
+  if (use_integrated_as) { as_resolve(); }
+  return 0;
+}
 
+int write_and_link(int *c_path, int *out_path) {
+  out_close();
+  int *s_path = out_spath;
+
+  int *o_path = replace_ext(c_path, 'o');
+  if (compile_only && out_path != 0) { o_path = out_path; }
+  if (use_integrated_as) {
+    obj_write_macho(o_path);
+  } else if (compile_only) {
+    run_driver("-c ", s_path, o_path);
+  }
+  if (compile_only) {
+    printf("Wrote %s and %s\n", s_path, o_path);
+    return 0;
+  }
+
+  if (use_integrated_as) { run_driver("", o_path, out_path); }
+  else { run_driver("", s_path, out_path); }
   printf("Wrote %s and built %s\n", s_path, out_path);
   return 0;
 }
@@ -12260,24 +21261,18 @@ int main(int argc, int **argv) {
 #endif
   int *c_path = parse_args(argc, argv);
   if (c_path == 0) { return 2; }
+  rep_start();
+  nx_init();
   int *out_path = cc_out_path;
 
-  // Read source file
-  int *f = fopen(c_path, "r");
-  if (f == 0) {
+  // Read source file; everything up to the lexer is preprocessor scratch
+  arena_use(AR_PP);
+  int srclen = 0;
+  int *srcbuf = read_file(c_path, &srclen);
+  if (srcbuf == 0) {
     printf("Cannot open: %s\n", c_path);
     return 1;
   }
-  int *srcbuf = my_malloc(10 * 1000 * 1000);
-  int srclen = 0;
-  int ch = fgetc(f);
-  while (ch != 0 - 1) {
-    __write_byte(srcbuf, srclen, ch);
-    srclen++;
-    ch = fgetc(f);
-  }
-  __write_byte(srcbuf, srclen, 0);
-  fclose(f);
 
   // Join backslash-newline continuations
   for (int bsi = 0; bsi < srclen - 1; bsi++) {
@@ -12419,6 +21414,13 @@ int main(int argc, int **argv) {
     bi_names[38] = "__FLT_DIG__"; bi_vals[38] = "6"; nbi++;
     bi_names[39] = "__DBL_DIG__"; bi_vals[39] = "15"; nbi++;
     bi_names[40] = "__LDBL_DIG__"; bi_vals[40] = "18"; nbi++;
+    if (target_elf) {
+      bi_names[nbi] = "__linux__"; bi_vals[nbi] = "1"; nbi++;
+      bi_names[nbi] = "__ELF__"; bi_vals[nbi] = "1"; nbi++;
+    }
+    if (target_x86) {
+      bi_names[nbi] = "__x86_64__"; bi_vals[nbi] = "1"; nbi++;
+    }
     int bi = 0;
     while (bi < nbi) {
       macros[nmacros].name = my_strdup(bi_names[bi]);
@@ -12444,8 +21446,9 @@ int main(int argc, int **argv) {
 
   // Strip block comments from preprocessed output before macro expansion
   // Must skip string/char literals to avoid stripping // inside "http://..."
-  { int ri = 0; int wi = 0;
+  { int ri = 0; int wi = 0; int dm = 0;
     while (ri < co) {
+      dm = pp_shift_defs(dm, ri, wi);
       if (__read_byte(cleaned, ri) == '"') {
         __write_byte(cleaned, wi, __read_byte(cleaned, ri)); ri++; wi++;
         while (ri < co && __read_byte(cleaned, ri) != '"') {
@@ -12478,13 +21481,15 @@ int main(int argc, int **argv) {
         wi++; ri++;
       }
     }
+    pp_shift_defs(dm, co, wi);
     co = wi;
     __write_byte(cleaned, co, 0);
   }
   // Second pass: strip orphaned comment continuations (lines with */ but no /*)
   // These occur when /* was inside a #define value and */ is on a continuation line
-  { int ri = 0; int wi = 0;
+  { int ri = 0; int wi = 0; int dm = 0;
     while (ri < co) {
+      dm = pp_shift_defs(dm, ri, wi);
       // Check if current line has */ but no /*
       int ls = ri; // line start
       int has_ss = 0; int has_se = 0;
@@ -12507,6 +21512,7 @@ int main(int argc, int **argv) {
         if (ri < co) { __write_byte(cleaned, wi, '\n'); wi++; ri++; }
       }
     }
+    pp_shift_defs(dm, co, wi);
     co = wi;
     __write_byte(cleaned, co, 0);
   }
@@ -12522,587 +21528,29 @@ int main(int argc, int **argv) {
     macro_ht_head[h] = mi;
     mi++;
   } }
-  // Expand macros if any were defined
-  int *expanded = 0;
-  int ei = 0;
-  int eo = 0;
-  int istart = 0;
-  int ilen = 0;
-  int found = 0;
-  int mc = 0;
-  int vlen = 0;
-  int vi = 0;
-  int ki = 0;
-  { // Always run expansion pass (for __LINE__/__FILE__ even with nmacros==0)
-    // Buffer must be large enough for full macro expansion.
-    // co*8 may be too small when source has large macros relative to code size.
-    // Add total macro body/value sizes to account for expansion.
-    int macro_total = 0;
-    { int mti = 0; while (mti < nmacros) {
-      if (macros[mti].body) { macro_total = macro_total + my_strlen(macros[mti].body); }
-      if (macros[mti].value) { macro_total = macro_total + my_strlen(macros[mti].value); }
-      mti++;
-    } }
-    int exp_buf_size = co * 8 + 1;
-    if (exp_buf_size < macro_total * 4 + co + 1) { exp_buf_size = macro_total * 4 + co + 1; }
-    expanded = my_malloc(exp_buf_size);
-    ei = 0;
-    eo = 0;
-    int dbg_next = 562300;
-    while (ei < co) {
-      // Skip string literals
-      if (__read_byte(cleaned, ei) == '"') {
-        __write_byte(expanded, eo, __read_byte(cleaned, ei));
-        ei++;
-        eo++;
-        while (ei < co && __read_byte(cleaned, ei) != '"') {
-          if (__read_byte(cleaned, ei) == '\\' && ei + 1 < co) {
-            __write_byte(expanded, eo, __read_byte(cleaned, ei));
-            ei++;
-            eo++;
-          }
-          __write_byte(expanded, eo, __read_byte(cleaned, ei));
-          ei++;
-          eo++;
-        }
-        if (ei < co) {
-          __write_byte(expanded, eo, __read_byte(cleaned, ei));
-          ei++;
-          eo++;
-        }
-      } else if (__read_byte(cleaned, ei) == '\'') {
-        // Skip char literals
-        __write_byte(expanded, eo, __read_byte(cleaned, ei));
-        ei++;
-        eo++;
-        while (ei < co && __read_byte(cleaned, ei) != '\'') {
-          if (__read_byte(cleaned, ei) == '\\' && ei + 1 < co) {
-            __write_byte(expanded, eo, __read_byte(cleaned, ei));
-            ei++;
-            eo++;
-          }
-          __write_byte(expanded, eo, __read_byte(cleaned, ei));
-          ei++;
-          eo++;
-        }
-        if (ei < co) {
-          __write_byte(expanded, eo, __read_byte(cleaned, ei));
-          ei++;
-          eo++;
-        }
-      } else if (is_alpha(__read_byte(cleaned, ei))) {
-        // Identifier — check against macros
-        istart = ei;
-        while (ei < co && is_alnum(__read_byte(cleaned, ei))) {
-          ei++;
-        }
-        ilen = ei - istart;
-        int *idstr = make_str(cleaned, istart, ilen);
-        // Special built-in macros
-        if (ilen == 8 && my_strcmp(idstr, "__LINE__") == 0) {
-          int ln = 1; int li = 0; while (li < istart) { if (__read_byte(cleaned, li) == '\n') { ln++; } li++; }
-          int *lns = int_to_str(ln);
-          int lnl = my_strlen(lns); int lni = 0;
-          while (lni < lnl) { __write_byte(expanded, eo, __read_byte(lns, lni)); eo++; lni++; }
-          found = 1;
-        } else if (ilen == 8 && my_strcmp(idstr, "__FILE__") == 0) {
-          __write_byte(expanded, eo, '"'); eo++;
-          int fnl = my_strlen(c_path); int fni = 0;
-          while (fni < fnl) { __write_byte(expanded, eo, __read_byte(c_path, fni)); eo++; fni++; }
-          __write_byte(expanded, eo, '"'); eo++;
-          found = 1;
-        } else {
-        found = 0;
-        { int h = 0; int ci = 0; while (ci < ilen) { h = h * 31 + __read_byte(cleaned, istart + ci); ci++; } mc = macro_ht_head[h & 65535]; }
-        while (mc >= 0) {
-          if (macros[mc].nlen == ilen &&
-              my_strcmp(idstr, macros[mc].name) == 0 &&
-              istart >= macros[mc].def_pos) {
-            // Don't expand L when followed by ' or " (wide char/string literal)
-            if (ilen == 1 && __read_byte(cleaned, istart) == 'L' && ei < co && (__read_byte(cleaned, ei) == '\'' || __read_byte(cleaned, ei) == '"')) {
-              break;
-            }
-            if (macros[mc].nparams >= 0) {
-              // Function-like macro: look for '('
-              int fj = ei;
-              while (fj < co && (__read_byte(cleaned, fj) == ' ' || __read_byte(cleaned, fj) == '\t')) { fj++; }
-              if (fj < co && __read_byte(cleaned, fj) == '(') {
-                fj++; // skip '('
-                // Parse arguments
-                int *fargs[64];
-                int fnargs = 0;
-                int fdepth = 1;
-                int astart = fj;
-                while (fj < co && fdepth > 0) {
-                  if (__read_byte(cleaned, fj) == '(') { fdepth++; }
-                  else if (__read_byte(cleaned, fj) == ')') {
-                    fdepth--;
-                    if (fdepth == 0) {
-                      if ((fj > astart || fnargs > 0) && fnargs < 64) {
-                        fargs[fnargs] = make_str(cleaned, astart, fj - astart);
-                        fnargs++;
-                      }
-                      fj++;
-                      break;
-                    }
-                  } else if (__read_byte(cleaned, fj) == ',' && fdepth == 1) {
-                    if (fnargs < 64) { fargs[fnargs] = make_str(cleaned, astart, fj - astart); }
-                    fnargs++;
-                    fj++;
-                    while (fj < co && (__read_byte(cleaned, fj) == ' ' || __read_byte(cleaned, fj) == '\t')) { fj++; }
-                    astart = fj;
-                    continue;
-                  } else if (__read_byte(cleaned, fj) == '"') {
-                    fj++;
-                    while (fj < co && __read_byte(cleaned, fj) != '"') {
-                      if (__read_byte(cleaned, fj) == '\\' && fj + 1 < co) { fj++; }
-                      fj++;
-                    }
-                    if (fj < co) { fj++; }
-                    continue;
-                  } else if (__read_byte(cleaned, fj) == '\'') {
-                    fj++;
-                    while (fj < co && __read_byte(cleaned, fj) != '\'') {
-                      if (__read_byte(cleaned, fj) == '\\' && fj + 1 < co) { fj++; }
-                      fj++;
-                    }
-                    if (fj < co) { fj++; }
-                    continue;
-                  }
-                  fj++;
-                }
-                // Check argument count matches (skip expansion if mismatch)
-                int argcount_ok = 1;
-                if (fnargs != macros[mc].nparams && !(macros[mc].is_variadic && fnargs >= macros[mc].nparams)) {
-                  // Argument count mismatch: don't expand, copy identifier + args as-is
-                  int bk = istart;
-                  while (bk < fj) { __write_byte(expanded, eo, __read_byte(cleaned, bk)); eo++; bk++; }
-                  ei = fj; // skip past the consumed text
-                  found = 1; // we already wrote output, don't copy again
-                  mc = 0 - 1; // break
-                  argcount_ok = 0;
-                }
-                // Substitute params in body
-                int *mbody = macros[mc >= 0 ? mc : 0].body;
-                int mblen = argcount_ok ? my_strlen(mbody) : 0;
-                int bi = 0;
-                int after_paste = 0;
-                while (bi < mblen) {
-                  if (is_alpha(__read_byte(mbody, bi))) {
-                    int ps1 = bi;
-                    while (bi < mblen && is_alnum(__read_byte(mbody, bi))) { bi++; }
-                    int pl1 = bi - ps1;
-                    int *pn1 = make_str(mbody, ps1, pl1);
-                    int pf1 = 0;
-                    int px1 = 0;
-                    // Check if ## follows this param (strip trailing ws from arg)
-                    int paste_follows = 0;
-                    { int bk2 = bi; while (bk2 < mblen && (__read_byte(mbody, bk2) == ' ' || __read_byte(mbody, bk2) == '\t')) { bk2++; }
-                      if (bk2 + 1 < mblen && __read_byte(mbody, bk2) == '#' && __read_byte(mbody, bk2 + 1) == '#') { paste_follows = 1; } }
-                    // Don't substitute L when followed by ' or " (wide char/string literal)
-                    int skip_param_sub = 0;
-                    if (pl1 == 1 && __read_byte(mbody, ps1) == 'L' && bi < mblen && (__read_byte(mbody, bi) == '\'' || __read_byte(mbody, bi) == '"')) { skip_param_sub = 1; }
-                    while (px1 < macros[mc].nparams && skip_param_sub == 0) {
-                      if (my_strcmp(macros[mc].params[px1], pn1) == 0) {
-                        // Substitute with argument
-                        int alen = my_strlen(fargs[px1]);
-                        int ai = 0;
-                        // Skip leading whitespace if after ##
-                        if (after_paste) { while (ai < alen && (__read_byte(fargs[px1], ai) == ' ' || __read_byte(fargs[px1], ai) == '\t')) { ai++; } }
-                        // Find end (strip trailing whitespace if ## follows)
-                        int aend = alen;
-                        if (paste_follows) { while (aend > ai && (__read_byte(fargs[px1], aend - 1) == ' ' || __read_byte(fargs[px1], aend - 1) == '\t')) { aend--; } }
-                        while (ai < aend) {
-                          __write_byte(expanded, eo, __read_byte(fargs[px1], ai));
-                          eo++;
-                          ai++;
-                        }
-                        pf1 = 1;
-                        px1 = macros[mc].nparams; // break
-                      }
-                      px1++;
-                    }
-                    if (pf1 == 0 && macros[mc].is_variadic && my_strcmp(pn1, "__VA_ARGS__") == 0) {
-                      // Substitute variadic args
-                      int vai = macros[mc].nparams;
-                      while (vai < fnargs) {
-                        if (vai > macros[mc].nparams) { __write_byte(expanded, eo, ','); eo++; __write_byte(expanded, eo, ' '); eo++; }
-                        int alen = my_strlen(fargs[vai]);
-                        int ai = 0;
-                        while (ai < alen) { __write_byte(expanded, eo, __read_byte(fargs[vai], ai)); eo++; ai++; }
-                        vai++;
-                      }
-                      pf1 = 1;
-                    }
-                    if (pf1 == 0) {
-                      // Copy body identifier as-is
-                      // If it matches the macro's own name, insert 0x01 marker to prevent re-expansion
-                      if (pl1 == macros[mc].nlen && my_strcmp(pn1, macros[mc].name) == 0) {
-                        __write_byte(expanded, eo, 1); eo++; // self-reference marker
-                      }
-                      int bk = ps1;
-                      while (bk < bi) {
-                        __write_byte(expanded, eo, __read_byte(mbody, bk));
-                        eo++;
-                        bk++;
-                      }
-                    }
-                    after_paste = 0;
-                  } else if (__read_byte(mbody, bi) == '#' && bi + 1 < mblen && __read_byte(mbody, bi + 1) == '#') {
-                    // Token pasting: remove ## and surrounding whitespace
-                    bi = bi + 2;
-                    while (eo > 0 && (__read_byte(expanded, eo - 1) == ' ' || __read_byte(expanded, eo - 1) == '\t')) { eo--; }
-                    while (bi < mblen && (__read_byte(mbody, bi) == ' ' || __read_byte(mbody, bi) == '\t')) { bi++; }
-                    after_paste = 1;
-                  } else if (__read_byte(mbody, bi) == '#' && bi + 1 < mblen && is_alpha(__read_byte(mbody, bi + 1))) {
-                    // Stringify operator
-                    bi++; // skip #
-                    int sps = bi;
-                    while (bi < mblen && is_alnum(__read_byte(mbody, bi))) { bi++; }
-                    int *spn = make_str(mbody, sps, bi - sps);
-                    int spf = 0;
-                    int spi = 0;
-                    while (spi < macros[mc].nparams) {
-                      if (my_strcmp(macros[mc].params[spi], spn) == 0) {
-                        __write_byte(expanded, eo, '"'); eo++;
-                        int salen = my_strlen(fargs[spi]);
-                        int sai = 0;
-                        while (sai < salen) {
-                          int sc = __read_byte(fargs[spi], sai);
-                          if (sc == '"' || sc == '\\') { __write_byte(expanded, eo, '\\'); eo++; }
-                          __write_byte(expanded, eo, sc); eo++;
-                          sai++;
-                        }
-                        __write_byte(expanded, eo, '"'); eo++;
-                        spf = 1; spi = macros[mc].nparams;
-                      }
-                      spi++;
-                    }
-                    if (spf == 0) {
-                      __write_byte(expanded, eo, '#'); eo++;
-                      int sbk = sps;
-                      while (sbk < bi) { __write_byte(expanded, eo, __read_byte(mbody, sbk)); eo++; sbk++; }
-                    }
-                    after_paste = 0;
-                  } else {
-                    __write_byte(expanded, eo, __read_byte(mbody, bi));
-                    eo++;
-                    bi++;
-                  }
-                }
-                if (argcount_ok) { ei = fj; found = 1; mc = 0 - 1; }
-              }
-              // If no '(' follows, don't expand — fall through
-            } else {
-              // Object-like macro: copy value
-              vlen = my_strlen(macros[mc].value);
-              vi = 0;
-              while (vi < vlen) {
-                __write_byte(expanded, eo, __read_byte(macros[mc].value, vi));
-                eo++;
-                vi++;
-              }
-              found = 1;
-              mc = 0 - 1; // break
-            }
-          }
-          if (mc >= 0) { mc = macros[mc].ht_next; }
-        }
-        if (found == 0) {
-          // Copy identifier as-is
-          ki = istart;
-          while (ki < ei) {
-            __write_byte(expanded, eo, __read_byte(cleaned, ki));
-            eo++;
-            ki++;
-          }
-        }
-        } // close else from __LINE__/__FILE__ check
-      } else {
-        __write_byte(expanded, eo, __read_byte(cleaned, ei));
-        ei++;
-        eo++;
-      }
-    }
-    __write_byte(expanded, eo, 0);
-    cleaned = expanded;
-    co = eo;
-
-    // Repeat expansion until no more macros are found
-    int expand_changed = 1;
-    int expand_iter = 0;
-    while (expand_changed && expand_iter < 16) {
-    expand_changed = 0;
-    expand_iter++;
-    int exp2_size = co * 8 + 1;
-    if (exp2_size < macro_total * 4 + co + 1) { exp2_size = macro_total * 4 + co + 1; }
-    int *expanded2 = my_malloc(exp2_size);
-    ei = 0;
-    eo = 0;
-    while (ei < co) {
-      if (__read_byte(cleaned, ei) == '"') {
-        __write_byte(expanded2, eo, __read_byte(cleaned, ei)); ei++; eo++;
-        while (ei < co && __read_byte(cleaned, ei) != '"') {
-          if (__read_byte(cleaned, ei) == '\\' && ei + 1 < co) {
-            __write_byte(expanded2, eo, __read_byte(cleaned, ei)); ei++; eo++;
-          }
-          __write_byte(expanded2, eo, __read_byte(cleaned, ei)); ei++; eo++;
-        }
-        if (ei < co) { __write_byte(expanded2, eo, __read_byte(cleaned, ei)); ei++; eo++; }
-      } else if (__read_byte(cleaned, ei) == '\'') {
-        __write_byte(expanded2, eo, __read_byte(cleaned, ei)); ei++; eo++;
-        while (ei < co && __read_byte(cleaned, ei) != '\'') {
-          if (__read_byte(cleaned, ei) == '\\' && ei + 1 < co) {
-            __write_byte(expanded2, eo, __read_byte(cleaned, ei)); ei++; eo++;
-          }
-          __write_byte(expanded2, eo, __read_byte(cleaned, ei)); ei++; eo++;
-        }
-        if (ei < co) { __write_byte(expanded2, eo, __read_byte(cleaned, ei)); ei++; eo++; }
-      } else if (__read_byte(cleaned, ei) == 1 && ei + 1 < co && is_alpha(__read_byte(cleaned, ei + 1))) {
-        // Self-reference marker: copy marker + identifier without expanding
-        __write_byte(expanded2, eo, 1); eo++; ei++; // copy marker
-        while (ei < co && is_alnum(__read_byte(cleaned, ei))) {
-          __write_byte(expanded2, eo, __read_byte(cleaned, ei)); eo++; ei++;
-        }
-      } else if (is_alpha(__read_byte(cleaned, ei))) {
-        istart = ei;
-        while (ei < co && is_alnum(__read_byte(cleaned, ei))) { ei++; }
-        ilen = ei - istart;
-        int *idstr2 = make_str(cleaned, istart, ilen);
-        // Special built-in macros in second pass
-        if (ilen == 8 && my_strcmp(idstr2, "__LINE__") == 0) {
-          int ln2 = 1; int li2 = 0; while (li2 < istart) { if (__read_byte(cleaned, li2) == '\n') { ln2++; } li2++; }
-          int *lns2 = int_to_str(ln2);
-          int lnl2 = my_strlen(lns2); int lni2 = 0;
-          while (lni2 < lnl2) { __write_byte(expanded2, eo, __read_byte(lns2, lni2)); eo++; lni2++; }
-          found = 1; expand_changed = 1;
-        } else if (ilen == 8 && my_strcmp(idstr2, "__FILE__") == 0) {
-          __write_byte(expanded2, eo, '"'); eo++;
-          int fnl2 = my_strlen(c_path); int fni2 = 0;
-          while (fni2 < fnl2) { __write_byte(expanded2, eo, __read_byte(c_path, fni2)); eo++; fni2++; }
-          __write_byte(expanded2, eo, '"'); eo++;
-          found = 1; expand_changed = 1;
-        } else {
-        found = 0;
-        { int h = 0; int ci = 0; while (ci < ilen) { h = h * 31 + __read_byte(cleaned, istart + ci); ci++; } mc = macro_ht_head[h & 65535]; }
-        while (mc >= 0) {
-          if (macros[mc].nlen == ilen &&
-              my_strcmp(idstr2, macros[mc].name) == 0) {
-            // Don't expand L when followed by ' or " (wide char/string literal)
-            if (ilen == 1 && __read_byte(cleaned, istart) == 'L' && ei < co && (__read_byte(cleaned, ei) == '\'' || __read_byte(cleaned, ei) == '"')) {
-              break;
-            }
-            if (macros[mc].nparams >= 0) {
-              int fj2 = ei;
-              while (fj2 < co && (__read_byte(cleaned, fj2) == ' ' || __read_byte(cleaned, fj2) == '\t')) { fj2++; }
-              if (fj2 < co && __read_byte(cleaned, fj2) == '(') {
-                fj2++;
-                int *fargs2[64];
-                int fnargs2 = 0;
-                int fdepth2 = 1;
-                int astart2 = fj2;
-                while (fj2 < co && fdepth2 > 0) {
-                  if (__read_byte(cleaned, fj2) == '(') { fdepth2++; }
-                  else if (__read_byte(cleaned, fj2) == ')') {
-                    fdepth2--;
-                    if (fdepth2 == 0) {
-                      if ((fj2 > astart2 || fnargs2 > 0) && fnargs2 < 64) { fargs2[fnargs2] = make_str(cleaned, astart2, fj2 - astart2); fnargs2++; }
-                      fj2++; break;
-                    }
-                  } else if (__read_byte(cleaned, fj2) == ',' && fdepth2 == 1) {
-                    if (fnargs2 < 64) { fargs2[fnargs2] = make_str(cleaned, astart2, fj2 - astart2); } fnargs2++;
-                    fj2++;
-                    while (fj2 < co && (__read_byte(cleaned, fj2) == ' ' || __read_byte(cleaned, fj2) == '\t')) { fj2++; }
-                    astart2 = fj2; continue;
-                  } else if (__read_byte(cleaned, fj2) == '"') {
-                    fj2++;
-                    while (fj2 < co && __read_byte(cleaned, fj2) != '"') {
-                      if (__read_byte(cleaned, fj2) == '\\' && fj2 + 1 < co) { fj2++; }
-                      fj2++;
-                    }
-                    if (fj2 < co) { fj2++; }
-                    continue;
-                  } else if (__read_byte(cleaned, fj2) == '\'') {
-                    fj2++;
-                    while (fj2 < co && __read_byte(cleaned, fj2) != '\'') {
-                      if (__read_byte(cleaned, fj2) == '\\' && fj2 + 1 < co) { fj2++; }
-                      fj2++;
-                    }
-                    if (fj2 < co) { fj2++; }
-                    continue;
-                  }
-                  fj2++;
-                }
-                // Check argument count matches
-                int argcount_ok2 = 1;
-                if (fnargs2 != macros[mc].nparams && !(macros[mc].is_variadic && fnargs2 >= macros[mc].nparams)) {
-                  // Copy identifier + full argument text as-is
-                  int bk2 = istart;
-                  while (bk2 < fj2) { __write_byte(expanded2, eo, __read_byte(cleaned, bk2)); eo++; bk2++; }
-                  ei = fj2; // skip past the consumed text
-                  found = 1; // we already wrote output, don't copy again
-                  mc = 0 - 1;
-                  argcount_ok2 = 0;
-                }
-                int *mbody2 = macros[mc >= 0 ? mc : 0].body;
-                int mblen2 = argcount_ok2 ? my_strlen(mbody2) : 0;
-                int bi2 = 0;
-                int after_paste2 = 0;
-                while (bi2 < mblen2) {
-                  if (is_alpha(__read_byte(mbody2, bi2))) {
-                    int pstart2 = bi2;
-                    while (bi2 < mblen2 && is_alnum(__read_byte(mbody2, bi2))) { bi2++; }
-                    int plen2 = bi2 - pstart2;
-                    int *pname2 = make_str(mbody2, pstart2, plen2);
-                    int pfound2 = 0;
-                    int pi2 = 0;
-                    int paste_follows2 = 0;
-                    { int bk3 = bi2; while (bk3 < mblen2 && (__read_byte(mbody2, bk3) == ' ' || __read_byte(mbody2, bk3) == '\t')) { bk3++; }
-                      if (bk3 + 1 < mblen2 && __read_byte(mbody2, bk3) == '#' && __read_byte(mbody2, bk3 + 1) == '#') { paste_follows2 = 1; } }
-                    int skip_psub2 = 0;
-                    if (plen2 == 1 && __read_byte(mbody2, pstart2) == 'L' && bi2 < mblen2 && (__read_byte(mbody2, bi2) == '\'' || __read_byte(mbody2, bi2) == '"')) { skip_psub2 = 1; }
-                    while (pi2 < macros[mc].nparams && skip_psub2 == 0) {
-                      if (my_strcmp(macros[mc].params[pi2], pname2) == 0) {
-                        int alen2 = my_strlen(fargs2[pi2]);
-                        int ai2 = 0;
-                        if (after_paste2) { while (ai2 < alen2 && (__read_byte(fargs2[pi2], ai2) == ' ' || __read_byte(fargs2[pi2], ai2) == '\t')) { ai2++; } }
-                        int aend2 = alen2;
-                        if (paste_follows2) { while (aend2 > ai2 && (__read_byte(fargs2[pi2], aend2 - 1) == ' ' || __read_byte(fargs2[pi2], aend2 - 1) == '\t')) { aend2--; } }
-                        while (ai2 < aend2) { __write_byte(expanded2, eo, __read_byte(fargs2[pi2], ai2)); eo++; ai2++; }
-                        pfound2 = 1; pi2 = macros[mc].nparams;
-                      }
-                      pi2++;
-                    }
-                    if (pfound2 == 0 && macros[mc].is_variadic && my_strcmp(pname2, "__VA_ARGS__") == 0) {
-                      int vai2 = macros[mc].nparams;
-                      while (vai2 < fnargs2) {
-                        if (vai2 > macros[mc].nparams) { __write_byte(expanded2, eo, ','); eo++; __write_byte(expanded2, eo, ' '); eo++; }
-                        int alen2 = my_strlen(fargs2[vai2]);
-                        int ai2 = 0;
-                        while (ai2 < alen2) { __write_byte(expanded2, eo, __read_byte(fargs2[vai2], ai2)); eo++; ai2++; }
-                        vai2++;
-                      }
-                      pfound2 = 1;
-                    }
-                    if (pfound2 == 0) {
-                      // Self-reference marker for re-expansion
-                      if (plen2 == macros[mc].nlen && my_strcmp(pname2, macros[mc].name) == 0) {
-                        __write_byte(expanded2, eo, 1); eo++;
-                      }
-                      int bk2 = pstart2;
-                      while (bk2 < bi2) { __write_byte(expanded2, eo, __read_byte(mbody2, bk2)); eo++; bk2++; }
-                    }
-                    after_paste2 = 0;
-                  } else if (__read_byte(mbody2, bi2) == '#' && bi2 + 1 < mblen2 && __read_byte(mbody2, bi2 + 1) == '#') {
-                    bi2 = bi2 + 2;
-                    while (eo > 0 && (__read_byte(expanded2, eo - 1) == ' ' || __read_byte(expanded2, eo - 1) == '\t')) { eo--; }
-                    while (bi2 < mblen2 && (__read_byte(mbody2, bi2) == ' ' || __read_byte(mbody2, bi2) == '\t')) { bi2++; }
-                    after_paste2 = 1;
-                  } else if (__read_byte(mbody2, bi2) == '#' && bi2 + 1 < mblen2 && is_alpha(__read_byte(mbody2, bi2 + 1))) {
-                    bi2++;
-                    int sps2 = bi2;
-                    while (bi2 < mblen2 && is_alnum(__read_byte(mbody2, bi2))) { bi2++; }
-                    int *spn2 = make_str(mbody2, sps2, bi2 - sps2);
-                    int spf2 = 0;
-                    int spi2 = 0;
-                    while (spi2 < macros[mc].nparams) {
-                      if (my_strcmp(macros[mc].params[spi2], spn2) == 0) {
-                        __write_byte(expanded2, eo, '"'); eo++;
-                        int salen2 = my_strlen(fargs2[spi2]);
-                        int sai2 = 0;
-                        while (sai2 < salen2) {
-                          int sc2 = __read_byte(fargs2[spi2], sai2);
-                          if (sc2 == '"' || sc2 == '\\') { __write_byte(expanded2, eo, '\\'); eo++; }
-                          __write_byte(expanded2, eo, sc2); eo++;
-                          sai2++;
-                        }
-                        __write_byte(expanded2, eo, '"'); eo++;
-                        spf2 = 1; spi2 = macros[mc].nparams;
-                      }
-                      spi2++;
-                    }
-                    if (spf2 == 0) {
-                      __write_byte(expanded2, eo, '#'); eo++;
-                      int sbk2 = sps2;
-                      while (sbk2 < bi2) { __write_byte(expanded2, eo, __read_byte(mbody2, sbk2)); eo++; sbk2++; }
-                    }
-                    after_paste2 = 0;
-                  } else {
-                    __write_byte(expanded2, eo, __read_byte(mbody2, bi2)); eo++; bi2++;
-                  }
-                }
-                if (argcount_ok2) { ei = fj2; found = 1; expand_changed = 1; mc = 0 - 1; }
-              }
-            } else {
-              // Self-referential check: skip if macro name appears as identifier in value
-              int selfref = 0;
-              { int sr_vl = my_strlen(macros[mc].value);
-                int sr_nl = macros[mc].nlen;
-                int sr_i = 0;
-                while (sr_i + sr_nl <= sr_vl) {
-                  if (sr_i > 0 && is_alnum(__read_byte(macros[mc].value, sr_i - 1))) { sr_i++; }
-                  else {
-                    int sr_m = 1;
-                    int sr_j = 0;
-                    while (sr_j < sr_nl) {
-                      if (__read_byte(macros[mc].value, sr_i + sr_j) != __read_byte(macros[mc].name, sr_j)) { sr_m = 0; sr_j = sr_nl; }
-                      sr_j++;
-                    }
-                    if (sr_m && (sr_i + sr_nl >= sr_vl || is_alnum(__read_byte(macros[mc].value, sr_i + sr_nl)) == 0)) { selfref = 1; sr_i = sr_vl; }
-                    else { sr_i++; }
-                  }
-                }
-              }
-              if (selfref == 0) {
-                vlen = my_strlen(macros[mc].value);
-                vi = 0;
-                while (vi < vlen) { __write_byte(expanded2, eo, __read_byte(macros[mc].value, vi)); eo++; vi++; }
-                found = 1; expand_changed = 1; mc = 0 - 1;
-              } else {
-                mc = 0 - 1;
-              }
-            }
-          }
-          if (mc >= 0) { mc = macros[mc].ht_next; }
-        }
-        if (found == 0) {
-          ki = istart;
-          while (ki < ei) { __write_byte(expanded2, eo, __read_byte(cleaned, ki)); eo++; ki++; }
-        }
-        } // close else from __LINE__/__FILE__ check (pass 2)
-      } else {
-        __write_byte(expanded2, eo, __read_byte(cleaned, ei)); ei++; eo++;
-      }
-    }
-    __write_byte(expanded2, eo, 0);
-    cleaned = expanded2;
-    co = eo;
-    } // end expand loop
-
-    // Strip self-reference marker bytes (0x01) from final output
-    { int si = 0; int so = 0;
-      while (si < co) {
-        if (__read_byte(cleaned, si) == 1) { si++; continue; }
-        __write_byte(cleaned, so, __read_byte(cleaned, si));
-        si++; so++;
-      }
-      __write_byte(cleaned, so, 0);
-      co = so;
-    }
-  }
+  rep_phase("preprocess");
+  // Expand macros (always, for __LINE__/__FILE__ even with nmacros==0)
+  cleaned = pp_expand(cleaned, co, c_path, &co);
+  arena_use(AR_PERM);
+  rep_phase("macro expansion");
 
   // Lex
   lex(cleaned, co);
+  arena_reset(AR_PP, 1);
+  rep_phase("lex");
 
   // Parse
   struct Program *prog = parse_program();
+  rep_phase("parse");
 
   // Codegen
-  outcap = 16 * 1000 * 1000;
-  outbuf = my_malloc(outcap);
-  outlen = 0;
+  out_open(c_path);
   codegen(prog);
+  rep_phase("codegen");
+  if (peep_report) { peep_print_report(); }
 
   write_and_link(c_path, out_path);
+  rep_phase("assemble, link");
+  rep_print();
   return 0;
 }
@@ -0,0 +1,48 @@
+// Test batch 103: expression temporaries in registers
+// Deep trees spill past the register window; calls inside expressions
+// must preserve the temporaries live around them.
+
+int printf(int *fmt, ...);
+
+int add3(int a, int b, int c) {
+  return a + b + c;
+}
+
+int twice(int x) {
+  return x * 2;
+}
+
+int main() {
+  int pass = 0;
+  int fail = 0;
+  int a = 1;
+  int b = 2;
+  int c = 3;
+  int d = 4;
+
+  // Test 1: right-leaning tree deeper than the register window
+  int r = a + (b * (c + (d * (a + (b * (c + (d + 5)))))));
+  if (r == 1 + 2 * (3 + 4 * (1 + 2 * (3 + 9)))) { pass++; } else { printf("FAIL 1: r=%d\n", r); fail++; }
+
+  // Test 2: calls nested inside live temporaries
+  r = a + (b * (c - twice(d + twice(a))));
+  if (r == 1 + 2 * (3 - 2 * (4 + 2))) { pass++; } else { printf("FAIL 2: r=%d\n", r); fail++; }
+
+  // Test 3: call arguments that are themselves deep expressions
+  r = 100 - add3(a + (b + (c + (d + 1))), twice(c) * (a + (b + (c + d))), d);
+  if (r == 100 - (11 + 60 + 4)) { pass++; } else { printf("FAIL 3: r=%d\n", r); fail++; }
+
+  // Test 4: byte intrinsics inside deep expressions
+  int buf[4];
+  __write_byte(buf, a + (b + (c + (d - 9))), 65 + twice(a));
+  if (__read_byte(buf, 1) == 67) { pass++; } else { printf("FAIL 4: %d\n", __read_byte(buf, 1)); fail++; }
+
+  // Test 5: post-increment result and store
+  int k = 7;
+  int old = k++;
+  if (old == 7 && k == 8) { pass++; } else { printf("FAIL 5: old=%d k=%d\n", old, k); fail++; }
+
+  printf("Expression temporary tests: %d passed, %d failed\n", pass, fail);
+  if (fail > 0) return 1;
+  return 0;
+}
@@ -0,0 +1,101 @@
+// Test batch 104: scalar locals and parameters in callee-saved registers
+// Register locals must survive calls, wrap like their memory-resident
+// counterparts, and stay in memory when their address is taken.
+
+int printf(int *fmt, ...);
+
+int sum_to(int n) {
+  int s = 0;
+  for (int i = 1; i <= n; i++) {
+    s += i;
+  }
+  return s;
+}
+
+int clobber(int a, int b, int c, int d) {
+  int x = a * 3;
+  int y = b * 5;
+  int z = c * 7;
+  int w = d * 11;
+  for (int i = 0; i < 3; i++) {
+    x = x + y;
+    y = y + z;
+    z = z + w;
+    w = w + x;
+  }
+  return x + y + z + w;
+}
+
+int bump(int *p) {
+  *p = *p + 1;
+  return *p;
+}
+
+long mix(long a, short b, unsigned char c, int d) {
+  long t = 0;
+  for (int i = 0; i < 4; i++) {
+    t = t + a + b + c + d;
+  }
+  return t;
+}
+
+int main() {
+  int pass = 0;
+  int fail = 0;
+
+  // Test 1: loop counter and accumulator
+  if (sum_to(100) == 5050) { pass++; } else { printf("FAIL 1: %d\n", sum_to(100)); fail++; }
+
+  // Test 2: values live across calls that use the same registers
+  int u = 10;
+  int v = 20;
+  for (int i = 0; i < 3; i++) {
+    u = u + clobber(1, 2, 3, 4) - clobber(1, 2, 3, 4);
+    v = v + sum_to(i);
+  }
+  if (u == 10 && v == 24) { pass++; } else { printf("FAIL 2: u=%d v=%d\n", u, v); fail++; }
+
+  // Test 3: narrow types wrap as if stored to memory
+  unsigned char uc = 250;
+  signed char sc = 120;
+  short sh = 32760;
+  unsigned short us = 65530;
+  unsigned int ui = 4294967290;
+  for (int i = 0; i < 10; i++) {
+    uc++;
+    sc++;
+    sh++;
+    us++;
+    ui++;
+  }
+  if (uc == 4 && sc == 0 - 126 && sh == 0 - 32766 && us == 4 && ui == 4) { pass++; }
+  else { printf("FAIL 3: uc=%d sc=%d sh=%d us=%d ui=%d\n", uc, sc, sh, us, ui); fail++; }
+
+  // Test 4: int truncates a wide value on assignment
+  int n = 0;
+  long big = 4294967297;
+  for (int i = 0; i < 2; i++) { n = big; }
+  if (n == 1) { pass++; } else { printf("FAIL 4: n=%d\n", n); fail++; }
+
+  // Test 5: address-taken local stays in memory
+  int cnt = 0;
+  for (int i = 0; i < 5; i++) { bump(&cnt); }
+  if (cnt == 5) { pass++; } else { printf("FAIL 5: cnt=%d\n", cnt); fail++; }
+
+  // Test 6: mixed-width parameters
+  if (mix(1000000000000, 0 - 2, 255, 0 - 3) == 4 * (1000000000000 - 2 + 255 - 3)) { pass++; }
+  else { printf("FAIL 6: %ld\n", mix(1000000000000, 0 - 2, 255, 0 - 3)); fail++; }
+
+  // Test 7: post-increment value and pointer stepping
+  int arr[5];
+  int *p = arr;
+  int k = 0;
+  while (k < 5) { *p++ = k * k; k++; }
+  int old = k--;
+  if (old == 5 && k == 4 && arr[3] == 9 && arr[4] == 16) { pass++; }
+  else { printf("FAIL 7: old=%d k=%d\n", old, k); fail++; }
+
+  printf("Register local tests: %d passed, %d failed\n", pass, fail);
+  if (fail > 0) return 1;
+  return 0;
+}
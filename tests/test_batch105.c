@@ -0,0 +1,152 @@
+// Test batch 105: functions generated through the IR
+// Control flow, narrow arithmetic, memory traffic between repeated loads,
+// register pressure and calls with many arguments.
+
+int printf(int *fmt, ...);
+int sprintf(int *buf, int *fmt, ...);
+int strcmp(int *a, int *b);
+
+struct Pt {
+  int x;
+  short y;
+  unsigned char tag;
+  long big;
+};
+
+int g_counter;
+long g_table[8];
+
+int sum8(int a, int b, int c, int d, int e, int f, int g, int h) {
+  return a + b + c + d + e + f + g + h;
+}
+
+long sum10(long a, long b, long c, long d, long e, long f, long g, long h, long i, long j) {
+  return a + 2 * b + 3 * c + 4 * d + 5 * e + 6 * f + 7 * g + 8 * h + 9 * i + 10 * j;
+}
+
+int collatz(int n) {
+  int steps = 0;
+  while (n != 1) {
+    if (n % 2 == 0) { n = n / 2; } else { n = 3 * n + 1; }
+    steps++;
+  }
+  return steps;
+}
+
+int classify(int a, int b) {
+  if (a > 0 && b > 0) return 1;
+  if (a < 0 || b < 0) return 2;
+  return !a ? 3 : 4;
+}
+
+int find_first(int *arr, int n, int key) {
+  int i = 0;
+  for (i = 0; i < n; i++) {
+    if (arr[i] < 0) continue;
+    if (arr[i] == key) break;
+  }
+  return i;
+}
+
+int goto_loop(int n) {
+  int acc = 0;
+  int i = 0;
+top:
+  if (i >= n) goto done;
+  acc = acc + i * i;
+  i++;
+  goto top;
+done:
+  return acc;
+}
+
+// More simultaneously live values than there are registers
+long pressure(long s) {
+  long a = s + 1; long b = s + 2; long c = s + 3; long d = s + 4;
+  long e = s + 5; long f = s + 6; long g = s + 7; long h = s + 8;
+  long i = s + 9; long j = s + 10; long k = s + 11; long l = s + 12;
+  long m = s + 13; long n = s + 14; long o = s + 15; long p = s + 16;
+  long q = s + 17; long r = s + 18; long t = s + 19; long u = s + 20;
+  for (int it = 0; it < 3; it++) {
+    a = a + u; b = b + a; c = c + b; d = d + c; e = e + d;
+    f = f + e; g = g + f; h = h + g; i = i + h; j = j + i;
+    k = k + j; l = l + k; m = m + l; n = n + m; o = o + n;
+    p = p + o; q = q + p; r = r + q; t = t + r; u = u + t;
+    g_counter = g_counter + sum8(1, 1, 1, 1, 1, 1, 1, 1);
+  }
+  return a + b + c + d + e + f + g + h + i + j + k + l + m + n + o + p + q + r + t + u;
+}
+
+int bump_pt(struct Pt *p) {
+  int before = p->x;
+  p->x = p->x + 1;
+  // p->x must be reloaded after the store
+  return before * 100 + p->x;
+}
+
+unsigned int umix(unsigned int a, unsigned int b) {
+  return (a / b) + (a % b) + (a >> 3);
+}
+
+int main() {
+  int pass = 0;
+  int fail = 0;
+
+  // Test 1: register and stack arguments
+  if (sum8(1, 2, 3, 4, 5, 6, 7, 8) == 36 && sum10(1, 1, 1, 1, 1, 1, 1, 1, 1, 1000000000000) == 10000000000045) { pass++; }
+  else { printf("FAIL 1: %d %ld\n", sum8(1, 2, 3, 4, 5, 6, 7, 8), sum10(1, 1, 1, 1, 1, 1, 1, 1, 1, 1000000000000)); fail++; }
+
+  // Test 2: loops with division and modulo
+  if (collatz(27) == 111) { pass++; } else { printf("FAIL 2: %d\n", collatz(27)); fail++; }
+
+  // Test 3: short-circuit conditions and ternaries
+  if (classify(1, 2) == 1 && classify(0 - 1, 5) == 2 && classify(0, 0) == 3 && classify(3, 0) == 4) { pass++; }
+  else { printf("FAIL 3: %d %d %d %d\n", classify(1, 2), classify(0 - 1, 5), classify(0, 0), classify(3, 0)); fail++; }
+
+  // Test 4: break and continue
+  int arr[6];
+  arr[0] = 0 - 7; arr[1] = 3; arr[2] = 0 - 7; arr[3] = 9; arr[4] = 7; arr[5] = 1;
+  if (find_first(arr, 6, 7) == 4 && find_first(arr, 6, 42) == 6) { pass++; }
+  else { printf("FAIL 4: %d %d\n", find_first(arr, 6, 7), find_first(arr, 6, 42)); fail++; }
+
+  // Test 5: goto loops
+  if (goto_loop(10) == 285) { pass++; } else { printf("FAIL 5: %d\n", goto_loop(10)); fail++; }
+
+  // Test 6: spilling with calls in the loop
+  g_counter = 0;
+  long pr = pressure(0);
+  if (pr == 165004 && g_counter == 24) { pass++; } else { printf("FAIL 6: %ld %d\n", pr, g_counter); fail++; }
+
+  // Test 7: struct fields of every width, reload after store
+  struct Pt pt;
+  pt.x = 41;
+  pt.y = 0 - 3;
+  pt.tag = 200;
+  pt.big = 5000000000;
+  if (bump_pt(&pt) == 4142 && pt.y == 0 - 3 && pt.tag == 200 && pt.big + pt.y == 4999999997) { pass++; }
+  else { printf("FAIL 7: x=%d y=%d tag=%d\n", pt.x, pt.y, pt.tag); fail++; }
+
+  // Test 8: unsigned division, modulo and shift
+  if (umix(4000000000, 7) == 571428571 + 3 + 500000000) { pass++; }
+  else { printf("FAIL 8: %u\n", umix(4000000000, 7)); fail++; }
+
+  // Test 9: global arrays and variadic calls
+  int gi = 0;
+  while (gi < 8) { g_table[gi] = gi * 1000 + 7; gi++; }
+  char buf[64];
+  sprintf(buf, "%ld/%d/%s", g_table[7] - g_table[2], gi, "ok");
+  if (strcmp(buf, "5000/8/ok") == 0) { pass++; } else { printf("FAIL 9: %s\n", buf); fail++; }
+
+  // Test 10: signed char and short wrap, negative constants in compares
+  signed char sc = 0 - 128;
+  short sh = 0 - 32768;
+  int neg = 0;
+  sc--;
+  sh--;
+  if (sc > 0 - 5000) { neg = neg + 1; }
+  if (sc == 127 && sh == 32767 && neg == 1) { pass++; } else { printf("FAIL 10: %d %d %d\n", sc, sh, neg); fail++; }
+
+  printf("IR tests: %d passed, %d failed\n", pass, fail);
+  if (fail > 0) return 1;
+  return 0;
+}
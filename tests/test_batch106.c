@@ -0,0 +1,148 @@
+// Test batch 106: switch dispatch
+// Dense ranges (jump tables), sparse values (binary search), negative and
+// large case values, fall-through, default placement and loop control.
+
+int printf(int *fmt, ...);
+
+int dense(int x) {
+  switch (x) {
+    case 0: return 10;
+    case 1: return 11;
+    case 2: return 12;
+    case 3: return 13;
+    case 4: return 14;
+    case 6: return 16;
+    case 7: return 17;
+    default: return 0 - 1;
+  }
+  return 0;
+}
+
+int dense_offset(long x) {
+  int r = 0;
+  switch (x) {
+    case 100: r = 1; break;
+    case 101: r = 2; break;
+    case 102: r = 3; break;
+    case 104: r = 5; break;
+    case 105: r = 6; break;
+  }
+  return r;
+}
+
+int sparse(int x) {
+  switch (x) {
+    case 3: return 1;
+    case 70: return 2;
+    case 900: return 3;
+    case 4000: return 4;
+    case 12345: return 5;
+    case 65536: return 6;
+    case 100000: return 7;
+    case 2000000: return 8;
+    case 0 - 5: return 9;
+    case 0 - 70000: return 10;
+  }
+  return 0;
+}
+
+int negative_dense(int x) {
+  switch (x) {
+    case 0 - 3: return 30;
+    case 0 - 2: return 20;
+    case 0 - 1: return 10;
+    case 0: return 0;
+    case 1: return 0 - 10;
+    default: return 99;
+  }
+  return 0;
+}
+
+// A dense run at each end of a sparse set
+int mixed(int x) {
+  switch (x) {
+    case 1: case 2: case 3: case 4: case 5: return x * 2;
+    case 500: return 7;
+    case 10000: return 8;
+    case 20000: case 20001: case 20002: case 20003: case 20004: case 20005: return x - 20000 + 100;
+  }
+  return 0 - 1;
+}
+
+int fallthrough(int x) {
+  int acc = 0;
+  switch (x) {
+    case 1: acc = acc + 1;
+    case 2: acc = acc + 10;
+    case 3: acc = acc + 100; break;
+    case 4: acc = acc + 1000;
+    default: acc = acc + 5;
+  }
+  return acc;
+}
+
+int sum_switch_loop(int n) {
+  int total = 0;
+  for (int i = 0; i < n; i++) {
+    switch (i % 6) {
+      case 0: total = total + 1; break;
+      case 1: continue;
+      case 2: total = total + 100; break;
+      case 3: total = total + 1000; break;
+      case 4: total = total + 10; break;
+      default: total = total + 10000;
+    }
+    total = total + 100000;
+  }
+  return total;
+}
+
+int char_class(int c) {
+  switch (c) {
+    case 'a': case 'e': case 'i': case 'o': case 'u': return 1;
+    case ' ': case '\t': case '\n': return 2;
+    case '0': case '1': case '2': case '3': case '4':
+    case '5': case '6': case '7': case '8': case '9': return 3;
+  }
+  return 0;
+}
+
+int main() {
+  int pass = 0;
+  int fail = 0;
+
+  // Test 1: dense cases with a hole and an out-of-range value
+  if (dense(0) == 10 && dense(4) == 14 && dense(5) == 0 - 1 && dense(7) == 17 && dense(8) == 0 - 1 && dense(0 - 1) == 0 - 1) { pass++; }
+  else { printf("FAIL 1: %d %d %d %d\n", dense(0), dense(5), dense(8), dense(0 - 1)); fail++; }
+
+  // Test 2: dense cases not starting at zero, long selector, no default
+  if (dense_offset(100) == 1 && dense_offset(103) == 0 && dense_offset(105) == 6 && dense_offset(99) == 0 && dense_offset(4294967397) == 0) { pass++; }
+  else { printf("FAIL 2: %d %d %d\n", dense_offset(100), dense_offset(103), dense_offset(4294967397)); fail++; }
+
+  // Test 3: sparse values, including ones that need a register to compare
+  if (sparse(3) == 1 && sparse(900) == 3 && sparse(65536) == 6 && sparse(2000000) == 8 && sparse(0 - 5) == 9 && sparse(0 - 70000) == 10 && sparse(4) == 0 && sparse(1999999) == 0) { pass++; }
+  else { printf("FAIL 3: %d %d %d %d\n", sparse(65536), sparse(2000000), sparse(0 - 70000), sparse(4)); fail++; }
+
+  // Test 4: negative dense range
+  if (negative_dense(0 - 3) == 30 && negative_dense(0 - 1) == 10 && negative_dense(1) == 0 - 10 && negative_dense(0 - 4) == 99 && negative_dense(2) == 99) { pass++; }
+  else { printf("FAIL 4: %d %d %d\n", negative_dense(0 - 3), negative_dense(0 - 4), negative_dense(2)); fail++; }
+
+  // Test 5: dense runs inside a sparse set
+  if (mixed(3) == 6 && mixed(500) == 7 && mixed(10000) == 8 && mixed(20003) == 103 && mixed(20006) == 0 - 1 && mixed(0) == 0 - 1 && mixed(501) == 0 - 1) { pass++; }
+  else { printf("FAIL 5: %d %d %d %d\n", mixed(3), mixed(500), mixed(20003), mixed(20006)); fail++; }
+
+  // Test 6: fall-through into later cases and into default
+  if (fallthrough(1) == 111 && fallthrough(2) == 110 && fallthrough(3) == 100 && fallthrough(4) == 1005 && fallthrough(9) == 5) { pass++; }
+  else { printf("FAIL 6: %d %d %d %d\n", fallthrough(1), fallthrough(2), fallthrough(4), fallthrough(9)); fail++; }
+
+  // Test 7: break leaves the switch, continue the enclosing loop
+  if (sum_switch_loop(12) == 1022222) { pass++; } else { printf("FAIL 7: %d\n", sum_switch_loop(12)); fail++; }
+
+  // Test 8: character classes
+  if (char_class('e') == 1 && char_class('\t') == 2 && char_class('7') == 3 && char_class('z') == 0) { pass++; }
+  else { printf("FAIL 8: %d %d %d %d\n", char_class('e'), char_class('\t'), char_class('7'), char_class('z')); fail++; }
+
+  printf("Switch tests: %d passed, %d failed\n", pass, fail);
+  if (fail > 0) return 1;
+  return 0;
+}
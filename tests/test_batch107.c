@@ -0,0 +1,81 @@
+// Test batch 107: code the peephole pass rewrites
+// Zero stores of every width, stores reloaded at once, code after returns
+// and jumps to the next instruction must keep their meaning.
+
+int printf(int *fmt, ...);
+
+struct Rec {
+  long l;
+  int i;
+  short s;
+  unsigned char c;
+};
+
+struct Rec g_rec;
+unsigned char g_bytes[4];
+short g_shorts[4];
+
+int clear_rec(struct Rec *r) {
+  r->l = 0;
+  r->i = 0;
+  r->s = 0;
+  r->c = 0;
+  return r->i + 7;
+}
+
+// Each store is read back immediately
+int roundtrip(int v) {
+  unsigned char b = 0;
+  short h = 0;
+  g_bytes[1] = v;
+  b = g_bytes[1];
+  g_shorts[2] = v;
+  h = g_shorts[2];
+  g_rec.i = v;
+  return b + h + g_rec.i;
+}
+
+int early(int n) {
+  for (int i = 0; i < n; i++) {
+    if (i == 3) return i * 10;
+  }
+  if (n > 100) { return 1; } else { return 2; }
+  return 3;
+}
+
+void fill(int *out, int n) {
+  for (int i = 0; i < n; i++) {
+    out[i] = 0;
+    if (i % 2) { continue; }
+    out[i] = i;
+  }
+}
+
+int main() {
+  int pass = 0;
+  int fail = 0;
+
+  // Test 1: zero stores of every field width
+  g_rec.l = 0 - 1; g_rec.i = 0 - 1; g_rec.s = 0 - 1; g_rec.c = 255;
+  int cr = clear_rec(&g_rec);
+  if (cr == 7 && g_rec.l == 0 && g_rec.i == 0 && g_rec.s == 0 && g_rec.c == 0) { pass++; }
+  else { printf("FAIL 1: %d %ld %d %d %d\n", cr, g_rec.l, g_rec.i, g_rec.s, g_rec.c); fail++; }
+
+  // Test 2: narrow stores read straight back truncate
+  if (roundtrip(300) == 44 + 300 + 300 && roundtrip(0 - 1) == 255 - 1 - 1 && roundtrip(70000) == 112 + 4464 + 70000) { pass++; }
+  else { printf("FAIL 2: %d %d %d\n", roundtrip(300), roundtrip(0 - 1), roundtrip(70000)); fail++; }
+
+  // Test 3: returns in the middle of a function
+  if (early(10) == 30 && early(2) == 2 && early(0) == 2) { pass++; }
+  else { printf("FAIL 3: %d %d %d\n", early(10), early(2), early(0)); fail++; }
+
+  // Test 4: zero stores overwritten on some paths
+  int buf[6];
+  fill(buf, 6);
+  if (buf[0] == 0 && buf[1] == 0 && buf[2] == 2 && buf[3] == 0 && buf[4] == 4 && buf[5] == 0) { pass++; }
+  else { printf("FAIL 4: %d %d %d %d\n", buf[1], buf[2], buf[3], buf[4]); fail++; }
+
+  printf("Peephole tests: %d passed, %d failed\n", pass, fail);
+  if (fail > 0) return 1;
+  return 0;
+}
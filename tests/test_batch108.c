@@ -0,0 +1,119 @@
+// Test batch 108: constant folding
+// Constant subexpressions, const locals, algebraic identities and the
+// cases folding must leave alone: overflow, division by zero, shadowing,
+// side effects and unsigned or long operands.
+
+int printf(int *fmt, ...);
+
+enum { FLAG_A = 1, FLAG_B = 4, FLAG_C = 16 };
+
+struct Foo {
+  int a;
+  long b;
+};
+
+int g_calls;
+
+int bump() {
+  g_calls++;
+  return 3;
+}
+
+int scaled(int x) {
+  return x * (4096 / 8);
+}
+
+long sized(int n) {
+  return sizeof(struct Foo) * n;
+}
+
+int flags() {
+  return FLAG_A | FLAG_B | FLAG_C;
+}
+
+int const_locals(int x) {
+  const int k = 6 * 7;
+  const int mask = k - 1;
+  int r = (x & mask) + k;
+  {
+    // A non-const local hides the outer constant
+    int k = x;
+    r = r + k;
+  }
+  return r;
+}
+
+int const_in_switch(int x) {
+  const int base = 100;
+  int r = 0;
+  switch (x) {
+    case 1: r = base; break;
+    case 2: { int base = 7; r = base; break; }
+    default: r = base + 1;
+  }
+  return r;
+}
+
+int identities(int x) {
+  int a = x * 1 + 0;
+  int b = (x - 0) | 0;
+  int c = x & 0;
+  int d = 0 * x;
+  int e = (x << 0) / 1;
+  return a + b + c + d + e;
+}
+
+int keep_side_effects(int x) {
+  g_calls = 0;
+  int r = bump() * 0 + (bump() & 0);
+  return r + g_calls * 10 + x * 0;
+}
+
+int ternary_fold(int x) {
+  int a = (2 > 1) ? x : x * 100;
+  int b = (1 - 1) ? x * 100 : x + 1;
+  int c = (0 && bump()) + (1 || bump());
+  return a + b + c;
+}
+
+int main() {
+  int pass = 0;
+  int fail = 0;
+
+  // Test 1: constant subexpressions inside runtime expressions
+  if (scaled(3) == 1536 && sized(4) == 64 && flags() == 21) { pass++; }
+  else { printf("FAIL 1: %d %ld %d\n", scaled(3), sized(4), flags()); fail++; }
+
+  // Test 2: const locals propagate, shadowed names do not
+  if (const_locals(5) == 1 + 42 + 5 && const_locals(0 - 1) == 41 + 42 - 1) { pass++; }
+  else { printf("FAIL 2: %d %d\n", const_locals(5), const_locals(0 - 1)); fail++; }
+
+  // Test 3: constants seen through switch cases
+  if (const_in_switch(1) == 100 && const_in_switch(2) == 7 && const_in_switch(9) == 101) { pass++; }
+  else { printf("FAIL 3: %d %d %d\n", const_in_switch(1), const_in_switch(2), const_in_switch(9)); fail++; }
+
+  // Test 4: algebraic identities
+  if (identities(7) == 21 && identities(0 - 4) == 0 - 12) { pass++; }
+  else { printf("FAIL 4: %d %d\n", identities(7), identities(0 - 4)); fail++; }
+
+  // Test 5: multiplying a call by zero still makes the call
+  if (keep_side_effects(9) == 20) { pass++; } else { printf("FAIL 5: %d\n", keep_side_effects(9)); fail++; }
+
+  // Test 6: constant conditions in ternaries and short circuits
+  g_calls = 0;
+  if (ternary_fold(5) == 5 + 6 + 1 && g_calls == 0) { pass++; }
+  else { printf("FAIL 6: %d %d\n", ternary_fold(5), g_calls); fail++; }
+
+  // Test 7: values that must not be folded to int
+  int big = 65536 * 65536;
+  long lbig = 2147483647;
+  unsigned int u = 0 - 1;
+  int quot = 7 / (1 - 1 + 1);
+  int neg = (0 - 7) / 2 + (0 - 7) % 2 + ((0 - 16) >> 2);
+  if (big == 0 && lbig + 1 == 2147483648 && u / 2 == 2147483647 && (1 << 31) < 0 && quot == 7 && neg == 0 - 8) { pass++; }
+  else { printf("FAIL 7: %d %ld %u %d %d\n", big, lbig + 1, u / 2, quot, neg); fail++; }
+
+  printf("Fold tests: %d passed, %d failed\n", pass, fail);
+  if (fail > 0) return 1;
+  return 0;
+}
@@ -0,0 +1,130 @@
+// Test batch 109: conditions compiled as branches
+// Comparisons against immediates and registers, bit tests, && and || as
+// control flow (including their side effects), negated conditions and
+// loops whose condition is tested at the bottom.
+
+int printf(int *fmt, ...);
+
+int g_trace;
+
+int note(int v, int ret) {
+  g_trace = g_trace * 10 + v;
+  return ret;
+}
+
+int classify(int x) {
+  if (x < 0 - 100) return 1;
+  if (x <= 0 - 1) return 2;
+  if (x == 0) return 3;
+  if (x > 4095) return 5;
+  return 4;
+}
+
+int bits(int x) {
+  int r = 0;
+  if (x & 1) { r = r + 1; }
+  if ((x & 32) == 0) { r = r + 10; }
+  if ((x & 1073741824) != 0) { r = r + 100; }
+  if (!(x & 4)) { r = r + 1000; }
+  return r;
+}
+
+int long_bits(long x) {
+  int r = 0;
+  if (x & 4294967296) { r = r + 1; }
+  if (x & 8) { r = r + 10; }
+  if (x > 4294967295) { r = r + 100; }
+  return r;
+}
+
+int uless(unsigned int a, unsigned int b) {
+  if (a < b) return 1;
+  return 0;
+}
+
+int short_circuit(int a, int b, int c) {
+  g_trace = 0;
+  if ((note(1, a) && note(2, b)) || note(3, c)) return 1;
+  return 0;
+}
+
+int not_and(int a, int b) {
+  if (!(a > 0 && b > 0)) return 1;
+  return 0;
+}
+
+int count_while(int n) {
+  int i = 0;
+  int odd = 0;
+  while (i < n) {
+    i++;
+    if ((i & 1) == 0) continue;
+    odd++;
+  }
+  return odd;
+}
+
+int count_for(int n) {
+  int s = 0;
+  for (int i = n; i != 0; i--) { s = s + i; }
+  for (;;) {
+    s++;
+    if (s % 7 == 0) break;
+  }
+  return s;
+}
+
+int count_do(int n) {
+  int k = 0;
+  do { k++; n = n / 2; } while (n > 0 && k < 100);
+  return k;
+}
+
+int main() {
+  int pass = 0;
+  int fail = 0;
+
+  // Test 1: compares against immediates, including negative ones
+  if (classify(0 - 500) == 1 && classify(0 - 100) == 2 && classify(0 - 1) == 2 && classify(0) == 3 && classify(4095) == 4 && classify(4096) == 5) { pass++; }
+  else { printf("FAIL 1: %d %d %d %d\n", classify(0 - 100), classify(0 - 1), classify(4095), classify(4096)); fail++; }
+
+  // Test 2: single-bit tests
+  if (bits(0) == 1010 && bits(1) == 1011 && bits(32 + 4) == 0 && bits(1073741824 + 1) == 1111) { pass++; }
+  else { printf("FAIL 2: %d %d %d %d\n", bits(0), bits(1), bits(36), bits(1073741825)); fail++; }
+
+  // Test 3: bit tests and compares on long values
+  if (long_bits(4294967296) == 101 && long_bits(8) == 10 && long_bits(4294967295) == 10) { pass++; }
+  else { printf("FAIL 3: %d %d %d\n", long_bits(4294967296), long_bits(8), long_bits(4294967295)); fail++; }
+
+  // Test 4: unsigned compares
+  if (uless(1, 0 - 1) == 1 && uless(0 - 1, 1) == 0 && uless(3, 3) == 0) { pass++; }
+  else { printf("FAIL 4: %d %d\n", uless(1, 0 - 1), uless(0 - 1, 1)); fail++; }
+
+  // Test 5: && and || evaluate only what they need, in order
+  int s1 = short_circuit(1, 1, 1); int t1 = g_trace;
+  int s2 = short_circuit(0, 1, 1); int t2 = g_trace;
+  int s3 = short_circuit(1, 0, 0); int t3 = g_trace;
+  if (s1 == 1 && t1 == 12 && s2 == 1 && t2 == 13 && s3 == 0 && t3 == 123) { pass++; }
+  else { printf("FAIL 5: %d/%d %d/%d %d/%d\n", s1, t1, s2, t2, s3, t3); fail++; }
+
+  // Test 6: negated compound conditions and their values
+  int v1 = (3 > 2) && (g_trace > 0);
+  int v2 = (g_trace < 0) || (g_trace == 0);
+  if (not_and(1, 1) == 0 && not_and(0, 1) == 1 && not_and(1, 0 - 1) == 1 && v1 == 1 && v2 == 0) { pass++; }
+  else { printf("FAIL 6: %d %d %d %d\n", not_and(1, 1), not_and(0, 1), v1, v2); fail++; }
+
+  // Test 7: loops with continue, break and empty conditions
+  if (count_while(10) == 5 && count_while(0) == 0 && count_for(4) == 14 && count_do(0) == 1 && count_do(1000) == 10) { pass++; }
+  else { printf("FAIL 7: %d %d %d %d\n", count_while(10), count_for(4), count_do(0), count_do(1000)); fail++; }
+
+  // Test 8: ternaries on compound conditions
+  int a = 5;
+  int b = 0 - 5;
+  int t = (a > 0 && b < 0) ? 1 : 2;
+  int u = (a < 0 || b > 0) ? 1 : 2;
+  if (t == 1 && u == 2) { pass++; } else { printf("FAIL 8: %d %d\n", t, u); fail++; }
+
+  printf("Branch tests: %d passed, %d failed\n", pass, fail);
+  if (fail > 0) return 1;
+  return 0;
+}
@@ -0,0 +1,136 @@
+// Test batch 110: immediate operands and addressing modes
+// Logical bitmask immediates, add/sub immediates past 12 bits, shifts and
+// compares by constants, locals far from the frame pointer and array and
+// field loads through immediate and register offsets.
+
+int printf(int *fmt, ...);
+
+struct Node {
+  int tag;
+  short small;
+  unsigned char flag;
+  long value;
+  struct Node *next;
+};
+
+long g_wide[600];
+
+long masks(long x) {
+  long a = x & 0xFF00FF00FF00FF00;
+  long b = x | 0x5555555555555555;
+  long c = x ^ 0xFFFFFFFFFFFFFFF0;
+  long d = x & 0x7FFFFFFF;
+  return (a >> 8) + (b & 0xF) + (c & 0xFF) + (d >> 28);
+}
+
+int int_masks(int x) {
+  return (x & 0xF0F0) + (x | 0x3) + (x ^ 0x1C) + (x & 0xFFFFFFF8);
+}
+
+long offsets(long x) {
+  long a = x + 4096;
+  long b = x - 8192;
+  long c = x + 1234567;
+  long d = x - 16777215;
+  return a + b + c + d;
+}
+
+int shifts(int x, unsigned int u, long l) {
+  return (x << 4) + (x >> 2) + (u >> 28) + (l >> 40);
+}
+
+int compares(int x, long l) {
+  int r = 0;
+  int a = x < 4095;
+  int b = x >= 0 - 4095;
+  int c = l > 1000;
+  int d = l == 0 - 1;
+  r = a + b * 2 + c * 4 + d * 8;
+  return r;
+}
+
+// Locals beyond the reach of a 9-bit frame offset
+int far_locals(int n) {
+  int pad[2000];
+  long wide[8];
+  short half = 0 - 3;
+  unsigned char byte = 200;
+  int last = n;
+  pad[0] = n;
+  pad[1999] = n * 2;
+  wide[7] = n * 3;
+  return pad[0] + pad[1999] + wide[7] + half + byte + last;
+}
+
+long indexing(int i) {
+  int ints[8];
+  short shorts[8];
+  unsigned char bytes[8];
+  long longs[8];
+  for (int k = 0; k < 8; k++) {
+    ints[k] = k * 100 - 350;
+    shorts[k] = 0 - k * 1000;
+    bytes[k] = 250 + k;
+    longs[k] = (long)k << 36;
+  }
+  long fixed = ints[3] + shorts[7] + bytes[5] + (longs[6] >> 32);
+  long varied = ints[i] + shorts[i] + bytes[i] + (longs[i] >> 32);
+  return fixed * 1000 + varied;
+}
+
+long walk(struct Node *n) {
+  long s = 0;
+  while (n != 0) {
+    s = s + n->tag + n->small + n->flag + n->value;
+    n = n->next;
+  }
+  return s;
+}
+
+int main() {
+  int pass = 0;
+  int fail = 0;
+
+  // Test 1: 64-bit and 32-bit logical immediates
+  long m1 = masks(0x123456789ABCDEF0);
+  int m2 = int_masks(0x12345);
+  if (m1 == 5066918958072036 && m2 == 231968) { pass++; }
+  else { printf("FAIL 1: %ld %d\n", m1, m2); fail++; }
+
+  // Test 2: add/sub immediates wider than 12 bits
+  if (offsets(10) == 0 - 15546704 && offsets(0 - 20000000) == 0 - 95546744) { pass++; }
+  else { printf("FAIL 2: %ld %ld\n", offsets(10), offsets(0 - 20000000)); fail++; }
+
+  // Test 3: shifts by constants keep signedness and width
+  if (shifts(0 - 100, 0 - 1, 0 - 1099511627776) == 0 - 1611 && shifts(3, 1, 1099511627776) == 49) { pass++; }
+  else { printf("FAIL 3: %d %d\n", shifts(0 - 100, 0 - 1, 0 - 1099511627776), shifts(3, 1, 1099511627776)); fail++; }
+
+  // Test 4: compares against immediates as values
+  if (compares(4094, 1001) == 7 && compares(4095, 0 - 1) == 10 && compares(0 - 4096, 1000) == 1) { pass++; }
+  else { printf("FAIL 4: %d %d %d\n", compares(4094, 1001), compares(4095, 0 - 1), compares(0 - 4096, 1000)); fail++; }
+
+  // Test 5: locals far from the frame pointer
+  if (far_locals(5) == 5 + 10 + 15 - 3 + 200 + 5) { pass++; }
+  else { printf("FAIL 5: %d\n", far_locals(5)); fail++; }
+
+  // Test 6: constant and variable indices of every element width
+  long ix0 = indexing(0);
+  long ix7 = indexing(7);
+  if (ix0 == 0 - 6699100 && ix7 == 0 - 6705537) { pass++; }
+  else { printf("FAIL 6: %ld %ld\n", ix0, ix7); fail++; }
+
+  // Test 7: fields through pointers and a global array past 4K
+  struct Node b;
+  struct Node a;
+  b.tag = 0 - 1; b.small = 0 - 2; b.flag = 255; b.value = 4294967296; b.next = 0;
+  a.tag = 7; a.small = 300; a.flag = 1; a.value = 0 - 8; a.next = &b;
+  g_wide[599] = 12345;
+  g_wide[513] = 0 - 6;
+  int j = 599;
+  if (walk(&a) == 4294967296 + 255 - 3 + 300 && g_wide[j] + g_wide[513] == 12339) { pass++; }
+  else { printf("FAIL 7: %ld %ld\n", walk(&a), g_wide[j]); fail++; }
+
+  printf("Immediate tests: %d passed, %d failed\n", pass, fail);
+  if (fail > 0) return 1;
+  return 0;
+}
@@ -0,0 +1,140 @@
+// Test batch 111: function inlining
+// Small static helpers, inline and always_inline functions, noinline and
+// recursive ones that must stay calls, return value conversions, arguments
+// with side effects, and names a copy must not capture.
+
+int printf(int *fmt, ...);
+
+int g;
+int g_calls;
+
+static int sq(int x) { return x * x; }
+
+static int clamp(int v, int lo, int hi) {
+  if (v < lo) return lo;
+  if (v > hi) return hi;
+  return v;
+}
+
+static int sign(int v) {
+  if (v < 0) return 0 - 1; else return v > 0;
+}
+
+static int add_g(int x) { return g + x; }
+
+// The parameter hides the global add_g reads
+int shadow_g(int g) { return add_g(g); }
+
+static int countdown(int n) {
+  int c = 0;
+  while (n > 0) { n--; c++; }
+  return c;
+}
+
+static int first_over(int *a, int n, int limit) {
+  int found = 0 - 1;
+  for (int i = 0; i < n; i++) {
+    if (a[i] > limit) { found = i; break; }
+  }
+  return found;
+}
+
+static void bump(int *p, int by) { *p = *p + by; }
+
+static int low32(long x) { return x; }
+static unsigned int as_unsigned(int x) { return x; }
+static long big(int x) { long r = x; return r << 32; }
+static char *skip_spaces(char *s) {
+  while (*s == ' ') { s++; }
+  return s;
+}
+
+static int next_val() {
+  g_calls++;
+  return g_calls * 10;
+}
+
+static int sum_sq(int a, int b) { return sq(a) + sq(b); }
+
+inline int twice(int x) { return x + x; }
+
+static inline __attribute__((always_inline)) int mix(int a, int b) {
+  int r = a;
+  for (int i = 0; i < 4; i++) {
+    if (i % 2 == 0) { r = r * 3 + b; } else { r = r - b; }
+    switch (r % 3) {
+      case 0: r = r + 1; break;
+      case 1: r = r + 2; break;
+      default: r = r + 3;
+    }
+  }
+  return r;
+}
+
+static __attribute__((noinline)) int kept(int x) { return x + 1; }
+
+static int fact(int n) {
+  if (n <= 1) return 1;
+  return n * fact(n - 1);
+}
+
+static int triple(int x) { return x * 3; }
+
+int apply(int (*fn)(int), int v) { return fn(v); }
+
+int main() {
+  int pass = 0;
+  int fail = 0;
+
+  // Test 1: helpers with constant and variable arguments
+  int k = 7;
+  if (sq(3) == 9 && sq(k) == 49 && sq(0 - k) == 49 && sq(sq(2)) == 16) { pass++; }
+  else { printf("FAIL 1: %d %d %d\n", sq(3), sq(k), sq(sq(2))); fail++; }
+
+  // Test 2: chains of early returns and if/else returns
+  if (clamp(0 - 5, 0, 9) == 0 && clamp(50, 0, 9) == 9 && clamp(4, 0, 9) == 4 &&
+      sign(0 - 3) == 0 - 1 && sign(0) == 0 && sign(8) == 1) { pass++; }
+  else { printf("FAIL 2: %d %d %d %d\n", clamp(0 - 5, 0, 9), clamp(50, 0, 9), sign(0 - 3), sign(8)); fail++; }
+
+  // Test 3: a caller local with the name of a global the helper reads
+  g = 100;
+  int r3 = add_g(1) + shadow_g(5);
+  if (r3 == 101 + 105) { pass++; } else { printf("FAIL 3: %d\n", r3); fail++; }
+
+  // Test 4: parameters changed inside the helper, loops and breaks
+  int n = 4;
+  int arr[5];
+  for (int i = 0; i < 5; i++) { arr[i] = i * i; }
+  if (countdown(6) == 6 && countdown(n) == 4 && n == 4 && first_over(arr, 5, 3) == 2 && first_over(arr, 5, 99) == 0 - 1) { pass++; }
+  else { printf("FAIL 4: %d %d %d %d\n", countdown(6), n, first_over(arr, 5, 3), first_over(arr, 5, 99)); fail++; }
+
+  // Test 5: void helpers writing through pointers
+  int acc = 1;
+  bump(&acc, 2);
+  for (int i = 0; i < 3; i++) { bump(&acc, i); }
+  if (acc == 6) { pass++; } else { printf("FAIL 5: %d\n", acc); fail++; }
+
+  // Test 6: return values convert to the return type
+  long wide = 4294967298;
+  char *txt = "   hi";
+  char *word = skip_spaces(txt);
+  if (low32(wide) == 2 && as_unsigned(0 - 1) > 5 && big(3) == 12884901888 && *word == 'h' && word - txt == 3) { pass++; }
+  else { printf("FAIL 6: %d %ld %d\n", low32(wide), big(3), skip_spaces(txt) - txt); fail++; }
+
+  // Test 7: arguments are evaluated exactly once
+  g_calls = 0;
+  int v7 = sq(next_val()) + sum_sq(next_val(), 1);
+  if (v7 == 100 + 401 && g_calls == 2) { pass++; } else { printf("FAIL 7: %d %d\n", v7, g_calls); fail++; }
+
+  // Test 8: inline, always_inline, noinline and recursive functions
+  if (twice(21) == 42 && mix(2, 5) == 34 && mix(k, 1) == 83 && kept(9) == 10 && fact(6) == 720) { pass++; }
+  else { printf("FAIL 8: %d %d %d %d %d\n", twice(21), mix(2, 5), mix(k, 1), kept(9), fact(6)); fail++; }
+
+  // Test 9: a helper also used through a function pointer stays defined
+  if (triple(4) == 12 && apply(triple, 5) == 15) { pass++; }
+  else { printf("FAIL 9: %d %d\n", triple(4), apply(triple, 5)); fail++; }
+
+  printf("Inline tests: %d passed, %d failed\n", pass, fail);
+  if (fail > 0) return 1;
+  return 0;
+}
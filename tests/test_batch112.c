@@ -0,0 +1,106 @@
+// Test batch 112: leaf and frameless functions
+// Leaves with no stack, with locals, with stack arguments and large frames,
+// switches, recursion and callers that keep their frames, all of which
+// must behave the same whatever frame each one ends up with.
+
+int printf(int *fmt, ...);
+
+struct Pair {
+  int a;
+  long b;
+};
+
+int g_val;
+
+int add3(int a, int b, int c) { return a + b + c; }
+
+long mix(long a, int b) { return (a << 4) ^ b; }
+
+int get_g() { return g_val; }
+void set_g(int v) { g_val = v; }
+
+int pick(int k) {
+  switch (k) {
+    case 0: return 10;
+    case 1: return 20;
+    case 5: return 50;
+  }
+  return 0 - 1;
+}
+
+int sum_arr(int n) {
+  int a[8];
+  for (int i = 0; i < 8; i++) { a[i] = i * n; }
+  int s = 0;
+  for (int i = 0; i < 8; i++) { s = s + a[i]; }
+  return s;
+}
+
+int big_frame(int k) {
+  int buf[2000];
+  for (int i = 0; i < 2000; i++) { buf[i] = i + k; }
+  return buf[0] + buf[1999] + buf[k];
+}
+
+int ten(int a, int b, int c, int d, int e, int f, int g, int h, int i, int j) {
+  return a - b + c - d + e - f + g - h + i * 100 + j * 1000;
+}
+
+int pair_sum(struct Pair p) { return p.a + p.b; }
+
+int addr_local(int x) {
+  int y = x;
+  int *p = &y;
+  *p = *p + 5;
+  return y;
+}
+
+int fib(int n) {
+  if (n < 2) return n;
+  return fib(n - 1) + fib(n - 2);
+}
+
+int call_ten(int x) {
+  int keep[4];
+  keep[0] = x;
+  keep[3] = ten(1, 2, 3, 4, 5, 6, 7, 8, x, 2);
+  return keep[0] + keep[3];
+}
+
+int apply(int (*fn)(int, int, int), int v) { return fn(v, v, v) + 1; }
+
+int main() {
+  int pass = 0;
+  int fail = 0;
+
+  // Test 1: leaves that need no stack at all
+  if (add3(1, 2, 3) == 6 && mix(3, 5) == 53 && mix(0 - 1, 0) == 0 - 16) { pass++; }
+  else { printf("FAIL 1: %d %ld\n", add3(1, 2, 3), mix(3, 5)); fail++; }
+
+  // Test 2: leaves reading and writing globals
+  set_g(41);
+  if (get_g() == 41 && g_val == 41) { pass++; } else { printf("FAIL 2: %d\n", get_g()); fail++; }
+
+  // Test 3: a leaf with a switch and several returns
+  if (pick(0) + pick(1) + pick(5) == 80 && pick(3) == 0 - 1) { pass++; }
+  else { printf("FAIL 3: %d %d\n", pick(5), pick(3)); fail++; }
+
+  // Test 4: leaves with local arrays, large frames and taken addresses
+  if (sum_arr(3) == 84 && big_frame(7) == 7 + 2006 + 14 && addr_local(10) == 15) { pass++; }
+  else { printf("FAIL 4: %d %d %d\n", sum_arr(3), big_frame(7), addr_local(10)); fail++; }
+
+  // Test 5: arguments passed on the stack and struct arguments
+  struct Pair pr;
+  pr.a = 3;
+  pr.b = 40;
+  if (ten(1, 2, 3, 4, 5, 6, 7, 8, 9, 10) == 0 - 4 + 900 + 10000 && pair_sum(pr) == 43) { pass++; }
+  else { printf("FAIL 5: %d %d\n", ten(1, 2, 3, 4, 5, 6, 7, 8, 9, 10), pair_sum(pr)); fail++; }
+
+  // Test 6: callers keep their return addresses
+  if (fib(15) == 610 && call_ten(4) == 4 + 0 - 4 + 400 + 2000 && apply(add3, 5) == 16) { pass++; }
+  else { printf("FAIL 6: %d %d %d\n", fib(15), call_ten(4), apply(add3, 5)); fail++; }
+
+  printf("Frame tests: %d passed, %d failed\n", pass, fail);
+  if (fail > 0) return 1;
+  return 0;
+}
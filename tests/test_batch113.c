@@ -0,0 +1,119 @@
+// Test batch 113: multiply, divide and modulo by constants
+// Every constant form is checked against the same operation on a divisor
+// the compiler cannot see, over dividends that include both extremes,
+// negative values and exact multiples.
+
+int printf(int *fmt, ...);
+
+int sdiv_ref(int a, int b) { return a / b; }
+int srem_ref(int a, int b) { return a % b; }
+unsigned int udiv_ref(unsigned int a, unsigned int b) { return a / b; }
+unsigned int urem_ref(unsigned int a, unsigned int b) { return a % b; }
+long ldiv_ref(long a, long b) { return a / b; }
+long lrem_ref(long a, long b) { return a % b; }
+int mul_ref(int a, int b) { return a * b; }
+long lmul_ref(long a, long b) { return a * b; }
+
+#define SCHECK(x, d) if ((x) / (d) != sdiv_ref(x, d) || (x) % (d) != srem_ref(x, d)) { bad++; }
+#define UCHECK(x, d) if ((x) / (d) != udiv_ref(x, d) || (x) % (d) != urem_ref(x, d)) { bad++; }
+#define LCHECK(x, d) if ((x) / (d) != ldiv_ref(x, d) || (x) % (d) != lrem_ref(x, d)) { bad++; }
+#define MCHECK(x, k) if ((x) * (k) != mul_ref(x, k)) { bad++; }
+#define LMCHECK(x, k) if ((x) * (k) != lmul_ref(x, k)) { bad++; }
+
+struct Rec {
+  int a;
+  int b;
+  int c;
+};
+
+int bad_signed(int x) {
+  int bad = 0;
+  // INT_MIN / -1 overflows
+  if (x != 0 - 2147483647 - 1) { SCHECK(x, 0 - 1) }
+  SCHECK(x, 1) SCHECK(x, 2) SCHECK(x, 0 - 2) SCHECK(x, 3) SCHECK(x, 0 - 3)
+  SCHECK(x, 5) SCHECK(x, 6) SCHECK(x, 7) SCHECK(x, 0 - 7) SCHECK(x, 10) SCHECK(x, 12)
+  SCHECK(x, 16) SCHECK(x, 0 - 16) SCHECK(x, 25) SCHECK(x, 100) SCHECK(x, 641) SCHECK(x, 1000)
+  SCHECK(x, 65536) SCHECK(x, 1073741824) SCHECK(x, 2147483647) SCHECK(x, 0 - 2147483647)
+  SCHECK(x, 1000000007) SCHECK(x, 0 - 65535)
+  return bad;
+}
+
+int bad_unsigned(unsigned int x) {
+  int bad = 0;
+  UCHECK(x, 1) UCHECK(x, 2) UCHECK(x, 3) UCHECK(x, 7) UCHECK(x, 10) UCHECK(x, 16)
+  UCHECK(x, 60) UCHECK(x, 641) UCHECK(x, 2147483648) UCHECK(x, 2147483649) UCHECK(x, 4294967295)
+  UCHECK(x, 1000000007)
+  return bad;
+}
+
+int bad_long(long x) {
+  int bad = 0;
+  LCHECK(x, 1) LCHECK(x, 0 - 1) LCHECK(x, 2) LCHECK(x, 8) LCHECK(x, 0 - 8) LCHECK(x, 7)
+  LCHECK(x, 4294967296) LCHECK(x, 1000)
+  return bad;
+}
+
+int bad_mul(int x, long y) {
+  int bad = 0;
+  MCHECK(x, 2) MCHECK(x, 3) MCHECK(x, 5) MCHECK(x, 7) MCHECK(x, 9) MCHECK(x, 12) MCHECK(x, 15)
+  MCHECK(x, 24) MCHECK(x, 0 - 1) MCHECK(x, 0 - 3) MCHECK(x, 0 - 7) MCHECK(x, 0 - 8) MCHECK(x, 1000)
+  LMCHECK(y, 3) LMCHECK(y, 10) LMCHECK(y, 0 - 5) LMCHECK(y, 4096) LMCHECK(y, 31) LMCHECK(y, 33)
+  return bad;
+}
+
+int main() {
+  int pass = 0;
+  int fail = 0;
+  int svals[14];
+  svals[0] = 0; svals[1] = 1; svals[2] = 0 - 1; svals[3] = 7; svals[4] = 0 - 7;
+  svals[5] = 2147483647; svals[6] = 0 - 2147483647 - 1; svals[7] = 0 - 2147483647;
+  svals[8] = 123456789; svals[9] = 0 - 987654321; svals[10] = 1000; svals[11] = 0 - 1000;
+  svals[12] = 65535; svals[13] = 0 - 100;
+
+  // Test 1: signed 32-bit division and remainder
+  int bad = 0;
+  for (int i = 0; i < 14; i++) { bad = bad + bad_signed(svals[i]); }
+  for (int v = 0 - 3000; v <= 3000; v = v + 7) { bad = bad + bad_signed(v); }
+  if (bad == 0) { pass++; } else { printf("FAIL 1: %d\n", bad); fail++; }
+
+  // Test 2: unsigned 32-bit division and remainder
+  bad = 0;
+  for (int i = 0; i < 14; i++) { bad = bad + bad_unsigned(svals[i]); }
+  for (int v = 0; v <= 5000; v = v + 3) { bad = bad + bad_unsigned(v); }
+  if (bad == 0) { pass++; } else { printf("FAIL 2: %d\n", bad); fail++; }
+
+  // Test 3: 64-bit division and remainder
+  bad = 0;
+  long big = 4611686018427387904;
+  bad = bad + bad_long(big) + bad_long(0 - big) + bad_long(big + big - 1 + big + big) + bad_long(0 - 9);
+  for (int i = 0; i < 14; i++) { bad = bad + bad_long(svals[i]); }
+  if (bad == 0) { pass++; } else { printf("FAIL 3: %d\n", bad); fail++; }
+
+  // Test 4: multiplies by constants
+  bad = 0;
+  for (int i = 0; i < 14; i++) { bad = bad + bad_mul(svals[i], svals[i] * 4096); }
+  bad = bad + bad_mul(3, big + 12345);
+  if (bad == 0) { pass++; } else { printf("FAIL 4: %d\n", bad); fail++; }
+
+  // Test 5: pointer arithmetic over 12-byte structs
+  struct Rec recs[5];
+  for (int i = 0; i < 5; i++) { recs[i].a = i; recs[i].b = i * 10; recs[i].c = i * 100; }
+  struct Rec *p = recs;
+  int k = 3;
+  struct Rec *q = p + k;
+  struct Rec *r = recs + 4;
+  if (q->b == 30 && (p + 4)->c == 400 && q - p == 3 && r - q == 1) { pass++; }
+  else { printf("FAIL 5: %d %d\n", q->b, (int)(q - p)); fail++; }
+
+  // Test 6: hashing with constant moduli
+  unsigned int h = 5381;
+  for (int i = 0; i < 20; i++) { h = (h * 33 + i) % 1000003; }
+  int buckets = 0;
+  for (int i = 0; i < 100; i++) { buckets = buckets + (i * 31 + 7) % 16 + (i * 17) / 10; }
+  if (h == udiv_ref(h, 1) && h < 1000003 && buckets == 9112) { pass++; }
+  else { printf("FAIL 6: %u %d\n", h, buckets); fail++; }
+
+  printf("Const arithmetic tests: %d passed, %d failed\n", pass, fail);
+  if (fail > 0) return 1;
+  return 0;
+}
@@ -0,0 +1,93 @@
+// Test batch 114: programs the integrated assembler has to get right
+// String tables, jump tables, function pointers, static and common storage
+// and large constants all go through relocations or local fixups.
+
+int printf(int *fmt, ...);
+int strcmp(int *a, int *b);
+
+int counter;
+int table[8] = {3, 1, 4, 1, 5, 9, 2, 6};
+int *names[4] = {"zero", "one", "two", "three"};
+long big_vals[3];
+static int hidden[4] = {10, 20, 30, 40};
+
+int add1(int x) { return x + 1; }
+int dbl(int x) { return x * 2; }
+int sqr(int x) { return x * x; }
+int (*ops[3])(int) = {add1, dbl, sqr};
+
+static int bump() {
+  static int calls = 0;
+  calls++;
+  return calls;
+}
+
+int classify(int c) {
+  switch (c) {
+  case 0: return 100;
+  case 1: return 101;
+  case 2: return 102;
+  case 3: return 103;
+  case 4: return 104;
+  case 5: return 105;
+  case 6: return 106;
+  case 7: return 107;
+  default: return 0 - 1;
+  }
+}
+
+int main() {
+  int pass = 0;
+  int fail = 0;
+
+  // Test 1: pointers into initialized data
+  int *table_ptr = table + 2;
+  if (*table_ptr == 4 && table_ptr[3] == 9 && table_ptr[0 - 2] == 3) { pass++; }
+  else { printf("FAIL 1: %d\n", *table_ptr); fail++; }
+
+  // Test 2: string table
+  if (strcmp(names[2], "two") == 0 && strcmp(names[3], "three") == 0) { pass++; }
+  else { printf("FAIL 2\n"); fail++; }
+
+  // Test 3: 64-bit constants in data and code
+  long k = 81985529216486895;
+  big_vals[0] = 1099511627776;
+  big_vals[1] = 0 - 1;
+  big_vals[2] = k;
+  if (big_vals[0] == 1099511627776 && big_vals[1] == 0 - 1 && big_vals[2] == k
+      && (k >> 32) == 19088743) { pass++; }
+  else { printf("FAIL 3\n"); fail++; }
+
+  // Test 4: jump table
+  int sum = 0;
+  for (int i = 0 - 1; i < 10; i++) { sum = sum + classify(i); }
+  if (sum == 828 - 3) { pass++; }
+  else { printf("FAIL 4: %d\n", sum); fail++; }
+
+  // Test 5: function pointer table
+  int v = 3;
+  for (int i = 0; i < 3; i++) { v = ops[i](v); }
+  if (v == 64) { pass++; }
+  else { printf("FAIL 5: %d\n", v); fail++; }
+
+  // Test 6: static locals, file statics and common storage
+  bump();
+  bump();
+  for (int i = 0; i < 4; i++) { counter = counter + hidden[i]; }
+  if (bump() == 3 && counter == 100) { pass++; }
+  else { printf("FAIL 6: %d\n", counter); fail++; }
+
+  // Test 7: backward and forward branches in loops
+  int n = 0;
+  int steps = 27;
+  while (steps != 1) {
+    if (steps % 2 == 0) { steps = steps / 2; } else { steps = 3 * steps + 1; }
+    n++;
+  }
+  if (n == 111) { pass++; }
+  else { printf("FAIL 7: %d\n", n); fail++; }
+
+  printf("Assembler tests: %d passed, %d failed\n", pass, fail);
+  if (fail > 0) return 1;
+  return 0;
+}
@@ -0,0 +1,159 @@
+// Test batch 115: code whose calling convention and symbols depend on the
+// object format. Variadic calls with register and stack arguments, doubles
+// passed to the printf family, static storage and label addresses all come
+// out differently for Mach-O and ELF targets.
+
+int printf(int *fmt, ...);
+int sprintf(int *buf, int *fmt, ...);
+int snprintf(int *buf, long n, int *fmt, ...);
+int strcmp(int *a, int *b);
+
+static int zeroed[64];
+static long zeroed_big[4];
+int shared_words[16];
+
+int weighted(int n, ...) {
+  __builtin_va_list ap;
+  __builtin_va_start(&ap);
+  int total = 0;
+  for (int i = 1; i <= n; i++) {
+    int v = __builtin_va_arg(ap, int);
+    total = total + v * i;
+  }
+  return total;
+}
+
+long mixed(int tag, long base, ...) {
+  __builtin_va_list ap;
+  __builtin_va_start(&ap);
+  long a = __builtin_va_arg(ap, long);
+  int *s = __builtin_va_arg(ap, int *);
+  int b = __builtin_va_arg(ap, int);
+  long r = base + a * 10 + b;
+  if (strcmp(s, "ok") != 0) { r = 0 - 1; }
+  return r * tag;
+}
+
+// Walks its arguments as kinds says: 'i' for an int, 'd' for a double.
+// Each is weighted by its position, so one read from the wrong slot shows.
+double tally(int *kinds, ...) {
+  __builtin_va_list ap;
+  __builtin_va_start(&ap);
+  double total = 0;
+  int i = 0;
+  while (__read_byte(kinds, i) != 0) {
+    if (__read_byte(kinds, i) == 'd') {
+      double d = __builtin_va_arg(ap, double);
+      total = total + d * (i + 1);
+    } else {
+      int v = __builtin_va_arg(ap, int);
+      total = total + v * (i + 1);
+    }
+    i++;
+  }
+  return total;
+}
+
+double sum_doubles(int n, __builtin_va_list ap) {
+  double s = 0;
+  for (int i = 0; i < n; i++) { s = s + __builtin_va_arg(ap, double); }
+  return s;
+}
+
+// Reads one int itself and hands the rest of its va_list on
+double scaled_sum(int n, ...) {
+  __builtin_va_list ap;
+  __builtin_va_start(&ap);
+  int scale = __builtin_va_arg(ap, int);
+  return sum_doubles(n, ap) * scale;
+}
+
+int counter() {
+  static int calls;
+  static int step = 3;
+  calls = calls + step;
+  return calls;
+}
+
+int run_ops(int *ops, int n) {
+  void *dispatch[3];
+  dispatch[0] = &&op_add;
+  dispatch[1] = &&op_dbl;
+  dispatch[2] = &&op_done;
+  int acc = 1;
+  int pc = 0;
+  goto *dispatch[ops[pc]];
+op_add:
+  acc = acc + 5;
+  pc++;
+  goto *dispatch[ops[pc]];
+op_dbl:
+  acc = acc * 2;
+  pc++;
+  goto *dispatch[ops[pc]];
+op_done:
+  return acc;
+}
+
+int main() {
+  int pass = 0;
+  int fail = 0;
+  char buf[128];
+
+  // Test 1: variadic arguments beyond the eight argument registers
+  int w = weighted(11, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11);
+  if (w == 506 && weighted(0) == 0 && weighted(2, 7, 0 - 3) == 1) { pass++; }
+  else { printf("FAIL 1: %d\n", w); fail++; }
+
+  // Test 2: two named parameters, then longs, pointers and ints
+  long m = mixed(2, 100, 4294967296, "ok", 7);
+  if (m == 2 * (100 + 42949672960 + 7) && mixed(1, 0, 0, "no", 0) == 0 - 1) { pass++; }
+  else { printf("FAIL 2\n"); fail++; }
+
+  // Test 3: doubles and ints interleaved in one printf-family call
+  int five = 5;
+  int one = 1;
+  double half = five;
+  double eighth = one;
+  half = half / 2;
+  eighth = eighth / 8;
+  sprintf(buf, "%d %.2f %d %.3f %s", 1, half, 3, eighth, "end");
+  if (strcmp(buf, "1 2.50 3 0.125 end") == 0) { pass++; }
+  else { printf("FAIL 3: %s\n", buf); fail++; }
+
+  // Test 4: integer arguments spilling to the stack
+  snprintf(buf, 128, "%d,%d,%d,%d,%d,%d,%d,%d,%d", 1, 2, 3, 4, 5, 6, 7, 8, 9);
+  if (strcmp(buf, "1,2,3,4,5,6,7,8,9") == 0) { pass++; }
+  else { printf("FAIL 4: %s\n", buf); fail++; }
+
+  // Test 5: zero-initialized statics and common storage
+  int bad = 0;
+  for (int i = 0; i < 64; i++) { if (zeroed[i] != 0) { bad++; } zeroed[i] = i; }
+  for (int i = 0; i < 16; i++) { shared_words[i] = zeroed[i * 4]; }
+  zeroed_big[3] = 1099511627776;
+  if (bad == 0 && shared_words[15] == 60 && zeroed_big[3] == 1099511627776 && zeroed_big[0] == 0) { pass++; }
+  else { printf("FAIL 5: %d\n", bad); fail++; }
+
+  // Test 6: static locals and label addresses
+  counter();
+  int ops[4];
+  ops[0] = 0; ops[1] = 1; ops[2] = 0; ops[3] = 2;
+  if (counter() == 6 && run_ops(ops, 4) == 17) { pass++; }
+  else { printf("FAIL 6\n"); fail++; }
+
+  // Test 7: va_arg of doubles and ints interleaved, more of each than
+  // there are argument registers
+  double t = tally("idididididididdddii", 1, 0.5, 2, 1.5, 3, 2.5, 4, 3.5, 5, 4.5, 6, 5.5, 7,
+                   6.5, 7.5, 8.5, 9.5, 8, 9);
+  if (t == 1229) { pass++; }
+  else { printf("FAIL 7: %f\n", t); fail++; }
+
+  // Test 8: a va_list passed on to another function
+  double u = scaled_sum(3, 10, 0.25, 1.5, 2.25);
+  if (u == 40) { pass++; }
+  else { printf("FAIL 8: %f\n", u); fail++; }
+
+  printf("Target ABI tests: %d passed, %d failed\n", pass, fail);
+  if (fail > 0) return 1;
+  return 0;
+}
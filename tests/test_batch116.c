@@ -0,0 +1,154 @@
+// Test batch 116: code that maps badly onto a second instruction set
+// Many-argument calls in both directions between compiled code and the C
+// library, divisions at their edges, shifts by variables, 64-bit constants,
+// narrow loads and stores, and floating-point compares and conversions.
+
+int printf(int *fmt, ...);
+int snprintf(int *buf, long n, int *fmt, ...);
+int strcmp(int *a, int *b);
+
+long sum9(long a, long b, long c, long d, long e, long f, long g, long h, long i) {
+  return a + 2 * b + 3 * c + 4 * d + 5 * e + 6 * f + 7 * g + 8 * h + 9 * i;
+}
+
+long pick7(int a, int b, int c, int d, int e, int f, int g) {
+  return g * 1000 + a;
+}
+
+int by_value(void *pa, void *pb) {
+  long a = *(long *)pa;
+  long b = *(long *)pb;
+  if (a < b) return 0 - 1;
+  if (a > b) return 1;
+  return 0;
+}
+
+void sort_by(long *v, int n, int (*cmp)(void *, void *)) {
+  for (int i = 1; i < n; i++) {
+    long x = v[i];
+    int j = i - 1;
+    while (j >= 0 && cmp(&v[j], &x) > 0) {
+      v[j + 1] = v[j];
+      j--;
+    }
+    v[j + 1] = x;
+  }
+}
+
+// Operands arrive as arguments so the divisions happen at run time; the
+// int forms widen a signed 32-bit result on the way out
+long ldiv_of(long a, long b) { return a / b; }
+long lrem_of(long a, long b) { return a % b; }
+long idiv_of(int a, int b) { return a / b; }
+long irem_of(int a, int b) { return a % b; }
+unsigned long udiv_of(unsigned long a, unsigned long b) { return a / b; }
+unsigned long urem_of(unsigned long a, unsigned long b) { return a % b; }
+
+long shift_mix(long x, long n, long c, long d) {
+  // d is the fourth argument, live across shifts by n
+  return ((x << n) + (x >> c)) ^ d;
+}
+
+// Each compare of a and b as a bit, as values and as branches; every one
+// but != is false when either side is a NaN
+int fcmp_bits(double a, double b) {
+  int r = (a < b) | (a <= b) << 1 | (a > b) << 2 | (a >= b) << 3 | (a == b) << 4 | (a != b) << 5;
+  if (a < b) { r = r | 64; }
+  if (a <= b) { r = r | 128; }
+  if (a == b) { r = r | 256; }
+  if (a != b) { r = r | 512; }
+  if (!(a < b)) { r = r | 1024; }
+  return r;
+}
+
+int main() {
+  int pass = 0;
+  int fail = 0;
+  char buf[128];
+
+  // Test 1: more arguments than registers, to compiled code and to libc
+  long s = sum9(1, 2, 3, 4, 5, 6, 7, 8, 9);
+  snprintf(buf, 128, "%ld %d %d %d %d %d %d %d %s", s, 1, 2, 3, 4, 5, 6, 7, "x");
+  if (s == 285 && pick7(5, 0, 0, 0, 0, 0, 9) == 9005
+      && strcmp(buf, "285 1 2 3 4 5 6 7 x") == 0) { pass++; }
+  else { printf("FAIL 1: %s\n", buf); fail++; }
+
+  // Test 2: calls through a function pointer
+  long vals[6];
+  vals[0] = 42; vals[1] = 0 - 7; vals[2] = 1099511627776; vals[3] = 3; vals[4] = 0; vals[5] = 0 - 1099511627776;
+  sort_by(vals, 6, by_value);
+  if (vals[0] == 0 - 1099511627776 && vals[1] == 0 - 7 && vals[2] == 0 && vals[5] == 1099511627776) { pass++; }
+  else { printf("FAIL 2\n"); fail++; }
+
+  // Test 3: division and remainder at the edges, with operands the
+  // compiler cannot see through
+  long big = 0 - 9223372036854775807 - 1;
+  int imin = 0 - 2147483647 - 1;
+  long q1 = ldiv_of(big, 0 - 1);
+  long q2 = idiv_of(imin, 0 - 1);
+  long r1 = irem_of(0 - 17, 5);
+  long q3 = idiv_of(0 - 100, 7);
+  if (q1 == big && q2 == imin && r1 == 0 - 2 && q3 == 0 - 14
+      && udiv_of(0 - 1, 3) == 6148914691236517205 && urem_of(0 - 1, 10) == 5
+      && lrem_of(big, 0 - 1) == 0) { pass++; }
+  else { printf("FAIL 3: %ld %ld %ld %ld\n", q1, q2, r1, q3); fail++; }
+
+  // Test 4: shifts by variable amounts with other arguments live
+  long sm = shift_mix(5, 3, 1, 1000);
+  int n = 40;
+  long one = 1;
+  unsigned int uw = 4026531840;
+  int sw = 0 - 256;
+  int k = 4;
+  if (sm == ((40 + 2) ^ 1000) && (one << n) == 1099511627776 && (uw >> k) == 251658240
+      && (sw >> k) == 0 - 16) { pass++; }
+  else { printf("FAIL 4: %ld\n", sm); fail++; }
+
+  // Test 5: constants that need more than 32 bits
+  long c1 = 81985529216486895;
+  long c2 = 0 - 81985529216486895;
+  unsigned long c3 = 18364758544493064720u;
+  if (c1 + c2 == 0 && (c1 & 65535) == 52719 && (c3 >> 48) == 65244 && (c3 & 255) == 16) { pass++; }
+  else { printf("FAIL 5\n"); fail++; }
+
+  // Test 6: narrow loads and stores keep their signedness
+  char cb[4];
+  short hb[2];
+  unsigned char ub[2];
+  cb[0] = 100; cb[1] = 27; hb[0] = 0 - 30000; hb[1] = 30000;
+  ub[0] = 250; ub[1] = 5;
+  int csum = cb[0] + cb[1];
+  int hsum = hb[0] + hb[1] + hb[0];
+  int usum = ub[0] + ub[1];
+  if (csum == 127 && hsum == 0 - 30000 && usum == 255) { pass++; }
+  else { printf("FAIL 6: %d %d %d\n", csum, hsum, usum); fail++; }
+
+  // Test 7: floating-point compares and conversions
+  int three = 3;
+  int seven = 7;
+  double a = three;
+  double b = seven;
+  double q = b / a;
+  int tq = (int)(q * 1000);
+  int lt = a < b;
+  int ge = a >= b;
+  int eq = a == a;
+  double neg = 0 - a;
+  int tn = (int)neg;
+  if (tq == 2333 && lt == 1 && ge == 0 && eq == 1 && tn == 0 - 3 && neg < a && !(b <= a)) { pass++; }
+  else { printf("FAIL 7: %d\n", tq); fail++; }
+
+  // Test 8: compares with a NaN are unordered
+  double zero = 0;
+  double nan = zero / zero;
+  int fn1 = fcmp_bits(neg, nan);
+  int fn2 = fcmp_bits(nan, a);
+  int fn3 = fcmp_bits(nan, nan);
+  int fo = fcmp_bits(neg, a);
+  if (fn1 == 1568 && fn2 == 1568 && fn3 == 1568 && fo == 739 && nan != nan && !(nan == nan)) { pass++; }
+  else { printf("FAIL 8: %d %d %d %d\n", fn1, fn2, fn3, fo); fail++; }
+
+  printf("Second target tests: %d passed, %d failed\n", pass, fail);
+  if (fail > 0) return 1;
+  return 0;
+}
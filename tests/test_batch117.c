@@ -0,0 +1,74 @@
+// Test batch 117: names that share spellings, prefixes and namespaces
+// Identifiers that look like keywords, the same name as a struct tag,
+// typedef, field and variable, sibling scopes, pasted names and enum constants
+// that differ only in their last character.
+
+int printf(int *fmt, ...);
+
+#define PASTE(a, b) a##b
+#define FIELD(n) PASTE(f_, n)
+
+struct pt { int x; int y; };
+typedef struct pt pt_t;
+struct node { int node; struct node *next; };
+
+enum { COLOR_A, COLOR_B, COLOR_C, COLOR_AB = 10, COLOR_BA = 20 };
+
+int iff = 3;
+int int_ = 4;
+int format = 5;
+int whiler = 6;
+long returned = 7;
+
+int pt_sum(pt_t p) { return p.x + p.y; }
+
+int FIELD(one)(int v) { return v + 1; }
+
+int count(struct node *n) {
+  int node = 0;
+  while (n) { node = node + n->node; n = n->next; }
+  return node;
+}
+
+int main() {
+  int pass = 0;
+  int fail = 0;
+
+  // Test 1: identifiers whose spelling starts with a keyword
+  int doit = 2;
+  int fortune = 8;
+  int ifx = iff + int_ + format + whiler + doit + fortune;
+  if (ifx == 28 && returned == 7) { pass++; }
+  else { printf("FAIL 1: %d\n", ifx); fail++; }
+
+  // Test 2: one spelling as tag, typedef, field and variable
+  struct pt pt;
+  pt.x = 3; pt.y = 4;
+  pt_t q = pt;
+  struct node c; c.node = 5; c.next = 0;
+  struct node b; b.node = 6; b.next = &c;
+  if (pt_sum(q) == 7 && count(&b) == 11) { pass++; }
+  else { printf("FAIL 2\n"); fail++; }
+
+  // Test 3: the same local name in sibling scopes
+  int total = 0;
+  for (int i = 0; i < 3; i++) { total = total + i; }
+  for (int i = 10; i < 12; i++) { total = total + i; }
+  { int tmp = 100; total = total + tmp; }
+  { int tmp = 1000; total = total + tmp; }
+  if (total == 1124) { pass++; }
+  else { printf("FAIL 3: %d\n", total); fail++; }
+
+  // Test 4: names built by token pasting
+  int f_two = 2;
+  if (FIELD(one)(41) == 42 && FIELD(two) == 2) { pass++; }
+  else { printf("FAIL 4\n"); fail++; }
+
+  // Test 5: enum constants with near-identical names
+  if (COLOR_A == 0 && COLOR_B == 1 && COLOR_C == 2 && COLOR_AB == 10 && COLOR_BA == 20) { pass++; }
+  else { printf("FAIL 5\n"); fail++; }
+
+  printf("Name tests: %d passed, %d failed\n", pass, fail);
+  if (fail > 0) return 1;
+  return 0;
+}
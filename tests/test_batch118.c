@@ -0,0 +1,82 @@
+// Test batch 118: name lookups when one name has several entries
+// Globals declared extern before their definition, locals that hide globals
+// in some functions but not others, struct tags shared with typedefs, and
+// enough enum constants and globals that a linear scan would be noticeable.
+
+int printf(int *fmt, ...);
+
+extern int level;
+extern char tag[8];
+int level = 7;
+char tag[8] = "abc";
+
+struct item { int id; long weight; };
+typedef struct item item;
+typedef int count_t;
+
+#define E4(p) p##0, p##1, p##2, p##3
+#define E16(p) E4(p##0), E4(p##1), E4(p##2), E4(p##3)
+enum { E16(K_A), E16(K_B), E16(K_C), E16(K_D), K_LAST };
+
+#define G4(p) int p##0 = 1; int p##1 = 2; int p##2 = 3; int p##3 = 4;
+#define G16(p) G4(p##0) G4(p##1) G4(p##2) G4(p##3)
+G16(gv_a)
+G16(gv_b)
+
+long scale = 3;
+
+long with_global() { return level * scale; }
+
+long with_local() {
+  long scale = 10;
+  int level = 2;
+  return level * scale;
+}
+
+char first_char() { return tag[0]; }
+
+char local_tag() {
+  char tag[4];
+  tag[0] = 'z';
+  return tag[0];
+}
+
+int sum_items(item *v, count_t n) {
+  int s = 0;
+  for (int i = 0; i < n; i++) { s = s + v[i].id * (int)v[i].weight; }
+  return s;
+}
+
+int main() {
+  int pass = 0;
+  int fail = 0;
+
+  // Test 1: extern declarations followed by definitions
+  if (level == 7 && tag[1] == 'b' && first_char() == 'a') { pass++; }
+  else { printf("FAIL 1\n"); fail++; }
+
+  // Test 2: locals hide globals only inside their own function
+  if (with_global() == 21 && with_local() == 20 && local_tag() == 'z' && first_char() == 'a') { pass++; }
+  else { printf("FAIL 2: %ld %ld\n", with_global(), with_local()); fail++; }
+
+  // Test 3: a struct tag that is also a typedef name
+  struct item a[3];
+  item *p = a;
+  for (int i = 0; i < 3; i++) { p[i].id = i + 1; p[i].weight = 10; }
+  if (sum_items(a, 3) == 60 && sizeof(item) == sizeof(struct item)) { pass++; }
+  else { printf("FAIL 3\n"); fail++; }
+
+  // Test 4: many enum constants
+  if (K_A00 == 0 && K_B00 == 16 && K_C33 == 47 && K_D32 == 62 && K_LAST == 64) { pass++; }
+  else { printf("FAIL 4: %d\n", K_LAST); fail++; }
+
+  // Test 5: many globals with shared prefixes
+  int gs = gv_a00 + gv_a13 + gv_a33 + gv_b02 + gv_b31;
+  gv_b33 = 100;
+  if (gs == 1 + 4 + 4 + 3 + 2 && gv_b33 == 100 && gv_a33 == 4) { pass++; }
+  else { printf("FAIL 5: %d\n", gs); fail++; }
+
+  printf("Name lookup tests: %d passed, %d failed\n", pass, fail);
+  if (fail > 0) return 1;
+  return 0;
+}
@@ -0,0 +1,71 @@
+// Test batch 119: the same expression types asked about in different places
+// Names that are unsigned, long or floating in one function and plain int in
+// the next, indexing of char, short, long and struct-field arrays, and
+// mixed-type subexpressions reused inside larger ones.
+
+int printf(int *fmt, ...);
+
+struct rec { unsigned char tag[4]; short w[2]; long big; };
+
+unsigned int mix_u(unsigned int v) { return (v >> 28) + (v / 3 > 100); }
+
+int mix_i(int v) { return (v >> 28) + (v / 3 > 100); }
+
+long widen(long v) { return v * 65536 * 65536; }
+
+int narrow(int v) { return v * 2; }
+
+int main() {
+  int pass = 0;
+  int fail = 0;
+
+  // Test 1: one spelling, different signedness per function
+  unsigned int big = 4026531840;
+  if (mix_u(big) == 16 && mix_i(0 - 268435456) == 0 - 1) { pass++; }
+  else { printf("FAIL 1: %u %d\n", mix_u(big), mix_i(0 - 268435456)); fail++; }
+
+  // Test 2: long and int results of the same shape
+  if (widen(3) == 12884901888 && narrow(3) == 6) { pass++; }
+  else { printf("FAIL 2\n"); fail++; }
+
+  // Test 3: floating and integer division of the same shape
+  int seven = 7;
+  int two = 2;
+  double d7 = seven;
+  double d2 = two;
+  double q = d7 / d2;
+  int h = (int)(q * 10);
+  if (h == 35 && seven / two == 3) { pass++; }
+  else { printf("FAIL 3: %d\n", h); fail++; }
+
+  // Test 4: loads of different widths and signedness
+  char cs[4];
+  short ss[4];
+  long ls[4];
+  cs[0] = 200; ss[0] = 0 - 5; ls[0] = 1099511627776;
+  int t4 = cs[0] + ss[0];
+  long l4 = ls[0] + ss[0];
+  if (t4 == 195 && l4 == 1099511627771) { pass++; }
+  else { printf("FAIL 4: %d %ld\n", t4, l4); fail++; }
+
+  // Test 5: struct field arrays
+  struct rec r;
+  struct rec *p = &r;
+  p->tag[1] = 255; p->w[1] = 0 - 2; p->big = 0 - 1;
+  int t5 = p->tag[1] + r.w[1];
+  if (t5 == 253 && r.big < 0 && p->big + p->tag[1] == 254) { pass++; }
+  else { printf("FAIL 5: %d\n", t5); fail++; }
+
+  // Test 6: a mixed subexpression reused inside larger ones
+  unsigned int u = 3;
+  long lv = 0 - 1;
+  int i = 0 - 1;
+  long m = lv * 2 + i;
+  unsigned int w = i;
+  if (m == 0 - 3 && w / u == 1431655765 && (lv * u) == 0 - 3) { pass++; }
+  else { printf("FAIL 6\n"); fail++; }
+
+  printf("Expression type tests: %d passed, %d failed\n", pass, fail);
+  if (fail > 0) return 1;
+  return 0;
+}
@@ -0,0 +1,71 @@
+// Test batch 120: field access through struct layouts
+// Wide structs, nested and embedded structs, unions, bitfields, char array
+// fields packed into 8-byte slots, and an initialized global struct array of
+// 8-byte scalars and char arrays.
+
+int printf(int *fmt, ...);
+int strcmp(int *a, int *b);
+
+struct inner { short a; long b; };
+struct wide {
+  int f0; int f1; int f2; int f3; int f4; int f5; int f6; int f7;
+  char name[12];
+  struct inner in;
+  long tail;
+};
+typedef struct wide wide_t;
+
+union num { long l; int i; };
+struct flags { unsigned int lo : 3; unsigned int mid : 5; unsigned int hi : 8; };
+
+struct entry { long id; char label[16]; long weight; };
+struct entry table[3] = { { 1, "one", 10 }, { 2, "two", 20 }, { 3, "a longer label", 30 } };
+
+long sum_wide(wide_t *w) {
+  return w->f0 + w->f3 + w->f7 + w->in.a + w->in.b + w->tail;
+}
+
+int main() {
+  int pass = 0;
+  int fail = 0;
+
+  // Test 1: many fields, through a typedef
+  wide_t w;
+  w.f0 = 1; w.f3 = 4; w.f7 = 8; w.in.a = 0 - 2; w.in.b = 100; w.tail = 1000;
+  if (sum_wide(&w) == 1111 && w.f7 == 8) { pass++; }
+  else { printf("FAIL 1: %ld\n", sum_wide(&w)); fail++; }
+
+  // Test 2: a char array field between scalars
+  w.name[0] = 'h'; w.name[1] = 'i'; w.name[2] = 0; w.name[11] = 'z';
+  if (strcmp(w.name, "hi") == 0 && w.name[11] == 'z' && w.in.b == 100) { pass++; }
+  else { printf("FAIL 2\n"); fail++; }
+
+  // Test 3: unions and bitfields
+  union num u;
+  u.l = 0;
+  u.i = 5;
+  struct flags f;
+  f.lo = 5; f.mid = 17; f.hi = 200;
+  if (u.i == 5 && f.lo == 5 && f.mid == 17 && f.hi == 200) { pass++; }
+  else { printf("FAIL 3: %d %d %d\n", f.lo, f.mid, f.hi); fail++; }
+
+  // Test 4: initialized global struct array with a char array field
+  if (table[2].id == 3 && strcmp(table[2].label, "a longer label") == 0 && table[1].weight == 20
+      && strcmp(table[0].label, "one") == 0) { pass++; }
+  else { printf("FAIL 4: %s %d\n", table[2].label, table[1].weight); fail++; }
+
+  // Test 5: nested fields of struct array elements
+  struct wide ws[2];
+  ws[1].in.b = 77; ws[1].in.a = 3; ws[1].tail = 0; ws[1].f0 = 0; ws[1].f3 = 0; ws[1].f7 = 0;
+  wide_t *pw = &ws[1];
+  if (pw->in.b == 77 && sum_wide(pw) == 80) { pass++; }
+  else { printf("FAIL 5: %ld\n", sum_wide(pw)); fail++; }
+
+  // Test 6: sizes of the same layouts
+  if (sizeof(struct inner) == 16 && sizeof(union num) == 8 && sizeof(struct entry) == 32) { pass++; }
+  else { printf("FAIL 6: %d %d\n", (int)sizeof(struct inner), (int)sizeof(struct entry)); fail++; }
+
+  printf("Struct layout tests: %d passed, %d failed\n", pass, fail);
+  if (fail > 0) return 1;
+  return 0;
+}
@@ -0,0 +1,80 @@
+// Test batch 121: macro expansion corner cases
+// Nested and recursive macros, macros that name themselves directly or through
+// another macro, # and ## operators, variadic macros with an empty tail, a
+// function-like name used without parentheses, a definition in mid-function,
+// and a macro that expands to the name of a function-like macro whose
+// arguments follow it.
+
+int printf(int *fmt, ...);
+int strcmp(int *a, int *b);
+
+int PING = 7;
+int PONG = 5;
+int SELF = 3;
+
+#define TWICE(x) ((x) * 2)
+#define QUAD(x) TWICE(TWICE(x))
+#define ADD(a, b) ((a) + (b))
+
+#define PING PONG + 1
+#define PONG PING + 10
+#define SELF SELF
+
+#define STR(x) #x
+#define XSTR(x) STR(x)
+#define CAT(a, b) a##b
+#define NUM 42
+
+int sum_n(int n, ...) { return n; }
+#define SUM(...) sum_n(0, ## __VA_ARGS__)
+#define COUNT(fmt, ...) sum_n(fmt, ## __VA_ARGS__)
+
+int neg(int v) { return 0 - v; }
+#define neg(v) (v + 1000)
+
+#define PICK ADD
+
+int main() {
+  int pass = 0;
+  int fail = 0;
+
+  // Test 1: nested calls, including a macro inside its own argument
+  if (QUAD(3) == 12 && TWICE(TWICE(1)) == 4 && ADD(TWICE(2), ADD(1, 2)) == 7) { pass++; }
+  else { printf("FAIL 1\n"); fail++; }
+
+  // Test 2: recursion through another macro stops at the original name
+  if (PING == 18 && PONG == 16 && SELF == 3) { pass++; }
+  else { printf("FAIL 2: %d %d\n", PING, PONG); fail++; }
+
+  // Test 3: stringify and token paste
+  int CAT(val, ue) = 9;
+  if (strcmp(STR(a  +  b), "a + b") == 0 && strcmp(XSTR(NUM), "42") == 0 && value == 9
+      && CAT(1, 5) == 15) { pass++; }
+  else { printf("FAIL 3: %s\n", XSTR(NUM)); fail++; }
+
+  // Test 4: empty variadic tails drop the preceding comma
+  if (SUM() == 0 && COUNT(4) == 4 && COUNT(5, 1, 2) == 5) { pass++; }
+  else { printf("FAIL 4\n"); fail++; }
+
+  // Test 5: a function-like name without parentheses is not expanded
+  int (*fp)(int) = neg;
+  if (neg(1) == 1001 && fp(4) == 0 - 4 && (neg)(2) == 0 - 2) { pass++; }
+  else { printf("FAIL 5\n"); fail++; }
+
+  // Test 6: expansion yields a function-like name; the arguments follow
+  if (PICK(2, 3) == 5 && PICK (4, 4) == 8) { pass++; }
+  else { printf("FAIL 6\n"); fail++; }
+
+  // Test 7: a macro applies only after its definition; __LINE__
+  int LATER = 1;
+  int before = LATER;
+#define LATER 2
+  int after = LATER;
+  int line = __LINE__;
+  if (before == 1 && after == 2 && line == 73) { pass++; }
+  else { printf("FAIL 7: %d %d %d\n", before, after, line); fail++; }
+
+  printf("Macro expansion tests: %d passed, %d failed\n", pass, fail);
+  if (fail > 0) return 1;
+  return 0;
+}
@@ -0,0 +1,69 @@
+// Test batch 122: headers included more than once
+// An include guard that is still defined, a guard undefined between two
+// includes, #pragma once, an unguarded list header expanded twice under
+// different macros, a header skipped because its guard is defined first,
+// and system headers pulled in repeatedly.
+
+#include <stdio.h>
+#include "test_batch122_gen.h"
+#include "test_batch122_once.h"
+#include "test_batch122_gen.h"
+#include "test_batch122_once.h"
+#include <stdio.h>
+#define TB122_SKIP_H
+#include "test_batch122_skip.h"
+
+int printf(char *fmt, ...);
+
+#undef TB122_GEN_H
+#define TB122_SECOND
+#include "test_batch122_gen.h"
+#include "test_batch122_once.h"
+
+int main() {
+  int pass = 0;
+  int fail = 0;
+
+  // Test 1: a guarded header is expanded once while its guard is defined
+  struct gen_pair gp;
+  gp.a = 3; gp.b = 4;
+  if (gen_one() == 1 && gp.a + gp.b == 7) { pass++; }
+  else { printf("FAIL 1\n"); fail++; }
+
+  // Test 2: with the guard undefined it is expanded again
+  if (gen_two() == 2) { pass++; }
+  else { printf("FAIL 2\n"); fail++; }
+
+  // Test 3: #pragma once
+  struct once_rec r;
+  r.id = 1; r.size = ONCE_LIMIT;
+  if (once_value == 7 && r.size == 64) { pass++; }
+  else { printf("FAIL 3\n"); fail++; }
+
+  // Test 4: an unguarded header is expanded each time
+#define X(v) + v
+  int s1 = 0
+#include "test_batch122_list.h"
+  ;
+#define X(v) + v * 10
+  int s10 = 0
+#include "test_batch122_list.h"
+  ;
+  if (s1 == 6 && s10 == 60) { pass++; }
+  else { printf("FAIL 4: %d %d\n", s1, s10); fail++; }
+
+  // Test 5: a header whose guard is already defined is skipped; with the
+  // guard undefined it is expanded once, and then skipped again
+  int skip_hits = 0;
+#include "test_batch122_skip.h"
+  int before = skip_hits;
+#undef TB122_SKIP_H
+#include "test_batch122_skip.h"
+#include "test_batch122_skip.h"
+  if (before == 0 && skip_hits == 1) { pass++; }
+  else { printf("FAIL 5: %d %d\n", before, skip_hits); fail++; }
+
+  printf("Header tests: %d passed, %d failed\n", pass, fail);
+  if (fail > 0) return 1;
+  return 0;
+}
@@ -0,0 +1,11 @@
+#ifndef TB122_GEN_H
+#define TB122_GEN_H
+
+#ifdef TB122_SECOND
+int gen_two() { return 2; }
+#else
+int gen_one() { return 1; }
+struct gen_pair { int a; int b; };
+#endif
+
+#endif /* TB122_GEN_H */
@@ -0,0 +1,3 @@
+X(1)
+X(2)
+X(3)
@@ -0,0 +1,6 @@
+// Included several times; only the first one counts
+#pragma once
+
+int once_value = 7;
+struct once_rec { int id; long size; };
+#define ONCE_LIMIT 64
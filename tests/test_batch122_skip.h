@@ -0,0 +1,6 @@
+#ifndef TB122_SKIP_H
+#define TB122_SKIP_H
+// Only expanded inside main, where the test counts expansions; at file
+// scope the test defines the guard first and this line would not compile
+skip_hits++;
+#endif
@@ -0,0 +1,89 @@
+// Test batch 123: data that outlives the function that created it
+// Each function is compiled in memory that is dropped afterwards, so string
+// literals, switch tables and static locals registered along the way must
+// survive until they are emitted after the last function. Also a block with
+// more statements than the parser's first guess.
+
+int printf(int *fmt, ...);
+int strcmp(int *a, int *b);
+
+int *name_of(int k) {
+  switch (k) {
+    case 0: return "zero";
+    case 1: return "one";
+    case 2: return "two";
+    case 3: return "three";
+    case 4: return "four";
+    case 5: return "five";
+    case 6: return "six";
+    default: return "many";
+  }
+}
+
+int score(int k) {
+  switch (k) {
+    case 10: return 1;
+    case 11: return 4;
+    case 12: return 9;
+    case 13: return 16;
+    case 14: return 25;
+    case 15: return 36;
+    case 16: return 49;
+  }
+  return 0 - 1;
+}
+
+int counter() {
+  static int calls = 0;
+  static int seen[4] = {5, 6, 7, 8};
+  calls++;
+  return calls * 100 + seen[calls % 4];
+}
+
+int *greeting() {
+  static int *text = 0;
+  if (text == 0) { text = "hello"; }
+  return text;
+}
+
+#define S1 total = total + 1;
+#define S10 S1 S1 S1 S1 S1 S1 S1 S1 S1 S1
+#define S100 S10 S10 S10 S10 S10 S10 S10 S10 S10 S10
+
+int long_block() {
+  int total = 0;
+  S100 S100 S100 S100 S100 S100 S100
+  return total;
+}
+
+int main() {
+  int pass = 0;
+  int fail = 0;
+
+  // Test 1: string literals from a function compiled earlier
+  if (strcmp(name_of(3), "three") == 0 && strcmp(name_of(9), "many") == 0
+      && strcmp(name_of(0), "zero") == 0) { pass++; }
+  else { printf("FAIL 1: %s\n", name_of(3)); fail++; }
+
+  // Test 2: jump tables emitted after every function
+  if (score(12) == 9 && score(16) == 49 && score(17) == 0 - 1 && score(10) == 1) { pass++; }
+  else { printf("FAIL 2: %d\n", score(12)); fail++; }
+
+  // Test 3: static locals with initializers
+  int a = counter();
+  int b = counter();
+  if (a == 106 && b == 207) { pass++; }
+  else { printf("FAIL 3: %d %d\n", a, b); fail++; }
+
+  // Test 4: a static local pointing at a string literal
+  if (strcmp(greeting(), "hello") == 0 && greeting() == greeting()) { pass++; }
+  else { printf("FAIL 4\n"); fail++; }
+
+  // Test 5: 700 statements in one block
+  if (long_block() == 700) { pass++; }
+  else { printf("FAIL 5: %d\n", long_block()); fail++; }
+
+  printf("Arena tests: %d passed, %d failed\n", pass, fail);
+  if (fail > 0) return 1;
+  return 0;
+}
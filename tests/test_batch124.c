@@ -0,0 +1,93 @@
+// Test batch 124: call argument placement
+// Arguments mixing constants, locals, addresses, string literals, nested
+// calls and side effects, with more than eight of them so some go on the
+// stack, for direct calls, calls through function pointers and struct
+// fields, and variadic calls. Every function here makes an indirect call,
+// so the whole batch also runs through the AST emitter.
+
+int printf(int *fmt, ...);
+int sprintf(int *buf, int *fmt, ...);
+int strcmp(int *a, int *b);
+
+int sum10(int a, int b, int c, int d, int e, int f, int g, int h, int i, int j) {
+  return a + b * 2 + c * 3 + d * 4 + e * 5 + f * 6 + g * 7 + h * 8 + i * 9 + j * 10;
+}
+
+int sub3(int a, int b, int c) { return a - b - c; }
+int twice(int x) { return x * 2; }
+int deref(int *p) { return *p; }
+int first_char(int *s) { return __read_byte(s, 0); }
+
+struct ops { int (*f)(int, int, int, int, int, int, int, int, int, int); int (*g)(int, int, int); };
+
+int counter;
+int next() { counter++; return counter; }
+int bump(int *p) { *p = *p + 1; return *p; }
+
+int test_direct(int (*fp)(int)) {
+  int x = 3;
+  int y = 40;
+  int arr[2];
+  arr[0] = 7;
+  arr[1] = 9;
+  int a = sum10(1, x, twice(y), 4, x + y, fp(5), 7, y, twice(x), 10);
+  int b = sub3(twice(x), x, 1);
+  int c = deref(&x) + deref(arr) + first_char("Q");
+  return a * 1000 + b * 100 + c;
+}
+
+int test_indirect() {
+  int (*f)(int, int, int, int, int, int, int, int, int, int) = sum10;
+  struct ops o;
+  o.f = sum10;
+  o.g = sub3;
+  int k = 2;
+  int a = f(k, 2, 3, 4, 5, 6, 7, 8, twice(k), 10);
+  int b = o.f(1, 2, 3, 4, 5, 6, 7, 8, 9, o.g(20, k, 3));
+  int c = o.g(o.g(10, 1, 1), twice(k), k);
+  return a * 100000 + b * 10 + c;
+}
+
+int test_order(int (*fp)(int)) {
+  counter = 0;
+  int i = 0;
+  // Arguments are evaluated left to right, so reads of i and counter see
+  // what the calls before them did
+  int a = sum10(next(), next(), bump(&i), i, next(), bump(&i), fp(i), i, counter, next());
+  return a;
+}
+
+int test_variadic(int (*fp)(int)) {
+  int buf[16];
+  int x = 5;
+  sprintf(buf, "%d %d %d %s %d %d %d %d %d %d", 1, x, fp(x), "s", x + 1, 6, 7, 8, 9, fp(fp(1)));
+  return strcmp(buf, "1 5 10 s 6 6 7 8 9 4");
+}
+
+int main() {
+  int pass = 0;
+  int fail = 0;
+
+  // Test 1: direct calls with leaves, nested calls and stack arguments
+  int r1 = test_direct(twice);
+  if (r1 == 1061 * 1000 + 200 + 3 + 7 + 81) { pass++; }
+  else { printf("FAIL 1: %d\n", r1); fail++; }
+
+  // Test 2: calls through a pointer and through struct fields
+  int r2 = test_indirect();
+  if (r2 == 341 * 100000 + 435 * 10 + 2) { pass++; }
+  else { printf("FAIL 2: %d\n", r2); fail++; }
+
+  // Test 3: evaluation order
+  int r3 = test_order(twice);
+  if (r3 == 1 + 2 * 2 + 1 * 3 + 1 * 4 + 3 * 5 + 2 * 6 + 4 * 7 + 2 * 8 + 3 * 9 + 4 * 10) { pass++; }
+  else { printf("FAIL 3: %d\n", r3); fail++; }
+
+  // Test 4: variadic call with stack-passed arguments
+  if (test_variadic(twice) == 0) { pass++; }
+  else { printf("FAIL 4\n"); fail++; }
+
+  printf("Call argument tests: %d passed, %d failed\n", pass, fail);
+  if (fail > 0) return 1;
+  return 0;
+}
@@ -1,26 +1,57 @@
 /* test_batch41: va_list / va_start / va_arg */
+#include <stdarg.h>
+
 int printf(char *fmt, ...);
+int vsnprintf(char *buf, long n, char *fmt, va_list ap);
+int strcmp(char *a, char *b);
 
 int sum_ints(int count, ...) {
-    char *ap;
-    __builtin_va_start(&ap);
+    va_list ap;
+    va_start(ap, count);
     int total = 0;
     int i = 0;
     while (i < count) {
-        total = total + *(int*)((ap = ap + 8) - 8);
+        total = total + va_arg(ap, int);
         i = i + 1;
     }
+    va_end(ap);
     return total;
 }
 
 /* Test va_arg with pointer type */
 char *first_str(int dummy, ...) {
-    char *ap;
-    __builtin_va_start(&ap);
-    char *s = *(char**)((ap = ap + 8) - 8);
+    va_list ap;
+    va_start(ap, dummy);
+    char *s = va_arg(ap, char *);
+    va_end(ap);
     return s;
 }
 
+/* Integer and floating arguments interleaved, more than fit in registers */
+double mixed(int count, ...) {
+    va_list ap;
+    va_start(ap, count);
+    double total = 0;
+    int i = 0;
+    while (i < count) {
+        long n = va_arg(ap, long);
+        double d = va_arg(ap, double);
+        total = total + n * d;
+        i = i + 1;
+    }
+    va_end(ap);
+    return total;
+}
+
+/* Hand the va_list on to the C library */
+int format(char *buf, char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, 100, fmt, ap);
+    va_end(ap);
+    return n;
+}
+
 int main() {
     int fail = 0;
 
@@ -33,9 +64,19 @@ int main() {
     int s3 = sum_ints(0);
     if (s3 != 0) { printf("FAIL: sum_ints(0) = %d\n", s3); fail = 1; }
 
+    int s4 = sum_ints(10, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10);
+    if (s4 != 55) { printf("FAIL: sum_ints(10, 1..10) = %d\n", s4); fail = 1; }
+
     char *r = first_str(0, "hello");
     if (r == 0) { printf("FAIL: first_str returned NULL\n"); fail = 1; }
 
+    double m = mixed(5, 1, 0.5, 2, 1.5, 3, 2.5, 4, 3.5, 5, 4.5);
+    if (m != 47.5) { printf("FAIL: mixed = %d\n", (int)m); fail = 1; }
+
+    char buf[100];
+    format(buf, "%d %s %.2f %ld %d %d %d %.1f", 7, "ab", 2.25, 1099511627776, 1, 2, 3, 0.5);
+    if (strcmp(buf, "7 ab 2.25 1099511627776 1 2 3 0.5") != 0) { printf("FAIL: format gave '%s'\n", buf); fail = 1; }
+
     if (!fail) printf("batch41: all tests passed\n");
     return fail;
 }